@@ -180,15 +180,15 @@ void AbnfParser::require( const EString & s )
 
 EString AbnfParser::digits( uint min, uint max )
 {
-    EString r;
+    uint start = d->at;
     uint i = 0;
     char c = nextChar();
     while ( i < max && c >= '0' && c <= '9' ) {
         step();
-        r.append( c );
         c = nextChar();
         i++;
     }
+    EString r = str.mid( start, i );
     if ( i < min )
         setError( "Expected at least " + fn( min-i ) + " more digits, "
                   "but saw: " + following() );
@@ -203,17 +203,17 @@ EString AbnfParser::digits( uint min, uint max )
 
 EString AbnfParser::letters( uint min, uint max )
 {
-    EString r;
+    uint start = d->at;
     uint i = 0;
     char c = nextChar();
     while ( i < max &&
             ( ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) ) )
     {
         step();
-        r.append( c );
         c = nextChar();
         i++;
     }
+    EString r = str.mid( start, i );
     if ( i < min )
         setError( "Expected at least " + fn( min-i ) + " more letters, "
                   "but saw: " + following() );
@@ -229,23 +229,30 @@ EString AbnfParser::letters( uint min, uint max )
 
 uint AbnfParser::number()
 {
-    EString s;
+    uint start = d->at;
     char c = nextChar();
 
     bool zero = false;
     if ( c == '0' )
         zero = true;
 
+    bool ok = true;
+    uint u = 0;
     while ( c >= '0' && c <= '9' ) {
-        s.append( c );
+        if ( u > ( UINT_MAX - ( c - '0' ) ) / 10 )
+            ok = false;
+        u = u * 10 + c - '0';
         step();
         c = nextChar();
     }
 
-    bool ok = true;
-    uint u = s.number( &ok );
-    if ( !ok )
-        setError( "Expected a number, but saw: " + s + following() );
+    if ( d->at == start )
+        ok = false;
+    if ( !ok ) {
+        u = 0;
+        setError( "Expected a number, but saw: " +
+                  str.mid( start, d->at - start ) + following() );
+    }
     else if ( u > 0 && zero )
         setError( "Zero used as leading digit" );
 
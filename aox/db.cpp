@@ -11,6 +11,10 @@
 #include "recipient.h"
 #include "transaction.h"
 #include "configuration.h"
+#include "ustringlist.h"
+#include "wordindex.h"
+#include "message.h"
+#include "bodypart.h"
 
 #include <stdio.h>
 
@@ -97,14 +101,21 @@ void ShowSchema::execute()
 
 static AoxFactory<UpgradeSchema>
 f2( "upgrade", "schema", "Upgrade the database schema.",
-    "    Synopsis: aox upgrade schema [-n]\n\n"
+    "    Synopsis: aox upgrade schema [-n] [-o]\n\n"
     "    Checks that the database schema is one that this version of\n"
     "    Archiveopteryx is compatible with, and updates it if needed.\n"
     "\n"
     "    The -n flag causes aox to perform the SQL statements for the\n"
     "    schema upgrade and report on their status without COMMITting\n"
     "    the transaction (i.e. see what the upgrade would do, without\n"
-    "    changing anything).\n" );
+    "    changing anything).\n"
+    "\n"
+    "    The -o flag upgrades online, while the old servers are still\n"
+    "    running: the upgrade gives up rather than wait more than ten\n"
+    "    seconds for a lock, new indexes are built concurrently after\n"
+    "    the upgrade has committed, and large updates are left for\n"
+    "    the new servers to apply in the background. If the index\n"
+    "    builds are interrupted, run the command again to finish.\n" );
 
 
 /*! \class UpgradeSchema schema.h
@@ -126,9 +137,10 @@ void UpgradeSchema::execute()
         bool commit = true;
         if ( opt( 'n' ) > 0 )
             commit = false;
+        bool online = opt( 'o' ) > 0;
 
         database( true );
-        Schema * s = new Schema( this, true, commit );
+        Schema * s = new Schema( this, true, commit, online );
         q = s->result();
         s->execute();
     }
@@ -145,7 +157,12 @@ f3( "vacuum", "", "Perform routine maintenance.",
     "    Synopsis: aox vacuum\n\n"
     "    Permanently deletes messages that were marked for deletion\n"
     "    more than a certain number of days ago (cf. undelete-time)\n"
-    "    and removes any bodyparts that are no longer used.\n\n"
+    "    and removes any bodyparts and raw message texts that are no\n"
+    "    longer used.\n\n"
+    "    Unless maintenance-rate is 0, the server already deletes old\n"
+    "    deliveries, applies retention policies and empties deleted\n"
+    "    mailboxes in the background, so this command does little of\n"
+    "    that work.\n\n"
     "    This is not a replacement for running VACUUM ANALYSE on the\n"
     "    database (either with vaccumdb or via autovacuum).\n\n"
     "    This command should be run (we suggest daily) via crontab.\n" );
@@ -230,6 +247,19 @@ void Vacuum::execute()
                     if (!q->done())
                         return;
                 } while (q->rows());
+                qstate = 5;
+                log( "vacuum: delete from raw_messages", Log::Significant );
+                do {
+                    q = new Query( "delete from raw_messages where id in "
+                                   "(select id from raw_messages r"
+                                   " left join message_raws mr on "
+                                   "(r.id=mr.raw) where mr.raw is null"
+                                   " limit " MSGBLOCKCOUNT ")", this );
+                    q->execute();
+            case 5:
+                    if (!q->done())
+                        return;
+                } while (q->rows());
         }
 
         t = new Transaction( this );
@@ -353,6 +383,36 @@ void Vacuum::execute()
             t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
         }
 
+        // messages in deleted mailboxes go the same way. nothing
+        // else can use those mailboxes, so they're easier.
+        t->enqueue( new Query( "create temporary table e ("
+                               "mailbox integer, "
+                               "uid integer )", 0 ) );
+        t->enqueue( new Query( "insert into e (mailbox,uid) "
+                               "select mm.mailbox, mm.uid "
+                               "from mailbox_messages mm "
+                               "join mailboxes mb on (mm.mailbox=mb.id) "
+                               "where mb.deleted", 0 ) );
+        t->enqueue( new Query( "select nextmodseq from mailboxes "
+                               "where id in (select mailbox from e) "
+                               "order by id "
+                               "for update", 0 ) );
+        t->enqueue( new Query( "insert into deleted_messages "
+                               "(mailbox, uid, message,"
+                               " modseq, deleted_by, reason) "
+                               "select e.mailbox, e.uid, mm.message,"
+                               " m.nextmodseq, null, 'Mailbox deleted' "
+                               "from e "
+                               "join mailbox_messages mm"
+                               " using (mailbox,uid) "
+                               "join mailboxes m on (e.mailbox=m.id)",
+                               0 ) );
+        t->enqueue( new Query( "update mailboxes "
+                               "set nextmodseq=nextmodseq+1 "
+                               "where id in (select mailbox from e)",
+                               0 ) );
+        t->enqueue( new Query( "drop table e", 0 ) );
+
         t->commit();
     }
 
@@ -463,6 +523,10 @@ struct TunableIndex {
       "CREATE INDEX dm_mm ON deleted_messages "
       "USING btree (mailbox, modseq)",
       false, true, true },
+    { "mm_mm", "mailbox_messages",
+      "CREATE INDEX mm_mm ON mailbox_messages "
+      "USING btree (mailbox, modseq)",
+      false, true, true },
     { "b_text", "bodyparts",
       "CREATE INDEX b_text ON bodyparts "
       "USING gin (to_tsvector('simple'::regconfig, text)) "
@@ -477,24 +541,65 @@ struct TunableIndex {
 };
 
 
+// indexes that aren't used by any mode, but that "aox tune database
+// advise" proposes when the slow queries contain the pattern
+struct AdvisableIndex {
+    const char * name;
+    const char * table;
+    const char * definition;
+    const char * pattern;
+    const char * reason;
+    bool trigrams;
+} advisableIndices[] = {
+    { "a_llp", "addresses",
+      "CREATE INDEX CONCURRENTLY a_llp ON addresses "
+      "USING btree (lower(localpart))",
+      "localpart)", "searches for address localparts", false },
+    { "a_ld", "addresses",
+      "CREATE INDEX CONCURRENTLY a_ld ON addresses "
+      "USING btree (lower(domain))",
+      "domain)", "searches for address domains", false },
+    { "hf_trgm", "header_fields",
+      "CREATE INDEX CONCURRENTLY hf_trgm ON header_fields "
+      "USING gin (value gin_trgm_ops)",
+      "value ilike", "substring searches in header fields", true },
+    { "m_idate", "messages",
+      "CREATE INDEX CONCURRENTLY m_idate ON messages "
+      "USING btree (idate)",
+      ".idate", "searches and sorting by internal date", false },
+    { 0, 0, 0, 0, 0, false }
+};
+
+
 class TuneDatabaseData
     : public Garbage
 {
 public:
-    TuneDatabaseData(): mode( Reading ), t( 0 ), find( 0 ), set( false ) {}
+    TuneDatabaseData()
+        : mode( Reading ), t( 0 ), find( 0 ), set( false ),
+          tables( 0 ), shapes( 0 ), trigrams( 0 ), create( 0 )
+    {}
     enum Mode {
-        Writing, Reading, Advanced
+        Writing, Reading, Advanced, Advise
     };
     Mode mode;
     Transaction * t;
     Query * find;
     bool set;
+
+    // used only by advise()
+    Query * tables;
+    Query * shapes;
+    Query * trigrams;
+    EStringList proposals;
+    Query * create;
 };
 
 
 static AoxFactory<TuneDatabase>
 f5( "tune", "database", "Adds or removes indices.",
-    "    Synopsis: aox tune database <mode>\n\n"
+    "    Synopsis: aox tune database <mode>\n"
+    "              aox tune database [-c] advise\n\n"
     "    There are three modes: mostly-writing, mostly-reading and\n"
     "    advanced-reading.\n"
     "    Mode mostly-writing tunes the database for fast message\n"
@@ -502,7 +607,14 @@ f5( "tune", "database", "Adds or removes indices.",
     "    Mode mostly-reading tunes the database for message reading,\n"
     "    but without full-text indexing.\n"
     "    Mode advanced-reading tunes the database for fast message\n"
-    "    searching and reading, at the cost of injection speed.\n" );
+    "    searching and reading, at the cost of injection speed.\n\n"
+    "    advise looks at the workload instead: It lists the query\n"
+    "    shapes that have taken the most time (if the\n"
+    "    pg_stat_statements extension is installed) and the large\n"
+    "    tables read mostly by sequential scans, and proposes indexes\n"
+    "    that would help. With -c, it also creates them, using\n"
+    "    create index concurrently, so that the servers can keep\n"
+    "    running meanwhile.\n" );
 
 /*! \class TuneDatabase db.h
     This class handles the "aox tune database" command.
@@ -517,6 +629,11 @@ TuneDatabase::TuneDatabase( EStringList * args )
 
 void TuneDatabase::execute()
 {
+    if ( d->mode == TuneDatabaseData::Advise ) {
+        advise();
+        return;
+    }
+
     if ( !d->t ) {
         parseOptions();
         EString mode = next().lower();
@@ -526,12 +643,20 @@ void TuneDatabase::execute()
             d->mode = TuneDatabaseData::Reading;
         else if ( mode == "advanced-reading" )
             d->mode = TuneDatabaseData::Advanced;
+        else if ( mode == "advise" )
+            d->mode = TuneDatabaseData::Advise;
         else
             error( "Unknown database mode.\n"
-                   "Supported: mostly-writing, mostly-reading and "
-                   "advanced-reading" );
+                   "Supported: mostly-writing, mostly-reading, "
+                   "advanced-reading and advise" );
+        end();
         database( true );
 
+        if ( d->mode == TuneDatabaseData::Advise ) {
+            advise();
+            return;
+        }
+
         d->t = new Transaction( this );
 
         EStringList indexnames;
@@ -581,6 +706,8 @@ void TuneDatabase::execute()
             case TuneDatabaseData::Advanced:
                 wanted = tunableIndices[i].advanced;
                 break;
+            case TuneDatabaseData::Advise:
+                break;
             }
             Query * q = 0;
             if ( wanted && !present.find( tunableIndices[i].name ) ) {
@@ -616,6 +743,192 @@ void TuneDatabase::execute()
 }
 
 
+/*! Looks at the statistics PostgreSQL keeps about the workload, and
+    proposes indexes that would help: Those in advisableIndices whose
+    pattern occurs in one of the slowest query shapes recorded by
+    pg_stat_statements, and both those and the tunableIndices on
+    tables that are large and read mostly by sequential scans. With
+    -c, the proposed indexes are also created, one at a time and
+    concurrently.
+
+    This is the database's view of what the "query-time-" statistics
+    (see Postgres::countQueries()) show for a single server, covering
+    all the servers and surviving restarts.
+*/
+
+void TuneDatabase::advise()
+{
+    if ( !d->find ) {
+        EString schema( Configuration::text( Configuration::DbSchema ) );
+        d->find = new Query( "select indexname::text from pg_indexes "
+                             "where schemaname=$1", this );
+        d->find->bind( 1, schema );
+        d->find->execute();
+
+        d->tables = new Query( "select relname::text, n_live_tup, "
+                               "seq_scan, seq_tup_read, "
+                               "coalesce(idx_scan,0) as idx_scan "
+                               "from pg_stat_user_tables "
+                               "where schemaname=$1 and n_live_tup>=10000 "
+                               "and seq_scan>coalesce(idx_scan,0) "
+                               "order by seq_tup_read desc", this );
+        d->tables->bind( 1, schema );
+        d->tables->execute();
+
+        d->trigrams = new Query( "select extname from pg_extension "
+                                 "where extname='pg_trgm'", this );
+        d->trigrams->execute();
+    }
+
+    if ( !d->find->done() )
+        return;
+
+    if ( !d->shapes ) {
+        // the column names changed in 13
+        EString total( "total_time" );
+        if ( Postgres::version() >= 130000 )
+            total = "total_exec_time";
+        d->shapes = new Query( "select query, calls, " + total +
+                               "::bigint as total, "
+                               "(" + total + "/calls)::bigint as mean "
+                               "from pg_stat_statements "
+                               "where dbid=(select oid from pg_database "
+                               "where datname=current_database()) "
+                               "and calls>0 "
+                               "order by " + total + " desc limit 20",
+                               this );
+        d->shapes->allowFailure();
+        d->shapes->execute();
+    }
+
+    if ( !d->tables->done() || !d->shapes->done() ||
+         !d->trigrams->done() )
+        return;
+
+    if ( d->find->failed() || d->tables->failed() )
+        error( "Cannot read database statistics" );
+
+    if ( !d->set ) {
+        d->set = true;
+
+        EStringList present;
+        while ( d->find->hasResults() )
+            present.append( d->find->nextRow()->getEString( "indexname" ) );
+
+        EStringList shapes;
+        if ( d->shapes->failed() ) {
+            printf( "pg_stat_statements is not available, so only table "
+                    "statistics are used.\n" );
+        }
+        else {
+            printf( "Slowest query shapes (total ms, calls, mean ms):\n" );
+            while ( d->shapes->hasResults() ) {
+                Row * r = d->shapes->nextRow();
+                EString q( r->getEString( "query" ).simplified() );
+                shapes.append( q.lower() );
+                if ( q.length() > 120 )
+                    q = q.mid( 0, 117 ) + "...";
+                printf( "%10s %8s %6s  %s\n",
+                        fn( r->getBigint( "total" ) ).cstr(),
+                        fn( r->getBigint( "calls" ) ).cstr(),
+                        fn( r->getBigint( "mean" ) ).cstr(), q.cstr() );
+            }
+            printf( "\n" );
+        }
+
+        EStringList scanned;
+        if ( d->tables->hasResults() )
+            printf( "Large tables read mostly by sequential scans:\n" );
+        while ( d->tables->hasResults() ) {
+            Row * r = d->tables->nextRow();
+            EString t( r->getEString( "relname" ) );
+            scanned.append( t );
+            printf( "    %s: %s rows, %s sequential scans reading %s rows, "
+                    "%s index scans\n", t.cstr(),
+                    fn( r->getBigint( "n_live_tup" ) ).cstr(),
+                    fn( r->getBigint( "seq_scan" ) ).cstr(),
+                    fn( r->getBigint( "seq_tup_read" ) ).cstr(),
+                    fn( r->getBigint( "idx_scan" ) ).cstr() );
+        }
+        if ( !scanned.isEmpty() )
+            printf( "\n" );
+
+        bool trigrams = d->trigrams->hasResults();
+        uint i = 0;
+        while ( advisableIndices[i].name ) {
+            const AdvisableIndex & a = advisableIndices[i];
+            i++;
+            if ( present.contains( a.name ) )
+                continue;
+            EString why;
+            EStringList::Iterator s( shapes );
+            while ( s && !s->contains( a.pattern ) )
+                ++s;
+            if ( s )
+                why = a.reason;
+            else if ( scanned.contains( a.table ) )
+                why = EString( "sequential scans of " ) + a.table;
+            else
+                continue;
+            if ( a.trigrams && !trigrams ) {
+                printf( "Would propose %s for %s, but the pg_trgm "
+                        "extension is not installed.\n",
+                        a.name, why.cstr() );
+                continue;
+            }
+            printf( "Proposed for %s:\n    %s;\n",
+                    why.cstr(), a.definition );
+            d->proposals.append( a.definition );
+        }
+
+        i = 0;
+        while ( tunableIndices[i].name ) {
+            const TunableIndex & t = tunableIndices[i];
+            i++;
+            if ( present.contains( t.name ) || !t.reading ||
+                 !scanned.contains( t.table ) )
+                continue;
+            EString def( t.definition );
+            def.replace( "CREATE INDEX ", "CREATE INDEX CONCURRENTLY " );
+            printf( "Proposed for sequential scans of %s:\n    %s;\n",
+                    t.table, def.cstr() );
+            d->proposals.append( def );
+        }
+
+        if ( d->proposals.isEmpty() )
+            printf( "No indexes to propose.\n" );
+        else if ( !opt( 'c' ) )
+            printf( "Use 'aox tune database -c advise' to create "
+                    "these indexes.\n" );
+        else
+            printf( "\n" );
+
+        if ( !opt( 'c' ) )
+            d->proposals.clear();
+        else if ( !d->proposals.isEmpty() )
+            d->proposals.append( "notify database_retuned" );
+    }
+
+    if ( d->create && !d->create->done() )
+        return;
+    if ( d->create && d->create->failed() )
+        error( "Couldn't create index: " + d->create->error() );
+
+    if ( d->proposals.isEmpty() ) {
+        finish();
+        return;
+    }
+
+    // create index concurrently can't be run in a transaction, and
+    // one at a time is gentler to the running servers
+    EString q( *d->proposals.shift() );
+    if ( q.startsWith( "CREATE" ) )
+        printf( "Executing %s;\n", q.cstr() );
+    d->create = new Query( q, this );
+    d->create->execute();
+}
+
+
 static AoxFactory<CheckDatabase>
 f6( "check", "database", "Check database contents.",
     "    Synopsis: aox check database\n\n"
@@ -773,3 +1086,287 @@ void CheckDatabase::scream( class Query * q )
     error( "Unexpected row in the database. Contact info@aox.org. "
            "Query: " + q->string() + " Result row: " + rowSummary( q ) );
 }
+
+
+static AoxFactory<IndexWords>
+f7( "index", "words", "Add old bodyparts to the word index.",
+    "    Synopsis: aox index words\n\n"
+    "    Records the words of every text bodypart that isn't already\n"
+    "    in the word index (see use-word-index in\n"
+    "    archiveopteryx.conf(5)). This is needed once, after enabling\n"
+    "    the word index on a database that already contains mail.\n"
+    "    The work is done and committed a thousand bodyparts at a\n"
+    "    time, so the command can be interrupted and started again.\n" );
+
+
+/*! \class IndexWords db.h
+    This class handles the "aox index words" command.
+
+    It pages through bodyparts in id order, and for each one that has
+    text but no entries in bodypart_words, records its words as the
+    Injector would.
+*/
+
+IndexWords::IndexWords( EStringList * args )
+    : AoxCommand( args ), t( 0 ), q( 0 ), last( 0 ), indexed( 0 ),
+      committing( false ), more( true )
+{
+}
+
+
+void IndexWords::execute()
+{
+    if ( !t ) {
+        parseOptions();
+        end();
+        database( true );
+    }
+    else if ( !q->done() ) {
+        return;
+    }
+    else if ( !committing ) {
+        if ( q->failed() )
+            error( "Couldn't read bodyparts: " + q->error() );
+        Query * copy = new Query( "copy bodypart_words (bodypart,word) "
+                                  "from stdin with binary", 0 );
+        uint words = 0;
+        more = false;
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            last = r->getInt( "id" );
+            more = true;
+            if ( r->getBoolean( "indexed" ) )
+                continue;
+            UStringList::Iterator w(
+                WordIndex::words( r->getUString( "text" ) ) );
+            while ( w ) {
+                copy->bind( 1, last );
+                copy->bind( 2, *w );
+                copy->submitLine();
+                words++;
+                ++w;
+            }
+            indexed++;
+        }
+        if ( words )
+            t->enqueue( copy );
+        committing = true;
+        t->commit();
+        return;
+    }
+    else if ( !t->done() ) {
+        return;
+    }
+    else {
+        if ( t->failed() )
+            error( "Couldn't index words: " + t->error() );
+        if ( !more ) {
+            printf( "Indexed %d bodyparts\n", indexed );
+            finish();
+            return;
+        }
+        if ( indexed )
+            printf( "Indexed %d bodyparts so far\n", indexed );
+    }
+
+    committing = false;
+    t = new Transaction( this );
+    q = new Query( "select b.id, b.text, exists "
+                   "(select 1 from bodypart_words w where w.bodypart=b.id) "
+                   "as indexed "
+                   "from bodyparts b "
+                   "where b.id>$1 and b.text is not null "
+                   "order by b.id limit " MSGBLOCKCOUNT, this );
+    q->bind( 1, last );
+    t->enqueue( q );
+    t->execute();
+}
+
+
+static AoxFactory<UpdatePreviews>
+f8( "update", "previews", "Compute previews of old messages.",
+    "    Synopsis: aox update previews\n\n"
+    "    Computes the RFC 8970 preview of every message that doesn't\n"
+    "    have one yet, i.e. of messages injected before the previews\n"
+    "    were introduced. A message's preview is made from the text of\n"
+    "    its first text bodypart. The work is done and committed a\n"
+    "    thousand messages at a time, so the command can be\n"
+    "    interrupted and started again.\n" );
+
+
+/*! \class UpdatePreviews db.h
+    This class handles the "aox update previews" command.
+
+    It pages through messages in id order, and stores a preview for
+    each one that has none. The Injector looks at the content types
+    to pick a part. This only looks at the stored text, which for HTML
+    is already converted to plain text.
+*/
+
+UpdatePreviews::UpdatePreviews( EStringList * args )
+    : AoxCommand( args ), t( 0 ), q( 0 ), last( 0 ), made( 0 ),
+      committing( false ), more( true )
+{
+}
+
+
+void UpdatePreviews::execute()
+{
+    if ( !t ) {
+        parseOptions();
+        end();
+        database( true );
+    }
+    else if ( !q->done() ) {
+        return;
+    }
+    else if ( !committing ) {
+        if ( q->failed() )
+            error( "Couldn't read messages: " + q->error() );
+        Query * copy = new Query( "copy message_previews (message,preview) "
+                                  "from stdin with binary", 0 );
+        uint n = 0;
+        more = false;
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            last = r->getInt( "id" );
+            more = true;
+            if ( r->getBoolean( "done" ) )
+                continue;
+            copy->bind( 1, last );
+            if ( r->isNull( "text" ) )
+                copy->bind( 2, UString() );
+            else
+                copy->bind( 2, Message::preview( r->getUString( "text" ) ) );
+            copy->submitLine();
+            n++;
+        }
+        if ( n )
+            t->enqueue( copy );
+        made += n;
+        committing = true;
+        t->commit();
+        return;
+    }
+    else if ( !t->done() ) {
+        return;
+    }
+    else {
+        if ( t->failed() )
+            error( "Couldn't store previews: " + t->error() );
+        if ( !more ) {
+            printf( "Computed %d previews\n", made );
+            finish();
+            return;
+        }
+        if ( made )
+            printf( "Computed %d previews so far\n", made );
+    }
+
+    committing = false;
+    t = new Transaction( this );
+    q = new Query( "select m.id, "
+                   "(select bp.text from part_numbers pn "
+                   "join bodyparts bp on (pn.bodypart=bp.id) "
+                   "where pn.message=m.id and bp.text is not null "
+                   "order by pn.part limit 1) as text, "
+                   "exists (select 1 from message_previews p "
+                   "where p.message=m.id) as done "
+                   "from messages m "
+                   "where m.id>$1 "
+                   "order by m.id limit " MSGBLOCKCOUNT, this );
+    q->bind( 1, last );
+    t->enqueue( q );
+    t->execute();
+}
+
+
+static AoxFactory<CompressBodyparts>
+f9( "compress", "bodyparts", "Compress old bodyparts.",
+    "    Synopsis: aox compress bodyparts\n\n"
+    "    Compresses the data of every bodypart that was stored before\n"
+    "    compress-bodyparts was enabled (see archiveopteryx.conf(5)),\n"
+    "    if doing so saves enough space. The work is done and committed\n"
+    "    a hundred bodyparts at a time, so the command can be\n"
+    "    interrupted and started again, and can run while the servers\n"
+    "    are running.\n" );
+
+
+/*! \class CompressBodyparts db.h
+    This class handles the "aox compress bodyparts" command.
+
+    It pages through bodyparts in id order, and replaces the data of
+    each uncompressed one with what the Injector would store today.
+*/
+
+CompressBodyparts::CompressBodyparts( EStringList * args )
+    : AoxCommand( args ), t( 0 ), q( 0 ), last( 0 ), compressed( 0 ),
+      saved( 0 ), committing( false ), more( true )
+{
+}
+
+
+void CompressBodyparts::execute()
+{
+    if ( !t ) {
+        parseOptions();
+        end();
+        if ( !Configuration::toggle( Configuration::CompressBodyparts ) )
+            error( "compress-bodyparts is not enabled" );
+        database( true );
+    }
+    else if ( !q->done() ) {
+        return;
+    }
+    else if ( !committing ) {
+        if ( q->failed() )
+            error( "Couldn't read bodyparts: " + q->error() );
+        more = false;
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            last = r->getInt( "id" );
+            more = true;
+            EString data = r->getEString( "data" );
+            EString c = Bodypart::compressed( data );
+            if ( c.isEmpty() )
+                continue;
+            Query * u = new Query( "update bodyparts "
+                                   "set data=$1, compressed=true "
+                                   "where id=$2", 0 );
+            u->bind( 1, c, Query::Binary );
+            u->bind( 2, last );
+            t->enqueue( u );
+            compressed++;
+            saved += data.length() - c.length();
+        }
+        committing = true;
+        t->commit();
+        return;
+    }
+    else if ( !t->done() ) {
+        return;
+    }
+    else {
+        if ( t->failed() )
+            error( "Couldn't compress bodyparts: " + t->error() );
+        if ( !more ) {
+            printf( "Compressed %d bodyparts, saving %s\n",
+                    compressed, EString::humanNumber( saved ).cstr() );
+            finish();
+            return;
+        }
+        if ( compressed )
+            printf( "Compressed %d bodyparts so far\n", compressed );
+    }
+
+    committing = false;
+    t = new Transaction( this );
+    // bodyparts may be large, so we read fewer at a time than
+    // IndexWords does
+    q = new Query( "select id, data from bodyparts "
+                   "where id>$1 and data is not null and not compressed "
+                   "order by id limit 100", this );
+    q->bind( 1, last );
+    t->enqueue( q );
+    t->execute();
+}
@@ -68,6 +68,8 @@ public:
 
 private:
     class TuneDatabaseData * d;
+
+    void advise();
 };
 
 
@@ -85,4 +87,56 @@ private:
 };
 
 
+class IndexWords
+    : public AoxCommand
+{
+public:
+    IndexWords( EStringList * );
+    void execute();
+
+private:
+    class Transaction * t;
+    class Query * q;
+    uint last;
+    uint indexed;
+    bool committing;
+    bool more;
+};
+
+
+class UpdatePreviews
+    : public AoxCommand
+{
+public:
+    UpdatePreviews( EStringList * );
+    void execute();
+
+private:
+    class Transaction * t;
+    class Query * q;
+    uint last;
+    uint made;
+    bool committing;
+    bool more;
+};
+
+
+class CompressBodyparts
+    : public AoxCommand
+{
+public:
+    CompressBodyparts( EStringList * );
+    void execute();
+
+private:
+    class Transaction * t;
+    class Query * q;
+    uint last;
+    uint compressed;
+    int64 saved;
+    bool committing;
+    bool more;
+};
+
+
 #endif
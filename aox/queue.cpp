@@ -4,6 +4,7 @@
 
 #include "query.h"
 #include "recipient.h"
+#include "integerset.h"
 #include "transaction.h"
 
 #include <stdio.h>
@@ -11,121 +12,251 @@
 
 static AoxFactory<ShowQueue>
 f( "show", "queue", "Display the outgoing mail queue.",
-   "    Synopsis: aox show queue\n\n"
-   "    Displays a list of mail queued for delivery to a smarthost.\n" );
+   "    Synopsis: aox show queue [-a] [-v] [-s] [-n count] [-f id]\n\n"
+   "    Displays a list of mail queued for delivery to a smarthost.\n\n"
+   "    Only mail that hasn't been delivered yet is shown, unless -a\n"
+   "    is given. -v shows the delivery status of each recipient.\n\n"
+   "    -s shows only a summary: the number of recipients by state\n"
+   "    and by domain, and the oldest message in the queue.\n\n"
+   "    -n shows at most count messages, and -f starts with the first\n"
+   "    message whose delivery id is above id, so that a large queue\n"
+   "    can be looked at a page at a time.\n" );
+
+
+static const uint pageSize = 1000;
+
+
+static const char * actionNames[] = {
+    "not tried yet", "failed", "delayed", "delivered", "relayed", "expanded"
+};
+
+
+static const char * actionName( uint action )
+{
+    if ( action < sizeof( actionNames ) / sizeof( actionNames[0] ) )
+        return actionNames[action];
+    return "unknown";
+}
+
+
+class ShowQueueData
+    : public Garbage
+{
+public:
+    ShowQueueData()
+        : parsed( false ), all( false ), summary( false ),
+          limit( 0 ), after( 0 ), shown( 0 ),
+          q( 0 ), qr( 0 ), byAction( 0 ), byDomain( 0 ), oldest( 0 )
+    {}
+
+    bool parsed;
+    bool all;
+    bool summary;
+    uint limit;
+    uint after;
+    uint shown;
+
+    Query * q;
+    Query * qr;
+    List<Row> deliveries;
+
+    Query * byAction;
+    Query * byDomain;
+    Query * oldest;
+};
 
 
 /*! \class ShowQueue queue.h
     This class handles the "aox show queue" command.
+
+    The queue is read a page of deliveries at a time, with the
+    recipients for each page fetched in a single query, so that
+    looking at a large queue neither takes one query per message nor
+    reads the whole queue at once.
 */
 
 ShowQueue::ShowQueue( EStringList * args )
-    : AoxCommand( args ), q( 0 ), qr( 0 )
+    : AoxCommand( args ), d( new ShowQueueData )
 {
 }
 
 
 void ShowQueue::execute()
 {
-    if ( !q ) {
-        parseOptions();
-        end();
+    if ( !d->parsed ) {
+        EString p( next() );
+        while ( p[0] == '-' ) {
+            bool ok = true;
+            if ( p == "-a" ) {
+                d->all = true;
+            }
+            else if ( p == "-v" ) {
+                setopt( 'v' );
+            }
+            else if ( p == "-s" ) {
+                d->summary = true;
+            }
+            else if ( p == "-n" ) {
+                d->limit = next().number( &ok );
+                if ( !ok || !d->limit )
+                    error( "-n needs a positive number of messages" );
+            }
+            else if ( p == "-f" ) {
+                d->after = next().number( &ok );
+                if ( !ok )
+                    error( "-f needs a delivery id" );
+            }
+            else {
+                error( "Bad option name: " + p.quoted() );
+            }
+            p = next();
+        }
+        if ( !p.isEmpty() )
+            error( "Unexpected argument: " + p );
+        d->parsed = true;
 
         database();
+    }
 
-        EString s(
-            "select d.id, d.message, "
-            "(a.localpart||'@'||a.domain)::text as sender, "
-            "to_char(d.injected_at, 'YYYY-MM-DD HH24:MI:SS') as submitted, "
-            "to_char(max(dr.last_attempt), 'YYYY-MM-DD HH24:MI:SS') as tried, "
-            "(extract(epoch from d.expires_at)-extract(epoch from current_timestamp))::bigint as expires_in "
-            "from deliveries d join addresses a on (d.sender=a.id) "
-            "join delivery_recipients dr on (d.id=dr.delivery) "
-        );
-        if ( !opt( 'a' ) )
-            s.append( "where dr.action=$1 or dr.action=$2 " );
-        s.append( "group by d.id, d.message, "
-                  "a.domain, a.localpart, d.injected_at, d.expires_at "
-                  "order by submitted, tried, sender" );
-
-        q = new Query( s, this );
-        if ( !opt( 'a' ) ) {
-            q->bind( 1, Recipient::Unknown );
-            q->bind( 2, Recipient::Delayed );
-        }
-        q->execute();
+    if ( d->summary ) {
+        summarise();
+        return;
     }
 
-    while ( qr || q->hasResults() ) {
-        if ( !qr ) {
-            Row * r = q->nextRow();
-            uint delivery = r->getInt( "id" );
-            uint message = r->getInt( "message" );
-            EString sender( r->getEString( "sender" ) );
-
-            if ( sender == "@" )
-                sender = "<>";
-
-            printf( "%d: Message %d from %s (submitted %s)\n",
-                    delivery, message, sender.cstr(),
-                    r->getEString( "submitted" ).cstr() );
-            bool nl = false;
-            if ( !r->isNull( "tried" ) ) {
-                printf( "\t(last tried %s",
-                        r->getEString( "tried" ).cstr() );
-                nl = true;
-            }
-            int64 expires = r->getBigint( "expires_in" );
-            if ( expires > 0 && expires < 604800 ) {
-                printf( "%sexpires in %d:%02d:%02d",
-                        nl ? ", " : "\t(",
-                        (int)expires / 3600, ( (int)expires / 60 ) % 60,
-                        (int)expires % 60 );
-                nl = true;
+    while ( true ) {
+        if ( !d->q ) {
+            uint n = pageSize;
+            if ( d->limit && d->limit - d->shown < n )
+                n = d->limit - d->shown;
+            EString s(
+                "select d.id, d.message, "
+                "(a.localpart||'@'||a.domain)::text as sender, "
+                "to_char(d.injected_at, 'YYYY-MM-DD HH24:MI:SS') "
+                "as submitted, "
+                "to_char(max(dr.last_attempt), 'YYYY-MM-DD HH24:MI:SS') "
+                "as tried, "
+                "(extract(epoch from d.expires_at)-"
+                "extract(epoch from current_timestamp))::bigint "
+                "as expires_in "
+                "from deliveries d join addresses a on (d.sender=a.id) "
+                "join delivery_recipients dr on (d.id=dr.delivery) "
+                "where d.id>$1 "
+            );
+            if ( !d->all )
+                s.append( "and (dr.action=$3 or dr.action=$4) " );
+            s.append( "group by d.id, d.message, a.domain, a.localpart, "
+                      "d.injected_at, d.expires_at "
+                      "order by d.id limit $2" );
+
+            d->q = new Query( s, this );
+            d->q->bind( 1, d->after );
+            d->q->bind( 2, n );
+            if ( !d->all ) {
+                d->q->bind( 3, Recipient::Unknown );
+                d->q->bind( 4, Recipient::Delayed );
             }
-            if ( nl )
-                printf( ")\n" );
+            d->q->execute();
+        }
 
-            EString s(
-                "select action, status, "
-                "a.domain::text as domain, a.localpart::text, "
+        while ( d->q->hasResults() )
+            d->deliveries.append( d->q->nextRow() );
+
+        if ( !d->q->done() )
+            return;
+
+        if ( d->deliveries.isEmpty() ) {
+            finish();
+            return;
+        }
+
+        if ( !d->qr ) {
+            IntegerSet ids;
+            List<Row>::Iterator i( d->deliveries );
+            while ( i ) {
+                ids.add( i->getInt( "id" ) );
+                ++i;
+            }
+            d->qr = new Query(
+                "select dr.delivery, action, status, "
                 "(a.localpart||'@'||a.domain)::text as recipient "
                 "from delivery_recipients dr join addresses a "
-                "on (dr.recipient=a.id) where dr.delivery=$1 "
-                "order by dr.action, a.domain, a.localpart"
-            );
-            qr = new Query( s, this );
-            qr->bind( 1, delivery );
-            qr->execute();
+                "on (dr.recipient=a.id) where dr.delivery=any($1) "
+                "order by dr.delivery, dr.action, a.domain, a.localpart",
+                this );
+            d->qr->bind( 1, ids );
+            d->qr->execute();
+        }
+
+        if ( !d->qr->done() )
+            return;
+
+        printPage();
+
+        uint rows = d->deliveries.count();
+        d->shown += rows;
+        d->after = d->deliveries.lastElement()->getInt( "id" );
+        d->deliveries.clear();
+        d->q = 0;
+        d->qr = 0;
+
+        if ( d->limit && d->shown >= d->limit ) {
+            printf( "\nTo see more: aox show queue%s -n %d -f %d\n",
+                    d->all ? " -a" : "", d->limit, d->after );
+            finish();
+            return;
         }
+        if ( rows < pageSize ) {
+            finish();
+            return;
+        }
+    }
+}
 
-        while ( qr->hasResults() ) {
-            Row * r = qr->nextRow();
 
+/*! Prints the deliveries in the current page along with their
+    recipients.
+*/
+
+void ShowQueue::printPage()
+{
+    Row * r = d->qr->nextRow();
+    bool first = !d->shown;
+    List<Row>::Iterator i( d->deliveries );
+    while ( i ) {
+        uint delivery = i->getInt( "id" );
+        uint message = i->getInt( "message" );
+        EString sender( i->getEString( "sender" ) );
+
+        if ( sender == "@" )
+            sender = "<>";
+
+        if ( !first )
+            printf( "\n" );
+        first = false;
+        printf( "%d: Message %d from %s (submitted %s)\n",
+                delivery, message, sender.cstr(),
+                i->getEString( "submitted" ).cstr() );
+        bool nl = false;
+        if ( !i->isNull( "tried" ) ) {
+            printf( "\t(last tried %s",
+                    i->getEString( "tried" ).cstr() );
+            nl = true;
+        }
+        int64 expires = i->getBigint( "expires_in" );
+        if ( expires > 0 && expires < 604800 ) {
+            printf( "%sexpires in %d:%02d:%02d",
+                    nl ? ", " : "\t(",
+                    (int)expires / 3600, ( (int)expires / 60 ) % 60,
+                    (int)expires % 60 );
+            nl = true;
+        }
+        if ( nl )
+            printf( ")\n" );
+
+        while ( r && (uint)r->getInt( "delivery" ) == delivery ) {
             EString recipient( r->getEString( "recipient" ) );
-            printf( "\t%s", recipient.cstr() );
-
-            uint action = r->getInt( "action" );
-            switch ( action ) {
-            case 0:
-                printf( " (not tried yet" );
-                break;
-            case 1:
-                printf( " (failed" );
-                break;
-            case 2:
-                printf( " (delayed" );
-                break;
-            case 3:
-                printf( " (delivered" );
-                break;
-            case 4:
-                printf( " (relayed" );
-                break;
-            case 5:
-                printf( " (expanded" );
-                break;
-            }
+            printf( "\t%s (%s", recipient.cstr(),
+                    actionName( r->getInt( "action" ) ) );
 
             EString status;
             if ( !r->isNull( "status" ) )
@@ -133,20 +264,84 @@ void ShowQueue::execute()
             if ( opt( 'v' ) && !status.isEmpty() )
                 printf( ": status is %s", status.cstr() );
             printf( ")\n" );
+            r = d->qr->nextRow();
         }
 
-        if ( !qr->done() )
-            return;
+        ++i;
+    }
+}
 
-        if ( q->hasResults() )
-            printf( "\n" );
 
-        qr = 0;
+/*! Prints the number of recipients in each state and in the most
+    common domains, and the oldest queued message. With -a, all
+    recipients are counted; otherwise only those not yet delivered,
+    which the dr_pending index finds without looking at the rest.
+*/
+
+void ShowQueue::summarise()
+{
+    if ( !d->byAction ) {
+        EString pending( "true" );
+        if ( !d->all )
+            pending = "(dr.action=$1 or dr.action=$2)";
+
+        d->byAction = new Query( "select action, count(*)::bigint as n "
+                                 "from delivery_recipients dr "
+                                 "where " + pending + " "
+                                 "group by action order by action", this );
+        d->byDomain = new Query( "select a.domain::text as domain, "
+                                 "count(*)::bigint as n "
+                                 "from delivery_recipients dr "
+                                 "join addresses a on (dr.recipient=a.id) "
+                                 "where " + pending + " "
+                                 "group by a.domain "
+                                 "order by n desc, domain limit 20", this );
+        d->oldest = new Query( "select d.id, d.message, "
+                               "to_char(d.injected_at, "
+                               "'YYYY-MM-DD HH24:MI:SS') as submitted "
+                               "from deliveries d where exists "
+                               "(select 1 from delivery_recipients dr "
+                               "where dr.delivery=d.id and " + pending +
+                               ") order by d.id limit 1", this );
+        if ( !d->all ) {
+            d->byAction->bind( 1, Recipient::Unknown );
+            d->byAction->bind( 2, Recipient::Delayed );
+            d->byDomain->bind( 1, Recipient::Unknown );
+            d->byDomain->bind( 2, Recipient::Delayed );
+            d->oldest->bind( 1, Recipient::Unknown );
+            d->oldest->bind( 2, Recipient::Delayed );
+        }
+        d->byAction->execute();
+        d->byDomain->execute();
+        d->oldest->execute();
     }
 
-    if ( !q->done() )
+    if ( !d->byAction->done() || !d->byDomain->done() ||
+         !d->oldest->done() )
         return;
 
+    printf( "Recipients by state:\n" );
+    while ( d->byAction->hasResults() ) {
+        Row * r = d->byAction->nextRow();
+        printf( "\t%s: %lld\n", actionName( r->getInt( "action" ) ),
+                (long long)r->getBigint( "n" ) );
+    }
+
+    printf( "Recipients by domain:\n" );
+    while ( d->byDomain->hasResults() ) {
+        Row * r = d->byDomain->nextRow();
+        printf( "\t%s: %lld\n", r->getEString( "domain" ).cstr(),
+                (long long)r->getBigint( "n" ) );
+    }
+
+    Row * r = d->oldest->nextRow();
+    if ( r )
+        printf( "Oldest: %d: Message %d (submitted %s)\n",
+                r->getInt( "id" ), r->getInt( "message" ),
+                r->getEString( "submitted" ).cstr() );
+    else
+        printf( "The queue is empty.\n" );
+
     finish();
 }
 
@@ -178,7 +373,8 @@ void FlushQueue::execute()
         t = new Transaction( this );
         t->enqueue( new Query( "update delivery_recipients "
                                "set last_attempt=null "
-                               "where action=2", 0 ) );
+                               "where action=2 "
+                               "and last_attempt is not null", 0 ) );
         t->enqueue( new Query( "notify deliveries_updated", 0 ) );
         t->commit();
     }
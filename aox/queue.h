@@ -14,8 +14,10 @@ public:
     void execute();
 
 private:
-    class Query * q;
-    class Query * qr;
+    class ShowQueueData * d;
+
+    void printPage();
+    void summarise();
 };
 
 
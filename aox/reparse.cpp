@@ -16,29 +16,83 @@
 #include <unistd.h> // getpid
 
 
+// the most messages one worker reparses in one transaction
+static const uint batchSize = 100;
+
+
+class ReparseWorker
+    : public EventHandler
+{
+public:
+    ReparseWorker( Reparse * o, class ReparseData * rd )
+        : owner( o ), d( rd ), t( 0 ), q( 0 ), first( 0 ),
+          parsed( false )
+    {}
+
+    void start( const IntegerSet & );
+    void execute();
+    void parse();
+
+    bool busy() const { return t != 0; }
+
+    Reparse * owner;
+    class ReparseData * d;
+    Transaction * t;
+    Query * q;
+    uint first;
+    bool parsed;
+};
+
+
 class ReparseData
     : public Garbage
 {
 public:
     ReparseData()
-        : q( 0 ), t( 0 )
+        : q( 0 ), start( 0 ), jobs( 1 ), dryRun( false ),
+          errorCopies( false ), checkpoint( 0 ),
+          reparsed( 0 ), failed( 0 )
     {}
 
     Query * q;
-    Transaction * t;
+    uint start;
+    uint jobs;
+    bool dryRun;
+    bool errorCopies;
+    IntegerSet todo;
+    List<ReparseWorker> workers;
+    uint checkpoint;
+    uint reparsed;
+    uint failed;
+    EString error;
 };
 
 
 static AoxFactory<Reparse>
 f( "reparse", "", "Retry previously-stored unparsable messages.",
-   "    Synopsis: aox reparse\n\n"
+   "    Synopsis: aox reparse [-e] [-n] [-j workers] [-s first]\n\n"
    "    Looks for messages that \"arrived but could not be stored\",\n"
    "    and tries to reparse them with parsing workarounds added more\n"
-   "    recently. If it succeeds, the new messages are injected.\n" );
+   "    recently. If it succeeds, the new messages are injected.\n\n"
+   "    The work is done and committed a hundred messages at a time.\n"
+   "    The -j flag lets that many batches run at once (the default\n"
+   "    is one). After each batch, aox prints a checkpoint; the\n"
+   "    \"-s first\" flag resumes from such a checkpoint, skipping\n"
+   "    the messages that were already tried.\n\n"
+   "    The -n flag makes a dry run: aox parses the messages and\n"
+   "    reports how many would now be accepted, but changes nothing.\n\n"
+   "    The -e flag writes a copy of each message that still fails\n"
+   "    to a file in the errors directory.\n" );
 
 
 /*! \class Reparse reparse.h
     This class handles the "aox reparse" command.
+
+    It reads the list of unparsed messages up front, and hands them
+    out in batches to as many ReparseWorker objects as the -j flag
+    asks for. Each batch is a transaction of its own. The checkpoint
+    is the lowest bodypart id in any batch not yet done, so every
+    message below it has been tried.
 */
 
 Reparse::Reparse( EStringList * args )
@@ -49,30 +103,46 @@ Reparse::Reparse( EStringList * args )
 
 void Reparse::execute()
 {
-    if ( !d->q && !d->t ) {
-        parseOptions();
-        end();
+    if ( !d->q ) {
+        EString p( next() );
+        while ( p[0] == '-' ) {
+            bool ok = true;
+            if ( p == "-e" ) {
+                d->errorCopies = true;
+            }
+            else if ( p == "-n" ) {
+                d->dryRun = true;
+            }
+            else if ( p == "-v" ) {
+                setopt( 'v' );
+            }
+            else if ( p == "-j" ) {
+                d->jobs = next().number( &ok );
+                if ( !ok || !d->jobs )
+                    error( "-j needs a positive number of workers" );
+            }
+            else if ( p == "-s" ) {
+                d->start = next().number( &ok );
+                if ( !ok )
+                    error( "-s needs a checkpoint number" );
+            }
+            else {
+                error( "Bad option name: " + p.quoted() );
+            }
+            p = next();
+        }
+        if ( !p.isEmpty() )
+            error( "Unexpected argument: " + p );
 
         printf( "Looking for messages with parse failures\n" );
 
         database( true );
         Mailbox::setup( this );
 
-        d->t = new Transaction( this );
-        d->q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
-                          "mm.message as wrapper, "
-                          "mb.nextmodseq, "
-                          "b.id as bodypart, b.text, b.data "
-                          "from unparsed_messages u "
-                          "join bodyparts b on (u.bodypart=b.id) "
-                          "join part_numbers p on (p.bodypart=b.id) "
-                          "join mailbox_messages mm on (p.message=mm.message) "
-                          "join mailboxes mb on (mm.mailbox=mb.id) "
-                          "order by mm.mailbox "
-                          "for update",
-                          this );
-        d->t->enqueue( d->q );
-        d->t->execute();
+        d->q = new Query( "select bodypart from unparsed_messages "
+                          "where bodypart>=$1 order by bodypart", this );
+        d->q->bind( 1, d->start );
+        d->q->execute();
     }
 
     if ( !choresDone() )
@@ -81,76 +151,215 @@ void Reparse::execute()
     if ( !d->q->done() )
         return;
 
+    if ( d->q->hasResults() ) {
+        while ( d->q->hasResults() )
+            d->todo.add( d->q->nextRow()->getInt( "bodypart" ) );
+        printf( "Found %d unparsed messages\n", d->todo.count() );
+    }
+
+    if ( d->q->failed() )
+        error( "Couldn't read unparsed_messages: " + d->q->error() );
+
+    // Give each idle worker its next batch, starting new workers up
+    // to -j, and note how far we've come.
+
+    uint running = 0;
+    List<ReparseWorker>::Iterator w( d->workers );
+    while ( w ) {
+        if ( w->busy() )
+            running++;
+        ++w;
+    }
+    while ( running < d->jobs && !d->todo.isEmpty() ) {
+        ReparseWorker * idle = 0;
+        w = d->workers.first();
+        while ( w && !idle ) {
+            if ( !w->busy() )
+                idle = w;
+            ++w;
+        }
+        if ( !idle ) {
+            idle = new ReparseWorker( this, d );
+            d->workers.append( idle );
+        }
+        uint n = batchSize;
+        if ( n > d->todo.count() )
+            n = d->todo.count();
+        IntegerSet batch;
+        while ( n-- ) {
+            uint id = d->todo.smallest();
+            d->todo.remove( id );
+            batch.add( id );
+        }
+        idle->start( batch );
+        running++;
+    }
+
+    uint checkpoint = 0;
+    if ( !d->todo.isEmpty() )
+        checkpoint = d->todo.smallest();
+    w = d->workers.first();
+    while ( w ) {
+        if ( w->busy() && ( !checkpoint || w->first < checkpoint ) )
+            checkpoint = w->first;
+        ++w;
+    }
+    if ( checkpoint > d->checkpoint ) {
+        d->checkpoint = checkpoint;
+        printf( "Checkpoint: %d (continue with aox reparse -s %d)\n",
+                checkpoint, checkpoint );
+    }
+
+    if ( !d->error.isEmpty() )
+        error( "Reparsing failed: " + d->error );
+
+    if ( running )
+        return;
+
+    if ( d->dryRun )
+        printf( "Would reparse %d messages, %d still fail\n",
+                d->reparsed, d->failed );
+    else
+        printf( "Reparsed %d messages, %d still fail\n",
+                d->reparsed, d->failed );
+    finish();
+}
+
+
+/*! Starts reparsing the messages whose bodyparts are in \a batch. */
+
+void ReparseWorker::start( const IntegerSet & batch )
+{
+    first = batch.smallest();
+    parsed = false;
+    t = new Transaction( this );
+    q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
+                   "mm.message as wrapper, "
+                   "mb.nextmodseq, "
+                   "b.id as bodypart, b.text, b.data, b.compressed "
+                   "from unparsed_messages u "
+                   "join bodyparts b on (u.bodypart=b.id) "
+                   "join part_numbers p on (p.bodypart=b.id) "
+                   "join mailbox_messages mm on (p.message=mm.message) "
+                   "join mailboxes mb on (mm.mailbox=mb.id) "
+                   "where u.bodypart=any($1) "
+                   "order by mm.mailbox "
+                   "for update",
+                   this );
+    q->bind( 1, batch );
+    t->enqueue( q );
+    t->execute();
+}
+
+
+void ReparseWorker::execute()
+{
+    if ( !t )
+        return;
+
+    if ( !parsed ) {
+        if ( !q->done() )
+            return;
+        parsed = true;
+        parse();
+    }
+
+    if ( !t->done() )
+        return;
+
+    if ( t->failed() && d->error.isEmpty() )
+        d->error = t->error();
+    t = 0;
+    q = 0;
+    owner->execute();
+}
+
+
+/*! Parses the messages \a q found, and either injects the ones that
+    now parse and commits, or just counts them and rolls back.
+*/
+
+void ReparseWorker::parse()
+{
     IntegerSet parsable;
 
     List<Injectee> injectables;
-    while ( d->q && d->q->hasResults() ) {
-        Row * r = d->q->nextRow();
+    while ( q->hasResults() ) {
+        Row * r = q->nextRow();
 
         EString text;
         if ( r->isNull( "data" ) )
             text = r->getEString( "text" );
+        else if ( r->getBoolean( "compressed" ) )
+            text = r->getEString( "data" ).inflated();
         else
             text = r->getEString( "data" );
         Mailbox * mb = Mailbox::find( r->getInt( "mailbox" ) );
         Injectee * im = new Injectee;
         im->parse( text );
         if ( im->valid() ) {
+            d->reparsed++;
+            if ( d->dryRun ) {
+                printf( "- %s:%d would be reparsed\n",
+                        mb->name().utf8().cstr(),
+                        r->getInt( "uid" ) );
+                continue;
+            }
+
             EStringList x;
             im->setFlags( mb, &x );
             injectables.append( im );
 
             parsable.add( r->getInt( "bodypart" ) );
 
-            Query * q
+            Query * dq
                 = new Query( "insert into deleted_messages "
                              "(mailbox,uid,message,modseq,deleted_by,reason) "
                              "values ($1,$2,$3,$4,$5,$6)", this );
-            q->bind( 1, r->getInt( "mailbox" ) );
-            q->bind( 2, r->getInt( "uid" ) );
-            q->bind( 3, r->getInt( "wrapper" ) );
-            q->bind( 4, r->getBigint( "nextmodseq" ) );
-            q->bindNull( 5 );
-            q->bind( 6,
+            dq->bind( 1, r->getInt( "mailbox" ) );
+            dq->bind( 2, r->getInt( "uid" ) );
+            dq->bind( 3, r->getInt( "wrapper" ) );
+            dq->bind( 4, r->getBigint( "nextmodseq" ) );
+            dq->bindNull( 5 );
+            dq->bind( 6,
                      EString( "reparsed by aox " ) +
                      Configuration::compiledIn( Configuration::Version ) );
-            d->t->enqueue( q );
+            t->enqueue( dq );
             printf( "- reparsed %s:%d\n",
                     mb->name().utf8().cstr(),
                     r->getInt( "uid" ) );
         }
         else {
+            d->failed++;
             printf( "- parsing %s:%d still fails: %s\n",
                     mb->name().utf8().cstr(), r->getInt( "uid" ),
                     im->error().simplified().cstr() );
-            if ( opt( 'e' ) )
+            if ( d->errorCopies )
                 printf( "- wrote a copy to %s\n",
-                        writeErrorCopy( text ).cstr() );
+                        owner->writeErrorCopy( text ).cstr() );
         }
 
     }
+
+    if ( d->dryRun ) {
+        t->rollback();
+        return;
+    }
+
     if ( !injectables.isEmpty() ) {
-        Query * q =
+        Query * uq =
             new Query( "delete from unparsed_messages where "
                        "bodypart=any($1)", this );
-        q->bind( 1, parsable );
-        d->t->enqueue( q );
+        uq->bind( 1, parsable );
+        t->enqueue( uq );
 
         Injector * injector = new Injector( this );
         injector->addInjection( &injectables );
-        injector->setTransaction( d->t );
+        injector->setTransaction( t );
         injector->execute();
-
     }
 
-    d->t->commit();
-
-    if ( !d->t->done() )
-        return;
-
-    if ( d->t->failed() )
-        error( "Reparsing failed: " + d->t->error() );
-    finish();
+    t->commit();
 }
 
 
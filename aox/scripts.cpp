@@ -0,0 +1,178 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "scripts.h"
+
+#include "file.h"
+#include "query.h"
+#include "estringlist.h"
+#include "transaction.h"
+#include "sievescript.h"
+
+#include <stdio.h>
+
+
+static AoxFactory<ImportScripts>
+f( "import", "scripts", "Store a Sieve script for many users.",
+   "    Synopsis: aox import scripts [-a] <name> <file> [username ...]\n\n"
+   "    Checks the Sieve script in <file> once, then stores it as\n"
+   "    <name> for each of the named users, replacing any script\n"
+   "    they already have by that name. If no usernames are given,\n"
+   "    they are read from standard input, one per line.\n\n"
+   "    The -a flag activates the script for each user.\n\n"
+   "    Unlike ManageSieve's PUTSCRIPT, this does not create the\n"
+   "    mailboxes named in fileinto commands.\n\n"
+   "    Examples:\n\n"
+   "      aox import scripts -a vacation vacation.siv alice bob\n"
+   "      cut -f1 users.txt | aox import scripts spam spam.siv\n" );
+
+
+class ImportScriptsData
+    : public Garbage
+{
+public:
+    ImportScriptsData()
+        : logins( 0 ), active( false ),
+          unknown( 0 ), t( 0 ), updated( 0 ), inserted( 0 )
+    {}
+
+    EString name;
+    EString script;
+    EStringList * logins;
+    bool active;
+
+    Query * unknown;
+    Transaction * t;
+    Query * updated;
+    Query * inserted;
+};
+
+
+/*  Returns an SQL condition matching the users whose logins are in
+    the array bound to parameter \a n, case-insensitively as for
+    logging in.
+*/
+
+static EString named( uint n )
+{
+    return "lower(u.login) in (select lower(l) from unnest($" + fn( n ) +
+        "::text[]) l)";
+}
+
+
+/*! \class ImportScripts scripts.h
+    This class handles the "aox import scripts" command.
+
+    The script is checked once, and stored for all the users using a
+    few queries in one transaction, so provisioning many users with
+    the same script is fast. The delivery side caches parsed scripts
+    by their text, so it too parses the script only once.
+*/
+
+ImportScripts::ImportScripts( EStringList * args )
+    : AoxCommand( args ), d( new ImportScriptsData )
+{
+}
+
+
+void ImportScripts::execute()
+{
+    if ( !d->logins ) {
+        parseOptions();
+        d->active = opt( 'a' ) > 0;
+        d->name = next();
+        EString file = next();
+        d->logins = new EStringList;
+        while ( !args()->isEmpty() )
+            d->logins->append( next() );
+        end();
+
+        if ( d->name.isEmpty() || file.isEmpty() )
+            error( "Script name and file must be non-empty." );
+
+        File f( file );
+        if ( !f.valid() )
+            error( "Couldn't read " + file );
+        d->script = f.contents();
+        if ( d->script.isEmpty() )
+            error( "Script cannot be empty" );
+
+        EString e = SieveScript::parsed( d->script )->parseErrors();
+        if ( !e.isEmpty() )
+            error( "Script has errors:\n" + e );
+
+        if ( d->logins->isEmpty() ) {
+            char line[1024];
+            while ( fgets( line, 1024, stdin ) ) {
+                EString l( line );
+                l = l.simplified();
+                if ( !l.isEmpty() )
+                    d->logins->append( l );
+            }
+        }
+        if ( d->logins->isEmpty() )
+            error( "No users named" );
+
+        database( true );
+
+        d->unknown = new Query( "select l from unnest($1::text[]) l "
+                                "where lower(l) not in "
+                                "(select lower(login) from users "
+                                "where login is not null)", this );
+        d->unknown->bind( 1, *d->logins );
+        d->unknown->execute();
+
+        d->t = new Transaction( this );
+
+        d->updated =
+            new Query( "update scripts s set script=$2 from users u "
+                       "where s.owner=u.id and s.name=$1 and " +
+                       named( 3 ), this );
+        d->updated->bind( 1, d->name );
+        d->updated->bind( 2, d->script );
+        d->updated->bind( 3, *d->logins );
+        d->t->enqueue( d->updated );
+
+        d->inserted =
+            new Query( "insert into scripts (owner,name,script,active) "
+                       "select u.id, $1, $2, false from users u "
+                       "where " + named( 3 ) + " and not exists "
+                       "(select id from scripts s "
+                       "where s.owner=u.id and s.name=$1)", this );
+        d->inserted->bind( 1, d->name );
+        d->inserted->bind( 2, d->script );
+        d->inserted->bind( 3, *d->logins );
+        d->t->enqueue( d->inserted );
+
+        if ( d->active ) {
+            Query * q =
+                new Query( "update scripts set active=(name=$1) "
+                           "where (name=$1 or active='t') and owner in "
+                           "(select u.id from users u where " +
+                           named( 2 ) + ")", this );
+            q->bind( 1, d->name );
+            q->bind( 2, *d->logins );
+            d->t->enqueue( q );
+        }
+
+        d->t->commit();
+    }
+
+    while ( d->unknown->hasResults() ) {
+        Row * r = d->unknown->nextRow();
+        fprintf( stderr, "aox: No such user: %s\n",
+                 r->getEString( "l" ).cstr() );
+    }
+
+    if ( !d->unknown->done() || !d->t->done() )
+        return;
+
+    if ( d->t->failed() )
+        error( "Couldn't store scripts: " + d->t->error() );
+
+    printf( "Stored %s for %d users (%d new, %d replaced)\n",
+            d->name.quoted().cstr(),
+            d->updated->rows() + d->inserted->rows(),
+            d->inserted->rows(), d->updated->rows() );
+
+    finish();
+}
@@ -0,0 +1,21 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SCRIPTS_H
+#define SCRIPTS_H
+
+#include "aoxcommand.h"
+
+
+class ImportScripts
+    : public AoxCommand
+{
+public:
+    ImportScripts( EStringList * );
+    void execute();
+
+private:
+    class ImportScriptsData * d;
+};
+
+
+#endif
@@ -1377,6 +1377,41 @@ void Restart::execute()
 
 
 
+static AoxFactory<Reload>
+f12( "reload", "", "Reload the server configuration.",
+     "    Synopsis: aox reload\n\n"
+     "    Makes the running archiveopteryx processes reread\n"
+     "    archiveopteryx.conf, and apply the changes to those variables\n"
+     "    that can change without a restart (e.g. db-max-handles,\n"
+     "    memory-limit and log-level). Changing other variables still\n"
+     "    requires a restart. The changes are logged.\n" );
+
+
+/*! \class Reload servers.h
+    This class handles the "aox reload" command, by sending SIGHUP to
+    the archiveopteryx server.
+*/
+
+Reload::Reload( EStringList * args )
+    : AoxCommand( args )
+{
+}
+
+
+void Reload::execute()
+{
+    parseOptions();
+    end();
+
+    int pid = serverPid( "archiveopteryx" );
+    if ( pid < 0 || kill( pid, SIGHUP ) < 0 )
+        error( "archiveopteryx does not seem to be running" );
+
+    finish();
+}
+
+
+
 static AoxFactory<ShowStatus>
 f5( "show", "status", "Display a summary of the running servers.",
     "    Synopsis: aox show status [-v]\n\n"
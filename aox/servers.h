@@ -106,6 +106,15 @@ private:
 };
 
 
+class Reload
+    : public AoxCommand
+{
+public:
+    Reload( EStringList * );
+    void execute();
+};
+
+
 class ShowStatus
     : public AoxCommand
 {
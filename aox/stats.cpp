@@ -3,6 +3,12 @@
 #include "stats.h"
 
 #include "query.h"
+#include "buffer.h"
+#include "endpoint.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "estringlist.h"
+#include "dict.h"
 #include "configuration.h"
 
 #include <stdio.h>
@@ -107,8 +113,8 @@ void ShowCounts::execute()
         d->query =
             new Query( "select count(*)::int as messages, "
                        "coalesce(sum(rfc822size)::bigint,0) as totalsize, "
-                       "(select count(*) from mailbox_messages)::int "
-                       "as mm, "
+                       "(select coalesce(sum(messages),0) "
+                       "from mailbox_counts)::int as mm, "
                        "(select count(*) from deleted_messages)::int "
                        "as dm from messages", this );
         d->query->execute();
@@ -178,3 +184,165 @@ void ShowCounts::execute()
 
     finish();
 }
+
+
+
+class MetricsClient
+    : public Connection
+{
+public:
+    MetricsClient( const Endpoint & e, EventHandler * o )
+        : Connection( Connection::socket( e.protocol() ),
+                      Connection::Client ),
+          owner( o ), lines( new EStringList ), done( false )
+    {
+        connect( e );
+        EventLoop::global()->addConnection( this );
+        setTimeoutAfter( 10 );
+    }
+
+    void react( Event e ) {
+        switch ( e ) {
+        case Connect:
+            enqueue( "GET /metrics HTTP/1.0\r\n\r\n" );
+            break;
+        case Read:
+            readLines();
+            break;
+        case Timeout:
+        case Error:
+        case Close:
+        case Shutdown:
+            readLines();
+            setState( Closing );
+            if ( !done ) {
+                done = true;
+                owner->execute();
+            }
+            break;
+        }
+    }
+
+    void readLines() {
+        EString * l = readBuffer()->removeLine();
+        while ( l ) {
+            lines->append( l );
+            l = readBuffer()->removeLine();
+        }
+    }
+
+    EventHandler * owner;
+    EStringList * lines;
+    bool done;
+};
+
+
+class ShowMemoryData
+    : public Garbage
+{
+public:
+    ShowMemoryData()
+        : client( 0 )
+    {}
+
+    MetricsClient * client;
+};
+
+
+static AoxFactory<ShowMemory>
+f2( "show", "memory", "Show how a server uses memory.",
+    "    Synopsis: aox show memory\n\n"
+    "    Asks a running server (on metrics-port) how many objects of\n"
+    "    each size it had after its last garbage collection, how many\n"
+    "    it allocated before that collection, and what percentage\n"
+    "    survived.\n\n"
+    "    use-statistics must be enabled. Each server process keeps\n"
+    "    its own statistics; the one which answers is named.\n" );
+
+
+/*! \class ShowMemory stats.h
+    This class handles the "aox show memory" command.
+
+    It fetches the allocator statistics exported by MetricsDumper and
+    prints them as a table, one line per size class.
+*/
+
+ShowMemory::ShowMemory( EStringList * args )
+    : AoxCommand( args ), d( new ShowMemoryData )
+{
+}
+
+
+/*  Returns the value of the label \a name in the metric line \a l,
+    or an empty string.
+*/
+
+static EString label( const EString & l, const char * name )
+{
+    EString n( name );
+    n.append( "=\"" );
+    int i = l.find( n );
+    if ( i < 0 )
+        return "";
+    i += n.length();
+    int e = l.find( '"', i );
+    if ( e < 0 )
+        return "";
+    return l.mid( i, e - i );
+}
+
+
+void ShowMemory::execute()
+{
+    if ( !d->client ) {
+        parseOptions();
+        end();
+
+        if ( !Configuration::toggle( Configuration::UseStatistics ) )
+            error( "use-statistics is not enabled" );
+
+        d->client = new MetricsClient(
+            Endpoint( Configuration::StatisticsAddress,
+                      Configuration::MetricsPort ), this );
+    }
+
+    if ( !d->client->done )
+        return;
+
+    EString process;
+    EStringList sizes;
+    Dict<EString> values;
+    EStringList::Iterator i( d->client->lines );
+    while ( i ) {
+        if ( i->startsWith( "aox_gc_class_" ) ) {
+            EString size( label( *i, "size" ) );
+            process = label( *i, "process" );
+            EString name( i->mid( 13, i->find( '{' ) - 13 ) );
+            if ( name == "objects" )
+                sizes.append( size );
+            int sp = i->find( "} " );
+            values.insert( name + " " + size,
+                           new EString( i->mid( sp + 2 ) ) );
+        }
+        ++i;
+    }
+
+    if ( sizes.isEmpty() )
+        error( "Could not fetch allocator statistics from metrics-port" );
+
+    printf( "Process %s:\n", process.cstr() );
+    printf( "%10s %10s %10s %9s\n",
+            "Size", "Objects", "Allocated", "Survival" );
+    EStringList::Iterator s( sizes );
+    while ( s ) {
+        EString * o = values.find( "objects " + *s );
+        EString * a = values.find( "allocations " + *s );
+        EString * p = values.find( "survival_percent " + *s );
+        printf( "%10s %10s %10s %8s%%\n", s->cstr(),
+                o ? o->cstr() : "-", a ? a->cstr() : "-",
+                p ? p->cstr() : "-" );
+        ++s;
+    }
+
+    finish();
+}
@@ -18,4 +18,16 @@ private:
 };
 
 
+class ShowMemory
+    : public AoxCommand
+{
+public:
+    ShowMemory( EStringList * );
+    void execute();
+
+private:
+    class ShowMemoryData * d;
+};
+
+
 #endif
@@ -15,34 +15,59 @@
 #include <stdio.h> // printf()
 
 
+static const uint chunkSize = 2000;
+
+
 class UndeleteData
     : public Garbage
 {
 public:
     UndeleteData(): state( 0 ), m( 0 ), t( 0 ),
-                    find( 0 ), uidnext( 0 ), usernames( 0 ) {}
+                    find( 0 ), usernames( 0 ), reserve( 0 ),
+                    total( 0 ), first( 0 ), attempted( 0 ), restored( 0 ),
+                    chunk( 0 ) {}
 
     uint state;
     Mailbox * m;
     Transaction * t;
 
     Query * find;
-    Query * uidnext;
     Query * usernames;
+    Query * reserve;
+
+    IntegerSet remaining;
+    uint total;
+    uint first;
+    uint attempted;
+    uint restored;
+    Query * chunk;
 };
 
 
 static AoxFactory<Undelete>
 f( "undelete", "", "Recover a message that has been deleted.",
-   "    Synopsis: undelete [-n] <mailbox> <search>\n\n"
+   "    Synopsis: undelete [-n] [-v] <mailbox> <search>\n\n"
    "    Searches for deleted messages in the specified mailbox and\n"
    "    recovers those that match the search.\n"
    "    The -n option causes a dummy undelete.\n"
+   "    The -v option shows who deleted each message, when and why.\n"
    "    Messages can be restored after an IMAP EXPUNGE or POP3 DELE\n"
-   "    until aox vacuum permanently removes them (some weeks) later.\n" );
+   "    until aox vacuum permanently removes them (some weeks) later.\n\n"
+   "    Messages are restored a few thousand at a time, so that\n"
+   "    the mailbox isn't locked for long. If the command is\n"
+   "    interrupted, running it again restores the rest.\n" );
 
 /*! \class Undelete Undelete.h
     This class handles the "aox undelete" command.
+
+    The matching messages are found first, and then a range of UIDs
+    for them is reserved in one short transaction. The messages are
+    then moved back into the mailbox in chunks of a few thousand, each
+    in its own transaction and with its own modseq, so that IMAP
+    sessions see each chunk arrive and other changes to the mailbox
+    need not wait for the whole undelete. Each restored message leaves
+    deleted_messages, so rerunning an interrupted undelete restores
+    only the remainder.
 */
 
 Undelete::Undelete( EStringList * args )
@@ -84,49 +109,32 @@ void Undelete::execute()
             exit( 1 );
         s->simplify();
 
-        d->t = new Transaction( this );
-        if ( d->m->deleted() ) {
-            if ( !d->m->create( d->t, 0 ) )
-                error( "Mailbox was deleted; recreating failed: " +
-                       d->m->name().utf8() );
-            printf( "aox: Note: Mailbox %s is recreated.\n"
-                    "     Its ownership and permissions could not be restored.\n",
-                    d->m->name().utf8().cstr() );
-        }
-
         EStringList wanted;
         wanted.append( "uid" );
         if ( opt( 'v' ) ) {
             wanted.append( "deleted_by" );
             wanted.append( "deleted_at::text" );
             wanted.append( "reason" );
-            d->usernames = new Query( "select id, login from users", 0 );
-            d->t->enqueue( d->usernames );
+            d->usernames = new Query( "select id, login from users", this );
+            d->usernames->execute();
         }
 
         d->find = s->query( 0, d->m, 0, 0, true, &wanted, true );
-        d->t->enqueue( d->find );
-
-        d->uidnext = new Query( "select uidnext, nextmodseq "
-                                "from mailboxes "
-                                "where id=$1 for update", this );
-        d->uidnext->bind( 1, d->m->id() );
-        d->t->enqueue( d->uidnext );
-
-        d->t->execute();
+        d->find->setOwner( this );
+        d->find->execute();
         d->state = 3;
     }
 
     if ( d->state == 3 ) {
-        if ( !d->uidnext->done() )
+        if ( !d->find->done() ||
+             ( d->usernames && !d->usernames->done() ) )
             return;
 
-        Row * r = d->uidnext->nextRow();
-        if ( !r )
-            error( "Internal error - could not read mailbox UID" );
-        uint uidnext = r->getInt( "uidnext" );
-        int64 modseq = r->getBigint( "nextmodseq" );
+        if ( d->find->failed() )
+            error( "Couldn't search for deleted messages: " +
+                   d->find->error() );
 
+        Row * r;
         Map<EString> logins;
         if ( d->usernames ) {
             while ( d->usernames->hasResults() ) {
@@ -137,11 +145,10 @@ void Undelete::execute()
         }
 
         Map<EString> why;
-        IntegerSet s;
         while ( d->find->hasResults() ) {
             r = d->find->nextRow();
             uint uid = r->getInt( "uid" );
-            s.add( uid );
+            d->remaining.add( uid );
             if ( d->usernames )
                 why.insert( uid,
                             new EString(
@@ -152,11 +159,12 @@ void Undelete::execute()
                                 r->getEString( "reason" ).simplified().quoted() ) );
         }
 
-        if ( s.isEmpty() )
+        if ( d->remaining.isEmpty() )
             error( "No such deleted message (search returned 0 results)" );
 
+        d->total = d->remaining.count();
         printf( "aox: Undeleting %d messages into %s\n",
-                s.count(), d->m->name().utf8().cstr() );
+                d->total, d->m->name().utf8().cstr() );
 
         Map<EString>::Iterator i( why );
         while ( i ) {
@@ -164,55 +172,117 @@ void Undelete::execute()
             ++i;
         }
 
-        Query * q;
+        if ( opt( 'n' ) ) {
+            printf( "aox: Cancelling undeleting due to -n. Rerun without -n to actually undelete.\n" );
+            finish();
+            return;
+        }
 
-        q = new Query( "create temporary sequence s start " + fn( uidnext ),
-                       0 );
-        d->t->enqueue( q );
+        d->t = new Transaction( this );
+        if ( d->m->deleted() ) {
+            if ( !d->m->create( d->t, 0 ) )
+                error( "Mailbox was deleted; recreating failed: " +
+                       d->m->name().utf8() );
+            printf( "aox: Note: Mailbox %s is recreated.\n"
+                    "     Its ownership and permissions could not be restored.\n",
+                    d->m->name().utf8().cstr() );
+        }
+
+        // the whole UID range is taken at once, so that the chunks
+        // below need only lock the mailbox briefly to get a modseq.
+        d->reserve = new Query( "update mailboxes set uidnext=uidnext+$2 "
+                                "where id=$1 "
+                                "returning uidnext-$2 as first", this );
+        d->reserve->bind( 1, d->m->id() );
+        d->reserve->bind( 2, d->total );
+        d->t->enqueue( d->reserve );
+        Mailbox::refreshMailboxes( d->t );
+        d->t->commit();
+        d->state = 4;
+    }
+
+    if ( d->state == 4 ) {
+        if ( !d->t->done() )
+            return;
+
+        Row * r = d->reserve->nextRow();
+        if ( d->t->failed() || !r )
+            error( "Couldn't reserve UIDs for the undeleted messages: " +
+                   d->t->error() );
+        d->first = r->getInt( "first" );
+        d->t = 0;
+        d->state = 5;
+    }
+
+    while ( d->state == 5 ) {
+        if ( d->t ) {
+            if ( !d->t->done() )
+                return;
+            if ( d->t->failed() )
+                error( "Undelete failed after restoring " +
+                       fn( d->restored ) + " of " + fn( d->total ) +
+                       " messages: " + d->t->error() + "\n"
+                       "Rerun the command to restore the rest." );
+            d->restored += d->chunk->rows();
+            d->t = 0;
+            printf( "aox: Restored %d of %d messages\n",
+                    d->restored, d->total );
+            fflush( stdout );
+        }
+
+        if ( d->remaining.isEmpty() ) {
+            d->state = 6;
+            break;
+        }
+
+        IntegerSet chunk;
+        uint last = d->remaining.largest();
+        if ( d->remaining.count() > chunkSize )
+            last = d->remaining.value( chunkSize );
+        chunk.add( d->remaining.smallest(), last );
+        chunk = chunk.intersection( d->remaining );
+        d->remaining.remove( d->remaining.smallest(), last );
+
+        d->t = new Transaction( this );
 
-        q = new Query( "insert into mailbox_messages "
-                       "(mailbox,uid,message,modseq) "
-                       "select $1,nextval('s'),message,$2 "
-                       "from deleted_messages "
-                       "where mailbox=$1 and uid=any($3)", 0 );
+        Query * q = new Query( "update mailboxes "
+                               "set nextmodseq=nextmodseq+1 "
+                               "where id=$1", 0 );
         q->bind( 1, d->m->id() );
-        q->bind( 2, modseq );
-        q->bind( 3, s );
         d->t->enqueue( q );
 
+        // messages that vanished since the search (e.g. because
+        // someone else restored them) simply leave unused UIDs.
+        d->chunk = new Query( "insert into mailbox_messages "
+                              "(mailbox,uid,message,modseq) "
+                              "select $1,"
+                              "$2+row_number() over (order by dm.uid)-1,"
+                              "dm.message,"
+                              "(select nextmodseq-1 from mailboxes"
+                              " where id=$1) "
+                              "from deleted_messages dm "
+                              "where dm.mailbox=$1 and dm.uid=any($3)", 0 );
+        d->chunk->bind( 1, d->m->id() );
+        d->chunk->bind( 2, d->first + d->attempted );
+        d->chunk->bind( 3, chunk );
+        d->t->enqueue( d->chunk );
+
         q = new Query( "delete from deleted_messages "
                        "where mailbox=$1 and uid=any($2)", 0 );
         q->bind( 1, d->m->id() );
-        q->bind( 2, s );
-        d->t->enqueue( q );
-
-        q = new Query( "update mailboxes "
-                       "set uidnext=nextval('s'), nextmodseq=$1 "
-                       "where id=$2", 0 );
-        q->bind( 1, modseq + 1 );
-        q->bind( 2, d->m->id() );
+        q->bind( 2, chunk );
         d->t->enqueue( q );
 
-        d->t->enqueue( new Query( "drop sequence s", 0 ) );
+        d->t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+        d->t->commit();
 
-        Mailbox::refreshMailboxes( d->t );
-
-        if ( opt( 'n' ) ) {
-            printf( "aox: Cancelling undeleting due to -n. Rerun without -n to actually undelete.\n" );
-            d->t->rollback();
-        }
-        else {
-            d->t->commit();
-        }
-        d->state = 4;
+        d->attempted += chunk.count();
     }
 
-    if ( d->state == 4 ) {
-        if ( !d->t->done() )
-            return;
-
-        if ( d->t->failed() )
-            error( "Undelete failed." );
+    if ( d->state == 6 ) {
+        if ( d->restored < d->total )
+            printf( "aox: %d messages were no longer deleted\n",
+                    d->total - d->restored );
         finish();
     }
 }
@@ -18,6 +18,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h> // fork()
+#include <sys/wait.h> // waitpid()
 
 
 static uint verbosity = 0;
@@ -37,13 +39,17 @@ int main( int ac, char ** av )
     Log * l = new Log;
     Allocator::addEternal( l, "aoxexport log" );
     global.setLog( l );
-    LogClient::setup( "aoxexport" );
-
-    Configuration::report();
 
+    bool compress = false;
+    bool anonymise = false;
+    EString maildir;
+    uint parallel = 2;
+    uint processes = 1;
+    uint sample = 0;
     int i = 1;
     while( i < ac && *av[i] == '-' ) {
         uint j = 1;
+        bool argument = false;
         while ( av[i][j] ) {
             switch( av[i][j] ) {
             case 'v':
@@ -53,14 +59,52 @@ int main( int ac, char ** av )
                 if ( verbosity )
                     verbosity--;
                 break;
+            case 'z':
+                compress = true;
+                break;
+            case 'a':
+                anonymise = true;
+                break;
+            case 'd':
+            case 'j':
+            case 'n':
+            case 'p':
+                // these take the next argument, so must come last
+                if ( argument || av[i][j+1] || i + 1 >= ac ) {
+                    bad = true;
+                }
+                else if ( av[i][j] != 'd' ) {
+                    bool ok = false;
+                    uint n = EString( av[i+1] ).number( &ok );
+                    if ( !ok || !n )
+                        bad = true;
+                    else if ( av[i][j] == 'j' )
+                        parallel = n;
+                    else if ( av[i][j] == 'n' )
+                        sample = n;
+                    else
+                        processes = n;
+                }
+                else {
+                    maildir = av[i+1];
+                }
+                argument = true;
+                break;
             default:
                 bad = true;
                 break;
             }
             j++;
         }
+        if ( argument )
+            i++;
         i++;
     }
+    if ( compress && !maildir.isEmpty() )
+        bad = true;
+    // several processes can share a maildir, but not stdout
+    if ( processes > 1 && maildir.isEmpty() )
+        bad = true;
 
     Utf8Codec c;
     UString source;
@@ -82,7 +126,8 @@ int main( int ac, char ** av )
 
     if ( bad ) {
         fprintf( stderr,
-                 "Usage: %s [-vq] [mailbox] [search]"
+                 "Usage: %s [-vqza] [-d maildir] [-j batches] "
+                 "[-n count] [-p processes] [mailbox] [search]\n"
                  "See aoxexport(8) or "
                  "http://aox.org/aoxexport/ for details.\n", av[0] );
         exit( -1 );
@@ -96,14 +141,57 @@ int main( int ac, char ** av )
         exit( -1 );
     }
 
+    // each process makes its own connections, so the children are
+    // started before any connection exists.
+    uint share = 0;
+    uint children = 0;
+    uint k = 1;
+    while ( k < processes ) {
+        pid_t p = fork();
+        if ( p < 0 ) {
+            fprintf( stderr, "%s: Could not start worker process\n",
+                     av[0] );
+            exit( -1 );
+        }
+        if ( p == 0 ) {
+            share = k;
+            children = 0;
+            break;
+        }
+        children++;
+        k++;
+    }
+
+    LogClient::setup( "aoxexport" );
+
+    Configuration::report();
+
     Entropy::setup();
     Database::setup();
 
     Exporter * e = new Exporter( source, which );
+    if ( compress )
+        e->setFormat( Exporter::CompressedMbox );
+    else if ( !maildir.isEmpty() )
+        e->setFormat( Exporter::Maildir, maildir );
+    e->setParallelism( parallel );
+    e->setAnonymised( anonymise );
+    e->setSample( sample );
+    e->setShare( share, processes );
 
     Mailbox::setup( e );
 
     EventLoop::global()->start();
 
-    return 0;
+    int status = 0;
+    while ( children ) {
+        int s = 0;
+        if ( ::wait( &s ) < 0 )
+            break;
+        if ( !WIFEXITED( s ) || WEXITSTATUS( s ) )
+            status = 1;
+        children--;
+    }
+
+    return status;
 }
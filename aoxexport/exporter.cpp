@@ -2,6 +2,8 @@
 
 #include "exporter.h"
 
+#include "configuration.h"
+#include "integerset.h"
 #include "eventloop.h"
 #include "selector.h"
 #include "address.h"
@@ -11,9 +13,21 @@
 #include "query.h"
 #include "date.h"
 #include "list.h"
+#include "file.h"
 #include "map.h"
 
-#include <unistd.h> // write()
+#include <unistd.h> // write(), getpid()
+#include <stdio.h> // rename()
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h> // mkdir()
+#include <sys/types.h>
+
+#include <zlib.h>
+
+
+// the number of messages fetched at a time
+static const uint batchSize = 256;
 
 
 class ExporterData
@@ -21,17 +35,39 @@ class ExporterData
 {
 public:
     ExporterData()
-        : find( 0 ), fetcher( 0 ),
+        : find( 0 ),
           mailbox( 0 ), selector( 0 ),
-          messages( new List<Message> )
+          format( Exporter::Mbox ), parallel( 2 ),
+          anonymised( false ), sample( 0 ), share( 0 ), shares( 1 ),
+          started( false ), written( 0 ), gz( 0 )
         {}
 
+    class Batch
+        : public Garbage
+    {
+    public:
+        Batch(): fetcher( 0 ) {}
+
+        List<Message> messages;
+        Fetcher * fetcher;
+    };
+
     Query * find;
-    Fetcher * fetcher;
     UString sourceName;
     Mailbox * mailbox;
     Selector * selector;
-    List<Message> * messages;
+    Exporter::Format format;
+    EString directory;
+    uint parallel;
+    bool anonymised;
+    uint sample;
+    uint share;
+    uint shares;
+    bool started;
+    IntegerSet ids;
+    List<Batch> batches;
+    uint written;
+    gzFile gz;
 };
 
 
@@ -50,6 +86,9 @@ static const char * weekdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu",
 
     If \a source is nonempty, but not a valid name, then the Exporter
     will kill the program with a disaster.
+
+    The messages are fetched a few hundred at a time, so the memory
+    used doesn't depend on the number of messages exported.
 */
 
 Exporter::Exporter( const UString & source, Selector * selector )
@@ -61,6 +100,71 @@ Exporter::Exporter( const UString & source, Selector * selector )
 }
 
 
+/*! Instructs this Exporter to write \a f. The default is Mbox, to
+    stdout. CompressedMbox writes gzip-compressed mbox to stdout, and
+    Maildir writes one file per message into the maildir \a directory,
+    which is created if necessary.
+*/
+
+void Exporter::setFormat( Format f, const EString & directory )
+{
+    d->format = f;
+    d->directory = directory;
+}
+
+
+/*! Instructs this Exporter to keep up to \a n batches of messages
+    being fetched while it writes. The default is 2, so that the next
+    batch is fetched while one is written.
+*/
+
+void Exporter::setParallelism( uint n )
+{
+    if ( n < 1 )
+        n = 1;
+    d->parallel = n;
+}
+
+
+/*! Instructs this Exporter to write each message in the anonymised
+    form EString::anonymised() produces if \a a is true, and as stored
+    if \a a is false (the default).
+*/
+
+void Exporter::setAnonymised( bool a )
+{
+    d->anonymised = a;
+}
+
+
+/*! Instructs this Exporter to write only \a n of the matching
+    messages, chosen at even intervals among them. 0, the default,
+    means to write all of them.
+*/
+
+void Exporter::setSample( uint n )
+{
+    d->sample = n;
+}
+
+
+/*! Instructs this Exporter to write only its share of the messages,
+    as number \a i (counting from 0) of \a n Exporters working on the
+    same search. Each of the \a n writes every nth message, so
+    together they write each message once.
+
+    This lets several processes share the work of a large export.
+*/
+
+void Exporter::setShare( uint i, uint n )
+{
+    if ( n < 1 )
+        n = 1;
+    d->share = i % n;
+    d->shares = n;
+}
+
+
 void Exporter::execute()
 {
     if ( Mailbox::refreshing() ) {
@@ -88,80 +192,216 @@ void Exporter::execute()
     if ( !d->find->done() )
         return;
 
-    if ( !d->fetcher ) {
-        d->messages = new List<Message>;
-        while ( d->find->hasResults() ) {
-            Row * r = d->find->nextRow();
-            Message * m = new Message;
-            m->setDatabaseId( r->getInt( "message" ) );
-            d->messages->append( m );
+    if ( !d->started ) {
+        d->started = true;
+        while ( d->find->hasResults() )
+            d->ids.add( d->find->nextRow()->getInt( "message" ) );
+        selectShare();
+        if ( !start() ) {
+            EventLoop::global()->stop();
+            return;
         }
-        d->fetcher = new Fetcher( d->messages, this, 0 );
-        d->fetcher->fetch( Fetcher::Addresses );
-        d->fetcher->fetch( Fetcher::OtherHeader );
-        d->fetcher->fetch( Fetcher::Body );
-        d->fetcher->fetch( Fetcher::Trivia );
-        d->fetcher->execute();
     }
 
-    while ( !d->messages->isEmpty() ) {
-        Message * m = d->messages->firstElement();
-        if ( !m->hasAddresses() )
-            return;
-        if ( !m->hasHeaders() )
-            return;
-        if ( !m->hasBodies() )
-            return;
-        if ( !m->hasTrivia() )
-            return;
-        d->messages->shift();
-        EString from = "From ";
-        Header * h = m->header();
-        List<Address> * rp = 0;
-        if ( h ) {
-            rp = h->addresses( HeaderField::ReturnPath );
-            if ( !rp )
-                rp = h->addresses( HeaderField::Sender );
-            if ( !rp )
-                rp = h->addresses( HeaderField::From );
+    while ( d->batches.count() < d->parallel && !d->ids.isEmpty() )
+        fetchBatch();
+
+    while ( !d->batches.isEmpty() ) {
+        ExporterData::Batch * b = d->batches.firstElement();
+        while ( !b->messages.isEmpty() ) {
+            Message * m = b->messages.firstElement();
+            bool raw = !m->rawText().isEmpty();
+            if ( !raw && !m->hasAddresses() )
+                return;
+            if ( !raw && !m->hasHeaders() )
+                return;
+            if ( !raw && !m->hasBodies() )
+                return;
+            if ( !m->hasTrivia() )
+                return;
+            b->messages.shift();
+            write( m );
         }
-        if ( rp )
-            from.append( rp->firstElement()->lpdomain() );
-        else
-            from.append( "invalid@invalid.invalid" );
-        from.append( "  " );
-        Date id;
-        if ( m->internalDate() )
-            id.setUnixTime( m->internalDate() );
-        else if ( m->header()->date() )
-            id = *m->header()->date();
-        // Tue Jul 23 19:39:23 2002
-        from.append( weekdays[id.weekday()] );
-        from.append( " " );
-        from.append( months[id.month()-1] );
-        from.append( " " );
-        from.appendNumber( id.day() );
-        from.append( " " );
-        from.appendNumber( id.hour() );
-        from.append( ":" );
-        if ( id.minute() < 10 )
-            from.append( "0" );
-        from.appendNumber( id.minute() );
-        from.append( ":" );
-        if ( id.second() < 10 )
-            from.append( "0" );
-        from.appendNumber( id.second() );
-        from.append( " " );
-        from.appendNumber( id.year() );
-        from.append( "\r\n" );
-        EString rfc822 = m->rfc822( false );
-        int r = ::write( 1, from.data(), from.length() ) +
-                ::write( 1, rfc822.data(), rfc822.length() );
-        // we don't really care whether the write succeeds or not, so
-        // just fool the compiler.
-        r = r;
+        d->batches.shift();
+        if ( !d->ids.isEmpty() )
+            fetchBatch();
     }
 
+    if ( d->gz )
+        ::gzclose( d->gz );
+    d->gz = 0;
+
     EventLoop::global()->stop();
 }
 
+
+/*! Reduces the set of messages to be written to the sample and share
+    requested by setSample() and setShare(). The choice depends only
+    on the set of matching messages, so Exporters working on the same
+    search make the same choice.
+*/
+
+void Exporter::selectShare()
+{
+    uint c = d->ids.count();
+    uint n = c;
+    if ( d->sample && d->sample < c )
+        n = d->sample;
+    if ( n == c && d->shares == 1 )
+        return;
+
+    IntegerSet r;
+    uint i = d->share;
+    while ( i < n ) {
+        r.add( d->ids.value( 1 + (uint)( (int64)i * c / n ) ) );
+        i += d->shares;
+    }
+    d->ids = r;
+}
+
+
+/*! Starts fetching the next batch of messages. */
+
+void Exporter::fetchBatch()
+{
+    ExporterData::Batch * b = new ExporterData::Batch;
+    uint n = 0;
+    while ( n < batchSize && !d->ids.isEmpty() ) {
+        uint id = d->ids.smallest();
+        d->ids.remove( id );
+        Message * m = new Message;
+        m->setDatabaseId( id );
+        b->messages.append( m );
+        n++;
+    }
+    d->batches.append( b );
+
+    b->fetcher = new Fetcher( &b->messages, this, 0 );
+    b->fetcher->fetch( Fetcher::Addresses );
+    b->fetcher->fetch( Fetcher::OtherHeader );
+    b->fetcher->fetch( Fetcher::Body );
+    b->fetcher->fetch( Fetcher::Trivia );
+    // the mbox From line needs the addresses, maildir needs nothing
+    // beyond the text itself
+    if ( d->format == Maildir )
+        b->fetcher->fetch( Fetcher::Raw );
+    b->fetcher->execute();
+}
+
+
+/*! Prepares the output, and returns true if that works and false if
+    there's no point in fetching anything.
+*/
+
+bool Exporter::start()
+{
+    if ( d->format == CompressedMbox ) {
+        d->gz = ::gzdopen( 1, "wb" );
+        if ( !d->gz ) {
+            log( "Cannot compress output", Log::Disaster );
+            return false;
+        }
+    }
+    else if ( d->format == Maildir ) {
+        const char * subdirs[] = { "", "/tmp", "/new", "/cur" };
+        uint i = 0;
+        while ( i < 4 ) {
+            EString n = d->directory + subdirs[i];
+            if ( ::mkdir( n.cstr(), 0700 ) < 0 && errno != EEXIST ) {
+                log( "Cannot create " + n, Log::Disaster );
+                return false;
+            }
+            i++;
+        }
+    }
+    return true;
+}
+
+
+/*! Writes \a m in the selected format. */
+
+void Exporter::write( Message * m )
+{
+    EString rfc822 = m->rfc822( false );
+    if ( d->anonymised )
+        rfc822 = rfc822.anonymised();
+    d->written++;
+
+    if ( d->format == Maildir ) {
+        // the usual maildir name, time.pid_n.host, written in tmp
+        // and moved to new when complete
+        EString n = fn( (uint)time( 0 ) );
+        n.append( "." );
+        n.appendNumber( getpid() );
+        n.append( "_" );
+        n.appendNumber( d->written );
+        n.append( "." );
+        n.append( Configuration::hostname() );
+        EString tmp = d->directory + "/tmp/" + n;
+        {
+            File f( tmp, File::ExclusiveWrite, 0600 );
+            if ( !f.valid() ) {
+                log( "Cannot write " + tmp, Log::Disaster );
+                return;
+            }
+            f.write( rfc822 );
+        }
+        EString target = d->directory + "/new/" + n;
+        if ( ::rename( tmp.cstr(), target.cstr() ) < 0 )
+            log( "Cannot rename " + tmp + " to " + target,
+                 Log::Disaster );
+        return;
+    }
+
+    EString from = "From ";
+    Header * h = m->header();
+    List<Address> * rp = 0;
+    if ( h ) {
+        rp = h->addresses( HeaderField::ReturnPath );
+        if ( !rp )
+            rp = h->addresses( HeaderField::Sender );
+        if ( !rp )
+            rp = h->addresses( HeaderField::From );
+    }
+    if ( rp )
+        from.append( rp->firstElement()->lpdomain() );
+    else
+        from.append( "invalid@invalid.invalid" );
+    from.append( "  " );
+    Date id;
+    if ( m->internalDate() )
+        id.setUnixTime( m->internalDate() );
+    else if ( m->header()->date() )
+        id = *m->header()->date();
+    // Tue Jul 23 19:39:23 2002
+    from.append( weekdays[id.weekday()] );
+    from.append( " " );
+    from.append( months[id.month()-1] );
+    from.append( " " );
+    from.appendNumber( id.day() );
+    from.append( " " );
+    from.appendNumber( id.hour() );
+    from.append( ":" );
+    if ( id.minute() < 10 )
+        from.append( "0" );
+    from.appendNumber( id.minute() );
+    from.append( ":" );
+    if ( id.second() < 10 )
+        from.append( "0" );
+    from.appendNumber( id.second() );
+    from.append( " " );
+    from.appendNumber( id.year() );
+    from.append( "\r\n" );
+
+    if ( d->gz ) {
+        ::gzwrite( d->gz, from.data(), from.length() );
+        ::gzwrite( d->gz, rfc822.data(), rfc822.length() );
+        return;
+    }
+
+    int r = ::write( 1, from.data(), from.length() ) +
+            ::write( 1, rfc822.data(), rfc822.length() );
+    // we don't really care whether the write succeeds or not, so
+    // just fool the compiler.
+    r = r;
+}
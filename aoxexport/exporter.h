@@ -4,6 +4,7 @@
 #define EXPORTER_H
 
 #include "event.h"
+#include "estring.h"
 
 class Selector;
 class UString;
@@ -15,10 +16,22 @@ class Exporter
 public:
     Exporter( const UString &, Selector * );
 
+    enum Format { Mbox, CompressedMbox, Maildir };
+    void setFormat( Format, const EString & = "" );
+    void setParallelism( uint );
+    void setAnonymised( bool );
+    void setSample( uint );
+    void setShare( uint, uint );
+
     void execute();
 
 private:
     class ExporterData * d;
+
+    bool start();
+    void selectShare();
+    void fetchBatch();
+    void write( class Message * );
 };
 
 #endif
@@ -36,9 +36,12 @@ int main( int ac, char ** av )
 
     Configuration::report();
 
+    uint workers = 1;
+    EString checkpoints;
     int i = 1;
     while( i < ac && *av[i] == '-' ) {
         uint j = 1;
+        bool argument = false;
         while ( av[i][j] ) {
             switch( av[i][j] ) {
             case 'v':
@@ -50,12 +53,31 @@ int main( int ac, char ** av )
             case 'e':
                 Migrator::setErrorCopies( true );
                 break;
+            case 'j':
+            case 'c':
+                // these take the next argument, so must come last
+                if ( argument || av[i][j+1] || i + 1 >= ac ) {
+                    bad = true;
+                }
+                else if ( av[i][j] == 'j' ) {
+                    bool ok = false;
+                    workers = EString( av[i+1] ).number( &ok );
+                    if ( !ok || !workers )
+                        bad = true;
+                }
+                else {
+                    checkpoints = av[i+1];
+                }
+                argument = true;
+                break;
             default:
                 bad = true;
                 break;
             }
             j++;
         }
+        if ( argument )
+            i++;
         i++;
     }
 
@@ -81,13 +103,16 @@ int main( int ac, char ** av )
         Allocator::addEternal( m, "migrator" );
         Utf8Codec c;
         m->setDestination( c.toUnicode( destination ) );
+        m->setWorkers( workers );
+        if ( !checkpoints.isEmpty() )
+            m->setCheckpointFile( checkpoints );
         while ( i < ac )
             m->addSource( av[i++] );
     }
 
     if ( bad ) {
         fprintf( stderr,
-                 "Usage: %s [-vq] "
+                 "Usage: %s [-vqe] [-j workers] [-c checkpoint-file] "
                  "<mailbox> <type> <source [, source ...]>\n"
                  "See aoximport(8) for details.\n", av[0] );
         exit( -1 );
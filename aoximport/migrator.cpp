@@ -4,6 +4,7 @@
 
 #include "file.h"
 #include "list.h"
+#include "dict.h"
 #include "flag.h"
 #include "timer.h"
 #include "scope.h"
@@ -33,20 +34,26 @@ class MigratorData
 {
 public:
     MigratorData()
-        : working( 0 ),
+        : workers( 1 ),
           messagesDone( 0 ), mailboxesDone( 0 ),
           mode( Migrator::Mbox ),
-          startup( (uint)time( 0 ) )
+          startup( (uint)time( 0 ) ),
+          checkpoints( 0 )
     {}
 
     UString destination;
     List< MigratorSource > sources;
-    MailboxMigrator * working;
+    EStringList sourceNames;
+    List< MailboxMigrator > working;
+    uint workers;
 
     uint messagesDone;
     uint mailboxesDone;
     Migrator::Mode mode;
     uint startup;
+
+    EString checkpointFile;
+    Dict<EString> * checkpoints;
 };
 
 
@@ -57,8 +64,12 @@ public:
 
     Its API consists of the two functions start() and running(). The
     execute() function does the heavy loading, by ensuring that the
-    Migrator always has four MailboxMigrator objects working. (The
+    Migrator always has workers() MailboxMigrator objects working. (The
     MailboxMigrator objects must call execute() when they're done.)
+
+    If setCheckpointFile() is used, the Migrator records its progress
+    in a file, and skips whatever that file says is already done, so
+    a long migration can be restarted.
 */
 
 
@@ -93,6 +104,7 @@ UString Migrator::destination() const
 
 void Migrator::addSource( const EString &s )
 {
+    d->sourceNames.append( s );
     switch( d->mode ) {
     case Mbox:
         d->sources.append( new MboxDirectory( s ) );
@@ -110,34 +122,118 @@ void Migrator::addSource( const EString &s )
 }
 
 
-/*! Finds another mailbox to migrate.
+/*! Instructs this Migrator to migrate \a n mailboxes at a time. The
+    default is 1. The memory limit is shared between them.
+*/
+
+void Migrator::setWorkers( uint n )
+{
+    if ( n < 1 )
+        n = 1;
+    d->workers = n;
+}
+
+
+/*! Returns the number of mailboxes migrated at a time, as set by
+    setWorkers().
+*/
+
+uint Migrator::workers() const
+{
+    return d->workers;
+}
+
+
+/*! Instructs this Migrator to record its progress in the file named
+    \a name, and to skip whatever that file says was migrated by an
+    earlier run.
+
+    The file contains one line for each chunk of messages committed,
+    giving the number of messages migrated from a mailbox so far (or
+    "done" once the mailbox is finished), the source and the mailbox's
+    partial name, separated by tabs. The last line about a mailbox
+    wins.
+*/
+
+void Migrator::setCheckpointFile( const EString & name )
+{
+    d->checkpointFile = name;
+    d->checkpoints = new Dict<EString>;
+
+    File f( name, File::Read );
+    if ( !f.valid() )
+        return;
+    EStringList::Iterator i( f.lines() );
+    while ( i ) {
+        EString l = i->stripCRLF();
+        int t = l.find( '\t' );
+        if ( t > 0 )
+            d->checkpoints->insert( l.mid( t + 1 ),
+                                    new EString( l.mid( 0, t ) ) );
+        ++i;
+    }
+}
+
+
+/*! Records in the checkpoint file that the mailbox identified by \a
+    key has progressed to \a state, which is either a number of
+    messages or "done". Does nothing unless setCheckpointFile() has
+    been called.
+*/
+
+void Migrator::checkpoint( const EString & key, const EString & state )
+{
+    if ( d->checkpointFile.isEmpty() )
+        return;
+    File f( d->checkpointFile, File::Append );
+    f.write( state + "\t" + key + "\n" );
+}
+
+
+/*! Finds more mailboxes to migrate, until workers() are working.
 */
 
 void Migrator::execute()
 {
-    if ( d->working && d->working->done() ) {
-        d->messagesDone += d->working->migrated();
-        d->mailboxesDone++;
-        d->working = 0;
+    List<MailboxMigrator>::Iterator w( d->working );
+    while ( w ) {
+        MailboxMigrator * m = w;
+        if ( m->done() ) {
+            d->messagesDone += m->migrated();
+            d->mailboxesDone++;
+            if ( m->error().isEmpty() )
+                checkpoint( m->checkpointKey(), "done" );
+            d->working.take( w );
+        }
+        else {
+            ++w;
+        }
     }
 
-    while ( !d->working && !d->sources.isEmpty() ) {
+    while ( d->working.count() < d->workers && !d->sources.isEmpty() ) {
         MigratorSource * source = d->sources.first();
         MigratorMailbox * m( source->nextMailbox() );
         if ( m ) {
-            MailboxMigrator * n = new MailboxMigrator( m, this );
-            if ( n->valid() ) {
-                d->working = n;
-                n->execute();
-                return;
+            EString key = *d->sourceNames.first() + "\t" + m->partialName();
+            EString * state = 0;
+            if ( d->checkpoints )
+                state = d->checkpoints->find( key );
+            if ( !state || *state != "done" ) {
+                MailboxMigrator * n = new MailboxMigrator( m, this );
+                if ( n->valid() ) {
+                    n->resume( key, state ? state->number( 0 ) : 0 );
+                    d->working.append( n );
+                    n->execute();
+                }
             }
         }
         else {
             d->sources.shift();
+            d->sourceNames.shift();
         }
     }
 
-    if ( d->working )
+    if ( !d->working.isEmpty() )
         return;
 
     if ( Database::idle() )
@@ -353,7 +449,7 @@ public:
           migrator( 0 ),
           validated( false ), valid( false ),
           injector( 0 ),
-          migrated( 0 ), migrating( 0 )
+          migrated( 0 ), migrating( 0 ), resumed( 0 )
     {}
 
     MigratorMailbox * source;
@@ -365,6 +461,8 @@ public:
     Injector * injector;
     uint migrated;
     uint migrating;
+    uint resumed;
+    EString key;
     EString error;
     Log log;
 };
@@ -422,13 +520,21 @@ bool MailboxMigrator::valid() const
 
 void MailboxMigrator::execute()
 {
-    if ( d->injector && !d->injector->done() )
+    Scope x( &d->log );
+
+    if ( d->injector && d->injector->committing() && d->messages.isEmpty() ) {
+        // read the next chunk while the database works on this one
+        readChunk();
         return;
+    }
 
-    Scope x( &d->log );
+    if ( d->injector && !d->injector->done() )
+        return;
 
     if ( d->injector && d->injector->failed() ) {
         d->error = "Database error: " + d->injector->error();
+        d->injector = 0;
+        d->messages.clear();
         d->migrator->execute();
         return;
     }
@@ -436,6 +542,7 @@ void MailboxMigrator::execute()
         d->migrated += d->migrating;
         d->migrating = 0;
         d->injector = 0;
+        d->migrator->checkpoint( d->key, fn( d->resumed + d->migrated ) );
     }
     else if ( !d->destination ) {
         UString tmp = d->migrator->destination();
@@ -448,14 +555,8 @@ void MailboxMigrator::execute()
         d->destination = Mailbox::obtain( tmp, true );
     }
 
-    uint limit = EventLoop::global()->memoryUsage();
-    uint before = Allocator::allocated();
-    MigratorMessage * mm = 0;
-    do {
-        mm = d->source->nextMessage();
-        if ( mm )
-            d->messages.append( mm );
-    } while ( mm && Allocator::allocated() * 2 - before < limit );
+    if ( d->messages.isEmpty() )
+        readChunk();
 
     uint done = d->migrator->messagesMigrated();
     if ( done && d->migrator->uptime() ) {
@@ -481,10 +582,11 @@ void MailboxMigrator::execute()
             ++i;
         }
         d->injector = new Injector( this );
+        d->injector->notifyWhenCommitting();
         d->injector->addInjection( messages );
-        d->injector->execute();
         d->migrating = d->messages.count();
         d->messages.clear();
+        d->injector->execute();
     }
     else {
         d->migrator->execute();
@@ -492,6 +594,25 @@ void MailboxMigrator::execute()
 }
 
 
+/*! Reads the next chunk of messages from the source, as many as fit
+    in half this MailboxMigrator's share of the memory we may use. The
+    other half is for the chunk being injected meanwhile.
+*/
+
+void MailboxMigrator::readChunk()
+{
+    uint limit = EventLoop::global()->memoryUsage() / 2 /
+                 d->migrator->workers();
+    uint before = Allocator::allocated();
+    MigratorMessage * mm = 0;
+    do {
+        mm = d->source->nextMessage();
+        if ( mm )
+            d->messages.append( mm );
+    } while ( mm && Allocator::allocated() * 2 - before < limit );
+}
+
+
 /*! Returns true if this mailbox has processed every message in its
     source to completion, and false if there may be something left to
     do.
@@ -503,10 +624,33 @@ bool MailboxMigrator::done() const
         return false;
     if ( !d->messages.isEmpty() )
         return false;
+    if ( d->injector )
+        return false;
     return true;
 }
 
 
+/*! Records that this MailboxMigrator is identified by \a key in the
+    Migrator's checkpoint file, and skips the first \a done messages
+    in the source, since an earlier run migrated those already.
+*/
+
+void MailboxMigrator::resume( const EString & key, uint done )
+{
+    d->key = key;
+    while ( d->resumed < done && d->source->nextMessage() )
+        d->resumed++;
+}
+
+
+/*! Returns the key set by resume(). */
+
+EString MailboxMigrator::checkpointKey() const
+{
+    return d->key;
+}
+
+
 /*! Returns the number of messages successfully migrated so far. */
 
 uint MailboxMigrator::migrated() const
@@ -530,14 +674,17 @@ EString MailboxMigrator::error() const
 uint Migrator::messagesMigrated() const
 {
     uint n = d->messagesDone;
-    if ( d->working )
-        n += d->working->migrated();
+    List<MailboxMigrator>::Iterator i( d->working );
+    while ( i ) {
+        n += i->migrated();
+        ++i;
+    }
     return n;
 }
 
 
 /*! Returns the number of mailboxes completely processed so far. The
-    mailbox currently being processed is not counted here.
+    mailboxes currently being processed are not counted here.
 */
 
 uint Migrator::mailboxesMigrated() const
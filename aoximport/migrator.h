@@ -25,6 +25,12 @@ public:
     uint messagesMigrated() const;
     uint mailboxesMigrated() const;
 
+    void setWorkers( uint );
+    uint workers() const;
+
+    void setCheckpointFile( const EString & );
+    void checkpoint( const EString &, const EString & );
+
     static void setVerbosity( uint );
     static uint verbosity();
 
@@ -102,8 +108,13 @@ public:
 
     uint migrated() const;
 
+    void resume( const EString &, uint );
+    EString checkpointKey() const;
+
 private:
     class MailboxMigratorData * d;
+
+    void readChunk();
 };
 
 
@@ -11,6 +11,7 @@
 #include "tlsthread.h"
 #include "flag.h"
 #include "event.h"
+#include "helperrowcreator.h"
 #include "cache.h"
 #include "mailbox.h"
 #include "listener.h"
@@ -19,6 +20,9 @@
 #include "selector.h"
 #include "managesieve.h"
 #include "spoolmanager.h"
+#include "maintainer.h"
+#include "reaper.h"
+#include "sharedcache.h"
 #include "entropy.h"
 #include "egd.h"
 
@@ -28,21 +32,37 @@
 #include <stdlib.h> // exit()
 
 #include <time.h> // time()
+#include <sys/time.h> // gettimeofday()
 
 
 /*! \nodoc */
 
 
+static int64 now()
+{
+    struct timeval tv;
+    ::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
 class StartupWatcher
     : public EventHandler
 {
 public:
-    StartupWatcher(): EventHandler() {}
+    StartupWatcher( const char * p )
+        : EventHandler(), phase( p ), started( now() ) {}
     void execute() {
         if ( Log::disastersYet() )
             ::exit( 1 );
+        if ( phase )
+            ::log( EString( "Startup: " ) + phase + " took " +
+                   fn( now() - started ) + "ms", Log::Info );
+        phase = 0;
         EventLoop::global()->setStartup( false );
     }
+    const char * phase;
+    int64 started;
 };
 
 
@@ -157,6 +177,35 @@ int main( int argc, char *argv[] )
         }
     }
 
+    EString cl( Configuration::text( Configuration::ConnectionLog ).lower() );
+    if ( cl != "database" && cl != "logfile" && cl != "none" )
+        log( "Invalid value for connection-log: " + cl, Log::Disaster );
+
+
+    EString bd( Configuration::text( Configuration::BlobDir ) );
+    if ( !bd.isEmpty() ) {
+        struct stat st;
+        if ( ::stat( bd.cstr(), &st ) < 0 || !S_ISDIR( st.st_mode ) )
+            log( "Inaccessible blob-directory: " + bd, Log::Disaster );
+        else if ( security && !bd.startsWith( root ) )
+            log( "blob-directory must be under jail directory " + root,
+                 Log::Disaster );
+    }
+
+    EString cd( Configuration::text( Configuration::ColdStorageDir ) );
+    if ( !cd.isEmpty() ) {
+        struct stat st;
+        if ( ::stat( cd.cstr(), &st ) < 0 || !S_ISDIR( st.st_mode ) )
+            log( "Inaccessible cold-storage-directory: " + cd,
+                 Log::Disaster );
+        else if ( security && !cd.startsWith( root ) )
+            log( "cold-storage-directory must be under jail directory " +
+                 root, Log::Disaster );
+    }
+    else if ( Configuration::scalar( Configuration::ColdStorageAge ) ) {
+        log( "cold-storage-age is set, but cold-storage-directory is not",
+             Log::Disaster );
+    }
 
     EString sA( Configuration::text( Configuration::SmartHostAddress ) );
     uint sP( Configuration::scalar( Configuration::SmartHostPort ) );
@@ -281,25 +330,36 @@ int main( int argc, char *argv[] )
         "Statistics", Configuration::toggle( Configuration::UseStatistics ),
         Configuration::StatisticsAddress, Configuration::StatisticsPort
     );
+    Listener< MetricsDumper >::create(
+        "Metrics", Configuration::toggle( Configuration::UseStatistics ),
+        Configuration::StatisticsAddress, Configuration::MetricsPort
+    );
 
     EventLoop::global()->setMemoryUsage(
         1024 * 1024 * Configuration::scalar( Configuration::MemoryLimit ) );
 
+    // before the server processes are forked, so they all share it
+    SharedCache::setup();
+
     s.setup( Server::Finish );
 
     Database::setup();
 
-    StartupWatcher * w = new StartupWatcher;
-
-    Database::checkSchema( w );
+    // these run concurrently, each on its own database handle if
+    // there are enough
+    Database::checkSchema( new StartupWatcher( "schema check" ) );
     if ( security )
-        Database::checkAccess( w );
+        Database::checkAccess( new StartupWatcher( "access check" ) );
     EventLoop::global()->setStartup( true );
-    Mailbox::setup( w );
+    Mailbox::setup( new StartupWatcher( "mailbox tree" ),
+                    Configuration::toggle( Configuration::LazyMailboxTree ) );
 
     SpoolManager::setup();
+    Maintainer::setup();
+    Reaper::setup();
     Selector::setup();
     Flag::setup();
+    HelperRowCreator::setup();
     IMAP::setup();
 
     if ( !security )
@@ -0,0 +1,611 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "maintainer.h"
+
+#include "transaction.h"
+#include "configuration.h"
+#include "estringlist.h"
+#include "allocator.h"
+#include "blobstore.h"
+#include "integerset.h"
+#include "recipient.h"
+#include "database.h"
+#include "dbsignal.h"
+#include "selector.h"
+#include "timer.h"
+#include "query.h"
+#include "scope.h"
+#include "log.h"
+
+// time
+#include <time.h>
+
+// the advisory lock held by whichever process runs a batch
+#define MAINTENANCELOCK "2052"
+
+// no batch touches more rows than this, whatever maintenance-rate says
+static const uint maxBatch = 1000;
+// seconds between the end of one pass and the start of the next
+static const uint passInterval = 3600;
+// the longest we step aside for other database work, in seconds
+static const uint maxBackoff = 64;
+// the most bodyparts moved to cold storage per batch; each batch
+// holds all of their contents in RAM
+static const uint maxColdBatch = 50;
+
+
+static Maintainer * maintainer;
+
+
+class MaintainerData
+    : public Garbage
+{
+public:
+    MaintainerData()
+        : step( Deliveries ), t( 0 ), lock( 0 ), work( 0 ), r( 0 ),
+          fix( 0 ), cold( 0 ), move( 0 ), timer( 0 ), locked( false ),
+          backoff( 0 ), rows( 0 ), owner( 0 ), fixed( 0 ), bodypart( 0 ),
+          examined( 0 ), moved( 0 ), backfilled( 0 )
+    {}
+
+    enum Step {
+        Deliveries, Expiry, Retention, Emptying, Quotas, Cold, Backfills
+    };
+
+    Step step;
+    Transaction * t;
+    Query * lock;
+    Query * work;
+    RetentionSelector * r;
+    Query * fix;
+    Query * cold;
+    Query * move;
+    Timer * timer;
+    bool locked;
+    uint backoff;
+    uint rows;
+    uint owner;
+    uint fixed;
+    uint bodypart;
+    uint examined;
+    uint moved;
+    uint backfilled;
+};
+
+
+/*  Moves the messages in the temporary table rs to deleted_messages
+    as EXPUNGE would, giving \a reason, and drops rs. Returns the
+    query that moves the messages, whose owner is \a owner.
+*/
+
+static Query * expungeStaged( Transaction * t, const EString & reason,
+                              EventHandler * owner )
+{
+    t->enqueue( new Query( "select nextmodseq from mailboxes "
+                           "join rs on (mailboxes.id=rs.mailbox) "
+                           "order by id "
+                           "for update", 0 ) );
+    Query * q = new Query( "insert into deleted_messages "
+                           "(mailbox, uid, message,"
+                           " modseq, deleted_by, reason) "
+                           "select rs.mailbox, rs.uid, mm.message,"
+                           " m.nextmodseq, null, $1 "
+                           "from rs "
+                           "join mailbox_messages mm"
+                           " using (mailbox,uid) "
+                           "join mailboxes m on (rs.mailbox=m.id)",
+                           owner );
+    q->bind( 1, reason );
+    t->enqueue( q );
+    t->enqueue( new Query( "update mailboxes "
+                           "set nextmodseq=nextmodseq+1 "
+                           "where id in "
+                           "(select mailbox from rs)", 0 ) );
+    t->enqueue( new Query( "drop table rs", 0 ) );
+    return q;
+}
+
+
+/*  Starts the next pass soon when a mailbox has been deleted, so that
+    its messages don't linger (and count towards quotas) for an hour.
+*/
+
+class MaintainerWaker
+    : public EventHandler
+{
+public:
+    MaintainerWaker(): EventHandler() {
+        (void)new DatabaseSignal( "mailboxes_emptying", this );
+    }
+
+    void execute() {
+        if ( ::maintainer )
+            ::maintainer->wake();
+    }
+};
+
+
+/*! \class Maintainer maintainer.h
+
+    The Maintainer class does the routine cleanup that doesn't need
+    the database owner's privileges, in small batches and in the
+    background, so that nobody has to wait for it.
+
+    Once an hour it makes a pass, first deleting spooled deliveries
+    that were handled more than undelete-time days ago, then expiring
+    deleted_messages rows older than undelete-time days, then
+    applying the "delete" retention policies, moving the messages they
+    reject to deleted_messages just as EXPUNGE would, then emptying
+    the mailboxes that have been deleted (see Mailbox::remove()) the
+    same way, and finally checking quota_usage against mailbox_counts
+    and correcting any user whose usage has drifted (as it does when a
+    mailbox is given to another owner). If cold-storage-age is set,
+    the pass ends by moving the contents of old attachments to
+    cold-storage-directory (see moveToColdStorage()). Last, it applies
+    the updates left by online schema upgrades ("aox upgrade schema
+    -o") using run_schema_backfill(). Each batch is a transaction of
+    its own, touches at most maintenance-rate rows, and is followed by
+    a pause long enough to keep to that many rows per second. If
+    other queries are waiting for the database when a batch is due,
+    the Maintainer waits for up to a minute instead. Deleting a
+    mailbox starts the next pass early (see wake()).
+
+    All state lives in the database, so after a restart the next pass
+    simply finds whatever work is left. Each batch starts by taking an
+    advisory lock, so only one process does this work at a time.
+
+    Expiring deleted_messages needs privileges archiveopteryx doesn't
+    have, so that's done by the expire_deleted_messages() function.
+    The Reaper then removes the messages that nothing uses any more.
+*/
+
+Maintainer::Maintainer()
+    : d( new MaintainerData )
+{
+    setLog( new Log );
+    // give startup a minute before adding any work
+    d->timer = new Timer( this, 60 );
+}
+
+
+void Maintainer::execute()
+{
+    if ( !d->t ) {
+        if ( !d->timer || !d->timer->active() )
+            startBatch();
+        return;
+    }
+
+    if ( !d->lock->done() )
+        return;
+
+    if ( !d->locked ) {
+        Row * r = d->lock->nextRow();
+        if ( !r || !r->getBoolean( "ok" ) ) {
+            // the query failed, or another process is doing the work
+            if ( d->lock->failed() )
+                log( "Cannot lock for maintenance: " + d->lock->error(),
+                     Log::Error );
+            d->t->rollback();
+            d->t = 0;
+            wait( passInterval );
+            return;
+        }
+        d->locked = true;
+        enqueueWork();
+    }
+
+    if ( d->r && !d->r->done() )
+        return;
+
+    if ( d->cold ) {
+        if ( !d->cold->done() )
+            return;
+        moveToColdStorage();
+    }
+
+    if ( d->r && !d->work ) {
+        uint limit = Configuration::scalar( Configuration::MaintenanceRate );
+        if ( limit > maxBatch )
+            limit = maxBatch;
+
+        Selector * s = new Selector( Selector::And );
+        if ( d->r->deletes() ) {
+            s->add( d->r->deletes() );
+            if ( d->r->retains() ) {
+                Selector * n = new Selector( Selector::Not );
+                s->add( n );
+                n->add( d->r->retains() );
+            }
+            s->simplify();
+            EStringList wanted;
+            wanted.append( "mailbox" );
+            wanted.append( "uid" );
+
+            // this follows aox vacuum, one batch at a time
+            d->t->enqueue( new Query( "create temporary table rs ("
+                                      "mailbox integer, "
+                                      "uid integer )", 0 ) );
+            Query * iq = s->query( 0, 0, 0, 0, false, &wanted, false );
+            iq->setString( "insert into rs (mailbox,uid) " +
+                           iq->string() + " limit " + fn( limit ) );
+            d->t->enqueue( iq );
+            d->work = expungeStaged( d->t, "Retention policy", this );
+            d->t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+        }
+        d->r = 0;
+        d->t->commit();
+    }
+
+    if ( !d->t->done() )
+        return;
+
+    finishBatch();
+}
+
+
+/*! Starts the next batch of work, unless other database work is
+    waiting, in which case this waits a little longer each time.
+*/
+
+void Maintainer::startBatch()
+{
+    if ( Database::queueLength() ) {
+        if ( d->backoff )
+            d->backoff *= 2;
+        else
+            d->backoff = 1;
+        if ( d->backoff > maxBackoff )
+            d->backoff = maxBackoff;
+        wait( d->backoff );
+        return;
+    }
+    d->backoff = 0;
+
+    d->t = new Transaction( this );
+    d->t->setPriority( Query::Background );
+    d->lock = new Query( "select pg_try_advisory_xact_lock("
+                         MAINTENANCELOCK ") as ok", this );
+    d->t->enqueue( d->lock );
+    d->t->execute();
+}
+
+
+/*! Enqueues the work for the current step, once the lock is held. The
+    retention step first needs a RetentionSelector, so execute()
+    enqueues its work later.
+*/
+
+void Maintainer::enqueueWork()
+{
+    if ( d->step == MaintainerData::Retention ) {
+        d->r = new RetentionSelector( d->t, this );
+        d->r->execute();
+        d->t->execute();
+        return;
+    }
+
+    uint n = Configuration::scalar( Configuration::MaintenanceRate );
+    if ( n > maxBatch )
+        n = maxBatch;
+
+    if ( d->step == MaintainerData::Cold ) {
+        if ( n > maxColdBatch )
+            n = maxColdBatch;
+        // the next n bodyparts are examined, and those that only
+        // old messages use are moved. work finds where the next
+        // batch starts.
+        EString next( "select id from bodyparts where id>$1 "
+                      "order by id limit " + fn( n ) );
+        d->work = new Query( "select max(id) as last from (" + next +
+                             ") b", this );
+        d->work->bind( 1, d->bodypart );
+        d->t->enqueue( d->work );
+        uint days = Configuration::scalar( Configuration::ColdStorageAge );
+        uint cutoff = (uint)time( 0 ) - days * 86400;
+        d->cold = new Query( "select bp.id, bp.hash, bp.data, "
+                             "bp.compressed from bodyparts bp "
+                             "where bp.id in (" + next + ") "
+                             "and bp.data is not null and bp.text is null "
+                             "and bp.bytes>=$2 and not exists "
+                             "(select 1 from part_numbers pn "
+                             "join messages m on (pn.message=m.id) "
+                             "where pn.bodypart=bp.id and m.idate>$3)",
+                             this );
+        d->cold->bind( 1, d->bodypart );
+        d->cold->bind( 2, BlobStore::minimumSize() );
+        d->cold->bind( 3, cutoff );
+        d->t->enqueue( d->cold );
+        d->t->execute();
+        return;
+    }
+
+    if ( d->step == MaintainerData::Emptying ) {
+        // nothing else uses a deleted mailbox, so this could move
+        // everything at once, but that might take a long time.
+        d->t->enqueue( new Query( "create temporary table rs ("
+                                  "mailbox integer, "
+                                  "uid integer )", 0 ) );
+        d->t->enqueue( new Query( "insert into rs (mailbox,uid) "
+                                  "select mm.mailbox, mm.uid "
+                                  "from mailbox_messages mm "
+                                  "join mailboxes mb on (mm.mailbox=mb.id) "
+                                  "where mb.deleted "
+                                  "limit " + fn( n ), 0 ) );
+        d->work = expungeStaged( d->t, "Mailbox deleted", this );
+        d->t->commit();
+        return;
+    }
+
+    if ( d->step == MaintainerData::Quotas ) {
+        // locking the users' rows first means that the sums below
+        // see every change that has already updated quota_usage, and
+        // that changes made later are added to the corrected values.
+        EString users( "select owner from quota_usage where owner>$1 "
+                       "order by owner limit " + fn( n ) );
+        d->work = new Query( users + " for update", this );
+        d->work->bind( 1, d->owner );
+        d->t->enqueue( d->work );
+        d->fix = new Query( "update quota_usage qu "
+                            "set messages=s.messages, "
+                            "rfc822size=s.rfc822size "
+                            "from (select u.owner, "
+                            "coalesce(sum(mc.messages),0) as messages, "
+                            "coalesce(sum(mc.rfc822size),0) as rfc822size "
+                            "from (" + users + ") u "
+                            "left join mailboxes mb on (mb.owner=u.owner) "
+                            "left join mailbox_counts mc "
+                            "on (mc.mailbox=mb.id) "
+                            "group by u.owner) s "
+                            "where qu.owner=s.owner and "
+                            "(qu.messages<>s.messages or "
+                            "qu.rfc822size<>s.rfc822size)", 0 );
+        d->fix->bind( 1, d->owner );
+        d->t->enqueue( d->fix );
+        d->t->commit();
+        return;
+    }
+
+    if ( d->step == MaintainerData::Backfills ) {
+        // one batch of the oldest unfinished task
+        d->work = new Query( "select run_schema_backfill(id,$1) as rows "
+                             "from schema_tasks where backfill and not done "
+                             "order by id limit 1", this );
+        d->work->bind( 1, n );
+        d->t->enqueue( d->work );
+        d->t->commit();
+        return;
+    }
+
+    uint days = Configuration::scalar( Configuration::UndeleteTime );
+
+    if ( d->step == MaintainerData::Expiry ) {
+        d->work = new Query( "select expire_deleted_messages($1,$2) "
+                             "as rows", this );
+        d->work->bind( 1, days );
+        d->work->bind( 2, n );
+        d->t->enqueue( d->work );
+        d->t->commit();
+        return;
+    }
+
+    d->work = new Query( "delete from deliveries where id in "
+                         "(select d.id from deliveries d "
+                         "where d.injected_at<current_timestamp-'" +
+                         fn( days ) + " days'::interval "
+                         "and exists (select 1 from delivery_recipients dr"
+                         " where dr.delivery=d.id"
+                         " and dr.action not in ($1,$2)) "
+                         "and not exists "
+                         "(select 1 from delivery_recipients dr"
+                         " where dr.delivery=d.id"
+                         " and dr.action in ($1,$2)) "
+                         "limit " + fn( n ) + ")", this );
+    d->work->bind( 1, Recipient::Unknown );
+    d->work->bind( 2, Recipient::Delayed );
+    d->t->enqueue( d->work );
+    d->t->commit();
+}
+
+
+/*! Looks at what the last batch did, and decides when to start the
+    next, and whether it belongs to the same step.
+*/
+
+void Maintainer::finishBatch()
+{
+    uint rows = 0;
+    bool failed = d->t->failed();
+    if ( failed )
+        log( "Maintenance failed: " + d->t->error(), Log::Error );
+    else if ( d->work && d->step == MaintainerData::Expiry )
+        rows = d->work->hasResults()
+               ? d->work->nextRow()->getInt( "rows" ) : 0;
+    else if ( d->work )
+        rows = d->work->rows();
+
+    if ( !failed && d->step == MaintainerData::Quotas ) {
+        Row * r;
+        while ( d->work && ( r = d->work->nextRow() ) != 0 )
+            d->owner = r->getInt( "owner" );
+        if ( d->fix )
+            d->fixed += d->fix->rows();
+    }
+
+    if ( !failed && d->step == MaintainerData::Cold ) {
+        // rows is the number of bodyparts found, but at least 1
+        // unless the end of the table has been reached
+        Row * r = d->work ? d->work->nextRow() : 0;
+        rows = 0;
+        if ( r && !r->isNull( "last" ) ) {
+            d->bodypart = r->getInt( "last" );
+            rows = d->examined;
+            if ( !rows )
+                rows = 1;
+        }
+        r = d->move ? d->move->nextRow() : 0;
+        if ( r )
+            d->moved += r->getInt( "moved" );
+    }
+
+    if ( !failed && d->step == MaintainerData::Backfills ) {
+        // rows is at least 1 while there is a task left, so that the
+        // next task starts when one is done
+        Row * r = d->work ? d->work->nextRow() : 0;
+        rows = 0;
+        if ( r ) {
+            rows = r->getInt( "rows" );
+            d->backfilled += rows;
+            if ( !rows )
+                rows = 1;
+        }
+    }
+
+    d->t = 0;
+    d->lock = 0;
+    d->work = 0;
+    d->r = 0;
+    d->fix = 0;
+    d->cold = 0;
+    d->move = 0;
+    d->locked = false;
+
+    if ( rows ) {
+        if ( d->step != MaintainerData::Quotas &&
+             d->step != MaintainerData::Cold &&
+             d->step != MaintainerData::Backfills )
+            d->rows += rows;
+        uint rate = Configuration::scalar( Configuration::MaintenanceRate );
+        wait( ( rows + rate - 1 ) / rate );
+        return;
+    }
+
+    if ( !failed && d->step == MaintainerData::Deliveries ) {
+        d->step = MaintainerData::Expiry;
+        wait( 1 );
+        return;
+    }
+
+    if ( !failed && d->step == MaintainerData::Expiry ) {
+        d->step = MaintainerData::Retention;
+        wait( 1 );
+        return;
+    }
+
+    if ( !failed && d->step == MaintainerData::Retention ) {
+        d->step = MaintainerData::Emptying;
+        wait( 1 );
+        return;
+    }
+
+    if ( !failed && d->step == MaintainerData::Emptying ) {
+        d->step = MaintainerData::Quotas;
+        wait( 1 );
+        return;
+    }
+
+    if ( !failed && d->step == MaintainerData::Quotas &&
+         BlobStore::coldEnabled() &&
+         Configuration::scalar( Configuration::ColdStorageAge ) ) {
+        d->step = MaintainerData::Cold;
+        wait( 1 );
+        return;
+    }
+
+    if ( !failed && ( d->step == MaintainerData::Quotas ||
+                      d->step == MaintainerData::Cold ) ) {
+        d->step = MaintainerData::Backfills;
+        wait( 1 );
+        return;
+    }
+
+    if ( d->fixed )
+        log( "Corrected quota usage for " + fn( d->fixed ) + " users" );
+    if ( d->moved )
+        log( "Moved " + fn( d->moved ) + " bodyparts to cold storage" );
+    if ( d->backfilled )
+        log( "Updated " + fn( d->backfilled ) +
+             " rows for online schema upgrades" );
+    if ( d->rows )
+        log( "Maintenance pass done, " + fn( d->rows ) + " rows changed" );
+    d->rows = 0;
+    d->owner = 0;
+    d->fixed = 0;
+    d->bodypart = 0;
+    d->moved = 0;
+    d->backfilled = 0;
+    d->step = MaintainerData::Deliveries;
+    wait( passInterval );
+}
+
+
+/*! Writes the bodyparts found by the Cold step to
+    cold-storage-directory, then removes the contents of those that
+    were written from the database and commits. Bodyparts that cannot
+    be written (because of a hash collision, for instance) stay where
+    they are.
+
+    The files are synced before the transaction commits, as when the
+    Injector uses blob-directory, so a bodypart's contents are never
+    only in the transaction.
+*/
+
+void Maintainer::moveToColdStorage()
+{
+    IntegerSet ids;
+    d->examined = d->cold->rows();
+    Row * r;
+    while ( ( r = d->cold->nextRow() ) != 0 ) {
+        EString data = r->getEString( "data" );
+        if ( r->getBoolean( "compressed" ) )
+            data = data.inflated();
+        if ( BlobStore::store( r->getEString( "hash" ), data, true ) )
+            ids.add( r->getInt( "id" ) );
+    }
+    d->cold = 0;
+
+    if ( !ids.isEmpty() ) {
+        d->move = new Query( "select move_to_cold_storage($1) as moved",
+                             this );
+        d->move->bind( 1, ids );
+        d->t->enqueue( d->move );
+    }
+    d->t->commit();
+}
+
+
+/*! Arranges for execute() to be called in \a seconds seconds. */
+
+void Maintainer::wait( uint seconds )
+{
+    if ( !seconds )
+        seconds = 1;
+    d->timer = new Timer( this, seconds );
+}
+
+
+/*! Starts a pass in a second or two, if the Maintainer is waiting
+    for the next pass. Called when a mailbox is deleted.
+*/
+
+void Maintainer::wake()
+{
+    if ( d->t || d->step != MaintainerData::Deliveries || d->rows ||
+         d->backoff )
+        return;
+    wait( 1 );
+}
+
+
+/*! Creates the process's Maintainer, unless maintenance-rate is 0. */
+
+void Maintainer::setup()
+{
+    if ( ::maintainer ||
+         !Configuration::scalar( Configuration::MaintenanceRate ) )
+        return;
+
+    ::maintainer = new Maintainer;
+    Allocator::addEternal( ::maintainer, "maintainer" );
+    Allocator::addEternal( new MaintainerWaker, "maintainer waker" );
+}
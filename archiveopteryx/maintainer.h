@@ -0,0 +1,31 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef MAINTAINER_H
+#define MAINTAINER_H
+
+#include "event.h"
+
+
+class Maintainer
+    : public EventHandler
+{
+public:
+    Maintainer();
+
+    void execute();
+    void wake();
+
+    static void setup();
+
+private:
+    class MaintainerData * d;
+
+    void startBatch();
+    void enqueueWork();
+    void finishBatch();
+    void moveToColdStorage();
+    void wait( uint );
+};
+
+
+#endif
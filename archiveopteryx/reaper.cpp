@@ -0,0 +1,199 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "reaper.h"
+
+#include "transaction.h"
+#include "configuration.h"
+#include "allocator.h"
+#include "database.h"
+#include "timer.h"
+#include "query.h"
+#include "scope.h"
+#include "log.h"
+
+// the advisory lock held by whichever process reaps a batch
+#define REAPERLOCK "2053"
+
+// no batch looks at more candidates than this
+static const uint maxBatch = 1000;
+// seconds between looks at an empty queue
+static const uint idleInterval = 60;
+// the longest we step aside for other database work, in seconds
+static const uint maxBackoff = 64;
+
+
+static Reaper * reaper;
+
+
+class ReaperData
+    : public Garbage
+{
+public:
+    ReaperData()
+        : t( 0 ), lock( 0 ), work( 0 ), timer( 0 ),
+          backoff( 0 ), rows( 0 )
+    {}
+
+    Transaction * t;
+    Query * lock;
+    Query * work;
+    Timer * timer;
+    uint backoff;
+    uint rows;
+};
+
+
+/*! \class Reaper reaper.h
+
+    The Reaper class removes messages that nothing uses any more,
+    steadily and in the background, so that storage is reclaimed
+    without waiting for aox vacuum.
+
+    The database notes each message that may have become unused in
+    orphan_candidates, when its last mailbox_messages,
+    deleted_messages or deliveries row goes away. The Reaper works
+    through that queue by calling reap_orphans(), which deletes the
+    unused messages (and with them their part numbers, header fields,
+    address fields etc.) and the bodyparts and raw text that no other
+    message uses. reap_orphans() is a security definer function, since
+    archiveopteryx itself may not delete from those tables.
+
+    Like the Maintainer, the Reaper does at most maintenance-rate rows
+    per second, in batches that are transactions of their own, steps
+    aside while other queries are waiting for the database, and holds
+    an advisory lock so that only one process reaps at a time. When
+    the queue is empty it looks again after a minute.
+*/
+
+Reaper::Reaper()
+    : d( new ReaperData )
+{
+    setLog( new Log );
+    // give startup a minute before adding any work
+    d->timer = new Timer( this, 60 );
+}
+
+
+void Reaper::execute()
+{
+    if ( !d->t ) {
+        if ( !d->timer || !d->timer->active() )
+            startBatch();
+        return;
+    }
+
+    if ( !d->lock->done() )
+        return;
+
+    if ( !d->work ) {
+        Row * r = d->lock->nextRow();
+        if ( !r || !r->getBoolean( "ok" ) ) {
+            // the query failed, or another process is doing the work
+            if ( d->lock->failed() )
+                log( "Cannot lock for reaping: " + d->lock->error(),
+                     Log::Error );
+            d->t->rollback();
+            d->t = 0;
+            wait( idleInterval );
+            return;
+        }
+
+        uint n = Configuration::scalar( Configuration::MaintenanceRate );
+        if ( n > maxBatch )
+            n = maxBatch;
+        d->work = new Query( "select reap_orphans($1) as rows", this );
+        d->work->bind( 1, n );
+        d->t->enqueue( d->work );
+        d->t->commit();
+    }
+
+    if ( !d->t->done() )
+        return;
+
+    finishBatch();
+}
+
+
+/*! Starts the next batch, unless other database work is waiting, in
+    which case this waits a little longer each time.
+*/
+
+void Reaper::startBatch()
+{
+    if ( Database::queueLength() ) {
+        if ( d->backoff )
+            d->backoff *= 2;
+        else
+            d->backoff = 1;
+        if ( d->backoff > maxBackoff )
+            d->backoff = maxBackoff;
+        wait( d->backoff );
+        return;
+    }
+    d->backoff = 0;
+
+    d->t = new Transaction( this );
+    d->t->setPriority( Query::Background );
+    d->lock = new Query( "select pg_try_advisory_xact_lock("
+                         REAPERLOCK ") as ok", this );
+    d->t->enqueue( d->lock );
+    d->t->execute();
+}
+
+
+/*! Looks at what the last batch did, and decides when to start the
+    next.
+*/
+
+void Reaper::finishBatch()
+{
+    uint rows = 0;
+    if ( d->t->failed() ) {
+        log( "Reaping failed: " + d->t->error(), Log::Error );
+    }
+    else {
+        Row * r = d->work->nextRow();
+        if ( r )
+            rows = r->getInt( "rows" );
+    }
+
+    d->t = 0;
+    d->lock = 0;
+    d->work = 0;
+
+    if ( rows ) {
+        d->rows += rows;
+        uint rate = Configuration::scalar( Configuration::MaintenanceRate );
+        wait( ( rows + rate - 1 ) / rate );
+        return;
+    }
+
+    if ( d->rows )
+        log( "Reaped the queue of unused messages, " + fn( d->rows ) +
+             " candidates seen" );
+    d->rows = 0;
+    wait( idleInterval );
+}
+
+
+/*! Arranges for execute() to be called in \a seconds seconds. */
+
+void Reaper::wait( uint seconds )
+{
+    if ( !seconds )
+        seconds = 1;
+    d->timer = new Timer( this, seconds );
+}
+
+
+/*! Creates the process's Reaper, unless maintenance-rate is 0. */
+
+void Reaper::setup()
+{
+    if ( ::reaper ||
+         !Configuration::scalar( Configuration::MaintenanceRate ) )
+        return;
+
+    ::reaper = new Reaper;
+    Allocator::addEternal( ::reaper, "reaper" );
+}
@@ -0,0 +1,28 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef REAPER_H
+#define REAPER_H
+
+#include "event.h"
+
+
+class Reaper
+    : public EventHandler
+{
+public:
+    Reaper();
+
+    void execute();
+
+    static void setup();
+
+private:
+    class ReaperData * d;
+
+    void startBatch();
+    void finishBatch();
+    void wait( uint );
+};
+
+
+#endif
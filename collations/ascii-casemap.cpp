@@ -106,3 +106,13 @@ int AsciiCasemap::compare( const UString & a, const UString & b ) const
         i++;
     }
 }
+
+
+/*! Returns \a s encoded as UTF-8, with the ASCII letters in upper
+    case, as compare() considers them.
+*/
+
+EString AsciiCasemap::key( const UString & s ) const
+{
+    return s.utf8().upper();
+}
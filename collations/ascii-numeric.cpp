@@ -85,3 +85,28 @@ int AsciiNumeric::compare( const UString & a, const UString & b ) const
         return 1;
     return 0;
 }
+
+
+/*! Returns the number represented by \a s as four big-endian bytes,
+    which sort as the numbers do. Positive infinity is the largest
+    number.
+*/
+
+EString AsciiNumeric::key( const UString & s ) const
+{
+    uint n = number( s );
+    EString r;
+    r.append( (char)( n >> 24 ) );
+    r.append( (char)( n >> 16 ) );
+    r.append( (char)( n >> 8 ) );
+    r.append( (char)n );
+    return r;
+}
+
+
+/*! Returns false, as contains() does. */
+
+bool AsciiNumeric::containsKey( const EString &, const EString & ) const
+{
+    return false;
+}
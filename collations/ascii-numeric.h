@@ -16,6 +16,9 @@ public:
     bool equals( const UString &, const UString & ) const;
     bool contains( const UString &, const UString & ) const;
     int compare( const UString &, const UString & ) const;
+
+    EString key( const UString & ) const;
+    bool containsKey( const EString &, const EString & ) const;
 };
 
 
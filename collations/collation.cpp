@@ -16,6 +16,11 @@
     strings as input and can be used to perform one or more of three
     basic comparison operations: equality test, substring match, and
     ordering test."
+
+    Callers that compare the same strings many times can use key() to
+    make a collation key for each string once, and then compare the
+    keys using EString's operators and EString::compare(), and
+    containsKey().
 */
 
 /*! Creates a new Collation. */
@@ -53,6 +58,25 @@ Collation::~Collation()
     1 if \a a is greater, than \a b.
 */
 
+/*! \fn virtual EString Collation::key( const UString & s ) const = 0;
+    Returns a collation key for \a s. Two keys are equal if and only if
+    equals() considers their strings equal, and EString::compare()
+    orders keys as compare() orders their strings.
+*/
+
+/*! Returns true if the string whose key() is \a a contains the one
+    whose key() is \a b, just as contains() would for the strings.
+
+    This implementation looks for \a b as a substring of \a a, which
+    is right for collations whose keys are UTF-8.
+*/
+
+bool Collation::containsKey( const EString & a, const EString & b ) const
+{
+    return a.contains( b );
+}
+
+
 /*! Returns a pointer to a newly-created Collation object corresponding
     to \a s, or 0 if no such collation is recognised.
 */
@@ -4,6 +4,7 @@
 #define COLLATION_H
 
 #include "ustring.h"
+#include "estring.h"
 
 
 class Collation
@@ -19,6 +20,9 @@ public:
     virtual bool contains( const UString &, const UString & ) const = 0;
     virtual int compare( const UString &, const UString & ) const = 0;
 
+    virtual EString key( const UString & ) const = 0;
+    virtual bool containsKey( const EString &, const EString & ) const;
+
     static Collation * create( const UString & );
 
     static class EStringList * supported();
@@ -95,3 +95,11 @@ int Octet::compare( const UString & a, const UString & b ) const
         i++;
     }
 }
+
+
+/*! Returns \a s encoded as UTF-8, which sorts in codepoint order. */
+
+EString Octet::key( const UString & s ) const
+{
+    return s.utf8();
+}
@@ -13,7 +13,7 @@
 #include <sys/time.h>
 #include <time.h>
 
-// mmap, munmap
+// mmap, munmap, madvise, mincore
 #include <sys/mman.h>
 
 // memset
@@ -30,6 +30,16 @@
 static uint BlockShift = 19;
 static uint BlockSize = 1 << BlockShift;
 
+// freed objects at least this large have their pages returned to the
+// OS at once.
+static const uint ReleaseSize = 65536;
+
+#if defined(__linux__)
+typedef unsigned char MincoreVector;
+#else
+typedef char MincoreVector;
+#endif
+
 
 
 class AllocatorMapTable // NOT a Garbage class
@@ -151,11 +161,72 @@ static uint tos;
 static uint peak;
 static AllocationBlock ** stack;
 
+// state for incremental sweeping: the current collection cycle, and
+// where the sweep has got to.
+static uint cycle;
+static bool sweepInProgress;
+static uint sweepClass;
+static bool sweepClassStarted;
+static Allocator * sweepCursor;
+static uint freed;
+static uint blocks;
+static uint timeToMark;
+static uint timeToSweep;
+static uint longestSlice;
+static bool incrementalSweep;
+
+// statistics about the last completed collection, for
+// Allocator::lastCollection() and friends.
+static struct {
+    uint collections;
+    uint pause;
+    uint markTime;
+    uint sweepTime;
+    uint freed;
+    uint objects;
+    uint blocks;
+    uint largestSize;
+    uint classObjects[32];
+    uint classAllocations[32];
+    uint classSurvival[32];
+} lastRun;
+
+// objects allocated in each size class since the last collection
+// completed.
+static uint classAllocations[32];
+
+// objects allocated since the program started
+static int64 allocations;
+
+// for each size class, an allocator which may have free space. the
+// ones before it in the chain were full when alloc() last looked.
+static Allocator * available[32];
+
+static void (*sampler)() = 0;
+
 
 static void oneMegabyteAllocated()
 {
     // this is a good place to put a breakpoint when we want to
     // find out who allocates memory.
+    if ( ::sampler )
+        ::sampler();
+}
+
+
+/*  Returns the index of the size class for objects of \a size bytes,
+    excluding the allocator's overhead.
+*/
+
+static uint sizeClass( uint size )
+{
+    uint i = 0;
+    uint b = 8;
+    if ( sizeof( void * ) == 8 )
+        b = 16;
+    while ( size + sizeof( void * ) > b << i )
+        i++;
+    return i;
 }
 
 
@@ -179,9 +250,15 @@ void * Allocator::alloc( uint s, uint n )
     if ( s > 262144 ) {
         fprintf( stderr, "%s", "" );
     }
-    Allocator * a = Allocator::allocator( s );
+    uint c = ::sizeClass( s );
+    Allocator * a = ::available[c];
+    if ( !a )
+        a = Allocator::allocator( s );
     while ( a->taken == a->capacity && a->next )
         a = a->next;
+    ::available[c] = a;
+    ::classAllocations[c]++;
+    ::allocations++;
     void * p = a->allocate( s, n );
     if ( ( ( ::total + ::allocated + s ) & 0xfff00000 ) >
          ( ( ::total + ::allocated ) & 0xfff00000 ) )
@@ -236,14 +313,13 @@ static bool verbose;
 
 Allocator * Allocator::allocator( uint size )
 {
-    uint i = 0;
-    uint b = 8;
-    if ( bits == 64 )
-        b = 16;
-    while ( size + bytes > b << i )
-        i++;
-    if ( !allocators[i] )
+    uint i = ::sizeClass( size );
+    if ( !allocators[i] ) {
+        uint b = 8;
+        if ( bits == 64 )
+            b = 16;
         allocators[i] = new Allocator( b << i );
+    }
     return allocators[i];
 }
 
@@ -285,7 +361,7 @@ Allocator * Allocator::allocator( uint size )
 Allocator::Allocator( uint s )
     : base( 0 ), step( s ), taken( 0 ), capacity( 0 ),
       used( 0 ), marked( 0 ), buffer( 0 ),
-      next( 0 )
+      next( 0 ), swept( ::cycle )
 {
     if ( s < ( BlockSize ) )
         capacity = ( BlockSize ) / ( s );
@@ -318,7 +394,8 @@ Allocator::Allocator( uint s )
         buffer = (void*)desired;
     }
 
-    memset( buffer, 0, l );
+    // the new mapping is full of zeroes already. we don't touch it,
+    // so the pages only become resident as they're used.
 
     uint bl = (capacity + bits - 1)/bits;
     used = (ulong*)::calloc( bl, sizeof( ulong ) );
@@ -360,11 +437,10 @@ void * Allocator::allocate( uint size, uint pointers )
 {
     if ( taken < capacity ) {
         while ( base < capacity ) {
-            ulong bm = used[base/bits];
-            if ( bm != ~(0UL) ) {
-                uint j = base%bits;
-                while ( bm & ( 1UL << j ) )
-                    j++;
+            // the free slots in this word, at or after base
+            ulong bm = ~used[base/bits] & ( ~(0UL) << (base%bits) );
+            if ( bm ) {
+                uint j = __builtin_ctzl( bm );
                 base = (base & ~(bits-1)) + j;
                 AllocationBlock * b = (AllocationBlock*)block( base );
                 if ( b ) {
@@ -378,7 +454,13 @@ void * Allocator::allocate( uint size, uint pointers )
                     else
                         b->x.number = pointers;
                     b->x.magic = ::magic;
-                    marked[base/bits] &= ~( 1UL << j );
+                    // if a sweep is in progress and hasn't reached
+                    // us yet, new objects must look marked, or the
+                    // sweep would free them.
+                    if ( ::sweepInProgress && swept != ::cycle )
+                        marked[base/bits] |= ( 1UL << j );
+                    else
+                        marked[base/bits] &= ~( 1UL << j );
                     used[base/bits] |= ( 1UL << j );
                     taken++;
                     base++;
@@ -396,6 +478,24 @@ void * Allocator::allocate( uint size, uint pointers )
 }
 
 
+/*  Tells the OS that the object at slot \a i of \a a is free, so its
+    pages can be reclaimed, provided that the object covers whole
+    pages. This is true of all objects of ReleaseSize or more, since
+    all mappings start at a BlockSize boundary and the large object
+    sizes are multiples of the page size.
+
+    A released page reads as zeroes if it's used again.
+*/
+
+static void release( void * buffer, uint step, uint i )
+{
+    if ( step < ReleaseSize )
+        return;
+    ::madvise( (char*)buffer + (unsigned long)i * step, step,
+               MADV_DONTNEED );
+}
+
+
 /*! Deallocates the object at \a p, provided that it's within this
     Allocator. Calling this function is never necessary, since free()
     does the same job. However, EString helps out by doing it
@@ -413,10 +513,13 @@ void Allocator::deallocate( void * p )
     AllocationBlock * m = (AllocationBlock *)block( i );
     if ( m->x.magic != ::magic )
         die( Memory );
-    used[i/bits] &= ~(1UL << i);
-    marked[i/bits] &= ~(1UL << i);
+    used[i/bits] &= ~(1UL << (i%bits));
+    marked[i/bits] &= ~(1UL << (i%bits));
+    if ( taken == capacity )
+        ::available[::sizeClass( step - bytes )] = this;
     taken--;
     m->x.magic = 0;
+    release( buffer, step, i );
 
     if ( base > i )
         base = i;
@@ -535,27 +638,43 @@ void Allocator::mark()
 
 /*! Frees all memory that's no longer in use. This can take some time.
 
+    If \a incremental is true, free() only marks the reachable
+    objects, and leaves the sweeping to later calls to sweepSome(),
+    so that the caller can spread the work over several short
+    pauses. Marking itself cannot be split up, since objects may move
+    between the marked and unmarked parts of the heap while the
+    program runs. If \a incremental is false (the default), free()
+    sweeps everything before it returns.
+
     Returns null if entries is null or empty, returns an object in
     entries else. The returned object is (in some sense) the one
     that's responsible for the largest share of allocated memory.
+
+    If \a sizes is non-null, it must point to an array with room for
+    one number per object in \a entries, and free() stores there how
+    many bytes were first reached from each object, in the same order
+    as \a entries. Objects reachable from several entries are counted
+    only for the first.
 */
 
-Garbage * Allocator::free( List<Garbage> * entries )
+Garbage * Allocator::free( List<Garbage> * entries, bool incremental,
+                           uint * sizes )
 {
-    struct timeval start, afterMark, afterSweep;
+    // a new mark phase needs a heap without any marks left over from
+    // the previous collection
+    if ( ::sweepInProgress )
+        sweepSome( UINT_MAX );
+
+    struct timeval start, afterMark;
     start.tv_sec = 0;
     start.tv_usec = 0;
     afterMark.tv_sec = 0;
     afterMark.tv_usec = 0;
-    afterSweep.tv_sec = 0;
-    afterSweep.tv_usec = 0;
     gettimeofday( &start, 0 );
 
     Cache::clearAllCaches( false );
 
-    total = 0;
     peak = 0;
-    uint freed = 0;
     objects = 0;
     ::marked = 0;
 
@@ -564,11 +683,14 @@ Garbage * Allocator::free( List<Garbage> * entries )
     // mark
     if ( entries ) {
         uint size = 0;
+        uint n = 0;
         List<Garbage>::Iterator i( entries );
         while ( i ) {
             uint m = ::marked;
             mark( i );
             mark();
+            if ( sizes )
+                sizes[n++] = ::marked - m;
             if ( !biggest || ::marked - m > size ) {
                 biggest = i;
                 size = ::marked - m;
@@ -591,63 +713,198 @@ Garbage * Allocator::free( List<Garbage> * entries )
     }
     gettimeofday( &afterMark, 0 );
 
-    // and sweep
-    i = 0;
-    uint blocks = 0;
-    while ( i < 32 ) {
-        Allocator * a = allocators[i];
-        while ( a ) {
-            uint taken = a->taken;
-            if ( a->taken )
-                a->sweep();
-            freed = freed + ( taken - a->taken ) * a->step;
-            total = total + a->taken * a->step;
-            a = a->next;
+    ::timeToMark = 0;
+    if ( start.tv_sec )
+        ::timeToMark = ( afterMark.tv_sec - start.tv_sec ) * 1000000 +
+                       ( afterMark.tv_usec - start.tv_usec );
+
+    // what's marked is what's in use, even before we've swept
+    total = ::marked;
+
+    // and start sweeping
+    ::cycle++;
+    ::sweepInProgress = true;
+    ::sweepClass = 0;
+    ::sweepClassStarted = false;
+    ::sweepCursor = 0;
+    ::freed = 0;
+    ::blocks = 0;
+    ::timeToSweep = 0;
+    ::longestSlice = 0;
+    ::incrementalSweep = incremental;
+
+    if ( !incremental )
+        sweepSome( UINT_MAX );
+
+    return biggest;
+}
+
+
+/*! Returns true if free() has marked the heap, but sweepSome() has
+    not yet swept all of it.
+*/
+
+bool Allocator::sweeping()
+{
+    return ::sweepInProgress;
+}
+
+
+/*! Continues the sweep started by free() for about \a limit
+    microseconds, and returns true if the sweep is complete, false if
+    there is more to do. Each Allocator is swept in one go, so \a
+    limit may be overrun by the time needed to sweep one block.
+
+    It is safe to allocate memory between calls to sweepSome().
+*/
+
+bool Allocator::sweepSome( uint limit )
+{
+    if ( !::sweepInProgress )
+        return true;
+
+    struct timeval start, now;
+    start.tv_sec = 0;
+    start.tv_usec = 0;
+    gettimeofday( &start, 0 );
+    now = start;
+    uint spent = 0;
+
+    while ( ::sweepClass < 32 ) {
+        if ( !::sweepClassStarted ) {
+            ::sweepCursor = allocators[::sweepClass];
+            ::sweepClassStarted = true;
+        }
+        while ( ::sweepCursor ) {
+            Allocator * a = ::sweepCursor;
+            ::sweepCursor = a->next;
+            if ( a->swept != ::cycle ) {
+                uint taken = a->taken;
+                if ( a->taken )
+                    a->sweep();
+                a->swept = ::cycle;
+                ::freed = ::freed + ( taken - a->taken ) * a->step;
+                if ( limit < UINT_MAX ) {
+                    gettimeofday( &now, 0 );
+                    spent = ( now.tv_sec - start.tv_sec ) * 1000000 +
+                            ( now.tv_usec - start.tv_usec );
+                    if ( spent >= limit ) {
+                        ::timeToSweep += spent;
+                        if ( spent > ::longestSlice )
+                            ::longestSlice = spent;
+                        return false;
+                    }
+                }
+            }
         }
+
+        // this size is done. drop the empty allocators.
         Allocator * s = 0;
-        a = allocators[i];
+        Allocator * a = allocators[::sweepClass];
         while ( a ) {
             Allocator * n = a->next;
             if ( a->taken ) {
                 a->next = s;
                 s = a;
-                blocks++;
             }
             else {
                 delete a;
             }
             a = n;
         }
-        allocators[i] = s;
+        allocators[::sweepClass] = s;
+        ::available[::sweepClass] = s;
+        ::sweepClass++;
+        ::sweepClassStarted = false;
+    }
+
+    gettimeofday( &now, 0 );
+    spent = ( now.tv_sec - start.tv_sec ) * 1000000 +
+            ( now.tv_usec - start.tv_usec );
+    ::timeToSweep += spent;
+    if ( spent > ::longestSlice )
+        ::longestSlice = spent;
+
+    ::sweepInProgress = false;
+    ::sweepCursor = 0;
+
+    total = 0;
+    uint largest = 0;
+    uint largestBytes = 0;
+    uint i = 0;
+    while ( i < 32 ) {
+        uint bytes = 0;
+        uint n = 0;
+        Allocator * a = allocators[i];
+        while ( a ) {
+            bytes = bytes + a->taken * a->step;
+            n = n + a->taken;
+            ::blocks++;
+            a = a->next;
+        }
+        if ( bytes > largestBytes ) {
+            largest = allocators[i]->step;
+            largestBytes = bytes;
+        }
+        total = total + bytes;
+
+        // the objects which could have survived are those left by
+        // the previous collection and those allocated since.
+        uint candidates = ::lastRun.classObjects[i] + ::classAllocations[i];
+        ::lastRun.classSurvival[i] = 0;
+        if ( candidates )
+            ::lastRun.classSurvival[i] =
+                (uint)( 100ULL * n / candidates );
+        if ( ::lastRun.classSurvival[i] > 100 )
+            ::lastRun.classSurvival[i] = 100;
+        ::lastRun.classObjects[i] = n;
+        ::lastRun.classAllocations[i] = ::classAllocations[i];
+        ::classAllocations[i] = 0;
         i++;
     }
-    gettimeofday( &afterSweep, 0 );
-
-    uint timeToMark = 0;
-    uint timeToSweep = 0;
-    if ( start.tv_sec ) {
-        timeToMark = ( afterMark.tv_sec - start.tv_sec ) * 1000000 +
-                     ( afterMark.tv_usec - start.tv_usec );
-        timeToSweep = ( afterSweep.tv_sec - afterMark.tv_sec ) * 1000000 +
-                      ( afterSweep.tv_usec - afterMark.tv_usec );
+
+    ::lastRun.collections++;
+    if ( ::incrementalSweep )
+        ::lastRun.pause = ::timeToMark > ::longestSlice
+                          ? ::timeToMark : ::longestSlice;
+    else
+        ::lastRun.pause = ::timeToMark + ::timeToSweep;
+    ::lastRun.markTime = ::timeToMark;
+    ::lastRun.sweepTime = ::timeToSweep;
+    ::lastRun.freed = ::freed;
+    ::lastRun.objects = ::objects;
+    ::lastRun.blocks = ::blocks;
+    ::lastRun.largestSize = largest;
+
+    if ( ::freed ) {
+        report();
+        ::allocated = 0;
     }
-    // dumpRandomObject();
+    return true;
+}
+
 
-    if ( !freed )
-        return biggest;
+/*! Logs statistics about the collection that just finished, if
+    setReporting() has asked for that.
+*/
+
+void Allocator::report()
+{
+    uint i = 0;
+    // dumpRandomObject();
 
     if ( verbose && ( ::allocated >= 4*1024*1024 ||
                       timeToMark + timeToSweep >= 10000 ) )
         log( "Allocator: allocated " +
              EString::humanNumber( ::allocated ) +
              " then freed " +
-             EString::humanNumber( freed ) +
+             EString::humanNumber( ::freed ) +
              " bytes, leaving " +
              fn( objects ) +
              " objects of " +
              EString::humanNumber( total ) +
              " bytes, across " +
-             fn( blocks ) +
+             fn( ::blocks ) +
              " " +
              EString::humanNumber( BlockSize ) +
              " blocks. Recursion depth: " +//
@@ -702,8 +959,6 @@ Garbage * Allocator::free( List<Garbage> * entries )
             i++;
         }
     }
-    ::allocated = 0;
-    return biggest;
 }
 
 
@@ -715,20 +970,20 @@ void Allocator::sweep()
 {
     uint b = 0;
     while ( taken > 0 && b * bits < capacity ) {
-        uint i = 0;
-        while ( ( used[b] & ~marked[b] ) ) {
-            if ( (used[b] & (1UL<<i)) && !(marked[b] & (1UL<<i)) ) {
-                AllocationBlock * m
-                    = (AllocationBlock *)block( b * bits + i );
-                if ( m ) {
-                    if ( m->x.magic != ::magic )
-                        die( Memory );
-                    used[b] &= ~(1UL << i);
-                    taken--;
-                    m->x.magic = 0;
-                }
+        ulong dead = used[b] & ~marked[b];
+        while ( dead ) {
+            uint i = __builtin_ctzl( dead );
+            dead &= dead - 1;
+            AllocationBlock * m
+                = (AllocationBlock *)block( b * bits + i );
+            if ( m ) {
+                if ( m->x.magic != ::magic )
+                    die( Memory );
+                used[b] &= ~(1UL << i);
+                taken--;
+                m->x.magic = 0;
+                release( buffer, step, b * bits + i );
             }
-            i++;
         }
         marked[b] = 0;
         b++;
@@ -873,6 +1128,17 @@ uint Allocator::allocated()
 }
 
 
+/*! Returns the number of objects allocated since the program
+    started. Benchmarks use this to measure how much garbage a piece
+    of code makes.
+*/
+
+int64 Allocator::allocations()
+{
+    return ::allocations;
+}
+
+
 /*! Returns the number of bytes in use after the last sweep. */
 
 uint Allocator::inUse()
@@ -881,6 +1147,155 @@ uint Allocator::inUse()
 }
 
 
+/*! Returns the number of collections completed so far. The other
+    statistics functions (lastPause() etc.) describe the most recent
+    of these, so callers can compare this number with what it was
+    before to see whether those have changed.
+*/
+
+uint Allocator::collections()
+{
+    return ::lastRun.collections;
+}
+
+
+/*! Returns the longest time in microseconds that the last collection
+    kept the program from running. For a collection that swept in
+    slices, that's the mark phase or the longest sweep slice,
+    whichever was longer.
+*/
+
+uint Allocator::lastPause()
+{
+    return ::lastRun.pause;
+}
+
+
+/*! Returns the number of microseconds the last collection needed to
+    mark the heap.
+*/
+
+uint Allocator::lastMarkTime()
+{
+    return ::lastRun.markTime;
+}
+
+
+/*! Returns the number of microseconds the last collection needed to
+    sweep the heap, summed over all the slices.
+*/
+
+uint Allocator::lastSweepTime()
+{
+    return ::lastRun.sweepTime;
+}
+
+
+/*! Returns the number of bytes freed by the last collection. */
+
+uint Allocator::lastFreed()
+{
+    return ::lastRun.freed;
+}
+
+
+/*! Returns the number of objects the last collection found to be in
+    use.
+*/
+
+uint Allocator::lastObjects()
+{
+    return ::lastRun.objects;
+}
+
+
+/*! Returns the number of Allocator blocks left after the last
+    collection had swept the heap.
+*/
+
+uint Allocator::lastBlocks()
+{
+    return ::lastRun.blocks;
+}
+
+
+/*! Returns the object size (including overhead) of the size class
+    which occupied the most memory after the last collection, or 0 if
+    there has been no collection yet.
+*/
+
+uint Allocator::largestSizeClass()
+{
+    return ::lastRun.largestSize;
+}
+
+
+/*! Returns the object size (including overhead) of size class \a i,
+    which is at least 0 and less than 32. Each class holds objects
+    twice as large as the one before it.
+*/
+
+uint Allocator::classSize( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ( bits == 64 ? 16 : 8 ) << i;
+}
+
+
+/*! Returns the number of objects in size class \a i which the last
+    collection found to be in use.
+*/
+
+uint Allocator::classObjects( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ::lastRun.classObjects[i];
+}
+
+
+/*! Returns the number of objects allocated in size class \a i
+    between the two most recent collections.
+*/
+
+uint Allocator::classAllocations( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ::lastRun.classAllocations[i];
+}
+
+
+/*! Returns the percentage of the candidates in size class \a i which
+    survived the last collection. The candidates are the objects left
+    by the collection before, and those allocated since. A low number
+    means that the class is mostly used for short-lived objects.
+*/
+
+uint Allocator::classSurvival( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ::lastRun.classSurvival[i];
+}
+
+
+/*! Instructs alloc() to call \a f each time another megabyte of
+    memory has been allocated, or to stop doing that if \a f is
+    null. The Profiler uses this to find out where the memory is
+    allocated.
+
+    \a f is called from within alloc(), so it must not allocate
+    memory itself.
+*/
+
+void Allocator::setSampler( void (*f)() )
+{
+    ::sampler = f;
+}
+
+
 /*! Returns the amount of memory gobbled up when this Allocator
     allocates memory. This is a little bigger than the biggest object
     this Allocator can provide.
@@ -957,12 +1372,12 @@ Allocator * Allocator::owner( const void * p )
 
 uint Allocator::allocatedFromOS()
 {
-    int r = 0;
+    uint r = 0;
     int i = 0;
     while ( i < 32 ) {
         Allocator * a = allocators[i];
         while ( a ) {
-            r += BlockSize;
+            r += ( ( a->capacity * a->step - 1 ) | 4095 ) + 1;
             a = a->next;
         }
         ++i;
@@ -970,3 +1385,50 @@ uint Allocator::allocatedFromOS()
 
     return r;
 }
+
+
+/*! Returns the number of bytes of allocatedFromOS() which are
+    actually resident in RAM. This is smaller than allocatedFromOS()
+    when parts of the heap have never been used, or have been freed
+    and released to the OS, and larger than inUse() when there is
+    garbage or free space which hasn't been released.
+
+    Returns 0 if the OS doesn't say.
+*/
+
+uint Allocator::residentFromOS()
+{
+    uint pageSize = 4096;
+    uint r = 0;
+    uint vl = 0;
+    MincoreVector * v = 0;
+    int i = 0;
+    while ( i < 32 ) {
+        Allocator * a = allocators[i];
+        while ( a ) {
+            uint l = ( ( a->capacity * a->step - 1 ) | 4095 ) + 1;
+            uint pages = l / pageSize;
+            if ( pages > vl ) {
+                ::free( v );
+                v = (MincoreVector*)::malloc( pages );
+                if ( !v )
+                    return 0;
+                vl = pages;
+            }
+            if ( ::mincore( a->buffer, l, v ) < 0 ) {
+                ::free( v );
+                return 0;
+            }
+            uint p = 0;
+            while ( p < pages ) {
+                if ( v[p] & 1 )
+                    r += pageSize;
+                p++;
+            }
+            a = a->next;
+        }
+        ++i;
+    }
+    ::free( v );
+    return r;
+}
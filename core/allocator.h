@@ -20,7 +20,9 @@ public:
 
     static Allocator * allocator( uint size );
 
-    static Garbage * free( List<Garbage> * = 0 );
+    static Garbage * free( List<Garbage> * = 0, bool = false, uint * = 0 );
+    static bool sweeping();
+    static bool sweepSome( uint );
     static void addEternal( const void *, const char * );
 
     static void removeEternal( void * );
@@ -29,6 +31,7 @@ public:
     static void setReporting( bool );
 
     static uint allocated();
+    static int64 allocations();
     static uint inUse();
 
     static void * alloc( uint, uint = UINT_MAX );
@@ -44,6 +47,23 @@ public:
     static uint sizeOf( void * );
 
     static uint allocatedFromOS();
+    static uint residentFromOS();
+
+    static uint collections();
+    static uint lastPause();
+    static uint lastMarkTime();
+    static uint lastSweepTime();
+    static uint lastFreed();
+    static uint lastObjects();
+    static uint lastBlocks();
+    static uint largestSizeClass();
+
+    static uint classSize( uint );
+    static uint classObjects( uint );
+    static uint classAllocations( uint );
+    static uint classSurvival( uint );
+
+    static void setSampler( void (*)() );
 
 private:
     typedef unsigned long int ulong;
@@ -56,6 +76,7 @@ private:
     ulong * marked;
     void * buffer;
     Allocator * next;
+    uint swept;
 
     friend void pointers( void * );
     friend class AllocatorMapTable;
@@ -64,6 +85,7 @@ private:
     static void mark( void * );
     static void mark();
     void sweep();
+    static void report();
 };
 
 
@@ -5,13 +5,16 @@
 #include "list.h"
 #include "estring.h"
 #include "allocator.h"
+#include "configuration.h"
 
 // open, O_CREAT|O_RDWR|O_EXCL
 #include <fcntl.h>
 // read, write, unlink, lseek, close
 #include <unistd.h>
-// strlen, memmove
+// strlen, memmove, memchr
 #include <string.h>
+// writev
+#include <sys/uio.h>
 
 #include <zlib.h>
 
@@ -19,6 +22,9 @@
 static const uint bufsiz = 8192;
 static char buffer[bufsiz];
 
+// the most vectors we give writev() at once
+static const uint maxVecs = 64;
+
 
 
 /*! \class Buffer buffer.h
@@ -41,17 +47,21 @@ static char buffer[bufsiz];
 Buffer::Buffer()
     : filter( None ), zs( 0 ),
       firstused( 0 ), firstfree( 0 ),
-      bytes( 0 )
+      bytes( 0 ), unflushed( false )
 {
 }
 
 
-/*! Appends \a l bytes starting at \a s to the Buffer. */
+/*! Appends \a l bytes starting at \a s to the Buffer.
+
+    If the Buffer compresses, the compressed form may not be available
+    until flush() is called.
+*/
 
 void Buffer::append( const char * s, uint l )
 {
     if ( l )
-        append( s, l, true );
+        append( s, l, false );
 }
 
 
@@ -83,13 +93,9 @@ void Buffer::append( const char * s, uint l, bool f )
             else
                 progress = false;
         }
-        if ( f ) {
-            zs->next_out = (Bytef*)buffer;
-            zs->avail_out = bufsiz;
-            r = ::deflate( zs, Z_SYNC_FLUSH );
-            if ( zs->avail_out < bufsiz )
-                append2( buffer, bufsiz - zs->avail_out );
-        }
+        unflushed = true;
+        if ( f )
+            flush();
         if ( zs->avail_in ) {
             // should not happen
         }
@@ -148,7 +154,9 @@ void Buffer::append2( const char * s, uint l )
         if ( f->len < 1500 )
             f->len = 1500;
         f->len = Allocator::rounded( f->len );
-        f->base = (char*)Allocator::alloc( f->len, 0 );
+        f->owner = new EString;
+        f->owner->setLength( f->len );
+        f->base = (char*)f->owner->data();
 
         if ( vecs.isEmpty() )
             firstused = 0;
@@ -167,12 +175,40 @@ void Buffer::append2( const char * s, uint l )
 
 /*! \overload
     Appends the EString \a s to a Buffer.
+
+    If \a s is large and the Buffer doesn't compress, this shares the
+    string's data rather than copying it. EString data is copied on
+    write, so the caller may go on using \a s.
 */
 
 void Buffer::append( const EString &s )
 {
-    if ( s.length() > 0 )
-        append( s.data(), s.length() );
+    if ( s.length() < bufsiz || filter != None ) {
+        if ( s.length() > 0 )
+            append( s.data(), s.length() );
+        return;
+    }
+
+    // all vectors but the last must be full, so if the last has
+    // room left, we pretend it doesn't. and the shared vector is
+    // full from the start, so the next append uses a new vector.
+    if ( !bytes )
+        vecs.clear();
+    else if ( vecs.last() )
+        vecs.last()->len = firstfree;
+
+    bytes += s.length();
+
+    Vector * v = new Vector;
+    v->owner = new EString( s );
+    v->base = (char*)v->owner->data();
+    v->len = s.length();
+    v->lent = true;
+
+    if ( vecs.isEmpty() )
+        firstused = 0;
+    vecs.append( v );
+    firstfree = v->len;
 }
 
 
@@ -195,28 +231,43 @@ void Buffer::read( int fd )
 
 /*! Writes as much as possible from the Buffer to its file descriptor
     \a fd. That file descriptor must be nonblocking.
+
+    Up to 64 vectors are handed to the kernel in each writev() call.
 */
 
 void Buffer::write( int fd )
 {
+    struct iovec iov[maxVecs];
     int written = 1;
 
     while ( written > 0 ) {
-        Vector * v = vecs.firstElement();
-
-        int max = 0;
-        if ( v )
-            max = v->len;
-        if ( vecs.count() == 1 )
-            max = firstfree;
-        int n = max - firstused;
+        uint n = 0;
+        uint wanted = 0;
+        bool first = true;
+        List< Vector >::Iterator i( vecs );
+        while ( i && n < maxVecs ) {
+            Vector * v = i;
+            ++i;
+            uint start = first ? firstused : 0;
+            uint end = i ? v->len : firstfree;
+            first = false;
+            if ( end > start ) {
+                iov[n].iov_base = v->base + start;
+                iov[n].iov_len = end - start;
+                wanted += end - start;
+                n++;
+            }
+        }
 
-        if ( n <= 0 || !v )
+        if ( !n )
             written = 0;
         else
-            written = ::write( fd, v->base+firstused, n );
+            written = ::writev( fd, iov, n );
         if ( written > 0 )
             remove( written );
+        // a short write means the kernel's buffer is full
+        if ( written < (int)wanted )
+            written = 0;
     }
 }
 
@@ -241,7 +292,7 @@ void Buffer::remove( uint n )
     if ( bytes == 0 ) {
         firstused = firstfree = 0;
         vecs.clear();
-        if ( v && ( v->len > 100 && v->len < 20000 ) )
+        if ( v && !v->lent && ( v->len > 100 && v->len < 20000 ) )
             vecs.append( v );
         return;
     }
@@ -337,12 +388,59 @@ EString Buffer::string( uint num ) const
 }
 
 
+/*! Copies the first \a num bytes in the buffer to \a dest, which must
+    have room for them, and returns the number of bytes copied (fewer
+    than \a num if the buffer is shorter). Like string(), but without
+    allocating anything. This function does not remove() the data.
+*/
+
+uint Buffer::copy( char * dest, uint num ) const
+{
+    uint n = size();
+    if ( n == 0 )
+        return 0;
+    if ( num < n )
+        n = num;
+
+    List< Vector >::Iterator it( vecs );
+    Vector *v = it;
+
+    int max = v->len;
+
+    if ( vecs.count() == 1 )
+        max = firstfree;
+
+    uint copied = max - firstused;
+
+    if ( copied > n )
+        copied = n;
+
+    memmove( dest, v->base + firstused, copied );
+
+    while ( copied < n ) {
+        v = ++it;
+        uint l = v->len;
+        if ( copied + l > n )
+            l = n - copied;
+        memmove( dest + copied, v->base, l );
+        copied += l;
+    }
+
+    return n;
+}
+
+
 /*! This function removes a line (terminated by LF or CRLF) of at most
     \a s bytes from the Buffer, and returns a pointer to a EString with
     the line ending removed. If the Buffer does not contain a complete
     line less than \a s bytes long, this function a null pointer.
 
     If \a s has its default value of 0, the entire Buffer is searched.
+
+    If the line lies within one of the Buffer's internal vectors, the
+    returned string shares that vector's memory instead of copying
+    it, and the Buffer won't reuse the vector afterwards. This lets
+    IMAP parse most commands without copying them.
 */
 
 EString * Buffer::removeLine( uint s )
@@ -353,11 +451,27 @@ EString * Buffer::removeLine( uint s )
     if ( s == 0 || s > size() )
         s = size();
 
-    while ( i < s && (*this)[i] != '\012' )
-        i++;
-
-    if ( i == s )
+    Vector * v = vecs.firstElement();
+    if ( !v )
         return 0;
+    uint max = v->len;
+    if ( vecs.count() == 1 )
+        max = firstfree;
+    uint first = max - firstused;
+    if ( first > s )
+        first = s;
+    const char * lf = (const char *)memchr( v->base + firstused, '\012',
+                                            first );
+    if ( lf ) {
+        i = lf - ( v->base + firstused );
+    }
+    else {
+        i = first;
+        while ( i < s && (*this)[i] != '\012' )
+            i++;
+        if ( i == s )
+            return 0;
+    }
 
     n = 1;
     if ( i > 0 && (*this)[i-1] == '\015' ) {
@@ -365,7 +479,13 @@ EString * Buffer::removeLine( uint s )
         n++;
     }
 
-    r = new EString( string( i ) );
+    if ( lf && v->owner ) {
+        r = new EString( v->owner->mid( firstused, i ) );
+        v->lent = true;
+    }
+    else {
+        r = new EString( string( i ) );
+    }
     remove( i+n );
     return r;
 }
@@ -384,9 +504,13 @@ void Buffer::setCompression( Compression c )
     zs->zalloc = 0;
     zs->zfree = 0;
     zs->opaque = 0;
-    if ( c == Compressing )
-        ::deflateInit2( zs, 9, Z_DEFLATED,
-                        -15, 9, Z_DEFAULT_STRATEGY );
+    if ( c == Compressing ) {
+        uint level = Configuration::scalar( Configuration::CompressionLevel );
+        if ( level > 9 )
+            level = 9;
+        ::deflateInit2( zs, level, Z_DEFLATED,
+                        -15, 8, Z_DEFAULT_STRATEGY );
+    }
     else if ( c == Decompressing )
         ::inflateInit2( zs, -15 );
     filter = c;
@@ -403,6 +527,32 @@ Buffer::Compression Buffer::compression() const
 }
 
 
+/*! Makes the compressed form of everything appended so far available,
+    so that it can be written. Does nothing unless this Buffer
+    compresses and something has been appended since the last flush.
+
+    Flushing costs a few bytes and some CPU, so append() doesn't do it.
+    Connection flushes once per event loop iteration, before writing.
+*/
+
+void Buffer::flush()
+{
+    if ( filter != Compressing || !unflushed )
+        return;
+    unflushed = false;
+
+    zs->avail_in = 0;
+    int r = Z_OK;
+    do {
+        zs->next_out = (Bytef*)buffer;
+        zs->avail_out = bufsiz;
+        r = ::deflate( zs, Z_SYNC_FLUSH );
+        if ( zs->avail_out < bufsiz )
+            append2( buffer, bufsiz - zs->avail_out );
+    } while ( r == Z_OK && zs->avail_out == 0 );
+}
+
+
 /*! Zlib needs to be closed down properly; it will not fit properly
     into garbage collections.
 */
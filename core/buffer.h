@@ -29,6 +29,7 @@ public:
     uint size() const { return bytes; }
     void remove( uint );
     EString string( uint ) const;
+    uint copy( char *, uint ) const;
     EString * removeLine( uint = 0 );
 
     char operator[]( uint i ) const {
@@ -43,6 +44,7 @@ public:
         return at( i );
     }
 
+    void flush();
     void close();
 
 private:
@@ -55,12 +57,14 @@ private:
     struct Vector
         : public Garbage
     {
-        Vector() : base( 0 ), len( 0 ) {
+        Vector() : base( 0 ), owner( 0 ), len( 0 ), lent( false ) {
             setFirstNonPointer( &len );
         }
         char *base;
+        EString * owner;
         // no pointers after this line
         uint len;
+        bool lent;
     };
 
     List< Vector > vecs;
@@ -68,6 +72,7 @@ private:
     struct z_stream_s * zs;
     uint firstused, firstfree;
     uint bytes;
+    bool unflushed;
 };
 
 
@@ -22,7 +22,7 @@ static List<Cache> * caches;
 
     Subclasses of Cache have to provide cache insertion and
     retrieval. This class provides only one bit of core functionality,
-    namely clearing the cache at GC time.
+    namely clearing or aging the cache at GC time.
 */
 
 
@@ -59,9 +59,10 @@ Cache::~Cache()
 }
 
 
-/*! Calls clear() for each currently extant Cache. Called from
-    Allocator::free(). If \a harder is set, then all caches are
-    cleared completely, no matter how high their duration factors are.
+/*! Calls age() for each currently extant Cache whose duration is up.
+    Called from Allocator::free(). If \a harder is set, then all
+    caches are cleared completely using clear(), no matter how high
+    their duration factors are.
 */
 
 void Cache::clearAllCaches( bool harder)
@@ -71,10 +72,14 @@ void Cache::clearAllCaches( bool harder)
         Cache * c = i;
         ++i;
         c->n++;
-        if ( harder || c->n > c->factor ) {
+        if ( harder ) {
             c->n = 0;
             c->clear(); // careful: no iterator pointing to c meanwhile
         }
+        else if ( c->n > c->factor ) {
+            c->n = 0;
+            c->age();
+        }
     }
 }
 
@@ -82,3 +87,16 @@ void Cache::clearAllCaches( bool harder)
 /*! \fn virtual void Cache::clear() = 0;
     Implemented by subclasses to discards the contents of the cache.
 */
+
+
+/*! Called by clearAllCaches() when this cache's duration is up.
+    Subclasses may reimplement this to discard only the entries that
+    haven't been used since the previous call, so that a busy cache
+    doesn't go cold all at once. The default implementation calls
+    clear().
+*/
+
+void Cache::age()
+{
+    clear();
+}
@@ -0,0 +1,302 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef COMPACTDICT_H
+#define COMPACTDICT_H
+
+#include "dict.h"
+#include "estringlist.h"
+
+
+template<class T>
+class CompactDict
+    : public Garbage
+{
+public:
+    CompactDict()
+        : Garbage(),
+          recent( new Dict<T> ), recentKeys( new EStringList ),
+          values( 0 ), blocks( 0 ), n( 0 ), live( 0 ), recentCount( 0 )
+    {
+        setFirstNonPointer( &n );
+    }
+
+    T * find( const EString & k ) const {
+        if ( recentCount ) {
+            T * r = recent->find( k );
+            if ( r )
+                return r;
+        }
+        int i = locate( k );
+        if ( i < 0 )
+            return 0;
+        return values[i];
+    }
+
+    void insert( const EString & k, T * t ) {
+        int i = locate( k );
+        if ( i >= 0 ) {
+            if ( !values[i] && t )
+                live++;
+            else if ( values[i] && !t )
+                live--;
+            values[i] = t;
+            return;
+        }
+        if ( !recent->find( k ) ) {
+            recentKeys->append( k );
+            recentCount++;
+        }
+        recent->insert( k, t );
+        if ( recentCount > 64 && recentCount * 8 > n )
+            compact();
+    }
+
+    T * remove( const EString & k ) {
+        T * r = recent->remove( k );
+        if ( r ) {
+            recentCount--;
+            return r;
+        }
+        int i = locate( k );
+        if ( i < 0 || !values[i] )
+            return 0;
+        r = values[i];
+        values[i] = 0;
+        live--;
+        return r;
+    }
+
+    bool contains( const EString & k ) const {
+        return find( k ) != 0;
+    }
+
+    bool isEmpty() const {
+        return live + recentCount == 0;
+    }
+
+    uint count() const {
+        return live + recentCount;
+    }
+
+    void clear() {
+        recent = new Dict<T>;
+        recentKeys = new EStringList;
+        recentCount = 0;
+        values = 0;
+        keys.truncate();
+        blocks = 0;
+        n = 0;
+        live = 0;
+    }
+
+    void compact() {
+        // gather everything in key order: the compact entries are
+        // already sorted, the recent ones need sorting.
+        EStringList * fresh = recentKeys->sorted();
+        EStringList::Iterator f( fresh );
+        EString previous;
+        bool any = false;
+
+        uint size = live + recentCount;
+        T ** v = (T**)Allocator::alloc( ( size ? size : 1 ) * sizeof( T * ) );
+        uint * b = (uint*)Allocator::alloc(
+            ( size / blockSize + 1 ) * sizeof( uint ), 0 );
+        EString k;
+        k.reserve( keys.length() + recentCount * 16 );
+        uint m = 0;
+
+        uint i = 0;
+        uint at = 0;
+        EString current;
+        bool haveCurrent = false;
+        while ( i < n || f ) {
+            if ( !haveCurrent && i < n ) {
+                at = decode( at, i, current );
+                haveCurrent = true;
+            }
+            EString key;
+            T * value = 0;
+            if ( haveCurrent &&
+                 ( !f || current.compare( *f ) <= 0 ) ) {
+                key = current;
+                value = values[i];
+                haveCurrent = false;
+                i++;
+            }
+            else {
+                key = *f;
+                value = recent->find( key );
+                ++f;
+                // the recent list can mention a key more than once
+                if ( any && key == previous )
+                    value = 0;
+            }
+            if ( !value )
+                continue;
+
+            if ( m % blockSize == 0 ) {
+                b[m / blockSize] = k.length();
+                appendNumber( k, key.length() );
+                k.append( key );
+            }
+            else {
+                uint s = 0;
+                while ( s < key.length() && s < previous.length() &&
+                        key[s] == previous[s] )
+                    s++;
+                appendNumber( k, s );
+                appendNumber( k, key.length() - s );
+                k.append( key.data() + s, key.length() - s );
+            }
+            v[m++] = value;
+            previous = key;
+            any = true;
+        }
+
+        values = v;
+        blocks = b;
+        keys = k;
+        n = m;
+        live = m;
+        recent = new Dict<T>;
+        recentKeys = new EStringList;
+        recentCount = 0;
+    }
+
+private:
+    static const uint blockSize = 16;
+
+    Dict<T> * recent;
+    EStringList * recentKeys;
+    T ** values;
+    uint * blocks;
+    EString keys;
+    uint n;
+    uint live;
+    uint recentCount;
+
+    static void appendNumber( EString & s, uint x ) {
+        while ( x >= 128 ) {
+            s.append( (char)( 128 | ( x & 127 ) ) );
+            x >>= 7;
+        }
+        s.append( (char)x );
+    }
+
+    uint number( uint & at ) const {
+        uint r = 0;
+        uint shift = 0;
+        while ( (unsigned char)keys[at] >= 128 ) {
+            r |= ( (unsigned char)keys[at] & 127 ) << shift;
+            shift += 7;
+            at++;
+        }
+        r |= (unsigned char)keys[at] << shift;
+        at++;
+        return r;
+    }
+
+    // decodes entry number i, which begins at offset at, into key,
+    // whose content must be entry i-1 unless i starts a block.
+    // returns the offset of the next entry.
+    uint decode( uint at, uint i, EString & key ) const {
+        if ( i % blockSize == 0 ) {
+            uint l = number( at );
+            key = keys.mid( at, l );
+            return at + l;
+        }
+        uint s = number( at );
+        uint l = number( at );
+        EString r = key.mid( 0, s );
+        r.append( keys.data() + at, l );
+        key = r;
+        return at + l;
+    }
+
+    // compares k with the first key of block b
+    int compareFirst( const EString & k, uint b ) const {
+        uint at = blocks[b];
+        uint l = number( at );
+        const char * p = keys.data() + at;
+        uint i = 0;
+        while ( i < l && i < k.length() && p[i] == k[i] )
+            i++;
+        if ( i == l && i == k.length() )
+            return 0;
+        if ( i == k.length() )
+            return -1;
+        if ( i == l )
+            return 1;
+        return (unsigned char)k[i] < (unsigned char)p[i] ? -1 : 1;
+    }
+
+    int locate( const EString & k ) const {
+        if ( !n )
+            return -1;
+
+        // find the last block whose first key is k or smaller
+        uint lo = 0;
+        uint hi = ( n + blockSize - 1 ) / blockSize;
+        while ( hi - lo > 1 ) {
+            uint mid = ( lo + hi ) / 2;
+            if ( compareFirst( k, mid ) < 0 )
+                hi = mid;
+            else
+                lo = mid;
+        }
+
+        // walk the block. match is the length of the prefix k shares
+        // with the entry just read, which is smaller than k.
+        uint i = lo * blockSize;
+        uint at = blocks[lo];
+        uint l = number( at );
+        uint match = 0;
+        const char * p = keys.data() + at;
+        while ( match < l && match < k.length() && p[match] == k[match] )
+            match++;
+        if ( match == l && match == k.length() )
+            return i;
+        if ( match < l &&
+             ( match == k.length() ||
+               (unsigned char)k[match] < (unsigned char)p[match] ) )
+            return -1;
+        at += l;
+        i++;
+        while ( i < n && i % blockSize ) {
+            uint s = number( at );
+            l = number( at );
+            p = keys.data() + at;
+            at += l;
+            if ( s < match )
+                return -1;
+            if ( s == match ) {
+                uint j = 0;
+                while ( j < l && match < k.length() &&
+                        p[j] == k[match] ) {
+                    j++;
+                    match++;
+                }
+                if ( j == l && match == k.length() )
+                    return i;
+                if ( j < l &&
+                     ( match == k.length() ||
+                       (unsigned char)k[match] < (unsigned char)p[j] ) )
+                    return -1;
+            }
+            i++;
+        }
+        return -1;
+    }
+
+private:
+    // operators explicitly undefined because there is no single
+    // correct way to implement them.
+    CompactDict< T > &operator =( const CompactDict< T > & ) {
+        return *this;
+    }
+    bool operator ==( const CompactDict< T > & ) const { return false; }
+    bool operator !=( const CompactDict< T > & ) const { return false; }
+};
+
+
+#endif
@@ -9,7 +9,7 @@
 #include "allocator.h"
 #include "estringlist.h"
 
-// gethostname()
+// gethostname(), sysconf()
 #include <unistd.h>
 // gethostbyname()
 #include <netdb.h>
@@ -22,13 +22,15 @@
 #include <errno.h>
 // memmove()
 #include <string.h>
+// open(), openat()
+#include <fcntl.h>
 
 
 class ConfigurationData
     : public Garbage
 {
 public:
-    ConfigurationData(): errors( 0 ) {}
+    ConfigurationData(): errors( 0 ), dir( -1 ) {}
 
     uint scalar[Configuration::NumScalars];
     EString text[Configuration::NumTexts];
@@ -44,6 +46,11 @@ public:
     };
     List<Error> * errors;
     EStringList seen;
+
+    // the directory containing the configuration file, kept open so
+    // reload() can read the file after chroot, and the file's name
+    int dir;
+    EString leaf;
     bool contains( const EString & s )
     {
         EStringList::Iterator i( seen );
@@ -119,7 +126,14 @@ void Configuration::read( const EString & file, bool allowFailure )
 
     log( "Using configuration file " + file, Log::Debug );
 
-    EString buffer( f.contents() );
+    parse( f.contents() );
+}
+
+
+/*! Parses each line of \a buffer as a variable. */
+
+void Configuration::parse( const EString & buffer )
+{
     // we now want to loop across buffer, picking up entire lines and
     // parsing them as variables.
     uint i = 0;
@@ -164,7 +178,31 @@ static struct {
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "tls-threads", Configuration::TlsThreads, 0 },
+    { "gc-slice-time", Configuration::GcSliceTime, 0 },
+    { "compression-level", Configuration::CompressionLevel, 6 },
+    { "fetch-read-ahead", Configuration::FetchReadAhead, 0 },
+    { "fetch-user-concurrency", Configuration::FetchUserConcurrency, 0 },
+    { "fetch-user-rate", Configuration::FetchUserRate, 0 },
+    { "shared-cache-size", Configuration::SharedCacheSize, 0 },
+    { "delivery-concurrency", Configuration::DeliveryConcurrency, 4 },
+    { "smarthost-connections", Configuration::SmartHostConnections, 2 },
+    { "db-reserved-handles", Configuration::DbReservedHandles, 1 },
+    { "db-replica-port", Configuration::DbReplicaPort, 5432 },
+    { "db-replica-handles", Configuration::DbReplicaHandles, 2 },
+    { "maintenance-rate", Configuration::MaintenanceRate, 100 },
+    { "slow-command-time", Configuration::SlowCommandTime, 1000 },
+    { "slow-query-time", Configuration::SlowQueryTime, 1000 },
+    { "metrics-port", Configuration::MetricsPort, 17222 },
+    { "injection-threads", Configuration::InjectionThreads, 0 },
+    { "tls-session-cache-size", Configuration::TlsSessionCacheSize, 20480 },
+    { "tls-session-timeout", Configuration::TlsSessionTimeout, 3600 },
+    { "connection-log-sample", Configuration::ConnectionLogSample, 1 },
+    { "drain-time", Configuration::DrainTime, 300 },
+    { "slow-loop-time", Configuration::SlowLoopTime, 1000 },
+    { "profile-rate", Configuration::ProfileRate, 0 },
+    { "cold-storage-age", Configuration::ColdStorageAge, 0 }
 };
 
 
@@ -211,7 +249,16 @@ static struct {
     { "smarthost-address", Configuration::SmartHostAddress, "127.0.0.1" },
     { "address-separator", Configuration::AddressSeparator, "" },
     { "statistics-address", Configuration::StatisticsAddress, "127.0.0.1" },
-    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" }
+    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" },
+    { "event-backend", Configuration::EventBackend, "auto" },
+    { "blob-directory", Configuration::BlobDir, "" },
+    { "db-replica-address", Configuration::DbReplicaAddress, "" },
+    { "indexed-header-fields", Configuration::IndexedHeaderFields, "" },
+    { "tls-ticket-key-file", Configuration::TlsTicketKeyFile, "" },
+    { "connection-log", Configuration::ConnectionLog, "database" },
+    { "profile-directory", Configuration::ProfileDir, MESSAGEDIR },
+    { "cold-storage-directory", Configuration::ColdStorageDir, "" },
+    { "interned-header-fields", Configuration::InternedHeaderFields, "" }
 };
 
 
@@ -243,7 +290,16 @@ static struct {
     { "use-statistics", Configuration::UseStatistics, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
-    { "use-imap-quota", Configuration::UseImapQuota, true }
+    { "use-imap-quota", Configuration::UseImapQuota, true },
+    { "lazy-mailbox-tree", Configuration::LazyMailboxTree, false },
+    { "use-word-index", Configuration::UseWordIndex, false },
+    { "store-raw-messages", Configuration::StoreRawMessages, false },
+    { "relaxed-commits", Configuration::RelaxedCommits, false },
+    { "explain-slow-queries", Configuration::ExplainSlowQueries, false },
+    { "compress-bodyparts", Configuration::CompressBodyparts, false },
+    { "reuse-port", Configuration::ReusePort, false },
+    { "use-ktls", Configuration::UseKtls, false },
+    { "use-injection-function", Configuration::UseInjectionFunction, false }
 };
 
 
@@ -653,6 +709,16 @@ void Configuration::setup( const EString & global, bool allowFailure )
     if ( hn.lower() == "localhost" || hn.lower().startsWith( "localhost." ) )
         log( "Using localhost as hostname", Log::Error );
 
+    if ( present( ServerProcesses ) && !d->scalar[ServerProcesses] ) {
+        // 0 means one process per CPU core
+        long cores = ::sysconf( _SC_NPROCESSORS_ONLN );
+        if ( cores < 1 )
+            cores = 1;
+        d->scalar[ServerProcesses] = (uint)cores;
+        log( "Using server-processes = " + fn( cores ) +
+             " (one per CPU core)", Log::Info );
+    }
+
     if ( !present( UseIPv6 ) && toggle( UseIPv6 ) ) {
         int s = ::socket( PF_INET6, SOCK_STREAM, IPPROTO_TCP );
         bool bad = false;
@@ -695,6 +761,205 @@ void Configuration::setup( const EString & global, bool allowFailure )
 }
 
 
+/*! Remembers where the configuration file \a file is, so that
+    reload() can read it again even after the server has chrooted.
+    Must be called before chroot().
+*/
+
+void Configuration::prepareReload( const EString & file )
+{
+    if ( !d || d->dir >= 0 )
+        return;
+    int slash = -1;
+    int i = file.find( '/' );
+    while ( i >= 0 ) {
+        slash = i;
+        i = file.find( '/', i + 1 );
+    }
+    EString dir( "." );
+    if ( slash == 0 )
+        dir = "/";
+    else if ( slash > 0 )
+        dir = file.mid( 0, slash );
+    d->leaf = file.mid( slash + 1 );
+    d->dir = ::open( dir.cstr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+}
+
+
+static uint reloadableScalars[] = {
+    Configuration::DbMaxHandles,
+    Configuration::DbHandleInterval,
+    Configuration::DbHandleTimeout,
+    Configuration::DbReservedHandles,
+    Configuration::MemoryLimit,
+    Configuration::GcSliceTime,
+    Configuration::FetchReadAhead,
+    Configuration::FetchUserConcurrency,
+    Configuration::FetchUserRate,
+    Configuration::MaintenanceRate,
+    Configuration::SlowCommandTime,
+    Configuration::SlowQueryTime,
+    Configuration::SlowLoopTime,
+    Configuration::ConnectionLogSample,
+    Configuration::DrainTime,
+    Configuration::ProfileRate
+};
+
+
+static uint reloadableTexts[] = {
+    Configuration::LogLevel,
+    Configuration::ConnectionLog,
+    Configuration::ProfileDir
+};
+
+
+static uint reloadableToggles[] = {
+    Configuration::ExplainSlowQueries
+};
+
+
+static bool member( uint n, const uint * list, uint size )
+{
+    uint i = 0;
+    while ( i < size / sizeof( uint ) && list[i] != n )
+        i++;
+    return i < size / sizeof( uint );
+}
+
+
+/*! Reads the configuration file again, and applies the changes to
+    those variables that can safely change while the server is
+    running: Mostly the database handle limits, memory-limit and the
+    other performance knobs, log-level and connection-log. Each change
+    is logged. Other changes are logged too, but take effect only
+    after a restart.
+
+    If the file contains errors, nothing is changed.
+
+    The caller is responsible for telling the classes that cache
+    configuration values (e.g. EventLoop) about the changes.
+*/
+
+void Configuration::reload()
+{
+    EString buffer;
+    int fd = -1;
+    if ( d->dir >= 0 )
+        fd = ::openat( d->dir, d->leaf.cstr(), O_RDONLY | O_CLOEXEC );
+    if ( fd >= 0 ) {
+        char b[4096];
+        int r = 0;
+        do {
+            r = ::read( fd, b, 4096 );
+            if ( r > 0 )
+                buffer.append( b, r );
+        } while ( r > 0 );
+        ::close( fd );
+    }
+    if ( fd < 0 || buffer.isEmpty() ) {
+        ::log( "Cannot reread the configuration file", Log::Error );
+        return;
+    }
+
+    ConfigurationData * old = d;
+    d = new ConfigurationData;
+    parse( buffer );
+    ConfigurationData * fresh = d;
+    d = old;
+
+    if ( fresh->errors ) {
+        bool bad = false;
+        List<ConfigurationData::Error>::Iterator e( fresh->errors );
+        while ( e ) {
+            ::log( e->e, e->s );
+            if ( e->s == Log::Disaster )
+                bad = true;
+            ++e;
+        }
+        if ( bad ) {
+            ::log( "Not reloading the configuration due to errors",
+                   Log::Error );
+            return;
+        }
+    }
+
+    uint n = 0;
+    while ( n < NumScalars ) {
+        EString name( scalarDefaults[n].name );
+        uint was = scalar( (Scalar)n );
+        uint now = scalarDefaults[n].value;
+        if ( fresh->contains( name ) )
+            now = fresh->scalar[n];
+        if ( n == ServerProcesses && !now )
+            now = was; // 0 means the number of cores, see setup()
+        if ( was == now ) {
+            // nothing to do
+        }
+        else if ( member( n, reloadableScalars,
+                          sizeof( reloadableScalars ) ) ) {
+            if ( !d->contains( name ) )
+                d->seen.append( name );
+            d->scalar[n] = now;
+            ::log( "Changed " + name + " from " + fn( was ) +
+                   " to " + fn( now ), Log::Significant );
+        }
+        else {
+            ::log( "Changing " + name + " requires a restart" );
+        }
+        n++;
+    }
+
+    n = 0;
+    while ( n < NumTexts ) {
+        EString name( textDefaults[n].name );
+        EString was = textDefaults[n].value;
+        if ( d->contains( name ) )
+            was = d->text[n];
+        EString now = textDefaults[n].value;
+        if ( fresh->contains( name ) )
+            now = fresh->text[n];
+        if ( was == now ) {
+            // nothing to do
+        }
+        else if ( member( n, reloadableTexts, sizeof( reloadableTexts ) ) ) {
+            if ( !d->contains( name ) )
+                d->seen.append( name );
+            d->text[n] = now;
+            ::log( "Changed " + name + " from " + was.quoted() +
+                   " to " + now.quoted(), Log::Significant );
+        }
+        else {
+            ::log( "Changing " + name + " requires a restart" );
+        }
+        n++;
+    }
+
+    n = 0;
+    while ( n < NumToggles ) {
+        EString name( toggleDefaults[n].name );
+        bool was = toggle( (Toggle)n );
+        bool now = toggleDefaults[n].value;
+        if ( fresh->contains( name ) )
+            now = fresh->toggle[n];
+        if ( was == now ) {
+            // nothing to do
+        }
+        else if ( member( n, reloadableToggles,
+                          sizeof( reloadableToggles ) ) ) {
+            if ( !d->contains( name ) )
+                d->seen.append( name );
+            d->toggle[n] = now;
+            ::log( "Changed " + name + " to " +
+                   ( now ? "enabled" : "disabled" ), Log::Significant );
+        }
+        else {
+            ::log( "Changing " + name + " requires a restart" );
+        }
+        n++;
+    }
+}
+
+
 /*! \fn EString Configuration::hostname()
     Returns the configured hostname (or our best guess, if no hostname
     has been specified in the configuration).
@@ -57,6 +57,30 @@ public:
         StatisticsPort,
         LdapServerPort,
         MemoryLimit,
+        TlsThreads,
+        GcSliceTime,
+        CompressionLevel,
+        FetchReadAhead,
+        FetchUserConcurrency,
+        FetchUserRate,
+        SharedCacheSize,
+        DeliveryConcurrency,
+        SmartHostConnections,
+        DbReservedHandles,
+        DbReplicaPort,
+        DbReplicaHandles,
+        MaintenanceRate,
+        SlowCommandTime,
+        SlowQueryTime,
+        MetricsPort,
+        InjectionThreads,
+        TlsSessionCacheSize,
+        TlsSessionTimeout,
+        ConnectionLogSample,
+        DrainTime,
+        SlowLoopTime,
+        ProfileRate,
+        ColdStorageAge,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -102,6 +126,15 @@ public:
         AddressSeparator,
         StatisticsAddress,
         LdapServerAddress,
+        EventBackend,
+        BlobDir,
+        DbReplicaAddress,
+        IndexedHeaderFields,
+        TlsTicketKeyFile,
+        ConnectionLog,
+        ProfileDir,
+        ColdStorageDir,
+        InternedHeaderFields,
         // additional texts go ABOVE THIS LINE
         NumTexts
     };
@@ -134,6 +167,15 @@ public:
         SoftBounce,
         CheckSenderAddresses,
         UseImapQuota,
+        LazyMailboxTree,
+        UseWordIndex,
+        StoreRawMessages,
+        RelaxedCommits,
+        ExplainSlowQueries,
+        CompressBodyparts,
+        ReusePort,
+        UseKtls,
+        UseInjectionFunction,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
@@ -147,6 +189,9 @@ public:
 
     static void read( const EString &, bool );
 
+    static void prepareReload( const EString & );
+    static void reload();
+
     static List<Text> * addressVariables();
 
 private:
@@ -154,6 +199,8 @@ private:
 
     static void log( const EString &, Log::Severity );
 
+    static void parse( const EString & );
+
     static void parseScalar( uint, const EString & );
     static void parseText( uint, const EString & );
     static void parseToggle( uint, const EString & );
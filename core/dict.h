@@ -40,14 +40,19 @@ class UDict: public PatriciaTree<T> {
 public:
     UDict(): PatriciaTree<T>() {}
 
+    // UString's internal representation depends on its widest
+    // character, so the key is the UTF-8 form instead.
     T * find( const UString & s ) const {
-        return PatriciaTree<T>::find( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        EString k = s.utf8();
+        return PatriciaTree<T>::find( k.data(), k.length() * 8 );
     }
     void insert( const UString & s, T* r ) {
-        PatriciaTree<T>::insert( (const char *)s.data(), s.length() * 8 * sizeof( uint ), r );
+        EString k = s.utf8();
+        PatriciaTree<T>::insert( k.data(), k.length() * 8, r );
     }
     T* remove( const UString & s ) {
-        return PatriciaTree<T>::remove( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        EString k = s.utf8();
+        return PatriciaTree<T>::remove( k.data(), k.length() * 8 );
     }
     bool contains( const UString & s ) const {
         return find( s ) != 0;
@@ -3,11 +3,14 @@
 #include "estring.h"
 
 #include "allocator.h"
+#include "dict.h"
 
 // stderr, fprintf
 #include <stdio.h>
 // strlen
 #include <string.h>
+// compress2, uncompress
+#include <zlib.h>
 
 
 /*! \class EStringData estring.h
@@ -264,6 +267,36 @@ EString EString::upper() const
 }
 
 
+static Dict<EString> * internedStrings = 0;
+
+
+/*! Returns a string equal to this one, whose data is shared with
+    every other interned() string of the same value. Comparing two
+    interned strings is a pointer comparison, and each value is stored
+    only once.
+
+    The strings are never freed, so this is meant only for the small
+    and stable sets of names we see very often, e.g. flag and header
+    field names.
+*/
+
+EString EString::interned() const
+{
+    if ( isEmpty() )
+        return *this;
+    if ( !internedStrings ) {
+        internedStrings = new Dict<EString>;
+        Allocator::addEternal( internedStrings, "interned strings" );
+    }
+    EString * s = internedStrings->find( *this );
+    if ( !s ) {
+        s = new EString( data(), length() );
+        internedStrings->insert( *s, s );
+    }
+    return *s;
+}
+
+
 /*! Returns a copy of this string where all letters have been changed
   to conform to typical mail header practice: Letters following digits
   and other letters are lower-cased. Other letters are upper-cased
@@ -446,12 +479,7 @@ void EString::appendNumber( int n, int base )
 
 void EString::appendNumber( uint n, int base )
 {
-    EString s( fromNumber( n, base ) );
-
-    if ( n > 0 )
-        append( s );
-    else
-        append( "0" );
+    appendNumber( (int64)n, (uint)base );
 }
 
 /*! Ensures that there is at least \a num bytes available in this
@@ -968,17 +996,42 @@ EString EString::fromNumber( int64 n, uint base )
 
 void EString::appendNumber( int64 n, uint base )
 {
-    int64 top = 1;
-    while ( top * base <= n )
-        top = base * top;
-    while ( top ) {
-        uint d = ( n / top ) % base;
-        char  c = '0' + d;
-        if ( d > 9 )
-            c = 'a' + d - 10;
-        append( c );
-        top = top / base;
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+
+    // the digits are generated backwards, into the end of b
+    char b[66];
+    uint i = sizeof( b );
+    bool negative = n < 0;
+    unsigned long long u = negative ? -(unsigned long long)n : n;
+    if ( base == 10 ) {
+        while ( u >= 100 ) {
+            uint p = ( u % 100 ) * 2;
+            u /= 100;
+            b[--i] = pairs[p+1];
+            b[--i] = pairs[p];
+        }
+        if ( u >= 10 ) {
+            b[--i] = pairs[u*2+1];
+            b[--i] = pairs[u*2];
+        }
+        else {
+            b[--i] = '0' + u;
+        }
+    }
+    else {
+        do {
+            uint d = u % base;
+            b[--i] = d > 9 ? 'a' + d - 10 : '0' + d;
+            u /= base;
+        } while ( u );
     }
+    if ( negative )
+        b[--i] = '-';
+    append( b + i, sizeof( b ) - i );
 }
 
 
@@ -1169,13 +1222,38 @@ EString EString::de64() const
     // this code comes from mailchen, adapted for EString.
     EString result;
     result.reserve( length() * 3 / 4 + 20 ); // 20 = fudge
-    EString body;
     uint bp = 0;
     uint decoded = 0;
     int m = 0;
     uint p = 0;
+    uint l = length();
     bool done = false;
-    while ( p < length() && !done ) {
+    while ( p < l && !done ) {
+        // most of the input is whole groups of four characters, which
+        // we decode in one go. whitespace, padding and junk use the
+        // slower per-character code below.
+        while ( m == 0 && p + 4 <= l ) {
+            uint a = d->str[p];
+            uint b = d->str[p+1];
+            uint c = d->str[p+2];
+            uint e = d->str[p+3];
+            if ( a > 'z' || b > 'z' || c > 'z' || e > 'z' )
+                break;
+            a = from64[a];
+            b = from64[b];
+            c = from64[c];
+            e = from64[e];
+            if ( ( a | b | c | e ) >= 64 )
+                break;
+            uint n = ( a << 18 ) | ( b << 12 ) | ( c << 6 ) | e;
+            result.d->str[bp++] = n >> 16;
+            result.d->str[bp++] = ( n >> 8 ) & 255;
+            result.d->str[bp++] = n & 255;
+            p += 4;
+        }
+        if ( p >= l )
+            break;
+
         uint c = d->str[p++];
         if ( c <= 'z' )
             c = from64[c];
@@ -1230,17 +1308,26 @@ static char to64[65] =
 EString EString::e64( uint lineLength ) const
 {
     // this code comes from mailchen, adapted for EString
-    int l = length();
-    int i = 0;
+    uint l = length();
+    uint i = 0;
     EString r;
-    r.reserve( l*2 );
-    int p = 0;
+    if ( !l )
+        return r;
+    // reserve exactly what we need: four bytes per group of three,
+    // plus a CRLF at most every lineLength bytes and one at the end.
+    uint groups = ( l + 2 ) / 3;
+    uint size = groups * 4;
+    if ( lineLength > 0 )
+        size += 2 * ( groups / ( ( lineLength + 3 ) / 4 ) + 1 );
+    r.reserve( size );
+    uint p = 0;
     uint c = 0;
-    while ( i <= l-3 ) {
-        r.d->str[p++] = to64[ ((d->str[i]>>2))&63 ];
-        r.d->str[p++] = to64[ ((d->str[i]<<4)&48) + ((d->str[i+1]>>4)&15) ];
-        r.d->str[p++] = to64[ ((d->str[i+1]<<2)&60) + ((d->str[i+2]>>6)&3) ];
-        r.d->str[p++] = to64[ (d->str[i+2]&63) ];
+    while ( i + 3 <= l ) {
+        uint n = ( d->str[i] << 16 ) | ( d->str[i+1] << 8 ) | d->str[i+2];
+        r.d->str[p++] = to64[ n >> 18 ];
+        r.d->str[p++] = to64[ ( n >> 12 ) & 63 ];
+        r.d->str[p++] = to64[ ( n >> 6 ) & 63 ];
+        r.d->str[p++] = to64[ n & 63 ];
         i += 3;
         c += 4;
         if ( lineLength > 0 && c >= lineLength ) {
@@ -1274,6 +1361,22 @@ EString EString::e64( uint lineLength ) const
 }
 
 
+/*! Returns the value of the hexadecimal digit \a c, or -1 if \a c
+    isn't one.
+*/
+
+static inline int hexValue( char c )
+{
+    if ( c >= '0' && c <= '9' )
+        return c - '0';
+    if ( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    return -1;
+}
+
+
 /*! Decodes this string according to the quoted-printable algorithm,
     and returns the result. Errors are overlooked, to cope with all
     the mail-munging brokenware in the great big world.
@@ -1288,7 +1391,16 @@ EString EString::deQP( bool underscore ) const
     EString r;
     r.reserve( length() );
     while ( i < length() ) {
-        if ( d->str[i] != '=' ) {
+        if ( !underscore && d->str[i] != '=' ) {
+            // copy everything up to the next = in one go
+            const char * e = (const char *)memchr( d->str + i, '=',
+                                                   d->len - i );
+            uint n = e ? e - d->str - i : d->len - i;
+            memmove( r.d->str + r.d->len, d->str + i, n );
+            r.d->len += n;
+            i += n;
+        }
+        else if ( d->str[i] != '=' ) {
             char c = d->str[i++];
             if ( underscore && c == '_' )
                 c = ' ';
@@ -1315,7 +1427,12 @@ EString EString::deQP( bool underscore ) const
             }
             else if ( i + 2 < d->len ) {
                 // ... and one common case: a two-digit hex number, not EOL
-                c = mid( i+1, 2 ).number( &ok, 16 );
+                int h = hexValue( d->str[i+1] );
+                int l = hexValue( d->str[i+2] );
+                if ( h >= 0 && l >= 0 ) {
+                    c = h * 16 + l;
+                    ok = true;
+                }
             }
 
             // write the proper decoded string and increase i.
@@ -1519,6 +1636,65 @@ bool EString::needsQP() const
 }
 
 
+/*! Returns a zlib-compressed copy of this string, preceded by the
+    uncompressed length as a four-byte big-endian number, so that
+    inflated() can allocate exactly what it needs. \a level is the
+    zlib compression level.
+*/
+
+EString EString::deflated( int level ) const
+{
+    uint l = length();
+    uLongf n = ::compressBound( l );
+    EString r;
+    r.reserve( 4 + n );
+    r.d->str[0] = ( l >> 24 ) & 0xff;
+    r.d->str[1] = ( l >> 16 ) & 0xff;
+    r.d->str[2] = ( l >> 8 ) & 0xff;
+    r.d->str[3] = l & 0xff;
+    if ( ::compress2( (Bytef*)r.d->str + 4, &n,
+                      (const Bytef*)data(), l, level ) != Z_OK )
+        return EString();
+    r.d->len = 4 + n;
+    return r;
+}
+
+
+/*! Returns the uncompressed form of a string made by deflated(). If
+    this string isn't one, returns an empty string and sets \a *ok to
+    false (if \a ok is non-null). Otherwise sets \a *ok to true.
+*/
+
+EString EString::inflated( bool * ok ) const
+{
+    if ( ok )
+        *ok = false;
+    if ( length() < 4 )
+        return EString();
+    uint l = ( (uint)(unsigned char)d->str[0] << 24 ) |
+             ( (uint)(unsigned char)d->str[1] << 16 ) |
+             ( (uint)(unsigned char)d->str[2] << 8 ) |
+             (uint)(unsigned char)d->str[3];
+    // deflate cannot do better than about 1032:1, so anything that
+    // claims more isn't ours
+    if ( l / 1032 > length() )
+        return EString();
+    EString r;
+    if ( l ) {
+        r.reserve( l );
+        uLongf n = l;
+        if ( ::uncompress( (Bytef*)r.d->str, &n,
+                           (const Bytef*)d->str + 4, length() - 4 ) != Z_OK ||
+             n != l )
+            return EString();
+        r.d->len = l;
+    }
+    if ( ok )
+        *ok = true;
+    return r;
+}
+
+
 /*! Returns -1 if this string is lexicographically before \a other, 0
     if they are the same, and 1 if this string is lexicographically
     after \a other.
@@ -1711,15 +1887,15 @@ static inline bool isMungableChar( char c ) {
     Specifically, most ASCII words are changed to xxxx, while most/all
     syntax elements are kept.
 
-    This function is very, very slow. That's okay since it's only used
-    for sending bug reports to us, and we all know, that's not a common
-    case.
+    This function is rather slow. It's used for bug reports and by
+    aoxexport -a, which builds test corpora from real mail.
 */
 
 EString EString::anonymised() const
 {
     uint b = 0;
     EString r;
+    r.reserve( length() );
     while ( b < length() ) {
         uint e = b;
         while ( e < d->len && ( d->str[e] > 127 ||
@@ -64,6 +64,7 @@ public:
     EString lower() const;
     EString upper() const;
     EString headerCased() const;
+    EString interned() const;
     EString mid( uint, uint = UINT_MAX ) const;
     EString simplified() const;
     EString trimmed() const;
@@ -122,6 +123,9 @@ public:
     EString eQP( bool = false, bool = false ) const;
     bool needsQP() const;
 
+    EString deflated( int = 6 ) const;
+    EString inflated( bool * = 0 ) const;
+
     friend inline bool operator==( const EString &, const EString & );
     friend bool operator==( const EString &, const char * );
 
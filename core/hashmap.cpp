@@ -0,0 +1,59 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "hashmap.h"
+
+
+/*! \class HashMap hashmap.h
+    The HashMap template maps from uint to a pointer, like Map, but
+    does not keep its keys in order and cannot be iterated over.
+
+    It is an open-addressing hash table with linear probing, stored as
+    two flat arrays (one of keys and one of pointers), so that a
+    lookup usually touches one or two cache lines rather than walking
+    the PatriciaTree behind Map. It's meant for the hot lookups by
+    database ID or UID: Mailbox::find(), MessageCache and the like.
+
+    The key array contains no pointers, so the Allocator doesn't scan
+    it. Null pointers cannot be stored; inserting one removes the key.
+*/
+
+
+/*! \fn HashMap::HashMap()
+    Creates a new empty HashMap. No memory is allocated until the
+    first insert().
+*/
+
+/*! \fn T * HashMap::find( uint k ) const
+    Returns a pointer to the object at key \a k, or a null pointer if
+    there is no such object. This function does not allocate any
+    memory.
+*/
+
+/*! \fn void HashMap::insert( uint k, T * r )
+    Inserts \a r into the HashMap at key \a k, replacing any previous
+    object there. If \a r is null, this is the same as remove( \a k ).
+    May allocate memory when the table grows.
+*/
+
+/*! \fn void HashMap::remove( uint k )
+    Removes the object at key \a k from the HashMap, if there is one.
+    Never allocates memory.
+*/
+
+/*! \fn bool HashMap::contains( uint k ) const
+    Returns true if this HashMap has an object at key \a k, and false
+    if not.
+*/
+
+/*! \fn void HashMap::clear()
+    Removes everything in the HashMap.
+*/
+
+/*! \fn uint HashMap::count() const
+    Returns the number of objects in the HashMap.
+*/
+
+/*! \fn bool HashMap::isEmpty() const
+    Returns true if the HashMap contains no objects, and false if it
+    contains at least one.
+*/
@@ -0,0 +1,126 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include "global.h"
+#include "allocator.h"
+
+
+template<class T>
+class HashMap
+    : public Garbage
+{
+public:
+    HashMap(): Garbage(), keys( 0 ), values( 0 ), size( 0 ), n( 0 ) {}
+
+    T * find( uint k ) const {
+        if ( !n )
+            return 0;
+        uint i = slot( k );
+        while ( values[i] ) {
+            if ( keys[i] == k )
+                return values[i];
+            i = ( i + 1 ) & ( size - 1 );
+        }
+        return 0;
+    }
+
+    void insert( uint k, T * r ) {
+        if ( !r ) {
+            remove( k );
+            return;
+        }
+        if ( ( n + 1 ) * 4 > size * 3 )
+            grow();
+        uint i = slot( k );
+        while ( values[i] && keys[i] != k )
+            i = ( i + 1 ) & ( size - 1 );
+        if ( !values[i] )
+            n++;
+        keys[i] = k;
+        values[i] = r;
+    }
+
+    void remove( uint k ) {
+        if ( !n )
+            return;
+        uint i = slot( k );
+        while ( values[i] && keys[i] != k )
+            i = ( i + 1 ) & ( size - 1 );
+        if ( !values[i] )
+            return;
+        values[i] = 0;
+        n--;
+        // move later members of the same run back, so that find()
+        // can stop at the first empty slot
+        uint j = i;
+        while ( true ) {
+            j = ( j + 1 ) & ( size - 1 );
+            if ( !values[j] )
+                return;
+            uint h = slot( keys[j] );
+            if ( ( j > i && ( h <= i || h > j ) ) ||
+                 ( j < i && ( h <= i && h > j ) ) ) {
+                keys[i] = keys[j];
+                values[i] = values[j];
+                values[j] = 0;
+                i = j;
+            }
+        }
+    }
+
+    bool contains( uint k ) const { return find( k ) != 0; }
+
+    void clear() {
+        keys = 0;
+        values = 0;
+        size = 0;
+        n = 0;
+    }
+
+    uint count() const { return n; }
+    bool isEmpty() const { return n == 0; }
+
+private:
+    uint * keys;
+    T ** values;
+    uint size;
+    uint n;
+
+    uint slot( uint k ) const {
+        return ( k * 2654435769U ) & ( size - 1 );
+    }
+
+    void grow() {
+        uint * ok = keys;
+        T ** ov = values;
+        uint os = size;
+        size = size ? size * 2 : 16;
+        keys = (uint*)Allocator::alloc( size * sizeof( uint ), 0 );
+        values = (T**)Allocator::alloc( size * sizeof( T * ) );
+        uint i = 0;
+        while ( i < size ) {
+            keys[i] = 0;
+            values[i] = 0;
+            i++;
+        }
+        n = 0;
+        i = 0;
+        while ( i < os ) {
+            if ( ov[i] )
+                insert( ok[i], ov[i] );
+            i++;
+        }
+    }
+
+private:
+    // operators explicitly undefined because there is no single
+    // correct way to implement them.
+    HashMap< T > &operator =( const HashMap< T > & ) { return *this; }
+    bool operator ==( const HashMap< T > & ) const { return false; }
+    bool operator !=( const HashMap< T > & ) const { return false; }
+};
+
+
+#endif
@@ -142,6 +142,60 @@ EString Log::id()
 }
 
 
+/*! Records that \a l describes the work done using this Log (and its
+    children), e.g. "IMAP fetch". The Profiler uses this to say what
+    the server was doing.
+*/
+
+void Log::setLabel( const EString & l )
+{
+    lbl = l;
+}
+
+
+/*! Returns the label() set for this Log, or if none is set, that of
+    the closest parent() that has one. Returns an empty string if none
+    has.
+*/
+
+EString Log::label() const
+{
+    const Log * l = this;
+    while ( l && l->lbl.isEmpty() )
+        l = l->p;
+    if ( l )
+        return l->lbl;
+    return "";
+}
+
+
+/*! Records that the work done using this Log (and its children) is
+    done on behalf of the user whose login is \a u. The Database and
+    the Fetcher use this to share their capacity fairly among users.
+*/
+
+void Log::setUser( const EString & u )
+{
+    usr = u;
+}
+
+
+/*! Returns the user() set for this Log, or if none is set, that of
+    the closest parent() that has one. Returns an empty string if none
+    has.
+*/
+
+EString Log::user() const
+{
+    const Log * l = this;
+    while ( l && l->usr.isEmpty() )
+        l = l->p;
+    if ( l )
+        return l->usr;
+    return "";
+}
+
+
 /*! Returns a pointer to the Log that was in effect when this object
     was created. This object's id() is based on the parent's id().
 
@@ -176,3 +230,14 @@ void Log::setLogLevel( Severity s )
 {
     logLevel = s;
 }
+
+
+/*! Returns true if messages with severity \a s are logged at all,
+    and false if they're discarded. Callers that build expensive
+    debug messages can use this to avoid building them in vain.
+*/
+
+bool Log::enabled( Severity s )
+{
+    return s >= logLevel;
+}
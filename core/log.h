@@ -20,15 +20,24 @@ public:
     void log( const EString &, Severity = Info );
     EString id();
 
+    void setLabel( const EString & );
+    EString label() const;
+
+    void setUser( const EString & );
+    EString user() const;
+
     Log * parent() const;
     bool isChildOf( Log * ) const;
 
     static void setLogLevel( Severity );
+    static bool enabled( Severity );
     static const char * severity( Severity );
     static bool disastersYet();
 
 private:
     EString ide;
+    EString lbl;
+    EString usr;
     uint children;
     Log * p;
 };
@@ -0,0 +1,213 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sha256.h"
+
+#include "estring.h"
+
+// memmove, memset
+#include <string.h>
+
+
+static const uint32 k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static inline uint32 rotr( uint32 x, uint n )
+{
+    return ( x >> n ) | ( x << ( 32 - n ) );
+}
+
+
+/*! \class SHA256 sha256.h
+    Implements the SHA-256 message-digest algorithm (FIPS 180-4).
+
+    The interface is the same as that of MD5: add() data, then call
+    hash() to get the 32-byte digest.
+*/
+
+/*! Creates and initialises an empty SHA256 object. */
+
+SHA256::SHA256()
+{
+    init();
+}
+
+
+/*! Initialises a SHA256 context for use. */
+
+void SHA256::init()
+{
+    h[0] = 0x6a09e667;
+    h[1] = 0xbb67ae85;
+    h[2] = 0x3c6ef372;
+    h[3] = 0xa54ff53a;
+    h[4] = 0x510e527f;
+    h[5] = 0x9b05688c;
+    h[6] = 0x1f83d9ab;
+    h[7] = 0x5be0cd19;
+    bytes = 0;
+    finalised = false;
+}
+
+
+/*! Updates the SHA256 context to reflect the concatenation of \a len
+    bytes from \a str.
+*/
+
+void SHA256::add( const char * str, uint len )
+{
+    // as with MD5, hash() destroys the accumulated input
+    if ( finalised )
+        init();
+
+    uint used = (uint)( bytes & 63 );
+    bytes += len;
+
+    if ( used ) {
+        uint t = 64 - used;
+        if ( len < t ) {
+            memmove( in + used, str, len );
+            return;
+        }
+        memmove( in + used, str, t );
+        transform();
+        str += t;
+        len -= t;
+    }
+
+    while ( len >= 64 ) {
+        memmove( in, str, 64 );
+        transform();
+        str += 64;
+        len -= 64;
+    }
+
+    memmove( in, str, len );
+}
+
+
+/*! \overload
+    As above, but adds data from the EString \a s.
+*/
+
+void SHA256::add( const EString & s )
+{
+    add( s.data(), s.length() );
+}
+
+
+/*! Returns the 32-byte SHA-256 hash of the bytes add()ed so far. */
+
+EString SHA256::hash()
+{
+    if ( !finalised ) {
+        int64 bits = bytes * 8;
+        uint used = (uint)( bytes & 63 );
+        in[used++] = (char)0x80;
+        if ( used > 56 ) {
+            memset( in + used, 0, 64 - used );
+            transform();
+            used = 0;
+        }
+        memset( in + used, 0, 56 - used );
+        uint i = 0;
+        while ( i < 8 ) {
+            in[63 - i] = (char)( bits >> ( 8 * i ) );
+            i++;
+        }
+        transform();
+        finalised = true;
+    }
+
+    EString r;
+    r.reserve( 32 );
+    uint i = 0;
+    while ( i < 8 ) {
+        r.append( (char)( h[i] >> 24 ) );
+        r.append( (char)( h[i] >> 16 ) );
+        r.append( (char)( h[i] >> 8 ) );
+        r.append( (char)h[i] );
+        i++;
+    }
+    return r;
+}
+
+
+/*! \overload
+    Returns the SHA-256 hash of the EString \a s.
+*/
+
+EString SHA256::hash( const EString & s )
+{
+    SHA256 ctx;
+
+    ctx.add( s );
+    return ctx.hash();
+}
+
+
+/*! Processes the 64-byte block in the input buffer. */
+
+void SHA256::transform()
+{
+    const unsigned char * p = (const unsigned char *)in;
+    uint32 w[64];
+    uint i = 0;
+    while ( i < 16 ) {
+        w[i] = ( (uint32)p[4*i] << 24 ) | ( (uint32)p[4*i+1] << 16 ) |
+               ( (uint32)p[4*i+2] << 8 ) | (uint32)p[4*i+3];
+        i++;
+    }
+    while ( i < 64 ) {
+        uint32 s0 = rotr( w[i-15], 7 ) ^ rotr( w[i-15], 18 ) ^
+                    ( w[i-15] >> 3 );
+        uint32 s1 = rotr( w[i-2], 17 ) ^ rotr( w[i-2], 19 ) ^
+                    ( w[i-2] >> 10 );
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+        i++;
+    }
+
+    uint32 a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32 e = h[4], f = h[5], g = h[6], x = h[7];
+    i = 0;
+    while ( i < 64 ) {
+        uint32 t1 = x + ( rotr( e, 6 ) ^ rotr( e, 11 ) ^ rotr( e, 25 ) ) +
+                    ( ( e & f ) ^ ( ~e & g ) ) + k[i] + w[i];
+        uint32 t2 = ( rotr( a, 2 ) ^ rotr( a, 13 ) ^ rotr( a, 22 ) ) +
+                    ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+        x = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+        i++;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += x;
+}
@@ -0,0 +1,35 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include "global.h"
+
+
+class EString;
+
+
+class SHA256
+    : public Garbage
+{
+public:
+    SHA256();
+
+    void add( const char *, uint );
+    void add( const EString & );
+
+    EString hash();
+    static EString hash( const EString & );
+
+private:
+    bool finalised;
+    int64 bytes;
+    uint32 h[8];
+    char in[64];
+
+    void init();
+    void transform();
+};
+
+
+#endif
@@ -14,9 +14,15 @@
 /*! \class UStringData ustring.h
 
     This private helper class contains the actual string data. It has
-    three fields, all accessible only to UString. The only noteworthy
-    field is max, which is 0 in the case of a shared/read-only string,
-    and nonzero in the case of a string which can be modified.
+    four fields, all accessible only to UString. max is 0 in the case
+    of a shared/read-only string, and nonzero in the case of a string
+    which can be modified.
+
+    width is the number of bytes used per character: 1 if all
+    characters are in ISO-8859-1, 2 if all are in the BMP, and 4
+    otherwise. Most text is ASCII, so most strings need a quarter of
+    the memory a uint per character would. at() and set() hide the
+    difference, so indexing stays O(1).
 */
 
 
@@ -28,16 +34,48 @@
 /*! Creates a new EString with \a words capacity. */
 
 UStringData::UStringData( int words )
-    : str( 0 ), len( 0 ), max( words )
+    : str( 0 ), len( 0 ), max( words ), width( 1 )
 {
     if ( str )
-        str = (uint*)Allocator::alloc( words*sizeof(uint), 0 );
+        str = (char*)Allocator::alloc( words, 0 );
 }
 
 
 void * UStringData::operator new( size_t ownSize, uint extra )
 {
-    return Allocator::alloc( ownSize + extra*sizeof(uint), 1 );
+    return Allocator::alloc( ownSize + extra, 1 );
+}
+
+
+/*! \fn uint UStringData::at( uint i ) const
+
+    Returns the character at position \a i, which must be less than
+    len.
+*/
+
+/*! \fn void UStringData::set( uint i, uint c )
+
+    Sets the character at position \a i to \a c. The caller must make
+    sure that \a c fits in width bytes and that \a i is less than max.
+*/
+
+/*! Copies \a n characters starting at \a start in \a from to position
+    \a to in this string, which must have room for them and be at
+    least as wide as \a from's characters.
+*/
+
+void UStringData::copy( uint to, const UStringData * from,
+                        uint start, uint n )
+{
+    if ( width == from->width ) {
+        memmove( str + to * width, from->str + start * width, n * width );
+        return;
+    }
+    uint i = 0;
+    while ( i < n ) {
+        set( to + i, from->at( start + i ) );
+        i++;
+    }
 }
 
 
@@ -181,8 +219,8 @@ void UString::append( const UString & other )
         *this = other;
         return;
     }
-    reserve( length() + other.length() );
-    memmove( d->str+d->len, other.d->str, sizeof(uint)*other.d->len );
+    prepare( length() + other.length(), other.d->width );
+    d->copy( d->len, other.d, 0, other.d->len );
     d->len += other.d->len;
 }
 
@@ -191,8 +229,8 @@ void UString::append( const UString & other )
 
 void UString::append( const uint cp )
 {
-    reserve( length() + 1 );
-    d->str[d->len] = cp;
+    prepare( length() + 1, widthOf( cp ) );
+    d->set( d->len, cp );
     d->len++;
 }
 
@@ -207,7 +245,31 @@ void UString::append( const char * s )
         return;
     reserve( length() + strlen( s ) );
     while ( s && *s )
-        d->str[d->len++] = (uint)*s++; // I feel naughty today
+        d->set( d->len++, (uint)*s++ ); // I feel naughty today
+}
+
+
+/*! Appends the \a n 8-bit characters starting at \a s to the end of
+    this string, treating each byte as a codepoint. The bytes should
+    be ASCII, and may include nulls.
+*/
+
+void UString::append( const char * s, uint n )
+{
+    if ( !s || !n )
+        return;
+    reserve( length() + n );
+    if ( d->width == 1 ) {
+        memmove( d->str + d->len, s, n );
+    }
+    else {
+        uint i = 0;
+        while ( i < n ) {
+            d->set( d->len + i, (uint)s[i] );
+            i++;
+        }
+    }
+    d->len += n;
 }
 
 
@@ -217,41 +279,67 @@ void UString::append( const char * s )
 */
 
 void UString::reserve( uint num )
+{
+    prepare( num, 1 );
+}
+
+
+/*! Ensures that this string is modifiable, has room for at least \a
+    num characters and stores at least \a w bytes per character.
+*/
+
+void UString::prepare( uint num, uint w )
 {
     if ( !num )
         num = 1;
+    if ( d && d->width > w )
+        w = d->width;
     if ( !d || d->max < num )
-        reserve2( num );
+        reserve2( num, w );
+    else if ( d->width < w )
+        reserve2( d->max, w );
+}
+
+
+/*! Returns the number of bytes needed to store \a cp: 1, 2 or 4. */
+
+uint UString::widthOf( uint cp )
+{
+    if ( cp < 0x100 )
+        return 1;
+    if ( cp < 0x10000 )
+        return 2;
+    return 4;
 }
 
 
-/*! Equivalent to reserve(). reserve( \a num ) calls this function to
-    do the heavy lifting. This function is not inline, while reserve()
-    is, and calls to this function should be interesting wrt. memory
-    allocation statistics.
+/*! Equivalent to reserve(). prepare() calls this function to do the
+    heavy lifting, making room for \a num characters of \a w bytes
+    each. This function is not inline, and calls to this function
+    should be interesting wrt. memory allocation statistics.
 
-    Noone except reserve() should call reserve2().
+    Noone except prepare() should call reserve2().
 */
 
-void UString::reserve2( uint num )
+void UString::reserve2( uint num, uint w )
 {
     const uint std = sizeof( UStringData );
-    const uint si = sizeof( uint );
-    num = ( Allocator::rounded( num * si + std ) - std ) / si;
+    num = ( Allocator::rounded( num * w + std ) - std ) / w;
 
     UStringData * freeable = 0;
     if ( d && d->max )
         freeable = d;
 
-    UStringData * nd = new( num ) UStringData( 0 );
+    UStringData * nd = new( num * w ) UStringData( 0 );
     nd->max = num;
-    nd->str = (uint*)(std + (char*)nd);
+    nd->width = w;
+    nd->str = std + (char*)nd;
     if ( d )
         nd->len = d->len;
     if ( nd->len > num )
         nd->len = num;
     if ( d && d->len )
-        memmove( nd->str, d->str, nd->len*si );
+        nd->copy( 0, d, 0, nd->len );
     d = nd;
 
     if ( freeable )
@@ -284,9 +372,9 @@ bool UString::isAscii() const
         return true;
     uint i = 0;
     while ( i < d->len ) {
-        if ( d->str[i] >= 128 ||
-             ( d->str[i] < 32 &&
-               d->str[i] != 9 && d->str[i] != 10 && d->str[i] != 13 ) )
+        if ( d->at( i ) >= 128 ||
+             ( d->at( i ) < 32 &&
+               d->at( i ) != 9 && d->at( i ) != 10 && d->at( i ) != 13 ) )
             return false;
         i++;
     }
@@ -310,8 +398,8 @@ EString UString::ascii() const
     r.reserve( length() );
     uint i = 0;
     while ( i < length() ) {
-        if ( d->str[i] >= ' ' && d->str[i] < 127 )
-            r.append( (char)(d->str[i]) );
+        if ( d->at( i ) >= ' ' && d->at( i ) < 127 )
+            r.append( (char)(d->at( i )) );
         else
             r.append( '?' );
         i++;
@@ -342,8 +430,9 @@ UString UString::mid( uint start, uint num ) const
 
     d->max = 0;
     result.d = new UStringData;
-    result.d->str = d->str + start;
+    result.d->str = d->str + start * d->width;
     result.d->len = num;
+    result.d->width = d->width;
     return result;
 }
 
@@ -395,7 +484,7 @@ UString UString::simplified() const
     uint i = 0;
     uint first = 0;
     while ( i < length() && first == i ) {
-        if ( isSpace( d->str[i] ) )
+        if ( isSpace( d->at( i ) ) )
             first++;
         i++;
     }
@@ -407,7 +496,7 @@ UString UString::simplified() const
     uint spaces = 0;
     bool identity = true;
     while ( identity && i < length() ) {
-        if ( isSpace( d->str[i] ) ) {
+        if ( isSpace( d->at( i ) ) ) {
             spaces++;
         }
         else {
@@ -428,7 +517,7 @@ UString UString::simplified() const
     bool ogham = false;
     bool zwnbsp = true;
     while ( i < length() ) {
-        int c = d->str[i];
+        int c = d->at( i );
         if ( isSpace( c ) ) {
             if ( c == 0x1680 )
                 ogham = true;
@@ -466,7 +555,7 @@ UString UString::trimmed() const
     uint first = length();
     uint last = 0;
     while ( i < length() ) {
-        if ( !isSpace( d->str[i] ) ) {
+        if ( !isSpace( d->at( i ) ) ) {
             if ( i < first )
                 first = i;
             if ( i > last )
@@ -512,8 +601,19 @@ int UString::compare( const UString & other ) const
     if ( d == other.d )
         return 0;
     uint i = 0;
+    if ( d && other.d && d->width == 1 && other.d->width == 1 ) {
+        uint l = length();
+        if ( other.length() < l )
+            l = other.length();
+        int r = memcmp( d->str, other.d->str, l );
+        if ( r < 0 )
+            return -1;
+        if ( r > 0 )
+            return 1;
+        i = l;
+    }
     while ( i < length() && i < other.length() &&
-            d->str[i] == other.d->str[i] )
+            d->at( i ) == other.d->at( i ) )
         i++;
     if ( i >= length() && i >= other.length() )
         return 0;
@@ -521,7 +621,7 @@ int UString::compare( const UString & other ) const
         return -1;
     if ( i >= other.length() )
         return 1;
-    if ( d->str[i] < other.d->str[i] )
+    if ( d->at( i ) < other.d->at( i ) )
         return -1;
     return 1;
 }
@@ -573,7 +673,7 @@ bool UString::startsWith( const char * prefix ) const
     if ( !length() )
         return false;
     uint i = 0;
-    while ( i < d->len && prefix[i] && prefix[i] == d->str[i] )
+    while ( i < d->len && prefix[i] && prefix[i] == d->at( i ) )
         i++;
     if ( i > d->len )
         return false;
@@ -606,7 +706,7 @@ bool UString::endsWith( const char * suffix ) const
     if ( l > length() )
         return false;
     uint i = 0;
-    while ( i < l && suffix[i] == d->str[d->len - l + i] )
+    while ( i < l && suffix[i] == d->at( d->len - l + i ) )
         i++;
     if ( i < l )
         return false;
@@ -620,7 +720,7 @@ bool UString::endsWith( const char * suffix ) const
 
 int UString::find( char c, int i ) const
 {
-    while ( i < (int)length() && d->str[i] != c )
+    while ( i < (int)length() && d->at( i ) != c )
         i++;
     if ( i < (int)length() )
         return i;
@@ -636,7 +736,7 @@ int UString::find( const UString & s, int i ) const
 {
     uint j = 0;
     while ( j < s.length() && i+j < length() ) {
-        if ( d->str[i+j] == s.d->str[j] ) {
+        if ( d->at( i+j ) == s.d->at( j ) ) {
             j++;
         }
         else {
@@ -681,7 +781,7 @@ bool UString::contains( const char * s ) const
         uint l = strlen( s );
         uint j = 0;
         while ( j < l && i + j < length() &&
-                d->str[i+j] == s[j] )
+                d->at( i+j ) == s[j] )
             j++;
         if ( j == l )
             return true;
@@ -703,12 +803,13 @@ UString UString::titlecased() const
     UString r = *this;
     uint i = 0;
     while ( i < length() ) {
-        uint cp = d->str[i];
+        uint cp = d->at( i );
         if ( cp < numTitlecaseCodepoints &&
              titlecaseCodepoints[cp] &&
              cp != titlecaseCodepoints[cp] ) {
-            r.detach();
-            r.d->str[i] = titlecaseCodepoints[cp];
+            uint tc = titlecaseCodepoints[cp];
+            r.prepare( length(), widthOf( tc ) );
+            r.d->set( i, tc );
         }
         i++;
     }
@@ -12,7 +12,7 @@ class UStringData
     : public Garbage
 {
 private:
-    UStringData(): str( 0 ), len( 0 ), max( 0 ) {
+    UStringData(): str( 0 ), len( 0 ), max( 0 ), width( 1 ) {
         setFirstNonPointer( &len );
     }
     UStringData( int );
@@ -23,9 +23,27 @@ private:
     void * operator new( size_t, uint );
     void * operator new( size_t s ) { return Garbage::operator new( s); }
 
-    uint * str;
+    uint at( uint i ) const {
+        if ( width == 1 )
+            return ((const unsigned char *)str)[i];
+        if ( width == 2 )
+            return ((const ushort *)str)[i];
+        return ((const uint *)str)[i];
+    }
+    void set( uint i, uint c ) {
+        if ( width == 1 )
+            ((unsigned char *)str)[i] = c;
+        else if ( width == 2 )
+            ((ushort *)str)[i] = c;
+        else
+            ((uint *)str)[i] = c;
+    }
+    void copy( uint, const UStringData *, uint, uint );
+
+    char * str;
     uint len;
     uint max;
+    uint width;
 };
 
 
@@ -46,7 +64,7 @@ public:
     uint operator[]( uint i ) const {
         if ( !d || i >= d->len )
             return 0;
-        return d->str[i];
+        return d->at( i );
     }
 
     bool isEmpty() const { return !d || d->len == 0; }
@@ -55,6 +73,7 @@ public:
     void append( const UString & );
     void append( const uint );
     void append( const char * );
+    void append( const char *, uint );
 
     void reserve( uint );
     void truncate( uint = 0 );
@@ -77,8 +96,6 @@ public:
     UString simplified() const;
     UString trimmed() const;
 
-    inline const uint * data() const { return d ? (const uint*)d->str : 0; }
-
     UString titlecased() const;
 
     inline void detach() { if ( !modifiable() ) reserve( length() ); }
@@ -104,7 +121,9 @@ public:
     static bool isSpace( uint );
 
 private:
-    void reserve2( uint );
+    void reserve2( uint, uint );
+    void prepare( uint, uint );
+    static uint widthOf( uint );
 
 
 private:
@@ -0,0 +1,63 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "vector.h"
+
+
+/*! \class Vector vector.h
+    The Vector template is a growable array of pointers.
+
+    Unlike List, it needs no allocation per element, and count() and
+    at() are cheap. It also works as a queue: append() adds at the
+    end and shift() removes from the start, and the space freed at the
+    start is reused when the array would otherwise have to grow.
+
+    The array is traced by the Allocator as usual. shift() clears the
+    slot it empties, so shifted elements can be freed.
+*/
+
+
+/*! \fn Vector::Vector()
+    Creates an empty Vector. No memory is allocated until the first
+    append().
+*/
+
+/*! \fn bool Vector::isEmpty() const
+    Returns true if the Vector contains no elements, and false if not.
+*/
+
+/*! \fn uint Vector::count() const
+    Returns the number of elements in the Vector.
+*/
+
+/*! \fn T * Vector::at( uint i ) const
+    Returns the element at position \a i (0 is the first), or a null
+    pointer if \a i is not less than count().
+*/
+
+/*! \fn T * Vector::operator[]( uint i ) const
+    Returns at( \a i ).
+*/
+
+/*! \fn T * Vector::firstElement() const
+    Returns the first element, or a null pointer if the Vector is
+    empty.
+*/
+
+/*! \fn T * Vector::lastElement() const
+    Returns the last element, or a null pointer if the Vector is
+    empty.
+*/
+
+/*! \fn void Vector::append( T * t )
+    Appends \a t to the Vector. This allocates memory only when the
+    array has to grow, which happens less and less often.
+*/
+
+/*! \fn T * Vector::shift()
+    Removes the first element and returns it, or returns a null
+    pointer if the Vector is empty.
+*/
+
+/*! \fn void Vector::clear()
+    Removes all elements from the Vector.
+*/
@@ -0,0 +1,93 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include "global.h"
+#include "allocator.h"
+
+
+template<class T>
+class Vector
+    : public Garbage
+{
+public:
+    Vector(): Garbage(), items( 0 ), first( 0 ), n( 0 ), size( 0 ) {}
+
+    bool isEmpty() const { return first == n; }
+    uint count() const { return n - first; }
+
+    T * at( uint i ) const {
+        if ( i >= n - first )
+            return 0;
+        return items[first + i];
+    }
+    T * operator[]( uint i ) const { return at( i ); }
+
+    T * firstElement() const { return at( 0 ); }
+    T * lastElement() const {
+        if ( first == n )
+            return 0;
+        return items[n - 1];
+    }
+
+    void append( T * t ) {
+        if ( n == size )
+            grow();
+        items[n++] = t;
+    }
+
+    T * shift() {
+        if ( first == n )
+            return 0;
+        T * t = items[first];
+        items[first] = 0;
+        first++;
+        if ( first == n )
+            first = n = 0;
+        return t;
+    }
+
+    void clear() {
+        items = 0;
+        first = n = size = 0;
+    }
+
+private:
+    T ** items;
+    uint first;
+    uint n;
+    uint size;
+
+    void grow() {
+        uint c = n - first;
+        uint s = size;
+        // if half or more is already shifted off, reuse the space
+        if ( !s || c * 2 > s )
+            s = s ? s * 2 : 8;
+        T ** a = items;
+        if ( s != size || !a )
+            a = (T**)Allocator::alloc( s * sizeof( T * ) );
+        uint i = 0;
+        while ( i < c ) {
+            a[i] = items[first + i];
+            i++;
+        }
+        while ( i < s )
+            a[i++] = 0;
+        items = a;
+        first = 0;
+        n = c;
+        size = s;
+    }
+
+private:
+    // operators explicitly undefined because there is no single
+    // correct way to implement them.
+    Vector< T > &operator =( const Vector< T > & ) { return *this; }
+    bool operator ==( const Vector< T > & ) const { return false; }
+    bool operator !=( const Vector< T > & ) const { return false; }
+};
+
+
+#endif
@@ -3,6 +3,7 @@
 #include "database.h"
 
 #include "list.h"
+#include "dict.h"
 #include "estring.h"
 #include "allocator.h"
 #include "configuration.h"
@@ -22,11 +23,14 @@
 
 
 static uint backendNumber;
-List< Query > *Database::queries;
+static const uint numPriorities = Query::Background + 1;
+static List< Query > * queries[numPriorities];
+static GraphableDataSet * queueWait[numPriorities];
 static GraphableNumber * queryQueueLength = 0;
 static GraphableNumber * busyDbConnections = 0;
 static GraphableNumber * totalDbConnections = 0;
 static List< Database > *handles;
+static List< Database > *connecting;
 static time_t lastExecuted;
 static time_t lastCreated;
 static Database::User loginAs;
@@ -34,8 +38,31 @@ static EString * username;
 static EString * password;
 static List<EventHandler> * whenIdle;
 
+// what the replicas must have replayed: writes counts the writes we've
+// done or heard of, and writtenLsn is the primary's position when
+// writes was knownWrites.
+static uint writes = 1;
+static uint knownWrites = 0;
+static int64 writtenLsn = 0;
+static bool probingPrimary = false;
 
-static void newHandle()
+// shareable queries that are waiting or running, by shareKey()
+static Dict< Query > * flights = 0;
+
+// each user's place in the queue, for firstSubmittedQuery()
+class FairShare
+    : public Garbage
+{
+public:
+    FairShare(): Garbage(), tag( 0 ) {}
+    uint tag;
+};
+
+static Dict< FairShare > * shares = 0;
+static uint virtualTime = 0;
+
+
+static void newHandle( bool replica = false )
 {
     Scope x;
     if ( handles && !handles->isEmpty() ) {
@@ -45,7 +72,97 @@ static void newHandle()
         if ( l )
             x.setLog( l );
     }
-    (void)new Postgres;
+    (void)new Postgres( replica );
+}
+
+
+// the number of primary handles that are still connecting
+static uint establishing()
+{
+    if ( !::connecting )
+        return 0;
+    List< Database >::Iterator it( ::connecting );
+    while ( it ) {
+        Connection::State s = it->Connection::state();
+        if ( s == Connection::Invalid || s == Connection::Closing )
+            ::connecting->take( it );
+        else
+            ++it;
+    }
+    return ::connecting->count();
+}
+
+
+// the longest any queued query has waited, in milliseconds
+static uint oldestWait()
+{
+    uint w = 0;
+    uint p = 0;
+    while ( p < numPriorities ) {
+        Query * q = 0;
+        if ( queries[p] )
+            q = queries[p]->firstElement();
+        if ( q && q->queueTime() > w )
+            w = q->queueTime();
+        p++;
+    }
+    return w;
+}
+
+
+// the number of primary (ie. not replica) handles
+static uint primaries()
+{
+    uint n = 0;
+    List< Database >::Iterator it( handles );
+    while ( it ) {
+        if ( !it->replica() )
+            n++;
+        ++it;
+    }
+    return n;
+}
+
+
+class LsnProbe
+    : public EventHandler
+{
+public:
+    LsnProbe(): EventHandler(), w( ::writes ), q( 0 ) {
+        EString s( "select pg_current_xlog_location()::text as lsn" );
+        if ( Postgres::version() >= 100000 )
+            s = "select pg_current_wal_lsn()::text as lsn";
+        q = new Query( s, this );
+        q->execute();
+    }
+
+    void execute() {
+        if ( !q->done() )
+            return;
+        ::probingPrimary = false;
+        Row * r = q->nextRow();
+        if ( !r || q->failed() )
+            return;
+        ::writtenLsn = Database::lsn( r->getEString( "lsn" ) );
+        ::knownWrites = w;
+    }
+
+    uint w;
+    Query * q;
+};
+
+
+// the number of queries waiting in all the queues
+static uint queued()
+{
+    uint n = 0;
+    uint p = 0;
+    while ( p < numPriorities ) {
+        if ( queries[p] )
+            n += queries[p]->count();
+        p++;
+    }
+    return n;
 }
 
 
@@ -59,15 +176,34 @@ static void newHandle()
     interface classes we implement). It's responsible for validating the
     database configuration, maintaining a pool of database handles, and
     accepting queries into a common queue via submit().
+
+    There is one queue for each Query::Priority. Interactive queries
+    are handed out first, and the last db-reserved-handles idle
+    handles take nothing else, so that a user's FETCH needn't wait
+    behind the spool manager or a bulk delete. The time each query
+    spends queued is graphed per priority on the statistics port.
+
+    If db-replica-address is set, some handles are connected to a
+    read replica. Those handles take only read-only queries outside
+    transactions (see Query::setReadOnly()), and only while the
+    replica has replayed everything this process has written or been
+    notified of. Until it has, such queries go to the primary.
 */
 
-Database::Database()
-    : Connection()
+Database::Database( bool replica )
+    : Connection(), rep( replica )
 {
     number = ++::backendNumber;
     setType( Connection::DatabaseClient );
     setState( Database::Connecting );
     lastCreated = time( 0 );
+    if ( !replica ) {
+        if ( !::connecting ) {
+            ::connecting = new List< Database >;
+            Allocator::addEternal( ::connecting, "connecting db handles" );
+        }
+        ::connecting->append( this );
+    }
 }
 
 
@@ -84,9 +220,18 @@ Database::Database()
 void Database::setup( uint desired, const EString & user,
                       const EString & pass )
 {
-    if ( !queries ) {
-        queries = new List< Query >;
-        Allocator::addEternal( queries, "list of queries" );
+    if ( !queries[Query::Interactive] ) {
+        static const char * names[numPriorities] = {
+            "interactive", "delivery", "background"
+        };
+        uint p = 0;
+        while ( p < numPriorities ) {
+            queries[p] = new List< Query >;
+            Allocator::addEternal( queries[p], "queue of queries" );
+            queueWait[p] = new GraphableDataSet( EString( "query-wait-" ) +
+                                                 names[p] );
+            p++;
+        }
     }
 
     if ( !handles ) {
@@ -114,6 +259,15 @@ void Database::setup( uint desired, const EString & user,
     }
 
     addInitialHandles( desired );
+
+    if ( ::loginAs == DbUser &&
+         !Configuration::text( Configuration::DbReplicaAddress ).isEmpty() ) {
+        uint n = Configuration::scalar( Configuration::DbReplicaHandles );
+        while ( n ) {
+            newHandle( true );
+            n--;
+        }
+    }
 }
 
 
@@ -171,13 +325,81 @@ void Database::setup( uint desired, Database::User login )
 }
 
 
+// the text and bound values of q, which identify a shareable query
+static EString shareKey( Query * q )
+{
+    EString k( q->string() );
+    List< Query::Value >::Iterator v( *q->values() );
+    while ( v ) {
+        k.append( '\0' );
+        k.appendNumber( v->position() );
+        k.append( ':' );
+        k.appendNumber( v->length() );
+        k.append( ':' );
+        k.appendNumber( (uint)v->format() );
+        k.append( ':' );
+        k.append( v->data() );
+        ++v;
+    }
+    return k;
+}
+
+
+/* Makes q follow an identical query submitted earlier, if there is
+   one that hasn't delivered any rows yet, and returns true if it
+   did. Otherwise records q for later queries to follow and returns
+   false.
+*/
+
+static bool joinFlight( Query * q )
+{
+    if ( !::flights ) {
+        ::flights = new Dict< Query >;
+        Allocator::addEternal( ::flights, "shareable queries" );
+    }
+
+    EString k( shareKey( q ) );
+    Query * leader = ::flights->find( k );
+    if ( leader && !leader->done() && !leader->rows() ) {
+        leader->addFollower( q );
+        return true;
+    }
+
+    // forget the queries that have finished, now and then.
+    if ( ::flights->count() > 128 ) {
+        Dict< Query > * live = new Dict< Query >;
+        Dict< Query >::Iterator i( ::flights );
+        while ( i ) {
+            if ( !i->done() )
+                live->insert( shareKey( i ), i );
+            ++i;
+        }
+        Allocator::removeEternal( ::flights );
+        ::flights = live;
+        Allocator::addEternal( ::flights, "shareable queries" );
+    }
+
+    ::flights->insert( k, q );
+    return false;
+}
+
+
 /*! Adds \a q to the queue of submitted queries and sets its state to
     Query::Submitted. The first available handle will process it.
+
+    If \a q is Query::shareable() and an identical query is already
+    waiting or running, \a q isn't queued, but gets that query's
+    results.
 */
 
 void Database::submit( Query *q )
 {
-    queries->append( q );
+    if ( q->shareable() && !q->transaction() && joinFlight( q ) ) {
+        q->setState( Query::Submitted );
+        return;
+    }
+
+    queries[q->priority()]->append( q );
     q->setState( Query::Submitted );
     runQueue();
 }
@@ -194,7 +416,7 @@ void Database::submit( List< Query > *q )
     List< Query >::Iterator it( q );
     while ( it ) {
         it->setState( Query::Submitted );
-        queries->append( it );
+        queries[it->priority()]->append( it );
         ++it;
     }
     runQueue();
@@ -227,7 +449,6 @@ void Database::disconnect()
 
 void Database::runQueue()
 {
-    int connecting = 0;
     int busy = 0;
 
     if ( !queryQueueLength )
@@ -235,9 +456,17 @@ void Database::runQueue()
     if ( !busyDbConnections )
         busyDbConnections = new GraphableNumber( "active-db-connections" );
 
-    // First, we give each idle handle a Query to process
+    // First, we give each idle handle a Query to process, starting
+    // with the replicas so that they get the read-only queries
 
-    Query * first = queries->firstElement();
+    uint before = queued();
+
+    List< Database >::Iterator r( handles );
+    while ( r ) {
+        if ( r->replica() && r->state() == Idle && r->usable() )
+            r->processQueue();
+        ++r;
+    }
 
     List< Database >::Iterator it( handles );
     while ( it ) {
@@ -252,25 +481,26 @@ void Database::runQueue()
 
         if ( st == Idle && it->usable() ) {
             it->processQueue();
-            if ( queries->isEmpty() ) {
+            if ( !queued() ) {
                 queryQueueLength->setValue( 0 );
                 busyDbConnections->setValue( busy );
                 return;
             }
         }
-        else if ( st == Connecting ) {
-            connecting++;
-        }
 
         ++it;
     }
 
-    queryQueueLength->setValue( queries->count() );
+    uint after = queued();
+    queryQueueLength->setValue( after );
     busyDbConnections->setValue( busy );
 
-    // If there's nothing to do, or we did get something done, then we
-    // don't even consider opening a new database connection.
-    if ( queries->isEmpty() || first != queries->firstElement() )
+    // If there's nothing to do, or we did get something done and the
+    // queue isn't piling up, then we don't even consider opening a
+    // new database connection.
+    uint have = primaries() + establishing();
+    bool piling = after > have || oldestWait() > 1000;
+    if ( !after || ( after < before && !piling ) )
         return;
 
     // Even if we want to, we cannot create unix-domain handles when
@@ -284,15 +514,31 @@ void Database::runQueue()
     if ( EventLoop::global()->inShutdown() )
         return;
 
-    // We create at most one new handle per interval.
+    uint max = Configuration::scalar( Configuration::DbMaxHandles );
+    if ( have >= max )
+        return;
+
+    // If queries are piling up, we connect enough handles at once for
+    // one per two queued queries, counting those already connecting.
+    // That makes a restart or failover ramp up in one round trip
+    // rather than one handle per interval.
+    if ( piling ) {
+        uint wanted = primaries() + ( after + 1 ) / 2;
+        if ( wanted > max )
+            wanted = max;
+        while ( have < wanted ) {
+            newHandle();
+            have++;
+        }
+        return;
+    }
+
+    // Otherwise we create at most one new handle per interval.
     int interval = Configuration::scalar( Configuration::DbHandleInterval );
     if ( time( 0 ) - lastCreated < interval )
         return;
 
-    // If we don't have too many, we can create another handle!
-    uint max = Configuration::scalar( Configuration::DbMaxHandles );
-    if ( handles->count() < max )
-        newHandle();
+    newHandle();
 }
 
 
@@ -324,6 +570,8 @@ Database::State Database::state() const
 
 void Database::addHandle( Database * d )
 {
+    if ( ::connecting )
+        ::connecting->remove( d );
     handles->append( d );
     if ( !totalDbConnections )
         totalDbConnections = new GraphableNumber( "total-db-connections" );
@@ -335,6 +583,8 @@ void Database::addHandle( Database * d )
 
 void Database::removeHandle( Database * d )
 {
+    if ( ::connecting )
+        ::connecting->remove( d );
     if ( !handles )
         return;
 
@@ -342,7 +592,7 @@ void Database::removeHandle( Database * d )
     if ( !totalDbConnections )
         totalDbConnections = new GraphableNumber( "total-db-connections" );
     totalDbConnections->setValue( handles->count() );
-    if ( !handles->isEmpty() )
+    if ( primaries() )
         return;
 
     if ( !EventLoop::global()->inShutdown() )
@@ -472,6 +722,79 @@ uint Database::connectionNumber() const
 }
 
 
+/*! Returns true if this handle is connected to the read replica
+    (db-replica-address), and false if it's connected to the primary.
+*/
+
+bool Database::replica() const
+{
+    return rep;
+}
+
+
+/*! Returns an Endpoint representing the address of the read replica
+    (as specified by db-replica-address and db-replica-port). The
+    Endpoint may not be valid.
+*/
+
+Endpoint Database::replicaServer()
+{
+    return Endpoint( Configuration::DbReplicaAddress,
+                     Configuration::DbReplicaPort );
+}
+
+
+/*! Records that something has been written to the primary, either by
+    this process or by another one which told us so using a
+    notification. Replicas are not used again until they're known to
+    have replayed that write.
+*/
+
+void Database::recordWrite()
+{
+    ::writes++;
+}
+
+
+/*! Returns true if a replica which has replayed up to \a replayed has
+    seen every write recorded by recordWrite(), and false if it hasn't
+    or if we don't know yet. In the latter case, this asks the primary
+    for its current position, so that a later call can tell.
+*/
+
+bool Database::replicaCurrent( int64 replayed )
+{
+    if ( ::knownWrites != ::writes ) {
+        if ( !::probingPrimary ) {
+            ::probingPrimary = true;
+            (void)new LsnProbe;
+        }
+        return false;
+    }
+    return replayed >= ::writtenLsn;
+}
+
+
+/*! Parses the WAL location \a s, as returned by PostgreSQL's
+    pg_current_wal_lsn() and friends ("16/B374D848"), and returns it as
+    a number. Returns 0 if \a s is not a valid location.
+*/
+
+int64 Database::lsn( const EString & s )
+{
+    int slash = s.find( '/' );
+    if ( slash < 0 )
+        return 0;
+    bool ok = true;
+    bool ok2 = true;
+    uint hi = s.mid( 0, slash ).number( &ok, 16 );
+    uint lo = s.mid( slash + 1 ).number( &ok2, 16 );
+    if ( !ok || !ok2 )
+        return 0;
+    return ( (int64)hi << 32 ) + lo;
+}
+
+
 /*! This function returns DbOwner or DbUser, as specified in the call to
     Database::setup().
 */
@@ -514,7 +837,7 @@ bool Database::idle()
         ++it;
     }
 
-    if ( queries && !queries->isEmpty() )
+    if ( queued() )
         return false;
 
     return true;
@@ -528,7 +851,7 @@ bool Database::idle()
 
 void Database::reactToIdleness()
 {
-    if ( !queries->isEmpty() )
+    if ( queued() )
         return;
 
     if ( !::whenIdle )
@@ -590,16 +913,20 @@ void Database::checkAccess( EventHandler * owner )
         void execute()
         {
             if ( !q ) {
-                q = new Query( "select not exists (select * from "
-                               "information_schema.table_privileges where "
-                               "privilege_type='DELETE' and table_name="
-                               "'messages' and grantee=$1) and not exists "
-                               "(select u.usename from pg_catalog.pg_class c "
+                // information_schema is slow on large catalogs, so
+                // this asks pg_class and has_table_privilege() instead
+                q = new Query( "select not has_table_privilege($1, c.oid, "
+                               "'delete') and "
+                               "u.usename is distinct from $1 as allowed "
+                               "from pg_catalog.pg_class c "
+                               "join pg_catalog.pg_namespace n on "
+                               "(c.relnamespace=n.oid) "
                                "left join pg_catalog.pg_user u on "
-                               "(u.usesysid=c.relowner) where c.relname="
-                               "'messages' and u.usename=$1) as allowed",
+                               "(u.usesysid=c.relowner) "
+                               "where c.relname='messages' and n.nspname=$2",
                                this );
                 q->bind( 1, Configuration::text( Configuration::DbUser ) );
+                q->bind( 2, Configuration::text( Configuration::DbSchema ) );
                 q->execute();
             }
 
@@ -678,6 +1005,23 @@ uint Database::idleHandles()
 }
 
 
+/*! Returns the number of handles that could accept a query right
+    now.
+*/
+
+uint Database::usableHandles()
+{
+    uint r = 0;
+    List< Database >::Iterator it( handles );
+    while ( it ) {
+        if ( it->usable() )
+            r++;
+        ++it;
+    }
+    return r;
+}
+
+
 /*! \fn void Database::cancel( class Query * query )
     Cancels the given \a query if it is being executed by this database object.
     Does nothing otherwise.
@@ -698,13 +1042,90 @@ void Database::cancelQuery( Query * q )
 }
 
 
+/*  Returns the FairShare for the user on whose behalf \a q runs. All
+    queries without a user share one.
+*/
+
+static FairShare * share( Query * q )
+{
+    if ( !shares ) {
+        shares = new Dict<FairShare>;
+        Allocator::addEternal( shares, "database fair shares" );
+    }
+    // the prefix keeps the key nonempty
+    EString k = "u" + q->user();
+    FairShare * f = shares->find( k );
+    if ( !f ) {
+        if ( shares->count() > 10000 )
+            shares->clear();
+        f = new FairShare;
+        f->tag = virtualTime;
+        shares->insert( k, f );
+    }
+    return f;
+}
+
+
+/*  Returns true if \a q may be sent now: a replica takes read-only
+    standalone queries, a primary anything but a transaction unless
+    \a transactionOK is true.
+*/
+
+static bool eligible( Query * q, bool transactionOK, bool replica )
+{
+    if ( replica )
+        return !q->transaction() && q->readOnly();
+    return transactionOK || !q->transaction();
+}
+
+
+/*  Returns the first of the eligible queries near the start of \a l
+    whose user has had the least service so far, or a null pointer if
+    there are no eligible queries.
+*/
+
+static Query * fairest( List<Query> * l, bool transactionOK, bool replica )
+{
+    Query * r = 0;
+    uint best = 0;
+    uint seen = 0;
+    List<Query>::Iterator i( l );
+    while ( i && seen < 32 ) {
+        if ( eligible( i, transactionOK, replica ) ) {
+            uint tag = share( i )->tag;
+            if ( tag < virtualTime )
+                tag = virtualTime;
+            if ( !r || tag < best ) {
+                r = i;
+                best = tag;
+            }
+            seen++;
+        }
+        ++i;
+    }
+    return r;
+}
+
+
+/*  Records that \a q's user has been given one more query. */
+
+static void charge( Query * q )
+{
+    FairShare * f = share( q );
+    if ( f->tag < virtualTime )
+        f->tag = virtualTime;
+    virtualTime = f->tag;
+    f->tag++;
+}
+
+
 /*! This static function returns the schema revision current at the time
     this server was compiled.
 */
 
 uint Database::currentRevision()
 {
-    return 98;
+    return 124;
 }
 
 
@@ -714,19 +1135,97 @@ uint Database::currentRevision()
     If \a transactionOK is true, the list is permitted to start a
     Transaction. If not, only standalone queries are considered.
 
+    If the chosen query is a standalone query, up to \a max standalone
+    queries for the same user that follow it in the queue are
+    included, so the caller can send them in one go. A COPY ends the
+    list, since nothing can be sent until it's done.
+
+    Queries are taken from the highest-priority queue that has any.
+    Delivery and Background queries are only taken if more than
+    db-reserved-handles handles are free, so that there always is a
+    handle for Interactive queries.
+
+    Within a priority, the users (as given by Query::user()) take
+    turns: among the first few suitable queries, the one whose user
+    has had the fewest queries sent lately goes first, so that one
+    busy user can't keep the others waiting. Users who haven't had
+    anything to do recently get no credit for that; they start level
+    with whoever is being served now.
+
+    A replica handle takes only read-only standalone queries, up to \a
+    max of them, and ignores \a transactionOK.
+
     Returns an empty list if no suitable queries can be found.
 */
 
-List< Query > * Database::firstSubmittedQuery( bool transactionOK )
+List< Query > * Database::firstSubmittedQuery( bool transactionOK,
+                                               uint max )
 {
-    List<Query>::Iterator i( queries );
-    if ( !transactionOK )
-        while ( i && i->transaction() )
-            ++i;
     List<Query> * r = new List<Query>();
-    if ( i ) {
-        r->append( i );
-        queries->take( i );
+
+    bool rep = replica();
+    uint reserved = 0;
+    if ( !rep ) {
+        reserved = Configuration::scalar( Configuration::DbReservedHandles );
+        uint n = primaries();
+        if ( n && reserved >= n )
+            reserved = n - 1;
+    }
+
+    uint p = 0;
+    while ( p < numPriorities ) {
+        if ( !rep && p > Query::Interactive && freeHandles() <= reserved )
+            return r;
+        Query * first = fairest( queries[p], transactionOK, rep );
+        if ( first ) {
+            EString user = first->user();
+            List<Query>::Iterator i( queries[p] );
+            while ( (Query*)i != first )
+                ++i;
+            bool standalone = !first->transaction();
+            do {
+                Query * q = i;
+                r->append( q );
+                queries[p]->take( i );
+                queueWait[p]->addNumber( q->queueTime() );
+                charge( q );
+                if ( q->inputLines() )
+                    standalone = false;
+                while ( i && !i->transaction() && i->user() != user )
+                    ++i;
+            } while ( standalone && r->count() < max &&
+                      i && eligible( i, false, rep ) );
+            return r;
+        }
+        p++;
     }
     return r;
 }
+
+
+/*! Returns the number of primary handles that are idle and could
+    take a query from the queue right now.
+*/
+
+uint Database::freeHandles()
+{
+    uint r = 0;
+    List< Database >::Iterator it( handles );
+    while ( it ) {
+        if ( !it->replica() && it->state() == Idle && it->usable() )
+            r++;
+        ++it;
+    }
+    return r;
+}
+
+
+/*! Returns the number of queries waiting for a handle, of any
+    priority. Background work can use this to back off while others
+    are waiting.
+*/
+
+uint Database::queueLength()
+{
+    return queued();
+}
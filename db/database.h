@@ -14,7 +14,7 @@ class Database
     : public Connection
 {
 public:
-    Database();
+    Database( bool = false );
 
     enum User {
         Superuser, DbOwner, DbUser
@@ -37,9 +37,13 @@ public:
     static uint numHandles();
     static uint handlesNeeded();
     static uint idleHandles();
+    static uint usableHandles();
+    static uint freeHandles();
+    static uint queueLength();
     static EString type();
 
     uint connectionNumber() const;
+    bool replica() const;
 
     static uint currentRevision();
 
@@ -53,10 +57,10 @@ public:
 
     static void cancelQuery( Query * );
 
-protected:
-    static List< Query > *queries;
+    static int64 lsn( const EString & );
 
-    List< Query > * firstSubmittedQuery( bool transactionOK );
+protected:
+    List< Query > * firstSubmittedQuery( bool transactionOK, uint = 1 );
 
     void setState( State );
     State state() const;
@@ -79,9 +83,14 @@ protected:
     static void recordExecution();
     static void reactToIdleness();
 
+    static Endpoint replicaServer();
+    static void recordWrite();
+    static bool replicaCurrent( int64 );
+
 private:
     State st;
     uint number;
+    bool rep;
 };
 
 
@@ -20,6 +20,7 @@ public:
     EString n;
     EventHandler * o;
     Log * l;
+    EStringList payloads;
 };
 
 
@@ -57,21 +58,40 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name, after recording \a payload for payloads() if it's not
+    empty.
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::notifyAll( const EString & name,
+                                const EString & payload )
 {
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
         ++i;
-        if ( name == s->d->n && s->d->o )
+        if ( name == s->d->n && s->d->o ) {
+            if ( !payload.isEmpty() )
+                s->d->payloads.append( payload );
             s->d->o->notify();
+        }
     }
 }
 
 
+/*! Returns the payloads received (as for "notify name, 'payload'")
+    since the last call, and forgets them. The return value is never
+    null, but may be empty.
+*/
+
+EStringList * DatabaseSignal::payloads()
+{
+    EStringList * r = new EStringList;
+    r->append( d->payloads );
+    d->payloads.clear();
+    return r;
+}
+
+
 /*! This destructor is private, so noone can ever call it. Objects of
     this class are indestructible by nature.
 */
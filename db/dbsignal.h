@@ -14,10 +14,12 @@ class DatabaseSignal
 public:
     DatabaseSignal( const EString &, EventHandler * );
 
-    static void notifyAll( const EString & );
+    static void notifyAll( const EString &, const EString & = "" );
 
     static EStringList * names();
 
+    EStringList * payloads();
+
 private: // noone can destroy this
     ~DatabaseSignal();
 
@@ -3,6 +3,7 @@
 #include "pgmessage.h"
 
 #include "log.h"
+#include "allocator.h"
 #include "event.h"
 #include "estring.h"
 #include "buffer.h"
@@ -190,6 +191,23 @@ EString PgServerMessage::decodeByten( uint x )
 }
 
 
+/*! Copies \a x bytes from the beginning of the input buffer to \a
+    dest and removes them. Throws a syntax error in the same cases as
+    the other decodeByten().
+*/
+
+void PgServerMessage::decodeByten( char * dest, uint x )
+{
+    if ( ( x && buf->size() < 1 ) || n+x > l )
+        throw Syntax;
+
+    if ( buf->copy( dest, x ) != x )
+        throw Syntax;
+    buf->remove( x );
+    n += x;
+}
+
+
 /*! This function is used by subclasses to assert that they have decoded
     the entire contents of the message. If the size of the decoded data
     does not match the declared size of this message, end() throws an
@@ -754,6 +772,47 @@ void PgDescribe::encodeData()
 
 
 
+/*! \class PgClose pgmessage.h
+    C: Closes a prepared statement or portal.
+
+    This message consists of one byte ('S' for a prepared statement, and
+    'P' for a portal) followed by a name (EString). Closing something
+    that doesn't exist is not an error.
+*/
+
+/*! Creates a Close message for the prepared statement or portal named
+    \a n. \a t must be S or P, as for PgDescribe.
+*/
+
+PgClose::PgClose( char t, const EString &n )
+    : PgClientMessage( 'C' ),
+      type( t ), name( n )
+{
+}
+
+
+void PgClose::encodeData()
+{
+    appendByte( type );
+    appendString( name );
+}
+
+
+
+/*! \class PgCloseComplete pgmessage.h
+    S: This indicates that a Close message was successfully processed.
+
+    This message contains no data.
+*/
+
+PgCloseComplete::PgCloseComplete( Buffer *b )
+    : PgServerMessage( b )
+{
+    end();
+}
+
+
+
 /*! \class PgNoData pgmessage.h
     S: The description of something that cannot return data.
 
@@ -795,12 +854,20 @@ PgParameterDescription::PgParameterDescription( Buffer *b )
     The message data contains the 16-bit number of columns, and tuples
     of (EString name, Int32 table-oid, Int16 col-number, Int32 type-id,
     Int16 size, Int32 type-mod, Int16 format-code) for each column.
+
+    Since every PgDataRow following a description has the same layout,
+    the description also maps each column's type to the Column::Type
+    Row uses (in kinds), and owns an arena from which the rows take
+    their memory, see allocate().
 */
 
 PgRowDescription::PgRowDescription( Buffer * b )
-    : PgServerMessage( b )
+    : PgServerMessage( b ), count( 0 ), kinds( 0 ),
+      arena( 0 ), arenaUsed( 0 ), arenaSize( 0 )
 {
     count = decodeInt16();
+    kinds = (::Column::Type*)Allocator::alloc( count * sizeof( ::Column::Type ),
+                                               0 );
     uint c = 0;
     while ( c < count ) {
         Column *col = new Column;
@@ -820,12 +887,68 @@ PgRowDescription::PgRowDescription( Buffer * b )
         names.insert( col->name.data(), 8 * col->name.length(),
                       &col->column2 );
 
+        switch ( col->type ) {
+        case 16:    // BOOL
+            kinds[c] = ::Column::Boolean;
+            break;
+        case 20:    // INT8
+            kinds[c] = ::Column::Bigint;
+            break;
+        case 21:    // INT2
+        case 23:    // INT4
+            kinds[c] = ::Column::Integer;
+            break;
+        case 17:    // BYTEA
+        case 18:    // CHAR
+        case 25:    // TEXT
+        case 1043:  // VARCHAR
+            kinds[c] = ::Column::Bytes;
+            break;
+        case 1184:
+            kinds[c] = ::Column::Timestamp;
+            break;
+        default:
+            if ( col->type == ::citextOid ) { // CITEXT
+                kinds[c] = ::Column::Bytes;
+                break;
+            }
+            log( "PostgreSQL: Unknown field type " + fn( col->type ) +
+                 " for column " + col->name.quoted(),
+                 Log::Error );
+            kinds[c] = ::Column::Unknown;
+            break;
+        }
+
         c++;
     }
     end();
 }
 
 
+/*! Returns a pointer to \a size bytes of uninitialised memory for a
+    row of the result described by this object. The memory is carved
+    out of large blocks, so that a result with many rows doesn't cost
+    one or more allocations per row and value, and the blocks live
+    until the last Row pointing into them is gone.
+*/
+
+char * PgRowDescription::allocate( uint size )
+{
+    // keep everything aligned for the offsets at the start of each row
+    size = ( size + 7 ) & ~7;
+    if ( size > 8192 )
+        return (char*)Allocator::alloc( size, 0 );
+    if ( arenaUsed + size > arenaSize ) {
+        arenaSize = Allocator::rounded( 65536 - 64 );
+        arena = (char*)Allocator::alloc( arenaSize, 0 );
+        arenaUsed = 0;
+    }
+    char * r = arena + arenaUsed;
+    arenaUsed += size;
+    return r;
+}
+
+
 
 /*! \class PgExecute pgmessage.h
     C: A request to execute a portal.
@@ -862,133 +985,78 @@ void PgExecute::encodeData()
 
 /*! This function constructs a new PgDataRow based on the contents of
     the Buffer \a b, and the PgRowDescription \a d.
+
+    The values are not decoded here. The row's bytes are copied into
+    memory from PgRowDescription::allocate(), preceded by an offset
+    and a length for each column, and Row reads the values from there
+    when asked.
 */
 
-PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
+PgDataRow::PgDataRow( Buffer *b, PgRowDescription *d )
     : PgServerMessage( b )
 {
     uint c = decodeInt16();
-    if ( c != d->columns.count() )
+    if ( c != d->count )
         // Is this really "Syntax"?
         throw Syntax;
 
-    int i = 0;
-    Column *columns = new Column[c];
+    uint max = l - n;
+    char * mem = d->allocate( c * 2 * sizeof( int ) + max );
+    int * cols = (int*)mem;
+    const unsigned char * p = (const unsigned char *)( cols + 2 * c );
+    decodeByten( (char*)p, max );
+    uint pos = 0;
+
+    uint i = 0;
     List< PgRowDescription::Column >::Iterator it( d->columns );
     while ( it ) {
-        Column *cv = &columns[i];
-
-        switch ( it->type ) {
-        case 16:    // BOOL
-            cv->type = Column::Boolean;
-            break;
-        case 20:    // INT8
-            cv->type = Column::Bigint;
-            break;
-        case 21:    // INT2
-        case 23:    // INT4
-            cv->type = Column::Integer;
-            break;
-        case 17:    // BYTEA
-        case 18:    // CHAR
-        case 25:    // TEXT
-        case 1043:  // VARCHAR
-            cv->type = Column::Bytes;
-            break;
-        case 1184:
-            cv->type = Column::Timestamp;
-            break;
-        default:
-            if ( it->type == ::citextOid ) { // CITEXT
-                cv->type = Column::Bytes;
-                break;
-            }
-            log( "PostgreSQL: Unknown field type " + fn( it->type ) +
-                 " for column " + it->name.quoted(),
-                 Log::Error );
-            cv->type = Column::Unknown;
-            break;
-        }
-
-        int length = decodeInt32();
-        if ( length == -1 )
-            cv->type = Column::Null;
-
-        switch ( cv->type ) {
+        if ( pos + 4 > max )
+            throw Syntax;
+        int length = ( p[pos] << 24 ) | ( p[pos+1] << 16 ) |
+                     ( p[pos+2] << 8 ) | p[pos+3];
+        pos += 4;
+        if ( length < -1 || ( length > 0 && pos + length > max ) )
+            throw Syntax;
+        cols[2*i] = pos;
+        cols[2*i+1] = length;
+        if ( length < 0 )
+            length = 0;
+
+        bool bad = false;
+        switch ( d->kinds[i] ) {
         case Column::Unknown:
-            // we've just logged the error, but supplement it
-            if ( length > 0 )
-                log( "Unknown column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
+            // the description logged an error, but supplement it
+            bad = length > 0;
             break;
         case Column::Boolean:
-            if ( length != 1 ) {
-                log( "Boolean column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            }
-            else {
-                cv->b = (*buf)[0];
-                buf->remove( 1 );
-                n++;
-            }
+            bad = cols[2*i+1] >= 0 && length != 1;
             break;
         case Column::Integer:
-            switch ( length ) {
-            case 1:
-                cv->i = (*buf)[0];
-                buf->remove( 1 );
-                n++;
-                break;
-            case 2:
-                cv->i = ((*buf)[0] << 8) | (*buf)[1];
-                buf->remove( 2 );
-                n += 2;
-                break;
-            case 4:
-                cv->i = ((*buf)[0] << 24) | ((*buf)[1] << 16) |
-                        ((*buf)[2] <<  8) | (*buf)[3];
-                buf->remove( 4 );
-                n += 4;
-                break;
-            default:
-                log( "Integer column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            }
+            bad = cols[2*i+1] >= 0 &&
+                  length != 1 && length != 2 && length != 4;
             break;
         case Column::Bigint:
-            if ( length == 8 ) {
-                cv->bi = (((int64)(*buf)[0]) << 56) |
-                         (((int64)(*buf)[1]) << 48) |
-                         (((int64)(*buf)[2]) << 40) |
-                         (((int64)(*buf)[3]) << 32) |
-                         (((int64)(*buf)[4]) << 24) |
-                         (((int64)(*buf)[5]) << 16) |
-                         (((int64)(*buf)[6]) <<  8) |
-                         (*buf)[7];
-                buf->remove( 8 );
-                n += 8;
-            }
-            else
-                log( "Bigint column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
+            bad = cols[2*i+1] >= 0 && length != 8;
             break;
         case Column::Bytes:
-            cv->s = decodeByten( length );
-            break;
         case Column::Timestamp:
-            cv->s = decodeByten( length );
-            break;
         case Column::Null:
-            // nothing needed
             break;
         }
+        if ( bad )
+            log( "Column " + it->name.quoted() + " of type " +
+                 Column::typeName( d->kinds[i] ) + " has value " +
+                 EString( (const char *)p + pos, length ).quoted() );
 
+        pos += length;
         ++it;
         i++;
     }
+    if ( pos != max )
+        throw Syntax;
     end();
 
-    r = new Row( d, columns );
+    r = new Row( d, mem );
 }
 
 
@@ -1304,7 +1372,9 @@ EString PgNotificationResponse::name() const
 }
 
 
-/*! Returns the notification source, usually an empty string. */
+/*! Returns the notification source, usually an empty string. Since
+    PostgreSQL 9.0 this is the payload given to NOTIFY, if any.
+*/
 
 EString PgNotificationResponse::source() const
 {
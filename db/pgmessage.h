@@ -33,6 +33,7 @@ protected:
     char decodeByte();
     EString decodeString();
     EString decodeByten( uint );
+    void decodeByten( char *, uint );
     void end();
 };
 
@@ -238,6 +239,28 @@ private:
 };
 
 
+class PgClose
+    : public PgClientMessage
+{
+public:
+    PgClose( char, const EString & );
+
+private:
+    void encodeData();
+
+    char type;
+    EString name;
+};
+
+
+class PgCloseComplete
+    : public PgServerMessage
+{
+public:
+    PgCloseComplete( Buffer * );
+};
+
+
 class PgNoData
     : public PgServerMessage
 {
@@ -271,6 +294,14 @@ public:
     List<Column> columns;
     PatriciaTree<int> names;
     uint count;
+    ::Column::Type * kinds;
+
+    char * allocate( uint );
+
+private:
+    char * arena;
+    uint arenaUsed;
+    uint arenaSize;
 };
 
 
@@ -292,7 +323,7 @@ class PgDataRow
     : public PgServerMessage
 {
 public:
-    PgDataRow( Buffer *, const PgRowDescription * );
+    PgDataRow( Buffer *, PgRowDescription * );
     Row *row() const;
 
 private:
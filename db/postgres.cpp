@@ -25,11 +25,83 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <pwd.h>
+// time
+#include <time.h>
 
 
 static bool hasMessage( Buffer * );
 static uint serverVersion;
 static Postgres * listener = 0;
+// true if the listener has been lost, so that the next one must tell
+// the DatabaseSignal owners about anything they may have missed
+static bool listenerLost = false;
+
+// the texts of unnamed queries we've seen, and the statement names
+// we use for those that are seen again.
+static Dict<EString> * statementNames = 0;
+static uint numStatementNames = 0;
+static uint statementCounter = 0;
+static const uint maxStatementNames = 1024;
+
+// the most statements each handle keeps prepared for statementName()
+static const uint maxCached = 256;
+
+// the most independent queries sent to a handle in one go
+static const uint maxPipelined = 8;
+
+// the most rows a streaming query may have waiting for its owner
+// before we stop reading from the server
+static const uint streamingRows = 1024;
+
+// the number of times any handle has sent something and then waited
+// for the server, and what was sent, for roundTrips() and bytesSent()
+static int64 numRoundTrips = 0;
+static int64 numBytesSent = 0;
+
+
+/*  Returns the name of the prepared statement to use for \a q, whose
+    text is \a text, or an empty string if \a q should be sent as an
+    unnamed statement.
+
+    Queries made from a PreparedStatement use its name. Other queries
+    get a name the second time their text is seen, so ad-hoc queries
+    don't push everything out of the handles' statement caches, or the
+    first time if Query::recurring() says it'll be seen again.
+    Names are never reused, so each handle may prepare a name when it
+    first needs it, just as for PreparedStatement.
+*/
+
+static EString statementName( Query * q, const EString & text )
+{
+    if ( !q->name().isEmpty() )
+        return q->name();
+    if ( q->inputLines() )
+        return "";
+
+    if ( !statementNames ) {
+        statementNames = new Dict<EString>;
+        Allocator::addEternal( statementNames, "SQL statement names" );
+    }
+
+    EString * n = statementNames->find( text );
+    if ( !n ) {
+        if ( numStatementNames >= maxStatementNames ) {
+            statementNames->clear();
+            numStatementNames = 0;
+        }
+        n = new EString;
+        statementNames->insert( text, n );
+        numStatementNames++;
+        if ( !q->recurring() )
+            return "";
+    }
+
+    if ( n->isEmpty() ) {
+        n->append( "a" );
+        n->appendNumber( ++statementCounter );
+    }
+    return *n;
+}
 
 
 class PgData
@@ -42,8 +114,9 @@ public:
           setSessionAuthorisation( false ),
           sendingCopy( false ), error( false ),
           keydata( 0 ),
-          description( 0 ), transaction( 0 ),
-          needNotify( 0 ), backendPid( 0 )
+          description( 0 ), numCached( 0 ), transaction( 0 ),
+          needNotify( 0 ), backendPid( 0 ),
+          replayed( 0 ), probed( 0 ), probing( false )
         {}
 
     bool active;
@@ -60,6 +133,9 @@ public:
     PgRowDescription *description;
     Dict<Postgres> prepared;
     EStringList preparesPending;
+    EStringList cached;
+    uint numCached;
+    EStringList names;
 
     List< Query > queries;
     Transaction *transaction;
@@ -69,6 +145,38 @@ public:
 
     uint backendPid;
 
+    int64 replayed;
+    time_t probed;
+    bool probing;
+
+    class ReplayProbe
+        : public EventHandler {
+    public:
+        ReplayProbe( PgData * data ): EventHandler(), d( data ), q( 0 ) {
+            EString s( "select pg_last_xlog_replay_location()::text "
+                       "as lsn" );
+            if ( Postgres::version() >= 100000 )
+                s = "select pg_last_wal_replay_lsn()::text as lsn";
+            q = new Query( s, this );
+        }
+        void execute() {
+            if ( !q->done() )
+                return;
+            d->probing = false;
+            Row * r = q->nextRow();
+            if ( !r || q->failed() )
+                return;
+            // null means the server isn't replaying, ie. isn't a
+            // replica, and so is as current as can be
+            if ( r->isNull( "lsn" ) )
+                d->replayed = 0x7fffffffffffffffLL;
+            else
+                d->replayed = Database::lsn( r->getEString( "lsn" ) );
+        }
+        PgData * d;
+        Query * q;
+    };
+
     class LockSpotter
         : public EventHandler {
     public:
@@ -117,9 +225,44 @@ public:
         }
         Query * q;
     };
+
+    class Resync
+        : public EventHandler {
+    public:
+        Resync( Query * query ): EventHandler(), q( query ) {
+            q->setOwner( this );
+        }
+        void execute() {
+            if ( !q->done() || q->failed() )
+                return;
+            // we don't know what happened while nobody was
+            // listening, so everyone has to look
+            EStringList * n = DatabaseSignal::names();
+            n->removeDuplicates();
+            EStringList::Iterator i( n );
+            while ( i ) {
+                DatabaseSignal::notifyAll( *i );
+                ++i;
+            }
+        }
+        Query * q;
+    };
 };
 
 
+/*  Records that \a p can no longer be the handle which listens for
+    notifications, if it was.
+*/
+
+static void dropListener( Postgres * p )
+{
+    if ( ::listener != p )
+        return;
+    ::listener = 0;
+    ::listenerLost = true;
+}
+
+
 /*! \class Postgres postgres.h
     Implements the PostgreSQL 3.0 Frontend-Backend protocol.
 
@@ -128,6 +271,15 @@ public:
     callers about any resulting data. As a descendant of Connection, it
     is responsible for all network communications with the server.
 
+    One handle per process is the listener: It sends the LISTEN
+    commands for DatabaseSignal, so each notification is received and
+    handled once per process, and it leaves queries to the other
+    handles whenever one of those is free, so notifications aren't
+    held up behind query traffic. If the listener is lost, the next
+    handle to become listener notifies every DatabaseSignal once its
+    LISTEN commands have been processed, since notifications sent in
+    the meantime are lost.
+
     The network protocol is documented at <doc/src/sgml/protocol.sgml>
     and <http://www.postgresql.org/docs/current/static/protocol.html>.
     The version implemented here is used by PostgreSQL 7.4 and later.
@@ -141,27 +293,35 @@ public:
 
 /*! Creates a Postgres object, initiates a TCP connection to the server,
     registers with the main loop, and adds this Database to the list of
-    available handles.
+    available handles. If \a replica is true, the connection is to the
+    read replica instead of to the primary.
 */
 
-Postgres::Postgres()
-    : Database(), d( new PgData )
+Postgres::Postgres( bool replica )
+    : Database( replica ), d( new PgData )
 {
     d->user = Database::user();
+    EString address( Database::address() );
+    uint port = Database::port();
+    if ( replica ) {
+        address = replicaServer().address();
+        port = replicaServer().port();
+    }
     struct passwd * p = getpwnam( d->user.cstr() );
     if ( p && getuid() != p->pw_uid ) {
         // Try to cooperate with ident authentication.
         uid_t e = geteuid();
         setreuid( 0, p->pw_uid );
-        connect( address(), port() );
+        connect( address, port );
         setreuid( 0, e );
     }
     else {
-        connect( address(), port() );
+        connect( address, port );
     }
 
-    log( "Connecting to PostgreSQL server at " +
-         address() + ":" + fn( port() ) + " "
+    log( EString( "Connecting to PostgreSQL " ) +
+         ( replica ? "replica" : "server" ) + " at " +
+         address + ":" + fn( port ) + " "
          "(backend " + fn( connectionNumber() ) + ", fd " + fn( fd() ) +
          ", user " + d->user + ")", Log::Debug );
 
@@ -191,7 +351,7 @@ void Postgres::processQueue()
            d->transaction->state() == Transaction::RolledBack ) )
         d->transaction = 0;
 
-    if ( !::listener && !d->transaction )
+    if ( !::listener && !d->transaction && !replica() )
         ::listener = this;
     if ( ::listener == this )
         sendListen();
@@ -200,11 +360,36 @@ void Postgres::processQueue()
     if ( d->transaction ) {
         l = d->transaction->submittedQueries();
     }
+    else if ( replica() ) {
+        // a replica can take read-only queries only once it has
+        // replayed our writes. we ask it at most once a second.
+        if ( !replicaCurrent( d->replayed ) ) {
+            if ( !d->probing && d->probed < time( 0 ) ) {
+                d->probing = true;
+                d->probed = time( 0 );
+                processQuery( (new PgData::ReplayProbe( d ))->q );
+            }
+            return;
+        }
+        uint max = 1;
+        if ( Database::usableHandles() <= 1 )
+            max = maxPipelined;
+        l = Database::firstSubmittedQuery( false, max );
+    }
     else {
-        if ( listener == this && numHandles() > 1 )
-            l = Database::firstSubmittedQuery( false );
+        // if no other handle could take them, we may as well send
+        // several standalone queries at once
+        uint max = 1;
+        if ( Database::usableHandles() <= 1 )
+            max = maxPipelined;
+        if ( listener == this && numHandles() > 1 ) {
+            if ( freeHandles() > 1 )
+                l = new List<Query>;
+            else
+                l = Database::firstSubmittedQuery( false, max );
+        }
         else
-            l = Database::firstSubmittedQuery( true );
+            l = Database::firstSubmittedQuery( true, max );
 
         if ( l->firstElement() && l->firstElement()->transaction() ) {
             Transaction * t = l->firstElement()->transaction();
@@ -213,6 +398,10 @@ void Postgres::processQueue()
         }
     }
 
+    uint before = writeBuffer()->size();
+    if ( !l->isEmpty() )
+        ::numRoundTrips++;
+
     Query * q = l->shift();
     while ( q ) {
         q->setState( Query::Executing );
@@ -226,6 +415,9 @@ void Postgres::processQueue()
         q = l->shift();
     }
 
+    if ( writeBuffer()->size() > before )
+        ::numBytesSent += writeBuffer()->size() - before;
+
     if ( d->queries.isEmpty() )
         reactToIdleness();
 }
@@ -238,23 +430,50 @@ void Postgres::processQueue()
 void Postgres::processQuery( Query * q )
 {
     Scope x( q->log() );
+    EString text = queryString( q );
+    EString name = statementName( q, text );
     d->queries.append( q );
+    d->names.append( name );
     EString s( "Sent " );
-    if ( q->name() == "" ||
-         !d->prepared.contains( q->name() ) )
+    bool automatic = q->name().isEmpty() && !name.isEmpty();
+    if ( name == "" ||
+         !d->prepared.contains( name ) )
     {
-        PgParse a( queryString( q ), q->name() );
+        if ( automatic ) {
+            if ( d->numCached >= maxCached ) {
+                // the least recently used statement goes
+                EString * old = d->cached.shift();
+                d->numCached--;
+                d->prepared.remove( *old );
+                PgClose c( 'S', *old );
+                c.enqueue( writeBuffer() );
+            }
+            d->cached.append( name );
+            d->numCached++;
+        }
+
+        PgParse a( text, name );
         a.enqueue( writeBuffer() );
 
-        if ( q->name() != "" ) {
-            d->prepared.insert( q->name(), this );
-            d->preparesPending.append( q->name() );
+        if ( name != "" ) {
+            d->prepared.insert( name, this );
+            d->preparesPending.append( name );
         }
 
         s.append( "parse/" );
     }
+    else if ( automatic ) {
+        EStringList::Iterator i( d->cached );
+        while ( i && *i != name )
+            ++i;
+        if ( i ) {
+            EString * used = i;
+            d->cached.take( i );
+            d->cached.append( used );
+        }
+    }
 
-    PgBind b( q->name() );
+    PgBind b( name );
     b.bind( q->values() );
     b.enqueue( writeBuffer() );
 
@@ -267,11 +486,13 @@ void Postgres::processQuery( Query * q )
     PgSync e;
     e.enqueue( writeBuffer() );
 
-    s.append( "execute for " );
-    s.append( q->description() );
-    s.append( " on backend " );
-    s.appendNumber( connectionNumber() );
-    ::log( s, Log::Debug );
+    if ( Log::enabled( Log::Debug ) ) {
+        s.append( "execute for " );
+        s.append( q->description() );
+        s.append( " on backend " );
+        s.appendNumber( connectionNumber() );
+        ::log( s, Log::Debug );
+    }
     recordExecution();
 }
 
@@ -355,6 +576,7 @@ void Postgres::react( Event e )
         }
         else if ( d->queries.isEmpty() &&
                   ::listener != this &&
+                  !replica() &&
                   server().protocol() != Endpoint::Unix &&
                   handlesNeeded() < numHandles() ) {
             log( "Closing idle database backend " + fn( connectionNumber() ) +
@@ -393,6 +615,21 @@ void Postgres::react( Event e )
 }
 
 
+/*! Returns false while the current Query is streaming() and its
+    owner hasn't caught up with the rows we've already received. The
+    server then has to wait, and we don't use more memory than one
+    socket buffer's worth of rows in addition to those.
+*/
+
+bool Postgres::canRead()
+{
+    Query * q = d->queries.firstElement();
+    if ( q && q->streaming() && q->unreadRows() >= ::streamingRows )
+        return false;
+    return true;
+}
+
+
 /*! This function handles the authentication phase of the protocol. It
     expects and responds to an authentication request, and waits for a
     positive response before entering the backend startup phase. It is
@@ -509,7 +746,8 @@ void Postgres::process( char type )
     case '1':
         {
             PgParseComplete msg( readBuffer() );
-            if ( q && q->name() != "" )
+            EString * n = d->names.first();
+            if ( q && n && !n->isEmpty() )
                 d->preparesPending.shift();
         }
         break;
@@ -520,6 +758,12 @@ void Postgres::process( char type )
         }
         break;
 
+    case '3':
+        {
+            PgCloseComplete msg( readBuffer() );
+        }
+        break;
+
     case 'n':
         {
             PgNoData msg( readBuffer() );
@@ -540,8 +784,11 @@ void Postgres::process( char type )
                 PgCopyData cd( q );
                 PgCopyDone e;
 
+                uint before = writeBuffer()->size();
                 cd.enqueue( writeBuffer() );
                 e.enqueue( writeBuffer() );
+                ::numRoundTrips++;
+                ::numBytesSent += writeBuffer()->size() - before;
             }
             else {
                 PgCopyFail f;
@@ -570,6 +817,11 @@ void Postgres::process( char type )
             if ( d->needNotify && d->needNotify != q )
                 d->needNotify->notify();
             d->needNotify = q;
+            if ( q->streaming() && q->unreadRows() >= ::streamingRows ) {
+                // let the owner catch up before we parse more
+                q->notify();
+                d->needNotify = 0;
+            }
         }
         break;
 
@@ -608,8 +860,13 @@ void Postgres::process( char type )
                 if ( !q->done() ) {
                     q->setState( Query::Completed );
                     countQueries( q );
+                    if ( !replica() &&
+                         ( q->transaction() ||
+                           !q->string().lower().startsWith( "select" ) ) )
+                        recordWrite();
                 }
                 d->queries.shift();
+                d->names.shift();
                 q->notify();
                 d->needNotify = 0;
             }
@@ -631,7 +888,10 @@ void Postgres::process( char type )
                 s = " (" + msg.source() + ")";
             log( "Received notify " + msg.name().quoted() +
                  " from server pid " + fn( msg.pid() ) + s, Log::Debug );
-            DatabaseSignal::notifyAll( msg.name() );
+            // whatever we're told about may not have reached the
+            // replica yet
+            recordWrite();
+            DatabaseSignal::notifyAll( msg.name(), msg.source() );
         }
         break;
 
@@ -789,8 +1049,7 @@ void Postgres::serverMessage()
         else
             log( "PostgreSQL reports a crash; closing connection.", Log::Info );
         removeHandle( this );
-        if ( ::listener == this )
-            ::listener = 0;
+        dropListener( this );
         close();
         error( "PostgreSQL server shut down" );
     }
@@ -891,8 +1150,9 @@ void Postgres::serverMessage()
         // it succeeded, we'll assume that statement name does not
         // exist for future use.
         EString * pp = d->preparesPending.first();
-        if ( q->name() != "" && pp && *pp == q->name() ) {
-            d->prepared.remove( q->name() );
+        EString * n = d->names.shift();
+        if ( n && !n->isEmpty() && pp && *pp == *n ) {
+            d->prepared.remove( *n );
             d->preparesPending.shift();
         }
         if ( q->inputLines() )
@@ -1032,8 +1292,7 @@ EString Postgres::mapped( const EString & s ) const
 
 void Postgres::error( const EString &s )
 {
-    if ( ::listener == this )
-        ::listener = 0;
+    dropListener( this );
 
     Scope x( log() );
     ::log( s + " (on backend " + fn( connectionNumber() ) + ")", Log::Error );
@@ -1062,8 +1321,7 @@ void Postgres::error( const EString &s )
 
 void Postgres::shutdown()
 {
-    if ( ::listener == this )
-        ::listener = 0;
+    dropListener( this );
 
     PgTerminate msg;
     msg.enqueue( writeBuffer() );
@@ -1112,14 +1370,66 @@ bool Postgres::usable() const
 static GraphableCounter * goodQueries = 0;
 static GraphableCounter * badQueries = 0;
 
+// the statement names for which we keep execution times, and the
+// most we keep, since each costs a few kilobytes
+static Dict<GraphableDataSet> * queryTimes = 0;
+static uint numQueryTimes = 0;
+static const uint maxQueryTimes = 100;
 
-/*! Updates the statistics when \a q is done. */
+static uint lastExplain = 0;
+
+
+class SlowQueryExplainer
+    : public EventHandler
+{
+public:
+    SlowQueryExplainer( Query * q )
+        : EventHandler(), e( 0 )
+    {
+        setLog( new Log( q->log() ) );
+        e = new Query( "explain (analyze, buffers) " + q->string(), this );
+        List< Query::Value >::Iterator v( *q->values() );
+        while ( v ) {
+            if ( v->length() < 0 )
+                e->bindNull( v->position() );
+            else
+                e->bind( v->position(), v->data(), v->format() );
+            ++v;
+        }
+        e->setReadOnly();
+        e->setPriority( Query::Background );
+        e->allowFailure();
+        e->execute();
+    }
+
+    void execute()
+    {
+        while ( e->hasResults() )
+            log( e->nextRow()->getEString( "QUERY PLAN" ),
+                 Log::Significant );
+    }
+
+private:
+    Query * e;
+};
+
+
+/*! Updates the statistics when \a q is done.
+
+    The execution time of each named statement (see statementName())
+    is recorded as "query-time-" followed by the name, for the first
+    hundred names seen. Queries slower than slow-query-time are
+    logged, and if explain-slow-queries is set, a read-only one is
+    explained now and then.
+*/
 
 void Postgres::countQueries( class Query * q )
 {
     if ( !goodQueries ) {
         goodQueries = new GraphableCounter( "queries-executed" ); // bad name?
         badQueries = new GraphableCounter( "queries-failed" ); // bad name?
+        queryTimes = new Dict<GraphableDataSet>;
+        Allocator::addEternal( queryTimes, "query execution times" );
     }
 
     if ( !q->failed() )
@@ -1128,8 +1438,41 @@ void Postgres::countQueries( class Query * q )
         badQueries->tick();
     ; // a query which fails but canFail is not counted anywhere.
 
-    // later also use GraphableDataSet to keep track of query
-    // execution times, but not right now.
+    if ( q->failed() )
+        return;
+
+    uint t = q->executionTime();
+    EString * name = d->names.firstElement();
+    if ( name && !name->isEmpty() ) {
+        GraphableDataSet * s = queryTimes->find( *name );
+        if ( !s && numQueryTimes < maxQueryTimes ) {
+            s = new GraphableDataSet( "query-time-" + *name );
+            queryTimes->insert( *name, s );
+            numQueryTimes++;
+            ::log( "Recording execution time of " + *name + " as " +
+                   s->name() + ": " + q->string(), Log::Info );
+        }
+        if ( s )
+            s->addNumber( t );
+    }
+
+    uint slow = Configuration::scalar( Configuration::SlowQueryTime );
+    if ( !slow || t < slow )
+        return;
+
+    Scope x( q->log() );
+    ::log( "Slow query: executed for " + fn( t ) + "ms after waiting " +
+           fn( q->queueTime() - t ) + "ms: " + q->description(),
+           Log::Significant );
+
+    uint now = (uint)time( 0 );
+    if ( Configuration::toggle( Configuration::ExplainSlowQueries ) &&
+         now >= lastExplain + 60 &&
+         !q->transaction() && !q->inputLines() &&
+         q->string().lower().startsWith( "select" ) ) {
+        lastExplain = now;
+        (void)new SlowQueryExplainer( q );
+    }
 }
 
 
@@ -1147,6 +1490,28 @@ uint Postgres::version()
 }
 
 
+/*! Returns the number of times a handle in this process has sent
+    queries to the server and then had to wait for an answer. Queries
+    that are sent together count once, and sending the data for a COPY
+    counts once more.
+*/
+
+int64 Postgres::roundTrips()
+{
+    return ::numRoundTrips;
+}
+
+
+/*! Returns the number of bytes of queries (including bound values and
+    COPY data) sent to the server by this process.
+*/
+
+int64 Postgres::bytesSent()
+{
+    return ::numBytesSent;
+}
+
+
 /*! Makes sure Postgres sends as many LISTEN commands as necessary,
     see DatabaseSignal and
     http://www.postgresql.org/docs/8.1/static/sql-listen.html
@@ -1155,6 +1520,7 @@ uint Postgres::version()
 
 void Postgres::sendListen()
 {
+    Query * last = 0;
     EStringList::Iterator s( DatabaseSignal::names() );
     while ( s ) {
         EString name = *s;
@@ -1163,9 +1529,15 @@ void Postgres::sendListen()
             d->listening.append( name );
             if ( !name.boring() )
                 name = name.quoted();
-            processQuery( new Query( "listen " + name, 0 ) );
+            last = new Query( "listen " + name, 0 );
+            processQuery( last );
         }
     }
+
+    if ( last && ::listenerLost ) {
+        ::listenerLost = false;
+        (void)new PgData::Resync( last );
+    }
 }
 
 
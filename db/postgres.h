@@ -12,15 +12,18 @@ class Postgres
     : public Database
 {
 public:
-    Postgres();
+    Postgres( bool = false );
     ~Postgres();
 
     void processQueue();
     void react( Event );
+    bool canRead();
 
     bool usable() const;
 
     static uint version();
+    static int64 roundTrips();
+    static int64 bytesSent();
 
     void sendListen();
 
@@ -14,6 +14,10 @@
 #include "integerset.h"
 #include "estringlist.h"
 #include "transaction.h"
+#include "vector.h"
+
+// gettimeofday
+#include <sys/time.h>
 
 
 class QueryData
@@ -24,8 +28,15 @@ public:
         : state( Query::Inactive ), format( Query::Text ),
           values( new Query::InputLine ), inputLines( 0 ),
           transaction( 0 ), owner( 0 ), totalRows( 0 ),
-          canFail( false )
-    {}
+          canFail( false ), priority( Query::Interactive ), submitted( 0 ),
+          executing( 0 ), readOnly( false ), shareable( false ),
+          streaming( false ), recurring( false ), followers( 0 ),
+          log( 0 )
+    {
+        Scope * x = Scope::current();
+        if ( x )
+            log = x->log();
+    }
 
     Query::State state;
     Query::Format format;
@@ -38,16 +49,35 @@ public:
 
     Transaction * transaction;
     EventHandler * owner;
-    List< Row > rows;
+    Vector< Row > rows;
     uint totalRows;
 
     EString error;
 
     bool canFail;
     bool canBeSlow;
+
+    Query::Priority priority;
+    int64 submitted;
+    int64 executing;
+    bool readOnly;
+    bool shareable;
+    bool streaming;
+    bool recurring;
+    List< Query > * followers;
+    Log * log;
 };
 
 
+// the current time in milliseconds
+static int64 now()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
 /*! \class Query query.h
     This class represents a single database query.
 
@@ -145,6 +175,174 @@ Query::State Query::state() const
 void Query::setState( State s )
 {
     d->state = s;
+    if ( s == Submitted )
+        d->submitted = now();
+    else if ( s == Executing && !d->executing )
+        d->executing = now();
+    if ( d->followers && s != Submitted ) {
+        List< Query >::Iterator f( d->followers );
+        while ( f ) {
+            f->setState( s );
+            ++f;
+        }
+    }
+}
+
+
+/*! Records that this Query has priority \a p. The Database hands out
+    Interactive queries before Delivery ones, and those before
+    Background ones, and keeps some handles free of all but
+    Interactive queries.
+
+    The default is Interactive, which suits anything a user is waiting
+    for. A Query in a Transaction has the Transaction's priority, so
+    this only matters for standalone queries.
+*/
+
+void Query::setPriority( Priority p )
+{
+    d->priority = p;
+}
+
+
+/*! Returns the priority of this Query, as set by setPriority() or by
+    Transaction::setPriority().
+*/
+
+Query::Priority Query::priority() const
+{
+    if ( d->transaction )
+        return d->transaction->priority();
+    return d->priority;
+}
+
+
+/*! Records that this Query only reads from the database, so that it
+    may be sent to a read replica (see db-replica-address) instead of
+    to the primary. This has no effect on a Query in a Transaction.
+*/
+
+void Query::setReadOnly()
+{
+    d->readOnly = true;
+}
+
+
+/*! Returns true if setReadOnly() has been called, and false if not. */
+
+bool Query::readOnly() const
+{
+    return d->readOnly;
+}
+
+
+/*! Records that this Query may share its execution with identical
+    queries (same text and same bound values) that are submitted while
+    it's waiting or running. Database::submit() then sends only one of
+    them and gives each the same rows.
+
+    This suits read-only queries whose results don't depend on when
+    they run, for instance user and permission lookups. It has no
+    effect on a Query in a Transaction.
+*/
+
+void Query::setShareable()
+{
+    d->shareable = true;
+}
+
+
+/*! Returns true if setShareable() has been called, and false if not. */
+
+bool Query::shareable() const
+{
+    return d->shareable;
+}
+
+
+/*! Records that the owner of this Query reads rows with nextRow()
+    whenever it's notified, rather than waiting until the Query is
+    done(). The Database uses this to apply backpressure: It stops
+    reading from the server while the Query has many unreadRows(), so
+    that a large result is never held in memory all at once.
+
+    Don't call this unless the owner really does consume the rows as
+    they arrive, or the Query will never finish.
+*/
+
+void Query::setStreaming()
+{
+    d->streaming = true;
+}
+
+
+/*! Returns true if setStreaming() has been called, and false if not. */
+
+bool Query::streaming() const
+{
+    return d->streaming;
+}
+
+
+/*! Records that this Query's text is likely to be used again soon,
+    with different bound values. The Postgres backend prepares such
+    queries as named statements the first time it sees them, instead
+    of waiting for the text to be repeated.
+
+    The text must not contain literals that vary from one use to the
+    next, or each use will just push another statement out of the
+    cache.
+*/
+
+void Query::setRecurring()
+{
+    d->recurring = true;
+}
+
+
+/*! Returns true if setRecurring() has been called, and false if not. */
+
+bool Query::recurring() const
+{
+    return d->recurring;
+}
+
+
+/*! Records that \a q is identical to this Query, and should get the
+    same rows, state and error as this one, in place of being executed
+    itself. Database::submit() uses this for shareable() queries.
+*/
+
+void Query::addFollower( Query * q )
+{
+    if ( !d->followers )
+        d->followers = new List< Query >;
+    d->followers->append( q );
+}
+
+
+/*! Returns the number of milliseconds since this Query was submitted,
+    or 0 if it hasn't been.
+*/
+
+uint Query::queueTime() const
+{
+    if ( !d->submitted )
+        return 0;
+    return (uint)( now() - d->submitted );
+}
+
+
+/*! Returns the number of milliseconds since this Query was sent to a
+    database handle, or 0 if it hasn't been. queueTime() minus this is
+    the time the Query spent waiting for a handle.
+*/
+
+uint Query::executionTime() const
+{
+    if ( !d->executing )
+        return 0;
+    return (uint)( now() - d->executing );
 }
 
 
@@ -343,7 +541,7 @@ void Query::bind( uint n, const EStringList & l )
         EStringList::Iterator it( l );
         while ( it ) {
             EString t( *it );
-            if ( t.boring() )
+            if ( t.boring() && t.lower() != "null" )
                 s.append( t );
             else
                 s.append( t.quoted() );
@@ -376,7 +574,7 @@ void Query::bind( uint n, const UStringList & l )
         UStringList::Iterator it( l );
         while ( it ) {
             EString t( p.fromUnicode( *it ) );
-            if ( t.boring() )
+            if ( t.boring() && t.lower() != "null" )
                 s.append( t );
             else
                 s.append( t.quoted() );
@@ -486,7 +684,8 @@ EString Query::string() const
     statement is completely constructed.
 
     It has no effect on queries that have already been submitted to
-    the database.
+    the database. It undoes setReadOnly(), since the new statement may
+    not be read-only.
 */
 
 void Query::setString( const EString &s )
@@ -495,6 +694,7 @@ void Query::setString( const EString &s )
         return;
 
     d->query = s;
+    d->readOnly = false;
     if ( s.lower().endsWith( "with binary" ) )
         d->format = Binary;
     if ( s.lower().startsWith( "copy " ) && !d->inputLines )
@@ -541,6 +741,25 @@ EventHandler *Query::owner() const
 }
 
 
+/*! Returns the login of the user on whose behalf this Query runs, as
+    given by Log::user() for the owner() or, failing that, for the Log
+    in effect when the Query was created. Returns an empty string for
+    work that isn't done for any particular user.
+*/
+
+EString Query::user() const
+{
+    if ( d->owner && d->owner->log() ) {
+        EString u = d->owner->log()->user();
+        if ( !u.isEmpty() )
+            return u;
+    }
+    if ( d->log )
+        return d->log->user();
+    return "";
+}
+
+
 /*! The Database calls this function to inform the owner() of this Query
     about any interesting activity, such as the arrival of rows from the
     server, or the completion of the query.
@@ -548,6 +767,14 @@ EventHandler *Query::owner() const
 
 void Query::notify()
 {
+    if ( d->followers ) {
+        List< Query >::Iterator f( d->followers );
+        while ( f ) {
+            f->notify();
+            ++f;
+        }
+    }
+
     if ( d->error.isEmpty() && d->transaction &&
          !d->transaction->error().isEmpty() )
         d->transaction->clearError();
@@ -682,6 +909,13 @@ void Query::setError( const EString &s )
     Scope x( log() );
     d->error = s;
     setState( Failed );
+    if ( d->followers ) {
+        List< Query >::Iterator f( d->followers );
+        while ( f ) {
+            f->d->error = s;
+            ++f;
+        }
+    }
     if ( d->transaction && !canFail() )
         d->transaction->setError( this, s );
     else if ( canFail() )
@@ -712,6 +946,13 @@ uint Query::rows() const
 void Query::setRows( uint r )
 {
     d->totalRows = r;
+    if ( d->followers ) {
+        List< Query >::Iterator f( d->followers );
+        while ( f ) {
+            f->setRows( r );
+            ++f;
+        }
+    }
 }
 
 
@@ -725,6 +966,16 @@ bool Query::hasResults() const
 }
 
 
+/*! Returns the number of rows that have been received, but not yet
+    read and removed by calling nextRow().
+*/
+
+uint Query::unreadRows() const
+{
+    return d->rows.count();
+}
+
+
 /*! For each Row \a r received in response to this query, the Database
     calls this function to append it to the list of results.
 */
@@ -733,6 +984,13 @@ void Query::addRow( Row *r )
 {
     d->rows.append( r );
     d->totalRows++;
+    if ( d->followers ) {
+        List< Query >::Iterator f( d->followers );
+        while ( f ) {
+            f->addRow( r );
+            ++f;
+        }
+    }
 }
 
 
@@ -750,9 +1008,8 @@ Row *Query::nextRow()
 /*! \class Row query.h
     Represents a single row of data retrieved from the Database.
 
-    The Database creates Row objects for every row of data received, and
-    populates them with the appropriate Column objects before appending
-    them to the originating Query.
+    The Database creates a Row object for every row of data received,
+    and appends it to the originating Query.
 
     Users of Query can retrieve each row in turn with Query::nextRow(),
     and use the getInt()/getEString()/etc. accessor functions, each of
@@ -761,12 +1018,17 @@ Row *Query::nextRow()
 */
 
 
-/*! Creates a row of data based on the columns \a c, named as in \a
-    desc.
+/*! Creates a row of data named as in \a desc, whose values are in
+    \a d.
+
+    \a d starts with an offset and a length for each column (the
+    length is -1 for NULL), followed by the column data as sent by the
+    server. The values are decoded only when someone asks for them, and
+    Row allocates no memory of its own.
 */
 
-Row::Row( const PgRowDescription * desc, Column * c )
-    : data( c ), layout( desc )
+Row::Row( const PgRowDescription * desc, const char * d )
+    : data( d ), layout( desc )
 {
 }
 
@@ -776,28 +1038,52 @@ extern "C" {
 };
 
 
-/*! This private helper returns the column named \a f, or a null
-    pointer if \a f does not exist.
+/*! This private helper returns the index of the column named \a f,
+    or -1 if \a f does not exist.
 
     If \a warn is true and \a f does not exist or has a type other
     than \a type, then fetch() logs a warning.
 */
 
-const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
+int Row::fetch( const char * f, Column::Type type, bool warn ) const
 {
     int * x = layout->names.find( f, strlen( f ) * 8 );
     if ( !x ) {
         if ( warn )
             log( "Note: Column " + EString( f ).quoted() + " does not exist",
                  Log::Error );
-        return 0;
+        return -1;
     }
 
-    if ( warn && type != data[*x].type )
+    if ( warn && type != this->type( *x ) )
         log( "Note: Expected type " + Column::typeName( type ) +
              " for column " + EString( f ).quoted() + ", but received " +
-             Column::typeName( data[*x].type ), Log::Error );
-    return &data[*x];
+             Column::typeName( this->type( *x ) ), Log::Error );
+    return *x;
+}
+
+
+/*! Returns the type of column \a i, which is Column::Null if the
+    value is NULL.
+*/
+
+Column::Type Row::type( uint i ) const
+{
+    if ( ((const int *)data)[2*i+1] < 0 )
+        return Column::Null;
+    return layout->kinds[i];
+}
+
+
+/*! Returns a pointer to the value of column \a i, and sets \a length
+    to its length in bytes.
+*/
+
+const unsigned char * Row::value( uint i, uint & length ) const
+{
+    const int * cols = (const int *)data;
+    length = cols[2*i+1] < 0 ? 0 : cols[2*i+1];
+    return (const unsigned char *)( cols + 2 * layout->count ) + cols[2*i];
 }
 
 
@@ -807,11 +1093,11 @@ const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
 
 bool Row::isNull( const char *f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
-    if ( !c )
+    int c = fetch( f, Column::Null, false );
+    if ( c < 0 )
         return true; // XXX the two isNull()s differed
 
-    if ( c->type == Column::Null )
+    if ( type( c ) == Column::Null )
         return true;
     return false;
 }
@@ -823,12 +1109,14 @@ bool Row::isNull( const char *f ) const
 
 bool Row::getBoolean( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Boolean, true );
-    if ( !c )
+    int c = fetch( f, Column::Boolean, true );
+    if ( c < 0 || type( c ) != Column::Boolean )
         return false;
-    if ( c->type != Column::Boolean )
+    uint l;
+    const unsigned char * v = value( c, l );
+    if ( l != 1 )
         return false;
-    return c->b;
+    return v[0];
 }
 
 
@@ -838,12 +1126,20 @@ bool Row::getBoolean( const char * f ) const
 
 int Row::getInt( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Integer, true );
-    if ( !c )
-        return 0;
-    if ( c->type != Column::Integer )
+    int c = fetch( f, Column::Integer, true );
+    if ( c < 0 || type( c ) != Column::Integer )
         return 0;
-    return c->i;
+    uint l;
+    const unsigned char * v = value( c, l );
+    switch ( l ) {
+    case 1:
+        return v[0];
+    case 2:
+        return ( v[0] << 8 ) | v[1];
+    case 4:
+        return ( v[0] << 24 ) | ( v[1] << 16 ) | ( v[2] <<  8 ) | v[3];
+    }
+    return 0;
 }
 
 
@@ -853,12 +1149,21 @@ int Row::getInt( const char * f ) const
 
 int64 Row::getBigint( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Bigint, true );
-    if ( !c )
+    int c = fetch( f, Column::Bigint, true );
+    if ( c < 0 || type( c ) != Column::Bigint )
         return 0;
-    if ( c->type != Column::Bigint )
+    uint l;
+    const unsigned char * v = value( c, l );
+    if ( l != 8 )
         return 0;
-    return c->bi;
+    return ( ((int64)v[0]) << 56 ) |
+           ( ((int64)v[1]) << 48 ) |
+           ( ((int64)v[2]) << 40 ) |
+           ( ((int64)v[3]) << 32 ) |
+           ( ((int64)v[4]) << 24 ) |
+           ( ((int64)v[5]) << 16 ) |
+           ( ((int64)v[6]) <<  8 ) |
+           v[7];
 }
 
 
@@ -868,12 +1173,12 @@ int64 Row::getBigint( const char * f ) const
 
 EString Row::getEString( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Bytes, true );
-    if ( !c )
-        return "";
-    if ( c->type != Column::Bytes )
+    int c = fetch( f, Column::Bytes, true );
+    if ( c < 0 || type( c ) != Column::Bytes )
         return "";
-    return c->s;
+    uint l;
+    const unsigned char * v = value( c, l );
+    return EString( (const char *)v, l );
 }
 
 
@@ -884,13 +1189,13 @@ EString Row::getEString( const char * f ) const
 UString Row::getUString( const char * f ) const
 {
     UString r;
-    const Column * c = fetch( f, Column::Bytes, true );
-    if ( !c )
-        return r;
-    if ( c->type != Column::Bytes )
+    int c = fetch( f, Column::Bytes, true );
+    if ( c < 0 || type( c ) != Column::Bytes )
         return r;
+    uint l;
+    const unsigned char * v = value( c, l );
     PgUtf8Codec uc;
-    r = uc.toUnicode( c->s );
+    r = uc.toUnicode( EString( (const char *)v, l ) );
     return r;
 }
 
@@ -901,10 +1206,7 @@ UString Row::getUString( const char * f ) const
 
 bool Row::hasColumn( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
-    if ( c )
-        return true;
-    return false;
+    return fetch( f, Column::Null, false ) >= 0;
 }
 
 
@@ -914,9 +1216,9 @@ bool Row::hasColumn( const char * f ) const
 
 Column::Type Row::columnType( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
-    if ( c )
-        return c->type;
+    int c = fetch( f, Column::Null, false );
+    if ( c >= 0 )
+        return type( c );
     return Column::Unknown;
 }
 
@@ -986,8 +1288,10 @@ EString PreparedStatement::query() const
 
 
 /*! \class Column query.h
-    This class represents a single column in a row.
-    Has no member functions or useful documentation yet.
+    This class names the types a column in a Row may have.
+
+    The values themselves are kept by Row, in the form the server sent
+    them.
 */
 
 
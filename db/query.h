@@ -42,6 +42,26 @@ public:
     Transaction *transaction() const;
     void setTransaction( Transaction * );
 
+    enum Priority { Interactive, Delivery, Background };
+    void setPriority( Priority );
+    Priority priority() const;
+
+    uint queueTime() const;
+    uint executionTime() const;
+
+    void setReadOnly();
+    bool readOnly() const;
+
+    void setShareable();
+    bool shareable() const;
+
+    void setStreaming();
+    bool streaming() const;
+
+    void setRecurring();
+    bool recurring() const;
+    void addFollower( Query * );
+
     enum Format { Unknown = -1, Text = 0, Binary };
     Format format() const;
 
@@ -103,6 +123,7 @@ public:
 
     void setOwner( EventHandler * );
     EventHandler *owner() const;
+    EString user() const;
     void notify();
 
     EString description();
@@ -115,6 +136,7 @@ public:
     bool hasResults() const;
     void addRow( Row * );
     Row *nextRow();
+    uint unreadRows() const;
 
     class Log * log() const;
 
@@ -131,12 +153,6 @@ class Column
 public:
     enum Type { Unknown, Boolean, Integer, Bigint, Bytes, Timestamp, Null };
 
-    Type type;
-    EString s;
-    bool b;
-    uint i;
-    int64 bi;
-
     static EString typeName( Type );
 };
 
@@ -145,7 +161,7 @@ class Row
     : public Garbage
 {
 public:
-    Row( const class PgRowDescription *, Column * );
+    Row( const class PgRowDescription *, const char * );
 
     bool isNull( const char * ) const;
     int getInt( const char * ) const;
@@ -159,10 +175,12 @@ public:
     EStringList * columnNames() const;
 
 private:
-    const Column * data;
+    const char * data;
     const class PgRowDescription * layout;
 
-    const Column * fetch( const char *, Column::Type, bool ) const;
+    int fetch( const char *, Column::Type, bool ) const;
+    Column::Type type( uint ) const;
+    const unsigned char * value( uint, uint & ) const;
 };
 
 
@@ -17,6 +17,7 @@
 #include "md5.h"
 #include "utf.h"
 #include "mailbox.h"
+#include "message.h"
 
 #include <stdio.h>
 
@@ -32,7 +33,9 @@ public:
           t( 0 ),
           result( 0 ), unparsed( 0 ), upgrade( false ), commit( true ),
           quid( 0 ), undel( 0 ), row( 0 ), lastMailbox( 0 ), count( 0 ),
-          uidnext( 0 ), nextmodseq( 0 ), granter( 0 )
+          uidnext( 0 ), nextmodseq( 0 ), granter( 0 ),
+          online( false ), tasks( 0 ), task( 0 ), build( 0 ),
+          indexes( 0 ), backfills( 0 )
     {
         schema = Configuration::text( Configuration::DbSchema );
         dbuser = Configuration::text( Configuration::DbUser ).quoted();
@@ -63,6 +66,15 @@ public:
     int64 nextmodseq;
 
     Granter * granter;
+
+    // The following are used by online upgrades; see createIndex().
+
+    bool online;
+    Query * tasks;
+    Row * task;
+    Query * build;
+    uint indexes;
+    uint backfills;
 };
 
 
@@ -83,16 +95,25 @@ public:
     statements performed during the upgrade will not be COMMITted, but
     their success or failure will be reported.
 
+    If \a online is true (it is not, by default), the upgrade is meant
+    to be done while Archiveopteryx is running: the transaction gives
+    up rather than wait long for a lock, indexes are built
+    concurrently after it commits, and large updates are left for the
+    server to apply in small batches. See createIndex() and
+    backfill().
+
     The \a owner will be notified of progress via the Query returned by
     result().
 */
 
-Schema::Schema( EventHandler * owner, bool upgrade, bool commit )
+Schema::Schema( EventHandler * owner, bool upgrade, bool commit,
+                bool online )
     : d( new SchemaData )
 {
     d->result = new Query( owner );
     d->upgrade = upgrade;
     d->commit = commit;
+    d->online = upgrade && online;
     d->t = new Transaction( this );
 }
 
@@ -141,6 +162,11 @@ void Schema::execute()
 {
     if ( d->state == 0 ) {
         if ( d->upgrade ) {
+            // waiting for a lock would block everyone queued behind us
+            if ( d->online )
+                d->t->enqueue( "select set_config('lock_timeout','10s',"
+                               "true) where current_setting("
+                               "'server_version_num')::integer>=90300" );
             d->lock =
                 new Query( "select version() as version, revision from "
                            "mailstore for update", this );
@@ -184,6 +210,8 @@ void Schema::execute()
             }
             d->result->setState( Query::Completed );
             d->state = 7;
+            if ( d->online && d->revision >= 123 )
+                d->state = 9;
         }
         else if ( d->upgrade && d->revision > Database::currentRevision() &&
                   d->revision >= 85 && Database::currentRevision() >= 80 ) {
@@ -320,6 +348,17 @@ void Schema::execute()
         }
 
         d->state = 7;
+        if ( d->online && d->commit && !d->t->failed() )
+            d->state = 9;
+    }
+
+    if ( d->state == 9 ) {
+        if ( !runTasks() )
+            return;
+        if ( d->result->failed() )
+            d->state = 8;
+        else
+            d->state = 7;
     }
 
     if ( d->state == 7 ) {
@@ -385,6 +424,202 @@ void Schema::fail( const EString &s, Query * q )
 }
 
 
+/*! Creates the index \a name on \a definition (e.g. "messages
+    (idate)"). If \a unique is true, the index is unique.
+
+    Normally the index is created by the upgrade transaction. An
+    online upgrade instead records it in schema_tasks, and runTasks()
+    builds it with create index concurrently once the transaction has
+    committed, so the table stays writable meanwhile. Until then the
+    server has to manage (perhaps slowly) without the index, and later
+    steps must not rely on it.
+
+    Only steps to revision 124 and later can use this.
+*/
+
+void Schema::createIndex( const EString & name, const EString & definition,
+                          bool unique )
+{
+    EString s( "create " );
+    if ( unique )
+        s.append( "unique " );
+    s.append( "index " );
+    if ( d->online )
+        addTask( name, false,
+                 s + "concurrently " + name + " on " + definition );
+    else
+        d->t->enqueue( s + name + " on " + definition );
+}
+
+
+/*! Updates \a table, applying \a set to each row that matches
+    \a where. \a key is the table's primary key, which may have more
+    than one column ("mailbox,uid").
+
+    Normally all rows are updated by the upgrade transaction. An
+    online upgrade instead records the update in schema_tasks, and
+    the Maintainer applies it in batches (see run_schema_backfill()),
+    so only a few rows are locked at a time. This continues until a
+    batch updates no rows, so \a set must make \a where false.
+
+    Until the task is done, the server must cope with rows that still
+    match \a where, e.g. by reading the old column when the new one is
+    null, and must itself write rows that don't.
+
+    Only steps to revision 124 and later can use this.
+*/
+
+void Schema::backfill( const EString & table, const EString & key,
+                       const EString & set, const EString & where )
+{
+    EString s( "update " + table + " set " + set + " where " );
+    if ( d->online )
+        addTask( table, true,
+                 s + "(" + key + ") in (select " + key + " from " +
+                 table + " where " + where + " limit $1)" );
+    else
+        d->t->enqueue( s + where );
+}
+
+
+/*! Records \a statement in schema_tasks, to be done after the upgrade
+    transaction commits. \a name describes the task (for an index, it
+    is the index's name), and \a backfill is true for updates the
+    Maintainer applies in batches and false for indexes.
+*/
+
+void Schema::addTask( const EString & name, bool backfill,
+                      const EString & statement )
+{
+    Query * q = new Query( "insert into schema_tasks "
+                           "(revision,name,backfill,statement) "
+                           "values ($1,$2,$3,$4)", 0 );
+    q->bind( 1, d->revision + 1 );
+    q->bind( 2, name );
+    q->bind( 3, backfill );
+    q->bind( 4, statement );
+    d->t->enqueue( q );
+}
+
+
+/*! Builds the indexes that online upgrades have left in schema_tasks,
+    one at a time and outside any transaction. An index left invalid
+    by an interrupted build is dropped and built again, so running
+    'aox upgrade schema -o' again finishes the work.
+
+    Returns true when all indexes are built or a build has failed, and
+    false while waiting for the database.
+*/
+
+bool Schema::runTasks()
+{
+    if ( !d->t->done() )
+        return false;
+
+    if ( !d->tasks ) {
+        d->substate = 0;
+        d->tasks = new Query( "select id, name, backfill, statement "
+                              "from schema_tasks where not done "
+                              "order by id", this );
+        d->tasks->execute();
+    }
+
+    while ( true ) {
+        Query * q = d->tasks;
+        if ( d->substate )
+            q = d->build;
+        if ( !q->done() )
+            return false;
+        if ( q->failed() ) {
+            if ( q == d->tasks )
+                fail( "Couldn't read the schema_tasks table.", q );
+            else
+                fail( "Couldn't build index " +
+                      d->task->getEString( "name" ) + ".", q );
+            return true;
+        }
+
+        EString name;
+        if ( d->task )
+            name = d->task->getEString( "name" );
+
+        switch ( d->substate ) {
+        case 0:
+            d->task = d->tasks->nextRow();
+            if ( !d->task ) {
+                if ( d->indexes )
+                    d->l->log( "Built " + fn( d->indexes ) + " indexes.",
+                               Log::Significant );
+                if ( d->backfills )
+                    d->l->log( fn( d->backfills ) + " tables are being "
+                               "updated in the background by "
+                               "Archiveopteryx (unless maintenance-rate "
+                               "is 0).", Log::Significant );
+                return true;
+            }
+            if ( d->task->getBoolean( "backfill" ) ) {
+                d->backfills++;
+                break;
+            }
+            d->build = new Query( "select i.indisvalid "
+                                  "from pg_index i "
+                                  "join pg_class c on (i.indexrelid=c.oid) "
+                                  "join pg_namespace n "
+                                  "on (c.relnamespace=n.oid) "
+                                  "where c.relname=$1 "
+                                  "and n.nspname=current_schema()", this );
+            d->build->bind( 1, d->task->getEString( "name" ) );
+            d->build->execute();
+            d->substate = 1;
+            break;
+        case 1:
+            {
+                Row * r = d->build->nextRow();
+                if ( r && r->getBoolean( "indisvalid" ) ) {
+                    d->build = new Query( "update schema_tasks "
+                                          "set done=true where id=$1",
+                                          this );
+                    d->build->bind( 1, d->task->getInt( "id" ) );
+                    d->substate = 4;
+                }
+                else if ( r ) {
+                    d->l->log( "Dropping invalid index " + name,
+                               Log::Significant );
+                    d->build = new Query( "drop index " + name, this );
+                    d->substate = 2;
+                }
+                else {
+                    d->l->log( "Building index " + name,
+                               Log::Significant );
+                    d->build = new Query( d->task->getEString( "statement" ),
+                                          this );
+                    d->substate = 3;
+                }
+                d->build->execute();
+            }
+            break;
+        case 2:
+            d->l->log( "Building index " + name, Log::Significant );
+            d->build = new Query( d->task->getEString( "statement" ), this );
+            d->build->execute();
+            d->substate = 3;
+            break;
+        case 3:
+            d->indexes++;
+            d->build = new Query( "update schema_tasks "
+                                  "set done=true where id=$1", this );
+            d->build->bind( 1, d->task->getInt( "id" ) );
+            d->build->execute();
+            d->substate = 4;
+            break;
+        case 4:
+            d->substate = 0;
+            break;
+        }
+    }
+}
+
+
 #include "downgrades.inc"
 
 
@@ -592,6 +827,58 @@ bool Schema::singleStep()
         c = stepTo97(); break;
     case 97:
         c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
+    case 102:
+        c = stepTo103(); break;
+    case 103:
+        c = stepTo104(); break;
+    case 104:
+        c = stepTo105(); break;
+    case 105:
+        c = stepTo106(); break;
+    case 106:
+        c = stepTo107(); break;
+    case 107:
+        c = stepTo108(); break;
+    case 108:
+        c = stepTo109(); break;
+    case 109:
+        c = stepTo110(); break;
+    case 110:
+        c = stepTo111(); break;
+    case 111:
+        c = stepTo112(); break;
+    case 112:
+        c = stepTo113(); break;
+    case 113:
+        c = stepTo114(); break;
+    case 114:
+        c = stepTo115(); break;
+    case 115:
+        c = stepTo116(); break;
+    case 116:
+        c = stepTo117(); break;
+    case 117:
+        c = stepTo118(); break;
+    case 118:
+        c = stepTo119(); break;
+    case 119:
+        c = stepTo120(); break;
+    case 120:
+        c = stepTo121(); break;
+    case 121:
+        c = stepTo122(); break;
+    case 122:
+        c = stepTo123(); break;
+    case 123:
+        c = stepTo124(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4420,3 +4707,919 @@ bool Schema::stepTo98()
     d->t->enqueue( "alter table mailboxes add flag text" );
     return true;
 }
+
+
+/*! Add mailboxes.change and mailbox_deletions, so that servers can
+    read only the mailboxes that have changed.
+*/
+
+bool Schema::stepTo99()
+{
+    describeStep( "Recording changes to mailboxes." );
+    d->t->enqueue( "alter table mailboxes add change bigint not null "
+                   "default 0" );
+    d->t->enqueue( "alter table mailboxes alter change "
+                   "set default txid_current()" );
+    d->t->enqueue( "create function set_mailbox_change() "
+                   "returns trigger as $$"
+                   "begin "
+                   "new.change := txid_current(); "
+                   "return new;"
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger mailbox_change_trigger "
+                   "before update on mailboxes for each "
+                   "row execute procedure set_mailbox_change()" );
+    d->t->enqueue( "create table mailbox_deletions ("
+                   "mailbox integer not null, "
+                   "change bigint not null default txid_current())" );
+    d->t->enqueue( "create function note_mailbox_deletion() "
+                   "returns trigger as $$"
+                   "begin "
+                   "insert into mailbox_deletions (mailbox) values (old.id); "
+                   "notify mailboxes_updated; "
+                   "return old;"
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger mailbox_deletion_trigger "
+                   "after delete on mailboxes for each "
+                   "row execute procedure note_mailbox_deletion()" );
+    return true;
+}
+
+
+/*! Adds the bodypart_words table used by WordIndex. */
+
+bool Schema::stepTo100()
+{
+    describeStep( "Adding a word index for bodyparts." );
+    d->t->enqueue( "create table bodypart_words ("
+                   "bodypart integer not null references bodyparts(id) "
+                   "on delete cascade, "
+                   "word text not null)" );
+    d->t->enqueue( "create index bw_w on bodypart_words(word)" );
+    d->t->enqueue( "create index bw_b on bodypart_words(bodypart)" );
+    return true;
+}
+
+
+/*! Adds the thread_members table used by Thread, and fills it in
+    from header_fields. The subjects copied here aren't reduced to
+    base subjects; stepTo117() does that.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Adding a thread index for messages." );
+    d->t->enqueue( "create table thread_members ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "messageid text, "
+                   "refs text not null, "
+                   "subject text not null)" );
+    d->t->enqueue( "insert into thread_members "
+                   "(message, messageid, refs, subject) "
+                   "select m.id, "
+                   "(select min(value) from header_fields "
+                   "where message=m.id and part='' and field=" +
+                   fn( HeaderField::MessageId ) + "), "
+                   "coalesce((select min(value) from header_fields "
+                   "where message=m.id and part='' and field=" +
+                   fn( HeaderField::References ) + "), ''), "
+                   "coalesce((select min(value) from header_fields "
+                   "where message=m.id and part='' and field=" +
+                   fn( HeaderField::Subject ) + "), '') "
+                   "from messages m" );
+    return true;
+}
+
+
+/*! Adds mailbox_counts and the triggers that maintain it, and fills
+    it in from mailbox_messages.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Adding per-mailbox message counts." );
+    d->t->enqueue( "create table mailbox_counts ("
+                   "mailbox integer primary key references mailboxes(id) "
+                   "on delete cascade, "
+                   "messages integer not null default 0, "
+                   "unseen integer not null default 0, "
+                   "deleted integer not null default 0, "
+                   "rfc822size bigint not null default 0)" );
+    d->t->enqueue( "insert into mailbox_counts "
+                   "(mailbox, messages, unseen, deleted, rfc822size) "
+                   "select mb.id, count(mm.uid), "
+                   "count(case when not mm.seen then 1 end), "
+                   "count(case when mm.deleted then 1 end), "
+                   "coalesce(sum(m.rfc822size::bigint),0) "
+                   "from mailboxes mb "
+                   "left join mailbox_messages mm on (mb.id=mm.mailbox) "
+                   "left join messages m on (mm.message=m.id) "
+                   "group by mb.id" );
+    d->t->enqueue( "create function create_mailbox_counts() "
+                   "returns trigger as $$"
+                   "begin "
+                   "insert into mailbox_counts (mailbox) values (new.id); "
+                   "return null;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger mailbox_counts_creation_trigger "
+                   "after insert on mailboxes for each "
+                   "row execute procedure create_mailbox_counts()" );
+    d->t->enqueue( "create function update_mailbox_counts() "
+                   "returns trigger as $$"
+                   "begin "
+                   "if tg_op = 'UPDATE' and "
+                   "new.mailbox = old.mailbox and "
+                   "new.message = old.message then "
+                   "update mailbox_counts set "
+                   "unseen = unseen + (case when new.seen then 0 else 1 end) "
+                   "- (case when old.seen then 0 else 1 end), "
+                   "deleted = deleted "
+                   "+ (case when new.deleted then 1 else 0 end) "
+                   "- (case when old.deleted then 1 else 0 end) "
+                   "where mailbox = new.mailbox; "
+                   "return null; "
+                   "end if; "
+                   "if tg_op <> 'INSERT' then "
+                   "update mailbox_counts set "
+                   "messages = messages - 1, "
+                   "unseen = unseen - (case when old.seen then 0 else 1 end), "
+                   "deleted = deleted "
+                   "- (case when old.deleted then 1 else 0 end), "
+                   "rfc822size = rfc822size - "
+                   "coalesce((select rfc822size from messages "
+                   "where id = old.message), 0) "
+                   "where mailbox = old.mailbox; "
+                   "end if; "
+                   "if tg_op <> 'DELETE' then "
+                   "update mailbox_counts set "
+                   "messages = messages + 1, "
+                   "unseen = unseen + (case when new.seen then 0 else 1 end), "
+                   "deleted = deleted "
+                   "+ (case when new.deleted then 1 else 0 end), "
+                   "rfc822size = rfc822size + "
+                   "coalesce((select rfc822size from messages "
+                   "where id = new.message), 0) "
+                   "where mailbox = new.mailbox; "
+                   "end if; "
+                   "return null;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger mailbox_counts_trigger "
+                   "after insert or delete or "
+                   "update of mailbox, message, seen, deleted "
+                   "on mailbox_messages for each "
+                   "row execute procedure update_mailbox_counts()" );
+    return true;
+}
+
+
+/*! Adds message_summaries, which FETCH fills as it computes ENVELOPE,
+    BODY and BODYSTRUCTURE responses.
+*/
+
+bool Schema::stepTo103()
+{
+    describeStep( "Adding precomputed message summaries." );
+    d->t->enqueue( "create table message_summaries ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "envelope text not null, "
+                   "body text not null, "
+                   "bodystructure text not null)" );
+    return true;
+}
+
+
+/*! Adds raw_messages and message_raws, which hold the complete text of
+    messages injected while store-raw-messages is enabled.
+*/
+
+bool Schema::stepTo104()
+{
+    describeStep( "Adding optional raw message storage." );
+    d->t->enqueue( "create table raw_messages ("
+                   "id serial primary key, "
+                   "hash text not null, "
+                   "data bytea not null)" );
+    d->t->enqueue( "create index rm_hash on raw_messages(hash)" );
+    d->t->enqueue( "create table message_raws ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "raw integer not null references raw_messages(id))" );
+    d->t->enqueue( "create index mr_raw on message_raws(raw)" );
+    return true;
+}
+
+
+/*! Adds message_previews, which holds the RFC 8970 PREVIEW text of
+    each message.
+*/
+
+bool Schema::stepTo105()
+{
+    describeStep( "Adding message previews." );
+    d->t->enqueue( "create table message_previews ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "preview text not null)" );
+    return true;
+}
+
+
+/*! Adds an index on mailbox_messages(mailbox,modseq), so that finding
+    the messages changed since a modseq needn't scan the mailbox.
+*/
+
+bool Schema::stepTo106()
+{
+    describeStep( "Indexing mailbox_messages by modseq." );
+    d->t->enqueue( "create index mm_mm on mailbox_messages(mailbox,modseq)" );
+    return true;
+}
+
+
+/*! Adds an index on autoresponses(sent_from,sent_to,handle), so that
+    Sieve's vacation check needn't scan the table.
+*/
+
+bool Schema::stepTo107()
+{
+    describeStep( "Indexing autoresponses by sender and recipient." );
+    d->t->enqueue( "create index ar_fth on "
+                   "autoresponses(sent_from,sent_to,handle)" );
+    return true;
+}
+
+
+/*! Adds header_blobs, which holds the header fields that aren't
+    stored in header_fields when indexed-header-fields is set.
+*/
+
+bool Schema::stepTo108()
+{
+    describeStep( "Adding header blobs for unindexed header fields." );
+    d->t->enqueue( "create table header_blobs ("
+                   "message integer not null, "
+                   "part text not null, "
+                   "header text not null, "
+                   "primary key (message, part), "
+                   "foreign key (message, part) "
+                   "references part_numbers(message, part) "
+                   "on delete cascade)" );
+    return true;
+}
+
+
+/*! Adds triggers to notify permissions_updated whenever permissions,
+    groups or group_members change, so that Permissions can cache.
+*/
+
+bool Schema::stepTo109()
+{
+    describeStep( "Notifying changes to permissions and groups." );
+    d->t->enqueue( "create or replace function notify_permissions() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "notify permissions_updated; return NULL; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger permissions_trigger "
+                   "after insert or update or delete "
+                   "on permissions "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    d->t->enqueue( "create trigger groups_trigger "
+                   "after insert or update or delete "
+                   "on groups "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    d->t->enqueue( "create trigger group_members_trigger "
+                   "after insert or update or delete "
+                   "on group_members "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    return true;
+}
+
+
+/*! Changes check_mailbox_update() to send mailbox_counters with the
+    new uidnext and nextmodseq as payload when nothing else changes,
+    so that other servers needn't reread the mailboxes table.
+*/
+
+bool Schema::stepTo110()
+{
+    describeStep( "Notifying mailbox counter changes with a payload." );
+    d->t->enqueue( "create or replace function check_mailbox_update() "
+                   "returns trigger as $$"
+                   "declare address text; "
+                   "begin "
+                   "if new.name=old.name and new.deleted=old.deleted and "
+                   "new.owner is not distinct from old.owner and "
+                   "new.uidvalidity=old.uidvalidity and "
+                   "new.flag is not distinct from old.flag "
+                   "then "
+                   "perform pg_notify('mailbox_counters', "
+                   "new.id||' '||new.uidnext||' '||new.nextmodseq); "
+                   "else "
+                   "notify mailboxes_updated; "
+                   "end if; "
+                   "if new.deleted='t' and old.deleted='f' then "
+                   "perform * from mailbox_messages where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is not empty', new.name;"
+                   "end if; "
+                   "select a.localpart||'@'||a.domain into address"
+                   " from addresses a join aliases al on (a.id=al.address)"
+                   " where al.mailbox=new.id;"
+                   "if address is not null then "
+                   "raise exception '% used by alias %', new.name, address; "
+                   "end if; "
+                   "perform * from fileinto_targets where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is used by sieve fileinto', new.name;"
+                   "end if; "
+                   "end if; "
+                   "return new;"
+                   "end;$$ language 'plpgsql'" );
+    return true;
+}
+
+
+/*! Adds a unique index on the SHA-256 hashes in bodyparts.hash, so
+    that Injector can find an existing bodypart by its hash alone.
+    Older rows have 32-character MD5 hashes, which may be shared by
+    more than one row, and are left out of the index.
+*/
+
+bool Schema::stepTo111()
+{
+    describeStep( "Indexing bodyparts by unique SHA-256 hash." );
+    d->t->enqueue( "create unique index b_sha on bodyparts(hash) "
+                   "where length(hash)=64" );
+    return true;
+}
+
+
+/*! Adds mailbox_messages.flagbits and moves flags 1-64 there from the
+    flags table.
+*/
+
+bool Schema::stepTo112()
+{
+    describeStep( "Storing common flags as bits in mailbox_messages." );
+    d->t->enqueue( "alter table mailbox_messages "
+                   "add flagbits bigint not null default 0" );
+    d->t->enqueue( "update mailbox_messages mm set flagbits=f.bits "
+                   "from (select mailbox, uid, "
+                   "bit_or(1::bigint<<(flag-1)) as bits "
+                   "from flags where flag<=64 group by mailbox, uid) f "
+                   "where mm.mailbox=f.mailbox and mm.uid=f.uid" );
+    d->t->enqueue( "delete from flags where flag<=64" );
+    return true;
+}
+
+
+/*! Adds bodyparts.compressed, which is true for the bodyparts whose
+    data Injector compressed (see compress-bodyparts).
+*/
+
+bool Schema::stepTo113()
+{
+    describeStep( "Allowing compressed bodyparts." );
+    d->t->enqueue( "alter table bodyparts "
+                   "add compressed boolean not null default false" );
+    return true;
+}
+
+
+/*! Adds quota_usage and the triggers that maintain it, and fills it
+    in from mailbox_counts.
+*/
+
+bool Schema::stepTo114()
+{
+    describeStep( "Adding per-user quota usage." );
+    d->t->enqueue( "create table quota_usage ("
+                   "owner integer primary key references users(id) "
+                   "on delete cascade, "
+                   "messages bigint not null default 0, "
+                   "rfc822size bigint not null default 0)" );
+    d->t->enqueue( "insert into quota_usage "
+                   "(owner, messages, rfc822size) "
+                   "select u.id, coalesce(sum(mc.messages),0), "
+                   "coalesce(sum(mc.rfc822size),0) "
+                   "from users u "
+                   "left join mailboxes mb on (mb.owner=u.id) "
+                   "left join mailbox_counts mc on (mc.mailbox=mb.id) "
+                   "group by u.id" );
+    d->t->enqueue( "create function create_quota_usage() "
+                   "returns trigger as $$"
+                   "begin "
+                   "insert into quota_usage (owner) values (new.id); "
+                   "return null;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger quota_usage_creation_trigger "
+                   "after insert on users for each "
+                   "row execute procedure create_quota_usage()" );
+    d->t->enqueue( "create function update_quota_usage() "
+                   "returns trigger as $$"
+                   "begin "
+                   "update quota_usage qu set "
+                   "messages = qu.messages + new.messages - old.messages, "
+                   "rfc822size = qu.rfc822size "
+                   "+ new.rfc822size - old.rfc822size "
+                   "from mailboxes mb "
+                   "where mb.id = new.mailbox and qu.owner = mb.owner; "
+                   "return null;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger quota_usage_trigger "
+                   "after update of messages, rfc822size "
+                   "on mailbox_counts for each "
+                   "row execute procedure update_quota_usage()" );
+    return true;
+}
+
+
+/*! Adds orphan_candidates, the triggers that fill it, and the
+    reap_orphans() and expire_deleted_messages() functions, which let
+    the server remove unused messages without the privileges aox
+    vacuum needs.
+*/
+
+bool Schema::stepTo115()
+{
+    describeStep( "Adding a queue of possibly unused messages." );
+    d->t->enqueue( "create table orphan_candidates ("
+                   "id serial primary key, "
+                   "message integer not null)" );
+    d->t->enqueue( "create function note_orphan_candidate() "
+                   "returns trigger as $$"
+                   "begin "
+                   "if tg_table_name = 'mailbox_messages' then "
+                   "perform 1 from deleted_messages "
+                   "where mailbox=old.mailbox and uid=old.uid; "
+                   "if found then "
+                   "return null; "
+                   "end if; "
+                   "end if; "
+                   "insert into orphan_candidates (message) "
+                   "values (old.message); "
+                   "return null;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger mailbox_messages_orphan_trigger "
+                   "after delete on mailbox_messages for each "
+                   "row execute procedure note_orphan_candidate()" );
+    d->t->enqueue( "create trigger deleted_messages_orphan_trigger "
+                   "after delete on deleted_messages for each "
+                   "row execute procedure note_orphan_candidate()" );
+    d->t->enqueue( "create trigger deliveries_orphan_trigger "
+                   "after delete on deliveries for each "
+                   "row execute procedure note_orphan_candidate()" );
+    d->t->enqueue( "create function reap_orphans(n integer) "
+                   "returns integer as $$"
+                   "declare "
+                   "c record; "
+                   "bps integer[]; "
+                   "rawid integer; "
+                   "handled integer := 0; "
+                   "begin "
+                   "for c in delete from orphan_candidates where id in "
+                   "(select id from orphan_candidates order by id limit n) "
+                   "returning message "
+                   "loop "
+                   "handled := handled + 1; "
+                   "perform 1 from mailbox_messages "
+                   "where message=c.message; "
+                   "if found then "
+                   "continue; "
+                   "end if; "
+                   "perform 1 from deleted_messages "
+                   "where message=c.message; "
+                   "if found then "
+                   "continue; "
+                   "end if; "
+                   "perform 1 from deliveries where message=c.message; "
+                   "if found then "
+                   "continue; "
+                   "end if; "
+                   "perform 1 from messages where id=c.message for update; "
+                   "if not found then "
+                   "continue; "
+                   "end if; "
+                   "select array_agg(bodypart) into bps from part_numbers "
+                   "where message=c.message and bodypart is not null; "
+                   "select mr.raw into rawid from message_raws mr "
+                   "where mr.message=c.message; "
+                   "delete from messages where id=c.message; "
+                   "if bps is not null then "
+                   "delete from bodyparts b where b.id=any(bps) "
+                   "and not exists (select 1 from part_numbers pn "
+                   "where pn.bodypart=b.id); "
+                   "end if; "
+                   "if rawid is not null then "
+                   "delete from raw_messages r where r.id=rawid "
+                   "and not exists (select 1 from message_raws mr "
+                   "where mr.raw=r.id); "
+                   "end if; "
+                   "end loop; "
+                   "return handled;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "grant execute on function "
+                   "reap_orphans(integer) to " +
+                   d->dbuser.unquoted() );
+    d->t->enqueue( "create function "
+                   "expire_deleted_messages(days integer, n integer) "
+                   "returns integer as $$"
+                   "declare "
+                   "expired integer; "
+                   "begin "
+                   "delete from deleted_messages where (mailbox, uid) in "
+                   "(select mailbox, uid from deleted_messages "
+                   "where deleted_at < "
+                   "current_timestamp - days * interval '1 day' "
+                   "limit n); "
+                   "get diagnostics expired = row_count; "
+                   "return expired;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "grant execute on function "
+                   "expire_deleted_messages(integer,integer) to " +
+                   d->dbuser.unquoted() );
+    return true;
+}
+
+
+/*! Indexes thread_members by base subject, so that the Injector can
+    find the thread a reply without References belongs to.
+*/
+
+bool Schema::stepTo116()
+{
+    describeStep( "Indexing thread_members by subject." );
+    d->t->enqueue( "create index tm_subject on thread_members(subject)" );
+    return true;
+}
+
+
+/*! Reduces the subjects stepTo101() copied into thread_members to
+    base subjects, as the Injector stores them, so that neither Sort
+    nor Thread needs to do that for each command.
+*/
+
+bool Schema::stepTo117()
+{
+    if ( d->substate == 0 ) {
+        describeStep( "Storing base subjects in thread_members." );
+        d->q = new Query( "select message, subject from thread_members",
+                          this );
+        d->t->enqueue( d->q );
+        d->t->execute();
+        d->substate = 1;
+    }
+
+    if ( d->substate == 1 ) {
+        if ( !d->q->done() )
+            return false;
+
+        Query * copy = new Query( "copy tmbs (message, subject) "
+                                  "from stdin with binary", 0 );
+        uint n = 0;
+        while ( d->q->hasResults() ) {
+            Row * r = d->q->nextRow();
+            UString subject = r->getUString( "subject" );
+            UString base = Message::baseSubject( subject );
+            if ( base != subject ) {
+                copy->bind( 1, r->getInt( "message" ) );
+                copy->bind( 2, base );
+                copy->submitLine();
+                n++;
+            }
+        }
+        if ( n ) {
+            d->t->enqueue( "create temporary table tmbs "
+                           "(message integer, subject text)" );
+            d->t->enqueue( copy );
+            d->t->enqueue( "update thread_members tm set subject=t.subject "
+                           "from tmbs t where tm.message=t.message" );
+            d->t->enqueue( "drop table tmbs" );
+            d->t->execute();
+        }
+        d->substate = 2;
+    }
+
+    return true;
+}
+
+
+/*! Returns SQL for the sort key of the first address in the \a field
+    field of m.id, using \a key as the expression over addresses a.
+*/
+
+static EString sortKey( HeaderField::Type field, const EString & key )
+{
+    return "(select upper(" + key + ") from address_fields af "
+        "join addresses a on (af.address=a.id) "
+        "where af.message=m.id and af.part='' and af.number=0 and "
+        "af.field=" + fn( field ) + ")";
+}
+
+
+/*! Adds the sort_keys table, so that SORT by addresses needn't join
+    address_fields and addresses, and fills it in.
+*/
+
+bool Schema::stepTo118()
+{
+    describeStep( "Adding precomputed address sort keys." );
+    d->t->enqueue( "create table sort_keys ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "from_key text, "
+                   "to_key text, "
+                   "cc_key text, "
+                   "display_from text, "
+                   "display_to text)" );
+    EString display( "case when a.name is null or a.name='' "
+                     "then a.localpart||'@'||a.domain "
+                     "else a.name end" );
+    d->t->enqueue( "insert into sort_keys "
+                   "(message, from_key, to_key, cc_key, "
+                   "display_from, display_to) "
+                   "select m.id, " +
+                   sortKey( HeaderField::From, "a.localpart" ) + ", " +
+                   sortKey( HeaderField::To, "a.localpart" ) + ", " +
+                   sortKey( HeaderField::Cc, "a.localpart" ) + ", " +
+                   sortKey( HeaderField::From, display ) + ", " +
+                   sortKey( HeaderField::To, display ) + " "
+                   "from messages m" );
+    return true;
+}
+
+
+/*! Adds indexes so that looking at and flushing the delivery queue
+    needn't read all of delivery_recipients.
+*/
+
+bool Schema::stepTo119()
+{
+    describeStep( "Adding indexes for the delivery queue." );
+    d->t->enqueue( "create index dr_d on delivery_recipients (delivery)" );
+    d->t->enqueue( "create index dr_pending on delivery_recipients "
+                   "(action, delivery) where action=0 or action=2" );
+    return true;
+}
+
+
+/*! Adds inject_message(), which does the part of injecting a message
+    that needs answers from the database, so that an Injector using
+    use-injection-function needs fewer round-trips.
+*/
+
+bool Schema::stepTo120()
+{
+    describeStep( "Adding the inject_message() function." );
+    d->t->enqueue( "create function inject_message(mbs integer[], "
+                   "listening integer[], hashes text[], refs text[], "
+                   "names text[], localparts text[], domains text[]) "
+                   "returns table (message integer, thread_root integer, "
+                   "address integer, name text, localpart text, "
+                   "domain text, bodypart integer, hash text, "
+                   "fresh boolean, mailbox integer, uid integer, "
+                   "modseq bigint, recent boolean) as $$"
+                   "#variable_conflict use_column\n"
+                   "declare "
+                   "r record; "
+                   "roots integer[]; "
+                   "root integer; "
+                   "i integer; "
+                   "begin "
+                   "message := nextval('messages_id_seq'); "
+                   "for i in 1..coalesce(array_length(names,1),0) loop "
+                   "select id into address from addresses "
+                   "where name=names[i] and localpart=localparts[i]::citext "
+                   "and domain=domains[i]::citext; "
+                   "if not found then "
+                   "begin "
+                   "insert into addresses (name,localpart,domain) "
+                   "values (names[i],localparts[i],domains[i]) "
+                   "returning id into address; "
+                   "exception when unique_violation then "
+                   "select id into address from addresses "
+                   "where name=names[i] and localpart=localparts[i]::citext "
+                   "and domain=domains[i]::citext; "
+                   "end; "
+                   "end if; "
+                   "name := names[i]; "
+                   "localpart := localparts[i]; "
+                   "domain := domains[i]; "
+                   "return next; "
+                   "end loop; "
+                   "address := null; "
+                   "name := null; "
+                   "localpart := null; "
+                   "domain := null; "
+                   "if array_length(refs,1) > 0 then "
+                   "select id into root from thread_roots "
+                   "where messageid=refs[1]; "
+                   "if not found then "
+                   "begin "
+                   "insert into thread_roots (messageid) values (refs[1]) "
+                   "returning id into root; "
+                   "exception when unique_violation then "
+                   "select id into root from thread_roots "
+                   "where messageid=refs[1]; "
+                   "end; "
+                   "end if; "
+                   "select array_agg(x.id) into roots from "
+                   "(select id from thread_roots where messageid=any(refs) "
+                   "union "
+                   "select m.thread_root from messages m "
+                   "join header_fields hf on "
+                   "(m.id=hf.message and hf.field=13) "
+                   "where hf.value=any(refs) "
+                   "and m.thread_root is not null) x; "
+                   "select min(x) into root from unnest(roots || root) x; "
+                   "for r in select distinct x from unnest(roots) x "
+                   "where x<>root loop "
+                   "perform merge_threads(root, r.x); "
+                   "end loop; "
+                   "thread_root := root; "
+                   "end if; "
+                   "perform pg_advisory_xact_lock(hashtext(s.h)) "
+                   "from (select distinct h from unnest(hashes) h "
+                   "order by h) s; "
+                   "for r in select distinct on (h) h, b.id "
+                   "from unnest(hashes) h "
+                   "left join bodyparts b on (b.hash=h) "
+                   "order by h, b.id "
+                   "loop "
+                   "hash := r.h; "
+                   "bodypart := r.id; "
+                   "fresh := false; "
+                   "if bodypart is null then "
+                   "bodypart := nextval('bodypart_ids'); "
+                   "fresh := true; "
+                   "end if; "
+                   "return next; "
+                   "end loop; "
+                   "bodypart := null; "
+                   "hash := null; "
+                   "fresh := null; "
+                   "for r in select id, uidnext, nextmodseq, first_recent "
+                   "from mailboxes where id=any(mbs) order by id for update "
+                   "loop "
+                   "mailbox := r.id; "
+                   "uid := r.uidnext; "
+                   "modseq := r.nextmodseq; "
+                   "recent := r.uidnext=r.first_recent "
+                   "and r.id=any(listening); "
+                   "i := 0; "
+                   "if recent then "
+                   "i := 1; "
+                   "end if; "
+                   "update mailboxes set uidnext=uidnext+1, "
+                   "nextmodseq=nextmodseq+1, first_recent=first_recent+i "
+                   "where id=r.id; "
+                   "return next; "
+                   "end loop; "
+                   "mailbox := null; "
+                   "uid := null; "
+                   "modseq := null; "
+                   "recent := null; "
+                   "return next; "
+                   "return; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "grant execute on function "
+                   "inject_message(integer[],integer[],text[],text[],"
+                   "text[],text[],text[]) to " +
+                   d->dbuser.unquoted() );
+    return true;
+}
+
+
+/*! Adds move_to_cold_storage(), which lets the Maintainer remove the
+    contents of bodyparts it has copied to cold-storage-directory.
+*/
+
+bool Schema::stepTo121()
+{
+    describeStep( "Adding the move_to_cold_storage() function." );
+    d->t->enqueue( "create function move_to_cold_storage(ids integer[]) "
+                   "returns integer as $$"
+                   "declare "
+                   "moved integer; "
+                   "begin "
+                   "update bodyparts set data=null, compressed=false "
+                   "where id=any(ids) and data is not null "
+                   "and text is null; "
+                   "get diagnostics moved = row_count; "
+                   "return moved;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "grant execute on function "
+                   "move_to_cold_storage(integer[]) to " +
+                   d->dbuser.unquoted() );
+    return true;
+}
+
+
+/*! Changes check_mailbox_update() so that a mailbox can be deleted
+    while it still contains messages, which the Maintainer then moves
+    to deleted_messages, and so that it cannot be recreated until
+    that's done.
+*/
+
+bool Schema::stepTo122()
+{
+    describeStep( "Allowing nonempty mailboxes to be deleted." );
+    d->t->enqueue( "create or replace function check_mailbox_update() "
+                   "returns trigger as $$"
+                   "declare address text; "
+                   "begin "
+                   "if new.name=old.name and new.deleted=old.deleted and "
+                   "new.owner is not distinct from old.owner and "
+                   "new.uidvalidity=old.uidvalidity and "
+                   "new.flag is not distinct from old.flag "
+                   "then "
+                   "perform pg_notify('mailbox_counters', "
+                   "new.id||' '||new.uidnext||' '||new.nextmodseq); "
+                   "else "
+                   "notify mailboxes_updated; "
+                   "end if; "
+                   "if new.deleted='f' and old.deleted='t' then "
+                   "perform * from mailbox_messages where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is still being emptied', new.name;"
+                   "end if; "
+                   "end if; "
+                   "if new.deleted='t' and old.deleted='f' then "
+                   "select a.localpart||'@'||a.domain into address"
+                   " from addresses a join aliases al on (a.id=al.address)"
+                   " where al.mailbox=new.id;"
+                   "if address is not null then "
+                   "raise exception '% used by alias %', new.name, address; "
+                   "end if; "
+                   "perform * from fileinto_targets where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is used by sieve fileinto', new.name;"
+                   "end if; "
+                   "end if; "
+                   "return new;"
+                   "end;$$ language 'plpgsql'" );
+    return true;
+}
+
+
+/*! Adds the schema_tasks table, which holds the work left over from
+    online upgrades, and run_schema_backfill(), which lets the
+    Maintainer do that work a batch at a time.
+*/
+
+bool Schema::stepTo123()
+{
+    describeStep( "Adding the schema_tasks table." );
+    d->t->enqueue( "create table schema_tasks ("
+                   "id serial primary key, "
+                   "revision integer not null, "
+                   "name text not null, "
+                   "backfill boolean not null default false, "
+                   "statement text not null, "
+                   "done boolean not null default false)" );
+    d->t->enqueue( "create function run_schema_backfill(t integer, "
+                   "n integer) returns integer as $$"
+                   "declare "
+                   "s text; "
+                   "changed integer; "
+                   "begin "
+                   "select statement into s from schema_tasks "
+                   "where id=t and backfill and not done for update; "
+                   "if not found then "
+                   "return 0; "
+                   "end if; "
+                   "execute s using n; "
+                   "get diagnostics changed = row_count; "
+                   "if changed = 0 then "
+                   "update schema_tasks set done=true where id=t; "
+                   "end if; "
+                   "return changed;"
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "grant execute on function "
+                   "run_schema_backfill(integer,integer) to " +
+                   d->dbuser.unquoted() );
+    return true;
+}
+
+
+/*! Adds the header_values table, which holds the values of the fields
+    named in interned-header-fields, and header_fields.value_id, which
+    refers to it.
+*/
+
+bool Schema::stepTo124()
+{
+    describeStep( "Adding the header_values table." );
+    d->t->enqueue( "create table header_values ("
+                   "id serial primary key, "
+                   "value text not null)" );
+    d->t->enqueue( "create unique index hv_value on header_values(value)" );
+    d->t->enqueue( "alter table header_fields add value_id integer" );
+    return true;
+}
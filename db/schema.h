@@ -14,7 +14,7 @@ class Schema
     : public EventHandler
 {
 public:
-    Schema( EventHandler *, bool = false, bool = true );
+    Schema( EventHandler *, bool = false, bool = true, bool = false );
     Query * result() const;
     void execute();
 
@@ -123,8 +123,39 @@ private:
     bool stepTo96();
     bool stepTo97();
     bool stepTo98();
+    bool stepTo99();
+    bool stepTo100();
+    bool stepTo101();
+    bool stepTo102();
+    bool stepTo103();
+    bool stepTo104();
+    bool stepTo105();
+    bool stepTo106();
+    bool stepTo107();
+    bool stepTo108();
+    bool stepTo109();
+    bool stepTo110();
+    bool stepTo111();
+    bool stepTo112();
+    bool stepTo113();
+    bool stepTo114();
+    bool stepTo115();
+    bool stepTo116();
+    bool stepTo117();
+    bool stepTo118();
+    bool stepTo119();
+    bool stepTo120();
+    bool stepTo121();
+    bool stepTo122();
+    bool stepTo123();
+    bool stepTo124();
 
     void describeStep( const EString & );
+    void createIndex( const EString &, const EString &, bool = false );
+    void backfill( const EString &, const EString &,
+                   const EString &, const EString & );
+    void addTask( const EString &, bool, const EString & );
+    bool runTasks();
 };
 
 
@@ -8,6 +8,7 @@
 #include "event.h"
 #include "scope.h"
 #include "list.h"
+#include "configuration.h"
 
 
 class TransactionData
@@ -19,7 +20,8 @@ public:
           children( 0 ),
           submittedCommit( false ), submittedBegin( false ),
           committing( false ),
-          owner( 0 ), db( 0 ), queries( 0 ), failedQuery( 0 )
+          owner( 0 ), db( 0 ), queries( 0 ), failedQuery( 0 ),
+          priority( Query::Interactive ), durability( Transaction::Durable )
     {}
 
     Transaction::State state;
@@ -36,6 +38,9 @@ public:
     List< Query > *queries;
 
     Query * failedQuery;
+
+    Query::Priority priority;
+    Transaction::Durability durability;
     EString error;
 
     class CommitBouncer
@@ -515,6 +520,9 @@ void Transaction::commit()
         enqueue( q );
     }
     else {
+        if ( d->durability == Relaxed &&
+             Configuration::toggle( Configuration::RelaxedCommits ) )
+            enqueue( "set local synchronous_commit to off" );
         TransactionData::CommitBouncer * cb =
             new TransactionData::CommitBouncer( this );
         Query * q = new Query( "commit", cb );
@@ -693,3 +701,57 @@ List< Query > * Transaction::submittedQueries()
 
     return r;
 }
+
+
+/*! Records that this Transaction has priority \a p, which applies to
+    all of its queries. A subtransaction has its parent's priority.
+    The default is Query::Interactive.
+
+    \sa Query::setPriority()
+*/
+
+void Transaction::setPriority( Query::Priority p )
+{
+    d->priority = p;
+}
+
+
+/*! Returns the priority set by setPriority(). */
+
+Query::Priority Transaction::priority() const
+{
+    const Transaction * t = this;
+    while ( t->d->parent )
+        t = t->d->parent;
+    return t->d->priority;
+}
+
+
+/*! Records that this Transaction's durability class is \a d. The
+    default is Durable, which means that commit() waits until the
+    database server has flushed the commit to disk.
+
+    A Relaxed transaction, if relaxed-commits is enabled, commits with
+    synchronous_commit turned off: it may be lost if the database
+    server crashes shortly afterwards, but may not be half done, and
+    commits without waiting for the disk. That suits changes that are
+    cheap to lose, such as flag changes, and not deliveries.
+
+    The durability of a subtransaction is that of its parent.
+*/
+
+void Transaction::setDurability( Durability d )
+{
+    this->d->durability = d;
+}
+
+
+/*! Returns the durability class set by setDurability(). */
+
+Transaction::Durability Transaction::durability() const
+{
+    const Transaction * t = this;
+    while ( t->d->parent )
+        t = t->d->parent;
+    return t->d->durability;
+}
@@ -7,8 +7,11 @@
 #include "stderrlogger.h"
 #include "configuration.h"
 #include "permissions.h"
+#include "connection.h"
 #include "logclient.h"
 #include "eventloop.h"
+#include "endpoint.h"
+#include "buffer.h"
 #include "injector.h"
 #include "mailbox.h"
 #include "query.h"
@@ -140,6 +143,149 @@ public:
 };
 
 
+/*  Returns \a s with CRLF line endings, dot-stuffed and terminated as
+    LMTP DATA wants it.
+*/
+
+static EString dotted( const EString & s )
+{
+    EString t = s.crlf();
+    EString r;
+    r.reserve( t.length() + 16 );
+    uint i = 0;
+    while ( i < t.length() ) {
+        if ( t[i] == '.' )
+            r.append( '.' );
+        int eol = t.find( "\r\n", i );
+        if ( eol < 0 )
+            eol = t.length();
+        else
+            eol += 2;
+        r.append( t.mid( i, eol - i ) );
+        i = eol;
+    }
+    if ( !r.endsWith( "\r\n" ) )
+        r.append( "\r\n" );
+    r.append( ".\r\n" );
+    return r;
+}
+
+
+/*  The LmtpDeliverator hands the message to a running archiveopteryx
+    over LMTP, so that no database connection or mailbox tree has to
+    be set up. The server's reply decides the exit status.
+*/
+
+class LmtpDeliverator
+    : public Connection
+{
+public:
+    enum Step { Banner, Lhlo, MailFrom, RcptTo, Data, Body, Quit };
+
+    Step step;
+    EString from;
+    EString to;
+    EString body;
+
+    LmtpDeliverator( const Endpoint & e, const EString & sender,
+                     const EString & recipient, const EString & message )
+        : Connection( Connection::socket( e.protocol() ),
+                      Connection::SmtpClient ),
+          step( Banner ), from( sender ), to( recipient ),
+          body( message )
+    {
+        Allocator::addEternal( this, "lmtp delivery" );
+        connect( e );
+        EventLoop::global()->addConnection( this );
+        setTimeoutAfter( 60 );
+    }
+
+    void react( Event e )
+    {
+        switch ( e ) {
+        case Connect:
+        case Shutdown:
+            break;
+        case Read:
+            parse();
+            break;
+        case Timeout:
+            quit( EX_TEMPFAIL, "Timeout talking to the LMTP server" );
+            break;
+        case Error:
+        case Close:
+            if ( step != Quit )
+                quit( EX_TEMPFAIL,
+                      "Could not talk to the LMTP server at " +
+                      peer().string() );
+            EventLoop::shutdown();
+            break;
+        }
+    }
+
+    void parse()
+    {
+        EString * l = readBuffer()->removeLine();
+        while ( l ) {
+            setTimeoutAfter( 60 );
+            if ( l->length() < 4 || (*l)[3] != '-' )
+                respond( *l );
+            l = readBuffer()->removeLine();
+        }
+    }
+
+    void respond( const EString & l )
+    {
+        log( "Received: " + l, Log::Debug );
+        uint code = l.mid( 0, 3 ).number( 0 );
+        if ( step == Data && code == 354 ) {
+            enqueue( body );
+            body.truncate();
+            step = Body;
+            return;
+        }
+        if ( code < 200 || code >= 300 ) {
+            if ( code >= 400 && code < 500 )
+                quit( EX_TEMPFAIL, l );
+            else if ( step == RcptTo )
+                quit( EX_NOUSER, l );
+            else if ( step == Body )
+                quit( EX_DATAERR, l );
+            quit( EX_UNAVAILABLE, l );
+        }
+
+        switch ( step ) {
+        case Banner:
+            enqueue( "lhlo " + Configuration::hostname() + "\r\n" );
+            step = Lhlo;
+            break;
+        case Lhlo:
+            enqueue( "mail from:<" + from + ">\r\n" );
+            step = MailFrom;
+            break;
+        case MailFrom:
+            enqueue( "rcpt to:<" + to + ">\r\n" );
+            step = RcptTo;
+            break;
+        case RcptTo:
+            enqueue( "data\r\n" );
+            step = Data;
+            break;
+        case Data:
+            quit( EX_PROTOCOL, "Unexpected reply to DATA: " + l );
+            break;
+        case Body:
+            enqueue( "quit\r\n" );
+            step = Quit;
+            break;
+        case Quit:
+            EventLoop::shutdown();
+            break;
+        }
+    }
+};
+
+
 int main( int argc, char *argv[] )
 {
     Scope global;
@@ -149,6 +295,7 @@ int main( int argc, char *argv[] )
     EString recipient;
     EString filename;
     int verbose = 0;
+    bool lmtp = false;
     bool error = false;
 
     int n = 1;
@@ -169,6 +316,10 @@ int main( int argc, char *argv[] )
                 }
                 break;
 
+            case 'l':
+                lmtp = true;
+                break;
+
             case 'v':
                 {
                     int i = 1;
@@ -198,9 +349,14 @@ int main( int argc, char *argv[] )
         n++;
     }
 
+    if ( lmtp && ( !mailbox.isEmpty() || !recipient.contains( '@' ) ) )
+        error = true;
+
     if ( error || recipient.isEmpty() ) {
         fprintf( stderr,
-                 "Syntax: aoxdeliver [-v] [-f sender] recipient [filename]\n" );
+                 "Syntax: aoxdeliver [-v] [-f sender] recipient [filename]\n"
+                 "        aoxdeliver -l [-v] [-f sender] address "
+                 "[filename]\n" );
         exit( -1 );
     }
 
@@ -222,6 +378,34 @@ int main( int argc, char *argv[] )
 
     Configuration::setup( "archiveopteryx.conf" );
 
+    if ( lmtp ) {
+        EString a = Configuration::text( Configuration::LmtpAddress );
+        if ( a.isEmpty() || a == "0.0.0.0" )
+            a = "127.0.0.1";
+        else if ( a == "::" )
+            a = "::1";
+        Endpoint e( a, Configuration::scalar( Configuration::LmtpPort ) );
+        if ( !e.valid() )
+            quit( EX_CONFIG, "Invalid lmtp-address: " + a );
+
+        if ( verbose > 0 )
+            fprintf( stderr, "Sending to <%s> via LMTP at %s\n",
+                     recipient.cstr(), e.string().cstr() );
+
+        EventLoop::setup();
+        Log * l = new Log;
+        Allocator::addEternal( l, "delivery log" );
+        global.setLog( l );
+        Allocator::addEternal( new StderrLogger( "aoxdeliver", verbose ),
+                               "log object" );
+        LmtpDeliverator * c =
+            new LmtpDeliverator( e, sender, recipient, dotted( contents ) );
+        EventLoop::global()->start();
+        if ( c->step != LmtpDeliverator::Quit )
+            return EX_TEMPFAIL;
+        return 0;
+    }
+
     Injectee * message = new Injectee;
     message->parse( contents );
     if ( !message->error().isEmpty() ) {
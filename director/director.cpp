@@ -0,0 +1,835 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "director.h"
+
+#include "md5.h"
+#include "list.h"
+#include "event.h"
+#include "scope.h"
+#include "timer.h"
+#include "buffer.h"
+#include "listener.h"
+#include "resolver.h"
+#include "allocator.h"
+#include "estringlist.h"
+
+#include <stdio.h> // fprintf, printf
+#include <stdlib.h> // exit
+
+
+// each backend owns this many points on the hash ring
+static const uint pointsPerBackend = 64;
+// seconds between health checks
+static const uint probeInterval = 10;
+// a backend that hasn't greeted within this many seconds is down
+static const uint probeTimeout = 5;
+// clients that haven't logged in after this many seconds are dropped
+static const uint loginTimeout = 120;
+// the longest line or literal accepted before login
+static const uint maxLength = 16384;
+
+
+class Backend
+    : public Garbage
+{
+public:
+    Backend( const Endpoint & e )
+        : Garbage(), endpoint( e ), healthy( true ), probe( 0 )
+    {}
+
+    Endpoint endpoint;
+    bool healthy;
+    DirectorProbe * probe;
+
+    void setHealthy( bool );
+};
+
+
+/*! Records whether this backend is \a up, and mentions changes. */
+
+void Backend::setHealthy( bool up )
+{
+    if ( up == healthy )
+        return;
+    healthy = up;
+    printf( "Backend %s is %s\n", endpoint.string().cstr(),
+            up ? "up" : "down" );
+    fflush( stdout );
+}
+
+
+class RingPoint
+    : public Garbage
+{
+public:
+    RingPoint( uint p, Backend * be ): Garbage(), h( p ), b( be ) {}
+
+    uint h;
+    Backend * b;
+};
+
+
+static bool pop = false;
+static List<Backend> * backends = 0;
+static List<RingPoint> * ring = 0;
+
+
+/*  Returns a 32-bit hash of \a s, taken from its MD5 digest so that
+    every director process agrees on it.
+*/
+
+static uint hashOf( const EString & s )
+{
+    EString h = MD5::hash( s );
+    return ( (uint)(unsigned char)h[0] << 24 ) |
+        ( (uint)(unsigned char)h[1] << 16 ) |
+        ( (uint)(unsigned char)h[2] << 8 ) |
+        (uint)(unsigned char)h[3];
+}
+
+
+/*  Returns the backend for \a login: the owner of the first point on
+    the ring at or after the login's hash, skipping backends that are
+    down. If all are down, returns the one that would be picked if all
+    were up.
+
+    Adding or removing a backend moves only the users whose points it
+    owns, so most users keep their warm caches.
+*/
+
+static Backend * pick( const EString & login )
+{
+    uint h = hashOf( login.lower() );
+    List<RingPoint>::Iterator i( ring );
+    while ( i && i->h < h )
+        ++i;
+    Backend * natural = 0;
+    uint n = ring->count();
+    while ( n ) {
+        if ( !i )
+            i = ring->first();
+        if ( !natural )
+            natural = i->b;
+        if ( i->b->healthy )
+            return i->b;
+        ++i;
+        n--;
+    }
+    return natural;
+}
+
+
+/*  Splits the part \a s of an IMAP command line into words, appending
+    them to \a words. Atoms and quoted strings are supported. If \a s
+    ends with a literal, \a literal is set to its length, \a more is
+    set to true and \a sync is set to true unless it's a LITERAL+
+    literal. Returns false in case of syntax errors.
+*/
+
+static bool tokenize( const EString & s, EStringList * words,
+                      uint * literal, bool * more, bool * sync )
+{
+    *more = false;
+    uint i = 0;
+    while ( i < s.length() ) {
+        if ( s[i] == ' ' ) {
+            i++;
+        }
+        else if ( s[i] == '"' ) {
+            EString w;
+            uint j = i + 1;
+            while ( j < s.length() && s[j] != '"' ) {
+                if ( s[j] == '\\' && j + 1 < s.length() )
+                    j++;
+                w.append( s[j] );
+                j++;
+            }
+            if ( j >= s.length() )
+                return false;
+            words->append( w );
+            i = j + 1;
+        }
+        else if ( s[i] == '{' ) {
+            uint j = i + 1;
+            while ( j < s.length() && s[j] >= '0' && s[j] <= '9' )
+                j++;
+            bool ok = false;
+            *literal = s.mid( i + 1, j - i - 1 ).number( &ok );
+            *sync = true;
+            if ( j < s.length() && s[j] == '+' ) {
+                *sync = false;
+                j++;
+            }
+            if ( !ok || j + 1 != s.length() || s[j] != '}' )
+                return false;
+            *more = true;
+            i = j + 1;
+        }
+        else {
+            uint j = i;
+            while ( j < s.length() && s[j] != ' ' )
+                j++;
+            words->append( s.mid( i, j - i ) );
+            i = j;
+        }
+    }
+    return true;
+}
+
+
+/*  Returns \a s as an IMAP astring, using a LITERAL+ literal only if
+    a quoted string won't do.
+*/
+
+static EString astring( const EString & s )
+{
+    if ( !s.isEmpty() && s.boring() )
+        return s;
+    if ( s.find( '\r' ) < 0 && s.find( '\n' ) < 0 && s.find( '\0' ) < 0 )
+        return s.quoted();
+    return "{" + fn( s.length() ) + "+}\r\n" + s;
+}
+
+
+class DirectorData
+    : public Garbage
+{
+public:
+    DirectorData()
+        : server( 0 ), client( 0 ), backend( 0 ),
+          state( Parsing ), literal( 0 ), more( false ), sasl( false ),
+          greeted( false ), attempts( 0 )
+    {}
+
+    DirectorServer * server;
+    DirectorClient * client;
+    Backend * backend;
+
+    enum State { Parsing, Connecting, Spliced };
+    State state;
+
+    EStringList words;
+    uint literal;
+    bool more;
+    bool sasl;
+    EString tag;
+
+    EString login;
+    EString user;
+    EString password;
+    EString command;
+    EString pending;
+    bool greeted;
+    uint attempts;
+
+    void splice();
+    void retry( DirectorClient * );
+};
+
+
+/*! Starts forwarding everything in both directions: the data the
+    client sent after logging in, and whatever the backend has sent
+    after its response.
+*/
+
+void DirectorData::splice()
+{
+    state = Spliced;
+    server->setTimeout( 0 );
+    client->setTimeout( 0 );
+    if ( !pending.isEmpty() )
+        client->enqueue( pending );
+    pending.truncate();
+    Buffer * r = client->readBuffer();
+    if ( r->size() ) {
+        server->enqueue( r->string( r->size() ) );
+        r->remove( r->size() );
+    }
+}
+
+
+/*! Marks the backend that \a failed was talking to as down, and tries
+    the next one, unless all have been tried. In that case, the client
+    is told that no server is available.
+*/
+
+void DirectorData::retry( DirectorClient * failed )
+{
+    if ( failed != client || state != Connecting )
+        return;
+    backend->setHealthy( false );
+    failed->setState( Connection::Closing );
+    greeted = false;
+    attempts++;
+    if ( attempts < backends->count() ) {
+        backend = pick( login );
+        client = new DirectorClient( this );
+        return;
+    }
+    if ( ::pop )
+        server->enqueue( "-ERR [SYS/TEMP] No server available\r\n" );
+    else
+        server->enqueue( "* BYE [UNAVAILABLE] No server available\r\n" );
+    server->setState( Connection::Closing );
+}
+
+
+/*! \class DirectorServer director.h
+
+    The DirectorServer class provides the client-facing side of the
+    director, a proxy which sends all of a user's IMAP or POP
+    connections to the same backend server, so that each user's
+    caches are warm on one server instead of cold on all.
+
+    Like RecorderServer, it relays bytes between the client and a
+    server. Before it can do that, it answers the client itself until
+    the client logs in (using LOGIN or AUTHENTICATE PLAIN for IMAP,
+    USER and PASS for POP), picks a backend by consistent hashing of
+    the login, and repeats the login to that backend. After that it
+    relays everything unchanged, including the backend's response to
+    the login.
+*/
+
+
+/*! Constructs a DirectorServer answering on socket \a fd. */
+
+DirectorServer::DirectorServer( int fd )
+    : Connection( fd, Connection::Pipe ),
+      d( new DirectorData )
+{
+    d->server = this;
+    setTimeoutAfter( loginTimeout );
+    EventLoop::global()->addConnection( this );
+    if ( ::pop )
+        enqueue( "+OK Archiveopteryx director ready\r\n" );
+    else
+        enqueue( "* OK [CAPABILITY IMAP4rev1 LITERAL+ SASL-IR AUTH=PLAIN "
+                 "ID] Archiveopteryx director ready\r\n" );
+}
+
+
+void DirectorServer::react( Event e )
+{
+    Buffer * r = readBuffer();
+    switch( e ) {
+    case Read:
+        if ( d->state == DirectorData::Spliced ) {
+            d->client->enqueue( r->string( r->size() ) );
+            r->remove( r->size() );
+        }
+        else if ( d->state == DirectorData::Connecting ) {
+            d->pending.append( r->string( r->size() ) );
+            r->remove( r->size() );
+        }
+        else if ( ::pop ) {
+            parsePop();
+        }
+        else {
+            parseImap();
+        }
+        break;
+    case Timeout:
+        if ( ::pop )
+            enqueue( "-ERR Autologout\r\n" );
+        else
+            enqueue( "* BYE Autologout\r\n" );
+        setState( Closing );
+        if ( d->client )
+            d->client->setState( Closing );
+        break;
+    case Connect:
+        break;
+    case Error:
+    case Close:
+    case Shutdown:
+        if ( d->client )
+            d->client->setState( Closing );
+        setState( Closing );
+        break;
+    }
+}
+
+
+/*! Parses and answers the IMAP commands the client sends before it
+    logs in, and calls login() when it does.
+*/
+
+void DirectorServer::parseImap()
+{
+    Buffer * r = readBuffer();
+    while ( d->state == DirectorData::Parsing && state() == Connected ) {
+        if ( d->more && d->literal ) {
+            if ( r->size() < d->literal )
+                return;
+            d->words.append( r->string( d->literal ) );
+            r->remove( d->literal );
+            d->literal = 0;
+        }
+
+        EString * l = r->removeLine( maxLength );
+        if ( !l ) {
+            if ( r->size() >= maxLength ) {
+                enqueue( "* BYE Line too long\r\n" );
+                setState( Closing );
+            }
+            return;
+        }
+
+        if ( d->sasl ) {
+            // the client's response to our empty SASL challenge
+            d->sasl = false;
+            if ( *l == "*" ) {
+                enqueue( d->tag + " BAD Authentication cancelled\r\n" );
+                continue;
+            }
+            d->words.append( *l );
+        }
+        else {
+            bool sync = false;
+            if ( !tokenize( *l, &d->words, &d->literal, &d->more, &sync ) ) {
+                EString tag( "*" );
+                if ( !d->words.isEmpty() )
+                    tag = *d->words.first();
+                enqueue( tag + " BAD Syntax error\r\n" );
+                d->words.clear();
+                d->more = false;
+                continue;
+            }
+            if ( d->more ) {
+                if ( d->literal > maxLength ) {
+                    enqueue( "* BYE Literal too long\r\n" );
+                    setState( Closing );
+                    return;
+                }
+                if ( sync )
+                    enqueue( "+ Go ahead\r\n" );
+                continue;
+            }
+        }
+
+        EStringList w( d->words );
+        d->words.clear();
+        if ( w.count() < 2 ) {
+            enqueue( "* BAD Syntax error\r\n" );
+            continue;
+        }
+        EStringList::Iterator a( w );
+        d->tag = *a;
+        ++a;
+        EString c = a->lower();
+        ++a;
+
+        if ( c == "capability" ) {
+            enqueue( "* CAPABILITY IMAP4rev1 LITERAL+ SASL-IR AUTH=PLAIN "
+                     "ID\r\n" + d->tag + " OK done\r\n" );
+        }
+        else if ( c == "noop" ) {
+            enqueue( d->tag + " OK done\r\n" );
+        }
+        else if ( c == "id" ) {
+            enqueue( "* ID NIL\r\n" + d->tag + " OK done\r\n" );
+        }
+        else if ( c == "logout" ) {
+            enqueue( "* BYE Logging out\r\n" + d->tag + " OK done\r\n" );
+            setState( Closing );
+        }
+        else if ( c == "login" && w.count() == 4 ) {
+            EString user = *a;
+            ++a;
+            d->command = d->tag + " LOGIN " + astring( user ) + " " +
+                         astring( *a ) + "\r\n";
+            login( user );
+        }
+        else if ( c == "authenticate" && w.count() >= 3 ) {
+            if ( a->lower() != "plain" ) {
+                enqueue( d->tag + " NO Only PLAIN is supported\r\n" );
+                continue;
+            }
+            ++a;
+            if ( !a ) {
+                // ask for the response, and treat it as the fourth word
+                d->sasl = true;
+                EStringList::Iterator i( w );
+                while ( i ) {
+                    d->words.append( *i );
+                    ++i;
+                }
+                enqueue( "+ \r\n" );
+                continue;
+            }
+            EString r64 = *a;
+            EStringList * parts = EStringList::split( 0, r64.de64() );
+            if ( parts->count() != 3 || r64 == "=" ) {
+                enqueue( d->tag + " BAD Malformed PLAIN response\r\n" );
+                continue;
+            }
+            EStringList::Iterator part( parts );
+            EString user = *part;
+            ++part;
+            if ( user.isEmpty() )
+                user = *part;
+            d->command = d->tag + " AUTHENTICATE PLAIN " + r64 + "\r\n";
+            login( user );
+        }
+        else {
+            enqueue( d->tag + " BAD Not logged in\r\n" );
+        }
+    }
+}
+
+
+/*! Parses and answers the POP commands the client sends before it
+    logs in, and calls login() when it does.
+*/
+
+void DirectorServer::parsePop()
+{
+    Buffer * r = readBuffer();
+    while ( d->state == DirectorData::Parsing && state() == Connected ) {
+        EString * l = r->removeLine( maxLength );
+        if ( !l ) {
+            if ( r->size() >= maxLength ) {
+                enqueue( "-ERR Line too long\r\n" );
+                setState( Closing );
+            }
+            return;
+        }
+
+        EString c = l->section( " ", 1 ).lower();
+        EString arg;
+        int sp = l->find( ' ' );
+        if ( sp > 0 )
+            arg = l->mid( sp + 1 );
+
+        if ( c == "capa" ) {
+            enqueue( "+OK Capabilities\r\nUSER\r\n.\r\n" );
+        }
+        else if ( c == "user" && !arg.isEmpty() ) {
+            d->user = arg;
+            enqueue( "+OK Send PASS\r\n" );
+        }
+        else if ( c == "pass" && !d->user.isEmpty() ) {
+            d->password = arg;
+            login( d->user );
+        }
+        else if ( c == "quit" ) {
+            enqueue( "+OK Bye\r\n" );
+            setState( Closing );
+        }
+        else {
+            enqueue( "-ERR Not logged in\r\n" );
+        }
+    }
+}
+
+
+/*! Picks the backend for \a user and connects to it. Anything the
+    client sends from now on is held until the login has been
+    repeated to the backend.
+*/
+
+void DirectorServer::login( const EString & user )
+{
+    d->login = user;
+    d->state = DirectorData::Connecting;
+    Buffer * r = readBuffer();
+    d->pending = r->string( r->size() );
+    r->remove( r->size() );
+    d->backend = pick( user );
+    d->client = new DirectorClient( d );
+}
+
+
+/*! \class DirectorClient director.h
+
+    The DirectorClient class provides the backend-facing side of the
+    director. It swallows the backend's greeting, repeats the client's
+    login, and then relays data between the backend and its
+    DirectorServer.
+*/
+
+
+/*! Constructs a client connection to the backend chosen for \a sd. */
+
+DirectorClient::DirectorClient( DirectorData * sd )
+    : Connection(), d( sd )
+{
+    connect( d->backend->endpoint );
+    setTimeoutAfter( loginTimeout );
+    EventLoop::global()->addConnection( this );
+}
+
+
+void DirectorClient::react( Event e )
+{
+    Buffer * r = readBuffer();
+    switch( e ) {
+    case Read:
+        if ( d->client != this ) {
+            // a connection we gave up on
+        }
+        else if ( d->state == DirectorData::Spliced ) {
+            d->server->enqueue( r->string( r->size() ) );
+            r->remove( r->size() );
+        }
+        else {
+            greet();
+        }
+        break;
+    case Connect:
+        break;
+    case Error:
+    case Timeout:
+        if ( d->client == this && d->state == DirectorData::Connecting )
+            d->retry( this );
+        setState( Closing );
+        break;
+    case Close:
+    case Shutdown:
+        if ( d->client == this && d->state == DirectorData::Connecting &&
+             !d->greeted ) {
+            d->retry( this );
+        }
+        else if ( d->client == this ) {
+            d->server->setState( Closing );
+        }
+        setState( Closing );
+        break;
+    }
+}
+
+
+/*! Reads the backend's greeting and its response to USER, sends the
+    login, and splices the connections.
+*/
+
+void DirectorClient::greet()
+{
+    Buffer * r = readBuffer();
+    while ( d->state == DirectorData::Connecting ) {
+        EString * l = r->removeLine();
+        if ( !l )
+            return;
+
+        if ( !d->greeted ) {
+            if ( !l->startsWith( ::pop ? "+OK" : "* OK" ) ) {
+                d->retry( this );
+                return;
+            }
+            d->greeted = true;
+            if ( ::pop ) {
+                enqueue( "USER " + d->user + "\r\n" );
+            }
+            else {
+                enqueue( d->command );
+                d->splice();
+            }
+        }
+        else if ( l->startsWith( "+OK" ) ) {
+            enqueue( "PASS " + d->password + "\r\n" );
+            d->splice();
+        }
+        else {
+            // the backend doesn't like the user name
+            d->server->enqueue( *l + "\r\n" );
+            d->server->setState( Closing );
+            setState( Closing );
+            return;
+        }
+    }
+}
+
+
+/*! \class DirectorProbe director.h
+
+    The DirectorProbe class checks that a backend is up: it connects,
+    and considers the backend healthy if it sends a greeting within a
+    few seconds. The director doesn't send users to backends that are
+    down.
+*/
+
+
+/*! Constructs a DirectorProbe for \a backend. */
+
+DirectorProbe::DirectorProbe( Backend * backend )
+    : Connection(), b( backend )
+{
+    b->probe = this;
+    connect( b->endpoint );
+    setTimeoutAfter( probeTimeout );
+    EventLoop::global()->addConnection( this );
+}
+
+
+void DirectorProbe::react( Event e )
+{
+    if ( b->probe != this ) {
+        setState( Closing );
+        return;
+    }
+
+    EString * l = 0;
+    switch( e ) {
+    case Connect:
+        return;
+    case Read:
+        l = readBuffer()->removeLine();
+        if ( !l )
+            return;
+        b->setHealthy( l->startsWith( ::pop ? "+OK" : "* OK" ) );
+        break;
+    case Error:
+    case Timeout:
+    case Close:
+    case Shutdown:
+        b->setHealthy( false );
+        break;
+    }
+    b->probe = 0;
+    setState( Closing );
+}
+
+
+class HealthChecker
+    : public EventHandler
+{
+public:
+    HealthChecker(): EventHandler() {
+        Timer * t = new Timer( this, probeInterval );
+        t->setRepeating( true );
+        execute();
+    }
+
+    void execute() {
+        List<Backend>::Iterator i( backends );
+        while ( i ) {
+            if ( !i->probe )
+                (void)new DirectorProbe( i );
+            ++i;
+        }
+    }
+};
+
+
+/*  Parses \a s as address:port and adds the backend, or returns false
+    if that isn't possible.
+*/
+
+static bool addBackend( const EString & s )
+{
+    int colon = -1;
+    int i = s.find( ':' );
+    while ( i >= 0 ) {
+        colon = i;
+        i = s.find( ':', i + 1 );
+    }
+    if ( colon <= 0 )
+        return false;
+    EString address = s.mid( 0, colon );
+    if ( address.startsWith( "[" ) && address.endsWith( "]" ) )
+        address = address.mid( 1, address.length() - 2 );
+    bool ok = false;
+    uint port = s.mid( colon + 1 ).number( &ok );
+    if ( !ok || !port )
+        return false;
+
+    EStringList l = Resolver::resolve( address );
+    if ( l.isEmpty() )
+        return false;
+    Endpoint e( *l.first(), port );
+    if ( !e.valid() )
+        return false;
+
+    Backend * b = new Backend( e );
+    backends->append( b );
+    uint n = 0;
+    while ( n < pointsPerBackend ) {
+        RingPoint * p = new RingPoint( hashOf( e.string() + "#" + fn( n ) ),
+                                       b );
+        List<RingPoint>::Iterator it( ring );
+        while ( it && it->h < p->h )
+            ++it;
+        ring->insert( it, p );
+        n++;
+    }
+    return true;
+}
+
+
+int main( int argc, char ** argv )
+{
+    Scope global;
+    EventLoop::setup();
+
+    backends = new List<Backend>;
+    Allocator::addEternal( backends, "director backends" );
+    ring = new List<RingPoint>;
+    Allocator::addEternal( ring, "director hash ring" );
+
+    EString error;
+    bool ok = true;
+    if ( argc < 4 ) {
+        error = "Wrong number of arguments";
+        ok = false;
+    }
+
+    if ( ok ) {
+        EString p = EString( argv[1] ).lower();
+        if ( p == "pop" || p == "pop3" )
+            ::pop = true;
+        else if ( p != "imap" )
+            error = "Protocol must be imap or pop";
+        ok = error.isEmpty();
+    }
+
+    uint port = 0;
+    if ( ok ) {
+        port = EString( argv[2] ).number( &ok );
+        if ( !ok )
+            error = "Could not parse own port number";
+    }
+
+    int i = 3;
+    while ( ok && i < argc ) {
+        ok = addBackend( argv[i] );
+        if ( !ok )
+            error = EString( "Cannot use backend " ) + argv[i];
+        i++;
+    }
+
+    if ( ok ) {
+        Listener<DirectorServer> * l4
+            = new Listener<DirectorServer>( Endpoint( "0.0.0.0", port ),
+                                            "director/4" );
+        Allocator::addEternal( l4, "director listener" );
+        Listener<DirectorServer> * l6
+            = new Listener<DirectorServer>( Endpoint( "::", port ),
+                                            "director/6" );
+        Allocator::addEternal( l6, "director listener" );
+
+        if ( l4->state() != Connection::Listening &&
+             l6->state() != Connection::Listening ) {
+            error = "Could not listen for connections";
+            ok = false;
+        }
+    }
+
+    if ( !ok ) {
+        fprintf( stderr,
+                 "Error: %s\n"
+                 "Usage: director protocol port address:port ...\n"
+                 "       Protocol: imap or pop.\n"
+                 "       Port: The director's own port.\n"
+                 "       Address:port: A backend server. Give one or "
+                 "more.\n",
+                 error.cstr() );
+        exit( 1 );
+    }
+
+    Allocator::addEternal( new HealthChecker, "director health checks" );
+    printf( "Directing %s users to %d backends\n",
+            ::pop ? "POP" : "IMAP", backends->count() );
+
+    global.setLog( new Log );
+    EventLoop::global()->start();
+}
@@ -0,0 +1,56 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef DIRECTOR_H
+#define DIRECTOR_H
+
+#include "connection.h"
+
+#include "endpoint.h"
+
+
+class DirectorServer
+    : public Connection
+{
+public:
+    DirectorServer( int );
+
+    void react( Event );
+
+private:
+    class DirectorData * d;
+
+    void parseImap();
+    void parsePop();
+    void login( const EString & );
+};
+
+
+class DirectorClient
+    : public Connection
+{
+public:
+    DirectorClient( class DirectorData * );
+
+    void react( Event );
+
+private:
+    class DirectorData * d;
+
+    void greet();
+};
+
+
+class DirectorProbe
+    : public Connection
+{
+public:
+    DirectorProbe( class Backend * );
+
+    void react( Event );
+
+private:
+    class Backend * b;
+};
+
+
+#endif
@@ -5,6 +5,7 @@
 #include "estring.h"
 #include "ustring.h"
 #include "estringlist.h"
+#include "allocator.h"
 
 #include "cp.h"
 #include "koi.h"
@@ -24,6 +25,9 @@
 #include "euckr.h"
 #include "gbk.h"
 
+// strcmp
+#include <string.h>
+
 
 /*! \class Codec codec.h
     The Codec class describes a mapping between UString and anything else.
@@ -226,14 +230,22 @@ Codec * Codec::byName( const EString & s )
 
     EString name = s.lower();
 
-    int i = 0;
-    // next loop can be replaced by a binary search - codecaliases is
-    // sorted by alias.
-    while ( codecaliases[i].alias &&
-            name != codecaliases[i].alias )
-        i++;
-    if ( codecaliases[i].alias )
-        name = codecaliases[i].name;
+    // codecaliases is sorted by alias, so we can binary search
+    int b = 0;
+    int e = sizeof( codecaliases ) / sizeof( codecaliases[0] ) - 1;
+    const char * n = name.cstr();
+    while ( b < e ) {
+        int m = ( b + e ) / 2;
+        int c = strcmp( n, codecaliases[m].alias );
+        if ( c == 0 )
+            b = e = m;
+        else if ( c < 0 )
+            e = m;
+        else
+            b = m + 1;
+    }
+    if ( codecaliases[b].alias && name == codecaliases[b].alias )
+        name = codecaliases[b].name;
     else if ( name == "macroman" )
         name = "macintosh";
 
@@ -244,7 +256,7 @@ Codec * Codec::byName( const EString & s )
         return codec;
 
     // some people use "iso 8859 1", "iso_8859-1", etc.
-    i = 0;
+    int i = 0;
     name = "";
     while ( i < (int)s.length() ) {
         if ( s[i] == '_' || s[i] == ' ' )
@@ -485,6 +497,78 @@ Codec * Codec::byString( const EString & s )
 }
 
 
+class TableCodecData
+    : public Garbage
+{
+public:
+    TableCodecData( const uint * );
+
+    static TableCodecData * find( const uint * );
+
+    const uint * table;
+    bool ascii;
+    ushort * pages[256];
+    TableCodecData * next;
+};
+
+
+static TableCodecData * tableCodecs = 0;
+
+
+/*! Builds the reverse of \a t: pages[cp>>8][cp&255] is one more than
+    the byte that maps to cp, or 0 if no byte does. The lowest such
+    byte is used, as the linear search we used to do would.
+*/
+
+TableCodecData::TableCodecData( const uint * t )
+    : table( t ), ascii( true ), next( 0 )
+{
+    uint i = 0;
+    while ( i < 256 )
+        pages[i++] = 0;
+    i = 256;
+    while ( i > 0 ) {
+        i--;
+        uint cp = t[i];
+        if ( i && i < 128 && cp != i )
+            ascii = false;
+        if ( cp >= 0x10000 )
+            continue;
+        ushort * & p = pages[cp >> 8];
+        if ( !p ) {
+            p = (ushort*)Allocator::alloc( 256 * sizeof( ushort ), 0 );
+            uint j = 0;
+            while ( j < 256 )
+                p[j++] = 0;
+        }
+        p[cp & 255] = i + 1;
+    }
+}
+
+
+/*! Returns the shared reverse table for \a t, creating it if
+    necessary. There are few tables, so a list is good enough.
+*/
+
+TableCodecData * TableCodecData::find( const uint * t )
+{
+    TableCodecData * d = tableCodecs;
+    while ( d && d->table != t && d->next )
+        d = d->next;
+    if ( d && d->table == t )
+        return d;
+    TableCodecData * n = new TableCodecData( t );
+    if ( d ) {
+        d->next = n;
+    }
+    else {
+        tableCodecs = n;
+        Allocator::addEternal( tableCodecs, "table codec reverse maps" );
+    }
+    return n;
+}
+
+
 /*! \class TableCodec codec.h
   The TableCodec provides a codec for simple 256-entry character sets.
 
@@ -496,8 +580,8 @@ Codec * Codec::byString( const EString & s )
   Codecs which map 0x80-0x9F to U+0080-0x009F consider any strings
   which contain 0x80-0x9F badly formed.
 
-  At the moment, the fromUnicode function is rather slow. This may
-  need fixing later.
+  fromUnicode() uses a two-level reverse table, which is built the
+  first time each table is used and shared by all codecs using it.
 */
 
 
@@ -514,15 +598,17 @@ Codec * Codec::byString( const EString & s )
 
 EString TableCodec::fromUnicode( const UString & u )
 {
+    if ( !r )
+        r = TableCodecData::find( t );
+
     EString s;
     s.reserve( u.length() );
     uint i = 0;
     while ( i < u.length() ) {
-        uint j = 0;
-        while ( j < 256 && t[j] != u[i] )
-            j++;
-        if ( j < 256 )
-            s.append( (char)j );
+        uint c = u[i];
+        ushort * p = c < 0x10000 ? r->pages[c >> 8] : 0;
+        if ( p && p[c & 255] )
+            s.append( (char)( p[c & 255] - 1 ) );
         else
             s.append( '?' );
         i++;
@@ -536,11 +622,24 @@ EString TableCodec::fromUnicode( const UString & u )
 
 UString TableCodec::toUnicode( const EString & s )
 {
+    if ( !r )
+        r = TableCodecData::find( t );
+
     UString u;
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
         uint c = s[i];
+        if ( r->ascii && c > 0 && c < 0x80 ) {
+            // most of the text is usually ASCII, which we copy as is
+            uint n = i + 1;
+            while ( s[n] > 0 && s[n] < 0x80 )
+                n++;
+            mangleTrailingSurrogate( u );
+            u.append( s.data() + i, n - i );
+            i = n;
+            continue;
+        }
         if ( !t[c] ) {
             recordError( i, c );
             u.append( 0xFFFD );
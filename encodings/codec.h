@@ -55,7 +55,7 @@ private:
 class TableCodec: public Codec {
 protected:
     TableCodec( const uint * table, const char * cs )
-        : Codec( cs ), t( table ) {}
+        : Codec( cs ), t( table ), r( 0 ) {}
 
 public:
     EString fromUnicode( const UString & );
@@ -63,6 +63,7 @@ public:
 
 private:
     const uint * t;
+    class TableCodecData * r;
 };
 
 
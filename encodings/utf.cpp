@@ -5,6 +5,9 @@
 #include "estring.h"
 #include "ustring.h"
 
+// memcpy
+#include <string.h>
+
 
 /*! \class Utf8Codec utf.h
     The Utf8Codec class implements the codec described in RFC 2279
@@ -118,13 +121,30 @@ UString Utf8Codec::toUnicode( const EString & s )
 {
     UString u;
     u.reserve( s.length() );
+    const char * p = s.data();
+    uint l = s.length();
     uint i = 0;
-    while ( i < s.length() ) {
+    while ( i < l ) {
         int c = 0;
         if ( s[i] < 0x80 ) {
             // 0000 0000-0000 007F   0xxxxxxx
-            c = s[i];
-            i += 1;
+
+            // most text is ASCII, so we find the end of the ASCII
+            // run four bytes at a time, and append it all at once
+            uint j = i + 1;
+            while ( j + 4 <= l ) {
+                uint w;
+                memcpy( &w, p + j, 4 );
+                if ( w & 0x80808080 )
+                    break;
+                j += 4;
+            }
+            while ( j < l && s[j] < 0x80 )
+                j++;
+            mangleTrailingSurrogate( u );
+            u.append( p + i, j - i );
+            i = j;
+            continue;
         }
         else if ( (s[i] & 0xe0) == 0xc0 && ahead( s, i, 1 ) ) {
             // 0000 0080-0000 07FF   110xxxxx 10xxxxxx
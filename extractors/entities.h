@@ -266,4 +266,69 @@ const struct entity {
 const int ents = sizeof( entities ) / sizeof( entities[0] );
 
 
+/* A perfect hash of the entity names above, generated from that list.
+   entityHash( name, 0 ) selects one of the entityDisplacements, and
+   entityHash( name, displacement ) % entitySlots is the index in
+   entityIndex of the name's entity, or of no entity (-1) if the name
+   is not an entity name. The hash is 32-bit FNV-1a, seeded with the
+   displacement. */
+
+const unsigned int entityBuckets = 64;
+const unsigned char entityDisplacements[] = {
+      1,   3,   4,   2,   1,   9,   1,   3,   1,   6,   2,   1,
+      4,   2,   1,   1,   1,   4,   2,   4,   6,   1,   3,   3,
+      1,   2,   2,   1,   1,   1,   2,   1,   6,   1,   5,   4,
+      7,   1,   4,   1,   1,   3,   7,   1,   9,   2,   1,   2,
+     10,   6,   3,   4,   2,  11,  13,   2,   3,   0,   3,   5,
+      1,   3,   3,   3,
+};
+
+const unsigned int entitySlots = 512;
+const short entityIndex[] = {
+     106,   75,  143,   -1,   -1,   -1,  150,   -1,   -1,   40,   -1,   -1,
+      -1,  179,   -1,  111,  114,  144,   -1,   -1,   49,   -1,   -1,   68,
+     186,   32,  212,   -1,  249,  162,   -1,  119,  147,   -1,   -1,    0,
+     187,  146,   90,   -1,  178,   82,   -1,  117,   -1,   39,  172,   -1,
+     221,  174,   10,   59,   89,   -1,   -1,   -1,   -1,  214,  220,  157,
+       7,  206,  200,   -1,   -1,   -1,   15,  203,   74,   -1,   -1,  210,
+     197,  236,  213,   -1,   -1,   -1,   -1,   -1,  251,   96,   -1,   -1,
+      41,   -1,   16,   -1,    4,   -1,   -1,  109,  233,   -1,  208,   53,
+      -1,   -1,  100,   -1,   -1,   -1,   -1,  237,   50,   -1,  112,   20,
+     104,   33,  163,   -1,   -1,   14,   -1,   -1,   -1,   -1,  102,   -1,
+      78,  175,   11,  113,  155,   -1,   -1,  223,  226,   69,   -1,  240,
+     121,   91,   -1,   -1,  168,   -1,   -1,   -1,  151,   -1,   46,   -1,
+      -1,   -1,   -1,   36,   -1,   21,   -1,  105,  164,   -1,   -1,  189,
+      43,  153,   -1,  148,  201,   -1,  215,   62,  139,  124,   -1,   86,
+     128,   -1,   -1,   -1,  244,    1,   -1,   -1,  232,   -1,   -1,   -1,
+      31,   84,   95,   35,   65,   -1,   81,   -1,   -1,   -1,   -1,  242,
+      12,   -1,   -1,   -1,   -1,   76,   -1,   -1,   77,  204,  180,   57,
+      -1,  182,   -1,   26,   -1,  196,  125,  166,   -1,  159,   -1,   -1,
+      -1,   -1,  209,   -1,   70,   38,   -1,   -1,   27,   -1,   -1,  131,
+     132,   72,   -1,   -1,   -1,  222,   -1,    3,   -1,  152,   58,   37,
+      -1,  185,   -1,   -1,  167,  156,  127,   13,   97,  205,   -1,   -1,
+      -1,   52,  181,  110,   64,   -1,   -1,   54,   23,   19,   -1,  199,
+      -1,   -1,   -1,  177,   -1,   -1,  227,   61,   -1,  241,   -1,  130,
+      -1,   -1,  248,  170,   29,   25,  122,   79,  115,  141,   34,   -1,
+      98,  158,  118,   -1,   -1,   56,   -1,   -1,   92,   30,   -1,  234,
+      28,   -1,   -1,  133,   -1,   -1,   -1,   -1,   -1,  235,    8,  219,
+      17,  218,  137,  225,   -1,  145,  188,   -1,   87,   -1,   -1,   -1,
+       2,   99,   -1,   22,   -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+      -1,   -1,   -1,   -1,   -1,   -1,    9,   -1,   -1,   -1,    5,   -1,
+      -1,   -1,  246,  116,   -1,   -1,   18,   -1,  165,   -1,  202,   66,
+      -1,   -1,   -1,   48,   -1,  101,   -1,  108,  129,   -1,   -1,   -1,
+      -1,   -1,   -1,   -1,   -1,  173,   80,   -1,   88,   -1,   -1,  216,
+      -1,  183,  247,  140,    6,   -1,  138,   -1,  228,   -1,   -1,   -1,
+      -1,   -1,   -1,  224,   -1,   -1,   93,   -1,   -1,   -1,   -1,   -1,
+     136,  194,   -1,  239,   -1,  231,   42,   -1,   -1,   -1,  120,   -1,
+      60,  193,   -1,  123,   -1,  135,   67,  126,   55,   -1,   -1,  149,
+      73,   -1,   -1,   -1,   -1,   -1,   -1,   -1,  229,  238,   -1,   94,
+      -1,   -1,  192,  134,   -1,   -1,   -1,   44,   -1,   24,   -1,  207,
+     160,   85,   -1,   63,   83,   -1,  161,  176,   -1,   -1,   -1,   -1,
+      -1,   71,   -1,  107,  250,   -1,   -1,   -1,   45,   -1,   -1,   -1,
+      -1,  142,  169,  243,   -1,  245,  217,  191,   51,  211,  103,  195,
+      -1,   -1,  190,  184,   -1,  154,   -1,  171,   -1,   -1,   -1,   -1,
+      -1,  198,   -1,  230,   -1,   -1,   47,   -1,
+};
+
+
 #endif
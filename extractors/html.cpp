@@ -3,11 +3,12 @@
 #include "html.h"
 
 #include "utf.h"
-#include "codec.h"
+#include "estring.h"
 #include "ustring.h"
 #include "entities.h"
 
 #include <ctype.h>
+#include <string.h>
 
 
 /*! \class HTML html.h
@@ -17,17 +18,162 @@
 */
 
 
-/*! Returns indexable text extracted from \a h. */
+/*! Returns indexable text extracted from \a h.
+
+    This is a convenience wrapper for the UTF-8 version of asText().
+*/
 
 UString HTML::asText( const UString &h )
 {
-    UString r;
-    UString t, s, qs, a;
+    Utf8Codec c;
+    return c.toUnicode( asText( h.utf8() ) );
+}
+
+
+static uint entityHash( const char * s, uint l, uint seed )
+{
+    uint x = 2166136261u ^ seed;
+    uint i = 0;
+    while ( i < l ) {
+        x ^= (uint)(unsigned char)s[i];
+        x *= 16777619u;
+        i++;
+    }
+    return x;
+}
+
+
+/* Returns the codepoint for the HTML 4 entity whose name is the \a l
+   bytes at \a s, or -1 if there is no such entity. */
+
+static int entity( const char * s, uint l )
+{
+    uint b = entityHash( s, l, 0 ) % entityBuckets;
+    uint n = entityHash( s, l, entityDisplacements[b] ) % entitySlots;
+    int e = entityIndex[n];
+    if ( e < 0 || strncmp( entities[e].name, s, l ) ||
+         entities[e].name[l] != '\0' )
+        return -1;
+    return entities[e].chr;
+}
+
+
+/* This helper holds the output of HTML::asText(): the text so far,
+   whitespace that will be output only if more text follows, and a
+   leading surrogate that will be output only if a trailing one
+   follows. Once the text is \a max bytes long, more is ignored. */
+
+class HtmlText
+{
+public:
+    HtmlText( uint m ): high( 0 ), max( m ) {}
+
+    bool full() const {
+        return max && r.length() >= max;
+    }
+
+    void flush() {
+        if ( full() ) {
+            // as if the text had been output, in case a body tag
+            // makes room again
+            high = 0;
+            s.truncate();
+            return;
+        }
+        if ( high ) {
+            appendUtf8( 0xFFFD );
+            high = 0;
+        }
+        if ( !s.isEmpty() ) {
+            r.append( s );
+            s.truncate();
+        }
+    }
+
+    void append( char c ) {
+        flush();
+        if ( !full() )
+            r.append( c );
+    }
+
+    void append( uint c ) {
+        if ( full() ) {
+            flush();
+            return;
+        }
+        if ( c >= 0x110000 ) {
+            flush();
+            appendUtf8( 0xFFFD );
+        }
+        else if ( c >= 0xDC00 && c <= 0xDFFF ) {
+            if ( high && s.isEmpty() ) {
+                appendUtf8( ( high - 0xD800 ) * 0x400 +
+                            ( c - 0xDC00 ) + 0x10000 );
+                high = 0;
+            }
+            else {
+                flush();
+                appendUtf8( 0xFFFD );
+            }
+        }
+        else {
+            flush();
+            if ( c >= 0xD800 && c <= 0xDBFF )
+                high = c;
+            else
+                appendUtf8( c );
+        }
+    }
+
+    void appendUtf8( uint c ) {
+        if ( c < 0x80 ) {
+            r.append( (char)c );
+        }
+        else if ( c < 0x800 ) {
+            r.append( 0xc0 | ((char)(c >> 6)) );
+            r.append( 0x80 | ((char)(c & 0x3f)) );
+        }
+        else if ( c < 0x10000 ) {
+            r.append( 0xe0 | ((char)(c >> 12)) );
+            r.append( 0x80 | ((char)(c >> 6) & 0x3f) );
+            r.append( 0x80 | ((char)(c & 0x3f)) );
+        }
+        else {
+            r.append( 0xf0 | ((char)(c >> 18)) );
+            r.append( 0x80 | ((char)(c >> 12) & 0x3f) );
+            r.append( 0x80 | ((char)(c >> 6) & 0x3f) );
+            r.append( 0x80 | ((char)(c & 0x3f)) );
+        }
+    }
+
+    EString r;
+    EString s;
+    uint high;
+    uint max;
+};
+
+
+/*! Returns indexable text extracted from the UTF-8 HTML \a h, also
+    encoded as UTF-8.
+
+    This works in one pass over the bytes of \a h, and does not
+    convert either the input or the output to UString, which would
+    need four bytes per character.
+
+    If \a max is nonzero, at most \a max bytes of text are returned,
+    and once that much text follows a body tag, the rest of \a h is
+    not looked at. That's useful for callers that need only a preview.
+*/
+
+EString HTML::asText( const EString & h, uint max )
+{
+    HtmlText r( max );
+    EString t;
+    bool body = false;
     char last = 0;
     char quote = 0;
     char c;
     uint mark = 0;
-    AsciiCodec dc; // just a dummy so we can use Codec::append()
 
     int tag = 0;        /* 1 inside <...> */
     int tagname = 0;    /* 1 inside tag, before whitespace */
@@ -35,7 +181,7 @@ UString HTML::asText( const UString &h )
     int quoted = 0;     /* 1 inside <foo bar="..."> */
 
     uint i = 0;
-    while ( i < h.length() ) {
+    while ( i < h.length() && !( body && r.full() ) ) {
         /* Each case below sets i to the position of the last character
            it processed. */
         switch ( h[i] ) {
@@ -55,16 +201,17 @@ UString HTML::asText( const UString &h )
             if ( quoted )
                 goto next;
             if ( tag ) {
-                //t = t.lower();
                 if ( t == "p" ) {
-                    s.append( '\n' );
-                    s.append( '\n' );
+                    r.s.append( '\n' );
+                    r.s.append( '\n' );
                 }
                 else if ( t == "br" ) {
-                    s.append( '\n' );
+                    r.s.append( '\n' );
                 }
                 else if ( t == "body" ) {
-                    r.truncate();
+                    r.r.truncate();
+                    r.high = 0;
+                    body = true;
                 }
                 sgml = tag = 0;
             }
@@ -90,7 +237,6 @@ UString HTML::asText( const UString &h )
             } else if ( !quoted && last == '=' ) {
                 quoted = 1;
                 quote = h[i];
-                qs.truncate();
             }
             break;
 
@@ -100,10 +246,9 @@ UString HTML::asText( const UString &h )
         case '\n':
             /* Whitespace shouldn't appear in last, and we compress it
                to one space. */
-            if ( !tag && s.isEmpty() )
-                s.append( ' ' );
+            if ( !tag && r.s.isEmpty() )
+                r.s.append( ' ' );
             tagname = false;
-            a.truncate();
             i++;
             continue;
             break;
@@ -119,9 +264,7 @@ UString HTML::asText( const UString &h )
                     mark = i++;
                     while ( isdigit( h[i] ) )
                         i++;
-                    r.append( s );
-                    dc.append( r, h.mid( mark, i-mark ).number( 0 ) );
-                    s.truncate();
+                    r.append( h.mid( mark, i-mark ).number( 0 ) );
 
                     /* The terminating semicolon is required only
                        where the next character would otherwise be
@@ -135,21 +278,16 @@ UString HTML::asText( const UString &h )
                     mark = ++i;
                     while ( isxdigit( h[i] ) )
                         i++;
-                    if ( i != mark ) {
-                        r.append( s );
-                        dc.append( r, h.mid( mark, i-mark ).number( 0, 16 ) );
-                        s.truncate();
-                    }
+                    if ( i != mark )
+                        r.append( h.mid( mark, i-mark ).number( 0, 16 ) );
                     if ( h[i] != ';' )
                         i--;
                 }
                 else {
                     /* Not a reference. */
                     i++;
-                    r.append( s );
                     r.append( '&' );
                     r.append( '#' );
-                    s.truncate();
                 }
             } else if ( isalpha( c ) ) {
                 /* Entity reference: &[a-zA-Z0-9]+;? */
@@ -157,52 +295,27 @@ UString HTML::asText( const UString &h )
                 mark = i++;
                 while ( isalnum( h[i] ) )
                     i++;
-                UString ent( h.mid( mark, i-mark ) );
+                int e = entity( h.data() + mark, i - mark );
                 if ( h[i] != ';' )
                     i--;
-
-                int n = 0;
-                while ( n < ents ) {
-                    uint l = 0;
-                    bool match = true;
-                    while ( l < ent.length() ) {
-                        if ( ent[l] != entities[n].name[l] ) {
-                            match = false;
-                            break;
-                        }
-                        l++;
-                    }
-
-                    if ( match && entities[n].name[l] == '\0' ) {
-                        r.append( s );
-                        r.append( entities[n].chr );
-                        s.truncate();
-                        break;
-                    }
-
-                    n++;
-                }
+                if ( e >= 0 )
+                    r.append( (uint)e );
             }
             else {
                 /* Not a reference. */
-                r.append( s );
                 r.append( '&' );
-                s.truncate();
             }
             break;
 
     unspecial:
         default:
             if ( !tag ) {
-                r.append( s );
-                dc.append( r, h[i] );
-                s.truncate();
+                r.append( h[i] );
             } else if ( tagname ) {
-                t.append( h[i] );
-            } else if ( !quoted && h[i] == '=' ) {
-                a.truncate();
-            } else {
-                a.append( h[i] );
+                // only the names we look for above matter, and they
+                // are all shorter than this
+                if ( t.length() < 5 )
+                    t.append( h[i] );
             }
             break;
         }
@@ -212,7 +325,15 @@ UString HTML::asText( const UString &h )
         i++;
     }
 
-    dc.mangleTrailingSurrogate( r );
-    // we ignore dc.state()
-    return r;
+    if ( r.high && !r.full() )
+        r.appendUtf8( 0xFFFD );
+
+    if ( max && r.r.length() > max ) {
+        // don't cut a character in half
+        uint l = max;
+        while ( l > 0 && ( r.r[l] & 0xC0 ) == 0x80 )
+            l--;
+        r.r.truncate( l );
+    }
+    return r.r;
 }
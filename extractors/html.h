@@ -4,6 +4,7 @@
 #define HTML_H
 
 #include "ustring.h"
+#include "estring.h"
 
 
 class HTML
@@ -11,6 +12,7 @@ class HTML
 {
 public:
     static UString asText( const UString & );
+    static EString asText( const EString &, uint = 0 );
 };
 
 
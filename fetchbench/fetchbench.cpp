@@ -0,0 +1,194 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "allocator.h"
+#include "integerset.h"
+#include "message.h"
+#include "buffer.h"
+#include "fetch.h"
+#include "scope.h"
+#include "file.h"
+
+// fprintf
+#include <stdio.h>
+// exit
+#include <stdlib.h>
+// gettimeofday
+#include <sys/time.h>
+
+
+// used when no files are given: a multipart message with an
+// attached message, so that BODYSTRUCTURE has some depth.
+static const char * sample =
+    "Return-Path: <alice@example.com>\r\n"
+    "Received: from mail.example.com (mail.example.com [192.0.2.1])\r\n"
+    " by mx.example.org with ESMTP; Tue, 4 Mar 2014 10:00:00 +0100\r\n"
+    "From: Alice Example <alice@example.com>\r\n"
+    "To: Bob Example <bob@example.org>, carol@example.org\r\n"
+    "Cc: \"Dave, the Third\" <dave@example.net>\r\n"
+    "Subject: Minutes of the budget meeting\r\n"
+    "Date: Tue, 4 Mar 2014 09:59:58 +0100\r\n"
+    "Message-Id: <minutes.20140304@example.com>\r\n"
+    "In-Reply-To: <agenda.20140303@example.org>\r\n"
+    "MIME-Version: 1.0\r\n"
+    "Content-Type: multipart/mixed; boundary=\"outer\"\r\n"
+    "\r\n"
+    "--outer\r\n"
+    "Content-Type: text/plain; charset=us-ascii\r\n"
+    "\r\n"
+    "The minutes are attached, and so is the mail about the agenda.\r\n"
+    "\r\n"
+    "--outer\r\n"
+    "Content-Type: application/pdf; name=\"minutes.pdf\"\r\n"
+    "Content-Disposition: attachment; filename=\"minutes.pdf\"\r\n"
+    "Content-Transfer-Encoding: base64\r\n"
+    "\r\n"
+    "JVBERi0xLjQKJcfsj6IKNSAwIG9iago8PC9MZW5ndGggNiAwIFI+PgpzdHJlYW0K\r\n"
+    "\r\n"
+    "--outer\r\n"
+    "Content-Type: message/rfc822\r\n"
+    "\r\n"
+    "From: Bob Example <bob@example.org>\r\n"
+    "To: Alice Example <alice@example.com>\r\n"
+    "Subject: Agenda\r\n"
+    "Date: Mon, 3 Mar 2014 17:00:00 +0100\r\n"
+    "Message-Id: <agenda.20140303@example.org>\r\n"
+    "\r\n"
+    "Budget, schedule, any other business.\r\n"
+    "\r\n"
+    "--outer--\r\n";
+
+
+// the current time in microseconds
+static int64 now()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*  Appends a FETCH response for \a m to \a w, in the same way as
+    Fetch::writeFetchResponse() does for "FETCH 1:* (UID FLAGS
+    INTERNALDATE RFC822.SIZE ENVELOPE BODYSTRUCTURE)".
+*/
+
+static void respond( Buffer * w, Message * m, uint uid )
+{
+    EString r;
+    r.reserve( 1024 );
+    r.append( "* " );
+    r.appendNumber( uid );
+    r.append( " FETCH (UID " );
+    r.appendNumber( uid );
+    r.append( " FLAGS (\\Seen) INTERNALDATE " );
+    Fetch::appendInternalDate( r, m );
+    r.append( " RFC822.SIZE " );
+    r.appendNumber( m->rfc822Size() );
+    r.append( " ENVELOPE " );
+    Fetch::appendEnvelope( r, m, false );
+    r.append( " BODYSTRUCTURE " );
+    Fetch::appendBodyStructure( r, m, true, false );
+    r.append( ")\r\n" );
+    w->append( r );
+}
+
+
+int main( int ac, char ** av )
+{
+    Scope global;
+
+    uint rounds = 1000;
+    int i = 1;
+    if ( i + 1 < ac && EString( av[i] ) == "-n" ) {
+        bool ok = false;
+        rounds = EString( av[i+1] ).number( &ok );
+        if ( !ok || !rounds ) {
+            fprintf( stderr, "Usage: %s [-n rounds] [file ...]\n", av[0] );
+            exit( -1 );
+        }
+        i += 2;
+    }
+
+    List<Message> * messages = new List<Message>;
+    Allocator::addEternal( messages, "messages to fetch" );
+    if ( i >= ac ) {
+        Message * m = new Message;
+        m->parse( sample );
+        messages->append( m );
+    }
+    while ( i < ac ) {
+        File f( av[i] );
+        if ( !f.valid() ) {
+            fprintf( stderr, "Cannot read %s\n", av[i] );
+            exit( -1 );
+        }
+        Message * m = new Message;
+        m->parse( f.contents() );
+        if ( !m->valid() )
+            fprintf( stderr, "Note: %s is not a valid message\n", av[i] );
+        messages->append( m );
+        i++;
+    }
+    List<Message>::Iterator m( messages );
+    while ( m ) {
+        m->setRfc822Size( m->rfc822( false ).length() );
+        m->setInternalDate( 1393923598 );
+        ++m;
+    }
+
+    // FETCH responses, as IMAP sends them for each message
+    int64 responses = 0;
+    int64 bytes = 0;
+    int64 allocations = 0;
+    int64 elapsed = 0;
+    uint round = 0;
+    while ( round < rounds ) {
+        Buffer * w = new Buffer;
+        int64 a = Allocator::allocations();
+        int64 t = now();
+        uint uid = 0;
+        List<Message>::Iterator m( messages );
+        while ( m ) {
+            respond( w, m, ++uid );
+            ++m;
+        }
+        elapsed += now() - t;
+        allocations += Allocator::allocations() - a;
+        responses += uid;
+        bytes += w->size();
+        round++;
+        if ( Allocator::allocated() > 64 * 1024 * 1024 )
+            Allocator::free();
+    }
+
+    // the UID set sent with each query and each untagged response
+    IntegerSet s;
+    uint n = 1;
+    while ( n < 10000 ) {
+        s.add( n, n + 2 );
+        n += 5;
+    }
+    int64 sets = 0;
+    int64 setAllocations = 0;
+    round = 0;
+    while ( round < rounds ) {
+        int64 a = Allocator::allocations();
+        (void)s.set();
+        (void)s.csl();
+        setAllocations += Allocator::allocations() - a;
+        sets += 2;
+        round++;
+    }
+
+    double r = responses ? responses : 1;
+    fprintf( stdout,
+             "Built %lld FETCH responses in %.3f seconds: "
+             "%.1f microseconds each\n"
+             "Objects allocated: %lld, %.2f per response\n"
+             "Bytes per response: %.0f\n"
+             "Objects allocated per IntegerSet::set() or csl(): %.2f\n",
+             responses, (double)elapsed / 1000000, elapsed / r,
+             allocations, allocations / r, bytes / r,
+             (double)setAllocations / sets );
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include "utf.h"
 #include "imap.h"
 #include "user.h"
+#include "graph.h"
 #include "buffer.h"
 #include "mailbox.h"
 #include "integerset.h"
@@ -13,6 +14,7 @@
 #include "transaction.h"
 #include "imapsession.h"
 #include "mailboxgroup.h"
+#include "configuration.h"
 
 // Keep these alphabetical.
 #include "handlers/acl.h"
@@ -25,6 +27,7 @@
 #include "handlers/create.h"
 #include "handlers/delete.h"
 #include "handlers/enable.h"
+#include "handlers/esearch.h"
 #include "handlers/expunge.h"
 #include "handlers/fetch.h"
 #include "handlers/genurlauth.h"
@@ -78,6 +81,7 @@ public:
           transaction( 0 )
     {
         (void)::gettimeofday( &started, 0 );
+        received = started;
     }
 
     EString tag;
@@ -101,6 +105,7 @@ public:
 
     uint permittedStates;
 
+    struct timeval received;
     struct timeval started;
 
     IMAP * imap;
@@ -262,6 +267,8 @@ Command * Command::create( IMAP * imap,
             c = new GetQuotaRoot();
         else if ( n == "setquotaroot" )
             c = new SetQuotaRoot();
+        else if ( n == "esearch" && !uid )
+            c = new ESearch;
 
         if ( c ) {
             authenticated = true;
@@ -337,6 +344,7 @@ Command * Command::create( IMAP * imap,
         c->d->permittedStates |= ( 1 << IMAP::Logout );
 
     c->setLog( new Log );
+    c->log()->setLabel( "IMAP " + c->d->name );
     c->log( "IMAP Command: " + tag + " " + name );
 
     return c;
@@ -488,6 +496,22 @@ void Command::setState( State s )
             m.append( fn( ( elapsed + 499 ) / 1000 ) );
             m.append( "ms" );
             log( m, level );
+
+            long waited =
+                ( d->started.tv_sec - d->received.tv_sec ) * 1000000 +
+                ( d->started.tv_usec - d->received.tv_usec );
+            uint total = ( waited + elapsed + 499 ) / 1000;
+            EString n( d->name );
+            n.replace( " ", "-" );
+            GraphableDataSet::named( "imap-" + n + "-ms" )
+                ->addNumber( total );
+            uint slow =
+                Configuration::scalar( Configuration::SlowCommandTime );
+            if ( slow && total >= slow )
+                log( "Slow command: " + d->name + " took " + fn( total ) +
+                     "ms (waited " + fn( ( waited + 499 ) / 1000 ) +
+                     "ms, executed " + fn( ( elapsed + 499 ) / 1000 ) +
+                     "ms)", Log::Significant );
         }
         log( "Finished", Log::Debug );
         break;
@@ -558,6 +582,9 @@ uint Command::group() const
     4) STATUS, LIST. Perhaps other read-only commands that look at
        mailboxes.
 
+    5) APPEND, except when it uses CATENATE URLs. Concurrent APPENDs
+       to the same mailbox share one injection.
+
     The initial value is 0.
 */
 
@@ -1152,15 +1179,33 @@ const EString Command::following() const
 */
 
 EString Command::imapQuoted( const EString & s, const QuoteMode mode )
+{
+    EString r;
+    appendQuoted( r, s, mode );
+    return r;
+}
+
+
+/*! Appends \a s to \a r, quoted as imapQuoted() would quote it. This
+    avoids a temporary string for each item when building a long
+    response, e.g. a FETCH ENVELOPE.
+*/
+
+void Command::appendQuoted( EString & r, const EString & s,
+                            const QuoteMode mode )
 {
     // if we're asked for an nstring, NIL may do
-    if ( mode == NString && s.isEmpty() )
-        return "NIL";
+    if ( mode == NString && s.isEmpty() ) {
+        r.append( "NIL" );
+        return;
+    }
 
     // if the string is really boring and we can send an atom, we do
     if ( mode == AString && s.boring() &&
-         !( s.length() == 3 && s.lower() == "nil" ) )
-        return s;
+         !( s.length() == 3 && s.lower() == "nil" ) ) {
+        r.append( s );
+        return;
+    }
 
     // will quoted do?
     uint i = 0;
@@ -1168,11 +1213,15 @@ EString Command::imapQuoted( const EString & s, const QuoteMode mode )
             s[i] >= ' ' && s[i] < 128 &&
             s[i] != '\\' && s[i] != '"' )
         i++;
-    if ( i >= s.length() ) // yes
-        return s.quoted( '"' );
+    if ( i >= s.length() ) { // yes
+        r.reserve( r.length() + s.length() + 2 );
+        r.append( '"' );
+        r.append( s );
+        r.append( '"' );
+        return;
+    }
 
-    EString r;
-    r.reserve( s.length() + 20 );
+    r.reserve( r.length() + s.length() + 20 );
     // if there's a null byte, we need to send a literal8
     if ( s.contains( 0 ) )
         r.append( '~' );
@@ -1180,7 +1229,6 @@ EString Command::imapQuoted( const EString & s, const QuoteMode mode )
     r.appendNumber( s.length() );
     r.append( "}\r\n" );
     r.append( s );
-    return r;
 }
 
 
@@ -92,6 +92,8 @@ public:
     };
     static EString imapQuoted( const EString &,
                                const QuoteMode = PlainString );
+    static void appendQuoted( EString &, const EString &,
+                              const QuoteMode = PlainString );
     EString imapQuoted( Mailbox *, Mailbox * = 0 );
 
     void shrink( IntegerSet * );
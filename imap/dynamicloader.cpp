@@ -0,0 +1,412 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "dynamicloader.h"
+
+#include "estringlist.h"
+#include "annotation.h"
+#include "integerset.h"
+#include "allocator.h"
+#include "mailbox.h"
+#include "cache.h"
+#include "flag.h"
+#include "query.h"
+#include "map.h"
+
+
+// the most messages whose annotations are cached for each mailbox
+static const uint maxCachedAnnotations = 4096;
+
+
+class DynamicLoaderData
+    : public Garbage
+{
+public:
+    DynamicLoaderData()
+        : mailbox( 0 ), kind( DynamicLoader::Flags ), horizon( 0 ),
+          seenDeleted( 0 ), q( 0 ), largestFlag( 0 ),
+          done( false ), failed( false )
+    {}
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): modseq( 0 ) {}
+        int64 modseq;
+        EStringList flags;
+        List<Annotation> annotations;
+    };
+
+    Mailbox * mailbox;
+    DynamicLoader::Kind kind;
+    int64 horizon;
+    IntegerSet uids;
+    Query * seenDeleted;
+    Query * q;
+    uint largestFlag;
+    Map<Entry> entries;
+    List<EventHandler> owners;
+    bool done;
+    bool failed;
+
+    Entry * entry( uint uid ) {
+        Entry * e = entries.find( uid );
+        if ( !e ) {
+            e = new Entry;
+            entries.insert( uid, e );
+        }
+        return e;
+    }
+};
+
+
+static List<DynamicLoader> * running;
+
+
+class AnnotationCache
+    : public Cache
+{
+public:
+    AnnotationCache(): Cache( 10 ) {}
+
+    // the finished annotation loaders for each mailbox, all with the
+    // same horizon
+    Map< List<DynamicLoader> > loaders;
+
+    void clear() { loaders.clear(); }
+};
+
+
+static AnnotationCache * annotationCache;
+
+
+/*! \class DynamicLoader dynamicloader.h
+    The DynamicLoader class loads flags, annotations or modseqs for a
+    set of messages in one mailbox on behalf of any number of Fetch
+    commands.
+
+    When many sessions have the same mailbox selected, a change often
+    makes them all fetch the same flags at about the same time. load()
+    lets a Fetch share the queries another Fetch already has running,
+    provided these cover some of the same UIDs and nothing has changed
+    in the mailbox since they were sent, and sends a new query only for
+    the other UIDs. Each owner is notified when its data is there.
+
+    Finished annotation loaders are kept in a per-mailbox cache and
+    reused by load() until the mailbox's modseq changes, since many
+    clients fetch the annotations of the same messages again and again
+    while nothing changes.
+
+    Queries sent within a Transaction see that transaction's locks and
+    changes, so a Fetch that uses a Transaction doesn't use this class.
+*/
+
+
+/*! Returns a list of DynamicLoader objects which together load data of
+    \a kind for at least \a uids in \a mailbox, and notify \a owner when
+    each is done. Running loaders (and for annotations, finished ones)
+    are shared if nothing has changed in \a mailbox since they started;
+    a new one is started for the UIDs they don't cover.
+*/
+
+List<DynamicLoader> * DynamicLoader::load( Mailbox * mailbox, Kind kind,
+                                           const IntegerSet & uids,
+                                           EventHandler * owner )
+{
+    if ( !running ) {
+        running = new List<DynamicLoader>;
+        Allocator::addEternal( running, "running dynamic data loaders" );
+    }
+
+    List<DynamicLoader> * l = new List<DynamicLoader>;
+    IntegerSet missing( uids );
+
+    if ( kind == Annotations && annotationCache ) {
+        List<DynamicLoader>::Iterator c(
+            annotationCache->loaders.find( mailbox->id() ) );
+        while ( c && !missing.isEmpty() ) {
+            DynamicLoader * dl = c;
+            ++c;
+            if ( dl->d->horizon == mailbox->nextModSeq() &&
+                 !dl->d->uids.intersection( missing ).isEmpty() ) {
+                missing.remove( dl->d->uids );
+                l->append( dl );
+            }
+        }
+        if ( !l->isEmpty() )
+            owner->log( "Using cached annotations for " +
+                        fn( uids.count() - missing.count() ) +
+                        " messages", Log::Debug );
+    }
+
+    uint cached = uids.count() - missing.count();
+    List<DynamicLoader>::Iterator i( running );
+    while ( i && !missing.isEmpty() ) {
+        DynamicLoader * dl = i;
+        ++i;
+        if ( dl->d->mailbox == mailbox && dl->d->kind == kind &&
+             dl->d->horizon == mailbox->nextModSeq() &&
+             !dl->d->uids.intersection( missing ).isEmpty() ) {
+            missing.remove( dl->d->uids );
+            dl->d->owners.append( owner );
+            l->append( dl );
+        }
+    }
+
+    if ( uids.count() - missing.count() > cached )
+        owner->log( "Sharing " +
+                    fn( uids.count() - missing.count() - cached ) +
+                    " messages' dynamic data with other commands",
+                    Log::Debug );
+
+    if ( !missing.isEmpty() ) {
+        DynamicLoader * dl = new DynamicLoader( mailbox, kind, missing );
+        dl->d->owners.append( owner );
+        running->append( dl );
+        l->append( dl );
+    }
+    return l;
+}
+
+
+/*! Constructs a DynamicLoader for the data of \a kind of the messages
+    with \a uids in \a mailbox, and sends its queries.
+*/
+
+DynamicLoader::DynamicLoader( Mailbox * mailbox, Kind kind,
+                              const IntegerSet & uids )
+    : EventHandler(), d( new DynamicLoaderData )
+{
+    d->mailbox = mailbox;
+    d->kind = kind;
+    d->horizon = mailbox->nextModSeq();
+    d->uids = uids;
+
+    switch ( kind ) {
+    case Flags:
+        d->seenDeleted = new Query( "select uid, seen, deleted, flagbits "
+                                    "from mailbox_messages "
+                                    "where mailbox=$1 and uid=any($2)",
+                                    this );
+        d->seenDeleted->bind( 1, mailbox->id() );
+        d->seenDeleted->bind( 2, uids );
+        d->seenDeleted->execute();
+        // execute() names the bits of the flags we know, the
+        // database names the rest
+        d->q = new Query( "select f.uid, fn.name from flags f "
+                          "join flag_names fn on (f.flag=fn.id) "
+                          "where f.mailbox=$1 and f.uid=any($2) "
+                          "union all "
+                          "select mm.uid, fn.name from mailbox_messages mm "
+                          "join flag_names fn "
+                          "on ((mm.flagbits>>(fn.id-1))&1=1) "
+                          "where mm.mailbox=$1 and mm.uid=any($2) "
+                          "and fn.id>$3 and fn.id<=64",
+                          this );
+        d->largestFlag = Flag::largestId();
+        d->q->bind( 3, d->largestFlag );
+        break;
+    case Annotations:
+        d->q = new Query( "select a.uid, "
+                          "a.owner, a.value, an.name "
+                          "from annotations a "
+                          "join annotation_names an on (a.name=an.id) "
+                          "where a.mailbox=$1 and a.uid=any($2) "
+                          "order by an.name",
+                          this );
+        break;
+    case ModSeqs:
+        d->q = new Query( "select uid, modseq "
+                          "from mailbox_messages "
+                          "where mailbox=$1 and uid=any($2)",
+                          this );
+        break;
+    }
+    d->q->bind( 1, mailbox->id() );
+    d->q->bind( 2, uids );
+    d->q->execute();
+}
+
+
+void DynamicLoader::execute()
+{
+    if ( d->done )
+        return;
+
+    EString * seen = 0;
+    EString * deleted = 0;
+    while ( d->seenDeleted && d->seenDeleted->hasResults() ) {
+        Row * r = d->seenDeleted->nextRow();
+        DynamicLoaderData::Entry * e = d->entry( r->getInt( "uid" ) );
+        if ( r->getBoolean( "seen" ) ) {
+            if ( !seen )
+                seen = new EString( "\\Seen" );
+            e->flags.append( seen );
+        }
+        if ( r->getBoolean( "deleted" ) ) {
+            if ( !deleted )
+                deleted = new EString( "\\Deleted" );
+            e->flags.append( deleted );
+        }
+        int64 bits = r->getBigint( "flagbits" );
+        uint f = 1;
+        while ( bits && f <= d->largestFlag && f <= 64 ) {
+            int64 b = Flag::bit( f );
+            if ( bits & b ) {
+                EString n = Flag::name( f );
+                if ( !n.isEmpty() )
+                    e->flags.append( n );
+                bits &= ~b;
+            }
+            f++;
+        }
+    }
+
+    while ( d->q->hasResults() ) {
+        Row * r = d->q->nextRow();
+        DynamicLoaderData::Entry * e = d->entry( r->getInt( "uid" ) );
+        switch ( d->kind ) {
+        case Flags:
+            e->flags.append( r->getEString( "name" ) );
+            break;
+        case Annotations:
+            {
+                uint owner = 0;
+                if ( !r->isNull( "owner" ) )
+                    owner = r->getInt( "owner" );
+                e->annotations.append(
+                    new Annotation( r->getEString( "name" ),
+                                    r->getEString( "value" ), owner ) );
+            }
+            break;
+        case ModSeqs:
+            e->modseq = r->getBigint( "modseq" );
+            break;
+        }
+    }
+
+    if ( ( d->seenDeleted && !d->seenDeleted->done() ) || !d->q->done() )
+        return;
+
+    d->done = true;
+    d->failed = d->q->failed() ||
+                ( d->seenDeleted && d->seenDeleted->failed() );
+    running->remove( this );
+    if ( d->kind == Annotations && !d->failed &&
+         d->horizon == d->mailbox->nextModSeq() &&
+         d->uids.count() <= maxCachedAnnotations )
+        cache();
+
+    List<EventHandler>::Iterator o( d->owners );
+    while ( o ) {
+        o->notify();
+        ++o;
+    }
+}
+
+
+/*! Adds this finished loader to the annotation cache for its
+    mailbox, discarding older loaders and the oldest ones if the
+    mailbox has too many cached messages.
+*/
+
+void DynamicLoader::cache()
+{
+    if ( !annotationCache )
+        annotationCache = new AnnotationCache;
+
+    uint id = d->mailbox->id();
+    List<DynamicLoader> * l = annotationCache->loaders.find( id );
+    if ( !l ) {
+        l = new List<DynamicLoader>;
+        annotationCache->loaders.insert( id, l );
+    }
+
+    uint n = d->uids.count();
+    List<DynamicLoader>::Iterator i( l );
+    while ( i ) {
+        if ( i->d->horizon == d->horizon ) {
+            n += i->d->uids.count();
+            ++i;
+        }
+        else {
+            l->take( i );
+        }
+    }
+    l->append( this );
+    while ( n > maxCachedAnnotations )
+        n -= l->shift()->d->uids.count();
+}
+
+
+/*! Returns the kind of data this loader loads. */
+
+DynamicLoader::Kind DynamicLoader::kind() const
+{
+    return d->kind;
+}
+
+
+/*! Returns true if all the data has been loaded, and false if not. */
+
+bool DynamicLoader::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if any of the queries failed. Only meaningful once
+    done() is true.
+*/
+
+bool DynamicLoader::failed() const
+{
+    return d->failed;
+}
+
+
+/*! Returns the UIDs whose data this loader loads. */
+
+IntegerSet DynamicLoader::uids() const
+{
+    return d->uids;
+}
+
+
+/*! Returns the flags of the message with \a uid, or a null pointer if
+    it has none or isn't among uids().
+*/
+
+EStringList * DynamicLoader::flags( uint uid ) const
+{
+    DynamicLoaderData::Entry * e = d->entries.find( uid );
+    if ( !e )
+        return 0;
+    return &e->flags;
+}
+
+
+/*! Returns the annotations of the message with \a uid, or a null
+    pointer if it has none or isn't among uids().
+*/
+
+List<Annotation> * DynamicLoader::annotations( uint uid ) const
+{
+    DynamicLoaderData::Entry * e = d->entries.find( uid );
+    if ( !e )
+        return 0;
+    return &e->annotations;
+}
+
+
+/*! Returns the modseq of the message with \a uid, or 0 if it isn't
+    among uids().
+*/
+
+int64 DynamicLoader::modSeq( uint uid ) const
+{
+    DynamicLoaderData::Entry * e = d->entries.find( uid );
+    if ( !e )
+        return 0;
+    return e->modseq;
+}
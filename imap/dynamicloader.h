@@ -0,0 +1,44 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef DYNAMICLOADER_H
+#define DYNAMICLOADER_H
+
+#include "event.h"
+#include "list.h"
+
+class Mailbox;
+class IntegerSet;
+class EStringList;
+class Annotation;
+
+
+class DynamicLoader
+    : public EventHandler
+{
+public:
+    enum Kind { Flags, Annotations, ModSeqs };
+
+    static List<DynamicLoader> * load( Mailbox *, Kind, const IntegerSet &,
+                                       EventHandler * );
+
+    void execute();
+
+    Kind kind() const;
+    bool done() const;
+    bool failed() const;
+    IntegerSet uids() const;
+
+    EStringList * flags( uint ) const;
+    List<Annotation> * annotations( uint ) const;
+    int64 modSeq( uint ) const;
+
+private:
+    DynamicLoader( Mailbox *, Kind, const IntegerSet & );
+
+    void cache();
+
+    class DynamicLoaderData * d;
+};
+
+
+#endif
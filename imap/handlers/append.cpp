@@ -16,6 +16,8 @@
 #include "imapurl.h"
 #include "section.h"
 #include "message.h"
+#include "bodypart.h"
+#include "mimefields.h"
 #include "estring.h"
 #include "fetch.h"
 #include "imap.h"
@@ -62,15 +64,59 @@ class AppendData
 {
 public:
     AppendData()
-        : mailbox( 0 ), injector( 0 )
+        : mailbox( 0 ), quota( 0 ), injector( 0 )
     {}
 
     Mailbox * mailbox;
     List<Appendage> messages;
+    Query * quota;
     Injector * injector;
 };
 
 
+/*  Returns true if the Injector would store \a a and \a b in the same
+    bodyparts row, that is, if both are text with the same text and the
+    same HTML-ness, or both are something else with the same data.
+*/
+
+static bool sameContent( Bodypart * a, Bodypart * b )
+{
+    ContentType * ca = a->contentType();
+    ContentType * cb = b->contentType();
+    bool ta = !ca || ca->type() == "text";
+    bool tb = !cb || cb->type() == "text";
+    if ( ta != tb )
+        return false;
+    if ( !ta )
+        return a->data() == b->data();
+    bool ha = ca && ca->subtype() == "html";
+    bool hb = cb && cb->subtype() == "html";
+    return ha == hb && a->utf8Text() == b->utf8Text();
+}
+
+
+/*  Gives each leaf bodypart of \a m whose content is that of one of
+    \a sources the ID of that source, so that the Injector links to
+    the existing bodyparts row instead of hashing and storing the
+    content again.
+*/
+
+static void linkBodyparts( Message * m, List<Bodypart> * sources )
+{
+    List<Bodypart>::Iterator b( m->allBodyparts() );
+    while ( b ) {
+        if ( !b->id() && !b->message() && b->children()->isEmpty() ) {
+            List<Bodypart>::Iterator s( sources );
+            while ( s && !sameContent( b, s ) )
+                ++s;
+            if ( s )
+                b->setId( s->id() );
+        }
+        ++b;
+    }
+}
+
+
 /*! \class Append append.h
     Adds a message to a mailbox (RFC 3501 section 6.3.11)
 
@@ -84,6 +130,16 @@ public:
     given by RFC 4466.
 
     We now use the syntax given by RFC 4466.
+
+    If the target mailbox has an owner, the messages are only injected
+    if they fit within the owner's User::quota(), which applies both to
+    the number of messages and to their total size in kilobytes, as in
+    GETQUOTA. Otherwise the command fails with OVERQUOTA (RFC 9208).
+
+    When a CATENATE URL refers to a single stored bodypart, such as an
+    attachment being forwarded, and the new message contains that
+    bodypart unchanged, the new message refers to the existing
+    bodyparts row. Only the new header and text parts are stored.
 */
 
 Append::Append()
@@ -277,6 +333,23 @@ void Append::parse()
     if ( !ok() )
         return;
 
+    // pipelined APPENDs may run concurrently and share an injector,
+    // unless they use CATENATE URLs, which may refer to messages an
+    // earlier APPEND is about to create.
+    bool urls = false;
+    List<Appendage>::Iterator h( d->messages );
+    while ( h && !urls ) {
+        List<Textpart>::Iterator t( h->textparts );
+        while ( t && !urls ) {
+            if ( t->type == Textpart::Url )
+                urls = true;
+            ++t;
+        }
+        ++h;
+    }
+    if ( !urls )
+        setGroup( 5 );
+
     requireRight( d->mailbox, Permissions::Insert );
     requireRight( d->mailbox, Permissions::Write );
 }
@@ -298,28 +371,62 @@ void Append::execute()
     if ( !permitted() || !ok() || state() != Executing )
         return;
 
-    List<Appendage>::Iterator h( d->messages );
-    bool allDone = true;
-    while ( h && ok() ) {
-        if ( !h->message )
-            process( h );
-        if ( !h->message )
-            allDone = false;
-        ++h;
-    }
-
-    if ( !allDone )
-        return;
-
     if ( !d->injector ) {
-        List<Injectee> * m = new List<Injectee>;
-        h = d->messages.first();
-        while ( h ) {
-            m->append( h->message );
-            ++h;
+        if ( !ready() )
+            return;
+
+        if ( !d->quota && d->mailbox->owner() ) {
+            d->quota = new Query( "select qu.messages, qu.rfc822size, "
+                                  "u.quota from quota_usage qu "
+                                  "join users u on (qu.owner=u.id) "
+                                  "where qu.owner=$1", this );
+            d->quota->bind( 1, d->mailbox->owner() );
+            d->quota->execute();
+        }
+        if ( d->quota && !d->quota->done() )
+            return;
+        Row * r = 0;
+        if ( d->quota )
+            r = d->quota->nextRow();
+        if ( r ) {
+            int64 messages = r->getBigint( "messages" );
+            int64 size = r->getBigint( "rfc822size" );
+            List<Appendage>::Iterator h( d->messages );
+            while ( h ) {
+                messages++;
+                size += h->text.length();
+                ++h;
+            }
+            int64 quota = r->getBigint( "quota" );
+            if ( messages > quota || size / 1024 > quota ) {
+                setRespTextCode( "OVERQUOTA" );
+                error( No, "Quota exceeded for " +
+                       d->mailbox->name().ascii() );
+                return;
+            }
         }
 
+        List<Injectee> * m = new List<Injectee>;
         d->injector = new Injector( this );
+        addMessages( m );
+
+        // Other APPENDs to the same mailbox which are executing
+        // concurrently with this one and are ready join our
+        // injection. They finish when IMAP runs them after we do.
+        List<Command>::Iterator c( imap()->commands() );
+        while ( c ) {
+            Append * a = 0;
+            if ( c != this && c->group() == 5 &&
+                 c->state() == Executing && c->name() == "append" )
+                a = (Append *)((Command *)c);
+            if ( a && !a->d->injector && a->d->mailbox == d->mailbox &&
+                 a->permitted() && a->ok() && a->ready() ) {
+                a->d->injector = d->injector;
+                a->addMessages( m );
+            }
+            ++c;
+        }
+
         d->injector->addInjection( m );
         d->injector->execute();
     }
@@ -333,7 +440,7 @@ void Append::execute()
     }
 
     IntegerSet uids;
-    h = d->messages.first();
+    List<Appendage>::Iterator h( d->messages );
     while ( h ) {
         uids.add( h->message->uid( d->mailbox ) );
         ++h;
@@ -345,6 +452,37 @@ void Append::execute()
 }
 
 
+/*! Processes each message of this command, and returns true if all of
+    them are ready to be injected.
+*/
+
+bool Append::ready()
+{
+    List<Appendage>::Iterator h( d->messages );
+    bool allDone = true;
+    while ( h && ok() ) {
+        if ( !h->message )
+            process( h );
+        if ( !h->message )
+            allDone = false;
+        ++h;
+    }
+    return allDone && ok();
+}
+
+
+/*! Appends this command's messages to \a m. */
+
+void Append::addMessages( List<Injectee> * m )
+{
+    List<Appendage>::Iterator h( d->messages );
+    while ( h ) {
+        m->append( h->message );
+        ++h;
+    }
+}
+
+
 /*! This private execute() helper processes the single message \a h. It
     can be executed in parallel.
 */
@@ -386,13 +524,18 @@ void Append::process( class Appendage * h )
         return;
     }
 
+    List<Bodypart> sources;
     List<Textpart>::Iterator it( h->textparts );
     while ( it ) {
         Textpart * tp = it;
-        if ( tp->type == Textpart::Text )
+        if ( tp->type == Textpart::Text ) {
             h->text.append( tp->s );
-        else
+        }
+        else {
             h->text.append( tp->url->text() );
+            if ( tp->url->bodypart() )
+                sources.append( tp->url->bodypart() );
+        }
         h->textparts->take( it );
     }
 
@@ -406,4 +549,6 @@ void Append::process( class Appendage * h )
         error( Bad, h->message->error() );
         return;
     }
+    if ( !sources.isEmpty() )
+        linkBodyparts( h->message, &sources );
 }
@@ -6,6 +6,9 @@
 #include "command.h"
 
 
+class Injectee;
+
+
 class Append
     : public Command
 {
@@ -17,6 +20,8 @@ public:
 
 private:
     uint number( uint );
+    bool ready();
+    void addMessages( List<Injectee> * );
     void process( class Appendage * );
 
     class AppendData * d;
@@ -46,7 +46,8 @@
     RFC 5465: NOTIFY,
     RFC 6154: SPECIAL-USE,
     RFC 6855: UTF=ACCEPT,
-    RFC 7162: QRESYNC.
+    RFC 7162: QRESYNC,
+    RFC 7377: MULTISEARCH.
 */
 
 void Capability::execute()
@@ -108,8 +109,10 @@ EString Capability::capabilities( IMAP * i, bool all )
     if ( all || login ) {
         c.append( "MOVE" );
         c.append( "MULTIAPPEND" );
+        c.append( "MULTISEARCH" );
         c.append( "NAMESPACE" );
         //c.append( "NOTIFY" );
+        c.append( "PREVIEW" );
     }
     if ( all || login ) {
         if ( Configuration::toggle( Configuration::UseImapQuota ) )
@@ -8,6 +8,11 @@
 #include "mailbox.h"
 #include "query.h"
 #include "user.h"
+#include "imap.h"
+
+
+// the number of messages copied by each insert into mailbox_messages
+static const uint chunkSize = 16384;
 
 
 class CopyData
@@ -18,7 +23,8 @@ public:
         uid( false ), move( false ),
         mailbox( 0 ),
         findUid( 0 ),
-        report( 0 )
+        report( 0 ),
+        reported( 0 )
     {}
     bool uid;
     bool move;
@@ -26,6 +32,8 @@ public:
     Mailbox * mailbox;
     Query * findUid;
     Query * report;
+    List<Query> chunks;
+    uint reported;
     uint toUid;
     int64 toMs;
     int64 fromMs;
@@ -143,7 +151,8 @@ void Copy::execute()
                        "uid integer,"
                        "message integer,"
                        "nuid integer,"
-                       "seen boolean"
+                       "seen boolean,"
+                       "flagbits bigint"
                        ")", 0 );
         transaction()->enqueue( q );
 
@@ -152,8 +161,9 @@ void Copy::execute()
         transaction()->enqueue( q );
 
         q = new Query( "insert into t "
-                       "(mailbox, uid, message, nuid, seen) "
-                       "select mailbox, uid, message, nextval('s'), seen "
+                       "(mailbox, uid, message, nuid, seen, flagbits) "
+                       "select mailbox, uid, message, nextval('s'), seen, "
+                       "flagbits "
                        "from mailbox_messages "
                        "where mailbox=$1 and uid=any($2) order by uid", 0 );
         q->bind( 1, session()->mailbox()->id() );
@@ -170,29 +180,52 @@ void Copy::execute()
 
         transaction()->enqueue( new Query( "drop sequence s", 0 ) );
 
-        q = new Query( "insert into mailbox_messages "
-                       "(mailbox, uid, message, modseq, seen, deleted) "
-                       "select $1, t.nuid, message, $2, t.seen, false "
-                       "from t", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, d->toMs );
-        transaction()->enqueue( q );
+        // large copies are done in chunks, so that we can tell the
+        // client how far we've come.
+        uint first = d->toUid;
+        uint end = d->toUid + d->set.count();
+        while ( first < end ) {
+            uint last = first + chunkSize;
+            if ( last > end )
+                last = end;
+
+            q = new Query( "insert into mailbox_messages "
+                           "(mailbox, uid, message, modseq, seen, deleted, "
+                           "flagbits) "
+                           "select $1, t.nuid, message, $2, t.seen, false, "
+                           "t.flagbits "
+                           "from t where t.nuid>=$3 and t.nuid<$4", 0 );
+            q->bind( 1, d->mailbox->id() );
+            q->bind( 2, d->toMs );
+            q->bind( 3, first );
+            q->bind( 4, last );
+            transaction()->enqueue( q );
 
-        q = new Query( "insert into flags "
-                       "(mailbox, uid, flag) "
-                       "select $1, t.nuid, f.flag "
-                       "from flags f join t using (mailbox, uid)", 0 );
-        q->bind( 1, d->mailbox->id() );
-        transaction()->enqueue( q );
+            q = new Query( "insert into flags "
+                           "(mailbox, uid, flag) "
+                           "select $1, t.nuid, f.flag "
+                           "from flags f join t using (mailbox, uid) "
+                           "where t.nuid>=$2 and t.nuid<$3", 0 );
+            q->bind( 1, d->mailbox->id() );
+            q->bind( 2, first );
+            q->bind( 3, last );
+            transaction()->enqueue( q );
 
-        q = new Query( "insert into annotations "
-                       "(mailbox, uid, owner, name, value) "
-                       "select $1, t.nuid, a.owner, a.name, a.value "
-                       "from annotations a join t using (mailbox, uid) "
-                       "where a.owner is null or a.owner=$2", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, imap()->user()->id() );
-        transaction()->enqueue( q );
+            q = new Query( "insert into annotations "
+                           "(mailbox, uid, owner, name, value) "
+                           "select $1, t.nuid, a.owner, a.name, a.value "
+                           "from annotations a join t using (mailbox, uid) "
+                           "where (a.owner is null or a.owner=$2) "
+                           "and t.nuid>=$3 and t.nuid<$4", this );
+            q->bind( 1, d->mailbox->id() );
+            q->bind( 2, imap()->user()->id() );
+            q->bind( 3, first );
+            q->bind( 4, last );
+            transaction()->enqueue( q );
+            d->chunks.append( q );
+
+            first = last;
+        }
 
         d->report = new Query( "select uid, nuid from t", 0 );
         transaction()->enqueue( d->report );
@@ -225,6 +258,21 @@ void Copy::execute()
         transaction()->commit();
     }
 
+    if ( d->chunks.count() > 1 ) {
+        uint done = 0;
+        List<Query>::Iterator q( d->chunks );
+        while ( q && q->done() ) {
+            done++;
+            ++q;
+        }
+        if ( done > d->reported && done < d->chunks.count() ) {
+            d->reported = done;
+            imap()->enqueue( "* OK [INPROGRESS (" + tag().quoted() + " " +
+                             fn( done * chunkSize ) + " " +
+                             fn( d->set.count() ) + ")] Copying\r\n" );
+        }
+    }
+
     if ( !transaction()->done() )
         return;
 
@@ -26,9 +26,12 @@ public:
 /*! \class Delete delete.h
     Deletes an existing mailbox (RFC 3501 section 6.3.4)
 
-    Mailboxes cannot be deleted until they're empty of messages and
-
-    (Really deletes? What happens to the mail there?)
+    A mailbox cannot be deleted while it contains new messages that
+    nobody has seen, or while an alias or a sieve fileinto uses it.
+    Otherwise the mailbox is marked as deleted at once, and the
+    Maintainer later moves its messages to deleted_messages in the
+    background, so they can be undeleted as usual. Deleting a large
+    mailbox therefore takes no longer than deleting an empty one.
 
     RFC 2180 section 3 is tricky. For the moment we disallow DELETE of
     an active mailbox. That's not practical to do on a cluster, so
@@ -0,0 +1,388 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "esearch.h"
+
+#include "map.h"
+#include "user.h"
+#include "query.h"
+#include "mailbox.h"
+#include "database.h"
+#include "selector.h"
+#include "imapparser.h"
+#include "imapsession.h"
+#include "permissions.h"
+
+
+static const uint resultLimit = 100000;
+
+
+class ESearchData
+    : public Garbage
+{
+public:
+    ESearchData()
+        : Garbage(), s( 0 ),
+          selected( false ), inboxes( false ),
+          personal( false ), subscribed( false ),
+          resolved( false ),
+          subscriptions( 0 ), query( 0 ),
+          current( 0 ), matches( 0 ),
+          returnAll( false ), returnCount( false ),
+          returnMax( false ), returnMin( false )
+    {}
+
+    Selector * s;
+
+    bool selected;
+    bool inboxes;
+    bool personal;
+    bool subscribed;
+
+    class Source
+        : public Garbage
+    {
+    public:
+        Source(): Garbage(), mailbox( 0 ), depth( 0 ) {}
+
+        Mailbox * mailbox;
+        uint depth;
+    };
+
+    List<Source> sources;
+
+    bool resolved;
+    Query * subscriptions;
+    Map<Permissions> permissions;
+    List<Permissions> checks;
+    Query * query;
+
+    uint current;
+    IntegerSet uids;
+    uint matches;
+
+    bool returnAll;
+    bool returnCount;
+    bool returnMax;
+    bool returnMin;
+};
+
+
+/*! \class ESearch esearch.h
+
+    The ESearch class implements the ESEARCH command from RFC 7377
+    (MULTISEARCH), which searches several mailboxes at once.
+
+    The mailboxes are given using the filters from RFC 5465 (selected,
+    inboxes, personal, subscribed, subtree, subtree-one and
+    mailboxes). Mailboxes the user cannot read are silently left out.
+
+    All the mailboxes are searched using a single Query, ordered by
+    mailbox, so that an ESEARCH response can be sent as soon as each
+    mailbox's results are complete. If the search matches more than
+    100,000 messages, the command is aborted with a NO [LIMIT].
+
+    This class subclasses Search in order to use its parser for the
+    search keys.
+*/
+
+
+/*! Constructs an empty ESearch command. */
+
+ESearch::ESearch()
+    : Search( true ), d( new ESearchData )
+{
+}
+
+
+void ESearch::parse()
+{
+    space();
+    if ( present( "in " ) ) {
+        parseSource();
+        space();
+    }
+    else {
+        d->selected = true;
+    }
+
+    if ( present( "return " ) ) {
+        require( "(" );
+        bool any = false;
+        while ( ok() && nextChar() != ')' ) {
+            EString modifier = letters( 3, 5 ).lower();
+            any = true;
+            if ( modifier == "all" )
+                d->returnAll = true;
+            else if ( modifier == "min" )
+                d->returnMin = true;
+            else if ( modifier == "max" )
+                d->returnMax = true;
+            else if ( modifier == "count" )
+                d->returnCount = true;
+            else
+                error( Bad, "Unknown search modifier option: " + modifier );
+            if ( nextChar() != ')' )
+                space();
+        }
+        require( ")" );
+        if ( !any )
+            d->returnAll = true;
+        space();
+    }
+    else {
+        d->returnAll = true;
+    }
+
+    if ( present( "charset " ) ) {
+        setCharset( astring() );
+        space();
+    }
+
+    d->s = new Selector;
+    d->s->add( parseKey() );
+    while ( ok() && !parser()->atEnd() ) {
+        space();
+        d->s->add( parseKey() );
+    }
+    end();
+
+    if ( !ok() )
+        return;
+
+    d->s->simplify();
+    log( "ESearch for " + d->s->debugString() );
+}
+
+
+/*! Parses the esearch-source-opts production, following the "IN ". */
+
+void ESearch::parseSource()
+{
+    require( "(" );
+    do {
+        uint depth = 0;
+        bool named = false;
+        if ( present( "selected-delayed" ) || present( "selected" ) ) {
+            d->selected = true;
+        }
+        else if ( present( "inboxes" ) ) {
+            d->inboxes = true;
+        }
+        else if ( present( "personal" ) ) {
+            d->personal = true;
+        }
+        else if ( present( "subscribed" ) ) {
+            d->subscribed = true;
+        }
+        else if ( present( "subtree-one" ) ) {
+            named = true;
+            depth = 1;
+        }
+        else if ( present( "subtree" ) ) {
+            named = true;
+            depth = UINT_MAX;
+        }
+        else if ( present( "mailboxes" ) ) {
+            named = true;
+        }
+        else if ( nextChar() == '(' ) {
+            error( Bad, "Scope options are not supported" );
+        }
+        else {
+            error( Bad, "Unknown mailbox filter: " + following() );
+        }
+        if ( named ) {
+            space();
+            bool list = present( "(" );
+            do {
+                ESearchData::Source * s = new ESearchData::Source;
+                s->mailbox = mailbox();
+                s->depth = depth;
+                d->sources.append( s );
+            } while ( ok() && list && present( " " ) );
+            if ( list )
+                require( ")" );
+        }
+    } while ( ok() && present( " " ) );
+    require( ")" );
+}
+
+
+void ESearch::execute()
+{
+    if ( state() != Executing )
+        return;
+
+    if ( !d->resolved ) {
+        User * u = imap()->user();
+        if ( d->subscribed && !d->subscriptions ) {
+            d->subscriptions =
+                new Query( "select mailbox from subscriptions "
+                           "where owner=$1", this );
+            d->subscriptions->bind( 1, u->id() );
+            d->subscriptions->execute();
+        }
+        if ( d->subscriptions && !d->subscriptions->done() )
+            return;
+        findMailboxes();
+        d->resolved = true;
+    }
+
+    List<Permissions>::Iterator p( d->checks );
+    while ( p ) {
+        if ( !p->ready() )
+            return;
+        ++p;
+    }
+
+    if ( !d->query ) {
+        IntegerSet ids;
+        List<Permissions>::Iterator i( d->checks );
+        while ( i ) {
+            if ( i->allowed( Permissions::Read ) )
+                ids.add( i->mailbox()->id() );
+            ++i;
+        }
+        if ( ids.isEmpty() ) {
+            finish();
+            return;
+        }
+
+        EStringList * wanted = new EStringList;
+        wanted->append( "mailbox" );
+        wanted->append( "uid" );
+        d->query = d->s->query( imap()->user(), ids, this, wanted );
+        d->query->execute();
+    }
+
+    Row * r;
+    while ( (r=d->query->nextRow()) != 0 ) {
+        uint mailbox = r->getInt( "mailbox" );
+        if ( mailbox != d->current ) {
+            if ( d->current )
+                respondFor( d->current, d->uids );
+            d->current = mailbox;
+            d->uids.clear();
+        }
+        d->uids.add( r->getInt( "uid" ) );
+        d->matches++;
+        if ( d->matches > resultLimit ) {
+            Database::cancelQuery( d->query );
+            setRespTextCode( "LIMIT" );
+            error( No, "Search matched more than " + fn( resultLimit ) +
+                   " messages" );
+            return;
+        }
+    }
+
+    if ( !d->query->done() )
+        return;
+
+    if ( d->query->failed() ) {
+        error( No, "Database error: " + d->query->error() );
+        return;
+    }
+
+    if ( d->current )
+        respondFor( d->current, d->uids );
+    finish();
+}
+
+
+/*! Finds the mailboxes named by the source filters, and starts
+    checking that the user may read them.
+*/
+
+void ESearch::findMailboxes()
+{
+    User * u = imap()->user();
+
+    if ( d->selected ) {
+        Session * s = imap()->session();
+        if ( s )
+            addMailbox( s->mailbox(), 0 );
+    }
+    if ( d->inboxes )
+        addMailbox( u->inbox(), 0 );
+    if ( d->personal )
+        addMailbox( u->home(), UINT_MAX );
+
+    if ( d->subscriptions ) {
+        Row * r;
+        while ( (r=d->subscriptions->nextRow()) != 0 )
+            addMailbox( Mailbox::find( r->getInt( "mailbox" ) ), 0 );
+    }
+
+    List<ESearchData::Source>::Iterator s( d->sources );
+    while ( s ) {
+        addMailbox( s->mailbox, s->depth );
+        ++s;
+    }
+}
+
+
+/*! Adds \a m to the mailboxes to be searched, along with its
+    descendants to a depth of \a depth. Deleted mailboxes and mailboxes
+    already added are skipped.
+*/
+
+void ESearch::addMailbox( Mailbox * m, uint depth )
+{
+    if ( !m )
+        return;
+
+    if ( m->id() && !m->deleted() && !d->permissions.contains( m->id() ) ) {
+        Permissions * p = new Permissions( m, imap()->user(), this );
+        d->permissions.insert( m->id(), p );
+        d->checks.append( p );
+    }
+
+    if ( !depth || !m->children() )
+        return;
+
+    List<Mailbox>::Iterator c( m->children() );
+    while ( c ) {
+        addMailbox( c, depth - 1 );
+        ++c;
+    }
+}
+
+
+/*! Sends the ESEARCH response for the matching \a uids in the
+    mailbox whose id is \a mailbox, right away.
+*/
+
+void ESearch::respondFor( uint mailbox, const IntegerSet & uids )
+{
+    Mailbox * m = Mailbox::find( mailbox );
+    if ( !m )
+        return;
+
+    EString r;
+    r.reserve( uids.count() * 4 + 100 );
+    r.append( "ESEARCH (TAG " );
+    r.append( tag().quoted() );
+    r.append( " MAILBOX " );
+    r.append( imapQuoted( m ) );
+    r.append( " UIDVALIDITY " );
+    r.appendNumber( m->uidvalidity() );
+    r.append( ") UID" );
+    if ( d->returnCount ) {
+        r.append( " COUNT " );
+        r.appendNumber( uids.count() );
+    }
+    if ( d->returnMin ) {
+        r.append( " MIN " );
+        r.appendNumber( uids.smallest() );
+    }
+    if ( d->returnMax ) {
+        r.append( " MAX " );
+        r.appendNumber( uids.largest() );
+    }
+    if ( d->returnAll ) {
+        r.append( " ALL " );
+        r.append( uids.set() );
+    }
+    respond( r );
+    imap()->emitResponses();
+}
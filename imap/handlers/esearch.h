@@ -0,0 +1,28 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef ESEARCH_H
+#define ESEARCH_H
+
+#include "search.h"
+
+
+class ESearch
+    : public Search
+{
+public:
+    ESearch();
+
+    void parse();
+    void execute();
+
+private:
+    class ESearchData * d;
+
+    void parseSource();
+    void findMailboxes();
+    void addMailbox( Mailbox *, uint );
+    void respondFor( uint, const IntegerSet & );
+};
+
+
+#endif
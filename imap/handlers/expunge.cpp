@@ -15,25 +15,33 @@
 #include "transaction.h"
 
 
+// the largest number of messages expunged by one transaction
+static const uint chunkSize = 1024;
+
+
 class ExpungeData
     : public Garbage
 {
 public:
     ExpungeData()
-        : uid( false ), commit( false ), modseq( 0 ), s( 0 ),
-          findUids( 0 ), findModseq( 0 ), expunge( 0 ), r( 0 )
+        : uid( false ), modseq( 0 ), s( 0 ), t( 0 ),
+          findUids( 0 ), findModseq( 0 ), expunge( 0 ), r( 0 ),
+          expunged( 0 ), retained( 0 )
     {}
 
     bool uid;
-    bool commit;
     int64 modseq;
     Session * s;
+    Transaction * t;
     Query * findUids;
     Query * findModseq;
     Query * expunge;
     IntegerSet requested;
     IntegerSet marked;
+    IntegerSet chunk;
     RetentionSelector * r;
+    uint expunged;
+    uint retained;
 };
 
 
@@ -50,6 +58,16 @@ public:
     message is gone, it really is. Seems advisable from a
     confidentiality point of view.
 
+    The messages are expunged in chunks of at most 1024, each in a
+    transaction of its own, so that the mailbox's nextmodseq is only
+    locked briefly and deliveries to the mailbox can proceed while a
+    large expunge is in progress. The client is sent EXPUNGE or
+    VANISHED responses for each chunk as soon as it is committed. If
+    a chunk fails, the chunks already committed stay expunged.
+
+    Removing the messages themselves (and their bodyparts, header
+    fields etc.) once nothing refers to them is left to aox vacuum.
+
     The UID of an expunged message may still exist in different
     sessions, although the message itself is no longer accessible.
 */
@@ -109,14 +127,7 @@ void Expunge::execute()
         d->r->execute();
     }
 
-    if ( !transaction() ) {
-        setTransaction( new Transaction( this ) );
-
-        d->findModseq = new Query( "select nextmodseq from mailboxes "
-                                   "where id=$1 for update", this );
-        d->findModseq->bind( 1, d->s->mailbox()->id() );
-        transaction()->enqueue( d->findModseq );
-
+    if ( !d->findUids ) {
         d->findUids = new Query( "", this );
         d->findUids->bind( 1, d->s->mailbox()->id() );
         EString query( "select uid from mailbox_messages "
@@ -125,11 +136,8 @@ void Expunge::execute()
             query.append( " and uid=any($2)" );
             d->findUids->bind( 2, d->requested );
         }
-        query.append( " order by uid for update" );
         d->findUids->setString( query );
-        transaction()->enqueue( d->findUids );
-
-        transaction()->execute();
+        d->findUids->execute();
     }
 
     while ( d->findUids->hasResults() ) {
@@ -137,100 +145,186 @@ void Expunge::execute()
         d->marked.add( r->getInt( "uid" ) );
     }
 
-    if ( d->findModseq->hasResults() ) {
-        Row * r = d->findModseq->nextRow();
-        d->modseq = r->getBigint( "nextmodseq" );
-    }
-
     if ( !d->findUids->done() )
         return;
 
     if ( !d->r->done() )
         return;
 
-    if ( d->marked.isEmpty() ) {
-        transaction()->commit();
-        finish();
+    if ( d->findUids->failed() ) {
+        error( No, "Database error: " + d->findUids->error() );
         return;
     }
 
-    if ( !d->expunge ) {
+    if ( !d->findModseq && !d->marked.isEmpty() )
         log( "Expunge " + fn( d->marked.count() ) + " messages: " +
              d->marked.set() );
 
-        Selector * s = new Selector;
-        s->add( new Selector( d->marked ) );
-        if ( d->r->retains() ) {
-            Selector * n = new Selector( Selector::Not );
-            s->add( n );
-            n->add( d->r->retains() );
+    while ( ok() ) {
+        if ( !d->t ) {
+            if ( d->marked.isEmpty() )
+                break;
+            startChunk();
         }
-        s->simplify();
-
-        EStringList wanted;
-        wanted.append( "mailbox" );
-        wanted.append( "uid" );
-        wanted.append( "message" );
-
-        d->expunge = s->query( imap()->user(), d->s->mailbox(),
-                               d->s, this, false, &wanted,
-                               false );
-
-        int i = d->expunge->string().find( " from " );
-        uint msb = s->placeHolder();
-        uint ub = s->placeHolder();
-        uint rb = s->placeHolder();
-        d->expunge->setString(
-            "insert into deleted_messages "
-            "(mailbox,uid,message,modseq,deleted_by,reason) " +
-            d->expunge->string().mid( 0, i ) + ", $" + fn( msb ) +", $" +
-            fn( ub ) + ", $" + fn( rb ) + d->expunge->string().mid( i ) );
-        d->expunge->bind( msb, d->modseq );
-        d->expunge->bind( ub, imap()->user()->id() );
-        d->expunge->bind( rb,
-                          "IMAP expunge " + Scope::current()->log()->id() );
-        transaction()->enqueue( d->expunge );
-        transaction()->execute();
+
+        if ( d->findModseq->hasResults() ) {
+            Row * r = d->findModseq->nextRow();
+            d->modseq = r->getBigint( "nextmodseq" );
+        }
+
+        if ( !d->expunge ) {
+            if ( !d->findModseq->done() )
+                return;
+            if ( !d->modseq ) {
+                d->t->rollback();
+                error( No, "Database error. Messages not expunged." );
+                return;
+            }
+            enqueueChunk();
+        }
+
+        if ( !d->t->done() )
+            return;
+
+        finishChunk();
     }
 
-    if ( !d->expunge->done() )
+    if ( !ok() )
         return;
 
-    if ( !d->commit ) {
-        d->commit = true;
-        if ( d->expunge->rows() < d->marked.count() ) {
-            log( "User requested expunging " + fn( d->marked.count() ) +
-                 " messages, of which " +
-                 fn ( d->marked.count() - d->expunge->rows() ) +
-                 " must be retained" );
-            // there was something we were asked to expunge, but which
-            // must be retained due to a configured policy. clear the
-            // deleted flag on those messages, so the retention policy
-            // is clearly visible.
-            Query * q = new Query( "update mailbox_messages "
-                                   "set modseq=$1, deleted=false "
-                                   "where mailbox=$2 and uid=any($3)",
-                                   0 );
-            q->bind( 1, d->modseq );
-            q->bind( 2, d->s->mailbox()->id() );
-            q->bind( 3, d->marked );
-            transaction()->enqueue( q );
-        }
+    if ( d->retained )
+        log( "User requested expunging " +
+             fn( d->expunged + d->retained ) +
+             " messages, of which " + fn( d->retained ) +
+             " must be retained" );
+    finish();
+}
+
 
-        Query * q = new Query( "update mailboxes set nextmodseq=$1 "
-                               "where id=$2", 0 );
-        q->bind( 1, d->modseq + 1 );
+/*! Starts a transaction for the next chunk of the marked messages,
+    and locks the mailbox's nextmodseq. enqueueChunk() does the rest
+    once the nextmodseq is known.
+*/
+
+void Expunge::startChunk()
+{
+    uint last = d->marked.largest();
+    if ( d->marked.count() > chunkSize )
+        last = d->marked.value( chunkSize );
+    IntegerSet range;
+    range.add( d->marked.smallest(), last );
+    d->chunk = d->marked.intersection( range );
+    d->marked.remove( d->marked.smallest(), last );
+
+    d->modseq = 0;
+    d->expunge = 0;
+    d->t = new Transaction( this );
+    d->findModseq = new Query( "select nextmodseq from mailboxes "
+                               "where id=$1 for update", this );
+    d->findModseq->bind( 1, d->s->mailbox()->id() );
+    d->t->enqueue( d->findModseq );
+    d->t->execute();
+}
+
+
+/*! Moves the current chunk to deleted_messages, except those messages
+    that are still \Deleted and must be retained, and commits the
+    transaction.
+*/
+
+void Expunge::enqueueChunk()
+{
+    Selector * s = new Selector;
+    s->add( new Selector( d->chunk ) );
+    // the messages may have been undeleted since we looked
+    s->add( new Selector( Selector::Flags, Selector::Contains,
+                          "\\deleted" ) );
+    if ( d->r->retains() ) {
+        Selector * n = new Selector( Selector::Not );
+        s->add( n );
+        n->add( d->r->retains() );
+    }
+    s->simplify();
+
+    EStringList wanted;
+    wanted.append( "mailbox" );
+    wanted.append( "uid" );
+    wanted.append( "message" );
+
+    d->expunge = s->query( imap()->user(), d->s->mailbox(),
+                           d->s, this, false, &wanted,
+                           false );
+
+    int i = d->expunge->string().find( " from " );
+    uint msb = s->placeHolder();
+    uint ub = s->placeHolder();
+    uint rb = s->placeHolder();
+    d->expunge->setString(
+        "insert into deleted_messages "
+        "(mailbox,uid,message,modseq,deleted_by,reason) " +
+        d->expunge->string().mid( 0, i ) + ", $" + fn( msb ) +", $" +
+        fn( ub ) + ", $" + fn( rb ) + d->expunge->string().mid( i ) +
+        " returning uid" );
+    d->expunge->bind( msb, d->modseq );
+    d->expunge->bind( ub, imap()->user()->id() );
+    d->expunge->bind( rb,
+                      "IMAP expunge " + Scope::current()->log()->id() );
+    d->t->enqueue( d->expunge );
+
+    if ( d->r->retains() ) {
+        // there may be something we were asked to expunge, but which
+        // must be retained due to a configured policy. clear the
+        // deleted flag on those messages, so the retention policy is
+        // clearly visible. the ones we expunged are gone by now.
+        Query * q = new Query( "update mailbox_messages "
+                               "set modseq=$1, deleted=false "
+                               "where mailbox=$2 and uid=any($3) "
+                               "and deleted",
+                               0 );
+        q->bind( 1, d->modseq );
         q->bind( 2, d->s->mailbox()->id() );
-        transaction()->enqueue( q );
-        Mailbox::refreshMailboxes( transaction() );
-        transaction()->commit();
+        q->bind( 3, d->chunk );
+        d->t->enqueue( q );
     }
 
-    if ( !transaction()->done() )
+    Query * q = new Query( "update mailboxes set nextmodseq=$1 "
+                           "where id=$2", 0 );
+    q->bind( 1, d->modseq + 1 );
+    q->bind( 2, d->s->mailbox()->id() );
+    d->t->enqueue( q );
+    Mailbox::refreshMailboxes( d->t );
+    d->t->commit();
+}
+
+
+/*! Looks at the results of the current chunk, and tells the client
+    about the expunged messages at once, unless Close has taken the
+    session away.
+*/
+
+void Expunge::finishChunk()
+{
+    Transaction * t = d->t;
+    d->t = 0;
+
+    if ( t->failed() || t->state() == Transaction::RolledBack ) {
+        if ( d->expunged )
+            error( No, "Database error. Only " + fn( d->expunged ) +
+                   " messages expunged." );
+        else
+            error( No, "Database error. Messages not expunged." );
         return;
+    }
 
-    if ( transaction()->failed() ||
-         transaction()->state() == Transaction::RolledBack )
-        error( No, "Database error. Messages not expunged." );
-    finish();
+    IntegerSet gone;
+    Row * r;
+    while ( ( r = d->expunge->nextRow() ) != 0 )
+        gone.add( r->getInt( "uid" ) );
+    d->expunged += gone.count();
+    d->retained += d->chunk.count() - gone.count();
+
+    if ( !gone.isEmpty() && imap()->session() == d->s ) {
+        d->s->expunge( gone );
+        d->s->emitUpdates( 0 );
+    }
 }
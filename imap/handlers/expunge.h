@@ -18,6 +18,10 @@ public:
 
 private:
     class ExpungeData *d;
+
+    void startChunk();
+    void enqueueChunk();
+    void finishChunk();
 };
 
 
@@ -2,15 +2,19 @@
 
 #include "fetch.h"
 
+#include "configuration.h"
+#include "flagsnapshot.h"
 #include "messagecache.h"
 #include "imapsession.h"
 #include "transaction.h"
 #include "annotation.h"
 #include "integerset.h"
 #include "estringlist.h"
+#include "ustringlist.h"
 #include "mimefields.h"
 #include "imapparser.h"
 #include "bodypart.h"
+#include "blobstore.h"
 #include "address.h"
 #include "mailbox.h"
 #include "message.h"
@@ -19,16 +23,22 @@
 #include "listext.h"
 #include "fetcher.h"
 #include "iso8859.h"
+#include "readahead.h"
+#include "dynamicloader.h"
+#include "sharedcache.h"
+#include "buffer.h"
 #include "codec.h"
 #include "query.h"
 #include "scope.h"
 #include "store.h"
+#include "flag.h"
 #include "timer.h"
 #include "imap.h"
 #include "date.h"
 #include "user.h"
 #include "dict.h"
 #include "map.h"
+#include "hashmap.h"
 #include "utf.h"
 
 
@@ -51,7 +61,7 @@ public:
     FetchData()
         : state( 0 ), peek( true ), processed( 0 ),
           changedSince( 0 ), those( 0 ), findIds( 0 ),
-          deleted( 0 ), store( 0 ),
+          deleted( 0 ), store( 0 ), fromSnapshot( false ),
           uid( false ),
           flags( false ), envelope( false ),
           body( false ), bodystructure( false ),
@@ -61,7 +71,11 @@ public:
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
-          annotationFetcher( 0 ), modseqFetcher( 0 )
+          annotationFetcher( 0 ), modseqFetcher( 0 ),
+          fetcher( 0 ), summarisable( false ), findSummaries( 0 ),
+          raw( false ), rangedBody( false ), rangeFetcher( 0 ),
+          preview( false ), previewLazy( false ),
+          findPreviews( 0 ), previewFetcher( 0 )
     {}
 
     int state;
@@ -76,6 +90,7 @@ public:
     Query * findIds;
     Query * deleted;
     Store * store;
+    bool fromSnapshot;
 
     // we want to ask for...
     bool uid;
@@ -110,14 +125,108 @@ public:
         Dict<EString> flags;
         List<Annotation> annotations;
     };
-    Map<DynamicData> dynamics;
+    HashMap<DynamicData> dynamics;
     Query * seenDeletedFetcher;
     Query * flagFetcher;
     Query * annotationFetcher;
     Query * modseqFetcher;
+    Fetcher * fetcher;
+    List<DynamicLoader> loaders;
+
+    class Summary
+        : public Garbage
+    {
+    public:
+        EString envelope;
+        EString body;
+        EString bodystructure;
+    };
+    bool summarisable;
+    Query * findSummaries;
+    HashMap<Summary> summaries;
+    EStringList newIds;
+    EStringList newEnvelopes;
+    EStringList newBodies;
+    EStringList newBodystructures;
+
+    bool raw;
+
+    class Range
+        : public Garbage
+    {
+    public:
+        Range( Section * s ): section( s ), start( 0 ), q( 0 ) {}
+        Section * section;
+        uint start;
+        Query * q;
+        Map<EString> chunks;
+    };
+    bool rangedBody;
+    List<Range> ranges;
+    Fetcher * rangeFetcher;
+    IntegerSet rangeFallback;
+
+    bool preview;
+    bool previewLazy;
+    Query * findPreviews;
+    HashMap<UString> previews;
+    Fetcher * previewFetcher;
+    EStringList newPreviewIds;
+    UStringList newPreviews;
 };
 
 
+/* Finds the bytes of stored bodypart data that are needed to answer
+   the partial fetch \a s, and sets \a start and \a end to delimit
+   them. BINARY sends the stored data as is. BODY sends a base64
+   encoding with 54 bytes (72 output characters and CRLF) per line,
+   so the range is widened to whole lines of input.
+*/
+
+static void storedRange( Section * s, uint & start, uint & end )
+{
+    int64 o = s->offset;
+    int64 e = o + s->length;
+    if ( !s->binary && s->length ) {
+        int64 k0 = o / 74;
+        int64 k1 = ( e - 1 ) / 74;
+        o = 54 * k0;
+        if ( e < 54 * ( k1 + 1 ) )
+            e = 54 * ( k1 + 1 );
+    }
+    if ( e > UINT_MAX / 2 )
+        e = UINT_MAX / 2;
+    if ( o > e )
+        o = e;
+    start = (uint)o;
+    end = (uint)e;
+}
+
+
+/* Offers \a summary, the summary of the message with database ID \a
+   id, to the SharedCache, so that other processes needn't look for it
+   in the database. The three strings are separated by NULs.
+*/
+
+static void shareSummary( uint id, FetchData::Summary * summary )
+{
+    if ( !SharedCache::enabled() ||
+         summary->envelope.contains( '\0' ) ||
+         summary->body.contains( '\0' ) ||
+         summary->bodystructure.contains( '\0' ) )
+        return;
+    EString s;
+    s.reserve( summary->envelope.length() + summary->body.length() +
+               summary->bodystructure.length() + 2 );
+    s.append( summary->envelope );
+    s.append( '\0' );
+    s.append( summary->body );
+    s.append( '\0' );
+    s.append( summary->bodystructure );
+    SharedCache::insert( SharedCache::Summary, id, s );
+}
+
+
 /*! \class Fetch fetch.h
 
     Returns message data (RFC 3501, section 6.4.5, extended by RFC
@@ -247,6 +356,26 @@ void Fetch::parse()
         require( ")" );
     }
     end();
+    // if only ENVELOPE, BODY and BODYSTRUCTURE need the header,
+    // addresses and part numbers, message_summaries may do instead.
+    if ( ( d->envelope || d->body || d->bodystructure ) &&
+         !d->needsHeader && !d->needsAddresses &&
+         !d->needsBody && !d->needsPartNumbers &&
+         imap() && !imap()->clientSupports( IMAP::Unicode ) )
+        d->summarisable = true;
+    // if all we send is whole messages, the raw text stored at
+    // injection time may do instead of the header and bodies.
+    if ( !d->sections.isEmpty() &&
+         !d->envelope && !d->body && !d->bodystructure ) {
+        d->raw = true;
+        List<Section>::Iterator s( d->sections );
+        while ( s && d->raw ) {
+            if ( s->id != "rfc822" &&
+                 !( s->id.isEmpty() && s->part.isEmpty() ) )
+                d->raw = false;
+            ++s;
+        }
+    }
     if ( d->envelope ) {
         d->needsHeader = true;
         d->needsAddresses = true;
@@ -261,6 +390,20 @@ void Fetch::parse()
     }
     if ( d->needsBody )
         d->needsHeader = true; // Bodypart::asText() needs mime type etc
+    // if every body we need is a byte range of a single bodypart, we
+    // may be able to fetch just those bytes.
+    if ( d->needsBody ) {
+        d->rangedBody = true;
+        List<Section>::Iterator s( d->sections );
+        while ( s && d->rangedBody ) {
+            if ( s->needsBody &&
+                 ( !s->partial || s->part.isEmpty() || !s->id.isEmpty() ) )
+                d->rangedBody = false;
+            ++s;
+        }
+        if ( d->rangedBody )
+            d->needsBody = false;
+    }
     if ( !ok() )
         return;
     EStringList l;
@@ -271,6 +414,8 @@ void Fetch::parse()
         l.append( "header" );
     if ( d->needsBody )
         l.append( "body" );
+    else if ( d->rangedBody )
+        l.append( "body ranges" );
     if ( d->flags )
         l.append( "flags" );
     if ( d->internaldate || d->rfc822size || d->databaseId || d->threadId )
@@ -279,6 +424,8 @@ void Fetch::parse()
         l.append( "bytes/lines" );
     if ( d->annotation )
         l.append( "annotations" );
+    if ( d->preview )
+        l.append( "preview" );
     log( l.join( " " ) );
 }
 
@@ -403,6 +550,14 @@ void Fetch::parseAttribute( bool alsoMacro )
     else if ( keyword == "thrid" ) {
         d->threadId = true;
     }
+    else if ( keyword == "preview" ) {
+        // RFC 8970
+        d->preview = true;
+        if ( present( " (lazy" ) ) {
+            d->previewLazy = true;
+            require( ")" );
+        }
+    }
     else {
         error( Bad, "expected fetch attribute, saw word " + keyword );
     }
@@ -678,8 +833,12 @@ void Fetch::execute()
     if ( d->state == 0 ) {
         if ( !transaction() &&
              ( !d->peek ||
-               ( d->modseq && ( d->flags || d->annotation || d->vanished ) ) ) )
+               ( d->modseq &&
+                 ( d->flags || d->annotation || d->vanished ) ) ) ) {
             setTransaction( new Transaction( this ) );
+            // all we write is \seen
+            transaction()->setDurability( Transaction::Relaxed );
+        }
 
         if ( d->vanished && d->changedSince > 0 && !d->deleted ) {
             d->deleted = new Query( "select uid from deleted_messages "
@@ -697,7 +856,16 @@ void Fetch::execute()
         Mailbox * mb = s->mailbox();
         if ( !d->those ) {
             d->set = d->set.intersection( session()->messages() );
-            if ( d->changedSince ) {
+            if ( d->changedSince && d->peek &&
+                 !d->needsAddresses && !d->needsHeader &&
+                 !d->needsBody && !d->needsPartNumbers &&
+                 !d->rfc822size && !d->internaldate &&
+                 !d->databaseId && !d->threadId && !d->preview )
+                useFlagSnapshot();
+            if ( d->fromSnapshot ) {
+                // the SessionInitialiser already fetched it all
+            }
+            else if ( d->changedSince ) {
                 d->those = new Query( "select uid, message "
                                       "from mailbox_messages "
                                       "where mailbox=$1 and uid=any($2) "
@@ -710,7 +878,7 @@ void Fetch::execute()
                       d->needsAddresses || d->needsHeader ||
                       d->needsBody || d->needsPartNumbers ||
                       d->rfc822size || d->internaldate ||
-                      d->databaseId || d->threadId ) {
+                      d->databaseId || d->threadId || d->preview ) {
                 IntegerSet r;
                 IntegerSet s( d->set );
                 while ( !s.isEmpty() ) {
@@ -776,7 +944,7 @@ void Fetch::execute()
                 }
             }
         }
-        else {
+        else if ( !d->fromSnapshot ) {
             IntegerSet r( d->set );
             while ( !r.isEmpty() ) {
                 uint uid = r.smallest();
@@ -835,14 +1003,46 @@ void Fetch::execute()
         }
     }
 
+    if ( d->state == 3 && d->summarisable ) {
+        if ( !d->findSummaries )
+            sendSummaryQuery();
+        if ( d->findSummaries && !d->findSummaries->done() )
+            return;
+        while ( d->findSummaries && d->findSummaries->hasResults() ) {
+            Row * r = d->findSummaries->nextRow();
+            FetchData::Summary * summary = new FetchData::Summary;
+            summary->envelope = r->getEString( "envelope" );
+            summary->body = r->getEString( "body" );
+            summary->bodystructure = r->getEString( "bodystructure" );
+            d->summaries.insert( r->getInt( "message" ), summary );
+            shareSummary( r->getInt( "message" ), summary );
+        }
+    }
+
+    if ( d->state == 3 && d->preview ) {
+        if ( !d->findPreviews )
+            sendPreviewQuery();
+        if ( !d->findPreviews->done() )
+            return;
+        while ( d->findPreviews->hasResults() ) {
+            Row * r = d->findPreviews->nextRow();
+            d->previews.insert( r->getInt( "message" ),
+                                new UString( r->getUString( "preview" ) ) );
+        }
+        if ( !d->previewLazy )
+            fetchPreviewBodies();
+    }
+
     if ( d->state == 3 ) {
         d->state = 4;
         sendFetchQueries();
-        if ( d->flags )
+        if ( d->rangedBody )
+            sendRangeQueries();
+        if ( d->flags && !d->fromSnapshot )
             sendFlagQuery();
         if ( d->annotation )
             sendAnnotationsQuery();
-        if ( d->modseq )
+        if ( d->modseq && !d->fromSnapshot )
             sendModSeqQuery();
         if ( transaction() )
             transaction()->commit();
@@ -860,11 +1060,83 @@ void Fetch::execute()
         s->recordExpungedFetch( d->expunged );
         error( No, "UID(s) " + d->expunged.set() + " has/have been expunged" );
     }
+    readAhead();
     finish();
 }
 
 
+/*! Starts reading ahead if fetch-read-ahead allows it and the client
+    has nothing else pending, so that the likely next FETCH finds its
+    messages in the MessageCache.
+
+    Two guesses are made: A client which fetched the headers of a
+    range will often fetch the bodies next, and a client which is
+    synchronising a mailbox will fetch the same items for the next
+    range of the same size.
+*/
+
+void Fetch::readAhead()
+{
+    uint budget = ReadAhead::available( imap() );
+    if ( !budget || d->set.isEmpty() )
+        return;
+
+    List<Command>::Iterator c( imap()->commands() );
+    while ( c ) {
+        if ( c != this && c->state() != Finished )
+            return;
+        ++c;
+    }
+
+    if ( d->needsHeader && !d->needsBody && !d->rangedBody ) {
+        IntegerSet uids;
+        IntegerSet s( d->set );
+        while ( !s.isEmpty() && uids.count() < budget ) {
+            uint uid = s.smallest();
+            s.remove( uid );
+            uids.add( uid );
+        }
+        List<Fetcher::Type> types;
+        types.append( new Fetcher::Type( Fetcher::Body ) );
+        (void)new ReadAhead( imap(), uids, &types );
+        budget -= uids.count();
+    }
+
+    List<Fetcher::Type> types;
+    if ( d->needsAddresses )
+        types.append( new Fetcher::Type( Fetcher::Addresses ) );
+    if ( d->needsHeader )
+        types.append( new Fetcher::Type( Fetcher::OtherHeader ) );
+    if ( d->needsBody )
+        types.append( new Fetcher::Type( Fetcher::Body ) );
+    if ( d->needsPartNumbers )
+        types.append( new Fetcher::Type( Fetcher::PartNumbers ) );
+    if ( d->rfc822size || d->internaldate || d->databaseId || d->threadId )
+        types.append( new Fetcher::Type( Fetcher::Trivia ) );
+    if ( types.isEmpty() || !budget )
+        return;
+
+    ImapSession * s = session();
+    uint msn = s->msn( d->set.largest() );
+    uint n = d->set.count();
+    if ( n > budget )
+        n = budget;
+    IntegerSet uids;
+    while ( msn && msn < s->count() && uids.count() < n ) {
+        msn++;
+        uids.add( s->uid( msn ) );
+    }
+    if ( !uids.isEmpty() )
+        (void)new ReadAhead( imap(), uids, &types );
+}
+
+
 /*! Issues queries to resolve any questions this FETCH needs to answer.
+
+    If another FETCH in the same group is still fetching the same
+    kinds of data, this one adds its messages to that Fetcher instead
+    of starting its own, so that pipelined FETCH commands for several
+    ranges share queries. The responses are still sent in order.
 */
 
 void Fetch::sendFetchQueries()
@@ -876,11 +1148,25 @@ void Fetch::sendFetchQueries()
     bool haveTrivia = true;
 
     List<Message> * l = new List<Message>;
+    List<Message> * summarised = new List<Message>;
+    bool summarisedTrivia = true;
 
     Map<Message>::Iterator i( d->messages );
     while ( i ) {
         Message * m = i;
         ++i;
+        if ( d->summaries.find( m->databaseId() ) ) {
+            if ( !m->hasTrivia() )
+                summarisedTrivia = false;
+            summarised->append( m );
+            continue;
+        }
+        if ( d->raw && !m->rawText().isEmpty() ) {
+            if ( !m->hasTrivia() )
+                haveTrivia = false;
+            l->append( m );
+            continue;
+        }
         if ( !m->hasAddresses() )
             haveAddresses = false;
         if ( !m->hasHeaders() )
@@ -894,19 +1180,172 @@ void Fetch::sendFetchQueries()
         l->append( m );
     }
 
-    Fetcher * f = new Fetcher( l, this, imap() );
+    List<Fetcher::Type> types;
     if ( d->needsAddresses && !haveAddresses )
-        f->fetch( Fetcher::Addresses );
+        types.append( new Fetcher::Type( Fetcher::Addresses ) );
     if ( d->needsHeader && !haveHeader )
-        f->fetch( Fetcher::OtherHeader );
+        types.append( new Fetcher::Type( Fetcher::OtherHeader ) );
     if ( d->needsBody && !haveBody )
-        f->fetch( Fetcher::Body );
+        types.append( new Fetcher::Type( Fetcher::Body ) );
     if ( ( d->rfc822size || d->internaldate ||
            d->databaseId || d->threadId ) && !haveTrivia )
-        f->fetch( Fetcher::Trivia );
+        types.append( new Fetcher::Type( Fetcher::Trivia ) );
     if ( d->needsPartNumbers && !havePartNumbers )
-        f->fetch( Fetcher::PartNumbers );
-    f->execute();
+        types.append( new Fetcher::Type( Fetcher::PartNumbers ) );
+    if ( d->raw && !types.isEmpty() )
+        types.append( new Fetcher::Type( Fetcher::Raw ) );
+
+    // messages with summaries may still need the trivia
+    if ( ( d->rfc822size || d->internaldate ||
+           d->databaseId || d->threadId ) && !summarisedTrivia ) {
+        Fetcher * f = new Fetcher( summarised, this, imap() );
+        f->fetch( Fetcher::Trivia );
+        f->execute();
+    }
+
+    if ( types.isEmpty() )
+        return;
+
+    List<Command>::Iterator c( imap()->commands() );
+    while ( c && !d->fetcher ) {
+        Fetch * f = 0;
+        if ( c != this && c->group() == group() &&
+             c->state() == Executing &&
+             ( c->name() == "fetch" || c->name() == "uid fetch" ) )
+            f = (Fetch *)((Command *)c);
+        ++c;
+        if ( f && f->d->fetcher && !f->d->fetcher->done() ) {
+            // a Fetcher that fetches raw text skips the other types
+            // for messages that have it
+            bool covered = d->raw ||
+                           !f->d->fetcher->fetching( Fetcher::Raw );
+            List<Fetcher::Type>::Iterator t( types );
+            while ( t && covered ) {
+                if ( !f->d->fetcher->fetching( *t ) &&
+                     !( *t == Fetcher::PartNumbers &&
+                        f->d->fetcher->fetching( Fetcher::Body ) ) )
+                    covered = false;
+                ++t;
+            }
+            if ( covered ) {
+                log( "Sharing message fetch with " + f->tag() );
+                d->fetcher = f->d->fetcher;
+                d->fetcher->addOwner( this );
+                d->fetcher->addMessages( l );
+            }
+        }
+    }
+
+    // a running Fetcher picks up added messages when its current
+    // batch is done, so we only need to start our own.
+    if ( d->fetcher )
+        return;
+
+    d->fetcher = new Fetcher( l, this, imap() );
+    List<Fetcher::Type>::Iterator t( types );
+    while ( t ) {
+        d->fetcher->fetch( *t );
+        ++t;
+    }
+    d->fetcher->execute();
+}
+
+
+/*! Sends one query for each partial BODY[part] or BINARY[part]
+    section, asking for just the stored bytes needed to answer it.
+
+    rangedData() turns the result into the response, for those
+    bodyparts whose encoded form can be computed from a slice of the
+    stored data. pickup() fetches the whole bodies of other messages.
+*/
+
+void Fetch::sendRangeQueries()
+{
+    IntegerSet ids;
+    Map<Message>::Iterator i( d->messages );
+    while ( i ) {
+        if ( !i->hasBodies() )
+            ids.add( i->databaseId() );
+        ++i;
+    }
+
+    List<Section>::Iterator s( d->sections );
+    while ( s ) {
+        if ( s->needsBody ) {
+            FetchData::Range * r = new FetchData::Range( s );
+            d->ranges.append( r );
+            uint end = 0;
+            storedRange( s, r->start, end );
+            if ( !ids.isEmpty() && end > r->start ) {
+                r->q = new Query( "select pn.message, bp.hash, "
+                                  "substring(bp.data from $2 for $3) "
+                                  "as data "
+                                  "from part_numbers pn "
+                                  "join bodyparts bp on (pn.bodypart=bp.id) "
+                                  "where pn.message=any($1) and pn.part=$4 "
+                                  "and bp.text is null "
+                                  "and not bp.compressed", this );
+                r->q->bind( 1, ids );
+                r->q->bind( 2, r->start + 1 );
+                r->q->bind( 3, end - r->start );
+                r->q->bind( 4, s->part );
+                enqueue( r->q );
+            }
+        }
+        ++s;
+    }
+}
+
+
+/*! Returns true if the partial section \a s can be answered for \a m
+    using the bytes fetched by sendRangeQueries(), and if so, sets \a
+    data to the response data and \a s's item.
+
+    Only leaf parts that aren't text and aren't quoted-printable are
+    answered this way: Their encoded form can be computed from the
+    stored bytes alone. Everything else needs the whole bodypart, and
+    this function returns false.
+*/
+
+bool Fetch::rangedData( Section * s, Message * m, EString & data )
+{
+    if ( !d->rangedBody || !s->needsBody )
+        return false;
+    FetchData::Range * r = 0;
+    List<FetchData::Range>::Iterator i( d->ranges );
+    while ( i && !r ) {
+        if ( i->section == s )
+            r = i;
+        ++i;
+    }
+    if ( !r )
+        return false;
+    EString * chunk = r->chunks.find( m->databaseId() );
+    Bodypart * bp = m->bodypart( s->part, false );
+    if ( !chunk || !bp || !bp->header() )
+        return false;
+    ContentType * ct = bp->contentType();
+    if ( !ct || ct->type() == "text" ||
+         ct->type() == "multipart" || ct->type() == "message" )
+        return false;
+
+    EString::Encoding e = bp->contentTransferEncoding();
+    if ( s->binary || e != EString::Base64 ) {
+        if ( !s->binary && e == EString::QP )
+            return false;
+        data = chunk->mid( s->offset - r->start, s->length );
+    }
+    else {
+        uint k0 = s->offset / 74;
+        uint end = 0;
+        storedRange( s, r->start, end );
+        data = chunk->mid( 0, end - r->start ).e64( 70 )
+               .mid( s->offset - 74 * k0, s->length );
+    }
+
+    s->item = ( s->binary ? "BINARY[" : "BODY[" ) + s->part + "]<" +
+              fn( s->offset ) + ">";
+    return true;
 }
 
 
@@ -1083,149 +1522,267 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 }
 
 
-/* This function returns the response data for an element in
-   d->sections, to be included in the FETCH response by
-   fetchResponses() below. If \a unicode is false, the result will be
-   downgraded rather than contain unicode.
+// section data at least this long is handed to the Buffer as is,
+// which shares rather than copies strings of this size
+static const uint largeLiteral = 8192;
+
+
+/*  Appends a space to \a r unless nothing has been appended since \a
+    start, i.e. separates one FETCH data item from the previous.
 */
 
-static EString sectionResponse( Section * s, Message * m, bool unicode )
+static void separate( EString & r, uint start )
 {
-    EString data( Fetch::sectionData( s, m, unicode ) );
-    if ( !s->item.startsWith( "BINARY.SIZE" ) )
-        data = Command::imapQuoted( data, Command::NString );
-    EString r;
-    r.reserve( data.length() + s->item.length() + 1 );
-    r.append( s->item );
-    r.append( " " );
-    r.append( data );
-    return r;
+    if ( r.length() > start )
+        r.append( ' ' );
 }
 
 
-/*! Emits a single FETCH response for the message \a m, which is
-    trusted to have UID \a uid and MSN \a msn.
-
-    The message must have all necessary content.
+/*  Returns a guess at the length of a FETCH response for one message
+    of \a d, whose summary is \a s (or a null pointer if there's no
+    summary), so that the response is usually built in one allocation.
 */
 
-EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
+static uint responseSize( FetchData * d, FetchData::Summary * s )
 {
-    EStringList l;
-    if ( d->uid )
-        l.append( "UID " + fn( uid ) );
-    if ( d->databaseId )
-        l.append( "MSGID " + fn( m->databaseId() ) );
-    if ( d->threadId )
-        l.append( "THRID " + fn( m->threadId() ) );
-    if ( d->rfc822size )
-        l.append( "RFC822.SIZE " + fn( m->rfc822Size() ) );
+    uint n = 64;
     if ( d->flags )
-        l.append( "FLAGS (" + flagList( uid ) + ")" );
+        n += 64;
     if ( d->internaldate )
-        l.append( "INTERNALDATE " + internalDate( m ) );
+        n += 32;
     if ( d->envelope )
-        l.append( "ENVELOPE " + envelope( m ) );
+        n += s ? s->envelope.length() : 400;
     if ( d->body )
-        l.append( "BODY " + bodyStructure( m, false ) );
+        n += s ? s->body.length() : 200;
     if ( d->bodystructure )
-        l.append( "BODYSTRUCTURE " + bodyStructure( m, true ) );
+        n += s ? s->bodystructure.length() : 300;
     if ( d->annotation )
-        l.append( "ANNOTATION " + annotation( imap()->user(), uid,
-                                              d->entries, d->attribs ) );
+        n += 128;
+    if ( d->preview )
+        n += 256;
+    return n;
+}
+
+
+/*! Writes a single FETCH response for the message \a m, which is
+    trusted to have UID \a uid and MSN \a msn, to \a w.
+
+    The message must have all necessary content.
+
+    The small items are built in one string. Large section data is
+    appended to \a w by itself after its literal prefix, so that a
+    big BODY[] is not copied into the response string.
+*/
+
+void Fetch::writeFetchResponse( Buffer * w, Message * m, uint uid, uint msn )
+{
+    FetchData::Summary * summary = 0;
+    if ( d->summarisable )
+        summary = d->summaries.find( m->databaseId() );
+    bool unicode = imap()->clientSupports( IMAP::Unicode );
+
+    // this is called once per message, so we build the response in
+    // place rather than via an EStringList and join(): that would
+    // leave a list node and a copy of each item for the collector.
+    EString r;
+    r.reserve( responseSize( d, summary ) );
+    r.append( "* " );
+    r.appendNumber( msn );
+    r.append( " FETCH (" );
+    uint start = r.length();
+
+    if ( d->uid ) {
+        r.append( "UID " );
+        r.appendNumber( uid );
+    }
+    if ( d->databaseId ) {
+        separate( r, start );
+        r.append( "MSGID " );
+        r.appendNumber( m->databaseId() );
+    }
+    if ( d->threadId ) {
+        separate( r, start );
+        r.append( "THRID " );
+        r.appendNumber( m->threadId() );
+    }
+    if ( d->rfc822size ) {
+        separate( r, start );
+        r.append( "RFC822.SIZE " );
+        r.appendNumber( m->rfc822Size() );
+    }
+    if ( d->flags ) {
+        separate( r, start );
+        r.append( "FLAGS (" );
+        appendFlags( r, uid );
+        r.append( ")" );
+    }
+    if ( d->internaldate ) {
+        separate( r, start );
+        r.append( "INTERNALDATE " );
+        appendInternalDate( r, m );
+    }
+    if ( d->envelope ) {
+        separate( r, start );
+        r.append( "ENVELOPE " );
+        if ( summary )
+            r.append( summary->envelope );
+        else
+            appendEnvelope( r, m, unicode );
+    }
+    if ( d->body ) {
+        separate( r, start );
+        r.append( "BODY " );
+        if ( summary )
+            r.append( summary->body );
+        else
+            appendBodyStructure( r, m, false, unicode );
+    }
+    if ( d->bodystructure ) {
+        separate( r, start );
+        r.append( "BODYSTRUCTURE " );
+        if ( summary )
+            r.append( summary->bodystructure );
+        else
+            appendBodyStructure( r, m, true, unicode );
+    }
+    if ( d->annotation ) {
+        separate( r, start );
+        r.append( "ANNOTATION " );
+        r.append( annotation( imap()->user(), uid,
+                              d->entries, d->attribs ) );
+    }
+    if ( d->preview ) {
+        separate( r, start );
+        r.append( "PREVIEW " );
+        UString * p = d->previews.find( m->databaseId() );
+        if ( p )
+            appendQuoted( r, p->utf8() );
+        else
+            r.append( "NIL" );
+    }
     if ( d->modseq ) {
         FetchData::DynamicData * dd = d->dynamics.find( uid );
-        if ( dd && dd->modseq )
-            l.append( "MODSEQ (" + fn( dd->modseq ) + ")" );
+        if ( dd && dd->modseq ) {
+            separate( r, start );
+            r.append( "MODSEQ (" );
+            r.appendNumber( dd->modseq );
+            r.append( ")" );
+        }
     }
 
     List< Section >::Iterator it( d->sections );
-    bool unicode = imap()->clientSupports( IMAP::Unicode );
+    bool flushed = false;
     while ( it ) {
-        l.append( sectionResponse( it, m, unicode ) );
+        if ( flushed )
+            r.append( ' ' );
+        else
+            separate( r, start );
+        EString data;
+        if ( !rangedData( it, m, data ) )
+            data = sectionData( it, m, unicode );
+        r.append( it->item );
+        r.append( ' ' );
+        if ( it->item.startsWith( "BINARY.SIZE" ) ) {
+            r.append( data );
+        }
+        else if ( data.length() < largeLiteral ) {
+            appendQuoted( r, data, NString );
+        }
+        else {
+            if ( data.contains( 0 ) )
+                r.append( '~' );
+            r.append( '{' );
+            r.appendNumber( data.length() );
+            r.append( "}\r\n" );
+            w->append( r );
+            w->append( data );
+            r.truncate();
+            flushed = true;
+        }
         ++it;
     }
 
-    EString r;
-    EString payload = l.join( " " );
-    r.reserve( payload.length() + 30 );
-    r.appendNumber( msn );
-    r.append( " FETCH (" );
-    r.append( payload );
-    r.append( ")" );
-    return r;
+    r.append( ")\r\n" );
+    w->append( r );
 }
 
 
-/*! Returns a string containing all the flags that are set for the
-    message with \a uid.
+/*! Appends all the flags that are set for the message with \a uid to
+    \a r, separated by spaces.
 */
 
-EString Fetch::flagList( uint uid )
+void Fetch::appendFlags( EString & r, uint uid )
 {
-    EStringList r;
-
     FetchData::DynamicData * dd = d->dynamics.find( uid );
-    if ( dd ) {
-        if ( session()->isRecent( uid ) )
-            dd->flags.insert( "\\recent", new EString( "\\Recent" ) );
-        Dict<EString>::Iterator i( dd->flags );
-        while ( i ) {
-            r.append( *i );
-            ++i;
-        }
-    }
+    if ( !dd )
+        return;
 
-    return r.join( " " );
+    if ( session()->isRecent( uid ) )
+        dd->flags.insert( "\\recent", new EString( "\\Recent" ) );
+    uint start = r.length();
+    Dict<EString>::Iterator i( dd->flags );
+    while ( i ) {
+        separate( r, start );
+        r.append( *i );
+        ++i;
+    }
 }
 
 
-/*! Returns the internaldate of \a m in IMAP format. */
+/*! Appends the internaldate of \a m in IMAP format to \a r. */
 
-EString Fetch::internalDate( Message * m )
+void Fetch::appendInternalDate( EString & r, Message * m )
 {
     Date date;
     date.setUnixTime( m->internalDate() );
-    return "\"" + date.imap() + "\"";
+    r.append( '"' );
+    r.append( date.imap() );
+    r.append( '"' );
 }
 
 
-static EString hf( Header * f, HeaderField::Type t, bool unicodable )
+/*  Appends the addresses in the \a t field of \a f to \a r, followed
+    by a space, as part of an envelope. \a unicodable is true if the
+    client can accept UTF-8.
+*/
+
+static void appendAddresses( EString & r, Header * f, HeaderField::Type t,
+                             bool unicodable )
 {
     List<Address> * a = f->addresses( t );
-    if ( !a || a->isEmpty() )
-        return "NIL ";
-    EString r;
-    r.reserve( 50 );
+    if ( !a || a->isEmpty() ) {
+        r.append( "NIL " );
+        return;
+    }
     r.append( "(" );
     List<Address>::Iterator it( a );
     while ( it ) {
         r.append( "(" );
         if ( it->type() == Address::EmptyGroup ) {
             r.append( "NIL NIL " );
-            r.append( Command::imapQuoted( it->name( !unicodable ),
-                                           Command::NString ) );
+            Command::appendQuoted( r, it->name( !unicodable ),
+                                   Command::NString );
             r.append( " NIL)(NIL NIL NIL NIL" );
         } else if ( it->type() == Address::Local ||
                     it->type() == Address::Normal ) {
             UString u = it->uname();
-            EString eu;
             if ( u.isAscii() || unicodable )
-                eu = u.simplified().utf8();
+                Command::appendQuoted( r, u.simplified().utf8(),
+                                       Command::NString );
             else
-                eu = HeaderField::encodePhrase( u );
-            r.append( Command::imapQuoted( eu, Command::NString ) );
+                Command::appendQuoted( r, HeaderField::encodePhrase( u ),
+                                       Command::NString );
             r.append( " NIL " );
             if ( unicodable ||
                  ( it->localpart().isAscii() && it->domain().isAscii() ) ) {
-                r.append( Command::imapQuoted( it->localpart().utf8(),
-                                               Command::NString ) );
+                Command::appendQuoted( r, it->localpart().utf8(),
+                                       Command::NString );
                 r.append( " " );
                 if ( it->domain().isEmpty() )
                     r.append( "\" \"" ); // RFC 3501, page 77 near bottom
                 else
-                    r.append( Command::imapQuoted( it->domain().utf8(),
-                                                   Command::NString ) );
+                    Command::appendQuoted( r, it->domain().utf8(),
+                                           Command::NString );
             }
             else {
                 r.append( "noreply unicode-needed.invalid" );
@@ -1235,13 +1792,14 @@ static EString hf( Header * f, HeaderField::Type t, bool unicodable )
         ++it;
     }
     r.append( ") " );
-    return r;
 }
 
 
-/*! Returns the IMAP envelope for \a m. */
+/*! Appends the IMAP envelope for \a m to \a r. If \a unicode is true,
+    the client can accept UTF-8 in addresses.
+*/
 
-EString Fetch::envelope( Message * m )
+void Fetch::appendEnvelope( EString & r, Message * m, bool unicode )
 {
     Header * h = m->header();
 
@@ -1249,106 +1807,114 @@ EString Fetch::envelope( Message * m )
     //                env-sender SP env-reply-to SP env-to SP env-cc SP
     //                env-bcc SP env-in-reply-to SP env-message-id ")"
 
-    EString r;
-    r.reserve( 300 );
+    r.reserve( r.length() + 300 );
     r.append( "(" );
 
     Date * date = h->date();
     if ( date )
-        r.append( imapQuoted( date->rfc822(), NString ) );
+        appendQuoted( r, date->rfc822(), NString );
     else
         r.append( "NIL" );
     r.append( " " );
 
-    r.append( imapQuoted( h->subject(), NString ) + " " );
-    bool unicode = imap()->clientSupports( IMAP::Unicode );
-    r.append( hf( h, HeaderField::From, unicode ) );
-    r.append( hf( h, HeaderField::Sender, unicode ) );
-    r.append( hf( h, HeaderField::ReplyTo, unicode ) );
-    r.append( hf( h, HeaderField::To, unicode ) );
-    r.append( hf( h, HeaderField::Cc, unicode ) );
-    r.append( hf( h, HeaderField::Bcc, unicode ) );
-    r.append( imapQuoted( h->inReplyTo(), NString ) + " " );
-    r.append( imapQuoted( h->messageId(), NString ) );
+    appendQuoted( r, h->subject(), NString );
+    r.append( " " );
+    appendAddresses( r, h, HeaderField::From, unicode );
+    appendAddresses( r, h, HeaderField::Sender, unicode );
+    appendAddresses( r, h, HeaderField::ReplyTo, unicode );
+    appendAddresses( r, h, HeaderField::To, unicode );
+    appendAddresses( r, h, HeaderField::Cc, unicode );
+    appendAddresses( r, h, HeaderField::Bcc, unicode );
+    appendQuoted( r, h->inReplyTo(), NString );
+    r.append( " " );
+    appendQuoted( r, h->messageId(), NString );
 
     r.append( ")" );
-    return r;
 }
 
 
-static EString parameterEString( MimeField *mf )
+/*  Appends the body-fld-param of \a mf to \a r. */
+
+static void appendParameters( EString & r, MimeField *mf )
 {
     EStringList *p = 0;
 
     if ( mf )
         p = mf->parameters();
-    if ( !mf || !p || p->isEmpty() )
-        return "NIL";
+    if ( !mf || !p || p->isEmpty() ) {
+        r.append( "NIL" );
+        return;
+    }
 
-    EStringList l;
+    r.append( "(" );
+    uint start = r.length();
     EStringList::Iterator it( p );
     while ( it ) {
-        l.append( Command::imapQuoted( *it ) );
-        l.append( Command::imapQuoted( mf->parameter( *it ) ) );
+        separate( r, start );
+        Command::appendQuoted( r, *it );
+        r.append( " " );
+        Command::appendQuoted( r, mf->parameter( *it ) );
         ++it;
     }
-
-    EString r = l.join( " " );
-    r.prepend( "(" );
     r.append( ")" );
-    return r;
 }
 
 
-static EString dispositionEString( ContentDisposition *cd )
+/*  Appends the body-fld-dsp for \a cd to \a r. */
+
+static void appendDisposition( EString & r, ContentDisposition *cd )
 {
-    if ( !cd )
-        return "NIL";
+    if ( !cd ) {
+        r.append( "NIL" );
+        return;
+    }
 
-    EString s;
     switch ( cd->disposition() ) {
     case ContentDisposition::Inline:
-        s = "inline";
+        r.append( "(\"inline\" " );
         break;
     case ContentDisposition::Attachment:
-        s = "attachment";
+        r.append( "(\"attachment\" " );
         break;
     }
-
-    return "(\"" + s + "\" " + parameterEString( cd ) + ")";
+    appendParameters( r, cd );
+    r.append( ")" );
 }
 
 
-static EString languageEString( ContentLanguage *cl )
+/*  Appends the body-fld-lang for \a cl to \a r. */
+
+static void appendLanguages( EString & r, ContentLanguage *cl )
 {
-    if ( !cl )
-        return "NIL";
+    if ( !cl ) {
+        r.append( "NIL" );
+        return;
+    }
 
-    EStringList m;
     const EStringList *l = cl->languages();
+    if ( l->count() != 1 )
+        r.append( "(" );
+    uint start = r.length();
     EStringList::Iterator it( l );
     while ( it ) {
-        m.append( Command::imapQuoted( *it ) );
+        separate( r, start );
+        Command::appendQuoted( r, *it );
         ++it;
     }
-
-    if ( l->count() == 1 )
-        return *m.first();
-    EString r = m.join( " " );
-    r.prepend( "(" );
-    r.append( ")" );
-    return r;
+    if ( l->count() != 1 )
+        r.append( ")" );
 }
 
 
-/*! Returns either the IMAP BODY or BODYSTRUCTURE production for \a
-    m. If \a extended is true, BODYSTRUCTURE is returned. If it's
-    false, BODY.
+/*! Appends either the IMAP BODY or BODYSTRUCTURE production for \a m
+    to \a r. If \a extended is true, BODYSTRUCTURE is appended. If
+    it's false, BODY. \a unicode is passed to appendEnvelope() for
+    any attached messages.
 */
 
-EString Fetch::bodyStructure( Multipart * m, bool extended )
+void Fetch::appendBodyStructure( EString & r, Multipart * m,
+                                 bool extended, bool unicode )
 {
-    EString r;
     bool isSigned = false;
     Multipart * ancestor = m;
     while ( ancestor->parent() != NULL )
@@ -1364,98 +1930,99 @@ EString Fetch::bodyStructure( Multipart * m, bool extended )
     Header * hdr = m->header();
     ContentType * ct = hdr->contentType();
     if ( ct && ct->type() == "multipart" ) {
-        EStringList children;
+        r.append( "(" );
         List< Bodypart >::Iterator it( m->children() );
         if ( ( m == ancestor ) && isSigned ) {  // if top level, consider raw part
             if ( !extended ) {
-                log( "Fetch::bodyStructure - append raw part", Log::Debug );
-                children.append( bodyStructure( it, extended ) );
+                ::log( "Fetch::bodyStructure - append raw part",
+                       Log::Debug );
+                appendBodyStructure( r, it, extended, unicode );
                 uint i;
                 for ( i = 1; i <= m->children()->count(); i++ )
                     ++it;
             } else {  // skip raw part
-                log( "Fetch::bodyStructure - skip raw part", Log::Debug );
+                ::log( "Fetch::bodyStructure - skip raw part", Log::Debug );
                 ++it;
             }
         }
         while ( it ) {
-            children.append( bodyStructure( it, extended ) );
+            appendBodyStructure( r, it, extended, unicode );
             ++it;
         }
 
-        r = children.join( "" );
-        r.prepend( "(" );
         r.append( " " );
-        r.append( imapQuoted( ct->subtype() ));
+        appendQuoted( r, ct->subtype() );
 
         if ( extended ) {
             r.append( " " );
-            r.append( parameterEString( ct ) );
+            appendParameters( r, ct );
             r.append( " " );
-            r.append( dispositionEString( hdr->contentDisposition() ) );
+            appendDisposition( r, hdr->contentDisposition() );
             r.append( " " );
-            r.append( languageEString( hdr->contentLanguage() ) );
+            appendLanguages( r, hdr->contentLanguage() );
             r.append( " " );
-            r.append( imapQuoted( hdr->contentLocation(), NString ) );
+            appendQuoted( r, hdr->contentLocation(), NString );
         }
 
         r.append( ")" );
     }
     else {
-        r = singlePartStructure( (Bodypart*)m, extended );
+        appendSinglePartStructure( r, (Bodypart*)m, extended, unicode );
     }
-    return r;
 }
 
 
-/*! Returns the structure of the single-part bodypart \a mp.
+/*! Appends the structure of the single-part bodypart \a mp to \a r.
 
     If \a extended is true, extended BODYSTRUCTURE attributes are
-    included.
+    included. \a unicode is as for appendBodyStructure().
 */
 
-EString Fetch::singlePartStructure( Multipart * mp, bool extended )
+void Fetch::appendSinglePartStructure( EString & r, Multipart * mp,
+                                       bool extended, bool unicode )
 {
-    EStringList l;
-
     if ( !mp )
-        return "";
+        return;
 
     ContentType * ct = mp->header()->contentType();
 
+    r.append( "(" );
     if ( ct ) {
-        l.append( imapQuoted( ct->type() ) );
-        l.append( imapQuoted( ct->subtype() ) );
+        appendQuoted( r, ct->type() );
+        r.append( " " );
+        appendQuoted( r, ct->subtype() );
     }
     else {
         // XXX: What happens to the default if this is a /digest?
-        l.append( "\"text\"" );
-        l.append( "\"plain\"" );
+        r.append( "\"text\" \"plain\"" );
     }
 
-    l.append( parameterEString( ct ) );
-    l.append( imapQuoted( mp->header()->messageId( HeaderField::ContentId ),
-                          NString ) );
-    l.append( imapQuoted( mp->header()->contentDescription(), NString ) );
+    r.append( " " );
+    appendParameters( r, ct );
+    r.append( " " );
+    appendQuoted( r, mp->header()->messageId( HeaderField::ContentId ),
+                  NString );
+    r.append( " " );
+    appendQuoted( r, mp->header()->contentDescription(), NString );
 
     if ( mp->header()->contentTransferEncoding() ) {
         switch( mp->header()->contentTransferEncoding()->encoding() ) {
         case EString::Binary:
-            l.append( "\"8BIT\"" ); // hm. is this entirely sound?
+            r.append( " \"8BIT\"" ); // hm. is this entirely sound?
             break;
         case EString::Uuencode:
-            l.append( "\"x-uuencode\"" ); // should never happen
+            r.append( " \"x-uuencode\"" ); // should never happen
             break;
         case EString::Base64:
-            l.append( "\"BASE64\"" );
+            r.append( " \"BASE64\"" );
             break;
         case EString::QP:
-            l.append( "\"QUOTED-PRINTABLE\"" );
+            r.append( " \"QUOTED-PRINTABLE\"" );
             break;
         }
     }
     else {
-        l.append( "\"7BIT\"" );
+        r.append( " \"7BIT\"" );
     }
 
     Bodypart * bp = 0;
@@ -1465,17 +2032,22 @@ EString Fetch::singlePartStructure( Multipart * mp, bool extended )
         bp = ((Message*)mp)->children()->first();
 
     if ( bp ) {
-        l.append( fn( bp->numEncodedBytes() ) );
+        r.append( " " );
+        r.appendNumber( bp->numEncodedBytes() );
         if ( ct && ct->type() == "message" && ct->subtype() == "rfc822" ) {
             // body-type-msg   = media-message SP body-fields SP envelope
             //                   SP body SP body-fld-lines
-            l.append( envelope( bp->message() ) );
-            l.append( bodyStructure( bp->message(), extended ) );
-            l.append( fn ( bp->numEncodedLines() ) );
+            r.append( " " );
+            appendEnvelope( r, bp->message(), unicode );
+            r.append( " " );
+            appendBodyStructure( r, bp->message(), extended, unicode );
+            r.append( " " );
+            r.appendNumber( bp->numEncodedLines() );
         }
         else if ( !ct || ct->type() == "text" ) {
             // body-type-text  = media-text SP body-fields SP body-fld-lines
-            l.append( fn( bp->numEncodedLines() ) );
+            r.append( " " );
+            r.appendNumber( bp->numEncodedLines() );
         }
     }
 
@@ -1485,16 +2057,17 @@ EString Fetch::singlePartStructure( Multipart * mp, bool extended )
         if ( f )
             md5 = f->rfc822( false );
 
-        l.append( imapQuoted( md5, NString ) );
-        l.append( dispositionEString( mp->header()->contentDisposition() ) );
-        l.append( languageEString( mp->header()->contentLanguage() ) );
-        l.append( imapQuoted( mp->header()->contentLocation(), NString ) );
+        r.append( " " );
+        appendQuoted( r, md5, NString );
+        r.append( " " );
+        appendDisposition( r, mp->header()->contentDisposition() );
+        r.append( " " );
+        appendLanguages( r, mp->header()->contentLanguage() );
+        r.append( " " );
+        appendQuoted( r, mp->header()->contentLocation(), NString );
     }
 
-    EString r = l.join( " " );
-    r.prepend( "(" );
     r.append( ")" );
-    return r;
 }
 
 
@@ -1654,6 +2227,18 @@ void Fetch::pickup()
                 dd->flags.insert( seenl, seen );
             if ( r->getBoolean( "deleted" ) )
                 dd->flags.insert( deletedl, deleted );
+            int64 bits = r->getBigint( "flagbits" );
+            uint f = 1;
+            while ( bits && f <= Flag::largestId() && f <= 64 ) {
+                int64 b = Flag::bit( f );
+                if ( bits & b ) {
+                    EString n = Flag::name( f );
+                    if ( !n.isEmpty() )
+                        dd->flags.insert( n.lower(), new EString( n ) );
+                    bits &= ~b;
+                }
+                f++;
+            }
         }
         while ( d->flagFetcher->hasResults() ) {
             Row * r = d->flagFetcher->nextRow();
@@ -1720,23 +2305,78 @@ void Fetch::pickup()
     if ( d->modseqFetcher && !d->modseqFetcher->done() )
         return;
 
+    List<DynamicLoader>::Iterator dl( d->loaders );
+    while ( dl ) {
+        if ( !dl->done() )
+            return;
+        if ( dl->failed() ) {
+            error( No, "Could not fetch flags, annotations or modseqs" );
+            return;
+        }
+        ++dl;
+    }
+    if ( !d->loaders.isEmpty() )
+        useDynamics();
+
+    List<FetchData::Range>::Iterator ri( d->ranges );
+    while ( ri ) {
+        while ( ri->q && ri->q->hasResults() ) {
+            Row * r = ri->q->nextRow();
+            EString * chunk = new EString;
+            if ( !r->isNull( "data" ) ) {
+                *chunk = r->getEString( "data" );
+            }
+            else if ( !r->isNull( "hash" ) ) {
+                uint end = 0;
+                storedRange( ri->section, ri->start, end );
+                *chunk = BlobStore::fetch( r->getEString( "hash" ),
+                                           ri->start, end - ri->start );
+            }
+            ri->chunks.insert( r->getInt( "message" ), chunk );
+        }
+        if ( ri->q && !ri->q->done() )
+            return;
+        ++ri;
+    }
+
+    if ( d->rangedBody && !d->rangeFetcher )
+        fetchUnrangedBodies();
+
     bool ok = true;
     uint done = 0;
     while ( ok && !d->remaining.isEmpty() ) {
         uint uid = d->remaining.smallest();
         Message * m = d->messages.find( uid );
-        if ( d->needsAddresses && !m->hasAddresses() )
+        bool summarised = d->summarisable &&
+                          d->summaries.find( m->databaseId() );
+        bool whole = summarised ||
+                     ( d->raw && !m->rawText().isEmpty() );
+        if ( d->needsAddresses && !whole && !m->hasAddresses() )
             ok = false;
-        if ( d->needsHeader && !m->hasHeaders() )
+        if ( d->needsHeader && !whole && !m->hasHeaders() )
             ok = false;
-        if ( d->needsPartNumbers && !m->hasBytesAndLines() )
+        if ( d->needsPartNumbers && !whole && !m->hasBytesAndLines() )
             ok = false;
-        if ( d->needsBody && !m->hasBodies() )
+        if ( d->needsBody && !whole && !m->hasBodies() )
+            ok = false;
+        if ( d->rangedBody && !d->rangeFetcher )
+            ok = false;
+        if ( d->preview && !d->previewLazy &&
+             !d->previews.find( m->databaseId() ) &&
+             ( !m->hasHeaders() || !m->hasBodies() ) )
+            ok = false;
+        if ( d->rangeFallback.contains( uid ) && !m->hasBodies() )
             ok = false;
         if ( ( d->rfc822size || d->internaldate ||
                d->databaseId || d->threadId ) && !m->hasTrivia() )
             ok = false;
         if ( ok ) {
+            if ( d->summarisable && !summarised &&
+                 ( d->body || d->bodystructure ) )
+                addSummary( m );
+            if ( d->preview && !d->previewLazy &&
+                 !d->previews.find( m->databaseId() ) )
+                addPreview( m );
             d->processed = uid;
             d->remaining.remove( uid );
             done++;
@@ -1744,6 +2384,9 @@ void Fetch::pickup()
         }
     }
 
+    storeSummaries();
+    storePreviews();
+
     if ( !done )
         return;
     log( "Processed " + fn( done ) + " messages", Log::Debug );
@@ -1751,6 +2394,47 @@ void Fetch::pickup()
 }
 
 
+/*! Looks for messages whose byte ranges rangedData() cannot answer,
+    and starts fetching the whole bodies of those. Does nothing until
+    all the headers are known, since the headers decide whether a
+    range can be used.
+*/
+
+void Fetch::fetchUnrangedBodies()
+{
+    List<Message> * l = new List<Message>;
+    IntegerSet r( d->remaining );
+    while ( !r.isEmpty() ) {
+        uint uid = r.smallest();
+        r.remove( uid );
+        Message * m = d->messages.find( uid );
+        if ( !m->hasHeaders() )
+            return;
+        if ( m->hasBodies() )
+            continue;
+        bool usable = true;
+        List<Section>::Iterator s( d->sections );
+        while ( s && usable ) {
+            EString data;
+            if ( s->needsBody && !rangedData( s, m, data ) )
+                usable = false;
+            ++s;
+        }
+        if ( !usable ) {
+            l->append( m );
+            d->rangeFallback.add( uid );
+        }
+    }
+
+    d->rangeFetcher = new Fetcher( l, this, imap() );
+    if ( l->isEmpty() )
+        return;
+    log( "Fetching " + fn( l->count() ) + " whole bodies", Log::Debug );
+    d->rangeFetcher->fetch( Fetcher::Body );
+    d->rangeFetcher->execute();
+}
+
+
 /*! \class ImapFetchResponse fetch.h
 
     The ImapFetchResponse class models a single FETCH response. Its
@@ -1771,11 +2455,22 @@ ImapFetchResponse::ImapFetchResponse( ImapSession * s,
 
 
 EString ImapFetchResponse::text() const
+{
+    Buffer * b = new Buffer;
+    if ( !write( b ) )
+        return "";
+    EString t = b->string( b->size() );
+    return t.mid( 2, t.length() - 4 );
+}
+
+
+bool ImapFetchResponse::write( Buffer * w ) const
 {
     uint msn = session()->msn( u );
-    if ( u && msn )
-        return f->makeFetchResponse( f->message( u ), u, msn );
-    return "";
+    if ( !u || !msn )
+        return false;
+    f->writeFetchResponse( w, f->message( u ), u, msn );
+    return true;
 }
 
 
@@ -1802,10 +2497,222 @@ void ImapFetchResponse::setSent()
 
 void Fetch::forget( uint uid )
 {
+    Message * m = d->messages.find( uid );
+    if ( m && d->summarisable )
+        d->summaries.remove( m->databaseId() );
+    if ( m && d->preview )
+        d->previews.remove( m->databaseId() );
+    if ( m && d->rangedBody ) {
+        List<FetchData::Range>::Iterator r( d->ranges );
+        while ( r ) {
+            r->chunks.remove( m->databaseId() );
+            ++r;
+        }
+    }
     d->messages.remove( uid );
 }
 
 
+/*! Looks in message_summaries for the ENVELOPE, BODY and
+    BODYSTRUCTURE of those messages that aren't fully in RAM already.
+*/
+
+void Fetch::sendSummaryQuery()
+{
+    IntegerSet ids;
+    Map<Message>::Iterator i( d->messages );
+    while ( i ) {
+        Message * m = i;
+        ++i;
+        if ( !m->databaseId() ||
+             ( m->hasHeaders() && m->hasAddresses() &&
+               ( !d->needsPartNumbers || m->hasBytesAndLines() ) ) )
+            continue;
+        EString s = SharedCache::find( SharedCache::Summary,
+                                       m->databaseId() );
+        int e = s.find( '\0' );
+        int b = -1;
+        if ( e >= 0 )
+            b = s.find( '\0', e + 1 );
+        if ( b > e ) {
+            FetchData::Summary * summary = new FetchData::Summary;
+            summary->envelope = s.mid( 0, e );
+            summary->body = s.mid( e + 1, b - e - 1 );
+            summary->bodystructure = s.mid( b + 1 );
+            d->summaries.insert( m->databaseId(), summary );
+        }
+        else {
+            ids.add( m->databaseId() );
+        }
+    }
+    if ( ids.isEmpty() )
+        return;
+
+    d->findSummaries = new Query( "select message, envelope, body, "
+                                  "bodystructure from message_summaries "
+                                  "where message=any($1)", this );
+    d->findSummaries->bind( 1, ids );
+    d->findSummaries->execute();
+}
+
+
+/*  Returns true if \a s contains only seven-bit characters. */
+
+static bool isSevenBit( const EString & s )
+{
+    uint i = 0;
+    while ( i < s.length() && s[i] < 128 )
+        i++;
+    return i >= s.length();
+}
+
+
+/*! Computes the summary of \a m, which must be fully fetched, and
+    notes it for storeSummaries() if it's suitable for storing.
+*/
+
+void Fetch::addSummary( Message * m )
+{
+    bool unicode = imap()->clientSupports( IMAP::Unicode );
+    FetchData::Summary * summary = new FetchData::Summary;
+    appendEnvelope( summary->envelope, m, unicode );
+    appendBodyStructure( summary->body, m, false, unicode );
+    appendBodyStructure( summary->bodystructure, m, true, unicode );
+    d->summaries.insert( m->databaseId(), summary );
+
+    // the column is text, so we don't store anything 8-bit
+    if ( !isSevenBit( summary->envelope ) ||
+         !isSevenBit( summary->bodystructure ) )
+        return;
+
+    shareSummary( m->databaseId(), summary );
+    d->newIds.append( fn( m->databaseId() ) );
+    d->newEnvelopes.append( summary->envelope );
+    d->newBodies.append( summary->body );
+    d->newBodystructures.append( summary->bodystructure );
+}
+
+
+/*! Stores the summaries noted by addSummary(), so that later FETCH
+    commands needn't fetch the headers, addresses and part numbers
+    that went into them. Any another session may have stored the
+    same summaries meanwhile; those rows are skipped.
+*/
+
+void Fetch::storeSummaries()
+{
+    if ( d->newIds.isEmpty() )
+        return;
+
+    Query * q = new Query( "insert into message_summaries "
+                           "(message, envelope, body, bodystructure) "
+                           "select m::int, e, b, s from "
+                           "(select unnest($1::text[]) as m, "
+                           "unnest($2::text[]) as e, "
+                           "unnest($3::text[]) as b, "
+                           "unnest($4::text[]) as s) x "
+                           "where not exists (select message "
+                           "from message_summaries "
+                           "where message=x.m::int)", 0 );
+    q->bind( 1, d->newIds );
+    q->bind( 2, d->newEnvelopes );
+    q->bind( 3, d->newBodies );
+    q->bind( 4, d->newBodystructures );
+    q->execute();
+
+    d->newIds.clear();
+    d->newEnvelopes.clear();
+    d->newBodies.clear();
+    d->newBodystructures.clear();
+}
+
+
+/*! Looks in message_previews for the previews of the messages to be
+    fetched.
+*/
+
+void Fetch::sendPreviewQuery()
+{
+    IntegerSet ids;
+    Map<Message>::Iterator i( d->messages );
+    while ( i ) {
+        if ( i->databaseId() )
+            ids.add( i->databaseId() );
+        ++i;
+    }
+    d->findPreviews = new Query( "select message, preview "
+                                 "from message_previews "
+                                 "where message=any($1)", this );
+    d->findPreviews->bind( 1, ids );
+    d->findPreviews->execute();
+}
+
+
+/*! Starts fetching the headers and bodies of those messages that have
+    no stored preview, so that addPreview() can compute one.
+*/
+
+void Fetch::fetchPreviewBodies()
+{
+    List<Message> * l = new List<Message>;
+    Map<Message>::Iterator i( d->messages );
+    while ( i ) {
+        Message * m = i;
+        ++i;
+        if ( !d->previews.find( m->databaseId() ) &&
+             ( !m->hasHeaders() || !m->hasBodies() ) )
+            l->append( m );
+    }
+    if ( l->isEmpty() )
+        return;
+
+    log( "Computing previews for " + fn( l->count() ) + " messages" );
+    d->previewFetcher = new Fetcher( l, this, imap() );
+    d->previewFetcher->fetch( Fetcher::OtherHeader );
+    d->previewFetcher->fetch( Fetcher::Body );
+    d->previewFetcher->execute();
+}
+
+
+/*! Computes the preview of \a m, which must have its headers and
+    bodies, and notes it for storePreviews().
+*/
+
+void Fetch::addPreview( Message * m )
+{
+    UString * p = new UString( m->preview() );
+    d->previews.insert( m->databaseId(), p );
+    d->newPreviewIds.append( fn( m->databaseId() ) );
+    d->newPreviews.append( p );
+}
+
+
+/*! Stores the previews noted by addPreview(), skipping any that
+    another session has stored meanwhile.
+*/
+
+void Fetch::storePreviews()
+{
+    if ( d->newPreviewIds.isEmpty() )
+        return;
+
+    Query * q = new Query( "insert into message_previews "
+                           "(message, preview) "
+                           "select m::int, p from "
+                           "(select unnest($1::text[]) as m, "
+                           "unnest($2::text[]) as p) x "
+                           "where not exists (select message "
+                           "from message_previews "
+                           "where message=x.m::int)", 0 );
+    q->bind( 1, d->newPreviewIds );
+    q->bind( 2, d->newPreviews );
+    q->execute();
+
+    d->newPreviewIds.clear();
+    d->newPreviews.clear();
+}
+
+
 /*! Returns a pointer to the message with \a uid that this command has
     fetched or will fetch.
 */
@@ -1816,33 +2723,161 @@ Message * Fetch::message( uint uid ) const
 }
 
 
-/*! Sends a query to retrieve all flags. */
+/*! Tries to find the flags and modseqs of the messages to be fetched
+    in the mailbox's FlagSnapshot, so that a flag update needn't query
+    the database. If every message is there, this fills in the
+    dynamic data, limits the set to the messages changed since the
+    modseq we're asked about, and sets fromSnapshot. If not, it
+    leaves everything as it was.
+*/
+
+void Fetch::useFlagSnapshot()
+{
+    Mailbox * mb = session()->mailbox();
+    FlagSnapshot * fs = mb->flagSnapshot();
+    if ( !fs || !fs->contains( d->set ) )
+        return;
+
+    HashMap<FetchData::DynamicData> dynamics;
+    IntegerSet changed;
+    IntegerSet s( d->set );
+    while ( !s.isEmpty() ) {
+        uint uid = s.smallest();
+        s.remove( uid );
+        if ( fs->modSeq( uid ) > d->changedSince ) {
+            EStringList * flags = fs->flags( uid );
+            if ( !flags )
+                return;
+            FetchData::DynamicData * dd = new FetchData::DynamicData;
+            dd->modseq = fs->modSeq( uid );
+            EStringList::Iterator f( flags );
+            while ( f ) {
+                dd->flags.insert( f->lower(), new EString( *f ) );
+                ++f;
+            }
+            dynamics.insert( uid, dd );
+            changed.add( uid );
+        }
+    }
+
+    d->set = changed;
+    while ( !changed.isEmpty() ) {
+        uint uid = changed.smallest();
+        changed.remove( uid );
+        d->dynamics.insert( uid, dynamics.find( uid ) );
+        Message * m = MessageCache::provide( mb, uid );
+        m->setDatabaseId( fs->databaseId( uid ) );
+        d->messages.insert( uid, m );
+    }
+    d->fromSnapshot = true;
+    log( "Using flag snapshot for " + fn( d->set.count() ) + " messages",
+         Log::Debug );
+}
+
+
+/*! Adds the DynamicLoader objects that will load \a kind of data for
+    this command to the list pickup() waits for.
+*/
+
+void Fetch::loadDynamics( int kind )
+{
+    d->loaders.append( DynamicLoader::load( session()->mailbox(),
+                                            (DynamicLoader::Kind)kind,
+                                            d->set, this ) );
+}
+
+
+/*! Copies what the DynamicLoader objects loaded into the dynamic data
+    of this command's messages.
+*/
+
+void Fetch::useDynamics()
+{
+    List<DynamicLoader>::Iterator dl( d->loaders );
+    while ( dl ) {
+        IntegerSet s( dl->uids().intersection( d->set ) );
+        while ( !s.isEmpty() ) {
+            uint uid = s.smallest();
+            s.remove( uid );
+            FetchData::DynamicData * dd = d->dynamics.find( uid );
+            if ( !dd ) {
+                dd = new FetchData::DynamicData;
+                d->dynamics.insert( uid, dd );
+            }
+            switch ( dl->kind() ) {
+            case DynamicLoader::Flags:
+                if ( dl->flags( uid ) ) {
+                    EStringList::Iterator f( dl->flags( uid ) );
+                    while ( f ) {
+                        dd->flags.insert( f->lower(), f );
+                        ++f;
+                    }
+                }
+                break;
+            case DynamicLoader::Annotations:
+                if ( dl->annotations( uid ) )
+                    dd->annotations.append( dl->annotations( uid ) );
+                break;
+            case DynamicLoader::ModSeqs:
+                dd->modseq = dl->modSeq( uid );
+                break;
+            }
+        }
+        ++dl;
+    }
+    d->loaders.clear();
+}
+
+
+/*! Sends a query to retrieve all flags. If this command doesn't use a
+    Transaction, the flags are loaded by DynamicLoader instead.
+*/
 
 void Fetch::sendFlagQuery()
 {
+    if ( !transaction() ) {
+        loadDynamics( DynamicLoader::Flags );
+        return;
+    }
+
     d->seenDeletedFetcher = new Query(
-        "select uid, seen, deleted from mailbox_messages "
+        "select uid, seen, deleted, flagbits from mailbox_messages "
         "where mailbox=$1 and uid=any($2)",
         this );
     d->seenDeletedFetcher->bind( 1, session()->mailbox()->id() );
     d->seenDeletedFetcher->bind( 2, d->set );
     enqueue( d->seenDeletedFetcher );
 
+    // pickup() names the bits of the flags we know. the database
+    // names the rest, if any.
     d->flagFetcher = new Query(
         "select f.uid, fn.name from flags f "
         "join flag_names fn on (f.flag=fn.id) "
-        "where f.mailbox=$1 and f.uid=any($2)",
+        "where f.mailbox=$1 and f.uid=any($2) "
+        "union all "
+        "select mm.uid, fn.name from mailbox_messages mm "
+        "join flag_names fn on ((mm.flagbits>>(fn.id-1))&1=1) "
+        "where mm.mailbox=$1 and mm.uid=any($2) "
+        "and fn.id>$3 and fn.id<=64",
         this );
     d->flagFetcher->bind( 1, session()->mailbox()->id() );
     d->flagFetcher->bind( 2, d->set );
+    d->flagFetcher->bind( 3, Flag::largestId() );
     enqueue( d->flagFetcher );
 }
 
 
-/*! Sends a query to retrieve all annotations. */
+/*! Sends a query to retrieve all annotations, or asks DynamicLoader
+    to load them, as for sendFlagQuery().
+*/
 
 void Fetch::sendAnnotationsQuery()
 {
+    if ( !transaction() ) {
+        loadDynamics( DynamicLoader::Annotations );
+        return;
+    }
+
     d->annotationFetcher = new Query(
         "select a.uid, "
         "a.owner, a.value, an.name "
@@ -1857,10 +2892,17 @@ void Fetch::sendAnnotationsQuery()
 }
 
 
-/*! Sends a query to retrieve the modseq. */
+/*! Sends a query to retrieve the modseq, or asks DynamicLoader to
+    load it, as for sendFlagQuery().
+*/
 
 void Fetch::sendModSeqQuery()
 {
+    if ( !transaction() ) {
+        loadDynamics( DynamicLoader::ModSeqs );
+        return;
+    }
+
     d->modseqFetcher = new Query(
         "select uid, modseq "
         "from mailbox_messages "
@@ -9,6 +9,7 @@
 class Query;
 class Header;
 class Section;
+class Buffer;
 class Message;
 class Bodypart;
 class Multipart;
@@ -29,11 +30,14 @@ public:
     void parseAttribute( bool );
     static Section * parseSection( ImapParser *, bool = false );
     static EString sectionData( Section *, Message *, bool );
-    EString flagList( uint );
+    static void appendInternalDate( EString &, Message * );
+    static void appendEnvelope( EString &, Message *, bool );
+    static void appendBodyStructure( EString &, Multipart *, bool, bool );
+    void appendFlags( EString &, uint );
     EString annotation( class User *, uint,
                        const EStringList &, const EStringList & );
 
-    EString makeFetchResponse( Message *, uint, uint );
+    void writeFetchResponse( Buffer *, Message *, uint, uint );
 
     Message * message( uint ) const;
     void forget( uint );
@@ -43,14 +47,26 @@ private:
     void parseBody( bool );
     void parseAnnotation();
     void sendFetchQueries();
+    void sendRangeQueries();
+    bool rangedData( Section *, Message *, EString & );
+    void fetchUnrangedBodies();
+    void useFlagSnapshot();
     void sendFlagQuery();
     void sendAnnotationsQuery();
     void sendModSeqQuery();
+    void loadDynamics( int );
+    void useDynamics();
+    void sendSummaryQuery();
+    void readAhead();
+    void addSummary( Message * );
+    void storeSummaries();
+    void sendPreviewQuery();
+    void fetchPreviewBodies();
+    void addPreview( Message * );
+    void storePreviews();
     EString dotLetters( uint, uint );
-    EString internalDate( Message * );
-    EString envelope( Message * );
-    EString bodyStructure( Multipart *, bool );
-    EString singlePartStructure( Multipart *, bool );
+    static void appendSinglePartStructure( EString &, Multipart *,
+                                           bool, bool );
 
     void pickup();
 
@@ -67,6 +83,7 @@ class ImapFetchResponse
 public:
     ImapFetchResponse( ImapSession *, Fetch *, uint );
     EString text() const;
+    bool write( Buffer * ) const;
     void setSent();
 
 private:
@@ -7,6 +7,8 @@
 #include "estringlist.h"
 #include "ustringlist.h"
 #include "imapparser.h"
+#include "integerset.h"
+#include "subscribe.h"
 #include "address.h"
 #include "mailbox.h"
 #include "query.h"
@@ -20,7 +22,8 @@ class ListextData
 {
 public:
     ListextData():
-        selectQuery( 0 ), permissionsQuery( 0 ),
+        subscriptionsQuery( 0 ), permissionsQuery( 0 ),
+        subscriptions( 0 ),
         reference( 0 ),
         state( 0 ),
         extended( false ),
@@ -31,11 +34,14 @@ public:
         selectSpecialUse( false )
     {}
 
-    Query * selectQuery;
+    Query * subscriptionsQuery;
     Query * permissionsQuery;
+    IntegerSet * subscriptions;
+    IntegerSet subscribedChildren;
     Mailbox * reference;
     EString referenceName;
     UStringList patterns;
+    UStringList fullPatterns;
     uint state;
 
     class Permissions
@@ -85,6 +91,11 @@ public:
 
     Archiveopteryx does not support remote mailboxes, so the listext
     option to show remote mailboxes is silently ignored.
+
+    The mailboxes are found by walking the Mailbox tree, and
+    subscriptions are looked up using Subscribe::subscriptions(), so
+    in the common case the only query is the one for permissions on
+    mailboxes the user doesn't own.
 */
 
 
@@ -181,127 +192,73 @@ void Listext::execute()
     }
 
     if ( d->state == 0 ) {
-        d->selectQuery = new Query( "", this );
-        uint bn = 1;
-        EString sel;
-        if ( d->selectSubscribed && d->selectRecursiveMatch ) {
-            sel = "select mb.id, mb.name, s.id as sid, "
-                  "exists(select cmb.id from mailboxes cmb "
-                  "join subscriptions cs on"
-                  " (cmb.id=cs.mailbox and cs.owner=$1) "
-                  "where lower(mb.name)||'/'="
-                  "lower(substring(cmb.name from 1 for length(mb.name)+1)))"
-                  " as csub "
-                  "from mailboxes mb "
-                  "left join subscriptions s on"
-                  " (mb.id=s.mailbox and s.owner=$1) "
-                  "where ";
-            d->selectQuery->bind( 1, imap()->user()->id() );
-            bn = 2;
-        }
-        else if ( d->selectSubscribed ) {
-            sel = "select mb.id, mb.name, s.id as sid from mailboxes mb "
-                  "join subscriptions s on (mb.id=s.mailbox and s.owner=$1) "
-                  "where ";
-            d->selectQuery->bind( 1, imap()->user()->id() );
-            bn = 2;
-        }
-        else {
-            sel = "select mb.id, mb.name";
-            if ( d->returnSubscribed ) {
-                sel.append( ", s.id as sid from mailboxes mb "
-                            "left join subscriptions s on"
-                            " (mb.id=s.mailbox and s.owner=$1)" );
-                d->selectQuery->bind( 1, imap()->user()->id() );
-                bn = 2;
+        if ( d->returnSubscribed ) {
+            d->subscriptions =
+                Subscribe::subscriptions( imap()->user()->id() );
+            if ( !d->subscriptions && !d->subscriptionsQuery ) {
+                d->subscriptionsQuery
+                    = new Query( "select mailbox from subscriptions "
+                                 "where owner=$1", this );
+                d->subscriptionsQuery->bind( 1, imap()->user()->id() );
+                d->subscriptionsQuery->execute();
             }
-            else {
-                sel.append( " from mailboxes mb" );
-            }
-            sel.append( " where " );
         }
-        if ( d->selectSpecialUse ) {
-            sel.append( "flag is not null" );
+
+        if ( d->subscriptionsQuery ) {
+            if ( !d->subscriptionsQuery->done() )
+                return;
+            d->subscriptions = new IntegerSet;
+            while ( d->subscriptionsQuery->hasResults() ) {
+                Row * r = d->subscriptionsQuery->nextRow();
+                d->subscriptions->add( r->getInt( "mailbox" ) );
+            }
+            if ( !d->subscriptionsQuery->failed() )
+                Subscribe::setSubscriptions( imap()->user()->id(),
+                                             d->subscriptions );
         }
-        EStringList conditions;
+
+        d->state = 1;
+    }
+
+    if ( d->state == 1 ) {
         UStringList::Iterator i( d->patterns );
-        bool first = true;
         while ( i ) {
-            if ( !first )
-                sel.append( " or " );
-            first = false;
             UString p = *i;
             if ( !p.startsWith( "/" ) ) {
                 p = d->reference->name();
                 if ( !i->isEmpty() ) {
-                    p.append( "/" );
+                    if ( !p.endsWith( "/" ) )
+                        p.append( "/" );
                     p.append( *i );
                 }
             }
-            UStringList constparts;
-            uint n = 0;
-            uint wn = 0;
-            while ( n <= p.length() ) {
-                if ( n >= p.length() || p[n] == '%' || p[n] == '*' ) {
-                    constparts.append( p.mid( wn, n-wn ) );
-                    n++;
-                    while ( p[n] == '%' || p[n] == '*' )
-                        n++;
-                    wn = n;
-                }
-                else {
-                    n++;
-                }
-            }
-            if ( constparts.isEmpty() ) {
-                sel.append( "true" );
-            }
-            else {
-                sel.append( "mb.name ilike " );
-                UStringList::Iterator constpart( constparts );
-                while ( constpart ) {
-                    sel.append( "$" );
-                    sel.appendNumber( bn );
-                    d->selectQuery->bind( bn, *constpart );
-                    bn++;
-                    ++constpart;
-                    if ( constpart )
-                        sel.append( "||'%'||" );
-                }
-            }
+            d->fullPatterns.append( p.titlecased() );
             ++i;
         }
-        sel.append( " order by lower(mb.name)||' '" );
-        d->selectQuery->setString( sel );
-        d->selectQuery->execute();
-
-        d->state = 1;
-    }
 
-    if ( d->state == 1 ) {
-        while ( d->selectQuery->hasResults() ) {
-            Row * r = d->selectQuery->nextRow();
-            UString mn = r->getUString( "name" );
-            bool matches = false;
-
-            UStringList::Iterator i( d->patterns );
-            while ( i && !matches ) {
-                uint s = 0;
-                if ( (*i)[0] != '*' && (*i)[0] != '/' ) {
-                    s = d->reference->name().length();
-                    if ( !i->isEmpty() && !d->reference->name().endsWith( "/" ) )
-                        s++;
+        if ( d->selectRecursiveMatch ) {
+            uint n = 1;
+            while ( n <= d->subscriptions->count() ) {
+                Mailbox * m = Mailbox::find( d->subscriptions->value( n ) );
+                if ( m )
+                    m = m->parent();
+                while ( m ) {
+                    if ( m->id() )
+                        d->subscribedChildren.add( m->id() );
+                    m = m->parent();
                 }
-                if ( Mailbox::match( i->titlecased(), 0,
-                                     mn.titlecased(), s ) == 2 )
-                    matches = true;
-                ++i;
+                n++;
             }
-            if ( matches )
-                makeResponse( r );
         }
-        if ( d->selectQuery->done() )
-            d->state = 2;
+
+        // the root's name is a prefix of every pattern, but doesn't
+        // always match as one
+        Mailbox * root = Mailbox::root();
+        if ( matches( root ) == 2 )
+            consider( root );
+        addChildren( root );
+
+        d->state = 2;
     }
 
     if ( d->state == 2 ) {
@@ -311,6 +268,8 @@ void Listext::execute()
             while ( i ) {
                 Mailbox * m = i->mailbox;
                 ++i;
+                if ( m && m->owner() == imap()->user()->id() )
+                    m = 0;
                 while ( m ) {
                     if ( m->id() && !m->deleted() ) {
                         ListextData::Permissions * p
@@ -333,6 +292,7 @@ void Listext::execute()
                                  this );
                 d->permissionsQuery->bind( 1, ids );
                 d->permissionsQuery->bind( 2, imap()->user()->login() );
+                d->permissionsQuery->setReadOnly();
                 d->permissionsQuery->execute();
             }
         }
@@ -423,13 +383,77 @@ void Listext::addSelectOption( const EString & option )
 }
 
 
-/*! Sends a LIST or LSUB response for \a row.
+// orders mailboxes by name, case-insensitively
+static int byName( const void * a, const void * b )
+{
+    const Mailbox ** ma = (const Mailbox**)a;
+    const Mailbox ** mb = (const Mailbox**)b;
+    return (*ma)->name().titlecased().compare( (*mb)->name().titlecased() );
+}
+
+
+/*! Returns 2 if \a m matches one of the patterns, 1 if one of its
+    children might, and 0 if neither is the case, as for
+    Mailbox::match().
+*/
+
+uint Listext::matches( Mailbox * m ) const
+{
+    UString name = m->name().titlecased();
+    uint r = 0;
+    UStringList::Iterator i( d->fullPatterns );
+    while ( i && r < 2 ) {
+        uint n = Mailbox::match( *i, 0, name, 0 );
+        if ( n > r )
+            r = n;
+        ++i;
+    }
+    return r;
+}
+
+
+/*! Considers each child of \a parent in order, and their children in
+    turn as long as the patterns might match them.
 */
 
-void Listext::makeResponse( Row * row )
+void Listext::addChildren( Mailbox * parent )
 {
-    Mailbox * mailbox = Mailbox::find( row->getInt( "id" ) );
-    if ( !mailbox )
+    List<Mailbox> * c = parent->children();
+    if ( !c || c->isEmpty() )
+        return;
+
+    List<Mailbox>::Iterator i( c->sorted( byName ) );
+    while ( i ) {
+        Mailbox * m = i;
+        ++i;
+        uint r = matches( m );
+        if ( r == 2 )
+            consider( m );
+        if ( r > 0 )
+            addChildren( m );
+    }
+}
+
+
+/*! Records a LIST response for \a mailbox, which matches a pattern,
+    if the selection options allow that.
+*/
+
+void Listext::consider( Mailbox * mailbox )
+{
+    // mailboxes without an id are not in the database
+    if ( !mailbox->id() )
+        return;
+
+    if ( d->selectSpecialUse && mailbox->flag().isEmpty() )
+        return;
+
+    bool subscribed = d->subscriptions &&
+                      d->subscriptions->contains( mailbox->id() );
+    bool childSubscribed = d->selectRecursiveMatch &&
+                           d->subscribedChildren.contains( mailbox->id() );
+
+    if ( d->selectSubscribed && !d->selectRecursiveMatch && !subscribed )
         return;
 
     EStringList a;
@@ -451,11 +475,11 @@ void Listext::makeResponse( Row * row )
     // then there's subscription
     bool include = false;
     EString ext = "";
-    if ( row->hasColumn( "sid" ) && !row->isNull( "sid" ) ) {
+    if ( subscribed ) {
         a.append( "\\subscribed" );
         include = true;
     }
-    if ( row->hasColumn( "csub" ) && row->getBoolean( "csub" ) ) {
+    if ( childSubscribed ) {
         ext = ( " ((\"childinfo\" (\"subscribed\")))" );
         include = true;
     }
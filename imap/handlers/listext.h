@@ -21,7 +21,9 @@ private:
     void addReturnOption( const EString & );
     void addSelectOption( const EString & );
 
-    void makeResponse( class Row * );
+    uint matches( Mailbox * ) const;
+    void addChildren( Mailbox * );
+    void consider( Mailbox * );
 
     void reference();
 
@@ -6,6 +6,8 @@
 #include "mailbox.h"
 #include "mailboxgroup.h"
 #include "imapparser.h"
+#include "integerset.h"
+#include "subscribe.h"
 #include "ustring.h"
 #include "query.h"
 #include "utf.h"
@@ -14,9 +16,12 @@ class LsubData
     : public Garbage
 {
 public:
-    LsubData() : q( 0 ), top( 0 ), ref( 0 ), prefix( 0 ) {}
+    LsubData()
+        : q( 0 ), subscriptions( 0 ), top( 0 ), ref( 0 ), prefix( 0 )
+    {}
 
     Query * q;
+    IntegerSet * subscriptions;
     Mailbox * top;
     Mailbox * ref;
     uint prefix;
@@ -34,6 +39,15 @@ public:
     adding a wart of this size to such a complex class feels wrong.
 */
 
+// orders mailboxes by name, like the database would
+static int byName( const void * a, const void * b )
+{
+    const Mailbox ** ma = (const Mailbox**)a;
+    const Mailbox ** mb = (const Mailbox**)b;
+    return (*ma)->name().compare( (*mb)->name() );
+}
+
+
 /*! Constructs an empty LSUB handler. */
 
 Lsub::Lsub()
@@ -54,17 +68,35 @@ void Lsub::parse()
 }
 
 
+/*! The subscriptions are read from the database only if
+    Subscribe::subscriptions() doesn't already know them. The rest is
+    done using the Mailbox tree.
+*/
+
 void Lsub::execute()
 {
-    if ( !d->q ) {
-        d->q = new Query( "select mailbox from subscriptions s "
-                          "join mailboxes m on (s.mailbox=m.id) "
-                          "where s.owner=$1 and m.deleted='f' "
-                          "order by m.name",
-                          this );
+    if ( !d->subscriptions )
+        d->subscriptions = Subscribe::subscriptions( imap()->user()->id() );
+
+    if ( !d->subscriptions && !d->q ) {
+        d->q = new Query( "select mailbox from subscriptions "
+                          "where owner=$1", this );
         d->q->bind( 1, imap()->user()->id() );
         d->q->execute();
+    }
+
+    if ( !d->subscriptions ) {
+        if ( !d->q->done() )
+            return;
+        d->subscriptions = new IntegerSet;
+        while ( d->q->hasResults() )
+            d->subscriptions->add( d->q->nextRow()->getInt( "mailbox" ) );
+        if ( !d->q->failed() )
+            Subscribe::setSubscriptions( imap()->user()->id(),
+                                         d->subscriptions );
+    }
 
+    if ( !d->top ) {
         if ( d->pat[0] == '/' ) {
             d->top = Mailbox::root();
             d->prefix = 0;
@@ -75,18 +107,23 @@ void Lsub::execute()
         }
     }
 
-    if ( !d->q->done() )
-        return;
-
     UString pattern = d->pat.titlecased();
-    List<Mailbox> mailboxes;
+    List<Mailbox> subscribed;
+    uint n = 1;
+    while ( n <= d->subscriptions->count() ) {
+        Mailbox * m = Mailbox::find( d->subscriptions->value( n ) );
+        if ( m && !m->deleted() )
+            subscribed.append( m );
+        n++;
+    }
+    List<Mailbox> * mailboxes = subscribed.sorted( byName );
 
     EString a;
 
-    Row * r = 0;
-    while ( (r=d->q->nextRow()) != 0 ) {
-        Mailbox * m = Mailbox::find( r->getInt( "mailbox" ) );
-        mailboxes.append( m );
+    List<Mailbox>::Iterator i( mailboxes );
+    while ( i ) {
+        Mailbox * m = i;
+        ++i;
 
         Mailbox * p = m;
         while ( p && p != d->top )
@@ -121,7 +158,7 @@ void Lsub::execute()
         }
     }
 
-    (void)new MailboxGroup( &mailboxes, imap() );
+    (void)new MailboxGroup( mailboxes, imap() );
     finish();
 }
 
@@ -10,13 +10,17 @@
 /*! \class GetQuota quota.h
 
     The GetQuota command implements the GETQUOTA command defined by
-    RFC 2087. It is the only part Archiveopteryx really implements; we
-    want to report usage, not impose quotas.
+    RFC 2087. It is the only part Archiveopteryx really implements;
+    quotas are set by the administrator, and only enforced by APPEND
+    and RCPT TO.
 
     Usage is defined as the sum of RFC822-format size, in kb. This is
     usually much bigger than the actual number of kilobytes used by
     the database for storing the mail (at one site by a factor of
     four), but it'll do for reporting usage.
+
+    The usage is read from quota_usage, which the database keeps up to
+    date, so this costs the same however many messages the user has.
 */
 
 void GetQuota::parse()
@@ -32,12 +36,8 @@ void GetQuota::parse()
 void GetQuota::execute()
 {
     if ( !q ) {
-        q = new Query( "select count(rfc822size) as c, "
-                       "coalesce(sum(rfc822size::bigint),0)::bigint/1024 as s "
-                       "from messages m"
-                       " join mailbox_messages mm on (m.id=mm.message)"
-                       " join mailboxes mb on (mm.mailbox=mb.id)"
-                       " where mb.owner=$1", this );
+        q = new Query( "select messages as c, rfc822size/1024 as s "
+                       "from quota_usage where owner=$1", this );
         q->bind( 1, imap()->user()->id() );
         q->execute();
     }
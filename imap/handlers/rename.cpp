@@ -9,6 +9,7 @@
 #include "mailbox.h"
 #include "session.h"
 #include "permissions.h"
+#include "integerset.h"
 #include "transaction.h"
 
 
@@ -17,31 +18,39 @@ class RenameData
 {
 public:
     RenameData()
-        : c( 0 ), ready( false ) {}
+        : c( 0 ), ready( false ), refresh( false ) {}
 public:
     Mailbox * from;
     UString toName;
+    UString fromName;
+    UString newName;
 
     Rename * c;
     bool ready;
+    bool refresh;
 
     class MailboxPair
         : public Garbage
     {
     public:
         MailboxPair()
-            : from( 0 ), toParent( 0 ),
+            : from( 0 ), to( 0 ), toParent( 0 ),
               toUidvalidity( 0 ) {}
     public:
         Mailbox * from;
+        Mailbox * to;
         UString toName;
         Mailbox * toParent;
         uint toUidvalidity;
     };
 
-    List<MailboxPair> renames;
+    // the pairs whose destination already has a row in mailboxes
+    List<MailboxPair> reused;
+    IntegerSet moved;
+    IntegerSet fresh;
 
-    void process( MailboxPair * p, MailboxPair * parent, Transaction * t );
+    void process( MailboxPair * p, MailboxPair * parent );
+    void enqueue( Transaction * t );
 };
 
 
@@ -53,6 +62,11 @@ public:
     new inbox henceforth, not to the renamed old one. This is more or
     less what RFC 3501 section 6.3.5 says.
 
+    However many children the mailbox has, the names are rewritten by
+    a fixed number of queries, and each server moves the subtree within
+    its Mailbox tree (see Mailbox::moveTree()) instead of rereading it.
+    Sessions on the renamed mailboxes are not disturbed.
+
     It's not clear what should happen if someone has inbox selected
     while it's being renamed. In our code, the renamed mailbox remains
     selected, and the new inbox is not selected.
@@ -84,76 +98,122 @@ void Rename::parse()
 }
 
 
-void RenameData::process( MailboxPair * p, MailboxPair * parent,
-                          Transaction * t )
+/*! Checks that \a p (whose parent is \a parent, if any) can be
+    renamed, and notes what has to be done to rename it and its
+    children. enqueue() does it afterwards, with a fixed number of
+    queries for the entire subtree.
+*/
+
+void RenameData::process( MailboxPair * p, MailboxPair * parent )
 {
     c->requireRight( p->from, Permissions::DeleteMailbox );
     if ( !parent || parent->toParent != p->toParent )
         c->requireRight( p->toParent, Permissions::CreateMailboxes );
-    renames.append( p );
 
-    Mailbox * to = Mailbox::obtain( p->toName, false );
-    if ( to && !to->deleted() ) {
+    p->to = Mailbox::obtain( p->toName, false );
+    if ( p->to && !p->to->deleted() ) {
         c->error( Rename::No,
                   "Destination mailbox exists: " + p->toName.ascii() );
         c->setRespTextCode( "ALREADYEXISTS" );
-        t->rollback();
         return;
     }
 
     p->toUidvalidity = p->from->uidvalidity();
+    if ( p->to ) {
+        // if an old mailbox is there already, we bump uidvalidity to
+        // inform any caches
+        if ( p->to->uidvalidity() > p->toUidvalidity ||
+             p->to->uidnext() > 1 )
+            p->toUidvalidity = p->to->uidvalidity() + 1;
+        refresh = true;
+    }
 
-    // if an old mailbox is there already, use it and bump uidvalidity
-    Query * q = 0;
-    if ( to ) {
-        q = new Query( "update mailboxes set name=$1 where id=$2", 0 );
+    if ( p->from->id() ) {
+        moved.add( p->from->id() );
+        if ( p->to && p->to->id() )
+            reused.append( p );
+        else
+            fresh.add( p->from->id() );
+    }
+
+    // process the from mailbox' children recursively
+    List<Mailbox>::Iterator i( p->from->children() );
+    while ( i && c->ok() ) {
+        MailboxPair * cp = new MailboxPair;
+        cp->from = i;
+        cp->toName = p->toName + i->name().mid( p->from->name().length() );
+        cp->toParent = Mailbox::closestParent( cp->toName );
+        process( cp, p );
+        ++i;
+    }
+}
+
+
+/*! Enqueues the queries that rename the mailboxes noted by process()
+    in \a t. All the names are rewritten by one statement, and the
+    deleted placeholders that keep the old names' uidnext and
+    uidvalidity are created by another. Only destinations that have
+    rows already need queries of their own.
+*/
+
+void RenameData::enqueue( Transaction * t )
+{
+    // move old mailboxes at the destinations out of the way
+    List<MailboxPair>::Iterator p( reused );
+    while ( p ) {
+        Query * q = new Query( "update mailboxes set name=$1 where id=$2",
+                               0 );
         q->bind( 1, Entropy::asString( 16 ).hex() );
-        q->bind( 2, to->id() );
+        q->bind( 2, p->to->id() );
         t->enqueue( q );
-        // and bump uidvalidity to inform any caches
-        if ( to->uidvalidity() > p->toUidvalidity || to->uidnext() > 1 )
-            p->toUidvalidity = to->uidvalidity() + 1;
+        ++p;
     }
 
-    // move the mailbox
-    q = new Query( "update mailboxes set name=$1,uidvalidity=$2 "
-                   "where id=$3", 0 );
-    q->bind( 1, p->toName );
-    q->bind( 2, p->toUidvalidity );
-    q->bind( 3, p->from->id() );
+    // move the mailboxes
+    Query * q = new Query( "update mailboxes "
+                           "set name=$1||substring(name from $2) "
+                           "where id=any($3)", 0 );
+    q->bind( 1, newName );
+    q->bind( 2, fromName.length() + 1 );
+    q->bind( 3, moved );
     t->enqueue( q );
 
-    // insert a deleted placeholder to ensure that uidnext/uidvalidity
+    // insert deleted placeholders to ensure that uidnext/uidvalidity
     // will be okay if a new mailbox is created with the same name as
-    // this one used to have
-    if ( to ) {
-        // if we have the old mailbox, use it
-        q = new Query( "update mailboxes "
-                       "set name=$1,uidnext=$2,uidvalidity=$3,deleted='t' "
-                       "where id=$4", 0 );
-        q->bind( 4, to->id() );
-    }
-    else {
-        // else, create a new one
+    // one of these used to have
+    if ( !fresh.isEmpty() ) {
         q = new Query( "insert into mailboxes "
                        "(name,uidnext,uidvalidity,deleted) "
-                       "values ($1,$2,$3,'t')", 0 );
+                       "select $1||substring(name from $2),"
+                       "uidnext,uidvalidity,'t' "
+                       "from mailboxes where id=any($3)", 0 );
+        q->bind( 1, fromName );
+        q->bind( 2, newName.length() + 1 );
+        q->bind( 3, fresh );
+        t->enqueue( q );
     }
-    q->bind( 1, p->from->name() );
-    q->bind( 2, p->from->uidnext() );
-    q->bind( 3, p->from->uidvalidity() );
-    t->enqueue( q );
 
-    // process the from mailbox' children recursively
-    List<Mailbox>::Iterator c( p->from->children() );
-    while ( c ) {
-        MailboxPair * cp = new MailboxPair;
-        cp->from = c;
-        cp->toName = p->toName + c->name().mid( p->from->name().length() );
-        cp->toParent = Mailbox::closestParent( cp->toName );
-        process( cp, p, t );
-        ++c;
+    // where we have the old mailbox, it's the placeholder
+    p = reused.first();
+    while ( p ) {
+        q = new Query( "update mailboxes set uidvalidity=$1 where id=$2",
+                       0 );
+        q->bind( 1, p->toUidvalidity );
+        q->bind( 2, p->from->id() );
+        t->enqueue( q );
+
+        q = new Query( "update mailboxes "
+                       "set name=$1,uidnext=$2,uidvalidity=$3,deleted='t' "
+                       "where id=$4", 0 );
+        q->bind( 1, p->from->name() );
+        q->bind( 2, p->from->uidnext() );
+        q->bind( 3, p->from->uidvalidity() );
+        q->bind( 4, p->to->id() );
+        t->enqueue( q );
+        ++p;
     }
+
+    Mailbox::announceRename( t, fromName, newName );
 }
 
 
@@ -169,9 +229,17 @@ void Rename::execute()
         p->from = d->from;
         p->toName = imap()->user()->mailboxName( d->toName );
         p->toParent = Mailbox::closestParent( p->toName );
-        d->process( p, 0, transaction() );
+        d->fromName = d->from->name();
+        d->newName = p->toName;
+        d->process( p, 0 );
+        if ( !ok() ) {
+            transaction()->rollback();
+            return;
+        }
+        d->enqueue( transaction() );
 
-        if ( ok() && d->from == imap()->user()->inbox() ) {
+        if ( d->from == imap()->user()->inbox() ) {
+            d->refresh = true;
             Query * q =
                 new Query( "update aliases set "
                            "mailbox=(select id from mailboxes where name=$1) "
@@ -192,7 +260,10 @@ void Rename::execute()
         return;
 
     if ( !d->ready ) {
-        Mailbox::refreshMailboxes( transaction() );
+        // when nothing is in the way, the tree is updated below, and
+        // in the other servers by the MailboxRenameWatcher.
+        if ( d->refresh )
+            Mailbox::refreshMailboxes( transaction() );
         transaction()->commit();
         d->ready = true;
     }
@@ -205,6 +276,9 @@ void Rename::execute()
         return;
     }
 
+    if ( !d->refresh )
+        Mailbox::moveTree( d->fromName, d->newName );
+
     if ( Mailbox::refreshing() ) {
         (void)new Timer( this, 1 );
         return;
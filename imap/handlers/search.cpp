@@ -4,8 +4,10 @@
 
 #include "imapsession.h"
 #include "imapparser.h"
+#include "messageindex.h"
 #include "annotation.h"
 #include "integerset.h"
+#include "selectorprogram.h"
 #include "listext.h"
 #include "mailbox.h"
 #include "message.h"
@@ -31,16 +33,19 @@ class SearchData
 {
 public:
     SearchData()
-        : uid( false ), done( false ), codec( 0 ), root( 0 ),
+        : uid( false ), done( false ), indexing( false ),
+          codec( 0 ), root( 0 ),
           query( 0 ), highestmodseq( 1 ),
           firstmodseq( 1 ), lastmodseq( 1 ),
           returnModseq( false ),
           returnAll( false ), returnCount( false ),
-          returnMax( false ), returnMin( false )
+          returnMax( false ), returnMin( false ),
+          cacheModseq( 0 ), nextModseq( 0 ), changed( 0 )
     {}
 
     bool uid;
     bool done;
+    bool indexing;
 
     EString charset;
     Codec * codec;
@@ -58,6 +63,12 @@ public:
     bool returnCount;
     bool returnMax;
     bool returnMin;
+
+    EString cacheKey;
+    int64 cacheModseq;
+    int64 nextModseq;
+    IntegerSet cached;
+    Query * changed;
 };
 
 
@@ -72,6 +83,16 @@ public:
     the comparison is difficult, expensive or unsuccessful, it gives
     up and uses the database.
 
+    If only some conditions of a search can be tested in RAM, those
+    are tested first, and the database is asked to test the rest for
+    only the messages that passed (see considerNarrowing()).
+
+    Clients tend to repeat the same search on each poll, so the
+    ImapSession remembers the results of recent database searches. If
+    a search is repeated, only the messages whose modseq has changed
+    since are searched again, and the result is merged with the
+    remembered one.
+
     If ESEARCH with only MIN, only MAX or only COUNT is used, we could
     generate better SQL than we do. Let's do that optimisation when a
     client benefits from it.
@@ -417,6 +438,28 @@ Selector * Search::parseKey()
 }
 
 
+/*! Returns true if \a s is a conjunction of which some, but not all,
+    conditions are indexable().
+*/
+
+static bool partlyIndexable( Selector * s )
+{
+    if ( s->action() != Selector::And )
+        return false;
+    bool cheap = false;
+    bool expensive = false;
+    List<Selector>::Iterator i( s->children() );
+    while ( i ) {
+        if ( i->indexable() )
+            cheap = true;
+        else
+            expensive = true;
+        ++i;
+    }
+    return cheap && expensive;
+}
+
+
 void Search::execute()
 {
     if ( state() != Executing )
@@ -440,6 +483,16 @@ void Search::execute()
     ImapSession * s = session();
 
     if ( !d->query ) {
+        // large mailboxes can be searched in RAM if the search only
+        // looks at flags, dates, sizes and so on, and narrowed in RAM
+        // if some of it does
+        if ( !d->indexing && s->count() > 300 &&
+             ( d->root->indexable() || partlyIndexable( d->root ) ) ) {
+            d->indexing = true;
+            if ( !s->messageIndex()->refresh( this ) )
+                return;
+        }
+
         considerCache();
         if ( d->done ) {
             sendResponse();
@@ -447,8 +500,20 @@ void Search::execute()
             return;
         }
 
-        d->query = d->root->query( imap()->user(), s->mailbox(),
-                                   s, this, false );
+        considerRememberedSearch();
+        if ( !d->changed )
+            considerNarrowing();
+        if ( d->done ) {
+            sendResponse();
+            finish();
+            return;
+        }
+
+        if ( d->changed )
+            d->query = d->changed;
+        else
+            d->query = d->root->query( imap()->user(), s->mailbox(),
+                                       s, this, false );
         d->query->execute();
     }
 
@@ -460,6 +525,25 @@ void Search::execute()
         return;
     }
 
+    if ( d->query == d->changed ) {
+        // the messages which were changed since the remembered
+        // search no longer match as they used to; those which still
+        // match are found by a search restricted to them
+        Row * r;
+        while ( (r=d->query->nextRow()) != 0 )
+            d->cached.remove( r->getInt( "uid" ) );
+        d->matches = d->cached;
+
+        Selector * changed = new Selector( Selector::And );
+        changed->add( d->root );
+        changed->add( new Selector( Selector::Modseq, Selector::Larger,
+                                    (uint)d->cacheModseq ) );
+        d->query = changed->query( imap()->user(), s->mailbox(),
+                                   s, this, false );
+        d->query->execute();
+        return;
+    }
+
     bool firstRow = true;
     Row * r;
     while ( (r=d->query->nextRow()) != 0 ) {
@@ -475,25 +559,130 @@ void Search::execute()
         }
     }
 
+    if ( !d->cacheKey.isEmpty() )
+        s->rememberSearch( d->cacheKey, d->matches, d->nextModseq );
+
     sendResponse();
     finish();
 }
 
 
+/*! Considers whether the database search can be narrowed by
+    evaluating its cheap conditions in RAM first.
+
+    If the search is a conjunction and the conditions that
+    Selector::match() can answer exclude at least half of the
+    session's messages, those conditions are replaced by the set of
+    UIDs which pass them, so that the database applies only the
+    expensive conditions (header and body searches and so on), and
+    only to those messages.
+*/
+
+void Search::considerNarrowing()
+{
+    Session * s = imap()->session();
+    if ( !s || !partlyIndexable( d->root ) )
+        return;
+
+    List<Selector> cheap;
+    List<Selector> rest;
+    List<Selector>::Iterator i( d->root->children() );
+    while ( i ) {
+        if ( i->indexable() )
+            cheap.append( i );
+        else
+            rest.append( i );
+        ++i;
+    }
+
+    SelectorProgram * p = new SelectorProgram;
+    List<Selector>::Iterator ci( cheap );
+    while ( ci ) {
+        p->add( ci );
+        ++ci;
+    }
+    IntegerSet candidates;
+    if ( p->run( s, candidates ) == Selector::Punt )
+        return;
+
+    uint max = s->count();
+    if ( candidates.count() * 2 > max )
+        return;
+
+    log( "Search narrowed to " + fn( candidates.count() ) + " of " +
+         fn( max ) + " messages using cache", Log::Debug );
+
+    if ( candidates.isEmpty() ) {
+        d->done = true;
+        return;
+    }
+
+    Selector * root = new Selector( Selector::And );
+    root->add( new Selector( candidates ) );
+    List<Selector>::Iterator ri( rest );
+    while ( ri ) {
+        root->add( ri );
+        ++ri;
+    }
+    d->root = root;
+}
+
+
+/*! Considers whether this search can be answered by updating a
+    search the session remembers, and if so, sets up the query for the
+    messages that have changed since.
+
+    Searches which return modseqs, depend on the time or depend on the
+    session are always run in full.
+*/
+
+void Search::considerRememberedSearch()
+{
+    ImapSession * s = session();
+    if ( !s || d->returnModseq ||
+         d->root->timeSensitive() || d->root->needSession() )
+        return;
+
+    // every change not yet seen by the session gets a modseq at
+    // least this large, so the result is correct below it
+    d->cacheKey = d->root->string();
+    d->nextModseq = s->nextModSeq();
+    int64 ms = 0;
+    if ( !s->rememberedSearch( d->cacheKey, &d->cached, &ms ) ||
+         ms > UINT_MAX )
+        return;
+
+    d->cacheModseq = ms;
+    d->changed = new Query( "select uid from mailbox_messages "
+                            "where mailbox=$1 and modseq>=$2 "
+                            "union "
+                            "select uid from deleted_messages "
+                            "where mailbox=$1 and modseq>=$2", this );
+    d->changed->bind( 1, s->mailbox()->id() );
+    d->changed->bind( 2, ms );
+    log( "Updating remembered search from modseq " + fn( ms ),
+         Log::Debug );
+}
+
+
 /*! Considers whether this search can and should be solved using this
     cache, and if so, finds all the matches.
 */
 
 void Search::considerCache()
 {
-    if ( d->returnModseq )
-        return;
     Session * s = imap()->session();
+    MessageIndex * mi = 0;
+    if ( s && d->root->indexable() && s->messageIndex()->current() )
+        mi = s->messageIndex();
+    if ( d->returnModseq && !mi )
+        return;
     bool needDb = false;
     if ( !s ) {
         needDb = true;
     }
-    else if ( d->root->field() == Selector::Uid &&
+    else if ( !d->returnModseq &&
+              d->root->field() == Selector::Uid &&
               d->root->action() == Selector::Contains ) {
         d->matches = s->messages().intersection( d->root->messageSet() );
         log( "UID-only search matched " +
@@ -502,28 +691,32 @@ void Search::considerCache()
     }
     else {
         uint max = s->count();
-         // don't consider more than 300 messages - pg does it better
-        if ( max > 300 )
+        SelectorProgram * p = new SelectorProgram;
+        p->add( d->root );
+        // don't consider more than 300 messages - pg does it better,
+        // unless the MessageIndex has everything we need
+        if ( max > 300 && !mi ) {
+            needDb = true;
+        }
+        else if ( p->run( s, d->matches ) == Selector::Punt ) {
+            log( "Search must go to database: some messages could not "
+                 "be tested in RAM", Log::Debug );
             needDb = true;
-        uint c = 0;
-        while ( c < max && !needDb ) {
-            c++;
-            uint uid = s->uid( c );
-            switch ( d->root->match( s, uid ) ) {
-            case Selector::Yes:
-                d->matches.add( uid );
-                break;
-            case Selector::No:
-                break;
-            case Selector::Punt:
-                log( "Search must go to database: message " + fn( uid ) +
-                     " could not be tested in RAM",
-                     Log::Debug );
-                needDb = true;
-                d->matches.clear();
-                break;
+            d->matches.clear();
+        }
+        else if ( d->returnModseq && !d->matches.isEmpty() ) {
+            d->firstmodseq = mi->modSeq( d->matches.smallest() );
+            d->lastmodseq = mi->modSeq( d->matches.largest() );
+            uint c = 0;
+            uint n = d->matches.count();
+            while ( c < n ) {
+                c++;
+                int64 ms = mi->modSeq( d->matches.value( c ) );
+                if ( ms > d->highestmodseq )
+                    d->highestmodseq = ms;
             }
         }
+        uint c = needDb ? 0 : max;
         log( "Search considered " + fn( c ) + " of " + fn( max ) +
              " messages using cache", Log::Debug );
     }
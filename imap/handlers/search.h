@@ -33,6 +33,8 @@ private:
     EString date();
 
     void considerCache();
+    void considerRememberedSearch();
+    void considerNarrowing();
 
     UString ustring( Command::QuoteMode stringType );
 
@@ -27,7 +27,7 @@ public:
           needFirstUnseen( false ), unicode( false ), qresync( false ),
           firstUnseen( 0 ), allFlags( 0 ), updated( 0 ),
           mailbox( 0 ), session( 0 ), permissions( 0 ),
-          cacheFirstUnseen( 0 ),
+          cacheFirstUnseen( 0 ), groupFirstUnseen( 0 ),
           lastUidValidity( 0 ), lastModSeq( 0 ), firstFetch( 0 )
     {}
 
@@ -44,6 +44,7 @@ public:
     ImapSession * session;
     Permissions * permissions;
     Query * cacheFirstUnseen;
+    Query * groupFirstUnseen;
     uint lastUidValidity;
     uint lastModSeq;
     IntegerSet knownUids;
@@ -67,16 +68,21 @@ public:
         Map<MailboxInfo> c;
 
         int64 find( Mailbox * m, int64 ms ) {
-            if ( !m || !m->id() )
+            if ( !has( m, ms ) )
                 return 0;
+            return c.find( m->id() )->fu;
+        }
+
+        // true if the first unseen uid (perhaps 0: none) is known
+        bool has( Mailbox * m, int64 ms ) {
+            if ( !m || !m->id() )
+                return false;
             MailboxInfo * mi = c.find( m->id() );
             if ( !mi )
-                return 0;
+                return false;
             if ( mi->ms < ms )
                 c.remove( m->id() );
-            if ( mi->ms != ms )
-                return 0;
-            return mi->fu;
+            return mi->ms == ms;
         }
 
         void insert( Mailbox * m, int64 ms, uint uid ) {
@@ -251,11 +257,35 @@ void Select::execute()
     if ( d->session->isEmpty() )
         d->needFirstUnseen = false;
     else if ( ::firstUnseenCache &&
-              ::firstUnseenCache->find( d->mailbox, d->session->nextModSeq() ) )
+              ::firstUnseenCache->has( d->mailbox, d->session->nextModSeq() ) )
         d->needFirstUnseen = false;
     else
         d->needFirstUnseen = true;
 
+    // if the client seems to be selecting each of a group of
+    // mailboxes in turn, find the first unseen message in the rest
+    // of them now, so their SELECTs needn't ask.
+    if ( mailboxGroup() && !d->groupFirstUnseen ) {
+        IntegerSet ids;
+        List<Mailbox>::Iterator i( mailboxGroup()->contents() );
+        while ( i ) {
+            if ( i != d->mailbox && !i->deleted() &&
+                 !::firstUnseenCache->has( i, i->nextModSeq() ) )
+                ids.add( i->id() );
+            ++i;
+        }
+        if ( ids.count() > 2 ) {
+            d->groupFirstUnseen
+                = new Query( "select m.id, (select uid "
+                             "from mailbox_messages mm "
+                             "where mm.mailbox=m.id and not seen "
+                             "order by uid limit 1) as uid "
+                             "from mailboxes m where m.id=any($1)", this );
+            d->groupFirstUnseen->bind( 1, ids );
+            transaction()->enqueue( d->groupFirstUnseen );
+        }
+    }
+
     if ( d->lastModSeq < d->mailbox->nextModSeq() - 1 && !d->updated ) {
         if ( d->knownUids.isEmpty() ) {
             d->updated = new Query( "select uid from deleted_messages "
@@ -293,9 +323,19 @@ void Select::execute()
     transaction()->execute();
 
     if ( ( d->updated && !d->updated->done() ) ||
-         ( d->firstUnseen && !d->firstUnseen->done() ) )
+         ( d->firstUnseen && !d->firstUnseen->done() ) ||
+         ( d->groupFirstUnseen && !d->groupFirstUnseen->done() ) )
         return;
 
+    while ( d->groupFirstUnseen && d->groupFirstUnseen->hasResults() ) {
+        Row * r = d->groupFirstUnseen->nextRow();
+        Mailbox * m = Mailbox::find( r->getInt( "id" ) );
+        if ( m )
+            ::firstUnseenCache->insert( m, m->nextModSeq(),
+                                        r->isNull( "uid" )
+                                        ? 0 : r->getInt( "uid" ) );
+    }
+
     if ( d->updated && !d->firstFetch ) {
         IntegerSet s;
         while ( d->updated->hasResults() ) {
@@ -333,9 +373,8 @@ void Select::execute()
         if ( !::firstUnseenCache )
             ::firstUnseenCache = new SelectData::FirstUnseenCache;
         Row * r = d->firstUnseen->nextRow();
-        if ( r )
-            ::firstUnseenCache->insert( d->mailbox, d->session->nextModSeq(),
-                                        r->getInt( "uid" ) );
+        ::firstUnseenCache->insert( d->mailbox, d->session->nextModSeq(),
+                                    r ? r->getInt( "uid" ) : 0 );
     }
 
     if ( ::firstUnseenCache ) {
@@ -2,10 +2,14 @@
 
 #include "sort.h"
 
+#include "map.h"
+#include "dict.h"
 #include "user.h"
+#include "cache.h"
 #include "field.h"
 #include "codec.h"
 #include "mailbox.h"
+#include "allocator.h"
 #include "imapparser.h"
 #include "imapsession.h"
 
@@ -14,7 +18,9 @@ class SortData
     : public Garbage
 {
 public:
-    SortData(): Garbage(), s( 0 ), q( 0 ), u( false ) {}
+    SortData()
+        : Garbage(), s( 0 ), q( 0 ), u( false ),
+          mergeable( false ), base( 0 ), uidnext( 0 ), modseq( 0 ) {}
 
     enum SortCriterionType {
         Arrival,
@@ -51,13 +57,57 @@ public:
     Query * q;
     bool u;
 
+    struct Item
+        : public Garbage
+    {
+    public:
+        Item(): Garbage(), uid( 0 ), key( 0 ) {}
+        uint uid;
+        uint key;
+    };
+
+    class SortCache
+        : public Cache
+    {
+    public:
+        SortCache(): Cache( 10 ) {}
+
+        struct Result
+            : public Garbage
+        {
+        public:
+            Result(): Garbage(), modseq( 0 ), uidnext( 0 ) {}
+            int64 modseq;
+            uint uidnext;
+            List<Item> items;
+        };
+
+        Dict<Result> c;
+
+        void clear() {
+            c.clear();
+        }
+    };
+
+    EString key;
+    bool mergeable;
+    SortCache::Result * base;
+    uint uidnext;
+    int64 modseq;
+
     bool usingCriterionType( SortCriterionType );
+    EString cacheKey( Mailbox *, User * );
+    bool before( const Item *, const Item * ) const;
+    void respond( Sort *, List<Item> * );
 
     void addCondition( EString &, class SortCriterion * );
     void addJoin( EString &, const EString &, const EString &, bool );
 };
 
 
+static SortData::SortCache * sortCache = 0;
+
+
 /*! \class Sort sort.h
 
     The Sort class implements the IMAP SORT extension, which is
@@ -66,6 +116,13 @@ public:
     This class subclasses Search in order to take advantage of its
     parser, and operates quite nastily on the Query generated by
     Selector.
+
+    Clients often repeat the same SORT while paging through a
+    mailbox, so results are cached per mailbox and criteria. A cached
+    result is reused as long as the mailbox's modseq hasn't changed.
+    If the search only looks at unchanging message attributes and the
+    sort is by arrival or size alone, new arrivals are fetched and
+    merged into the cached result instead of sorting everything again.
 */
 
 
@@ -181,16 +238,48 @@ void Sort::execute()
 
     if ( !d->q ) {
         d->s->simplify();
-        d->q = d->s->query( imap()->user(), session()->mailbox(),
-                            session(), this, true );
+        ImapSession * session = this->session();
+        if ( !::sortCache )
+            ::sortCache = new SortData::SortCache;
+        d->key = d->cacheKey( session->mailbox(), imap()->user() );
+        d->uidnext = session->uidnext();
+        d->modseq = session->nextModSeq();
+        if ( !d->key.isEmpty() )
+            d->base = ::sortCache->c.find( d->key );
+        if ( d->base && d->base->modseq == session->nextModSeq() ) {
+            d->respond( this, &d->base->items );
+            return;
+        }
+        if ( d->base && ( !d->mergeable ||
+                          d->base->modseq > session->nextModSeq() ) )
+            d->base = 0;
+
+        Selector * s = d->s;
+        if ( d->base ) {
+            if ( d->base->uidnext >= d->uidnext ) {
+                // nothing new, only flag changes or expunges
+                d->base->modseq = session->nextModSeq();
+                d->respond( this, &d->base->items );
+                return;
+            }
+            IntegerSet arrivals;
+            arrivals.add( d->base->uidnext, d->uidnext - 1 );
+            s = new Selector;
+            s->add( d->s );
+            s->add( new Selector( arrivals ) );
+            s->simplify();
+        }
+
+        d->q = s->query( imap()->user(), session->mailbox(),
+                         session, this, true );
         EString t = d->q->string();
         List<SortData::SortCriterion>::Iterator c( d->c );
         while ( c ) {
             if ( c->t == SortData::Annotation ) {
-                c->b1 = d->s->placeHolder();
+                c->b1 = s->placeHolder();
                 d->q->bind( c->b1, c->annotationEntry );
                 if ( c->priv ) {
-                    c->b2 = d->s->placeHolder();
+                    c->b2 = s->placeHolder();
                     d->q->bind( c->b2, imap()->user()->id() );
                 }
             }
@@ -204,34 +293,142 @@ void Sort::execute()
     if ( !d->q->done() )
         return;
 
-    List<uint> * result = new List<uint>;
+    EString column;
+    if ( d->mergeable && d->c.firstElement()->t == SortData::Arrival )
+        column = "idate";
+    else if ( d->mergeable )
+        column = "rfc822size";
+
+    List<SortData::Item> * result = new List<SortData::Item>;
     Row * r;
     while ( (r=d->q->nextRow()) != 0 ) {
-        uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
-        *tmp = r->getInt( "uid" );
-        result->append( tmp );
+        SortData::Item * i = new SortData::Item;
+        i->uid = r->getInt( "uid" );
+        if ( !column.isEmpty() )
+            i->key = r->getInt( column.cstr() );
+        if ( i->uid >= d->uidnext )
+            d->uidnext = i->uid + 1;
+        result->append( i );
     }
-    waitFor( new ImapSortResponse( session(), result, d->u ) );
-    finish();
+
+    if ( d->base ) {
+        // merge the new arrivals into the cached result
+        List<SortData::Item> * merged = new List<SortData::Item>;
+        List<SortData::Item>::Iterator o( d->base->items );
+        List<SortData::Item>::Iterator n( result );
+        while ( o || n ) {
+            if ( o && ( !n || !d->before( n, o ) ) ) {
+                merged->append( o );
+                ++o;
+            }
+            else {
+                merged->append( n );
+                ++n;
+            }
+        }
+        result = merged;
+    }
+
+    if ( !d->key.isEmpty() && !d->q->failed() ) {
+        SortData::SortCache::Result * c = new SortData::SortCache::Result;
+        c->modseq = d->modseq;
+        c->uidnext = d->uidnext;
+        c->items.append( result );
+        ::sortCache->c.insert( d->key, c );
+    }
+
+    d->respond( this, result );
+}
+
+
+/*! Returns a string identifying this SORT command's result in \a
+    mailbox as seen by \a user, or an empty string if the result
+    can't be cached. Also decides whether new arrivals can be merged
+    into a cached result.
+*/
+
+EString SortData::cacheKey( Mailbox * mailbox, User * user )
+{
+    if ( !mailbox || s->needSession() || s->timeSensitive() )
+        return "";
+
+    EString r = fn( mailbox->id() );
+    List<SortCriterion>::Iterator i( c );
+    while ( i ) {
+        r.append( " " );
+        if ( i->reverse )
+            r.append( "-" );
+        r.appendNumber( i->t );
+        if ( i->t == Annotation ) {
+            r.append( i->annotationEntry.quoted() );
+            if ( i->priv && user )
+                r.append( "/" + fn( user->id() ) );
+        }
+        ++i;
+    }
+    r.append( " " );
+    r.append( s->string() );
+
+    mergeable = !s->dynamic() && c.count() == 1 &&
+                ( c.firstElement()->t == Arrival ||
+                  c.firstElement()->t == Size );
+    return r;
+}
+
+
+/*! Returns true if \a a sorts before \a b. This is only used for
+    mergeable sorts, where the sort key is a single number, and the uid
+    breaks ties as in the SQL query.
+*/
+
+bool SortData::before( const Item * a, const Item * b ) const
+{
+    if ( a->key != b->key ) {
+        if ( c.firstElement()->reverse )
+            return a->key > b->key;
+        return a->key < b->key;
+    }
+    return a->uid < b->uid;
+}
+
+
+/*! Sends the SORT response for \a items (less any messages \a sort's
+    session no longer has) and finishes \a sort.
+*/
+
+void SortData::respond( Sort * sort, List<Item> * items )
+{
+    ImapSession * session = sort->session();
+    List<uint> * result = new List<uint>;
+    List<Item>::Iterator i( items );
+    while ( i ) {
+        if ( session->messages().contains( i->uid ) ||
+             i->uid >= session->uidnext() ) {
+            uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
+            *tmp = i->uid;
+            result->append( tmp );
+        }
+        ++i;
+    }
+    sort->waitFor( new ImapSortResponse( session, result, u ) );
+    sort->finish();
 }
 
 
 void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
 {
+    // the Injector stores the address sort keys in sort_keys
+    EString sortKeys;
+    if ( !t.contains( " sort_keys ssk " ) )
+        sortKeys = "left join sort_keys ssk on (mm.message=ssk.message) ";
+
     switch ( c->t ) {
     case Arrival:
         addJoin( t, "join messages marrdt on (marrdt.id=mm.message) ",
                  "marrdt.idate", c->reverse );
         break;
     case Cc:
-        addJoin( t,
-                 "left join address_fields sccaf on "
-                 "(mm.message=sccaf.message and "
-                 " sccaf.part='' and sccaf.number=0 and"
-                 " sccaf.field=" + fn( HeaderField::Cc ) + ") "
-                 "left join addresses scca on (sccaf.address=scca.id) ",
-                 "scca.localpart",
-                 c->reverse );
+        addJoin( t, sortKeys, "ssk.cc_key", c->reverse );
         break;
     case Date:
         addJoin( t,
@@ -240,40 +437,13 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
                  c->reverse );
         break;
     case From:
-        addJoin( t,
-                 "left join address_fields sfaf on "
-                 "(mm.message=sfaf.message and "
-                 " sfaf.part='' and sfaf.number=0 and"
-                 " sfaf.field=" + fn( HeaderField::From ) + ") "
-                 "join addresses sfa on (sfaf.address=sfa.id) ",
-                 "sfa.localpart",
-                 c->reverse );
+        addJoin( t, sortKeys, "ssk.from_key", c->reverse );
         break;
     case DisplayFrom:
-        addJoin( t,
-                 "left join address_fields sdfaf on "
-                 "(mm.message=sdfaf.message and "
-                 " sdfaf.part='' and sdfaf.number=0 and"
-                 " sdfaf.field=" + fn( HeaderField::From ) + ") "
-                 "join addresses sdfa on (sdfaf.address=sdfa.id) ",
-                 "case "
-                 "when sdfa.name='' then sdfa.localpart||'@'||sdfa.domain "
-                 "else sdfa.name "
-                 "end",
-                 c->reverse );
+        addJoin( t, sortKeys, "ssk.display_from", c->reverse );
         break;
     case DisplayTo:
-        addJoin( t,
-                 "left join address_fields sdtaf on "
-                 "(mm.message=sdtaf.message and "
-                 " sdtaf.part='' and sdtaf.number=0 and"
-                 " sdtaf.field=" + fn( HeaderField::To ) + ") "
-                 "join addresses sdta on (sdtaf.address=sdta.id) ",
-                 "case "
-                 "when sdta.name='' then sdta.localpart||'@'||sdta.domain "
-                 "else sdta.name "
-                 "end",
-                 c->reverse );
+        addJoin( t, sortKeys, "ssk.display_to", c->reverse );
         break;
     case Size:
         addJoin( t,
@@ -282,22 +452,15 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
                  c->reverse );
         break;
     case Subject:
+        // the Injector stores the base subject in thread_members
         addJoin( t,
-                 "left join header_fields sshf on "
-                 "(mm.message=sshf.message and sshf.field=" +
-                 fn( HeaderField::Subject ) + ") ",
-                 "sshf.value",
+                 "left join thread_members sstm on "
+                 "(mm.message=sstm.message) ",
+                 "sstm.subject",
                  c->reverse );
         break;
     case To:
-        addJoin( t,
-                 "left join address_fields staf on "
-                 "(mm.message=staf.message and "
-                 " staf.part='' and staf.number=0 and"
-                 " staf.field=" + fn( HeaderField::To ) + ") "
-                 "left join addresses sta on (staf.address=sta.id) ",
-                 "sta.localpart",
-                 c->reverse );
+        addJoin( t, sortKeys, "ssk.to_key", c->reverse );
         break;
     case Annotation:
         if ( c->priv )
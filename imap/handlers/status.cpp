@@ -22,14 +22,17 @@ public:
         modseq( false ),
         mailbox( 0 ),
         unseenCount( 0 ), messageCount( 0 ), recentCount( 0 ),
-        cacheState( 0 )
+        preload( 0 ), cacheState( 0 ), leader( 0 )
         {}
     bool messages, uidnext, uidvalidity, recent, unseen, modseq;
     Mailbox * mailbox;
     Query * unseenCount;
     Query * messageCount;
     Query * recentCount;
+    Query * preload;
     uint cacheState;
+    IntegerSet preloaded;
+    Status * leader;
 
     class CacheItem
         : public Garbage
@@ -90,6 +93,11 @@ static StatusData::StatusCache * cache = 0;
 
 /*! \class Status status.h
     Returns the status of the specified mailbox (RFC 3501 section 6.3.10)
+
+    When the client seems to be looping over a MailboxGroup, or has
+    pipelined several STATUS commands, the first Status preloads
+    MESSAGES, UNSEEN and RECENT for all of them using a single query,
+    and the others are answered from the cache.
 */
 
 Status::Status()
@@ -189,17 +197,36 @@ void Status::execute()
 
     // second part. see if anything has happened, and feed the cache if
     // so. make sure we feed the cache at once.
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
+    if ( d->unseenCount || d->recentCount || d->messageCount ||
+         d->preload ) {
         if ( d->unseenCount && !d->unseenCount->done() )
             return;
         if ( d->messageCount && !d->messageCount->done() )
             return;
         if ( d->recentCount && !d->recentCount->done() )
             return;
+        if ( d->preload && !d->preload->done() )
+            return;
     }
     if ( !::cache )
         ::cache = new StatusData::StatusCache;
 
+    if ( d->preload ) {
+        while ( d->preload->hasResults() ) {
+            Row * r = d->preload->nextRow();
+            StatusData::CacheItem * ci =
+                ::cache->find( r->getInt( "mailbox" ) );
+            if ( ci ) {
+                ci->hasMessages = true;
+                ci->messages = r->getInt( "messages" );
+                ci->hasUnseen = true;
+                ci->unseen = r->getInt( "unseen" );
+                ci->hasRecent = true;
+                ci->recent = r->getInt( "recent" );
+            }
+        }
+    }
+
     if ( d->unseenCount ) {
         while ( d->unseenCount->hasResults() ) {
             Row * r = d->unseenCount->nextRow();
@@ -234,75 +261,109 @@ void Status::execute()
         }
     }
 
-    // third part. are we processing the first command in a STATUS
-    // loop? if so, see if we ought to preload the cache.
-    if ( mailboxGroup() && d->cacheState < 3 ) {
-        IntegerSet mailboxes;
+    // third part. are we processing the first of several STATUS
+    // commands, either pipelined or in a STATUS loop? if so, see if
+    // we ought to preload the cache for all of them at once.
+    if ( d->leader ) {
+        // another Status is preloading for us
+        if ( d->leader->state() == Executing )
+            return;
+        d->leader = 0;
+    }
+    if ( d->cacheState < 3 ) {
+        bool unseen = d->unseen;
+        bool recent = d->recent;
+        bool messages = d->messages;
         if ( d->cacheState < 1 ) {
-            // cache state 0: decide which messages
-            List<Mailbox>::Iterator i( mailboxGroup()->contents() );
+            // cache state 0: decide which mailboxes, and what to ask
+            List<Status> followers;
+            List<Mailbox> candidates;
+            candidates.append( d->mailbox );
+            if ( mailboxGroup() ) {
+                // the client will likely ask the same of the rest,
+                // and perhaps more, so fetch everything
+                unseen = true;
+                recent = true;
+                messages = true;
+                List<Mailbox>::Iterator i( mailboxGroup()->contents() );
+                while ( i ) {
+                    candidates.append( i );
+                    ++i;
+                }
+            }
+            List<Command>::Iterator c( imap()->commands() );
+            while ( c ) {
+                Status * s = 0;
+                if ( c != this && c->state() == Executing &&
+                     c->name() == "status" )
+                    s = (Status *)((Command *)c);
+                ++c;
+                if ( s && s->d->mailbox && !s->d->leader &&
+                     s->d->cacheState == 0 &&
+                     !s->d->unseenCount && !s->d->recentCount &&
+                     !s->d->messageCount ) {
+                    followers.append( s );
+                    candidates.append( s->d->mailbox );
+                    if ( s->d->unseen )
+                        unseen = true;
+                    if ( s->d->recent )
+                        recent = true;
+                    if ( s->d->messages )
+                        messages = true;
+                }
+            }
+            List<Mailbox>::Iterator i( candidates );
             while ( i ) {
                 StatusData::CacheItem * ci = ::cache->provide( i );
-                bool need = false;
-                if ( d->unseen || d->recent || d->messages )
-                    need = true;
-                if ( ci->hasUnseen || ci->hasRecent || ci->hasMessages )
-                    need = false;
-                if ( need )
-                    mailboxes.add( i->id() );
+                if ( ( unseen && !ci->hasUnseen ) ||
+                     ( recent && !ci->hasRecent ) ||
+                     ( messages && !ci->hasMessages ) )
+                    d->preloaded.add( i->id() );
                 ++i;
             }
-            if ( mailboxes.count() < 3 )
+            if ( d->preloaded.count() < 3 ) {
                 d->cacheState = 3;
-        }
-        if ( d->cacheState == 1 ) {
-            // state 1: send queries
-            if ( d->unseen ) {
-                d->unseenCount
-                    = new Query( "select mailbox, count(uid)::int as unseen "
-                                 "from mailbox_messages "
-                                 "where mailbox=any($1) and not seen "
-                                 "group by mailbox", this );
-                d->unseenCount->bind( 1, mailboxes );
-                d->unseenCount->execute();
-            }
-            if ( d->recent ) {
-                d->recentCount
-                    = new Query( "select id as mailbox, "
-                                 "uidnext-first_recent as recent "
-                                 "from mailboxes where id=any($1)", this );
-                d->recentCount->bind( 1, mailboxes );
-                d->recentCount->execute();
             }
-            if ( d->messages ) {
-                d->messageCount
-                    = new Query( "select count(*)::int as messages, mailbox "
-                                 "from mailbox_messages where mailbox=any($1) "
-                                 "group by mailbox", this );
-                d->messageCount->bind( 1, mailboxes );
-                d->messageCount->execute();
+            else {
+                d->cacheState = 1;
+                List<Status>::Iterator f( followers );
+                while ( f ) {
+                    f->d->leader = this;
+                    f->d->cacheState = 3;
+                    ++f;
+                }
             }
+        }
+        if ( d->cacheState == 1 ) {
+            // state 1: send one query for all three
+            d->preload
+                = new Query( "select mb.id as mailbox, "
+                             "mc.messages, mc.unseen, "
+                             "mb.uidnext-mb.first_recent as recent "
+                             "from mailboxes mb "
+                             "join mailbox_counts mc on (mb.id=mc.mailbox) "
+                             "where mb.id=any($1)", this );
+            d->preload->bind( 1, d->preloaded );
+            d->preload->setReadOnly();
+            d->preload->execute();
             d->cacheState = 2;
+            return;
         }
         if ( d->cacheState == 2 ) {
             // state 2: mark the cache as complete.
-            IntegerSet mailboxes;
-            List<Mailbox>::Iterator i( mailboxGroup()->contents() );
-            while ( i ) {
-                StatusData::CacheItem * ci = ::cache->find( i->id() );
-                if ( ci && d->unseenCount )
+            while ( !d->preloaded.isEmpty() ) {
+                uint id = d->preloaded.smallest();
+                d->preloaded.remove( id );
+                StatusData::CacheItem * ci = ::cache->find( id );
+                if ( ci && !d->preload->failed() ) {
                     ci->hasUnseen = true;
-                if ( ci && d->recentCount )
                     ci->hasRecent = true;
-                if ( ci && d->messageCount )
                     ci->hasMessages = true;
-                ++i;
+                }
             }
-            // and drop the queries
+            // and drop the query
             d->cacheState = 3;
-            d->unseenCount = 0;
-            d->recentCount = 0;
-            d->messageCount = 0;
+            d->preload = 0;
         }
     }
 
@@ -312,11 +373,11 @@ void Status::execute()
     // fourth part: send individual queries if there's anything we need
     if ( d->unseen && !d->unseenCount && !i->hasUnseen ) {
         d->unseenCount
-            = new Query( "select $1::int as mailbox, "
-                         "count(uid)::int as unseen "
-                         "from mailbox_messages "
-                         "where mailbox=$1 and not seen", this );
+            = new Query( "select mailbox, unseen "
+                         "from mailbox_counts "
+                         "where mailbox=$1", this );
         d->unseenCount->bind( 1, d->mailbox->id() );
+        d->unseenCount->setReadOnly();
         d->unseenCount->execute();
     }
 
@@ -335,6 +396,7 @@ void Status::execute()
                          "uidnext-first_recent as recent "
                          "from mailboxes where id=$1", this );
         d->recentCount->bind( 1, d->mailbox->id() );
+        d->recentCount->setReadOnly();
         d->recentCount->execute();
     }
 
@@ -349,10 +411,11 @@ void Status::execute()
     }
     else if ( d->messages && !d->messageCount ) {
         d->messageCount
-            = new Query( "select count(*)::int as messages, "
-                         "$1::int as mailbox "
-                         "from mailbox_messages where mailbox=$1", this );
+            = new Query( "select mailbox, messages "
+                         "from mailbox_counts "
+                         "where mailbox=$1", this );
         d->messageCount->bind( 1, d->mailbox->id() );
+        d->messageCount->setReadOnly();
         d->messageCount->execute();
     }
 
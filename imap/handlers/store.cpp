@@ -16,6 +16,7 @@
 #include "estring.h"
 #include "query.h"
 #include "scope.h"
+#include "dict.h"
 #include "flag.h"
 #include "list.h"
 #include "imap.h"
@@ -23,6 +24,10 @@
 #include "map.h"
 
 
+// the most messages a STORE changes in one transaction
+static const uint sliceSize = 16384;
+
+
 class StoreData
     : public Garbage
 {
@@ -40,7 +45,9 @@ public:
           annotationNameCreator( 0 ), session( 0 ),
           changeSeen( false ), changeDeleted( false ),
           newSeen( false ), newDeleted( false ),
-          sentNextModSeq( false ), modseqUpdate( 0 )
+          addBits( 0 ), keepBits( -1 ),
+          sentNextModSeq( false ), modseqUpdate( 0 ),
+          sliced( false )
     {}
     IntegerSet specified;
     IntegerSet s;
@@ -75,10 +82,15 @@ public:
     bool changeDeleted;
     bool newSeen;
     bool newDeleted;
+    int64 addBits;
+    int64 keepBits;
     IntegerSet changedUids;
 
     bool sentNextModSeq;
     Query * modseqUpdate;
+
+    bool sliced;
+    IntegerSet remaining;
 };
 
 
@@ -97,6 +109,12 @@ public:
     order, and the x flag on message 1 may have any value afterwards.
     Generally, the second command's finished last, because of how the
     database does locking.
+
+    A flag STORE on more than 16384 messages is done in slices, each
+    in its own transaction, so that the mailbox isn't locked for the
+    entire time and deliveries can proceed in between. Each slice
+    uses its own modseq. A STORE with UNCHANGEDSINCE is never sliced,
+    since its test has to cover all the messages at once.
 */
 
 /*! Constructs a Store handler. If \a u is set, the first argument is
@@ -313,6 +331,13 @@ void Store::parseAnnotationEntry()
 }
 
 
+static EString bigint( int64 n )
+{
+    // -9223372036854775808 would be parsed as a numeric
+    return "'" + fn( n ) + "'::bigint";
+}
+
+
 /*! Stores all the annotations/flags, using potentially enormous
     numbers of database queries. The command is kept atomic by the use
     of a Transaction.
@@ -370,9 +395,23 @@ void Store::execute()
     if ( !ok() || !permitted() )
         return;
 
+    if ( !d->sliced ) {
+        d->sliced = true;
+        if ( !transaction() && !tag().isEmpty() &&
+             d->op != StoreData::ReplaceAnnotations &&
+             !d->seenUnchangedSince &&
+             d->specified.count() > sliceSize ) {
+            d->remaining = d->specified;
+            takeSlice();
+        }
+    }
+
     if ( !d->obtainModSeq ) {
-        if ( !transaction() )
+        if ( !transaction() ) {
             setTransaction( new Transaction( this ) );
+            if ( d->op != StoreData::ReplaceAnnotations )
+                transaction()->setDurability( Transaction::Relaxed );
+        }
 
         d->obtainModSeq
             = new Query( "select nextmodseq from mailboxes "
@@ -404,7 +443,8 @@ void Store::execute()
             while ( i ) {
                 uint id = Flag::id( *i );
                 ++i;
-                if ( id && !Flag::isSeen( id ) && !Flag::isDeleted( id ) ) {
+                if ( id && !Flag::isSeen( id ) && !Flag::isDeleted( id ) &&
+                     !Flag::bit( id ) ) {
                     s.add( id );
                     d->present->insert( id, new IntegerSet );
                 }
@@ -468,6 +508,8 @@ void Store::execute()
 
         if ( d->s.isEmpty() ) {
             transaction()->commit();
+            if ( nextSlice() )
+                return;
             if ( !d->silent && !d->expunged.isEmpty() )
                 error( No, "Cannot store on expunged messages" );
             finish();
@@ -494,9 +536,12 @@ void Store::execute()
         if ( d->flagCreator )
             session()->sendFlagUpdate( d->flagCreator );
 
-        if ( !work && !d->changeSeen && !d->changeDeleted ) {
+        if ( !work && !d->changeSeen && !d->changeDeleted &&
+             !d->addBits && d->keepBits == -1 ) {
             // there's no actual work to be done.
             transaction()->commit();
+            if ( nextSlice() )
+                return;
             finish();
             return;
         }
@@ -534,6 +579,13 @@ void Store::execute()
             else
                 uq.append( "false" );
         }
+        EString bits;
+        if ( d->addBits || d->keepBits != -1 ) {
+            bits = "(flagbits|" + bigint( d->addBits ) + ")&" +
+                   bigint( d->keepBits );
+            uq.append( ",flagbits=" );
+            uq.append( bits );
+        }
         uq.append( " where mailbox=$2 and uid=any($3)" );
         EStringList extraConditions;
         bool checkSeenDeleted = true;
@@ -564,6 +616,8 @@ void Store::execute()
                 else
                     extraConditions.append( "deleted" );
             }
+            if ( !bits.isEmpty() )
+                extraConditions.append( "flagbits<>" + bits );
         }
         if ( extraConditions.isEmpty() ) {
             // nothing needed
@@ -590,6 +644,8 @@ void Store::execute()
             // we updated zero mailbox_messages rows, so we also
             // should not consume a modseq.
             transaction()->commit();
+            if ( nextSlice() )
+                return;
             finish();
             return;
         }
@@ -626,6 +682,9 @@ void Store::execute()
         }
     }
 
+    if ( nextSlice() )
+        return;
+
     if ( !d->silent && !d->expunged.isEmpty() ) {
         error( No, "Cannot store on expunged messages" );
         return;
@@ -635,6 +694,57 @@ void Store::execute()
 }
 
 
+/*! Moves the next slice of the messages to be changed into
+    d->specified.
+*/
+
+void Store::takeSlice()
+{
+    d->specified.clear();
+    uint n = d->remaining.count();
+    if ( n > sliceSize )
+        n = sliceSize;
+    d->specified.add( d->remaining.smallest(), d->remaining.value( n ) );
+    d->specified = d->specified.intersection( d->remaining );
+    d->remaining.remove( d->specified );
+}
+
+
+/*! Starts work on the next slice of a large STORE and returns true,
+    or returns false if there is no more to do.
+*/
+
+bool Store::nextSlice()
+{
+    if ( d->remaining.isEmpty() )
+        return false;
+
+    d->obtainModSeq = 0;
+    d->findSet = 0;
+    d->presentFlags = 0;
+    d->present = 0;
+    d->sentWorkQueries = false;
+    d->modseq = 0;
+    d->modseqUpdate = 0;
+    d->sentNextModSeq = false;
+    d->s.clear();
+    d->changedUids.clear();
+    d->changeSeen = false;
+    d->changeDeleted = false;
+    d->newSeen = false;
+    d->newDeleted = false;
+    d->addBits = 0;
+    d->keepBits = -1;
+    setTransaction( 0 );
+
+    takeSlice();
+    log( "Storing on UIDs " + d->specified.set() + ", " +
+         fn( d->remaining.count() ) + " more to go" );
+    execute();
+    return true;
+}
+
+
 /*! Adds any necessary flag names to the database and returns true once
     everything is in order.
 */
@@ -677,7 +787,8 @@ bool Store::processAnnotationNames()
 
 /*! Removes the specified flags from the relevant messages in the
     database. If \a opposite, removes all other flags, but leaves the
-    specified flags.
+    specified flags. Flags with a bit in mailbox_messages.flagbits
+    are changed later, along with the modseq.
 
     Returns true if it enqueues a query and false if it does not.
 
@@ -689,6 +800,7 @@ bool Store::processAnnotationNames()
 bool Store::removeFlags( bool opposite )
 {
     IntegerSet flags;
+    int64 bits = 0;
 
     IntegerSet unchanged;
     unchanged.add( d->specified );
@@ -700,6 +812,7 @@ bool Store::removeFlags( bool opposite )
         if ( !id )
             id = Flag::id( *i );
         ++i;
+        bits |= Flag::bit( id );
         if ( id ) {
             IntegerSet * present = d->present->find( id );
             if ( present && !present->isEmpty() ) {
@@ -713,6 +826,11 @@ bool Store::removeFlags( bool opposite )
     changed.remove( unchanged );
     d->changedUids.add( changed );
 
+    if ( opposite )
+        d->keepBits = bits;
+    else
+        d->keepBits = ~bits;
+
     if ( ( d->seen && !opposite ) ||
          ( opposite && !d->seen ) ) {
         d->changeSeen = true;
@@ -770,6 +888,9 @@ bool Store::addFlags()
             d->changeDeleted = true;
             d->newDeleted = true;
         }
+        else if ( Flag::bit( flag ) ) {
+            d->addBits |= Flag::bit( flag );
+        }
         else if ( flag ) {
             IntegerSet * p = d->present->find( flag );
             if ( p )
@@ -810,77 +931,74 @@ bool Store::replaceFlags()
 }
 
 
-static void bind( Query * q, uint i, const EString & n )
-{
-    if ( n.isEmpty() )
-        q->bindNull( i );
-    else
-        q->bind( i, n );
-}
-
+/*! Replaces one or more annotations with the provided replacements.
 
-/*! Replaces one or more annotations with the provided replacements. */
+    All the annotations are changed for all the messages by a single
+    statement: Its first part lists the replacements, the next two
+    delete the annotations whose new value is empty and update those
+    that exist, and the last inserts the rest. If the same entry is
+    given twice, the last value wins.
+*/
 
 void Store::replaceAnnotations()
 {
     Mailbox * m = d->session->mailbox();
-    IntegerSet s( d->s );
 
+    Dict<Annotation> last;
     List<Annotation>::Iterator it( d->annotations );
-    User * u = imap()->user();
     while ( it ) {
-        Query * q;
-
-        uint aid = d->annotationNameCreator->id( it->entryName() );
-
-        if ( it->value().isEmpty() ) {
-            EString o = "owner=$4";
-            if ( !it->ownerId() )
-                o = "owner is null";
-            q = new Query( "delete from annotations where "
-                           "mailbox=$1 and uid=any($2) and "
-                           "name=$3 and " + o, 0 );
-            q->bind( 1, m->id() );
-            q->bind( 2, d->s );
-            q->bind( 3, aid );
-            if ( it->ownerId() )
-                q->bind( 4, u->id() );
-            transaction()->enqueue( q );
-        }
-        else {
-            EString o( "owner=$5" );
-            if ( !it->ownerId() )
-                o = "owner is null";
-            EString existing( "where mailbox=$2 and uid=any($3) and "
-                             "name=$4 and " + o );
-            q = new Query( "update annotations set value=$1 " + existing, 0 );
-            bind( q, 1, it->value() );
-            q->bind( 2, m->id() );
-            q->bind( 3, d->s );
-            q->bind( 4, aid );
-            if ( it->ownerId() )
-                q->bind( 5, u->id() );
-            transaction()->enqueue( q );
-
-            q = new Query( "insert into annotations "
-                           "(mailbox, uid, name, value, owner) "
-                           "select $2,uid,$4,$1,$5 "
-                           "from mailbox_messages where "
-                           "mailbox=$2 and uid=any($3) and uid not in "
-                           "(select uid from annotations " + existing + ")",
-                           0 );
-            bind( q, 1, it->value() );
-            q->bind( 2, m->id() );
-            q->bind( 3, d->s );
-            q->bind( 4, aid );
-            if ( it->ownerId() )
-                q->bind( 5, it->ownerId() );
+        last.insert( it->entryName() + " " + fn( it->ownerId() ), it );
+        ++it;
+    }
+
+    Query * q = new Query( "", 0 );
+    q->bind( 1, m->id() );
+    q->bind( 2, d->s );
+
+    EString values;
+    uint n = 3;
+    List<Annotation>::Iterator a( d->annotations );
+    while ( a ) {
+        Annotation * r = a;
+        if ( last.find( r->entryName() + " " + fn( r->ownerId() ) ) == r ) {
+            if ( !values.isEmpty() )
+                values.append( "," );
+            values.append( "($" + fn( n ) + "::integer,$" +
+                           fn( n+1 ) + "::text,$" +
+                           fn( n+2 ) + "::integer)" );
+            q->bind( n, d->annotationNameCreator->id( a->entryName() ) );
+            if ( a->value().isEmpty() )
+                q->bindNull( n+1 );
+            else
+                q->bind( n+1, a->value() );
+            if ( a->ownerId() )
+                q->bind( n+2, a->ownerId() );
             else
-                q->bindNull( 5 );
-            transaction()->enqueue( q );
+                q->bindNull( n+2 );
+            n += 3;
         }
-        ++it;
+        ++a;
     }
+    if ( values.isEmpty() )
+        return;
+
+    EString same( "a.mailbox=$1 and a.uid=any($2) and a.name=v.name "
+                  "and a.owner is not distinct from v.owner" );
+    q->setString( "with v (name, value, owner) as (values " + values + "), "
+                  "d as (delete from annotations a using v "
+                  "where " + same + " and v.value is null), "
+                  "u as (update annotations a set value=v.value from v "
+                  "where " + same + " and v.value is not null) "
+                  "insert into annotations "
+                  "(mailbox, uid, name, value, owner) "
+                  "select $1, a.uid, v.name, v.value, v.owner "
+                  "from mailbox_messages a cross join v "
+                  "where a.mailbox=$1 and a.uid=any($2) "
+                  "and v.value is not null "
+                  "and not exists (select 1 from annotations x "
+                  "where x.mailbox=$1 and x.uid=a.uid and x.name=v.name "
+                  "and x.owner is not distinct from v.owner)" );
+    transaction()->enqueue( q );
 }
 
 
@@ -30,6 +30,8 @@ private:
     bool addFlags();
     bool replaceFlags();
     void replaceAnnotations();
+    void takeSlice();
+    bool nextSlice();
     void parseAnnotationEntry();
     EString entryName();
 };
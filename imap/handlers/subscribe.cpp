@@ -4,8 +4,41 @@
 
 #include "imap.h"
 #include "user.h"
+#include "cache.h"
 #include "query.h"
 #include "mailbox.h"
+#include "dbsignal.h"
+#include "integerset.h"
+#include "map.h"
+
+
+class SubscriptionCache
+    : public Cache
+{
+public:
+    SubscriptionCache(): Cache( 5 ) {}
+
+    // the ids of the mailboxes each user is subscribed to
+    Map<IntegerSet> users;
+
+    void clear() { users.clear(); }
+};
+
+
+static SubscriptionCache * cache = 0;
+
+
+class SubscriptionWatcher
+    : public EventHandler
+{
+public:
+    SubscriptionWatcher(): EventHandler() {
+        (void)new DatabaseSignal( "subscriptions_updated", this );
+    }
+    void execute() {
+        ::cache->clear();
+    }
+};
 
 
 /*! \class Subscribe subscribe.h
@@ -17,12 +50,43 @@ Subscribe::Subscribe()
 {}
 
 
+/*! Returns the set of mailbox ids that \a user is subscribed to, or a
+    null pointer if that isn't known. The set may include deleted
+    mailboxes.
+
+    LSUB and LIST use this to avoid asking the database. Subscribe and
+    Unsubscribe keep it up to date, and tell other processes to forget
+    what they know.
+*/
+
+IntegerSet * Subscribe::subscriptions( uint user )
+{
+    if ( !::cache )
+        return 0;
+    return ::cache->users.find( user );
+}
+
+
+/*! Records that \a user is subscribed to the mailboxes in \a set, as
+    read from the database.
+*/
+
+void Subscribe::setSubscriptions( uint user, IntegerSet * set )
+{
+    if ( !::cache ) {
+        ::cache = new SubscriptionCache;
+        (void)new SubscriptionWatcher;
+    }
+    ::cache->users.insert( user, set );
+}
+
+
 /*! \class Unsubscribe subscribe.h
     Removes a mailbox from the subscription list (RFC 3501 section 6.3.7)
 */
 
 Unsubscribe::Unsubscribe()
-    : Command(), q( 0 )
+    : Command(), q( 0 ), id( 0 )
 {
 }
 
@@ -69,8 +133,16 @@ void Subscribe::execute()
     if ( !q->done() )
         return;
 
-    if ( q->failed() )
+    if ( q->failed() ) {
         log( "Ignoring duplicate subscription" );
+    }
+    else {
+        IntegerSet * s = subscriptions( imap()->user()->id() );
+        if ( s )
+            s->add( m->id() );
+        Query * nq = new Query( "notify subscriptions_updated", 0 );
+        nq->execute();
+    }
     finish();
 }
 
@@ -98,15 +170,21 @@ void Unsubscribe::execute()
             finish();
             return;
         }
+        id = m->id();
         q = new Query( "delete from subscriptions "
                        "where owner=$1 and mailbox=$2", this );
         q->bind( 1, imap()->user()->id() );
-        q->bind( 2, m->id() );
+        q->bind( 2, id );
         q->execute();
     }
 
     if ( q && !q->done() )
         return;
 
+    IntegerSet * s = Subscribe::subscriptions( imap()->user()->id() );
+    if ( s )
+        s->remove( id );
+    Query * nq = new Query( "notify subscriptions_updated", 0 );
+    nq->execute();
     finish();
 }
@@ -15,6 +15,9 @@ public:
     void parse();
     void execute();
 
+    static class IntegerSet * subscriptions( uint );
+    static void setSubscriptions( uint, class IntegerSet * );
+
 private:
     class Query * q;
     class Mailbox * m;
@@ -33,6 +36,7 @@ public:
 private:
     UString n;
     class Query * q;
+    uint id;
 };
 
 
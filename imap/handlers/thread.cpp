@@ -145,35 +145,25 @@ void Thread::execute()
         want->append( "message" );
         want->append( "m.idate" );
         want->append( "m.thread_root" );
-        want->append( "tmid.value as messageid" );
-        want->append( "tref.value as references" );
-        EString ts;
-        if ( d->threadAlg == ThreadData::References ) {
-            want->append( "tsubj.value as subject" );
-            ts = "left join header_fields tsubj on"
-                 " (m.id=tsubj.message and"
-                 " tsubj.field=" + fn( HeaderField::Subject ) +
-                 " and tsubj.part='') ";
-        }
+        want->append( "tm.messageid" );
+        want->append( "tm.refs as references" );
+        if ( d->threadAlg == ThreadData::References )
+            want->append( "tm.subject" );
 
         d->find = d->s->query( imap()->user(),
                                d->session->mailbox(), d->session,
                                this, false, want );
         EString j = d->find->string();
 
-        // we need to get the References and Message-Id fields as well
+        // the Injector stores each message's Message-Id, References
+        // and base subject in thread_members, so one join finds them
+        // all
         const char * x = "left join";
         if ( !j.contains( x ) )
             x = "where";
         j.replace( x,
-                   "left join header_fields tref on"
-                   " (m.id=tref.message and"
-                   " tref.field=" + fn( HeaderField::References ) +
-                   " and tref.part='') "
-                   "left join header_fields tmid on"
-                   " (m.id=tmid.message and"
-                   " tmid.field=" + fn( HeaderField::MessageId ) +
-                   " and tmid.part='') " + ts + x );
+                   "left join thread_members tm on (m.id=tm.message) " +
+                   EString( x ) );
 
         d->find->setString( j );
 
@@ -193,7 +183,7 @@ void Thread::execute()
         if ( !r->isNull( "messageid" ) )
             n->messageId = r->getEString( "messageid" );
         if ( !r->isNull( "subject" ) )
-            n->subject = Message::baseSubject( r->getUString( "subject" ) );
+            n->subject = r->getUString( "subject" );
 
         d->result.append( n );
         if ( !n->messageId.isEmpty() )
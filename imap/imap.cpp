@@ -162,10 +162,23 @@ IMAP::IMAP( int s )
     banner.append( "\r\n" );
     enqueue( banner );
     setTimeoutAfter( 120 );
+    // stop starting commands for clients that don't read responses
+    setWriteBufferLimits( 256 * 1024, 1024 * 1024 );
     EventLoop::global()->addConnection( this );
 }
 
 
+/*! Starts any commands that were held back while the client was slow
+    to read its responses.
+*/
+
+void IMAP::writeBufferDrained()
+{
+    log( "Client has read its responses; resuming", Log::Debug );
+    unblockCommands();
+}
+
+
 /*! Handles the incoming event \a e as appropriate for its type. */
 
 void IMAP::react( Event e )
@@ -282,6 +295,9 @@ void IMAP::parse()
                 if ( n <= ImapParser::literalSizeLimit() ) {
                     d->readingLiteral = true;
                     d->literalSize = n;
+                    // make room for the literal and a little more of
+                    // the command, so it's copied into place only once
+                    d->str.reserve( d->str.length() + n + 128 );
                     if ( !plus )
                         enqueue( "+ reading literal\r\n" );
                 }
@@ -294,12 +310,18 @@ void IMAP::parse()
             }
         }
         else if ( d->readingLiteral ) {
-            // Have we finished reading a complete literal?
-            if ( r->size() < d->literalSize )
+            // We move the literal out of the read buffer as it
+            // arrives, so that we don't hold two copies of it.
+            uint n = r->size();
+            if ( n > d->literalSize )
+                n = d->literalSize;
+            if ( n ) {
+                d->str.append( r->string( n ) );
+                r->remove( n );
+                d->literalSize -= n;
+            }
+            if ( d->literalSize )
                 return;
-
-            d->str.append( r->string( d->literalSize ) );
-            r->remove( d->literalSize );
             d->readingLiteral = false;
         }
         else if ( d->reader ) {
@@ -581,9 +603,18 @@ void IMAP::runCommands()
             return;
         }
 
-        // we may be able to start new commands.
+        // we may be able to start new commands, unless the client
+        // hasn't read the responses to the earlier ones.
         i = d->commands.first();
         Command * first = i;
+        if ( first && first->state() != Command::Retired &&
+             writeBufferFull() &&
+             ( first->state() == Command::Unparsed ||
+               first->state() == Command::Blocked ) ) {
+            log( "Holding back commands until the client reads "
+                 "its responses", Log::Debug );
+            first = 0;
+        }
         if ( first && first->state() != Command::Retired ) {
             Scope x( first->log() );
             ++i;
@@ -881,13 +912,8 @@ void IMAP::emitResponses()
             r->setSent();
         }
         else if ( !r->sent() && ( can || !r->changesMsn() ) ) {
-            EString t = r->text();
-            if ( !t.isEmpty() ) {
-                w->append( "* ", 2 );
-                w->append( t );
-                w->append( "\r\n", 2 );
+            if ( r->write( w ) )
                 n++;
-            }
             r->setSent();
             any = true;
         }
@@ -21,6 +21,7 @@ public:
 
     void parse();
     virtual void react( Event );
+    void writeBufferDrained();
     void reserve( Command * );
 
     enum State { NotAuthenticated, Authenticated, Selected, Logout };
@@ -27,6 +27,17 @@ ImapParser::ImapParser( const EString &s )
 }
 
 
+/*! Returns the input from \a start to the cursor. The result shares
+    the input string's memory, so the tokens returned by this class
+    cost no copying as long as the command is alive.
+*/
+
+EString ImapParser::since( uint start ) const
+{
+    return str.mid( start, pos() - start );
+}
+
+
 /*! Returns the first line of this IMAP command, meant for logging.
 
     This function assumes that the object was constructed for the entire
@@ -47,17 +58,16 @@ EString ImapParser::firstLine()
 
 EString ImapParser::tag()
 {
-    EString r;
-
+    uint start = pos();
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '%' && c != '*' && c != '"' && c != '\\' && c != '+' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r = since( start );
     if ( r.isEmpty() )
         setError( "Expected IMAP tag, but saw: " + following().quoted() );
 
@@ -73,20 +83,20 @@ EString ImapParser::tag()
 
 EString ImapParser::command()
 {
-    EString r;
-
-    if ( present( "uid " ) )
-        r.append( "uid " );
+    uint start = pos();
+    bool uid = present( "uid " );
 
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '%' && c != '*' && c != '"' && c != '\\' && c != ']' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r = since( start );
+    if ( uid && !r.startsWith( "uid " ) )
+        r = "uid " + r.mid( 4 );
     if ( r.isEmpty() || r == "uid " )
         setError( "Expected IMAP command name, but saw: '" +
                   following() + "'" );
@@ -117,18 +127,17 @@ uint ImapParser::nzNumber()
 
 EString ImapParser::atom()
 {
-    EString r;
-
+    uint start = pos();
     char c = nextChar();
     while ( c > ' ' && c < 127 &&
             c != '(' && c != ')' && c != '{' && c != ']' &&
             c != '"' && c != '\\' && c != '%' && c != '*' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r = since( start );
     if ( r.isEmpty() )
         setError( "Expected IMAP atom, but saw: " + following() );
 
@@ -144,17 +153,16 @@ EString ImapParser::atom()
 
 EString ImapParser::listChars()
 {
-    EString r;
-
+    uint start = pos();
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r = since( start );
     if ( r.isEmpty() )
         setError( "Expected 1*list-char, but saw: " + following() );
 
@@ -191,6 +199,23 @@ EString ImapParser::quoted()
 
     step();
     c = nextChar();
+
+    // the common case is plain ASCII without escapes, which needs
+    // neither copying nor UTF-8 checking
+    uint start = pos();
+    while ( c != '"' && c != '\\' && c > 0 && c < 128 &&
+            c != 10 && c != 13 )
+    {
+        step();
+        c = nextChar();
+    }
+    if ( c == '"' ) {
+        r = since( start );
+        step();
+        return r;
+    }
+    r = since( start );
+
     while ( c != '"' && c > 0 && c != 10 && c != 13 ) {
         if ( c == '\\' ) {
             step();
@@ -310,17 +335,17 @@ EString ImapParser::astring()
     if ( c == '"' || c == '{' )
         return string();
 
-    EString r;
+    uint start = pos();
     while ( c > ' ' && c < 128 &&
             c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' &&
             c != '%' && c != '*' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r = since( start );
     if ( r.isEmpty() )
         setError( "Expected astring, but saw: " + following() );
 
@@ -336,21 +361,20 @@ EString ImapParser::astring()
 
 EString ImapParser::listMailbox()
 {
-    EString r;
-
     char c = nextChar();
     if ( c == '"' || c == '{' )
         return string();
 
+    uint start = pos();
     while ( c > ' ' &&
             c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
+    EString r = since( start );
     if ( r.isEmpty() )
         setError( "Expected list-mailbox, but saw: " + following() );
 
@@ -386,7 +410,7 @@ EString ImapParser::flag()
 
 EString ImapParser::dotLetters( uint min, uint max )
 {
-    EString r;
+    uint start = pos();
     uint i = 0;
     char c = nextChar();
     while ( i < max &&
@@ -394,11 +418,12 @@ EString ImapParser::dotLetters( uint min, uint max )
               ( c >= '0' && c <= '9' ) || ( c == '.' ) ) )
     {
         step();
-        r.append( c );
         c = nextChar();
         i++;
     }
 
+    EString r = since( start );
+
     if ( i < min )
         setError( "Expected at least " + fn( min-i ) + " more "
                   "letters/digits/dots, but saw: " + following() );
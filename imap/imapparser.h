@@ -31,6 +31,9 @@ public:
     EString dotLetters( uint, uint );
 
     static uint literalSizeLimit();
+
+private:
+    EString since( uint ) const;
 };
 
 
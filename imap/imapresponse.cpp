@@ -3,6 +3,7 @@
 #include "imapresponse.h"
 
 #include "imapsession.h"
+#include "buffer.h"
 #include "imap.h"
 
 
@@ -145,6 +146,27 @@ EString ImapResponse::text() const
 }
 
 
+/*! Appends the complete response, including the leading "* " and the
+    trailing CRLF, to \a buffer, and returns true. Returns false and
+    appends nothing if the response should not be sent.
+
+    This implementation uses text(). Subclasses whose responses may be
+    large can reimplement it to hand data to \a buffer without first
+    building one string.
+*/
+
+bool ImapResponse::write( Buffer * buffer ) const
+{
+    EString t = text();
+    if ( t.isEmpty() )
+        return false;
+    buffer->append( "* ", 2 );
+    buffer->append( t );
+    buffer->append( "\r\n", 2 );
+    return true;
+}
+
+
 /*! Returns true if this response has meaning, and false if it may be
     discarded.
 
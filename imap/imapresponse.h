@@ -20,6 +20,7 @@ public:
     virtual void setSent();
 
     virtual EString text() const;
+    virtual bool write( class Buffer * ) const;
 
     virtual bool meaningful() const;
     bool changesMsn() const;
@@ -5,6 +5,7 @@
 #include "helperrowcreator.h"
 #include "handlers/fetch.h"
 #include "command.h"
+#include "buffer.h"
 #include "fetcher.h"
 #include "mailbox.h"
 #include "message.h"
@@ -186,6 +187,19 @@ public:
         FlagCreator * creator;
         uint * limit;
     };
+
+    class SearchResult
+        : public Garbage
+    {
+    public:
+        SearchResult(): modseq( 0 ) {}
+
+        EString key;
+        IntegerSet matches;
+        int64 modseq;
+    };
+
+    List<SearchResult> searches;
 };
 
 
@@ -251,11 +265,8 @@ void ImapSession::emitUpdates( Transaction * t )
             work = true;
         }
         else {
-            while ( !e.isEmpty() ) {
-                (void)new ImapExpungeResponse( e.smallest(), this );
-                work = true;
-                e.remove( e.smallest() );
-            }
+            (void)new ImapExpungeResponse( e, this );
+            work = true;
         }
     }
 
@@ -405,67 +416,106 @@ EString ImapVanishedResponse::text() const
 
 void ImapVanishedResponse::setSent()
 {
-    while ( !s->isEmpty() ) {
-        int i = s->smallest();
-        session()->clearExpunged( i );
-        s->remove( i );
-    }
+    session()->clearExpunged( *s );
     ImapResponse::setSent();
 }
 
 
 /*! \class ImapExpungeResponse imapsession.h
 
-    The ImapExpungeResponse provides a single Expunge response. It can
-    formulate the right text and modify the session to account for the
-    response's having been sent.
-*/
+    The ImapExpungeResponse provides the EXPUNGE responses for a set of
+    messages. It can formulate the right text and modify the session
+    to account for the responses' having been sent.
 
+    The responses are sent in ascending UID order, so each MSN is the
+    message's MSN before any of the messages were expunged, less the
+    number of EXPUNGE responses before it. Neither the session's MSN
+    map nor anything else is changed until all have been sent.
+*/
 
-/*! Constructs an ImapExpungeResponse for \a uid in \a session.
 
-*/
+/*! Constructs an ImapExpungeResponse for \a uids in \a session. */
 
-ImapExpungeResponse::ImapExpungeResponse( uint uid, ImapSession * session )
-    : ImapResponse( session ), u( uid )
+ImapExpungeResponse::ImapExpungeResponse( const IntegerSet & uids,
+                                          ImapSession * session )
+    : ImapResponse( session ), s( new IntegerSet( uids ) )
 {
     setChangesMsn();
 }
 
 
-EString ImapExpungeResponse::text() const
+/*! Returns all the responses, each with its leading "* " and trailing
+    CRLF, in one string.
+*/
+
+EString ImapExpungeResponse::lines() const
 {
     EString r;
-    uint msn = session()->msn( u );
-    if ( !msn ) {
-        log( "Warning: No MSN for UID " + fn( u ), Log::Error );
-        return r; // can this happen? no?
+    uint n = s->count();
+    r.reserve( n * 20 );
+    uint done = 0;
+    uint i = 1;
+    while ( i <= n ) {
+        uint u = s->value( i );
+        uint msn = session()->msn( u );
+        if ( msn ) {
+            r.append( "* " );
+            r.appendNumber( msn - done );
+            r.append( " EXPUNGE\r\n" );
+            done++;
+        }
+        else {
+            log( "Warning: No MSN for UID " + fn( u ), Log::Error );
+        }
+        i++;
     }
-
-    r.appendNumber( msn );
-    r.append( " EXPUNGE" );
     return r;
 }
 
 
+EString ImapExpungeResponse::text() const
+{
+    EString r = lines();
+    if ( r.length() < 4 )
+        return "";
+    return r.mid( 2, r.length() - 4 );
+}
+
+
+/*! This reimplementation writes all the responses to \a buffer at
+    once.
+*/
+
+bool ImapExpungeResponse::write( Buffer * buffer ) const
+{
+    EString r = lines();
+    if ( r.isEmpty() )
+        return false;
+    buffer->append( r );
+    return true;
+}
+
+
 void ImapExpungeResponse::setSent()
 {
-    session()->clearExpunged( u );
+    session()->clearExpunged( *s );
     ImapResponse::setSent();
 }
 
 
 /*! This reimplementation ensures that the ImapSession doesn't think
     the EXISTS number is higher than what the IMAP client thinks after
-    the message with UID \a u is expunged.
+    the messages in \a uids are expunged.
 */
 
-void ImapSession::clearExpunged( uint u )
+void ImapSession::clearExpunged( const IntegerSet & uids )
 {
-    Session::clearExpunged( u );
-    d->expungesReported.remove( u );
-    if ( d->exists )
-        d->exists--;
+    Session::clearExpunged( uids );
+    d->expungesReported.remove( uids );
+    uint n = uids.count();
+    if ( n > d->exists )
+        n = d->exists;
+    d->exists -= n;
 }
 
 
@@ -499,3 +549,54 @@ bool ImapSession::unicode() const
 {
     return d->unicode;
 }
+
+
+static const uint rememberedSearches = 4;
+
+
+/*! Records that a search whose Selector::string() is \a key matched
+    \a matches, and that the result is correct for all messages whose
+    modseq is less than \a modseq. Only the last few searches are
+    remembered; searching again for \a key moves it to the front.
+*/
+
+void ImapSession::rememberSearch( const EString & key,
+                                  const IntegerSet & matches,
+                                  int64 modseq )
+{
+    List<ImapSessionData::SearchResult>::Iterator i( d->searches );
+    while ( i && i->key != key )
+        ++i;
+    ImapSessionData::SearchResult * r = i;
+    if ( r )
+        d->searches.take( i );
+    else
+        r = new ImapSessionData::SearchResult;
+    r->key = key;
+    r->matches = matches;
+    r->modseq = modseq;
+    d->searches.prepend( r );
+    while ( d->searches.count() > rememberedSearches )
+        d->searches.pop();
+}
+
+
+/*! Looks for a search remembered by rememberSearch() for \a key. If
+    there is one, this function stores its matches in \a matches, the
+    modseq up to which those are correct in \a modseq, and returns
+    true. If not, it returns false and leaves both untouched.
+*/
+
+bool ImapSession::rememberedSearch( const EString & key,
+                                    IntegerSet * matches,
+                                    int64 * modseq ) const
+{
+    List<ImapSessionData::SearchResult>::Iterator i( d->searches );
+    while ( i && i->key != key )
+        ++i;
+    if ( !i )
+        return false;
+    *matches = i->matches;
+    *modseq = i->modseq;
+    return true;
+}
@@ -29,7 +29,7 @@ public:
 
     void ignoreModSeq( int64 );
 
-    void clearExpunged( uint );
+    void clearExpunged( const IntegerSet & );
 
     void sendFlagUpdate();
     void sendFlagUpdate( class FlagCreator * );
@@ -38,6 +38,9 @@ public:
 
     void addChangedMessage( uint );
 
+    void rememberSearch( const EString &, const IntegerSet &, int64 );
+    bool rememberedSearch( const EString &, IntegerSet *, int64 * ) const;
+
 private:
     class ImapSessionData * d;
 
@@ -49,13 +52,16 @@ class ImapExpungeResponse
     : public ImapResponse
 {
 public:
-    ImapExpungeResponse( uint, ImapSession * );
+    ImapExpungeResponse( const IntegerSet &, ImapSession * );
 
     EString text() const;
+    bool write( class Buffer * ) const;
     void setSent();
 
 private:
-    uint u;
+    IntegerSet * s;
+
+    EString lines() const;
 };
 
 
@@ -17,7 +17,7 @@ public:
     ImapUrlData()
         : valid( false ), isRump( false ), rumpEnd( 0 ), imap( 0 ),
           user( 0 ), port( 143 ), uidvalidity( 0 ), uid( 0 ),
-          expires( 0 )
+          expires( 0 ), bodypart( 0 )
     {}
 
     bool valid;
@@ -41,6 +41,7 @@ public:
 
     EString orig;
     EString text;
+    Bodypart * bodypart;
 };
 
 
@@ -370,6 +371,31 @@ EString ImapUrl::text() const
 }
 
 
+/*! This function, meant for use by the ImapUrlFetcher, records that
+    text() is the content of \a b, a single bodypart that's stored in
+    the database.
+*/
+
+void ImapUrl::setBodypart( Bodypart * b )
+{
+    d->bodypart = b;
+}
+
+
+/*! Returns the bodypart whose content text() is, as set by
+    setBodypart(), or a null pointer if this URL refers to anything
+    else, or if setBodypart() has not been called.
+
+    Append uses this to link the bodypart to the new message instead
+    of storing it again.
+*/
+
+Bodypart * ImapUrl::bodypart() const
+{
+    return d->bodypart;
+}
+
+
 /*! \class ImapUrlParser imapurl.h
     Provides functions used to parse RFC 2192 productions.
 
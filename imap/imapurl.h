@@ -10,6 +10,7 @@
 
 
 class IMAP;
+class Bodypart;
 
 
 class ImapUrl
@@ -41,6 +42,9 @@ public:
     void setText( const EString & );
     EString text() const;
 
+    void setBodypart( Bodypart * );
+    Bodypart * bodypart() const;
+
 private:
     void parse( const EString & );
 
@@ -2,10 +2,12 @@
 
 #include "imapurlfetcher.h"
 
+#include "map.h"
 #include "user.h"
 #include "date.h"
 #include "event.h"
 #include "message.h"
+#include "bodypart.h"
 #include "fetcher.h"
 #include "imapparser.h"
 #include "messagecache.h"
@@ -47,6 +49,7 @@ struct MailboxSet
     IntegerSet h;
     IntegerSet b;
     IntegerSet i;
+    Map<Message> messages;
 };
 
 
@@ -313,7 +316,16 @@ void ImapUrlFetcher::execute()
                 while ( !s.isEmpty() ) {
                     uint uid = s.smallest();
                     s.remove( uid );
-                    Message * m = MessageCache::provide( ms->mailbox, uid );
+                    // a message someone else has fetched is used as
+                    // is, but one fetched just for this is kept out of
+                    // the MessageCache, so it can be freed as soon as
+                    // its text has been extracted.
+                    Message * m = ms->messages.find( uid );
+                    if ( !m )
+                        m = MessageCache::find( ms->mailbox, uid );
+                    if ( !m )
+                        m = new Message;
+                    ms->messages.insert( uid, m );
                     if ( !m->databaseId() ) {
                         ms->i.add( uid );
                         needIds = true;
@@ -325,7 +337,7 @@ void ImapUrlFetcher::execute()
                             al->append( m );
                     }
                     else {
-                        if ( m->hasBodies() )
+                        if ( !m->hasBodies() )
                             bl->append( m );
                     }
                     List<UrlLink>::Iterator it( d->urls );
@@ -346,12 +358,12 @@ void ImapUrlFetcher::execute()
             d->fetchers->append( f );
         }
         if ( !hl->isEmpty() ) {
-            Fetcher * f = new Fetcher( al, this, 0 );
+            Fetcher * f = new Fetcher( hl, this, 0 );
             f->fetch( Fetcher::OtherHeader );
             d->fetchers->append( f );
         }
         if ( !bl->isEmpty() ) {
-            Fetcher * f = new Fetcher( al, this, 0 );
+            Fetcher * f = new Fetcher( bl, this, 0 );
             f->fetch( Fetcher::Body );
             d->fetchers->append( f );
         }
@@ -435,16 +447,26 @@ void ImapUrlFetcher::execute()
                 it->url->setText( Fetch::sectionData( it->section,
                                                       it->message,
                                                       d->unicodable ) );
+                Bodypart * bp = 0;
+                if ( it->section->id.isEmpty() &&
+                     !it->section->part.isEmpty() &&
+                     !it->section->partial )
+                    bp = it->message->bodypart( it->section->part, false );
+                if ( bp && bp->id() && !bp->message() &&
+                     bp->children()->isEmpty() )
+                    it->url->setBodypart( bp );
             }
             else {
                 // this is highly dubious: we always return unicode
                 // email addresses and such when fetched this way.
                 it->url->setText( it->message->rfc822( !d->unicodable ) );
             }
+            it->message = 0;
 
             ++it;
         }
 
+        d->fetchers = 0;
         d->state = 5;
     }
 
@@ -0,0 +1,196 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "readahead.h"
+
+#include "configuration.h"
+#include "messagecache.h"
+#include "integerset.h"
+#include "allocator.h"
+#include "session.h"
+#include "mailbox.h"
+#include "message.h"
+#include "query.h"
+#include "scope.h"
+#include "imap.h"
+#include "user.h"
+#include "map.h"
+
+
+class ReadAheadBudget
+    : public Garbage
+{
+public:
+    ReadAheadBudget(): used( 0 ) {}
+    uint used;
+};
+
+
+static Map<ReadAheadBudget> * budgets;
+
+
+class ReadAheadData
+    : public Garbage
+{
+public:
+    ReadAheadData()
+        : imap( 0 ), mailbox( 0 ), user( 0 ), count( 0 ),
+          find( 0 ), fetcher( 0 )
+    {}
+
+    IMAP * imap;
+    Mailbox * mailbox;
+    uint user;
+    uint count;
+    IntegerSet uids;
+    List<Fetcher::Type> types;
+    List<Message> messages;
+    Query * find;
+    Fetcher * fetcher;
+};
+
+
+/*! \class ReadAhead readahead.h
+    The ReadAhead class fetches message data that a client is likely
+    to ask for soon, so that the data is in the MessageCache when the
+    client asks.
+
+    Fetch creates a ReadAhead when fetch-read-ahead is set and the
+    connection has nothing else to do, e.g. for the next window of a
+    mailbox a client is synchronising, or for the bodies of messages
+    whose envelopes it has just sent.
+
+    The messages being read ahead for each user count against that
+    user's budget (fetch-read-ahead messages in all), which
+    available() reports. Nothing is sent to the client, and the
+    Fetcher backs off if the connection's write buffer grows, so the
+    work never delays responses much.
+*/
+
+
+/*! Constructs a ReadAhead which will fetch data of \a types for the
+    messages with \a uids in the mailbox selected by \a imap, and
+    starts it right away. The caller should not ask for more than
+    available() messages.
+*/
+
+ReadAhead::ReadAhead( IMAP * imap, const IntegerSet & uids,
+                      List<Fetcher::Type> * types )
+    : EventHandler(), d( new ReadAheadData )
+{
+    setLog( new Log );
+    d->imap = imap;
+    d->mailbox = imap->session()->mailbox();
+    d->user = imap->user()->id();
+    d->uids = uids;
+    d->count = uids.count();
+    List<Fetcher::Type>::Iterator t( types );
+    while ( t ) {
+        d->types.append( t );
+        ++t;
+    }
+
+    if ( !budgets ) {
+        budgets = new Map<ReadAheadBudget>;
+        Allocator::addEternal( budgets, "read-ahead budgets" );
+    }
+    ReadAheadBudget * b = budgets->find( d->user );
+    if ( !b ) {
+        b = new ReadAheadBudget;
+        budgets->insert( d->user, b );
+    }
+    b->used += d->count;
+
+    execute();
+}
+
+
+/*! Returns the number of messages \a imap's user may still have read
+    ahead, which is 0 if read-ahead is disabled.
+*/
+
+uint ReadAhead::available( IMAP * imap )
+{
+    uint limit = Configuration::scalar( Configuration::FetchReadAhead );
+    if ( !limit || !imap->user() )
+        return 0;
+    ReadAheadBudget * b = 0;
+    if ( budgets )
+        b = budgets->find( imap->user()->id() );
+    if ( b && b->used >= limit )
+        return 0;
+    if ( b )
+        return limit - b->used;
+    return limit;
+}
+
+
+void ReadAhead::execute()
+{
+    Scope x( log() );
+
+    if ( !d->find && !d->fetcher ) {
+        IntegerSet unknown;
+        IntegerSet s( d->uids );
+        while ( !s.isEmpty() ) {
+            uint uid = s.smallest();
+            s.remove( uid );
+            Message * m = MessageCache::find( d->mailbox, uid );
+            if ( m && m->databaseId() )
+                d->messages.append( m );
+            else
+                unknown.add( uid );
+        }
+        if ( !unknown.isEmpty() ) {
+            d->find = new Query( "select uid, message "
+                                 "from mailbox_messages "
+                                 "where mailbox=$1 and uid=any($2)", this );
+            d->find->bind( 1, d->mailbox->id() );
+            d->find->bind( 2, unknown );
+            d->find->execute();
+        }
+    }
+
+    if ( d->find && !d->find->done() )
+        return;
+
+    if ( !d->fetcher ) {
+        while ( d->find && d->find->hasResults() ) {
+            Row * r = d->find->nextRow();
+            Message * m = MessageCache::provide( d->mailbox,
+                                                 r->getInt( "uid" ) );
+            if ( !m->databaseId() )
+                m->setDatabaseId( r->getInt( "message" ) );
+            d->messages.append( m );
+        }
+        log( "Reading ahead " + fn( d->messages.count() ) + " messages",
+             Log::Debug );
+        d->fetcher = new Fetcher( &d->messages, this, d->imap );
+        List<Fetcher::Type>::Iterator t( d->types );
+        while ( t ) {
+            d->fetcher->fetch( *t );
+            ++t;
+        }
+        d->fetcher->execute();
+    }
+
+    // a Fetcher whose connection closes stops without becoming done
+    if ( !d->fetcher->done() && d->imap->valid() )
+        return;
+
+    release();
+}
+
+
+/*! Returns the messages read by this ReadAhead to its user's budget. */
+
+void ReadAhead::release()
+{
+    ReadAheadBudget * b = budgets->find( d->user );
+    if ( !b || !d->count )
+        return;
+    if ( b->used > d->count )
+        b->used -= d->count;
+    else
+        b->used = 0;
+    d->count = 0;
+}
@@ -0,0 +1,31 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "event.h"
+#include "fetcher.h"
+#include "list.h"
+
+class IMAP;
+class IntegerSet;
+
+
+class ReadAhead
+    : public EventHandler
+{
+public:
+    ReadAhead( IMAP *, const IntegerSet &, List<Fetcher::Type> * );
+
+    void execute();
+
+    static uint available( IMAP * );
+
+private:
+    class ReadAheadData * d;
+
+    void release();
+};
+
+
+#endif
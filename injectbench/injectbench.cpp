@@ -0,0 +1,643 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "injectbench.h"
+
+#include "configuration.h"
+#include "estringlist.h"
+#include "logclient.h"
+#include "eventloop.h"
+#include "allocator.h"
+#include "injector.h"
+#include "postgres.h"
+#include "database.h"
+#include "mailbox.h"
+#include "entropy.h"
+#include "scope.h"
+#include "file.h"
+#include "flag.h"
+#include "utf.h"
+#include "log.h"
+
+// fprintf
+#include <stdio.h>
+// exit
+#include <stdlib.h>
+// getpid
+#include <unistd.h>
+// gettimeofday
+#include <sys/time.h>
+
+
+static bool failed = false;
+
+
+// the current time in microseconds
+static int64 now()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static const char * words[] = {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+    "with", "was", "on", "be", "at", "by", "this", "had", "not", "are",
+    "but", "from", "or", "have", "an", "they", "which", "one", "you",
+    "were", "all", "we", "her", "she", "there", "would", "their",
+    "will", "when", "who", "him", "been", "has", "more", "if", "no",
+    "out", "do", "so", "can", "what", "up", "said", "about", "other",
+    "into", "than", "its", "time", "only", "could", "new", "them",
+    "man", "some", "these", "then", "two", "first", "may", "any",
+    "like", "now", "my", "such", "make", "over", "our", "even", "most",
+    "me", "state", "after", "also", "made", "many", "did", "must",
+    "before", "back", "see", "through", "way", "where", "get", "much",
+    "go", "well", "your", "know", "should", "down", "work", "year",
+    "because", "come", "people", "just", "each", "mailbox", "server",
+    "database", "message", "invoice", "meeting", "schedule", "report",
+    "budget", "attached", "please", "thanks", "regards", "tomorrow"
+};
+
+static const uint numWords = sizeof( words ) / sizeof( words[0] );
+
+// how many different attachments are reused, at most
+static const uint poolSize = 10;
+
+
+class InjectBenchData
+    : public Garbage
+{
+public:
+    InjectBenchData()
+        : mailbox( 0 ),
+          messages( 1000 ), batchSize( 1 ), injectors( 1 ),
+          averageSize( 4096 ), duplication( 50 ), recipients( 1 ),
+          headers( 0 ), seed( 1 ),
+          fromFiles( false ), produced( 0 ), injected( 0 ),
+          firstDone( false ), started( 0 ), roundTrips( 0 ), bytesSent( 0 )
+    {}
+
+    struct Batch
+        : public Garbage
+    {
+        Batch( Injector * i, uint n ): injector( i ), messages( n ) {}
+        Injector * injector;
+        uint messages;
+    };
+
+    UString name;
+    Mailbox * mailbox;
+
+    uint messages;
+    uint batchSize;
+    uint injectors;
+    uint averageSize;
+    uint duplication;
+    uint recipients;
+    uint headers;
+    uint seed;
+
+    EStringList files;
+    bool fromFiles;
+    EStringList pool;
+
+    uint produced;
+    uint injected;
+    bool firstDone;
+    List<Batch> working;
+
+    int64 started;
+    int64 roundTrips;
+    int64 bytesSent;
+};
+
+
+/*! \class InjectBench injectbench.h
+
+    The InjectBench class measures how fast the Injector stores
+    messages, so that changes to the injection path can be measured
+    rather than guessed.
+
+    It injects either the messages in a set of files (for example an
+    anonymised corpus made with "aox anonymise"), or a synthetic
+    corpus whose message sizes, attachment duplication, recipient
+    fan-out and header count are chosen on the command line. When
+    done, it reports messages per second, database round trips and
+    bytes sent per message, and the time spent in each stage of the
+    Injector.
+
+    The first batch is injected alone, so that the mailbox exists
+    before the other injectors start.
+*/
+
+
+/*! Constructs an InjectBench which will inject messages into the
+    mailbox called \a name, creating it if necessary.
+*/
+
+InjectBench::InjectBench( const UString & name )
+    : EventHandler(), d( new InjectBenchData )
+{
+    setLog( new Log );
+    d->name = name;
+}
+
+
+/*! Instructs this InjectBench to inject \a n synthetic messages. The
+    default is 1000. Ignored if addFile() is used.
+*/
+
+void InjectBench::setMessages( uint n )
+{
+    d->messages = n;
+}
+
+
+/*! Instructs this InjectBench to give each Injector \a n messages.
+    The default is 1.
+*/
+
+void InjectBench::setBatchSize( uint n )
+{
+    d->batchSize = n ? n : 1;
+}
+
+
+/*! Instructs this InjectBench to keep up to \a n Injector objects
+    working at once. The default is 1.
+*/
+
+void InjectBench::setInjectors( uint n )
+{
+    d->injectors = n ? n : 1;
+}
+
+
+/*! Instructs this InjectBench to make synthetic messages whose text
+    is \a n bytes on average. Each message's size varies between an
+    eighth of that and eight times that. The default is 4096.
+*/
+
+void InjectBench::setAverageSize( uint n )
+{
+    d->averageSize = n ? n : 1;
+}
+
+
+/*! Instructs this InjectBench to make \a percent of the attachments
+    in synthetic messages copies of a few popular ones, and the rest
+    unique. About one message in three has an attachment. The default
+    is 50.
+*/
+
+void InjectBench::setDuplication( uint percent )
+{
+    d->duplication = percent > 100 ? 100 : percent;
+}
+
+
+/*! Instructs this InjectBench to address each synthetic message to
+    \a n recipients, picked from a thousand addresses. The default is
+    1.
+*/
+
+void InjectBench::setRecipients( uint n )
+{
+    d->recipients = n ? n : 1;
+}
+
+
+/*! Instructs this InjectBench to add \a n header fields beyond the
+    usual ones to each synthetic message. The default is 0.
+*/
+
+void InjectBench::setHeaders( uint n )
+{
+    d->headers = n;
+}
+
+
+/*! Seeds the random number generator used to make synthetic messages
+    with \a seed, so that runs can be repeated exactly.
+*/
+
+void InjectBench::setSeed( uint seed )
+{
+    d->seed = seed ? seed : 1;
+}
+
+
+/*! Instructs this InjectBench to inject the message in the file
+    called \a name instead of synthetic messages.
+*/
+
+void InjectBench::addFile( const EString & name )
+{
+    d->files.append( name );
+    d->fromFiles = true;
+}
+
+
+void InjectBench::execute()
+{
+    Scope x( log() );
+
+    if ( !d->started ) {
+        start();
+        if ( ::failed )
+            return;
+    }
+
+    List<InjectBenchData::Batch>::Iterator i( d->working );
+    while ( i ) {
+        InjectBenchData::Batch * b = i;
+        if ( b->injector->done() ) {
+            d->working.take( i );
+            d->firstDone = true;
+            if ( b->injector->failed() ) {
+                fprintf( stderr, "Injection failed: %s\n",
+                         b->injector->error().cstr() );
+                ::failed = true;
+            }
+            else {
+                d->injected += b->messages;
+            }
+        }
+        else {
+            ++i;
+        }
+    }
+
+    uint max = d->injectors;
+    if ( !d->firstDone )
+        max = 1;
+    while ( !::failed && d->working.count() < max ) {
+        List<Injectee> * l = new List<Injectee>;
+        Injectee * m = 0;
+        while ( l->count() < d->batchSize && ( m = next() ) != 0 )
+            l->append( m );
+        if ( l->isEmpty() )
+            break;
+        Injector * j = new Injector( this );
+        j->addInjection( l );
+        d->working.append( new InjectBenchData::Batch( j, l->count() ) );
+        j->execute();
+    }
+
+    if ( !d->working.isEmpty() )
+        return;
+
+    report();
+    EventLoop::global()->shutdown();
+}
+
+
+/*! Finds the mailbox and notes the starting point of the
+    measurements.
+*/
+
+void InjectBench::start()
+{
+    d->mailbox = Mailbox::obtain( d->name, true );
+    if ( !d->mailbox ) {
+        fprintf( stderr, "Cannot use %s as mailbox\n",
+                 d->name.utf8().cstr() );
+        ::failed = true;
+        EventLoop::global()->shutdown();
+        return;
+    }
+    if ( d->fromFiles )
+        d->messages = d->files.count();
+    fprintf( stdout, "Injecting %d messages into %s\n",
+             d->messages, d->name.utf8().cstr() );
+    d->started = now();
+    d->roundTrips = Postgres::roundTrips();
+    d->bytesSent = Postgres::bytesSent();
+}
+
+
+/*! Returns the next message to inject, or a null pointer if all have
+    been injected.
+*/
+
+Injectee * InjectBench::next()
+{
+    Injectee * m = 0;
+    if ( d->fromFiles ) {
+        if ( d->files.isEmpty() )
+            return 0;
+        EString name = *d->files.shift();
+        File f( name );
+        if ( !f.valid() ) {
+            fprintf( stderr, "Cannot read %s\n", name.cstr() );
+            ::failed = true;
+            return 0;
+        }
+        m = new Injectee;
+        m->parse( f.contents() );
+        if ( !m->error().isEmpty() )
+            m = Injectee::wrapUnparsableMessage( f.contents(), m->error(),
+                                                 "Unparsable message" );
+    }
+    else {
+        if ( d->produced >= d->messages )
+            return 0;
+        m = synthetic();
+    }
+    d->produced++;
+    EStringList none;
+    m->setFlags( d->mailbox, &none );
+    return m;
+}
+
+
+/*! Returns a new synthetic message, made as described in the class
+    documentation.
+*/
+
+Injectee * InjectBench::synthetic()
+{
+    uint n = d->produced;
+    EString domain( "@injectbench.example.com>" );
+    EString r;
+
+    uint k = random( 1000 );
+    r.append( "From: User " + fn( k ) + " <user" + fn( k ) +
+              "@example.com>\r\n" );
+    uint i = 0;
+    while ( i < d->recipients ) {
+        if ( i == 0 )
+            r.append( "To: " );
+        else if ( i == 1 )
+            r.append( "Cc: " );
+        else
+            r.append( ",\r\n " );
+        k = random( 1000 );
+        r.append( "User " + fn( k ) + " <user" + fn( k ) + "@example.com>" );
+        i++;
+        if ( i == 1 || i == d->recipients )
+            r.append( "\r\n" );
+    }
+
+    r.append( "Message-Id: <" + fn( n ) + "." + fn( getpid() ) + domain +
+              "\r\n" );
+    EString subject = "Subject: Benchmark " + fn( random( 100 ) );
+    if ( n && random( 3 ) == 0 ) {
+        subject = "Subject: Re: Benchmark " + fn( random( 100 ) );
+        r.append( "In-Reply-To: <" + fn( random( n ) ) + "." +
+                  fn( getpid() ) + domain + "\r\n" );
+    }
+    r.append( subject + "\r\n" );
+    EString minutes = fn( 100 + n / 60 % 60 ).mid( 1 );
+    EString seconds = fn( 100 + n % 60 ).mid( 1 );
+    r.append( "Date: Mon, 1 Jun 2015 12:" + minutes + ":" + seconds +
+              " +0000\r\n" );
+    i = 0;
+    while ( i < d->headers ) {
+        r.append( "X-Bench-" + fn( i ) + ": " + text( 40 ).simplified() +
+                  "\r\n" );
+        i++;
+    }
+    r.append( "Mime-Version: 1.0\r\n" );
+
+    // a log-uniform size between an eighth and eight times the average
+    uint size = d->averageSize * ( 1 << random( 7 ) ) / 8;
+    if ( random( 3 ) ) {
+        r.append( "Content-Type: text/plain; charset=us-ascii\r\n\r\n" );
+        r.append( text( size ) );
+    }
+    else {
+        EString b = "b" + fn( n ) + "." + fn( getpid() );
+        r.append( "Content-Type: multipart/mixed; boundary=\"" + b +
+                  "\"\r\n\r\n--" + b + "\r\n" );
+        r.append( "Content-Type: text/plain; charset=us-ascii\r\n\r\n" );
+        r.append( text( size / 4 ) );
+        r.append( "--" + b + "\r\n" );
+        r.append( "Content-Type: application/octet-stream\r\n"
+                  "Content-Transfer-Encoding: base64\r\n\r\n" );
+        r.append( attachment() );
+        r.append( "--" + b + "--\r\n" );
+    }
+
+    Injectee * m = new Injectee;
+    m->parse( r );
+    return m;
+}
+
+
+/*! Returns about \a size bytes of plain text, in lines of reasonable
+    length.
+*/
+
+EString InjectBench::text( uint size )
+{
+    EString r;
+    uint line = 0;
+    while ( r.length() < size ) {
+        EString w( words[random( numWords )] );
+        if ( line + w.length() > 72 ) {
+            r.append( "\r\n" );
+            line = 0;
+        }
+        else if ( line ) {
+            r.append( " " );
+            line++;
+        }
+        r.append( w );
+        line += w.length();
+    }
+    r.append( "\r\n" );
+    return r;
+}
+
+
+/*! Returns a base64-encoded attachment: a copy of one of a few
+    popular attachments, or a new one, according to the duplication
+    ratio set with setDuplication().
+*/
+
+EString InjectBench::attachment()
+{
+    bool reuse = random( 100 ) < d->duplication;
+    if ( reuse && d->pool.count() == poolSize ) {
+        EStringList::Iterator i( d->pool );
+        uint n = random( poolSize );
+        while ( n-- )
+            ++i;
+        return *i;
+    }
+
+    uint size = d->averageSize * ( 1 << random( 7 ) ) / 8;
+    EString raw;
+    raw.reserve( size );
+    while ( raw.length() < size )
+        raw.append( (char)random( 256 ) );
+    EString r = raw.e64( 76 );
+    r.append( "\r\n" );
+    if ( reuse )
+        d->pool.append( r );
+    return r;
+}
+
+
+/*! Returns a pseudo-random number less than \a n, as given by a
+    xorshift generator.
+*/
+
+uint InjectBench::random( uint n )
+{
+    uint x = d->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    d->seed = x;
+    return n ? x % n : 0;
+}
+
+
+/*! Writes the results to stdout. */
+
+void InjectBench::report()
+{
+    double elapsed = (double)( now() - d->started ) / 1000000;
+    if ( elapsed <= 0 )
+        elapsed = 0.000001;
+    double n = d->injected ? d->injected : 1;
+    int64 trips = Postgres::roundTrips() - d->roundTrips;
+    int64 bytes = Postgres::bytesSent() - d->bytesSent;
+
+    fprintf( stdout,
+             "Injected %d messages in %.2f seconds: %.1f messages/s\n"
+             "Database round trips: %lld, %.2f per message\n"
+             "Bytes sent to the database: %lld, %.0f per message\n",
+             d->injected, elapsed, d->injected / elapsed,
+             trips, trips / n, bytes, bytes / n );
+
+    int64 total = 0;
+    uint s = 0;
+    while ( s < Injector::stages() )
+        total += Injector::stageTime( s++ );
+    if ( !total )
+        return;
+
+    fprintf( stdout, "Time in each stage, summed over all injectors:\n" );
+    s = 0;
+    while ( s < Injector::stages() ) {
+        int64 t = Injector::stageTime( s );
+        if ( t )
+            fprintf( stdout, "  %-20s %10.3fs %9.3fms/message %6.1f%%\n",
+                     Injector::stageName( s ).cstr(),
+                     (double)t / 1000000, (double)t / 1000 / n,
+                     100.0 * t / total );
+        s++;
+    }
+}
+
+
+int main( int ac, char ** av )
+{
+    Scope global;
+
+    EString config( "archiveopteryx.conf" );
+    EString options;
+    List<EString> values;
+    bool bad = false;
+    int i = 1;
+    while ( i < ac && av[i][0] == '-' ) {
+        if ( !av[i][1] || av[i][2] || i + 1 >= ac ||
+             !EString( "nbjsdrhSf" ).contains( av[i][1] ) ) {
+            bad = true;
+            break;
+        }
+        if ( av[i][1] == 'f' )
+            config = av[i+1];
+        options.append( av[i][1] );
+        values.append( new EString( av[i+1] ) );
+        i += 2;
+    }
+    if ( i >= ac )
+        bad = true;
+
+    if ( bad ) {
+        fprintf( stderr,
+                 "Usage: %s [-f config] [-n messages] [-b batch-size] "
+                 "[-j injectors]\n"
+                 "       [-s average-size] [-d duplication-percent] "
+                 "[-r recipients]\n"
+                 "       [-h headers] [-S seed] mailbox [file ...]\n",
+                 av[0] );
+        exit( -1 );
+    }
+
+    Configuration::setup( config );
+
+    EventLoop::setup();
+    Log * l = new Log;
+    Allocator::addEternal( l, "injectbench log" );
+    global.setLog( l );
+    LogClient::setup( "injectbench" );
+
+    Configuration::report();
+
+    Utf8Codec c;
+    InjectBench * b = new InjectBench( c.toUnicode( av[i++] ) );
+    Allocator::addEternal( b, "injection benchmark" );
+    uint o = 0;
+    List<EString>::Iterator v( values );
+    while ( v ) {
+        bool ok = true;
+        uint n = 0;
+        if ( options[o] != 'f' )
+            n = v->number( &ok );
+        if ( !ok ) {
+            fprintf( stderr, "Not a number: %s\n", v->cstr() );
+            exit( -1 );
+        }
+        switch ( options[o] ) {
+        case 'n':
+            b->setMessages( n );
+            break;
+        case 'b':
+            b->setBatchSize( n );
+            break;
+        case 'j':
+            b->setInjectors( n );
+            break;
+        case 's':
+            b->setAverageSize( n );
+            break;
+        case 'd':
+            b->setDuplication( n );
+            break;
+        case 'r':
+            b->setRecipients( n );
+            break;
+        case 'h':
+            b->setHeaders( n );
+            break;
+        case 'S':
+            b->setSeed( n );
+            break;
+        }
+        ++v;
+        o++;
+    }
+    while ( i < ac )
+        b->addFile( av[i++] );
+
+    Entropy::setup();
+    Database::setup();
+    Mailbox::setup( b );
+    Flag::setup();
+
+    uint limit = Configuration::scalar( Configuration::MemoryLimit );
+    if ( !limit )
+        limit = 128;
+    EventLoop::global()->setMemoryUsage( 1024 * 1024 * limit );
+
+    EventLoop::global()->start();
+
+    if ( ::failed || Log::disastersYet() )
+        return 1;
+    return 0;
+}
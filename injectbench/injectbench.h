@@ -0,0 +1,44 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef INJECTBENCH_H
+#define INJECTBENCH_H
+
+#include "event.h"
+#include "ustring.h"
+
+
+class Injectee;
+
+
+class InjectBench
+    : public EventHandler
+{
+public:
+    InjectBench( const UString & );
+
+    void setMessages( uint );
+    void setBatchSize( uint );
+    void setInjectors( uint );
+    void setAverageSize( uint );
+    void setDuplication( uint );
+    void setRecipients( uint );
+    void setHeaders( uint );
+    void setSeed( uint );
+    void addFile( const EString & );
+
+    void execute();
+
+private:
+    class InjectBenchData * d;
+
+    void start();
+    Injectee * next();
+    Injectee * synthetic();
+    EString text( uint );
+    EString attachment();
+    uint random( uint );
+    void report();
+};
+
+
+#endif
@@ -14,6 +14,8 @@
 #include <stdio.h>
 // dup
 #include <unistd.h>
+// localtime
+#include <time.h>
 // openlog, syslog
 #include <syslog.h>
 
@@ -30,15 +32,22 @@ static bool useSyslog;
 
     Each logged item belongs to a transaction (a base-36 number), has a
     level of seriousness (debug, info, error or disaster) and a text.
+
+    Clients start by sending text lines. LogClient sends "binary"
+    after its name, and from then on sends length-prefixed frames,
+    which processFrame() handles without having to search for spaces
+    and parse severity names.
 */
 
 class LogServerData
     : public Garbage
 {
 public:
-    LogServerData(): id( ::id++ ), name( "(Anonymous)" ) {}
+    LogServerData()
+        : id( ::id++ ), binary( false ), name( "(Anonymous)" ) {}
 
     uint id;
+    bool binary;
 
     EString name;
 };
@@ -87,8 +96,24 @@ void LogServer::react( Event e )
 void LogServer::parse()
 {
     EString *s;
-    while ( ( s = readBuffer()->removeLine() ) != 0 )
+    while ( !d->binary && ( s = readBuffer()->removeLine() ) != 0 )
         processLine( *s );
+
+    Buffer * r = readBuffer();
+    while ( d->binary && r->size() >= 4 ) {
+        uint l = ( (uint)(unsigned char)(*r)[0] << 24 ) +
+                 ( (uint)(unsigned char)(*r)[1] << 16 ) +
+                 ( (uint)(unsigned char)(*r)[2] << 8 ) +
+                 (uint)(unsigned char)(*r)[3];
+        if ( r->size() < 4 + l )
+            return;
+        EString f = r->string( 4 + l ).mid( 4 );
+        r->remove( 4 + l );
+        if ( l )
+            processFrame( f );
+        else
+            close();
+    }
 }
 
 
@@ -109,6 +134,10 @@ void LogServer::processLine( const EString &line )
         close();
         return;
     }
+    else if ( line == "binary" ) {
+        d->binary = true;
+        return;
+    }
 
     uint cmd = 0;
     uint msg = 0;
@@ -133,6 +162,49 @@ void LogServer::processLine( const EString &line )
 }
 
 
+/*! Adds the single log message in \a frame to the log output.
+
+    The frame (less its four-byte length prefix) contains the
+    severity as one byte, the time as four bytes of seconds since the
+    epoch and two of milliseconds, then the transaction identifier
+    prefixed by its one-byte length, and finally the message. All
+    numbers are in network byte order. A frame of length 0 closes the
+    connection.
+*/
+
+void LogServer::processFrame( const EString & frame )
+{
+    if ( frame.length() < 8 )
+        return;
+    uint sv = (unsigned char)frame[0];
+    if ( sv > Log::Disaster )
+        return;
+    Log::Severity s = (Log::Severity)sv;
+    if ( s < logLevel )
+        return;
+
+    time_t sec = ( (uint)(unsigned char)frame[1] << 24 ) +
+                 ( (uint)(unsigned char)frame[2] << 16 ) +
+                 ( (uint)(unsigned char)frame[3] << 8 ) +
+                 (uint)(unsigned char)frame[4];
+    uint ms = ( (uint)(unsigned char)frame[5] << 8 ) +
+              (uint)(unsigned char)frame[6];
+    uint idl = (unsigned char)frame[7];
+    if ( frame.length() < 8 + idl )
+        return;
+
+    struct tm * t = localtime( &sec );
+    char ts[32];
+    sprintf( ts, "%04d-%02d-%02d %02d:%02d:%02d.%03d ",
+             t->tm_year + 1900, t->tm_mon+1, t->tm_mday,
+             t->tm_hour, t->tm_min, t->tm_sec, ms % 1000 );
+
+    EString m( ts );
+    m.append( frame.mid( 8 + idl ).simplified() );
+    output( frame.mid( 8, idl ), s, m );
+}
+
+
 /*! This private function actually writes \a line to the log file with
     the \a tag and severity \a s converted into their
     textual representations.
@@ -118,8 +118,8 @@ class AddressCache
 {
 public:
     AddressCache(): Cache( 8 ) {}
-    void clear() { step1.clear(); }
-    UDict< UDict< UDict<AddressData> > > step1;
+    void clear() { addresses.clear(); }
+    Dict<AddressData> addresses;
 };
 
 static AddressCache * cache = 0;
@@ -137,18 +137,18 @@ void Address::init( const UString &n, const UString &l, const UString &o )
     if ( !::cache )
         ::cache = new AddressCache;
 
+    // the key is the lengths of the three parts followed by the
+    // parts, so that it's unambiguous.
     UString dl( o.titlecased() );
-    UDict< UDict<AddressData> > * step2 = ::cache->step1.find( dl );
-    if ( !step2 ) {
-        step2 = new UDict< UDict<AddressData> >;
-        ::cache->step1.insert( dl, step2 );
-    }
-    UDict<AddressData> * step3 = step2->find( l );
-    if ( !step3 ) {
-        step3 = new UDict<AddressData>;
-        step2->insert( l, step3 );
-    }
-    d = step3->find( n );
+    EString key;
+    key.appendNumber( dl.length() );
+    key.append( '/' );
+    key.appendNumber( l.length() );
+    key.append( '/' );
+    key.append( dl.utf8() );
+    key.append( l.utf8() );
+    key.append( n.utf8() );
+    d = ::cache->addresses.find( key );
     if ( !d ) {
         d = new AddressData;
         d->name = n;
@@ -164,7 +164,7 @@ void Address::init( const UString &n, const UString &l, const UString &o )
                   d->localpart.isEmpty() &&
                   d->domain.isEmpty() )
             d->type = Bounce;
-        step3->insert( n, d );
+        ::cache->addresses.insert( key, d );
     }
 }
 
@@ -458,6 +458,9 @@ AddressParser::AddressParser( EString s )
     : d( new AddressParserData )
 {
     d->s = s;
+    if ( simple() )
+        return;
+
     int i = s.length()-1;
     int j = i+1;
     bool colon = s.contains( ':' );
@@ -559,6 +562,178 @@ AddressParser::AddressParser( EString s )
 }
 
 
+class SimpleAddress
+    : public Garbage
+{
+public:
+    SimpleAddress(): Garbage() {}
+
+    EString name;
+    EString localpart;
+    EString domain;
+};
+
+
+static inline bool isSimpleAtext( char c )
+{
+    return ( c >= 'a' && c <= 'z' ) ||
+        ( c >= 'A' && c <= 'Z' ) ||
+        ( c >= '0' && c <= '9' ) ||
+        c == '!' || c == '#' || c == '$' || c == '%' ||
+        c == '&' || c == '\'' || c == '*' || c == '+' ||
+        c == '-' || c == '/' || c == '=' || c == '?' ||
+        c == '^' || c == '_' || c == '`' || c == '{' ||
+        c == '|' || c == '}' || c == '~';
+}
+
+
+static inline bool isSimpleSpace( char c )
+{
+    return c == ' ' || c == 9 || c == 10 || c == 13;
+}
+
+
+// returns the end of the dot-atom starting at \a i in \a s, or \a i
+// if there isn't one. a domain is restricted to letters, digits and
+// hyphens, and mustn't end with a digit, since the full parser turns
+// some of those into address literals.
+
+static uint simpleDotAtom( const EString & s, uint i, bool domain )
+{
+    uint e = i;
+    while ( true ) {
+        uint b = e;
+        while ( domain
+                ? ( ( s[e] >= 'a' && s[e] <= 'z' ) ||
+                    ( s[e] >= 'A' && s[e] <= 'Z' ) ||
+                    ( s[e] >= '0' && s[e] <= '9' ) || s[e] == '-' )
+                : isSimpleAtext( s[e] ) )
+            e++;
+        if ( e == b )
+            return i;
+        if ( s[e] != '.' )
+            break;
+        e++;
+    }
+    if ( domain && s[e-1] >= '0' && s[e-1] <= '9' )
+        return i;
+    return e;
+}
+
+
+/*! This private helper parses the input in a single forward pass if
+    it's a list of plain addr-specs and "display-name <addr-spec>",
+    which is what most address fields contain, and returns true. The
+    display-name may be a sequence of atoms or a single quoted string
+    without quoted-pairs.
+
+    If the input contains anything else (comments, groups, encoded
+    words, 8-bit, obsolete syntax or an error), simple() returns false
+    without having changed anything, and the constructor uses the
+    full parser, which works backwards and copes with nearly
+    everything.
+*/
+
+bool AddressParser::simple()
+{
+    const EString & s = d->s;
+    List<SimpleAddress> found;
+    uint i = 0;
+    while ( isSimpleSpace( s[i] ) )
+        i++;
+    while ( i < s.length() ) {
+        SimpleAddress * a = new SimpleAddress;
+        uint e = simpleDotAtom( s, i, false );
+        if ( s[e] == '@' && e > i ) {
+            // addr-spec
+            a->localpart = s.mid( i, e - i );
+            i = e + 1;
+            e = simpleDotAtom( s, i, true );
+            if ( e == i )
+                return false;
+            a->domain = s.mid( i, e - i );
+            i = e;
+        }
+        else {
+            // [display-name] "<" addr-spec ">"
+            if ( s[i] == '"' ) {
+                uint b = i + 1;
+                e = b;
+                while ( s[e] >= ' ' && s[e] < 127 &&
+                        s[e] != '"' && s[e] != '\\' )
+                    e++;
+                if ( s[e] != '"' )
+                    return false;
+                a->name = s.mid( b, e - b );
+                i = e + 1;
+            }
+            else if ( s[i] != '<' ) {
+                uint b = i;
+                uint last = i;
+                while ( isSimpleAtext( s[i] ) ) {
+                    while ( isSimpleAtext( s[i] ) )
+                        i++;
+                    last = i;
+                    while ( s[i] == ' ' )
+                        i++;
+                }
+                if ( last == b )
+                    return false;
+                a->name = s.mid( b, last - b );
+            }
+            if ( a->name.contains( "=?" ) )
+                return false;
+            while ( isSimpleSpace( s[i] ) )
+                i++;
+            if ( s[i] != '<' )
+                return false;
+            i++;
+            e = simpleDotAtom( s, i, false );
+            if ( e == i || s[e] != '@' )
+                return false;
+            a->localpart = s.mid( i, e - i );
+            i = e + 1;
+            e = simpleDotAtom( s, i, true );
+            if ( e == i || s[e] != '>' )
+                return false;
+            a->domain = s.mid( i, e - i );
+            i = e + 1;
+        }
+        found.append( a );
+        while ( isSimpleSpace( s[i] ) )
+            i++;
+        if ( i < s.length() ) {
+            if ( s[i] != ',' )
+                return false;
+            i++;
+            while ( isSimpleSpace( s[i] ) )
+                i++;
+            if ( i >= s.length() )
+                return false;
+        }
+    }
+    if ( found.isEmpty() )
+        return false;
+
+    // add() prepends, so we add the last address first
+    AsciiCodec c;
+    List<SimpleAddress>::Iterator a( found.last() );
+    while ( a ) {
+        add( c.toUnicode( a->name ),
+             c.toUnicode( a->localpart ), c.toUnicode( a->domain ) );
+        --a;
+    }
+    if ( !d->firstError.isEmpty() ) {
+        d->a.clear();
+        d->firstError.truncate();
+        d->recentError.truncate();
+        return false;
+    }
+    Address::uniquify( &d->a );
+    return true;
+}
+
+
 /*! Finds the point between \a left and \a right which is most likely
     to be the border between two addresses. Mucho heuristics. Never
     used for correct addresses, only when we're grasping at straws.
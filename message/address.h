@@ -69,6 +69,7 @@ public:
     static AddressParser * references( const EString & );
 
 private:
+    bool simple();
     void address( int & );
     void space( int & );
     void comment( int & );
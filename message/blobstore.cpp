@@ -0,0 +1,310 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "blobstore.h"
+
+#include "configuration.h"
+#include "estring.h"
+#include "cache.h"
+#include "file.h"
+#include "dict.h"
+#include "log.h"
+
+// open, O_WRONLY, O_CREAT, O_EXCL
+#include <fcntl.h>
+// write, pread, close, fsync, getpid
+#include <unistd.h>
+// stat, fstat, mkdir
+#include <sys/stat.h>
+// rename
+#include <stdio.h>
+// errno
+#include <errno.h>
+
+
+// bodyparts smaller than this stay in the database
+static const uint smallest = 16384;
+
+// the most bytes of cold bodyparts kept in RAM, and the largest one
+static const uint coldCacheSize = 64 * 1024 * 1024;
+static const uint largestCached = 4 * 1024 * 1024;
+
+
+class ColdCache
+    : public Cache
+{
+public:
+    ColdCache(): Cache( 2 ), bytes( 0 ) {}
+
+    Dict<EString> parts;
+    uint bytes;
+
+    void clear() { parts.clear(); bytes = 0; }
+};
+
+
+static ColdCache * coldCache = 0;
+
+
+/*! \class BlobStore blobstore.h
+    The BlobStore class keeps large binary bodyparts in files instead
+    of in bodyparts.data.
+
+    If blob-directory is set, the Injector asks store() to write each
+    large non-text bodypart to a file named after bodyparts.hash, and
+    leaves both bodyparts.data and bodyparts.text null. The Fetcher
+    notices that and uses fetch() to read the file instead.
+
+    The files are content-addressed: Two bodyparts with the same hash
+    share a file. If a new bodypart has the same hash as a stored
+    file but different content, store() refuses it and the bodypart
+    is kept in the database as usual.
+
+    The files are written and synced before the injecting transaction
+    commits, so a committed bodypart always has its file.
+
+    If cold-storage-directory is set, the Maintainer moves the data of
+    old bodyparts from the database to files there, in the same form
+    (see Maintainer). fetch() looks there when a bodypart's file isn't
+    in blob-directory, and keeps what it read from there in RAM for a
+    while, since cold storage is usually slow.
+*/
+
+
+/*! Returns true if blob-directory is set, ie. if new bodyparts may be
+    stored in files.
+*/
+
+bool BlobStore::enabled()
+{
+    return !Configuration::text( Configuration::BlobDir ).isEmpty();
+}
+
+
+/*! Returns true if cold-storage-directory is set, ie. if bodyparts
+    may have been moved to cold storage.
+*/
+
+bool BlobStore::coldEnabled()
+{
+    return !Configuration::text( Configuration::ColdStorageDir ).isEmpty();
+}
+
+
+/*! Returns true if \a data should be stored in a file rather than in
+    the database.
+*/
+
+bool BlobStore::wants( const EString & data )
+{
+    return enabled() && data.length() >= smallest;
+}
+
+
+/*! Returns the size below which bodyparts are kept in the database. */
+
+uint BlobStore::minimumSize()
+{
+    return smallest;
+}
+
+
+/*! Returns the name of the file used to store data whose hash is \a
+    hash, in cold-storage-directory if \a cold is true and in
+    blob-directory if not. The files are spread over 256
+    subdirectories to keep directories small.
+*/
+
+EString BlobStore::fileName( const EString & hash, bool cold )
+{
+    EString r = Configuration::text( Configuration::BlobDir );
+    if ( cold )
+        r = Configuration::text( Configuration::ColdStorageDir );
+    if ( !r.endsWith( "/" ) )
+        r.append( "/" );
+    r.append( hash.mid( 0, 2 ) );
+    r.append( "/" );
+    r.append( hash );
+    return r;
+}
+
+
+/*! Stores \a data in the file belonging to \a hash, and returns true
+    if that worked. If the file exists and contains \a data already,
+    store() returns true without writing anything. The file is in
+    cold-storage-directory if \a cold is true, and in blob-directory
+    otherwise.
+
+    Returns false and logs the reason if the data could not be written
+    or if another blob already has this \a hash.
+*/
+
+bool BlobStore::store( const EString & hash, const EString & data,
+                       bool cold )
+{
+    if ( !( cold ? coldEnabled() : enabled() ) || hash.length() < 2 )
+        return false;
+
+    EString name = fileName( hash, cold );
+    EString chn = File::chrooted( name );
+
+    struct stat st;
+    if ( ::stat( chn.cstr(), &st ) == 0 ) {
+        if ( (uint)st.st_size == data.length() ) {
+            File f( name );
+            if ( f.valid() && f.contents() == data )
+                return true;
+        }
+        log( "Hash collision in blob-directory: " + name,
+             Log::Significant );
+        return false;
+    }
+
+    EString parent = chn.mid( 0, chn.length() - hash.length() - 1 );
+    if ( ::mkdir( parent.cstr(), 0700 ) < 0 && errno != EEXIST ) {
+        log( "Could not create " + parent + ": " + fn( errno ),
+             Log::Error );
+        return false;
+    }
+
+    EString tmp = chn;
+    tmp.append( "." );
+    tmp.appendNumber( (uint)getpid() );
+    int fd = ::open( tmp.cstr(), O_WRONLY|O_CREAT|O_EXCL, 0600 );
+    if ( fd < 0 ) {
+        log( "Could not open " + tmp + " for writing: " + fn( errno ),
+             Log::Error );
+        return false;
+    }
+
+    uint done = 0;
+    while ( done < data.length() ) {
+        int n = ::write( fd, data.data() + done, data.length() - done );
+        if ( n < 0 && errno != EINTR )
+            break;
+        if ( n > 0 )
+            done += n;
+    }
+
+    bool ok = done == data.length() && ::fsync( fd ) == 0;
+    ::close( fd );
+    if ( ok && ::rename( tmp.cstr(), chn.cstr() ) < 0 )
+        ok = false;
+
+    if ( !ok ) {
+        log( "Could not write " + name + ": " + fn( errno ), Log::Error );
+        ::unlink( tmp.cstr() );
+    }
+    return ok;
+}
+
+
+/*! Returns the data stored for \a hash. If \a ok is non-null, \a *ok
+    is set to true if the data could be read and to false if not. A
+    file that has gone missing is logged as an error.
+
+    If the file isn't in blob-directory, fetch() looks in
+    cold-storage-directory, and caches what it finds there.
+*/
+
+EString BlobStore::fetch( const EString & hash, bool * ok )
+{
+    if ( enabled() || !coldEnabled() ) {
+        File f( fileName( hash ) );
+        if ( f.valid() || !coldEnabled() ) {
+            if ( ok )
+                *ok = f.valid();
+            if ( !f.valid() ) {
+                log( "Could not read bodypart from " + f.name(),
+                     Log::Error );
+                return "";
+            }
+            return f.contents();
+        }
+    }
+
+    EString * c = 0;
+    if ( ::coldCache )
+        c = ::coldCache->parts.find( hash );
+    if ( c ) {
+        if ( ok )
+            *ok = true;
+        return *c;
+    }
+
+    File f( fileName( hash, true ) );
+    if ( ok )
+        *ok = f.valid();
+    if ( !f.valid() ) {
+        log( "Could not read bodypart from " + f.name(), Log::Error );
+        return "";
+    }
+
+    EString r = f.contents();
+    if ( r.length() <= largestCached ) {
+        if ( !::coldCache )
+            ::coldCache = new ColdCache;
+        if ( ::coldCache->bytes + r.length() > coldCacheSize )
+            ::coldCache->clear();
+        ::coldCache->parts.insert( hash, new EString( r ) );
+        ::coldCache->bytes += r.length();
+    }
+    return r;
+}
+
+
+/*! Returns at most \a length bytes, starting at \a offset, of the
+    data stored for \a hash, reading only those bytes from the file.
+    If \a ok is nonnull, sets *\a ok to true if the file could be
+    read, and to false if not.
+*/
+
+EString BlobStore::fetch( const EString & hash, uint offset, uint length,
+                          bool * ok )
+{
+    EString r;
+    if ( ::coldCache ) {
+        EString * c = ::coldCache->parts.find( hash );
+        if ( c ) {
+            if ( ok )
+                *ok = true;
+            return c->mid( offset, length );
+        }
+    }
+
+    EString name = File::chrooted( fileName( hash ) );
+    int fd = -1;
+    if ( enabled() || !coldEnabled() )
+        fd = ::open( name.cstr(), O_RDONLY );
+    if ( fd < 0 && coldEnabled() ) {
+        name = File::chrooted( fileName( hash, true ) );
+        fd = ::open( name.cstr(), O_RDONLY );
+    }
+    if ( ok )
+        *ok = fd >= 0;
+    if ( fd < 0 ) {
+        log( "Could not read bodypart from " + name, Log::Error );
+        return r;
+    }
+
+    struct stat st;
+    if ( ::fstat( fd, &st ) == 0 && (uint)st.st_size > offset ) {
+        if ( length > (uint)st.st_size - offset )
+            length = (uint)st.st_size - offset;
+        r.reserve( length );
+        char buffer[8192];
+        uint done = 0;
+        while ( done < length ) {
+            int n = ::pread( fd, buffer, length - done > sizeof( buffer )
+                             ? sizeof( buffer ) : length - done,
+                             offset + done );
+            if ( n < 0 && errno == EINTR )
+                continue;
+            if ( n <= 0 )
+                break;
+            r.append( buffer, n );
+            done += n;
+        }
+    }
+    ::close( fd );
+    return r;
+}
@@ -0,0 +1,29 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include "global.h"
+
+
+class EString;
+
+
+class BlobStore
+    : public Garbage
+{
+public:
+    static bool enabled();
+    static bool coldEnabled();
+    static bool wants( const EString & );
+    static uint minimumSize();
+
+    static bool store( const EString &, const EString &, bool = false );
+    static EString fetch( const EString &, bool * = 0 );
+    static EString fetch( const EString &, uint, uint, bool * = 0 );
+
+    static EString fileName( const EString &, bool = false );
+};
+
+
+#endif
@@ -12,6 +12,7 @@
 #include "unknown.h"
 #include "iso2022jp.h"
 #include "mimefields.h"
+#include "configuration.h"
 #include "log.h"
 
 
@@ -35,7 +36,7 @@ public:
     uint numEncodedLines;
 
     EString data;
-    UString text;
+    EString text;
     bool hasText;
     EString error;
 };
@@ -178,23 +179,50 @@ void Bodypart::setData( const EString &s )
 
 /*! Returns the text of this Bodypart. MUST NOT be called for non-text
     parts (whose contents are not known to be well-formed text).
+
+    The text is kept in UTF-8 and decoded each time this function is
+    called. Use utf8Text() if UTF-8 is what's wanted anyway.
 */
 
 UString Bodypart::text() const
 {
-    if ( d->hasText )
-        return d->text;
-
     Utf8Codec c;
+    if ( d->hasText )
+        return c.toUnicode( d->text );
     return c.toUnicode( d->data );
 }
 
 
+/*! Returns the text of this Bodypart encoded as UTF-8, without
+    decoding it to a UString first. As for text(), this MUST NOT be
+    called for non-text parts.
+*/
+
+EString Bodypart::utf8Text() const
+{
+    if ( d->hasText )
+        return d->text;
+    return d->data;
+}
+
+
 /*! Sets the text of this Bodypart to \a s. For use only by
     MessageBodyFetcher for now.
 */
 
 void Bodypart::setText( const UString &s )
+{
+    d->hasText = true;
+    d->text = s.utf8();
+}
+
+
+/*! Sets the text of this Bodypart to \a s, which must be valid
+    UTF-8. This is cheaper than setText() when the text already is
+    UTF-8.
+*/
+
+void Bodypart::setUtf8Text( const EString &s )
 {
     d->hasText = true;
     d->text = s;
@@ -394,6 +422,22 @@ void Bodypart::parseMultipart( uint i, uint end,
 }
 
 
+/*! Returns the number of bytes EString::e64( 72 ) produces for \a n
+    bytes of input, without looking at the input.
+*/
+
+static uint base64Length( uint n )
+{
+    if ( !n )
+        return 0;
+    uint full = n / 3;
+    uint r = 4 * ( ( n + 2 ) / 3 ) + 2 * ( full / 18 );
+    if ( full % 18 )
+        r += 2;
+    return r;
+}
+
+
 static Codec * guessTextCodec( const EString & body )
 {
     // step 1. try iso-2022-jp. this goes first because it's so
@@ -584,6 +628,7 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
         ct = h->contentType();
     }
     if ( ct->type() == "text" ) {
+        UString text;
         bool specified = false;
         bool unknown = false;
         Codec * c = 0;
@@ -613,7 +658,7 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
             c = new AsciiCodec;
 
         bp->d->hasText = true;
-        bp->d->text = c->toUnicode( body.crlf() );
+        text = c->toUnicode( body.crlf() );
 
         if ( c->name() == "GB2312" || c->name() == "ISO-2022-JP" ||
              c->name() == "KS_C_5601-1987" ) {
@@ -641,10 +686,10 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
             }
 
             // if the body was bad, we prefer the (unicode) in
-            // bp->d->text and pretend it arrived as UTF-8:
+            // the unicode text and pretend it arrived as UTF-8:
             if ( bad ) {
                 c = new Utf8Codec;
-                body = c->fromUnicode( bp->d->text );
+                body = c->fromUnicode( text );
             }
         }
 
@@ -665,7 +710,7 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
                 // unknown-8bit.
                 if ( !specified && !c->valid() ) {
                     c = new Unknown8BitCodec;
-                    bp->d->text = c->toUnicode( body.crlf() );
+                    text = c->toUnicode( body.crlf() );
                 }
             }
             else {
@@ -673,7 +718,7 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
                 // than what we had?
                 if ( g->wellformed() && !c->wellformed() ) {
                     c = g;
-                    bp->d->text = guessed;
+                    text = guessed;
                 }
             }
         }
@@ -685,19 +730,19 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
             // result (probably including one or more U+FFFD) and
             // labelling the message as UTF-8.
             c = new Utf8Codec;
-            body = c->fromUnicode( bp->d->text );
+            body = c->fromUnicode( text );
         }
         else if ( !specified && c->state() == Codec::Invalid ) {
             // the codec was not specified, and we couldn't find
             // anything. we call it unknown-8bit.
             c = new Unknown8BitCodec;
-            bp->d->text = c->toUnicode( body );
+            text = c->toUnicode( body );
         }
 
         // if we ended up using a 16-bit codec and were using q-p, we
         // need to reevaluate without any trailing CRLF
         if ( e == EString::QP && c->name().startsWith( "UTF-16" ) )
-            bp->d->text = c->toUnicode( body.stripCRLF() );
+            text = c->toUnicode( body.stripCRLF() );
 
         if ( !c->valid() && bp->d->error.isEmpty() ) {
             bp->d->error = "Could not convert body to Unicode";
@@ -719,7 +764,8 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
             ct->addParameter( "charset", c->name().lower() );
         else if ( ct )
             ct->removeParameter( "charset" );
-        body = c->fromUnicode( bp->d->text );
+        body = c->fromUnicode( text );
+        bp->d->text = text.utf8();
         bool qp = body.needsQP();
 
         if ( cte ) {
@@ -792,12 +838,21 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
         body = m->rfc822( false );
     }
 
+    bool countLines = bp->d->hasText ||
+                      ( ct->type() == "message" &&
+                        ct->subtype() == "rfc822" );
     bp->d->numBytes = body.length();
-    if ( cte )
-        body = body.encoded( cte->encoding(), 72 );
-    bp->d->numEncodedBytes = body.length();
-    if ( bp->d->hasText ||
-         ( ct->type() == "message" && ct->subtype() == "rfc822" ) ) {
+    if ( cte && cte->encoding() == EString::Base64 && !countLines ) {
+        // we need only the size, and that's easily computed. avoid
+        // making a second, bigger copy of a possibly huge body.
+        bp->d->numEncodedBytes = base64Length( body.length() );
+    }
+    else {
+        if ( cte )
+            body = body.encoded( cte->encoding(), 72 );
+        bp->d->numEncodedBytes = body.length();
+    }
+    if ( countLines ) {
         uint n = 0;
         uint i = 0;
         uint l = body.length();
@@ -854,3 +909,26 @@ EString Bodypart::error() const
 {
     return d->error;
 }
+
+
+// bodyparts smaller than this aren't worth compressing
+static const uint minimumCompressible = 512;
+
+
+/*! Returns \a data compressed with EString::deflated() for storage in
+    bodyparts.data, or an empty string if compress-bodyparts is
+    disabled or compressing \a data wouldn't save at least an eighth
+    of it. Most images and archives are compressed already, and gain
+    nothing but a slower fetch.
+*/
+
+EString Bodypart::compressed( const EString & data )
+{
+    if ( !Configuration::toggle( Configuration::CompressBodyparts ) ||
+         data.length() < minimumCompressible )
+        return "";
+    EString r = data.deflated();
+    if ( r.isEmpty() || r.length() > data.length() - data.length() / 8 )
+        return "";
+    return r;
+}
@@ -36,7 +36,9 @@ public:
     bool isBodypart() const;
 
     UString text() const;
+    EString utf8Text() const;
     void setText( const UString & );
+    void setUtf8Text( const EString & );
 
     uint numBytes() const;
     void setNumBytes( uint );
@@ -51,6 +53,8 @@ public:
 
     EString error() const;
 
+    static EString compressed( const EString & );
+
     static Bodypart *parseBodypart( uint, uint, const EString &,
                                     Header *, Multipart * );
 
@@ -3,6 +3,7 @@
 #include "date.h"
 
 #include "parser.h"
+#include "cache.h"
 
 // time_t
 #include <time.h>
@@ -25,6 +26,8 @@ public:
         tzn = "";
         valid = false;
         minus0 = false;
+        known = false;
+        unixTime = 0;
     }
 
 public:
@@ -34,6 +37,11 @@ public:
     EString tzn;
     bool valid;
     bool minus0;
+    // true if the fields were set by setUnixTime( unixTime ), with
+    // tz and minus0 possibly set afterwards. imap() uses that as a
+    // cache key.
+    bool known;
+    uint unixTime;
 };
 
 
@@ -89,6 +97,7 @@ void Date::setCurrentTime()
     d->tzn = "";
     d->valid = true;
     d->minus0 = false;
+    d->known = false;
 }
 
 
@@ -111,7 +120,8 @@ void Date::setUnixTime( uint t )
     d->second = gmt.tm_sec;
     d->valid = true;
     d->minus0 = false;
-
+    d->known = true;
+    d->unixTime = t;
 }
 
 
@@ -303,11 +313,15 @@ static bool weekday( const EString & name )
 
 void Date::setRfc822( const EString & s )
 {
+    d->reset();
+    if ( setCanonicalRfc822( s ) ) {
+        finishRfc822();
+        return;
+    }
+
     EmailParser p( s );
     EString a;
 
-    d->reset();
-
     // we'll understand 2822, but a bit kinder.
 
     // perhaps this is all bad. perhaps we should scan the string for
@@ -528,6 +542,17 @@ void Date::setRfc822( const EString & s )
             d->year += 1900;
     }
 
+    finishRfc822();
+}
+
+
+/*! This private helper marks the date set by setRfc822() as valid,
+    checks it harder, and moves dates in time zones PostgreSQL cannot
+    store to -0000.
+*/
+
+void Date::finishRfc822()
+{
     d->valid = true;
     checkHarder();
     if ( !d->valid )
@@ -545,6 +570,126 @@ void Date::setRfc822( const EString & s )
 }
 
 
+static inline bool isDigit( char c )
+{
+    return c >= '0' && c <= '9';
+}
+
+
+/*! This private helper parses \a s if it's in the canonical RFC 5322
+    form, "Mon, 13 Dec 2003 10:00:00 +0100", optionally without the
+    weekday and with a time zone name in a comment at the end, which
+    is what nearly all Date and Received fields contain. It sets the
+    fields and returns true if \a s is in that form, and returns
+    false without changing anything else if not, so that
+    setRfc822() can use its more lenient parser.
+
+    The result is the same as setRfc822()'s would have been.
+*/
+
+bool Date::setCanonicalRfc822( const EString & s )
+{
+    uint i = 0;
+    if ( s[3] == ',' && s[4] == ' ' ) {
+        uint w = 0;
+        while ( w < 7 && !( (s[0]|0x20) == (weekdays[w][0]|0x20) &&
+                            (s[1]|0x20) == (weekdays[w][1]|0x20) &&
+                            (s[2]|0x20) == (weekdays[w][2]|0x20) ) )
+            w++;
+        if ( w == 7 )
+            return false;
+        i = 5;
+    }
+
+    // day
+    if ( !isDigit( s[i] ) )
+        return false;
+    int day = s[i++] - '0';
+    if ( isDigit( s[i] ) )
+        day = day * 10 + s[i++] - '0';
+    if ( s[i++] != ' ' )
+        return false;
+
+    // month
+    uint m = 0;
+    while ( m < 12 && !( (s[i]|0x20) == (months[m][0]|0x20) &&
+                         (s[i+1]|0x20) == (months[m][1]|0x20) &&
+                         (s[i+2]|0x20) == (months[m][2]|0x20) ) )
+        m++;
+    if ( m == 12 || s[i+3] != ' ' )
+        return false;
+    i += 4;
+
+    // year, hour, minute, second
+    if ( !isDigit( s[i] ) || s[i] == '0' || !isDigit( s[i+1] ) ||
+         !isDigit( s[i+2] ) || !isDigit( s[i+3] ) || s[i+4] != ' ' )
+        return false;
+    int year = ( s[i] - '0' ) * 1000 + ( s[i+1] - '0' ) * 100 +
+               ( s[i+2] - '0' ) * 10 + ( s[i+3] - '0' );
+    i += 5;
+    if ( !isDigit( s[i] ) || !isDigit( s[i+1] ) || s[i+2] != ':' ||
+         !isDigit( s[i+3] ) || !isDigit( s[i+4] ) || s[i+5] != ':' ||
+         !isDigit( s[i+6] ) || !isDigit( s[i+7] ) || s[i+8] != ' ' )
+        return false;
+    int hour = ( s[i] - '0' ) * 10 + s[i+1] - '0';
+    int minute = ( s[i+3] - '0' ) * 10 + s[i+4] - '0';
+    int second = ( s[i+6] - '0' ) * 10 + s[i+7] - '0';
+    if ( hour > 23 || minute > 59 || second > 60 )
+        return false;
+    i += 9;
+
+    // zone, which is as strict as setRfc822()'s
+    if ( !( ( s[i] == '+' || s[i] == '-' ) &&
+            ( s[i+1] >= '0' && s[i+1] <= '2' ) &&
+            isDigit( s[i+2] ) &&
+            ( s[i+3] >= '0' && s[i+3] <= '5' ) &&
+            isDigit( s[i+4] ) ) )
+        return false;
+    int tz = ( s[i+1] - '0' ) * 600 + ( s[i+2] - '0' ) * 60 +
+             ( s[i+3] - '0' ) * 10 + s[i+4] - '0';
+    bool minus0 = false;
+    if ( s[i] == '-' ) {
+        tz = -tz;
+        if ( !tz )
+            minus0 = true;
+    }
+    i += 5;
+
+    // and an optional zone name, which is used only if it agrees
+    EString tzn;
+    if ( i < s.length() ) {
+        if ( s[i] != ' ' || s[i+1] != '(' )
+            return false;
+        uint b = i + 2;
+        uint e = b;
+        while ( ( s[e] >= 'a' && s[e] <= 'z' ) ||
+                ( s[e] >= 'A' && s[e] <= 'Z' ) )
+            e++;
+        if ( e == b || s[e] != ')' || e + 1 != s.length() )
+            return false;
+        if ( !minus0 ) {
+            EString n = s.mid( b, e - b ).lower();
+            uint j = 0;
+            while ( zones[j].name != 0 && zones[j].name != n )
+                j++;
+            if ( zones[j].name != 0 && zones[j].offset == tz )
+                tzn = zones[j].name;
+        }
+    }
+
+    d->day = day;
+    d->month = m + 1;
+    d->year = year;
+    d->hour = hour;
+    d->minute = minute;
+    d->second = second;
+    d->tz = tz;
+    d->tzn = tzn;
+    d->minus0 = minus0;
+    return true;
+}
+
+
 
 /* Returns the day-of-week (0..6) from year/month/day, using the CACM
    algorithm also used in Qt. Communications of the ACM, Vol 6, No 8.
@@ -629,11 +774,50 @@ EString Date::rfc822() const
 }
 
 
+class ImapDateCache
+    : public Cache
+{
+public:
+    ImapDateCache(): Cache( 4 ) { clear(); }
+
+    void clear() {
+        uint i = 0;
+        while ( i < Size ) {
+            dates[i].s = 0;
+            i++;
+        }
+    }
+
+    // a direct-mapped table, keyed by unix time and time zone
+    static const uint Size = 1024;
+    struct Entry {
+        uint t;
+        int tz;
+        bool minus0;
+        EString * s;
+    };
+    Entry dates[Size];
+};
+
+
+static ImapDateCache * imapDates;
+
+
+static inline void twoDigits( char * p, uint n )
+{
+    p[0] = '0' + ( n / 10 ) % 10;
+    p[1] = '0' + n % 10;
+}
+
+
 /*! Returns an IMAP-format date-time, or an empty string if the date
   is invalid.
 
   (date-day-fixed "-" date-month "-" date-year SP time SP zone)
 
+  Dates set using setUnixTime() are remembered until the next garbage
+  collection or so, since FETCH INTERNALDATE tends to format the same
+  dates repeatedly.
 */
 
 EString Date::imap() const
@@ -642,27 +826,48 @@ EString Date::imap() const
     if ( !d->valid )
         return r;
 
-    r.append( zeroPrefixed( d->day, 2 ) );
-    r.append( "-" );
-    r.append( months[ d->month-1 ] );
-    r.append( "-" );
-    r.append( zeroPrefixed( d->year, 4 ) );
-    r.append( " " );
-    r.append( zeroPrefixed( d->hour, 2 ) );
-    r.append( ":" );
-    r.append( zeroPrefixed( d->minute, 2 ) );
-    r.append( ":" );
-    r.append( zeroPrefixed( d->second, 2 ) );
-    r.append( " " );
+    ImapDateCache::Entry * e = 0;
+    if ( d->known ) {
+        if ( !::imapDates )
+            ::imapDates = new ImapDateCache;
+        e = &::imapDates->dates[( d->unixTime ^ (uint)d->tz ) %
+                                ImapDateCache::Size];
+        if ( e->s && e->t == d->unixTime && e->tz == d->tz &&
+             e->minus0 == d->minus0 )
+            return *e->s;
+    }
 
+    // dd-Mmm-yyyy hh:mm:ss +zzzz
+    char b[26];
+    twoDigits( b, d->day );
+    b[2] = '-';
+    b[3] = months[d->month-1][0];
+    b[4] = months[d->month-1][1];
+    b[5] = months[d->month-1][2];
+    b[6] = '-';
+    twoDigits( b + 7, d->year / 100 );
+    twoDigits( b + 9, d->year % 100 );
+    b[11] = ' ';
+    twoDigits( b + 12, d->hour );
+    b[14] = ':';
+    twoDigits( b + 15, d->minute );
+    b[17] = ':';
+    twoDigits( b + 18, d->second );
+    b[20] = ' ';
     if ( d->minus0 || d->tz < 0 )
-        r.append( "-" );
+        b[21] = '-';
     else
-        r.append( "+" );
-
-    r.append( zeroPrefixed( abs( d->tz ) / 60, 2 ) );
-    r.append( zeroPrefixed( abs( d->tz ) % 60, 2 ) );
-
+        b[21] = '+';
+    twoDigits( b + 22, abs( d->tz ) / 60 );
+    twoDigits( b + 24, abs( d->tz ) % 60 );
+    r.append( b, 26 );
+
+    if ( e ) {
+        e->t = d->unixTime;
+        e->tz = d->tz;
+        e->minus0 = d->minus0;
+        e->s = new EString( r );
+    }
     return r;
 }
 
@@ -46,6 +46,9 @@ public:
 
 private:
     class DateData * d;
+
+    bool setCanonicalRfc822( const EString & );
+    void finishRfc822();
 };
 
 
@@ -92,8 +92,10 @@ EString DSN::envelopeId() const
 
 /*! Records that the resulting DSN should include the entire message()
     if \a full is true, and just its top-level header if \a full is
-    false. The initial value is true (this may change in a future
-    version).
+    false. The initial value is true.
+
+    result() currently includes only the header in either case, so
+    that bounces stay small however large the original message is.
 */
 
 void DSN::setFullReport( bool full )
@@ -193,26 +195,12 @@ Injectee * DSN::result() const
     r->children()->append( dsn );
     r->children()->append( original );
 
-    // set up the original message, either full or header-only
-    if ( fullReport() ) {
-        original->header()->add( "Content-Type", "text/rfc822-headers" );
-        original->setData( message()->header()->asText( false ) );
-
-        // this is what we _should_ do, except that we don't. the body
-        // of the message is lost, probably because original-> has a
-        // null parent.
-
-        //original->header()->add( "Content-Type", "message/rfc822" );
-        //original->setMessage( message() );
-
-        // and maybe we shouldn't anyway. sending a potentially big
-        // body in a bounce is not necessarily a good idea.
-    }
-    else {
-        // nasty mime name there
-        original->header()->add( "Content-Type", "text/rfc822-headers" );
-        original->setData( message()->header()->asText( false ) );
-    }
+    // the original message is represented by its header alone. the
+    // body could be large, and in a mail loop or backscatter storm
+    // we'd send and store a copy of it in every bounce.
+    EString headerText = message()->header()->asText( false );
+    original->header()->add( "Content-Type", "text/rfc822-headers" );
+    original->setData( headerText );
 
     // the from field has to contain... what? let's try this for now.
     AsciiCodec a;
@@ -239,16 +227,21 @@ Injectee * DSN::result() const
     else
         h->add( "Subject", "Message delivery reports" );
     h->add( "Mime-Version", "1.0" );
-    h->add( "Content-Type", "multipart/report; boundary=" +
-            Message::acceptableBoundary( message()->rfc822( false ) ) );
 
     // set up the plaintext and DSN parts
     // what charset should we use for plainText?
     plainText->header()->add( "Content-Type", "text/plain; format=flowed" );
     dsn->header()->add( "Content-Type", "message/delivery-status" );
 
-    plainText->setData( plainBody() );
-    dsn->setData( dsnBody() );
+    EString plain = plainBody();
+    EString status = dsnBody();
+    plainText->setData( plain );
+    dsn->setData( status );
+
+    // the boundary need only be absent from what we send, so there's
+    // no need to render the entire original message to choose it.
+    h->add( "Content-Type", "multipart/report; boundary=" +
+            Message::acceptableBoundary( plain + status + headerText ) );
     r->addMessageId( Configuration::hostname() );
 
     return r;
@@ -6,6 +6,7 @@
 #include "transaction.h"
 #include "integerset.h"
 #include "allocator.h"
+#include "blobstore.h"
 #include "bodypart.h"
 #include "selector.h"
 #include "postgres.h"
@@ -16,9 +17,15 @@
 #include "query.h"
 #include "scope.h"
 #include "timer.h"
+#include "graph.h"
+#include "dict.h"
+#include "cache.h"
+#include "sharedcache.h"
 #include "utf.h"
 #include "map.h"
+#include "vector.h"
 #include "log.h"
+#include "configuration.h"
 
 #include <time.h> // time()
 
@@ -26,13 +33,62 @@
 enum State { NotStarted, Fetching, Done };
 
 
+// the estimated size of the message texts all Fetchers are fetching
+static uint bytesInFlight = 0;
+
+
+// what each user is fetching, for fetch-user-concurrency and
+// fetch-user-rate
+class FetchUser
+    : public Garbage
+{
+public:
+    FetchUser()
+        : Garbage(),
+          active( 0 ), changed( 0 ), tokens( 0 ), last( 0 ), throttled( 0 )
+    {}
+
+    EString name;
+    uint active;
+    uint changed;
+    int64 tokens;
+    uint last;
+    uint throttled;
+};
+
+// the values of interned header fields (see HeaderField::isInterned())
+// that this process has fetched recently, so the database needn't
+// send them again
+class InternedValueCache
+    : public Cache
+{
+public:
+    InternedValueCache(): Cache( 10 ), values( new Map<UString> ) {}
+
+    Map<UString> * values;
+    IntegerSet ids;
+
+    // a decoder may still be using the old map, so it's replaced
+    void clear() { values = new Map<UString>; ids.clear(); }
+};
+
+static InternedValueCache * internedValues = 0;
+// the most values internedValues holds
+static const uint maxInternedValues = 1024;
+
+
+static Dict<FetchUser> * fetchUsers = 0;
+static List<FetchUser> * throttledUsers = 0;
+static GraphableCounter * throttledFetches = 0;
+static uint lastThrottleReport = 0;
+
+
 class FetcherData
     : public Garbage
 {
 public:
     FetcherData()
-        : owner( 0 ),
-          q( 0 ),
+        : q( 0 ),
           transaction( 0 ),
           f( 0 ),
           state( NotStarted ),
@@ -42,13 +98,15 @@ public:
           lastBatchStarted( 0 ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
-          partnumbers( 0 ),
-          throttler( 0 )
+          partnumbers( 0 ), raw( 0 ), rawDone( false ),
+          throttler( 0 ),
+          batchBytes( 0 ), averageSize( 40 * 1024 ),
+          user( 0 ), waiting( false ), inFlight( false )
     {}
 
     List<Message> messages;
     Map< List<Message> > batch;
-    EventHandler * owner;
+    List<EventHandler> owners;
     List<Query> * q;
     Transaction * transaction;
 
@@ -69,12 +127,12 @@ public:
         }
         void execute();
         void process();
-        virtual void decode( Message *, List<Row> * ) = 0;
+        virtual void decode( Message *, Vector<Row> * ) = 0;
         virtual void setDone( Message * ) = 0;
         virtual bool isDone( Message * ) const = 0;
         Query * q;
         FetcherData * d;
-        List<Row> mr;
+        Vector<Row> mr;
     };
 
     Decoder * addresses;
@@ -82,6 +140,18 @@ public:
     Decoder * body;
     Decoder * trivia;
     Decoder * partnumbers;
+    Decoder * raw;
+    bool rawDone;
+
+    class RawDecoder
+        : public Decoder
+    {
+    public:
+        RawDecoder( FetcherData * fd ): Decoder( fd ) {}
+        void decode( Message *, Vector<Row> * );
+        void setDone( Message * );
+        bool isDone( Message * ) const;
+    };
 
     class TriviaDecoder
         : public Decoder
@@ -89,7 +159,7 @@ public:
     public:
         TriviaDecoder( FetcherData * fd )
             : Decoder( fd ) {}
-        void decode( Message *, List<Row> * );
+        void decode( Message *, Vector<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
     };
@@ -99,7 +169,7 @@ public:
     {
     public:
         AddressDecoder( FetcherData * fd ): Decoder( fd ) {}
-        void decode( Message *, List<Row> * );
+        void decode( Message *, Vector<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
     };
@@ -108,10 +178,12 @@ public:
         : public Decoder
     {
     public:
-        HeaderDecoder( FetcherData * fd ): Decoder( fd ) {}
-        void decode( Message *, List<Row> * );
+        HeaderDecoder( FetcherData * fd ): Decoder( fd ), interned( 0 ) {}
+        void decode( Message *, Vector<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
+        void addBlob( Header *, const EString & );
+        Map<UString> * interned;
     };
 
     class PartNumberDecoder
@@ -119,7 +191,7 @@ public:
     {
     public:
         PartNumberDecoder( FetcherData * fd ): Decoder( fd ) {}
-        void decode( Message *, List<Row> * );
+        void decode( Message *, Vector<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
     };
@@ -129,12 +201,19 @@ public:
     {
     public:
         BodyDecoder( FetcherData * fd ): PartNumberDecoder( fd ) {}
-        void decode( Message *, List<Row> * );
+        void decode( Message *, Vector<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
     };
 
     Connection * throttler;
+
+    uint batchBytes;
+    uint averageSize;
+
+    FetchUser * user;
+    bool waiting;
+    bool inFlight;
 };
 
 
@@ -151,19 +230,26 @@ public:
     an SQL select for them. Typically the select ends with
     "mailbox=$71 and uid in any($72). When the Fetcher isn't useful
     any more, its owner drops it on the floor.
+
+    The fetch-user-concurrency and fetch-user-rate settings limit how
+    much each user can fetch, so that one user downloading a large
+    mailbox doesn't slow everyone else down. A Fetcher whose user is
+    over the limit waits before starting its next batch.
 */
 
 
 /*! Constructs an empty Fetcher which will fetch \a messages and
     notify \a e when it's done, taking care to keep the write buffer
-    of \a connection short. */
+    of \a connection short, and to pause while the EventLoop has
+    throttled \a connection. */
 
 Fetcher::Fetcher( List<Message> * messages, EventHandler * e,
                   Connection * output )
     : EventHandler(), d( new FetcherData )
 {
     setLog( new Log );
-    d->owner = e;
+    if ( e )
+        d->owners.append( e );
     d->f = this;
     d->throttler = output;
     addMessages( messages );
@@ -181,7 +267,8 @@ Fetcher::Fetcher( Message * m, EventHandler * owner )
     : EventHandler(), d( new FetcherData )
 {
     setLog( new Log );
-    d->owner = owner;
+    if ( owner )
+        d->owners.append( owner );
     d->f = this;
     d->messages.append( m );
 }
@@ -212,6 +299,19 @@ void Fetcher::addMessages( List<Message> * messages )
 }
 
 
+/*! Records that \a e also wants to be notified whenever this Fetcher
+    makes progress. This lets several owners share one Fetcher, so
+    that messages added with addMessages() on behalf of \a e are
+    fetched by the same queries as the original owner's.
+*/
+
+void Fetcher::addOwner( EventHandler * e )
+{
+    if ( e && !d->owners.find( e ) )
+        d->owners.append( e );
+}
+
+
 /*! Returns true if this Fetcher has finished the work assigned to it
     (and will perform no further message updates), and false if it is
     still working.
@@ -237,7 +337,10 @@ void Fetcher::execute()
             start();
             break;
         case Fetching:
-            waitForEnd();
+            if ( d->waiting )
+                startBatch();
+            else
+                waitForEnd();
             break;
         case Done:
             break;
@@ -282,6 +385,10 @@ void Fetcher::start()
         n++;
         what.append( "bytes/lines" );
     }
+    if ( d->raw ) {
+        n++;
+        what.append( "raw" );
+    }
 
     if ( n < 1 || d->messages.isEmpty() ) {
         // nothing to do.
@@ -303,8 +410,7 @@ void Fetcher::start()
         d->batchSize = d->batchSize * 3 / 4;
 
     d->state = Fetching;
-    prepareBatch();
-    makeQueries();
+    startBatch();
 }
 
 
@@ -317,6 +423,27 @@ void Fetcher::start()
 
 void Fetcher::waitForEnd()
 {
+    if ( d->raw && !d->rawDone ) {
+        if ( d->raw->q && !d->raw->q->done() )
+            return;
+        d->rawDone = true;
+        Map< List<Message> >::Iterator bi( d->batch );
+        while ( bi ) {
+            List<Message>::Iterator li( *bi );
+            ++bi;
+            while ( li ) {
+                d->raw->setDone( li );
+                ++li;
+            }
+        }
+        if ( d->addresses || d->otherheader || d->body ||
+             d->trivia || d->partnumbers ) {
+            // the rest of this batch, for the messages without raw text
+            makeQueries();
+            return;
+        }
+    }
+
     List<FetcherData::Decoder> decoders;
     if ( d->addresses )
         decoders.append( d->addresses );
@@ -328,6 +455,8 @@ void Fetcher::waitForEnd()
         decoders.append( d->trivia );
     if ( d->partnumbers )
         decoders.append( d->partnumbers );
+    if ( d->raw )
+        decoders.append( d->raw );
 
     List<FetcherData::Decoder>::Iterator i( decoders );
     while ( i ) {
@@ -344,14 +473,18 @@ void Fetcher::waitForEnd()
             Message * m = li;
             ++li;
 
+            bool raw = d->raw && !m->rawText().isEmpty();
             List<FetcherData::Decoder>::Iterator di( decoders );
             while ( di ) {
-                di->setDone( m );
+                if ( !raw || di == d->raw || di == d->trivia )
+                    di->setDone( m );
                 ++di;
             }
         }
     }
 
+    finishBatch();
+
     if ( d->messages.isEmpty() ) {
         d->state = Done;
         if ( d->transaction )
@@ -362,16 +495,176 @@ void Fetcher::waitForEnd()
         d->throttler = 0;
     }
     else if ( d->throttler &&
-              d->throttler->writeBuffer() &&
-              d->throttler->writeBuffer()->size() > 1024*1024 ) {
-        (void)new Timer( this, 2 );
+              ( d->throttler->throttled() ||
+                d->throttler->writeBufferFull() ||
+                ( d->throttler->writeBuffer() &&
+                  d->throttler->writeBuffer()->size() > 1024*1024 ) ) ) {
+        // the client reads slowly. a small buffer drains soon, a
+        // big one takes longer.
+        uint wait = 1;
+        if ( d->throttler->writeBuffer() &&
+             d->throttler->writeBuffer()->size() > 4*1024*1024 )
+            wait = 2;
+        (void)new Timer( this, wait );
     }
     else {
-        prepareBatch();
-        makeQueries();
+        startBatch();
+    }
+    List<EventHandler>::Iterator o( d->owners );
+    while ( o ) {
+        EventHandler * e = o;
+        ++o;
+        e->notify();
+    }
+}
+
+
+/*! Releases the bytes the current batch counted as in flight, and
+    refines the estimate of how large the messages are, using the
+    sizes of those whose size is now known.
+*/
+
+void Fetcher::finishBatch()
+{
+    if ( d->inFlight && d->user ) {
+        if ( d->user->active )
+            d->user->active--;
+        d->user->changed = (uint)time( 0 );
+    }
+    d->inFlight = false;
+
+    if ( bytesInFlight > d->batchBytes )
+        bytesInFlight -= d->batchBytes;
+    else
+        bytesInFlight = 0;
+    d->batchBytes = 0;
+
+    uint n = 0;
+    uint bytes = 0;
+    Map< List<Message> >::Iterator bi( d->batch );
+    while ( bi ) {
+        Message * m = bi->firstElement();
+        ++bi;
+        if ( m && m->hasTrivia() && m->rfc822Size() ) {
+            n++;
+            bytes += m->rfc822Size();
+        }
+    }
+    if ( n )
+        d->averageSize = ( d->averageSize + bytes / n ) / 2;
+}
+
+
+/*! Starts fetching the next batch, unless the user on whose behalf
+    this Fetcher works (see Log::user()) may not fetch more right now,
+    in which case this Fetcher tries again a second later.
+*/
+
+void Fetcher::startBatch()
+{
+    if ( userThrottled() ) {
+        d->waiting = true;
+        (void)new Timer( this, 1 );
+        return;
+    }
+
+    d->waiting = false;
+    prepareBatch();
+    if ( d->user ) {
+        d->user->active++;
+        d->user->changed = (uint)time( 0 );
+        d->user->tokens -= d->batchBytes;
+    }
+    d->inFlight = true;
+    makeQueries();
+}
+
+
+/*! Returns true if this Fetcher's user has as many batches in flight
+    as fetch-user-concurrency permits, or has fetched more message
+    text than fetch-user-rate permits, and false otherwise.
+
+    The rate is enforced by a token bucket holding up to four seconds'
+    worth of text. A batch may overdraw the bucket, after which the
+    user waits until it's refilled.
+
+    A user's batches are presumed to be lost if none has started or
+    finished for a minute, so that a Fetcher which is abandoned in
+    flight can't block its user forever.
+
+    Each refusal is counted, and the users who were refused are logged
+    once a minute.
+*/
+
+bool Fetcher::userThrottled()
+{
+    uint concurrency =
+        Configuration::scalar( Configuration::FetchUserConcurrency );
+    uint rate = Configuration::scalar( Configuration::FetchUserRate );
+
+    d->user = 0;
+    if ( !concurrency && !rate )
+        return false;
+    EString login = log()->user();
+    if ( login.isEmpty() )
+        return false;
+
+    if ( !fetchUsers ) {
+        fetchUsers = new Dict<FetchUser>;
+        Allocator::addEternal( fetchUsers, "fetchers by user" );
+        throttledUsers = new List<FetchUser>;
+        Allocator::addEternal( throttledUsers, "throttled fetch users" );
+        throttledFetches = new GraphableCounter( "fetch-throttled" );
+    }
+    FetchUser * u = fetchUsers->find( login );
+    if ( !u ) {
+        u = new FetchUser;
+        u->name = login;
+        fetchUsers->insert( login, u );
     }
-    if ( d->owner )
-        d->owner->notify();
+    d->user = u;
+
+    uint now = (uint)time( 0 );
+    if ( rate ) {
+        int64 full = (int64)rate * 1024 * 4;
+        if ( !u->last )
+            u->tokens = full;
+        else if ( now > u->last )
+            u->tokens += (int64)rate * 1024 * ( now - u->last );
+        if ( u->tokens > full )
+            u->tokens = full;
+        u->last = now;
+    }
+
+    bool throttle = false;
+    if ( concurrency && u->active >= concurrency ) {
+        if ( now > u->changed + 60 )
+            u->active = 0;
+        else
+            throttle = true;
+    }
+    if ( rate && ( d->body || d->raw ) && u->tokens <= 0 )
+        throttle = true;
+    if ( !throttle )
+        return false;
+
+    throttledFetches->tick();
+    if ( !u->throttled )
+        throttledUsers->append( u );
+    u->throttled++;
+    if ( now >= lastThrottleReport + 60 ) {
+        EStringList l;
+        List<FetchUser>::Iterator i( throttledUsers );
+        while ( i ) {
+            l.append( i->name + " (" + fn( i->throttled ) + ")" );
+            i->throttled = 0;
+            ++i;
+        }
+        throttledUsers->clear();
+        log( "Throttled fetches: " + l.join( ", " ), Log::Significant );
+        lastThrottleReport = now;
+    }
+    return true;
 }
 
 
@@ -379,6 +672,15 @@ void Fetcher::waitForEnd()
     early on. This function adjusts the size of the batches so we'll
     get about one batch every 6 seconds, and updates the tables so we
     have a batch ready for reading.
+
+    When message texts are fetched, a batch is also limited by its
+    size in bytes, so that a few thousand large messages aren't
+    fetched into memory at once. The size of each message is its
+    RFC822 size if known, or else the average of the ones seen so far.
+    Each Fetcher may have an eighth of memory-limit in flight, all
+    Fetchers together half of it, and a Fetcher writing to a client
+    counts the client's unsent output against its share. Each batch
+    has at least one message, so a Fetcher always makes progress.
 */
 
 
@@ -427,7 +729,9 @@ void Fetcher::prepareBatch()
         uint perMessage = 40 * 1024;
         if ( d->transaction || Database::numHandles() < 2 )
             perMessage = 80 * 1024;
-        uint batchSizeLimit = ( limit - already ) / perMessage;
+        uint batchSizeLimit = 0;
+        if ( limit > already )
+            batchSizeLimit = ( limit - already ) / perMessage;
         if ( batchSizeLimit < 32 )
             batchSizeLimit = 32; // just sanity, shouldn't actually hit
         if ( d->batchSize > batchSizeLimit )
@@ -439,13 +743,44 @@ void Fetcher::prepareBatch()
                  fn( d->batchSize ), Log::Debug );
     }
     d->lastBatchStarted = now;
+    d->rawDone = false;
 
     // Find out which messages we're going to fetch, and fill in the
     // batch array so we can tie responses to the Message objects.
     d->uniqueDatabaseIds = true;
     d->batch.clear();
+
+    bool texts = d->body || d->raw;
+    uint budget = 0;
+    if ( texts ) {
+        uint limit = 1024 * 1024 *
+                     Configuration::scalar( Configuration::MemoryLimit );
+        budget = limit / 8;
+        if ( d->throttler && d->throttler->writeBuffer() ) {
+            uint queued = d->throttler->writeBuffer()->size();
+            if ( queued < budget )
+                budget -= queued;
+            else
+                budget = 0;
+        }
+        uint global = limit / 2;
+        if ( bytesInFlight >= global )
+            budget = 0;
+        else if ( budget > global - bytesInFlight )
+            budget = global - bytesInFlight;
+    }
+
     uint n = 0;
     while ( !d->messages.isEmpty() && n < d->batchSize ) {
+        if ( texts ) {
+            Message * m = d->messages.firstElement();
+            uint size = d->averageSize;
+            if ( m->hasTrivia() && m->rfc822Size() )
+                size = m->rfc822Size();
+            if ( n && d->batchBytes + size > budget )
+                break;
+            d->batchBytes += size;
+        }
         Message * m = d->messages.shift();
         List<Message> * l = d->batch.find( m->databaseId() );
         if ( !l ) {
@@ -455,6 +790,10 @@ void Fetcher::prepareBatch()
         l->append( m );
         n++;
     }
+    bytesInFlight += d->batchBytes;
+    if ( texts && n < d->batchSize && !d->messages.isEmpty() )
+        log( "Limiting batch to " + fn( n ) + " messages, about " +
+             fn( d->batchBytes ) + " bytes", Log::Debug );
 }
 
 
@@ -496,7 +835,15 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
                 if ( m->hasTrivia() )
                     need = false;
                 break;
+            case Raw:
+                if ( m->hasRawText() )
+                    need = false;
+                break;
             }
+            // messages with raw text need nothing more than trivia
+            if ( d->raw && type != Raw && type != Trivia &&
+                 !m->rawText().isEmpty() )
+                need = false;
             if ( need && m->databaseId() )
                 l.add( m->databaseId() );
         }
@@ -520,6 +867,42 @@ void Fetcher::makeQueries()
     Query * q = 0;
     EString r;
 
+    if ( d->raw && !d->rawDone ) {
+        // another process may have fetched some of the texts already
+        if ( SharedCache::enabled() ) {
+            Map< List<Message> >::Iterator bi( d->batch );
+            while ( bi ) {
+                List<Message>::Iterator li( *bi );
+                ++bi;
+                while ( li ) {
+                    Message * m = li;
+                    ++li;
+                    if ( m->hasRawText() )
+                        continue;
+                    EString text = SharedCache::find( SharedCache::RawText,
+                                                      m->databaseId() );
+                    if ( text.isEmpty() )
+                        continue;
+                    m->setRawText( text );
+                    m->setRawTextFetched();
+                }
+            }
+        }
+
+        // the raw text comes first. waitForEnd() calls this again for
+        // the other types, which are then fetched only for messages
+        // that have no raw text.
+        q = new Query( "select mr.message, r.data from message_raws mr "
+                       "join raw_messages r on (mr.raw=r.id) "
+                       "where mr.message=any($1)", d->raw );
+        bindIds( q, 1, Raw );
+        submit( q );
+        d->raw->q = q;
+        if ( d->transaction )
+            d->transaction->execute();
+        return;
+    }
+
     if ( d->partnumbers && !d->body ) {
         // body (below) will handle this as a side effect
         q = new Query( "select message, part, bytes, lines "
@@ -555,20 +938,35 @@ void Fetcher::makeQueries()
     }
 
     if ( d->otherheader ) {
+        // interned values are sent unless this process has them
+        if ( !internedValues )
+            internedValues = new InternedValueCache;
         q = new Query( "select hf.message, hf.part, hf.position, "
-                       "fn.name, hf.value from header_fields hf "
+                       "fn.name, hf.value_id, "
+                       "case when hf.value_id=any($2) then null "
+                       "else coalesce(hf.value,hv.value) end as value, "
+                       "null::text as header "
+                       "from header_fields hf "
                        "join field_names fn on (hf.field=fn.id) "
+                       "left join header_values hv on (hf.value_id=hv.id) "
                        "where hf.message=any($1) "
-                       "order by hf.message, hf.part",
+                       "union all "
+                       "select message, part, 0, null, null, null, header "
+                       "from header_blobs where message=any($1) "
+                       "order by message, part",
                        d->otherheader );
         bindIds( q, 1, OtherHeader );
+        q->bind( 2, internedValues->ids );
+        ((FetcherData::HeaderDecoder *)d->otherheader)->interned
+            = internedValues->values;
         submit( q );
         d->otherheader->q = q;
     }
 
     if ( d->body ) {
-        q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
-                       "bp.bytes as rawbytes, pn.bytes, pn.lines "
+        q = new Query( "select pn.message, pn.part, pn.bodypart, "
+                       "bp.text, bp.data, bp.compressed, "
+                       "bp.hash, bp.bytes as rawbytes, pn.bytes, pn.lines "
                        "from part_numbers pn "
                        "left join bodyparts bp on (pn.bodypart=bp.id) "
                        "where pn.message=any($1) "
@@ -625,16 +1023,14 @@ void FetcherData::Decoder::process()
     mr.clear();
 }
 
-void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
+void FetcherData::HeaderDecoder::decode( Message * m, Vector<Row> * rows )
 {
-    List<Row>::Iterator i( rows );
-    while ( i ) {
-        Row * r = i;
+    uint i = 0;
+    while ( i < rows->count() ) {
+        Row * r = rows->at( i );
         ++i;
 
         EString part = r->getEString( "part" );
-        EString name = r->getEString( "name" );
-        UString value = r->getUString( "value" );
 
         Header * h = m->header();
         if ( part.endsWith( ".rfc822" ) ) {
@@ -653,8 +1049,79 @@ void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
         else {
             h = m->bodypart( part, true )->header();
         }
-        HeaderField * f = HeaderField::assemble( name, value );
-        f->setPosition( r->getInt( "position" ) );
+
+        if ( r->isNull( "header" ) ) {
+            UString value;
+            if ( !r->isNull( "value" ) ) {
+                value = r->getUString( "value" );
+                if ( !r->isNull( "value_id" ) &&
+                     internedValues->ids.count() < maxInternedValues ) {
+                    uint id = r->getInt( "value_id" );
+                    internedValues->ids.add( id );
+                    internedValues->values->insert( id,
+                                                    new UString( value ) );
+                }
+            }
+            else if ( !r->isNull( "value_id" ) ) {
+                UString * v = interned->find( r->getInt( "value_id" ) );
+                if ( v )
+                    value = *v;
+            }
+            HeaderField * f =
+                HeaderField::assemble( r->getEString( "name" ), value );
+            f->setPosition( r->getInt( "position" ) );
+            h->add( f );
+        }
+        else {
+            addBlob( h, r->getEString( "header" ) );
+        }
+    }
+}
+
+
+/*! Adds the fields stored in the header_blobs text \a blob to \a h.
+    Each line is a position, a tab, a name, a tab and a value in which
+    backslash and newline are escaped, as written by Injector.
+*/
+
+void FetcherData::HeaderDecoder::addBlob( Header * h, const EString & blob )
+{
+    Utf8Codec c;
+    uint i = 0;
+    while ( i < blob.length() ) {
+        int e = blob.find( '\n', i );
+        if ( e < 0 )
+            e = blob.length();
+        EString line = blob.mid( i, e - i );
+        i = e + 1;
+
+        int t1 = line.find( '\t' );
+        int t2 = line.find( '\t', t1 + 1 );
+        if ( t1 < 1 || t2 < 0 )
+            continue;
+
+        EString v = line.mid( t2 + 1 );
+        EString value;
+        uint j = 0;
+        while ( j < v.length() ) {
+            if ( v[j] == '\\' && v[j+1] == 'n' ) {
+                value.append( '\n' );
+                j++;
+            }
+            else if ( v[j] == '\\' && v[j+1] == '\\' ) {
+                value.append( '\\' );
+                j++;
+            }
+            else {
+                value.append( v[j] );
+            }
+            j++;
+        }
+
+        HeaderField * f =
+            HeaderField::assemble( line.mid( t1 + 1, t2 - t1 - 1 ),
+                                   c.toUnicode( value ) );
+        f->setPosition( line.mid( 0, t1 ).number( 0 ) );
         h->add( f );
     }
 }
@@ -673,11 +1140,11 @@ bool FetcherData::HeaderDecoder::isDone( Message * m ) const
 
 
 
-void FetcherData::AddressDecoder::decode( Message * m, List<Row> * rows )
+void FetcherData::AddressDecoder::decode( Message * m, Vector<Row> * rows )
 {
-    List<Row>::Iterator i( rows );
-    while ( i ) {
-        Row * r = i;
+    uint i = 0;
+    while ( i < rows->count() ) {
+        Row * r = rows->at( i );
         ++i;
 
         EString part = r->getEString( "part" );
@@ -736,13 +1203,13 @@ bool FetcherData::AddressDecoder::isDone( Message * m ) const
 }
 
 
-void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
+void FetcherData::BodyDecoder::decode( Message * m, Vector<Row> * rows )
 {
     PartNumberDecoder::decode( m, rows );
 
-    List<Row>::Iterator i( rows );
-    while ( i ) {
-        Row * r = i;
+    uint i = 0;
+    while ( i < rows->count() ) {
+        Row * r = rows->at( i );
         ++i;
 
         EString part = r->getEString( "part" );
@@ -750,13 +1217,26 @@ void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
         if ( !part.endsWith( ".rfc822" ) ) {
             Bodypart * bp = m->bodypart( part, true );
 
-            if ( !r->isNull( "data" ) )
+            if ( !r->isNull( "data" ) && r->getBoolean( "compressed" ) )
+                bp->setData( r->getEString( "data" ).inflated() );
+            else if ( !r->isNull( "data" ) )
                 bp->setData( r->getEString( "data" ) );
-            else if ( !r->isNull( "text" ) )
-                bp->setText( r->getUString( "text" ) );
+            else if ( !r->isNull( "text" ) ) {
+                // the database gives us UTF-8, which is what Bodypart
+                // keeps, unless Injector had to encode a 0 as U+ED00.
+                EString t = r->getEString( "text" );
+                if ( t.contains( "\xEE\xB4\x80" ) )
+                    bp->setText( r->getUString( "text" ) );
+                else
+                    bp->setUtf8Text( t );
+            }
+            else if ( !r->isNull( "hash" ) )
+                bp->setData( BlobStore::fetch( r->getEString( "hash" ) ) );
 
             if ( !r->isNull( "rawbytes" ) )
                 bp->setNumBytes( r->getInt( "rawbytes" ) );
+            if ( !r->isNull( "bodypart" ) )
+                bp->setId( r->getInt( "bodypart" ) );
         }
     }
 }
@@ -775,11 +1255,11 @@ bool FetcherData::BodyDecoder::isDone( Message * m ) const
 }
 
 
-void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
+void FetcherData::PartNumberDecoder::decode( Message * m, Vector<Row> * rows )
 {
-    List<Row>::Iterator i( rows );
-    while ( i ) {
-        Row * r = i;
+    uint i = 0;
+    while ( i < rows->count() ) {
+        Row * r = rows->at( i );
         ++i;
 
         EString part = r->getEString( "part" );
@@ -821,7 +1301,7 @@ bool FetcherData::PartNumberDecoder::isDone( Message * m ) const
 }
 
 
-void FetcherData::TriviaDecoder::decode( Message * m , List<Row> * rows )
+void FetcherData::TriviaDecoder::decode( Message * m , Vector<Row> * rows )
 {
     Row * r = rows->firstElement();
     m->setInternalDate( r->getInt( "idate" ) );
@@ -846,7 +1326,34 @@ bool FetcherData::TriviaDecoder::isDone( Message * m ) const
 }
 
 
-/*! Instructs this Fetcher to fetch data of type \a t. */
+void FetcherData::RawDecoder::decode( Message * m, Vector<Row> * rows )
+{
+    Row * r = rows->firstElement();
+    m->setRawText( r->getEString( "data" ) );
+    SharedCache::insert( SharedCache::RawText, r->getInt( "message" ),
+                         m->rawText() );
+}
+
+
+void FetcherData::RawDecoder::setDone( Message * m )
+{
+    m->setRawTextFetched();
+}
+
+
+bool FetcherData::RawDecoder::isDone( Message * m ) const
+{
+    return m->hasRawText();
+}
+
+
+/*! Instructs this Fetcher to fetch data of type \a t.
+
+    If \a t is Raw, the raw text stored at injection time is fetched
+    first, and the Addresses, OtherHeader, Body and PartNumbers types
+    are then fetched only for those messages that have none. Either
+    way, Message::rfc822() works afterwards.
+*/
 
 void Fetcher::fetch( Type t )
 {
@@ -873,6 +1380,10 @@ void Fetcher::fetch( Type t )
         if ( !d->partnumbers )
             d->partnumbers = new FetcherData::PartNumberDecoder( d );
         break;
+    case Raw:
+        if ( !d->raw )
+            d->raw = new FetcherData::RawDecoder( d );
+        break;
     }
 }
 
@@ -899,6 +1410,9 @@ bool Fetcher::fetching( Type t ) const
     case PartNumbers:
         return d->partnumbers != 0;
         break;
+    case Raw:
+        return d->raw != 0;
+        break;
     }
     return false; // not reached
 }
@@ -922,6 +1436,9 @@ void Fetcher::setTransaction( class Transaction * t )
 
 void Fetcher::submit( Query * q )
 {
+    q->setReadOnly();
+    // the decoders take each row as soon as it arrives
+    q->setStreaming();
     if ( d->transaction )
         d->transaction->enqueue( q );
     else
@@ -29,11 +29,13 @@ public:
         OtherHeader,
         Body,
         PartNumbers,
-        Trivia
+        Trivia,
+        Raw
     };
 
     void addMessage( Message * );
     void addMessages( List<Message> * );
+    void addOwner( EventHandler * );
 
     void fetch( Type );
     bool fetching( Type ) const;
@@ -49,7 +51,10 @@ private:
 
 private:
     void start();
+    void startBatch();
+    bool userThrottled();
     void prepareBatch();
+    void finishBatch();
     void makeQueries();
     void waitForEnd();
     void submit( Query * );
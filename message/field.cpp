@@ -11,6 +11,9 @@
 #include "addressfield.h"
 #include "ustringlist.h"
 #include "estringlist.h"
+#include "configuration.h"
+#include "allocator.h"
+#include "dict.h"
 #include "parser.h"
 #include "utf.h"
 
@@ -62,7 +65,7 @@ public:
 
     HeaderField::Type type;
     EString name;
-    UString value;
+    EString value;
     EString unparsed;
     EString error;
     uint position;
@@ -94,6 +97,8 @@ HeaderField *HeaderField::fieldNamed( const EString &name )
 
     HeaderField::Type t = fieldNames[i].type;
     HeaderField * hf = 0;
+    if ( fieldNames[i].name )
+        n = n.interned();
 
     switch ( t ) {
     case InReplyTo:
@@ -271,21 +276,21 @@ EString HeaderField::rfc822( bool avoidUtf8 ) const
          d->type == Comments ||
          d->type == ContentDescription ) {
         if ( avoidUtf8 )
-            return wrap( encodeText( d->value ) );
+            return wrap( encodeText( HeaderField::value() ) );
         else
-            return wrap( d->value.utf8() );
+            return wrap( d->value );
     }
 
     if ( d->type == Other ) {
         if ( avoidUtf8 )
-            return encodeText( d->value );
+            return encodeText( HeaderField::value() );
         else
-            return d->value.utf8();
+            return d->value;
     }
 
     // We assume that, for most fields, we can use the database
     // representation in an RFC 822 message.
-    return d->value.utf8();
+    return d->value;
 }
 
 
@@ -298,11 +303,15 @@ EString HeaderField::rfc822( bool avoidUtf8 ) const
     string.
 
     Use rfc822() if you want a valid RFC 2822 representation.
+
+    The value is kept in UTF-8 and decoded each time this function is
+    called, since most fields are only ever passed on byte for byte.
 */
 
 UString HeaderField::value() const
 {
-    return d->value;
+    Utf8Codec c;
+    return c.toUnicode( d->value );
 }
 
 
@@ -312,7 +321,7 @@ UString HeaderField::value() const
 
 void HeaderField::setValue( const UString &s )
 {
-    d->value = s;
+    d->value = s.utf8();
     d->error.truncate();
 }
 
@@ -674,6 +683,87 @@ uint HeaderField::fieldType( const EString & n )
 }
 
 
+static Dict<void> * indexedFields;
+
+
+/*! Returns true if header fields named \a n are stored as rows in
+    header_fields, so that they can be searched using an index, and
+    false if they're stored in the header_blobs text for their part.
+
+    All fields are indexed unless indexed-header-fields is set. If it
+    is, then the well-known fields (except Received), Thread-Index and
+    the fields named in indexed-header-fields are. An empty \a n is
+    indexed only if all fields are, so isIndexed( "" ) tells whether
+    header_blobs is in use.
+*/
+
+bool HeaderField::isIndexed( const EString & n )
+{
+    EString fn = n.headerCased();
+    if ( !indexedFields ) {
+        indexedFields = new Dict<void>;
+        Allocator::addEternal( indexedFields, "indexed header fields" );
+        EStringList * l = EStringList::split(
+            ',', Configuration::text( Configuration::IndexedHeaderFields ) );
+        EStringList::Iterator i( l );
+        while ( i ) {
+            EString f = i->simplified().headerCased();
+            if ( !f.isEmpty() )
+                indexedFields->insert( f, (void*)1 );
+            ++i;
+        }
+        if ( !indexedFields->isEmpty() )
+            indexedFields->insert( "Thread-Index", (void*)1 );
+    }
+
+    if ( indexedFields->isEmpty() )
+        return true;
+    uint t = fieldType( fn );
+    if ( t && t != Received )
+        return true;
+    return indexedFields->contains( fn );
+}
+
+
+static Dict<void> * internedFields;
+
+
+/*! Returns true if the values of indexed header fields named \a n
+    are stored in header_values (see interned-header-fields), and
+    false if they're stored in header_fields.value.
+
+    Fields that Archiveopteryx itself looks up by value, and the
+    address fields, are never interned.
+*/
+
+bool HeaderField::isInterned( const EString & n )
+{
+    EString fn = n.headerCased();
+    if ( !internedFields ) {
+        internedFields = new Dict<void>;
+        Allocator::addEternal( internedFields, "interned header fields" );
+        EStringList * l = EStringList::split(
+            ',', Configuration::text( Configuration::InternedHeaderFields ) );
+        EStringList::Iterator i( l );
+        while ( i ) {
+            EString f = i->simplified().headerCased();
+            if ( !f.isEmpty() )
+                internedFields->insert( f, (void*)1 );
+            ++i;
+        }
+    }
+
+    if ( internedFields->isEmpty() || !isIndexed( fn ) )
+        return false;
+    uint t = fieldType( fn );
+    if ( ( t && t <= LastAddressField ) ||
+         t == MessageId || t == References ||
+         t == InReplyTo || t == Subject || fn == "Thread-Index" )
+        return false;
+    return internedFields->contains( fn );
+}
+
+
 /*! Returns a version of \a s with long lines wrapped according to the
     rules in RFC [2]822. This function is not static, because it needs
     to look at the field name.
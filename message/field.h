@@ -71,6 +71,8 @@ public:
 
     static const char *fieldName( HeaderField::Type );
     static uint fieldType( const EString & );
+    static bool isIndexed( const EString & );
+    static bool isInterned( const EString & );
 
     EString wrap( const EString & ) const;
 
@@ -66,7 +66,7 @@ void Flag::execute()
 
     while ( d->q->hasResults() ) {
         Row * r = d->q->nextRow();
-        EString name = r->getEString( "name" );
+        EString name = r->getEString( "name" ).interned();
         uint * id = (uint *)Allocator::alloc( sizeof(uint), 0 );
         *id = r->getInt( "id" );
         d->byName.insert( name.lower(), id );
@@ -124,6 +124,11 @@ public:
     and the flags table refers to it by id. This class provides lookup
     functions by id and name.
 
+    "\Seen" and "\Deleted" are stored as columns in mailbox_messages,
+    and so are the first 64 other flags, as bits in
+    mailbox_messages.flagbits (see bit()). Only the rest use the flags
+    table.
+
     ("\Recent" is special; it is not stored in the flag_names table.)
 */
 
@@ -229,3 +234,20 @@ bool Flag::isDeleted( uint f )
         ::deletedId = id( "\\deleted" );
     return f == ::deletedId;
 }
+
+
+/*! Returns the bit which represents the flag \a id in
+    mailbox_messages.flagbits, or 0 if that flag is stored elsewhere.
+
+    Flags 1-64 have bits, except "\Seen" and "\Deleted", which have
+    columns of their own. Since flag ids are assigned in order of use,
+    the bits go to the system flags and the keywords clients create
+    first, which are usually the ones most messages have.
+*/
+
+int64 Flag::bit( uint id )
+{
+    if ( id < 1 || id > 64 || isSeen( id ) || isDeleted( id ) )
+        return 0;
+    return ((int64)1) << ( id - 1 );
+}
@@ -25,6 +25,8 @@ public:
     static bool isSeen( uint );
     static bool isDeleted( uint );
 
+    static int64 bit( uint );
+
     static uint largestId();
     static EStringList allFlags();
 
@@ -3,7 +3,9 @@
 #include "helperrowcreator.h"
 
 #include "dict.h"
+#include "cache.h"
 #include "scope.h"
+#include "dbsignal.h"
 #include "allocator.h"
 #include "transaction.h"
 #include "address.h"
@@ -24,16 +26,129 @@
     tables frequently contain less than one row per thousand messages,
     so we need to optimise this class for inserting zero, one or at
     most a few rows.
+
+    The names in field_names and annotation_names are loaded into a
+    cache shared by all creators in the process (see setup()), so
+    most creators don't need to issue any queries at all.
+
+    If the creator is given no Transaction, it creates any new rows
+    using queries of its own, each committed at once, and notifies
+    its owner when it's done. This way, other processes see new names
+    at once, rather than when the caller's Transaction commits, and
+    don't wait for that Transaction when they want to insert the same
+    name. The caller must not hold a database handle while it waits.
 */
 
 
+class NameRegistry
+    : public EventHandler
+{
+public:
+    NameRegistry( const EString & table )
+        : EventHandler(), t( table ), largest( 0 ), again( false ), q( 0 )
+    {
+        setLog( new Log );
+        execute();
+    }
+
+    void execute() {
+        if ( !q ) {
+            again = false;
+            q = new Query( "select id, name from " + t + " where id>$1",
+                           this );
+            q->bind( 1, largest );
+            q->execute();
+        }
+
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            add( r->getEString( "name" ), r->getInt( "id" ) );
+        }
+        if ( !q->done() )
+            return;
+
+        q = 0;
+        if ( again )
+            execute();
+    }
+
+    void add( const EString & name, uint id ) {
+        uint * p = (uint *)Allocator::alloc( sizeof(uint), 0 );
+        *p = id;
+        byName.insert( name.lower(), p );
+        if ( id > largest )
+            largest = id;
+    }
+
+    EString t;
+    Dict<uint> byName;
+    uint largest;
+    bool again;
+    Query * q;
+};
+
+
+class NameWatcher
+    : public EventHandler
+{
+public:
+    NameWatcher( NameRegistry * registry, bool wipe )
+        : EventHandler(), r( registry ), w( wipe ) {
+        setLog( r->log() );
+        if ( w )
+            (void)new DatabaseSignal( "obliterated", this );
+        else
+            (void)new DatabaseSignal( r->t + "_extended", this );
+    }
+
+    void execute() {
+        if ( w ) {
+            r->byName.clear();
+            r->largest = 0;
+        }
+        r->again = true;
+        if ( !r->q )
+            r->execute();
+    }
+
+    NameRegistry * r;
+    bool w;
+};
+
+
+static Dict<NameRegistry> * registries = 0;
+
+
+/*  Returns the shared cache of the rows in \a table, creating and
+    starting to fill it if necessary.
+*/
+
+static NameRegistry * registry( const EString & table )
+{
+    if ( !registries ) {
+        registries = new Dict<NameRegistry>;
+        Allocator::addEternal( registries, "shared helper table names" );
+    }
+    NameRegistry * r = registries->find( table );
+    if ( !r ) {
+        r = new NameRegistry( table );
+        (void)new NameWatcher( r, false );
+        (void)new NameWatcher( r, true );
+        registries->insert( table, r );
+    }
+    return r;
+}
+
+
 class HelperRowCreatorData
     : public Garbage
 {
 public:
     HelperRowCreatorData()
         : s( 0 ), c( 0 ), notify( 0 ), parent( 0 ), t( 0 ),
-          done( false ), inserted( false )
+          owner( 0 ), registry( 0 ), attempts( 0 ),
+          done( false ), inserted( false ), failed( false ),
+          waited( false )
     {}
 
     Query * s;
@@ -41,10 +156,16 @@ public:
     Query * notify;
     Transaction * parent;
     Transaction * t;
+    EventHandler * owner;
+    NameRegistry * registry;
+    uint attempts;
+    EString table;
     EString n;
     EString e;
     bool done;
     bool inserted;
+    bool failed;
+    bool waited;
     Dict<uint> names;
 };
 
@@ -52,20 +173,51 @@ public:
 /*!  Constructs an empty HelperRowCreator refering to \a table, using
      \a transaction. If an error related to \a constraint occurs,
      execute() will roll back to a savepoint and try again.
+
+     If \a transaction is null, the creator works on its own and
+     notifies \a owner when it's done (unless it's done at once).
 */
 
 HelperRowCreator::HelperRowCreator( const EString & table,
                                     Transaction * transaction,
-                                    const EString & constraint )
+                                    const EString & constraint,
+                                    EventHandler * owner )
     : EventHandler(), d( new HelperRowCreatorData )
 {
     setLog( new Log );
     d->parent = transaction;
+    d->owner = owner;
+    d->table = table;
     d->n = table + "_creator";
     d->e = constraint;
 }
 
 
+/*! Starts loading the shared caches of field_names and
+    annotation_names, and keeps them up to date from then on. This
+    may be called once at startup; otherwise each cache is loaded
+    when it's first needed.
+*/
+
+void HelperRowCreator::setup()
+{
+    (void)::registry( "field_names" );
+    (void)::registry( "annotation_names" );
+}
+
+
+/*! Instructs this creator to look up names in the shared cache for
+    its table before asking the database, and to add the rows it
+    finds to the cache when it's safe to do so. Subclasses call this
+    in their constructors.
+*/
+
+void HelperRowCreator::shareNames()
+{
+    d->registry = ::registry( d->table );
+}
+
+
 /*! Returns true if this object is done with the Transaction, and
     false if it will use the Transaction for one or more queries.
 */
@@ -76,9 +228,25 @@ bool HelperRowCreator::done() const
 }
 
 
+/*! Returns true if this creator, working without a Transaction, was
+    unable to create its rows, and false in all other cases. When a
+    Transaction is used, that Transaction fails instead.
+*/
+
+bool HelperRowCreator::failed() const
+{
+    return d->failed;
+}
+
+
 void HelperRowCreator::execute()
 {
     Scope x( log() );
+    if ( !d->parent ) {
+        executeAlone();
+        return;
+    }
+
     while ( !d->done ) {
         // If we're waiting for the db, just go away.
         if ( d->s && !d->s->done() )
@@ -151,6 +319,77 @@ void HelperRowCreator::execute()
 }
 
 
+/*! This private helper does the work of execute() when there's no
+    Transaction: The lookups and inserts are standalone queries, and
+    a failed insert, which may be caused by someone else inserting
+    the same row meanwhile, is followed by another lookup.
+*/
+
+void HelperRowCreator::executeAlone()
+{
+    while ( !d->done ) {
+        if ( ( d->s && !d->s->done() ) || ( d->c && !d->c->done() ) ) {
+            d->waited = true;
+            return;
+        }
+
+        if ( !d->s && !d->c ) {
+            d->s = makeSelect();
+            if ( d->s )
+                d->s->execute();
+            else
+                d->done = true;
+        }
+
+        if ( d->s && d->s->done() ) {
+            Query * s = d->s;
+            d->s = 0;
+            processSelect( s );
+            d->c = makeCopy();
+            if ( d->c && d->attempts++ >= 3 ) {
+                log( "Giving up inserting into " + d->table +
+                     " after " + fn( d->attempts - 1 ) + " attempts",
+                     Log::Error );
+                d->c = 0;
+                d->failed = true;
+                d->done = true;
+            }
+            else if ( d->c ) {
+                d->c->execute();
+                d->inserted = true;
+            }
+            else {
+                d->done = true;
+            }
+        }
+
+        if ( d->c && d->c->done() ) {
+            Query * c = d->c;
+            d->c = 0;
+            if ( !c->failed() ) {
+                EString ed = d->n;
+                ed.replace( "creator", "extended" );
+                (new Query( "notify " + ed, 0 ))->execute();
+            }
+            else if ( !c->error().contains( d->e ) ) {
+                log( "Could not insert into " + d->table + ": " +
+                     c->error(), Log::Error );
+                d->failed = true;
+                d->done = true;
+            }
+            // otherwise, the rows we didn't insert are there now, and
+            // the next select will find them, as it will if we did
+            // insert them.
+        }
+    }
+
+    if ( d->waited && d->owner ) {
+        d->waited = false;
+        d->owner->notify();
+    }
+}
+
+
 /*! \fn Query * HelperRowCreator::makeSelect()
 
     This pure virtual function is called to make a query to return the
@@ -198,14 +437,23 @@ void HelperRowCreator::add( const EString & s, uint id )
     *tmp = id;
 
     d->names.insert( s.lower(), tmp );
+
+    // rows seen within a transaction may not be committed yet, and
+    // may never be
+    if ( d->registry && !d->parent )
+        d->registry->add( s, id );
 }
 
 
-/*! Returns the id stored earlier with add() for the name \a s. */
+/*! Returns the id stored earlier with add() for the name \a s, or
+    found in the shared cache.
+*/
 
 uint HelperRowCreator::id( const EString & s )
 {
     uint * p = d->names.find( s.lower() );
+    if ( !p && d->registry )
+        p = d->registry->byName.find( s.lower() );
     if ( p )
         return *p;
     return 0;
@@ -244,10 +492,14 @@ void HelperRowCreator::postprocess( Transaction * )
 
     \a t will fail if flag creation fails for some reason (typically
     bugs). Transaction::error() should say what went wrong.
+
+    If \a t is null, the flags are created at once, and \a owner is
+    notified when that's done.
 */
 
-FlagCreator::FlagCreator( const EStringList & f, Transaction * t )
-    : HelperRowCreator( "flag_names", t, "fn_uname" ),
+FlagCreator::FlagCreator( const EStringList & f, Transaction * t,
+                          EventHandler * owner )
+    : HelperRowCreator( "flag_names", t, "fn_uname", owner ),
       names( f )
 {
 }
@@ -312,15 +564,18 @@ Query * FlagCreator::makeCopy()
 
 
 /*! Creates an object to ensure that all entries in \a f are present
-    in field_names, using \a tr for all its queryies.
+    in field_names, using \a tr for all its queryies, or working on
+    its own and notifying \a owner if \a tr is null.
 */
 
 
 FieldNameCreator::FieldNameCreator( const EStringList & f,
-                                    Transaction * tr )
-    : HelperRowCreator( "field_names", tr,  "field_names_name_key" ),
+                                    Transaction * tr,
+                                    EventHandler * owner )
+    : HelperRowCreator( "field_names", tr,  "field_names_name_key", owner ),
       names( f )
 {
+    shareNames();
 }
 
 
@@ -366,6 +621,131 @@ Query * FieldNameCreator::makeCopy()
 }
 
 
+/*! \class HeaderValueCreator helperrowcreator.h
+
+    The HeaderValueCreator is a HelperRowCreator to insert rows into
+    the header_values table, which holds the values of the fields
+    named in interned-header-fields.
+
+    Unlike names, values are case-sensitive, and there may be too
+    many to load them all, so the creator keeps a Cache of its own:
+    The values looked up recently by any creator working without a
+    Transaction, up to a limit.
+*/
+
+
+class HeaderValueCache
+    : public Cache
+{
+public:
+    HeaderValueCache(): Cache( 10 ), n( 0 ) {}
+
+    Dict<uint> ids;
+    uint n;
+
+    void clear() { ids.clear(); n = 0; }
+};
+
+
+static HeaderValueCache * valueCache = 0;
+// the most values valueCache holds before it's cleared
+static const uint maxCachedValues = 16384;
+
+
+/*! Creates an object to ensure that all entries in \a v (UTF-8
+    encoded) are present in header_values, using \a t for all its
+    queries, or working on its own and notifying \a owner if \a t is
+    null.
+*/
+
+HeaderValueCreator::HeaderValueCreator( const EStringList & v,
+                                        Transaction * t,
+                                        EventHandler * owner )
+    : HelperRowCreator( "header_values", t, "hv_value", owner ),
+      values( v ), shared( !t )
+{
+    if ( !valueCache )
+        valueCache = new HeaderValueCache;
+}
+
+
+Query * HeaderValueCreator::makeSelect()
+{
+    Query * q = new Query( "select id, value as name from header_values "
+                           "where value=any($1::text[])", this );
+
+    EStringList sl;
+    EStringList::Iterator it( values );
+    while ( it ) {
+        if ( !id( *it ) )
+            sl.append( *it );
+        ++it;
+    }
+    if ( sl.isEmpty() )
+        return 0;
+    q->bind( 1, sl );
+    log( "Looking up " + fn( sl.count() ) + " header values", Log::Debug );
+    return q;
+}
+
+
+Query * HeaderValueCreator::makeCopy()
+{
+    Query * q = new Query( "copy header_values (value) "
+                           "from stdin with binary", this );
+    EStringList::Iterator it( values );
+    uint count = 0;
+    while ( it ) {
+        if ( !id( *it ) ) {
+            q->bind( 1, *it );
+            q->submitLine();
+            count++;
+        }
+        ++it;
+    }
+
+    if ( !count )
+        return 0;
+    log( "Inserting " + fn( count ) + " new header values" );
+    return q;
+}
+
+
+/*! Remembers that \a value has the ID \a id, and caches it for other
+    creators if the row is known to be committed.
+*/
+
+void HeaderValueCreator::add( const EString & value, uint id )
+{
+    uint * p = (uint *)Allocator::alloc( sizeof(uint), 0 );
+    *p = id;
+    ids.insert( value, p );
+
+    if ( !shared )
+        return;
+    if ( valueCache->n >= maxCachedValues )
+        valueCache->clear();
+    if ( !valueCache->ids.contains( value ) )
+        valueCache->n++;
+    valueCache->ids.insert( value, p );
+}
+
+
+/*! Returns the ID of \a value, or 0 if it's not known yet. */
+
+uint HeaderValueCreator::id( const EString & value )
+{
+    if ( value.isEmpty() )
+        return 0;
+    uint * p = ids.find( value );
+    if ( !p )
+        p = valueCache->ids.find( value );
+    if ( p )
+        return *p;
+    return 0;
+}
+
+
 /*! \class AnnotationNameCreator helperrowcreator.h
 
     The AnnotationNameCreator is a HelperRowCreator to insert rows into
@@ -374,14 +754,18 @@ Query * FieldNameCreator::makeCopy()
 
 
 /*! Creates an object to ensure that all entries in \a f are present
-    in annotation_names, using \a t for all its queryies.
+    in annotation_names, using \a t for all its queryies, or working
+    on its own and notifying \a owner if \a t is null.
 */
 
 AnnotationNameCreator::AnnotationNameCreator( const EStringList & f,
-                                              Transaction * t )
-    : HelperRowCreator( "annotation_names", t, "annotation_names_name_key" ),
+                                              Transaction * t,
+                                              EventHandler * owner )
+    : HelperRowCreator( "annotation_names", t, "annotation_names_name_key",
+                        owner ),
       names( f )
 {
+    shareNames();
 }
 
 Query *  AnnotationNameCreator::makeSelect()
@@ -436,9 +820,18 @@ Query * AnnotationNameCreator::makeCopy()
     You have to create an object, then execute it. It'll use a
     subtransaction and implicitly block your transaction until the IDs
     are known.
+
+    All the addresses are resolved by a single statement, which
+    inserts the ones that don't exist yet and returns the IDs of all,
+    so a message with many addresses costs one round-trip. The IDs
+    end up in the Address objects, whose data the Address class shares
+    with later instances of the same address.
 */
 
 
+static const char * addressKey = "addresses_ldn_key";
+
+
 /*! Constructs an AddressCreator which will ensure that all the \a
     addresses have an Address::id(), using a subtransaction if \a t
     for its work.
@@ -446,9 +839,9 @@ Query * AnnotationNameCreator::makeCopy()
 
 AddressCreator::AddressCreator( Dict<Address> * addresses,
                                 Transaction * t )
-    : HelperRowCreator( "addresses", t, "addresses_nld_key" ),
-      a( addresses ), bulk( false ), decided( false ),
-      base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
+    : HelperRowCreator( "addresses", t, addressKey ),
+      a( addresses ), base( t ), sub( 0 ), obtain( 0 ),
+      committed( false )
 {
 }
 
@@ -458,9 +851,9 @@ AddressCreator::AddressCreator( Dict<Address> * addresses,
 */
 
 AddressCreator::AddressCreator( Address * address, class Transaction * t )
-    : HelperRowCreator( "addresses", t, "addresses_nld_key" ),
-      a( new Dict<Address> ), bulk( false ), decided( false ),
-      base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
+    : HelperRowCreator( "addresses", t, addressKey ),
+      a( new Dict<Address> ), base( t ), sub( 0 ), obtain( 0 ),
+      committed( false )
 {
     a->insert( AddressCreator::key( address ), address );
 }
@@ -474,9 +867,9 @@ AddressCreator::AddressCreator( Address * address, class Transaction * t )
 
 AddressCreator::AddressCreator( List<Address> * addresses,
                                 class Transaction * t )
-    : HelperRowCreator( "addresses", t, "addresses_nld_key" ),
-      a( new Dict<Address> ), bulk( false ), decided( false ),
-      base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
+    : HelperRowCreator( "addresses", t, addressKey ),
+      a( new Dict<Address> ), base( t ), sub( 0 ), obtain( 0 ),
+      committed( false )
 {
     List<Address>::Iterator address( addresses );
     while ( address ) {
@@ -486,74 +879,57 @@ AddressCreator::AddressCreator( List<Address> * addresses,
 }
 
 
-/*! This private helper looks for \a s in \a b, inserts it if not
-    present, and returns its number. Uses \a n to generate a new
-    unique number if necessary, and binds \a s to \a n in \a q.
-
-    \a b has to use key() as key for each member. Nothing will work if
-    you break this rule. This sounds a little fragile, but I can't
-    think of a good alternative right now.
-*/
-
-uint AddressCreator::param( Dict<uint> * b, const EString & s,
-                            uint & n,
-                            Query * q )
-{
-    uint * r = b->find( s );
-    if ( !r ) {
-        r = (uint*)Allocator::alloc( sizeof( uint ), 0 );
-        *r = n++;
-        b->insert( s, r );
-        q->bind( *r, s );
-    }
-    return *r;
-}
-
+/*! Creates a query which inserts those of our addresses that aren't
+    in the database, and returns the IDs of all of them, both old and
+    new. Returns a null pointer if all the addresses have IDs already.
 
-/*! Creates a select to look for as many addresses as possible, but
-    binding no more than 128 strings.
+    The rows inserted by the statement aren't visible to the part
+    which looks at the table, so the result is the union of the two.
 */
 
 Query * AddressCreator::makeSelect()
 {
-    EString s = "select id, name, localpart::text, domain::text "
-                "from addresses where ";
-    Query * q = new Query( "", this );
-    uint n = 1;
-    Dict<uint> binds;
+    EStringList names;
+    EStringList localparts;
+    EStringList domains;
     PgUtf8Codec p;
-    bool first = true;
     Dict<Address>::Iterator i( a );
-    asked.clear();
-    while ( i && n < 128 ) {
+    while ( i ) {
         if ( !i->id() ) {
-            EString name( p.fromUnicode( i->uname() ) );
-            EString lp( i->localpart().utf8() );
-            EString dom( i->domain().utf8() );
-
-            uint bn = param( &binds, name, n, q );
-            uint bl = param( &binds, lp, n, q );
-            uint bd = param( &binds, dom, n, q );
-
-            if ( !first )
-                s.append( " or " );
-            first = false;
-            s.append( "(name=$" );
-            s.appendNumber( bn );
-            s.append( " and localpart=$" );
-            s.appendNumber( bl );
-            s.append( "::citext and domain=$" );
-            s.appendNumber( bd );
-            s.append( "::citext)" );
-
-            asked.append( i );
+            names.append( p.fromUnicode( i->uname() ) );
+            localparts.append( i->localpart().utf8() );
+            domains.append( i->domain().utf8() );
         }
         ++i;
     }
-    if ( asked.isEmpty() )
+    if ( names.isEmpty() )
         return 0;
-    q->setString( s );
-    log( "Looking up " + fn( asked.count() ) + " addresses", Log::Debug );
+
+    Query * q = new Query(
+        "with v as ("
+        "select distinct ($1::text[])[i] as name, "
+        "($2::text[])[i]::citext as localpart, "
+        "($3::text[])[i]::citext as domain "
+        "from generate_subscripts($1::text[],1) i"
+        "), n as ("
+        "insert into addresses (name,localpart,domain) "
+        "select name,localpart,domain from v "
+        "where not exists (select id from addresses a "
+        "where a.name=v.name and a.localpart=v.localpart "
+        "and a.domain=v.domain) "
+        "returning id,name,localpart,domain"
+        ") "
+        "select id, name, localpart::text, domain::text from n "
+        "union all "
+        "select a.id, a.name, a.localpart::text, a.domain::text "
+        "from addresses a join v on "
+        "(a.name=v.name and a.localpart=v.localpart "
+        "and a.domain=v.domain)", this );
+    q->bind( 1, names );
+    q->bind( 2, localparts );
+    q->bind( 3, domains );
+    log( "Looking up or inserting " + fn( names.count() ) + " addresses",
+         Log::Debug );
     return q;
 }
 
@@ -575,26 +951,13 @@ void AddressCreator::processSelect( Query * q )
 }
 
 
+/*! makeSelect() inserts the new addresses as well, so this does
+    nothing.
+*/
+
 Query * AddressCreator::makeCopy()
 {
-    uint count = 0;
-    Query * q = new Query( "copy addresses (name,localpart,domain) "
-                           "from stdin with binary", this );
-    List<Address>::Iterator i( asked );
-    while ( i ) {
-        if ( !i->id() ) {
-            q->bind( 1, i->uname() );
-            q->bind( 2, i->localpart() );
-            q->bind( 3, i->domain() );
-            q->submitLine();
-            count++;
-        }
-        ++i;
-    }
-    if ( !count )
-        return 0;
-    log( "Inserting " + fn( count ) + " new addresses" );
-    return q;
+    return 0;
 }
 
 
@@ -615,104 +978,40 @@ EString AddressCreator::key( Address * a )
 }
 
 
-// this constant decides when we change to using the temptable. where's
-// the crossover point?
-
-static uint useTempTable = 30;
-
-
-/*! This overloads HelperRowCreator::execute() and conditionally
-    replaces its state machine with one that's faster for large
-    address sets.
+/*! This reimplements HelperRowCreator::execute() to send the single
+    statement made by makeSelect(), and to run it again if another
+    transaction inserted one of the same addresses meanwhile.
 */
 
 void AddressCreator::execute()
 {
     Scope x( log() );
-    if ( !decided ) {
-        uint c = 0;
-        Dict<Address>::Iterator i( a );
-        while ( c < useTempTable && i ) {
-            if ( !i->id() )
-                ++c;
-            ++i;
-        }
-        if ( c >= useTempTable )
-            bulk = true;
-        decided = true;
-    }
-
-    if ( !bulk ) {
-        HelperRowCreator::execute();
-        return;
-    }
-
-    if ( !sub ) {
-        base->enqueue( new Query( "create temporary table na ("
-                                  "id integer, "
-                                  "f boolean, "
-                                  "name text, "
-                                  "localpart citext, "
-                                  "domain citext )", 0 ) );
-        Query * q = new Query( "copy na (id, f, name,localpart,domain) "
-                               "from stdin with binary", this );
-        Dict<Address>::Iterator i( a );
-        while ( i ) {
-            if ( !i->id() ) {
-                q->bind( 1, 0 );
-                q->bind( 2, false );
-                q->bind( 3, i->uname() );
-                q->bind( 4, i->localpart() );
-                q->bind( 5, i->domain() );
-                q->submitLine();
-            }
-            ++i;
-        }
-        base->enqueue( q );
 
-        sub = base->subTransaction( this );
-    }
-
-    if ( insert && insert->failed() ) {
+    if ( obtain && obtain->failed() ) {
+        if ( !obtain->error().contains( addressKey ) )
+            return;
+        // we lost a race. roll back and try again; the next attempt
+        // will find the rows the other transaction inserted.
         sub->restart();
-        insert = 0;
+        obtain = 0;
     }
 
-    if ( !insert ) {
-        sub->enqueue(
-            new Query(
-                "update na set f=true, id=a.id from addresses a "
-                "where na.localpart=a.localpart "
-                "and na.domain=a.domain "
-                "and na.name=a.name "
-                "and not f", 0 ) );
-        sub->enqueue(
-            new Query(
-                "update na "
-                "set id=nextval(pg_get_serial_sequence('addresses','id')) "
-                "where id = 0 and not f", 0 ) );
-        insert =
-            new Query(
-                "insert into addresses "
-                "(id, name, localpart, domain) "
-                "select id, name, localpart, domain "
-                "from na where not f", this );
-        sub->enqueue( insert );
+    if ( !obtain ) {
+        obtain = makeSelect();
+        if ( !obtain )
+            return;
+        if ( !sub )
+            sub = base->subTransaction( this );
+        sub->enqueue( obtain );
         sub->execute();
     }
 
-    if ( !insert->done() )
+    if ( !obtain->done() || committed )
         return;
 
-    if ( !obtain ) {
-        obtain = new Query( "select id, name, localpart::text, domain::text "
-                            "from na", this );
-        sub->enqueue( obtain );
-        sub->enqueue( new Query( "drop table na", 0 ) );
-        sub->commit();
-    }
-
     processSelect( obtain );
+    committed = true;
+    sub->commit();
 }
 
 
@@ -14,9 +14,13 @@ class HelperRowCreator
     : public EventHandler
 {
 public:
-    HelperRowCreator( const EString &, class Transaction *, const EString & );
+    HelperRowCreator( const EString &, class Transaction *, const EString &,
+                      EventHandler * = 0 );
+
+    static void setup();
 
     bool done() const;
+    bool failed() const;
 
     void execute();
 
@@ -26,8 +30,11 @@ public:
 
 protected:
     virtual void add( const EString &, uint );
+    void shareNames();
 
 private:
+    void executeAlone();
+
     virtual Query * makeSelect() = 0;
     virtual void processSelect( Query * );
     virtual Query * makeCopy() = 0;
@@ -42,7 +49,8 @@ class FlagCreator
     : public HelperRowCreator
 {
 public:
-    FlagCreator( const EStringList &, class Transaction * );
+    FlagCreator( const EStringList &, class Transaction *,
+                 EventHandler * = 0 );
 
     EStringList * allFlags() { return &names; }
 
@@ -59,7 +67,8 @@ class FieldNameCreator
     : public HelperRowCreator
 {
 public:
-    FieldNameCreator( const EStringList &, class Transaction * );
+    FieldNameCreator( const EStringList &, class Transaction *,
+                      EventHandler * = 0 );
 
 private:
     Query * makeSelect();
@@ -74,7 +83,8 @@ class AnnotationNameCreator
     : public HelperRowCreator
 {
 public:
-    AnnotationNameCreator( const EStringList &, class Transaction * );
+    AnnotationNameCreator( const EStringList &, class Transaction *,
+                           EventHandler * = 0 );
 
 private:
     Query * makeSelect();
@@ -85,6 +95,28 @@ private:
 };
 
 
+class HeaderValueCreator
+    : public HelperRowCreator
+{
+public:
+    HeaderValueCreator( const EStringList &, class Transaction *,
+                        EventHandler * = 0 );
+
+    uint id( const EString & );
+
+private:
+    Query * makeSelect();
+    Query * makeCopy();
+
+    void add( const EString &, uint );
+
+private:
+    EStringList values;
+    Dict<uint> ids;
+    bool shared;
+};
+
+
 class AddressCreator
     : public HelperRowCreator
 {
@@ -102,18 +134,12 @@ private:
     void processSelect( Query * );
     Query * makeCopy();
 
-private:
-    uint param( Dict<uint> *, const EString &, uint &, Query * );
-
 private:
     Dict<Address> * a;
-    List<Address> asked;
-    bool bulk;
-    bool decided;
     Transaction * base;
     Transaction * sub;
-    Query * insert;
     Query * obtain;
+    bool committed;
 };
 
 
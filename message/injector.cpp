@@ -12,6 +12,9 @@
 #include "ustring.h"
 #include "mailbox.h"
 #include "bodypart.h"
+#include "blobstore.h"
+#include "wordindex.h"
+#include "ustringlist.h"
 #include "datefield.h"
 #include "mimefields.h"
 #include "messagecache.h"
@@ -21,14 +24,22 @@
 #include "annotation.h"
 #include "postgres.h"
 #include "session.h"
+#include "eventloop.h"
+#include "configuration.h"
 #include "scope.h"
 #include "graph.h"
 #include "html.h"
 #include "md5.h"
+#include "cache.h"
+#include "hasher.h"
+#include "allocator.h"
 #include "utf.h"
 #include "log.h"
 #include "dsn.h"
 
+// gettimeofday
+#include <sys/time.h>
+
 
 static GraphableCounter * successes;
 static GraphableCounter * failures;
@@ -38,7 +49,7 @@ struct BodypartRow
     : public Garbage
 {
     BodypartRow()
-        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 )
+        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 ), fresh( false )
     {}
 
     uint id;
@@ -46,10 +57,33 @@ struct BodypartRow
     EString * text;
     EString * data;
     uint bytes;
+    bool fresh;
     List<Bodypart> bodyparts;
 };
 
 
+// The bodyparts.id of each hash this process has recently seen in the
+// database, so that popular bodyparts need not even be looked up.
+
+class BodypartCache
+    : public Cache
+{
+public:
+    BodypartCache(): Cache( 2 ) {}
+    void clear() { ids.clear(); }
+    Dict<uint> ids;
+};
+
+static BodypartCache * bodypartCache = 0;
+
+
+// Longer values of interned header fields are stored in header_fields
+// as usual; they're unlikely to repeat, and the unique index on
+// header_values.value cannot hold very long values.
+
+static const uint maxInternedValue = 512;
+
+
 // The following is everything the Injector needs to do its work.
 
 enum State {
@@ -59,6 +93,7 @@ enum State {
     CreatingDependencies,
     ConvertingInReplyTo, AddingMoreReferences,
     ConvertingThreadIndex,
+    ConvertingSubjects,
     CreatingThreadRoots,
     InsertingBodyparts,
     SelectingMessageIds, SelectingUids,
@@ -67,20 +102,53 @@ enum State {
 };
 
 
+// what each state is called in stageName(), and the time all
+// Injectors together have spent in it, in microseconds
+static const char * stageNames[Done + 1] = {
+    "findMessages",
+    "createMailboxes",
+    "findDependencies",
+    "createDependencies",
+    "convertInReplyTo", "addMoreReferences",
+    "convertThreadIndex",
+    "convertSubjects",
+    "insertThreadRoots",
+    "insertBodyparts",
+    "selectMessageIds", "selectUids",
+    "insertMessages",
+    "commit", "done"
+};
+
+static int64 stageTimes[Done + 1];
+
+
+// the current time in microseconds
+static int64 now()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
 class InjectorData
     : public Garbage
 {
 public:
     InjectorData()
-        : owner( 0 ),
+        : owner( 0 ), notifyWhenCommitting( false ),
           state( Inactive ), failed( false ), retried( 0 ), transaction( 0 ),
+          priority( Query::Interactive ),
           mailboxesCreated( 0 ),
           fieldNameCreator( 0 ), flagCreator( 0 ), annotationNameCreator( 0 ),
+          headerValueCreator( 0 ),
+          namesRequested( false ), namesAlone( false ),
+          viaFunction( false ), inject( 0 ), threadRoot( 0 ),
           lockUidnext( 0 ), select( 0 ), insert( 0 ),
-          substate( 0 ), subtransaction( 0 ),
+          substate( 0 ), subtransaction( 0 ), conflicts( 0 ),
           findParents( 0 ), findReferences( 0 ),
           findBlah( 0 ), findMessagesInOutlookThreads( 0 ),
-          threads( 0 )
+          findSubjects( 0 ), threads( 0 ), stageStarted( 0 )
     {}
 
     struct Delivery
@@ -101,16 +169,19 @@ public:
     List<Delivery> deliveries;
 
     EventHandler * owner;
+    bool notifyWhenCommitting;
 
     State state;
     bool failed;
     bool retried;
 
     Transaction *transaction;
+    Query::Priority priority;
 
     EStringList flags;
     EStringList fields;
     EStringList annotationNames;
+    EStringList headerValues;
     UStringList baseSubjects;
     Dict<Address> addresses;
     List< ::Mailbox > * mailboxesCreated;
@@ -125,9 +196,27 @@ public:
 
     Map<Mailbox> mailboxes;
 
+    struct UidnextUpdate
+        : public Garbage
+    {
+        UidnextUpdate(): Garbage(), n( 0 ), recent( false ) {}
+        uint n;
+        bool recent;
+        IntegerSet mailboxes;
+    };
+
+    Dict<UidnextUpdate> uidnextUpdates;
+
     HelperRowCreator * fieldNameCreator;
     HelperRowCreator * flagCreator;
     HelperRowCreator * annotationNameCreator;
+    HelperRowCreator * headerValueCreator;
+    bool namesRequested;
+    bool namesAlone;
+
+    bool viaFunction;
+    Query * inject;
+    uint threadRoot;
 
     Query * lockUidnext;
     Query * select;
@@ -135,10 +224,27 @@ public:
 
     uint substate;
     Transaction * subtransaction;
+    uint conflicts;
 
     Dict<BodypartRow> hashes;
     List<BodypartRow> bodyparts;
 
+    struct HashingBodypart
+        : public Garbage
+    {
+    public:
+        HashingBodypart()
+            : Garbage(), bodypart( 0 ), text( 0 ), data( 0 ), hasher( 0 )
+        {}
+
+        Bodypart * bodypart;
+        EString * text;
+        EString * data;
+        Hasher * hasher;
+    };
+
+    List<HashingBodypart> hashing;
+
     // for convertInReplyTo()
     Dict< List<Message> > outlooks;
     Map<EString> outlookParentIds;
@@ -147,6 +253,9 @@ public:
     // for convertThreadIndex()
     Query * findBlah;
     Query * findMessagesInOutlookThreads;
+    // for convertSubjects()
+    Query * findSubjects;
+    Dict<EString> subjectParents;
 
     struct ThreadParentInfo
         : public Garbage
@@ -167,6 +276,7 @@ public:
 
         Injectee * m;
         Transaction * t;
+        EString parent;
 
         EStringList references() const {
             EStringList result;
@@ -182,6 +292,8 @@ public:
                     ++i;
                 }
             }
+            if ( result.isEmpty() && !parent.isEmpty() )
+                result.append( parent );
             return result;
         }
 
@@ -194,6 +306,8 @@ public:
     };
 
     ThreadRootCreator * threads;
+
+    int64 stageStarted;
 };
 
 
@@ -203,6 +317,12 @@ public:
     This class takes a list of Message objects and performs the database
     operations necessary to inject them into their respective mailboxes.
     Injection commences only when execute() is called.
+
+    Each step normally waits for an answer from the database before
+    the next can start. If use-injection-function is set, a single
+    message is instead injected with the help of the inject_message()
+    database function, which answers all the questions at once (see
+    injectViaFunction()).
 */
 
 
@@ -295,6 +415,29 @@ EString Injector::error() const
 }
 
 
+/*! Instructs this Injector to notify its owner also when it has sent
+    all its work to the database and is only waiting for the commit,
+    so the owner can prepare more work meanwhile. committing() is
+    true from that point until done().
+*/
+
+void Injector::notifyWhenCommitting()
+{
+    d->notifyWhenCommitting = true;
+}
+
+
+/*! Returns true if this Injector has sent all its work to the
+    database and waits only for the transaction to finish, and false
+    otherwise.
+*/
+
+bool Injector::committing() const
+{
+    return !d->failed && d->state == AwaitingCompletion;
+}
+
+
 /*! This private function advances the injector to the next state. */
 
 void Injector::next()
@@ -316,12 +459,27 @@ void Injector::setTransaction( class Transaction * t )
 }
 
 
+/*! Records that this Injector's database work has priority \a p, if
+    it uses a Transaction of its own. The default is
+    Query::Interactive. A subtransaction from setTransaction() has the
+    priority of its parent instead.
+*/
+
+void Injector::setPriority( Query::Priority p )
+{
+    d->priority = p;
+}
+
+
 void Injector::execute()
 {
     Scope x( log() );
 
     State last;
 
+    if ( !d->stageStarted )
+        d->stageStarted = now();
+
     // We start in state Inactive, and execute the functions responsible
     // for making progress in each state. If they change the state using
     // next(), we restart the loop; otherwise we wait for callbacks. We
@@ -339,8 +497,10 @@ void Injector::execute()
                 d->state = Done;
             }
             else {
-                if ( !d->transaction )
+                if ( !d->transaction ) {
                     d->transaction = new Transaction( this );
+                    d->transaction->setPriority( d->priority );
+                }
                 next();
             }
             break;
@@ -371,13 +531,21 @@ void Injector::execute()
             convertThreadIndex();
             break;
 
+        case ConvertingSubjects:
+            convertSubjects();
+            break;
+
         case CreatingThreadRoots:
-            insertThreadRoots();
+            if ( !d->viaFunction )
+                insertThreadRoots();
             next();
             break;
 
         case InsertingBodyparts:
-            insertBodyparts();
+            if ( d->viaFunction )
+                injectViaFunction();
+            else
+                insertBodyparts();
             break;
 
         case SelectingMessageIds:
@@ -390,12 +558,16 @@ void Injector::execute()
 
         case InsertingMessages:
             insertMessages();
-            insertDeliveries();
-            insertThreadIndexes();
             next();
             if ( !d->mailboxes.isEmpty() )
                 Mailbox::refreshMailboxes( d->transaction );
             d->transaction->commit();
+            if ( d->notifyWhenCommitting && d->owner ) {
+                // let the database start on the work while the owner
+                // does whatever it does
+                EventLoop::global()->flushAll();
+                d->owner->notify();
+            }
             break;
 
         case AwaitingCompletion:
@@ -405,6 +577,9 @@ void Injector::execute()
             if ( d->failed || d->transaction->failed() ) {
                 ::failures->tick();
                 Cache::clearAllCaches( false );
+                // a cached bodypart may have been removed by aox vacuum
+                if ( ::bodypartCache )
+                    ::bodypartCache->clear();
             }
             else {
                 ::successes->tick();
@@ -417,6 +592,12 @@ void Injector::execute()
             break;
         }
 
+        if ( d->state != last ) {
+            int64 t = now();
+            stageTimes[last] += t - d->stageStarted;
+            d->stageStarted = t;
+        }
+
         if ( !d->failed && d->transaction )
             d->failed = d->transaction->failed();
     }
@@ -439,6 +620,43 @@ void Injector::execute()
 }
 
 
+/*! Returns the number of stages an Injector goes through, for
+    stageName() and stageTime().
+*/
+
+uint Injector::stages()
+{
+    return Done;
+}
+
+
+/*! Returns the name of \a stage, which is the name of the function
+    doing most of the work in that stage (e.g. "insertBodyparts"), or
+    "commit" for the wait for the Transaction to commit.
+*/
+
+EString Injector::stageName( uint stage )
+{
+    if ( stage > Done )
+        return "";
+    return stageNames[stage];
+}
+
+
+/*! Returns the number of microseconds all Injectors in this process
+    have spent in \a stage, from entering it until leaving it. The
+    time includes waiting for the database, so when several Injectors
+    work at once, the sum of all stages can exceed the time elapsed.
+*/
+
+int64 Injector::stageTime( uint stage )
+{
+    if ( stage > Done )
+        return 0;
+    return stageTimes[stage];
+}
+
+
 /*! This private helper makes a master list of messages to be
     inserted, based on what addDelivery() and addInjection() have
     done.
@@ -563,7 +781,8 @@ void Injector::findDependencies()
                 EString n( hf->name() );
 
                 if ( hf->type() >= HeaderField::Other &&
-                     !seenFields.contains( n ) )
+                     !seenFields.contains( n ) &&
+                     HeaderField::isIndexed( n ) )
                 {
                     d->fields.append( n );
                     seenFields.insert( n, this );
@@ -571,6 +790,8 @@ void Injector::findDependencies()
 
                 if ( hf->type() <= HeaderField::LastAddressField )
                     updateAddresses( ((AddressField *)hf)->addresses() );
+                else if ( HeaderField::isInterned( n ) )
+                    addInternedValue( hf );
 
                 ++fi;
             }
@@ -619,6 +840,7 @@ void Injector::findDependencies()
 
     d->flags.removeDuplicates();
     d->annotationNames.removeDuplicates( true );
+    d->headerValues.removeDuplicates( false );
     d->baseSubjects.removeDuplicates( true );
 
     // Rows destined for deliveries/delivery_recipients also contain
@@ -635,6 +857,30 @@ void Injector::findDependencies()
 }
 
 
+/*! Notes that the value of \a hf should be stored in header_values,
+    unless it's too long to be worth it.
+*/
+
+void Injector::addInternedValue( HeaderField * hf )
+{
+    EString v = hf->value().utf8();
+    if ( !v.isEmpty() && v.length() < maxInternedValue )
+        d->headerValues.append( v );
+}
+
+
+/*! Returns the header_values.id of the value of \a hf, or 0 if its
+    value is to be stored in header_fields.
+*/
+
+uint Injector::internedValueId( HeaderField * hf )
+{
+    if ( !d->headerValueCreator || !HeaderField::isInterned( hf->name() ) )
+        return 0;
+    return d->headerValueCreator->id( hf->value().utf8() );
+}
+
+
 /*! Adds previously unknown addresses from \a newAddresses to
     d->addresses. */
 
@@ -673,31 +919,88 @@ uint Injector::addressId( Address * a )
 
 
 /*! This function creates any unknown names found by
-    findDependencies().  It creates up to four subtransactions and
+    findDependencies().  It creates up to five subtransactions and
     advances to the next state, trusting Transaction to queue the work
     appropriately.
+
+    If our Transaction hasn't started yet, the field, flag and
+    annotation names and the interned header values are instead
+    created outside it, and committed at once, before the Transaction
+    starts. Other injectors then don't
+    have to wait for ours to commit if they want the same names.
 */
 
 void Injector::createDependencies()
 {
-    if ( !d->fields.isEmpty() ) {
-        d->fieldNameCreator =
-            new FieldNameCreator( d->fields, d->transaction );
-        d->fieldNameCreator->execute();
-    }
+    if ( !d->namesRequested ) {
+        d->namesRequested = true;
+        Transaction * t = d->transaction;
+        if ( !t->parent() && t->state() == Transaction::Inactive ) {
+            d->namesAlone = true;
+            t = 0;
+        }
+
+        if ( !d->fields.isEmpty() ) {
+            d->fieldNameCreator =
+                new FieldNameCreator( d->fields, t, this );
+            d->fieldNameCreator->execute();
+        }
+
+        if ( !d->flags.isEmpty() ) {
+            d->flagCreator = new FlagCreator( d->flags, t, this );
+            d->flagCreator->execute();
+        }
+
+        if ( !d->annotationNames.isEmpty() ) {
+            d->annotationNameCreator =
+                new AnnotationNameCreator( d->annotationNames, t, this );
+            d->annotationNameCreator->execute();
+        }
 
-    if ( !d->flags.isEmpty() ) {
-        d->flagCreator = new FlagCreator( d->flags, d->transaction );
-        d->flagCreator->execute();
+        if ( !d->headerValues.isEmpty() ) {
+            d->headerValueCreator =
+                new HeaderValueCreator( d->headerValues, t, this );
+            d->headerValueCreator->execute();
+        }
     }
 
-    if ( !d->annotationNames.isEmpty() ) {
-        d->annotationNameCreator =
-            new AnnotationNameCreator( d->annotationNames, d->transaction );
-        d->annotationNameCreator->execute();
+    if ( d->namesAlone ) {
+        if ( ( d->fieldNameCreator && !d->fieldNameCreator->done() ) ||
+             ( d->flagCreator && !d->flagCreator->done() ) ||
+             ( d->annotationNameCreator &&
+               !d->annotationNameCreator->done() ) ||
+             ( d->headerValueCreator && !d->headerValueCreator->done() ) )
+            return;
+
+        // if that didn't work, we try again the old way, so that any
+        // error is reported by the Transaction
+        if ( d->fieldNameCreator && d->fieldNameCreator->failed() ) {
+            d->fieldNameCreator =
+                new FieldNameCreator( d->fields, d->transaction );
+            d->fieldNameCreator->execute();
+        }
+        if ( d->flagCreator && d->flagCreator->failed() ) {
+            d->flagCreator = new FlagCreator( d->flags, d->transaction );
+            d->flagCreator->execute();
+        }
+        if ( d->annotationNameCreator &&
+             d->annotationNameCreator->failed() ) {
+            d->annotationNameCreator =
+                new AnnotationNameCreator( d->annotationNames,
+                                           d->transaction );
+            d->annotationNameCreator->execute();
+        }
+        if ( d->headerValueCreator && d->headerValueCreator->failed() ) {
+            d->headerValueCreator =
+                new HeaderValueCreator( d->headerValues, d->transaction );
+            d->headerValueCreator->execute();
+        }
+        d->namesAlone = false;
     }
 
-    if ( !d->addresses.isEmpty() ) {
+    // inject_message() looks up the addresses itself
+    d->viaFunction = canUseFunction();
+    if ( !d->addresses.isEmpty() && !d->viaFunction ) {
         AddressCreator * ac
             = new AddressCreator( &d->addresses, d->transaction );
         ac->execute();
@@ -707,6 +1010,38 @@ void Injector::createDependencies()
 }
 
 
+/*! Returns true if this Injector should use the inject_message()
+    database function (see use-injection-function), and false if it
+    should do all the work itself.
+
+    The function handles a single message, and needs the IDs of any
+    new field names and flags to be known already.
+*/
+
+bool Injector::canUseFunction() const
+{
+    if ( !Configuration::toggle( Configuration::UseInjectionFunction ) )
+        return false;
+    if ( d->messages.count() != 1 )
+        return false;
+    if ( d->fieldNameCreator &&
+         ( !d->fieldNameCreator->done() || d->fieldNameCreator->failed() ) )
+        return false;
+    if ( d->flagCreator &&
+         ( !d->flagCreator->done() || d->flagCreator->failed() ) )
+        return false;
+    if ( d->annotationNameCreator &&
+         ( !d->annotationNameCreator->done() ||
+           d->annotationNameCreator->failed() ) )
+        return false;
+    if ( d->headerValueCreator &&
+         ( !d->headerValueCreator->done() ||
+           d->headerValueCreator->failed() ) )
+        return false;
+    return true;
+}
+
+
 /*! Creates a proper References field for any messages which have
     In-Reply-To but not References. This covers some versions of
     Outlook, but not all.
@@ -1096,6 +1431,105 @@ void Injector::insertThreadIndexes()
 }
 
 
+/*! Returns true if \a subject looks like that of a reply or forward,
+    ie. starts with "Re:", "Fw:" or "Fwd:", possibly after a list tag.
+*/
+
+static bool isReply( const UString & subject )
+{
+    EString s = subject.utf8().simplified().lower();
+    while ( s.startsWith( "[" ) && s.find( ']' ) > 0 )
+        s = s.mid( s.find( ']' ) + 1 ).simplified();
+    return s.startsWith( "re:" ) || s.startsWith( "re[" ) ||
+        s.startsWith( "fw:" ) || s.startsWith( "fwd:" );
+}
+
+
+/*! Finds a thread for each reply that has neither References nor a
+    usable In-Reply-To or Thread-Index, by looking for the most recent
+    message in the same mailboxes with the same base subject. The
+    message is later threaded as though it referred to that message,
+    so that it gets the same thread_root, and threads that grow
+    together later are merged as usual.
+
+    The message itself isn't changed.
+*/
+
+void Injector::convertSubjects()
+{
+    if ( !d->findSubjects ) {
+        EStringList subjects;
+        IntegerSet mailboxes;
+        List<Injectee>::Iterator i( d->messages );
+        while ( i ) {
+            Header * h = i->header();
+            HeaderField * s = h->field( HeaderField::Subject );
+            if ( s && !h->field( HeaderField::References ) &&
+                 isReply( s->value() ) ) {
+                subjects.append( Message::baseSubject( s->value() ).utf8() );
+                List<Mailbox>::Iterator m( i->mailboxes() );
+                while ( m ) {
+                    if ( m->id() )
+                        mailboxes.add( m->id() );
+                    ++m;
+                }
+            }
+            ++i;
+        }
+        if ( subjects.isEmpty() || mailboxes.isEmpty() ) {
+            next();
+            return;
+        }
+
+        subjects.removeDuplicates();
+        d->findSubjects =
+            new Query( "select distinct on (tm.subject) "
+                       "tm.subject, tm.messageid "
+                       "from thread_members tm "
+                       "join mailbox_messages mm on (tm.message=mm.message) "
+                       "where tm.subject=any($1::text[]) "
+                       "and mm.mailbox=any($2) "
+                       "and tm.messageid is not null "
+                       "order by tm.subject, tm.message desc", this );
+        d->findSubjects->bind( 1, subjects );
+        d->findSubjects->bind( 2, mailboxes );
+        d->transaction->enqueue( d->findSubjects );
+        d->transaction->execute();
+    }
+
+    if ( !d->findSubjects->done() )
+        return;
+
+    while ( d->findSubjects->hasResults() ) {
+        Row * r = d->findSubjects->nextRow();
+        d->subjectParents.insert( r->getUString( "subject" ).utf8(),
+                                  new EString( r->getEString( "messageid" ) ) );
+    }
+
+    next();
+}
+
+
+/*  Returns a ThreadInjectee for \a i, whose parent is the one
+    convertSubjects() found in \a d, if any.
+*/
+
+static InjectorData::ThreadInjectee * threadInjectee( InjectorData * d,
+                                                      Injectee * i )
+{
+    InjectorData::ThreadInjectee * ti
+        = new InjectorData::ThreadInjectee( i, d->transaction );
+    HeaderField * s = i->header()->field( HeaderField::Subject );
+    if ( s && !i->header()->field( HeaderField::References ) ) {
+        EString * p = d->subjectParents.find(
+            Message::baseSubject( s->value() ).utf8() );
+        if ( p )
+            ti->parent = *p;
+    }
+    return ti;
+}
+
+
 /*! Inserts rows into the thread_roots table, so that insertMessages()
     can reference what it needs to.
 */
@@ -1106,7 +1540,7 @@ void Injector::insertThreadRoots()
         = new List<ThreadRootCreator::Message>;
     List<Injectee>::Iterator i( d->messages );
     while ( i ) {
-        l->append( new InjectorData::ThreadInjectee( i, d->transaction ) );
+        l->append( threadInjectee( d, i ) );
         ++i;
     }
     d->threads = new ThreadRootCreator( l, d->transaction );
@@ -1116,7 +1550,16 @@ void Injector::insertThreadRoots()
 
 /*! Inserts all unique bodyparts in the messages into the bodyparts
     table, and updates the in-memory objects with the newly-created
-    bodyparts.ids. */
+    bodyparts.ids.
+
+    Each bodypart is identified by its hash alone (see
+    hashBodypart()), which may be computed by other threads while we
+    wait. Hashes this process has seen recently are
+    known without asking; the rest are looked up, and only the
+    bodyparts which aren't in the database already are sent to the
+    server. If another process inserts one of those first, the unique
+    index on bodyparts.hash makes the copy fail, and we look again.
+*/
 
 void Injector::insertBodyparts()
 {
@@ -1126,126 +1569,141 @@ void Injector::insertBodyparts()
         last = d->substate;
 
         if ( d->substate == 0 ) {
-            List<Injectee>::Iterator it( d->messages );
-            while ( it ) {
-                Message * m = it;
-                List<Bodypart>::Iterator bi( m->allBodyparts() );
-                while ( bi ) {
-                    addBodypartRow( bi );
-                    ++bi;
-                }
-                ++it;
+            if ( !hashBodyparts() )
+                return;
+
+            bool unknown = false;
+            List<BodypartRow>::Iterator bi( d->bodyparts );
+            while ( bi && !unknown ) {
+                if ( !bi->id )
+                    unknown = true;
+                ++bi;
             }
 
             if ( d->bodyparts.isEmpty() )
+                d->substate = 6;
+            else if ( !unknown )
                 d->substate = 5;
             else
                 d->substate++;
         }
 
         if ( d->substate == 1 ) {
-            Query * create =
-                new Query( "create temporary table bp ("
-                           "bid integer, bytes integer, "
-                           "hash text, text text, data bytea, "
-                           "i integer, n boolean default 'f')", 0 );
-
-            Query * copy =
-                new Query( "copy bp (bytes,hash,text,data,i) "
-                           "from stdin with binary", this );
-
-            uint i = 0;
+            EStringList hashes;
             List<BodypartRow>::Iterator bi( d->bodyparts );
             while ( bi ) {
-                BodypartRow * br = bi;
-
-                copy->bind( 1, br->bytes );
-                copy->bind( 2, br->hash );
-                if ( br->text )
-                    copy->bind( 3, *br->text );
-                else
-                    copy->bindNull( 3 );
-                if ( br->data )
-                    copy->bind( 4, *br->data );
-                else
-                    copy->bindNull( 4 );
-                copy->bind( 5, i++ );
-                copy->submitLine();
-
+                if ( !bi->id )
+                    hashes.append( bi->hash );
                 ++bi;
             }
 
-            d->transaction->enqueue( create );
-            d->transaction->enqueue( copy );
-            d->subtransaction = d->transaction->subTransaction( this );
-
+            // inject_message() locks the hashes it inserts, so that
+            // it won't allocate an ID for a bodypart we're inserting
+            Query * lock =
+                new Query( "select pg_advisory_xact_lock(hashtext(h)) "
+                           "from (select distinct h "
+                           "from unnest($1::text[]) h order by h) s", 0 );
+            lock->bind( 1, hashes );
+
+            d->select =
+                new Query( "select id, hash from bodyparts "
+                           "where hash=any($1::text[])", this );
+            d->select->bind( 1, hashes );
+
+            if ( !d->subtransaction )
+                d->subtransaction = d->transaction->subTransaction( this );
+            d->subtransaction->enqueue( lock );
+            d->subtransaction->enqueue( d->select );
+            d->subtransaction->execute();
             d->substate++;
         }
 
         if ( d->substate == 2 ) {
-            Query * setId =
-                new Query( "update bp set bid=b.id from bodyparts b where "
-                           "bp.hash=b.hash and not bp.text is distinct from "
-                           "b.text and not bp.data is distinct from b.data",
-                           0 );
-
-            Query * setNew =
-                new Query( "update bp set bid=nextval('bodypart_ids')::int, "
-                           "n='t' where bid is null", 0 );
-
-            d->insert =
-                new Query( "insert into bodyparts "
-                           "(id,bytes,hash,text,data) "
-                           "select bid,bytes,hash,text,data "
-                           "from bp where n", this );
+            if ( !d->select->done() )
+                return;
 
-            d->substate++;
-            d->subtransaction->enqueue( setId );
-            d->subtransaction->enqueue( setNew );
-            d->subtransaction->enqueue( d->insert );
-            d->subtransaction->execute();
-        }
+            while ( d->select->hasResults() ) {
+                Row * r = d->select->nextRow();
+                BodypartRow * br = d->hashes.find( r->getEString( "hash" ) );
+                if ( br )
+                    br->id = r->getInt( "id" );
+            }
 
-        if ( d->substate == 3 ) {
-            if ( !d->insert->done() )
-                return;
+            uint n = 0;
+            List<BodypartRow>::Iterator bi( d->bodyparts );
+            while ( bi ) {
+                if ( !bi->id )
+                    n++;
+                ++bi;
+            }
 
-            if ( d->insert->failed() ) {
-                // this will fail only if there is some kind of
-                // serious, serious failure, the kind where retrying
-                // will fail again.
-                d->subtransaction->commit();
-                d->substate = 100;
+            if ( n ) {
+                d->select = selectNextvals( "bodypart_ids", n );
+                d->subtransaction->enqueue( d->select );
+                d->subtransaction->execute();
+                d->substate++;
             }
             else {
-                d->substate++;
                 d->subtransaction->commit();
-                d->select =
-                    new Query( "select bid from bp order by i", this );
-                d->transaction->enqueue( d->select );
-                d->transaction->enqueue( new Query( "drop table bp", 0 ) );
-                d->transaction->execute();
+                d->substate = 5;
             }
         }
 
-        if ( d->substate == 4 ) {
+        if ( d->substate == 3 ) {
             if ( !d->select->done() )
                 return;
 
             List<BodypartRow>::Iterator bi( d->bodyparts );
             while ( bi ) {
-                BodypartRow * br = bi;
-                Row * r = d->select->nextRow();
-                uint id = r->getInt( "bid" );
-
-                List<Bodypart>::Iterator it( br->bodyparts );
-                while ( it ) {
-                    it->setId( id );
-                    ++it;
+                if ( !bi->id ) {
+                    Row * r = d->select->nextRow();
+                    bi->id = r->getInt( "id" );
+                    bi->fresh = true;
                 }
-
                 ++bi;
             }
+
+            d->insert = copyBodyparts();
+            d->subtransaction->enqueue( d->insert );
+            d->subtransaction->execute();
+            d->substate++;
+        }
+
+        if ( d->substate == 4 ) {
+            if ( !d->insert->done() )
+                return;
+
+            if ( !d->insert->failed() ) {
+                d->subtransaction->commit();
+                d->substate++;
+            }
+            else if ( d->insert->error().contains( "b_sha" ) &&
+                      d->conflicts++ < 3 ) {
+                // someone else inserted one of our bodyparts while we
+                // weren't looking. forget the ids we made up and look
+                // again.
+                List<BodypartRow>::Iterator bi( d->bodyparts );
+                while ( bi ) {
+                    if ( bi->fresh ) {
+                        bi->id = 0;
+                        bi->fresh = false;
+                    }
+                    ++bi;
+                }
+                d->subtransaction->restart();
+                d->substate = 1;
+            }
+            else {
+                // this will fail only if there is some kind of
+                // serious, serious failure, the kind where retrying
+                // will fail again.
+                d->subtransaction->commit();
+                d->substate = 100;
+            }
+        }
+
+        if ( d->substate == 5 ) {
+            recordBodyparts();
             d->substate++;
         }
     }
@@ -1257,6 +1715,298 @@ void Injector::insertBodyparts()
 }
 
 
+/*! Starts hashing the bodyparts of all the messages, if that hasn't
+    been done, and returns false if any hash isn't ready yet. When
+    all are, adds a BodypartRow for each and returns true.
+*/
+
+bool Injector::hashBodyparts()
+{
+    if ( d->hashing.isEmpty() ) {
+        List<Injectee>::Iterator it( d->messages );
+        while ( it ) {
+            Message * m = it;
+            List<Bodypart>::Iterator bi( m->allBodyparts() );
+            while ( bi ) {
+                if ( bi->id() )
+                    addStoredBodypart( bi );
+                else
+                    hashBodypart( bi );
+                ++bi;
+            }
+            ++it;
+        }
+    }
+
+    List<InjectorData::HashingBodypart>::Iterator h( d->hashing );
+    while ( h ) {
+        if ( !h->hasher->done() )
+            return false;
+        ++h;
+    }
+
+    List<InjectorData::HashingBodypart>::Iterator i( d->hashing );
+    while ( i ) {
+        addBodypartRow( i->bodypart, i->text, i->data,
+                        i->hasher->hash().hex() );
+        ++i;
+    }
+    d->hashing.clear();
+    return true;
+}
+
+
+/*! Adds \a b, which already has a bodyparts row (such as a bodypart
+    of another message that Append copied using CATENATE), to the list
+    of bodyparts without hashing it. The Injector links to that row and
+    stores nothing.
+*/
+
+void Injector::addStoredBodypart( Bodypart * b )
+{
+    // the key can't clash with a hash, which is hexadecimal
+    EString key = "id " + fn( b->id() );
+    BodypartRow * br = d->hashes.find( key );
+    if ( !br ) {
+        br = new BodypartRow;
+        br->id = b->id();
+        br->bytes = b->numBytes();
+        d->hashes.insert( key, br );
+        d->bodyparts.append( br );
+    }
+    br->bodyparts.append( b );
+}
+
+
+/*! Returns a new Query to copy the bodyparts which have just been
+    given IDs (those marked fresh) into the bodyparts table.
+*/
+
+Query * Injector::copyBodyparts()
+{
+    Query * q = new Query( "copy bodyparts "
+                           "(id,bytes,hash,text,data,compressed) "
+                           "from stdin with binary", this );
+
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi ) {
+        BodypartRow * br = bi;
+        if ( br->fresh ) {
+            q->bind( 1, br->id );
+            q->bind( 2, br->bytes );
+            q->bind( 3, br->hash );
+            if ( br->text )
+                q->bind( 4, *br->text );
+            else
+                q->bindNull( 4 );
+            EString c;
+            if ( br->data )
+                c = Bodypart::compressed( *br->data );
+            if ( !c.isEmpty() )
+                q->bind( 5, c );
+            else if ( br->data )
+                q->bind( 5, *br->data );
+            else
+                q->bindNull( 5 );
+            q->bind( 6, !c.isEmpty() );
+            q->submitLine();
+        }
+        ++bi;
+    }
+    return q;
+}
+
+
+/*! Gives each Bodypart the ID of its row, remembers the IDs for later
+    injections, and records the words of the new text bodyparts if
+    use-word-index is set.
+*/
+
+void Injector::recordBodyparts()
+{
+    if ( !::bodypartCache )
+        ::bodypartCache = new BodypartCache;
+
+    Query * words = 0;
+    if ( WordIndex::enabled() )
+        words = new Query( "copy bodypart_words (bodypart,word) "
+                           "from stdin with binary", 0 );
+
+    Utf8Codec u;
+    uint n = 0;
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi ) {
+        BodypartRow * br = bi;
+
+        List<Bodypart>::Iterator it( br->bodyparts );
+        while ( it ) {
+            it->setId( br->id );
+            ++it;
+        }
+
+        if ( !br->hash.isEmpty() &&
+             !::bodypartCache->ids.contains( br->hash ) ) {
+            uint * id = (uint *)Allocator::alloc( sizeof(uint), 0 );
+            *id = br->id;
+            ::bodypartCache->ids.insert( br->hash, id );
+        }
+
+        // only new bodyparts need their words recorded
+        if ( words && br->text && br->fresh ) {
+            UStringList::Iterator w(
+                WordIndex::words( u.toUnicode( *br->text ) ) );
+            while ( w ) {
+                words->bind( 1, br->id );
+                words->bind( 2, *w );
+                words->submitLine();
+                n++;
+                ++w;
+            }
+        }
+
+        ++bi;
+    }
+    if ( n )
+        d->transaction->enqueue( words );
+}
+
+
+/*! Does the work of insertBodyparts(), selectMessageIds() and
+    selectUids() for a single message using one call to the
+    inject_message() database function, which also looks up the
+    addresses and the thread root. When it returns, the rest of the
+    message is sent at once, so the database is asked only two
+    questions: The function call, and the commit.
+*/
+
+void Injector::injectViaFunction()
+{
+    Injectee * m = d->messages.firstElement();
+
+    if ( !d->inject ) {
+        if ( !hashBodyparts() )
+            return;
+
+        IntegerSet mailboxes;
+        IntegerSet listening;
+        Map<InjectorData::Mailbox>::Iterator mi( d->mailboxes );
+        while ( mi ) {
+            mailboxes.add( mi->mailbox->id() );
+            List<Session>::Iterator si( mi->mailbox->sessions() );
+            if ( si )
+                listening.add( mi->mailbox->id() );
+            ++mi;
+        }
+
+        EStringList hashes;
+        List<BodypartRow>::Iterator bi( d->bodyparts );
+        while ( bi ) {
+            if ( !bi->id )
+                hashes.append( bi->hash );
+            ++bi;
+        }
+
+        // the same message-ids as ThreadRootCreator would look at,
+        // with the root first
+        EStringList refs;
+        InjectorData::ThreadInjectee * ti = threadInjectee( d, m );
+        EStringList l = ti->references();
+        l.append( ti->messageId() );
+        EStringList::Iterator ri( l );
+        while ( ri ) {
+            if ( !ri->isEmpty() )
+                refs.append( *ri );
+            ++ri;
+        }
+
+        EStringList names;
+        EStringList localparts;
+        EStringList domains;
+        PgUtf8Codec p;
+        Dict<Address>::Iterator ai( d->addresses );
+        while ( ai ) {
+            if ( !ai->id() ) {
+                names.append( p.fromUnicode( ai->uname() ) );
+                localparts.append( ai->localpart().utf8() );
+                domains.append( ai->domain().utf8() );
+            }
+            ++ai;
+        }
+
+        d->inject = new Query( "select * from inject_message("
+                               "$1::integer[],$2::integer[],"
+                               "$3::text[],$4::text[],$5::text[],"
+                               "$6::text[],$7::text[])", this );
+        d->inject->bind( 1, mailboxes );
+        d->inject->bind( 2, listening );
+        d->inject->bind( 3, hashes );
+        d->inject->bind( 4, refs );
+        d->inject->bind( 5, names );
+        d->inject->bind( 6, localparts );
+        d->inject->bind( 7, domains );
+        d->transaction->enqueue( d->inject );
+        d->transaction->execute();
+    }
+
+    if ( !d->inject->done() || d->inject->failed() )
+        return;
+
+    while ( d->inject->hasResults() ) {
+        Row * r = d->inject->nextRow();
+        m->setDatabaseId( r->getInt( "message" ) );
+        if ( !r->isNull( "thread_root" ) )
+            d->threadRoot = r->getInt( "thread_root" );
+
+        if ( !r->isNull( "address" ) ) {
+            Address * c = new Address( r->getUString( "name" ),
+                                       r->getUString( "localpart" ),
+                                       r->getUString( "domain" ) );
+            Address * a = d->addresses.find( AddressCreator::key( c ) );
+            if ( a )
+                a->setId( r->getInt( "address" ) );
+        }
+        else if ( !r->isNull( "bodypart" ) ) {
+            BodypartRow * br = d->hashes.find( r->getEString( "hash" ) );
+            if ( br ) {
+                br->id = r->getInt( "bodypart" );
+                br->fresh = r->getBoolean( "fresh" );
+            }
+        }
+        else if ( !r->isNull( "mailbox" ) ) {
+            InjectorData::Mailbox * mb =
+                d->mailboxes.find( r->getInt( "mailbox" ) );
+            if ( mb ) {
+                uint uid = r->getInt( "uid" );
+                checkUidnext( mb->mailbox, uid );
+                m->setUid( mb->mailbox, uid );
+                m->setModSeq( mb->mailbox, r->getBigint( "modseq" ) );
+                log( "Using UID " + fn( uid ) + " in mailbox " +
+                     mb->mailbox->name().utf8() );
+                List<Session>::Iterator si( mb->mailbox->sessions() );
+                if ( si && r->getBoolean( "recent" ) )
+                    si->addRecent( uid, 1 );
+            }
+        }
+    }
+
+    bool fresh = false;
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi ) {
+        if ( bi->fresh )
+            fresh = true;
+        ++bi;
+    }
+    if ( fresh )
+        d->transaction->enqueue( copyBodyparts() );
+    recordBodyparts();
+
+    insertMessageRows();
+
+    // inject_message() has updated uidnext, so we go straight on
+    d->state = InsertingMessages;
+}
+
+
 /*! Returns a new Query to select \a num nextval()s as "id" from the
     named \a sequence. */
 
@@ -1270,9 +2020,12 @@ Query * Injector::selectNextvals( const EString & sequence, uint num )
 }
 
 
-/*! Adds \a b to the list of bodyparts if it's not there already. */
+/*! Decides what needs to be stored for \a b, if anything, and starts
+    hashing it. insertBodyparts() calls addBodypartRow() when all the
+    hashes are done.
+*/
 
-void Injector::addBodypartRow( Bodypart * b )
+void Injector::hashBodypart( Bodypart * b )
 {
     bool storeText = false;
     bool storeData = false;
@@ -1304,13 +2057,17 @@ void Injector::addBodypartRow( Bodypart * b )
     // Yes. What exactly do we need to store?
 
     EString * s;
-    EString hash;
     EString * text = 0;
     EString * data = 0;
     PgUtf8Codec u;
 
     if ( storeText ) {
-        text = s = new EString( u.fromUnicode( b->text() ) );
+        // the text is already UTF-8, and only needs to go through the
+        // codec if postgres would choke on a 0 byte.
+        EString t = b->utf8Text();
+        if ( t.contains( '\0' ) )
+            t = u.fromUnicode( b->text() );
+        text = s = new EString( t );
 
         // For certain content types (whose names are "text/html"), we
         // store the contents as data and a plaintext representation as
@@ -1319,16 +2076,45 @@ void Injector::addBodypartRow( Bodypart * b )
 
         if ( storeData ) {
             data = s;
-            text =
-                new EString( u.fromUnicode( HTML::asText( b->text() ) ) );
+            EString h = HTML::asText( b->utf8Text() );
+            if ( h.contains( '\0' ) ) {
+                Utf8Codec c;
+                h = u.fromUnicode( c.toUnicode( h ) );
+            }
+            text = new EString( h );
         }
     }
     else {
         data = s = new EString( b->data() );
     }
-    hash = MD5::hash( *s ).hex();
 
-    // And where does it fit in the list of bodyparts we know already?
+    // The hash covers the way the content is stored as well as the
+    // content itself, since the same bytes may be stored as text for
+    // one bodypart and as data for another.
+
+    InjectorData::HashingBodypart * h = new InjectorData::HashingBodypart;
+    h->bodypart = b;
+    h->text = text;
+    h->data = data;
+    if ( text && data )
+        h->hasher = new Hasher( "h", *s, this );
+    else if ( text )
+        h->hasher = new Hasher( "t", *s, this );
+    else
+        h->hasher = new Hasher( "d", *s, this );
+    d->hashing.append( h );
+}
+
+
+/*! Adds \a b to the list of bodyparts if it's not there already. \a
+    text and \a data are what hashBodypart() decided to store, and \a
+    hash identifies them.
+*/
+
+void Injector::addBodypartRow( Bodypart * b, EString * text, EString * data,
+                               const EString & hash )
+{
+    // Where does it fit in the list of bodyparts we know already?
     // Either we've seen it before (in which case we add it to the list
     // of bodyparts in the appropriate BodypartRow entry), or we haven't
     // (in which case we add a new BodypartRow).
@@ -1336,7 +2122,19 @@ void Injector::addBodypartRow( Bodypart * b )
     BodypartRow * br = d->hashes.find( hash );
 
     if ( !br ) {
+        uint * id = 0;
+        if ( ::bodypartCache )
+            id = ::bodypartCache->ids.find( hash );
+
+        // large binary parts may live in a file instead; a bodyparts
+        // row with neither text nor data tells Fetcher to look there
+        if ( data && !text && BlobStore::wants( *data ) &&
+             BlobStore::store( hash, *data ) )
+            data = 0;
+
         br = new BodypartRow;
+        if ( id )
+            br->id = *id;
         br->hash = hash;
         br->text = text;
         br->data = data;
@@ -1348,6 +2146,48 @@ void Injector::addBodypartRow( Bodypart * b )
 }
 
 
+/*! Returns the first address in the \a t field of \a h, or a null
+    pointer if there is none.
+*/
+
+static Address * firstAddress( Header * h, HeaderField::Type t )
+{
+    AddressField * f = h->addressField( t );
+    if ( !f || !f->addresses() )
+        return 0;
+    return f->addresses()->firstElement();
+}
+
+
+/*! Binds the sort key for \a a to \a n in \a q: the localpart, or if
+    \a display is true, the display name (RFC 5957) falling back to
+    the address. Keys are titlecased so that they sort without regard
+    to case. If \a a is null, the key is null.
+*/
+
+static void bindSortKey( Query * q, uint n, Address * a, bool display )
+{
+    if ( !a ) {
+        q->bindNull( n );
+        return;
+    }
+
+    UString k;
+    if ( !display ) {
+        k = a->localpart();
+    }
+    else if ( !a->uname().isEmpty() ) {
+        k = a->uname();
+    }
+    else {
+        k = a->localpart();
+        k.append( '@' );
+        k.append( a->domain() );
+    }
+    q->bind( n, k.titlecased() );
+}
+
+
 /*! This function inserts rows into the messages table for each Message
     in d->messages, and updates the objects with the newly-created ids.
     It expects to be called repeatedly until it returns true, which it
@@ -1368,15 +2208,33 @@ void Injector::selectMessageIds()
     if ( d->select->failed() )
         return;
 
+    List<Injectee>::Iterator m( d->messages );
+    while ( m && d->select->hasResults() ) {
+        Row * r = d->select->nextRow();
+        m->setDatabaseId( r->getInt( "id" ) );
+        ++m;
+    }
+
+    insertMessageRows();
+
+    next();
+}
+
+
+/*! Inserts the rows describing each message, once the messages have
+    IDs: messages, thread_members, sort_keys, and those written by
+    insertParts() and the functions it calls.
+*/
+
+void Injector::insertMessageRows()
+{
     Query * copy
         = new Query( "copy messages "
                      "(id,rfc822size,idate,thread_root) "
                      "from stdin with binary", this );
 
     List<Injectee>::Iterator m( d->messages );
-    while ( m && d->select->hasResults() ) {
-        Row * r = d->select->nextRow();
-        m->setDatabaseId( r->getInt( "id" ) );
+    while ( m ) {
         copy->bind( 1, m->databaseId() );
         if ( !m->hasTrivia() ) {
             m->setRfc822Size( m->rfc822( false ).length() );
@@ -1384,7 +2242,9 @@ void Injector::selectMessageIds()
         }
         copy->bind( 2, m->rfc822Size() );
         copy->bind( 3, internalDate( m ) );
-        uint tr = d->threads->id( m->header()->messageId() );
+        uint tr = d->threadRoot;
+        if ( d->threads )
+            tr = d->threads->id( m->header()->messageId() );
         if ( tr ) {
             copy->bind( 4, tr );
             m->setThreadId( tr );
@@ -1398,7 +2258,126 @@ void Injector::selectMessageIds()
 
     d->transaction->enqueue( copy );
 
-    next();
+    // and the thread information, so Thread needn't look at
+    // header_fields later
+    Query * threads
+        = new Query( "copy thread_members "
+                     "(message,messageid,refs,subject) "
+                     "from stdin with binary", 0 );
+    List<Injectee>::Iterator i( d->messages );
+    while ( i ) {
+        InjectorData::ThreadInjectee ti( i, d->transaction );
+        threads->bind( 1, i->databaseId() );
+        EString id = ti.messageId();
+        if ( id.isEmpty() )
+            threads->bindNull( 2 );
+        else
+            threads->bind( 2, id );
+        threads->bind( 3, ti.references().join( " " ) );
+        HeaderField * subject = i->header()->field( HeaderField::Subject );
+        if ( subject )
+            threads->bind( 4, Message::baseSubject( subject->value() ) );
+        else
+            threads->bind( 4, UString() );
+        threads->submitLine();
+        ++i;
+    }
+    d->transaction->enqueue( threads );
+
+    // and the sort keys, so Sort needn't join address_fields
+    Query * keys
+        = new Query( "copy sort_keys "
+                     "(message,from_key,to_key,cc_key,"
+                     "display_from,display_to) "
+                     "from stdin with binary", 0 );
+    i = d->messages.first();
+    while ( i ) {
+        Header * h = i->header();
+        Address * from = firstAddress( h, HeaderField::From );
+        Address * to = firstAddress( h, HeaderField::To );
+        Address * cc = firstAddress( h, HeaderField::Cc );
+        keys->bind( 1, i->databaseId() );
+        bindSortKey( keys, 2, from, false );
+        bindSortKey( keys, 3, to, false );
+        bindSortKey( keys, 4, cc, false );
+        bindSortKey( keys, 5, from, true );
+        bindSortKey( keys, 6, to, true );
+        keys->submitLine();
+        ++i;
+    }
+    d->transaction->enqueue( keys );
+
+    // none of this needs UIDs, so we send it before selectUids()
+    // locks the mailboxes. the locks are then held only while the
+    // mailbox-specific rows go in.
+    insertParts();
+    insertPreviews();
+    if ( Configuration::toggle( Configuration::StoreRawMessages ) )
+        insertRawTexts();
+    insertDeliveries();
+    insertThreadIndexes();
+}
+
+
+/*! Stores the RFC 822 form of each message in raw_messages, so that
+    Fetcher can later hand it out without reassembling it from the
+    header fields and bodyparts. Messages with the same text share a
+    row, found by its MD5 hash.
+
+    Message::rfc822() returns the raw text whether or not UTF-8 is to
+    be avoided, so a message is skipped if the two forms differ.
+*/
+
+void Injector::insertRawTexts()
+{
+    List<Injectee>::Iterator i( d->messages );
+    while ( i ) {
+        Message * m = i;
+        ++i;
+
+        EString text = m->rfc822( false );
+        uint n = 0;
+        while ( n < text.length() && text[n] < 128 )
+            n++;
+        if ( n < text.length() && m->rfc822( true ) != text )
+            continue;
+
+        EString hash = MD5::hash( text ).hex();
+
+        Query * q = new Query( "insert into raw_messages (hash,data) "
+                               "select $1,$2 where not exists "
+                               "(select id from raw_messages "
+                               "where hash=$1)", 0 );
+        q->bind( 1, hash );
+        q->bind( 2, text, Query::Binary );
+        d->transaction->enqueue( q );
+
+        q = new Query( "insert into message_raws (message,raw) "
+                       "select $1,min(id) from raw_messages "
+                       "where hash=$2", 0 );
+        q->bind( 1, m->databaseId() );
+        q->bind( 2, hash );
+        d->transaction->enqueue( q );
+    }
+}
+
+
+/*! Stores the RFC 8970 preview of each message in message_previews,
+    so that a FETCH PREVIEW needn't look at the bodyparts later.
+*/
+
+void Injector::insertPreviews()
+{
+    Query * q = new Query( "copy message_previews (message,preview) "
+                           "from stdin with binary", 0 );
+    List<Injectee>::Iterator i( d->messages );
+    while ( i ) {
+        q->bind( 1, i->databaseId() );
+        q->bind( 2, i->preview() );
+        q->submitLine();
+        ++i;
+    }
+    d->transaction->enqueue( q );
 }
 
 
@@ -1430,6 +2409,11 @@ void Injector::selectUids()
     // mailboxes, we hold a write lock on the mailboxes during
     // injection; thus, the Injectors try to acquire locks in the same
     // order to avoid deadlock.
+    //
+    // When one message goes into many mailboxes (a list delivered to
+    // two thousand local recipients, say), most mailboxes get the same
+    // number of messages. So the updates are grouped by that number,
+    // and we send one update for each group rather than each mailbox.
 
     if ( !d->lockUidnext ) {
         if ( d->mailboxes.isEmpty() ) {
@@ -1458,15 +2442,7 @@ void Injector::selectUids()
         uint uidnext = r->getInt( "uidnext" );
         int64 nextms = r->getBigint( "nextmodseq" );
 
-        if ( uidnext > 0x7ff00000 ) {
-            Log::Severity level = Log::Significant;
-            if ( uidnext > 0x7fffff00 )
-                level = Log::Error;
-            log( "Note: Mailbox " + mb->mailbox->name().ascii() +
-                 " only has " + fn ( 0x7fffffff - uidnext ) +
-                 " more usable UIDs. Please contact info@aox.org"
-                 " to resolve this problem.", level );
-        }
+        checkUidnext( mb->mailbox, uidnext );
 
         // Any messages in this mailbox are assigned consecutive uids
         // starting with uidnext, but all of them get the same modseq.
@@ -1497,38 +2473,80 @@ void Injector::selectUids()
             }
         }
 
-        // Update uidnext and nextmodseq based on what we did above.
+        // Remember to update uidnext and nextmodseq based on what we
+        // did above.
 
-        Query * u;
+        EString k = fn( n );
         if ( recentIn )
+            k.append( "r" );
+        InjectorData::UidnextUpdate * u = d->uidnextUpdates.find( k );
+        if ( !u ) {
+            u = new InjectorData::UidnextUpdate;
+            u->n = n;
+            u->recent = recentIn;
+            d->uidnextUpdates.insert( k, u );
+        }
+        u->mailboxes.add( mb->mailbox->id() );
+    }
+
+    if ( !d->lockUidnext->done() )
+        return;
+
+    Dict<InjectorData::UidnextUpdate>::Iterator ui( d->uidnextUpdates );
+    while ( ui ) {
+        Query * u;
+        if ( ui->recent )
             u = new Query( "update mailboxes "
                            "set uidnext=uidnext+$2,"
                            "nextmodseq=nextmodseq+1,"
                            "first_recent=first_recent+$2 "
-                           "where id=$1", 0 );
+                           "where id=any($1)", 0 );
         else
             u = new Query( "update mailboxes "
                            "set uidnext=uidnext+$2,nextmodseq=nextmodseq+1 "
-                           "where id=$1", 0 );
-        u->bind( 1, mb->mailbox->id() );
-        u->bind( 2, n );
+                           "where id=any($1)", 0 );
+        u->bind( 1, ui->mailboxes );
+        u->bind( 2, ui->n );
         d->transaction->enqueue( u );
+        ++ui;
     }
+    d->uidnextUpdates.clear();
 
-    if ( d->lockUidnext->done() )
-        next();
+    next();
 }
 
 
-/*! Injects messages into the correct tables. */
+/*! Logs a warning if \a uidnext, the next UID in \a mailbox, is
+    close to the largest possible UID.
+*/
 
-void Injector::insertMessages()
+void Injector::checkUidnext( Mailbox * mailbox, uint uidnext )
+{
+    if ( uidnext <= 0x7ff00000 )
+        return;
+
+    Log::Severity level = Log::Significant;
+    if ( uidnext > 0x7fffff00 )
+        level = Log::Error;
+    log( "Note: Mailbox " + mailbox->name().ascii() +
+         " only has " + fn ( 0x7fffffff - uidnext ) +
+         " more usable UIDs. Please contact info@aox.org"
+         " to resolve this problem.", level );
+}
+
+
+/*! Inserts the part numbers and header fields of each message, which
+    don't depend on the mailboxes they're injected into.
+*/
+
+void Injector::insertParts()
 {
     Query * qp =
         new Query( "copy part_numbers (message,part,bodypart,bytes,lines) "
                    "from stdin with binary", 0 );
     Query * qh =
-        new Query( "copy header_fields (message,part,position,field,value) "
+        new Query( "copy header_fields "
+                   "(message,part,position,field,value,value_id) "
                    "from stdin with binary", 0 );
     Query * qa =
         new Query( "copy address_fields "
@@ -1536,25 +2554,15 @@ void Injector::insertMessages()
                    "from stdin with binary", 0 );
     Query * qd =
         new Query( "copy date_fields (message,value) from stdin", 0 );
-
-    Query * qm =
-        new Query( "copy mailbox_messages "
-                   "(mailbox,uid,message,modseq,seen,deleted) "
-                   "from stdin with binary", 0 );
-    Query * qf =
-        new Query( "copy flags (mailbox,uid,flag) "
-                   "from stdin with binary", 0 );
-    Query * qn =
-        new Query( "copy annotations (mailbox,uid,name,value,owner) "
-                   "from stdin with binary", 0 );
     Query * qw =
         new Query( "copy unparsed_messages (bodypart) "
                    "from stdin with binary", 0 );
+    Query * qb =
+        new Query( "copy header_blobs (message,part,header) "
+                   "from stdin with binary", 0 );
 
-    uint flags = 0;
     uint wrapped = 0;
-    uint mailboxes = 0;
-    uint annotations = 0;
+    uint blobs = 0;
 
     List<Injectee>::Iterator it( d->messages );
     while ( it ) {
@@ -1566,7 +2574,8 @@ void Injector::insertMessages()
         // bodyparts table.
 
         addPartNumber( qp, mid, "" );
-        addHeader( qh, qa, qd, mid, "", m->header() );
+        if ( addHeader( qh, qa, qd, qb, mid, "", m->header() ) )
+            blobs++;
 
         // Since the MIME header fields belonging to the first-child of
         // a single-part Message are appended to the RFC 822 header, we
@@ -1592,17 +2601,19 @@ void Injector::insertMessages()
             EString pn( m->partNumber( b ) );
 
             addPartNumber( qp, mid, pn, b );
-            if ( !skip )
-                addHeader( qh, qa, qd, mid, pn, b->header() );
-            else
+            if ( skip )
                 skip = false;
+            else if ( addHeader( qh, qa, qd, qb, mid, pn, b->header() ) )
+                blobs++;
 
             // message/rfc822 bodyparts get a special part number too.
 
             if ( b->message() ) {
                 EString rpn( pn + ".rfc822" );
                 addPartNumber( qp, mid, rpn, b );
-                addHeader( qh, qa, qd, mid, rpn, b->message()->header() );
+                if ( addHeader( qh, qa, qd, qb, mid, rpn,
+                                b->message()->header() ) )
+                    blobs++;
             }
 
             // If the message we're injecting is a wrapper around a
@@ -1623,6 +2634,36 @@ void Injector::insertMessages()
         ++it;
     }
 
+    d->transaction->enqueue( qp );
+    d->transaction->enqueue( qh );
+    d->transaction->enqueue( qa );
+    d->transaction->enqueue( qd );
+    if ( wrapped )
+        d->transaction->enqueue( qw );
+    if ( blobs )
+        d->transaction->enqueue( qb );
+}
+
+
+/*! Injects messages into the mailbox-specific tables. */
+
+void Injector::insertMessages()
+{
+    Query * qm =
+        new Query( "copy mailbox_messages "
+                   "(mailbox,uid,message,modseq,seen,deleted,flagbits) "
+                   "from stdin with binary", 0 );
+    Query * qf =
+        new Query( "copy flags (mailbox,uid,flag) "
+                   "from stdin with binary", 0 );
+    Query * qn =
+        new Query( "copy annotations (mailbox,uid,name,value,owner) "
+                   "from stdin with binary", 0 );
+
+    uint flags = 0;
+    uint mailboxes = 0;
+    uint annotations = 0;
+
     List<Injectee>::Iterator imi( d->injectables );
     while ( imi ) {
         Injectee * m = imi;
@@ -1644,18 +2685,12 @@ void Injector::insertMessages()
         }
     }
 
-    d->transaction->enqueue( qp );
-    d->transaction->enqueue( qh );
-    d->transaction->enqueue( qa );
-    d->transaction->enqueue( qd );
     if ( mailboxes )
         d->transaction->enqueue( qm );
     if ( flags )
         d->transaction->enqueue( qf );
     if ( annotations )
         d->transaction->enqueue( qn );
-    if ( wrapped )
-        d->transaction->enqueue( qw );
 }
 
 
@@ -1690,12 +2725,17 @@ void Injector::addPartNumber( Query * q, uint mid, const EString &part,
 
 /*! Add each field from the header \a h (belonging to the given \a part
     of the message with id \a mid) to one of the queries \a qh, \a qa,
-    or \a qd, depending on their type.
+    \a qd or \a qb, depending on their type.
+
+    The fields HeaderField::isIndexed() rejects are collected into one
+    header_blobs row, which is added to \a qb. Returns true if such a
+    row was added, and false if all fields went to the other queries.
 */
 
-void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
-                          const EString & part, Header * h )
+bool Injector::addHeader( Query * qh, Query * qa, Query * qd, Query * qb,
+                          uint mid, const EString & part, Header * h )
 {
+    EString blob;
     List< HeaderField >::Iterator it( h->fields() );
     while ( it ) {
         HeaderField * hf = it;
@@ -1716,6 +2756,24 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
                 ++n;
             }
         }
+        else if ( !HeaderField::isIndexed( hf->name() ) ) {
+            blob.appendNumber( hf->position() );
+            blob.append( '\t' );
+            blob.append( hf->name() );
+            blob.append( '\t' );
+            EString v = hf->value().utf8();
+            uint i = 0;
+            while ( i < v.length() ) {
+                if ( v[i] == '\\' )
+                    blob.append( "\\\\" );
+                else if ( v[i] == '\n' )
+                    blob.append( "\\n" );
+                else
+                    blob.append( v[i] );
+                i++;
+            }
+            blob.append( '\n' );
+        }
         else {
             uint t = 0;
             if ( d->fieldNameCreator )
@@ -1727,7 +2785,15 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
             qh->bind( 2, part );
             qh->bind( 3, hf->position() );
             qh->bind( 4, t );
-            qh->bind( 5, hf->value() );
+            uint v = internedValueId( hf );
+            if ( v ) {
+                qh->bindNull( 5 );
+                qh->bind( 6, v );
+            }
+            else {
+                qh->bind( 5, hf->value() );
+                qh->bindNull( 6 );
+            }
             qh->submitLine();
 
             if ( part.isEmpty() && hf->type() == HeaderField::Date ) {
@@ -1740,6 +2806,15 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
 
         ++it;
     }
+
+    if ( blob.isEmpty() )
+        return false;
+
+    qb->bind( 1, mid );
+    qb->bind( 2, part );
+    qb->bind( 3, blob );
+    qb->submitLine();
+    return true;
 }
 
 
@@ -1759,22 +2834,31 @@ void Injector::addMailbox( Query * q, Injectee * m, Mailbox * mb )
     EStringList::Iterator i( m->flags( mb ) );
     bool seen = false;
     bool deleted = false;
+    int64 bits = 0;
     while ( i ) {
-        uint id = Flag::id( *i );
+        uint id = 0;
+        if ( d->flagCreator )
+            id = d->flagCreator->id( *i );
+        if ( !id )
+            id = Flag::id( *i );
         ++i;
         if ( Flag::isSeen( id ) )
             seen = true;
         else if ( Flag::isDeleted( id ) )
             deleted = true;
+        else
+            bits |= Flag::bit( id );
     }
     q->bind( 5, seen );
     q->bind( 6, deleted );
+    q->bind( 7, bits );
     q->submitLine();
 }
 
 
 /*! Adds flags rows for the message \a m in mailbox \a mb to the query
-    \a q, and returns the number of flags (which may be 0). */
+    \a q, and returns the number of flags (which may be 0). Flags
+    stored in mailbox_messages are left to addMailbox(). */
 
 uint Injector::addFlags( Query * q, Injectee * m, Mailbox * mb )
 {
@@ -1786,7 +2870,8 @@ uint Injector::addFlags( Query * q, Injectee * m, Mailbox * mb )
             flag = d->flagCreator->id( *it );
         if ( !flag )
             flag = Flag::id( *it );
-        if ( !Flag::isSeen( flag ) && !Flag::isDeleted( flag ) ) {
+        if ( !Flag::isSeen( flag ) && !Flag::isDeleted( flag ) &&
+             !Flag::bit( flag ) ) {
             n++;
             q->bind( 1, mb->id() );
             q->bind( 2, m->uid( mb ) );
@@ -2022,19 +3107,31 @@ public:
     };
 
     List<Mailbox> mailboxes;
+    Map<Mailbox> byId;
 
     Mailbox * mailbox( ::Mailbox * mb, bool create = false ) {
         if ( mailboxes.firstElement() &&
              mailboxes.firstElement()->mailbox == mb )
             return mailboxes.firstElement();
+        // a message delivered to many mailboxes would make the list
+        // walk quadratic, so we look up by id when we can. ids of new
+        // mailboxes change, so the list is still the authority.
+        if ( mb && mb->id() ) {
+            Mailbox * m = byId.find( mb->id() );
+            if ( m && m->mailbox == mb )
+                return m;
+        }
         List<Mailbox>::Iterator i( mailboxes );
         while ( i && i->mailbox != mb )
             ++i;
-        if ( i || !create )
-            return i;
-        Mailbox * n = new Mailbox;
-        n->mailbox = mb;
-        mailboxes.append( n );
+        Mailbox * n = i;
+        if ( !n && create ) {
+            n = new Mailbox;
+            n->mailbox = mb;
+            mailboxes.append( n );
+        }
+        if ( n && mb && mb->id() )
+            byId.insert( mb->id(), n );
         return n;
     }
 };
@@ -6,6 +6,7 @@
 #include "message.h"
 #include "event.h"
 #include "list.h"
+#include "query.h"
 
 class Query;
 class Header;
@@ -57,15 +58,23 @@ public:
     bool failed() const;
     EString error() const;
 
+    void notifyWhenCommitting();
+    bool committing() const;
+
     void addInjection( List<Injectee> * );
     void addDelivery( Injectee *, Address *, List<Address> *,
                       class Date * = 0 );
 
     void setTransaction( class Transaction * );
+    void setPriority( Query::Priority );
 
     void addAddress( Address * );
     uint addressId( Address * );
 
+    static uint stages();
+    static EString stageName( uint );
+    static int64 stageTime( uint );
+
 private:
     class InjectorData * d;
 
@@ -74,20 +83,36 @@ private:
     void findMessages();
     void findDependencies();
     void updateAddresses( List<Address> * );
+    void addInternedValue( class HeaderField * );
+    uint internedValueId( class HeaderField * );
     void createDependencies();
     void convertInReplyTo();
     void addMoreReferences();
     void convertThreadIndex();
+    void convertSubjects();
     void insertThreadIndexes();
     void insertThreadRoots();
+    bool canUseFunction() const;
+    void injectViaFunction();
     void insertBodyparts();
-    void addBodypartRow( Bodypart * );
+    bool hashBodyparts();
+    void hashBodypart( Bodypart * );
+    void addStoredBodypart( Bodypart * );
+    Query * copyBodyparts();
+    void recordBodyparts();
+    void addBodypartRow( Bodypart *, EString *, EString *, const EString & );
     void selectMessageIds();
+    void insertMessageRows();
     void selectUids();
+    void checkUidnext( Mailbox *, uint );
+    void insertParts();
+    void insertRawTexts();
+    void insertPreviews();
     void insertMessages();
     void insertDeliveries();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
-    void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
+    bool addHeader( Query *, Query *, Query *, Query *,
+                    uint, const EString &, Header * );
     void addMailbox( Query *, Injectee *, Mailbox * );
     uint addFlags( Query *, Injectee *, Mailbox * );
     uint addAnnotations( Query *, Injectee *, Mailbox * );
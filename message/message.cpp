@@ -6,11 +6,13 @@
 #include "address.h"
 #include "bodypart.h"
 #include "mimefields.h"
+#include "html.h"
 #include "configuration.h"
 #include "annotation.h"
 #include "allocator.h"
 #include "entropy.h"
 #include "codec.h"
+#include "utf.h"
 #include "date.h"
 #include "dict.h"
 #include "flag.h"
@@ -28,7 +30,8 @@ public:
         : databaseId( 0 ), threadId( 0 ),
           wrapped( false ), rfc822Size( 0 ), internalDate( 0 ),
           hasHeaders( false ), hasAddresses( false ), hasBodies( false ),
-          hasTrivia( false ), hasBytesAndLines( false ), hasPGPsignedPart( false )
+          hasTrivia( false ), hasBytesAndLines( false ), hasPGPsignedPart( false ),
+          hasRawText( false )
     {}
 
     EString error;
@@ -46,7 +49,9 @@ public:
     bool hasTrivia : 1;
     bool hasBytesAndLines : 1;
     bool hasPGPsignedPart : 1;
+    bool hasRawText : 1;
     EString rawSignedMessageBody;
+    EString rawText;
 };
 
 
@@ -292,10 +297,17 @@ EString Message::error() const
 
     If \a avoidUtf8 is true, this function loses information rather
     than including UTF-8 in the result.
+
+    If the stored rawText() is known, this returns that without looking
+    at the header or bodies. The Injector stores it only when \a
+    avoidUtf8 makes no difference.
 */
 
 EString Message::rfc822( bool avoidUtf8 ) const
 {
+    if ( !d->rawText.isEmpty() )
+        return d->rawText;
+
     EString r;
     if ( d->rfc822Size )
         r.reserve( d->rfc822Size );
@@ -567,6 +579,116 @@ void Message::setTriviaFetched( bool ok )
 }
 
 
+/*! Returns true if the raw text of this message has been looked up
+    in the database, whether or not any was stored, and false if not.
+*/
+
+bool Message::hasRawText() const
+{
+    return d->hasRawText;
+}
+
+
+/*! Records that the raw text of this message has been looked up. */
+
+void Message::setRawTextFetched()
+{
+    d->hasRawText = true;
+}
+
+
+/*! Records that \a text is this message's raw RFC 822 form, as stored
+    when the message was injected. rfc822() returns \a text after
+    this.
+*/
+
+void Message::setRawText( const EString & text )
+{
+    d->rawText = text;
+}
+
+
+/*! Returns the raw text set with setRawText(), or an empty string if
+    none has been set.
+*/
+
+EString Message::rawText() const
+{
+    return d->rawText;
+}
+
+
+/*! Returns a short plain-text preview of this message, as described
+    in RFC 8970, or an empty string if the message has no text.
+
+    The preview is made from the first text/plain part that isn't an
+    attachment, or failing that from the first such text/html part.
+    The message must have its headers and bodies.
+*/
+
+UString Message::preview() const
+{
+    Bodypart * plain = 0;
+    Bodypart * html = 0;
+    List<Bodypart>::Iterator b( allBodyparts() );
+    while ( b && !plain ) {
+        ContentType * ct = b->contentType();
+        ContentDisposition * cd = 0;
+        if ( b->header() )
+            cd = b->header()->contentDisposition();
+        if ( b->children()->isEmpty() && !b->message() &&
+             ( !cd || cd->disposition() != ContentDisposition::Attachment ) ) {
+            if ( !ct || ( ct->type() == "text" && ct->subtype() == "plain" ) )
+                plain = b;
+            else if ( !html && ct->type() == "text" &&
+                      ct->subtype() == "html" )
+                html = b;
+        }
+        ++b;
+    }
+
+    if ( plain )
+        return preview( plain->text() );
+    if ( html ) {
+        // 16k of text is much more than preview() needs, even if the
+        // start of it is quoted.
+        Utf8Codec c;
+        return preview( c.toUnicode( HTML::asText( html->utf8Text(),
+                                                   16384 ) ) );
+    }
+    return UString();
+}
+
+
+/*! Returns a preview of \a text: At most 256 characters, with quoted
+    lines and the signature removed and all white space simplified.
+*/
+
+UString Message::preview( const UString & text )
+{
+    UString r;
+    uint i = 0;
+    while ( i < text.length() && r.length() < 256 ) {
+        uint e = i;
+        while ( e < text.length() && text[e] != '\n' )
+            e++;
+        UString line = text.mid( i, e - i );
+        i = e + 1;
+        if ( line == "-- " || line == "-- \r" )
+            break;
+        line = line.simplified();
+        if ( line.isEmpty() || line[0] == '>' )
+            continue;
+        if ( !r.isEmpty() )
+            r.append( ' ' );
+        r.append( line );
+    }
+    if ( r.length() > 256 )
+        r.truncate( 256 );
+    return r;
+}
+
+
 /*! Tries to remove the prefixes and suffixes used by MUAs from \a subject
     to find a base subject that can be used to tie threads together
     linearly.
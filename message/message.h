@@ -60,6 +60,10 @@ public:
     void setBodiesFetched();
     bool hasBytesAndLines() const;
     void setBytesAndLinesFetched();
+    bool hasRawText() const;
+    void setRawTextFetched();
+    void setRawText( const EString & );
+    EString rawText() const;
     bool hasPGPsignedPart() const;
     void setPGPsignedPart( bool );
 
@@ -67,6 +71,9 @@ public:
 
     static UString baseSubject( const UString & );
 
+    UString preview() const;
+    static UString preview( const UString & );
+
     static EString acceptableBoundary( const EString & );
 
     void addMessageId( const EString & );
@@ -5,20 +5,25 @@
 #include "message.h"
 #include "mailbox.h"
 #include "server.h"
-#include "map.h"
+#include "graph.h"
+#include "hashmap.h"
 
 #include <time.h> // time(0)
 
 
 static class MessageCache * c = 0;
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
 
 
 class MessageCacheData
     : public Garbage
 {
 public:
-    MessageCacheData(): Garbage() {}
-    Map<Map<Message> > m;
+    MessageCacheData()
+        : Garbage(), m( new HashMap<HashMap<Message> > ), old( 0 ) {}
+    HashMap<HashMap<Message> > * m;
+    HashMap<HashMap<Message> > * old;
 };
 
 
@@ -28,6 +33,13 @@ public:
   to clear out old Garbage. As a special feature, it can also cache
   messages a few seconds longer, although that should be used
   sparingly.
+
+  The cache has two generations. age() makes the current generation
+  old and discards the previous old one, and find() moves messages it
+  finds in the old generation back into the current one. A message
+  thus stays cached for as long as it's used at least once between
+  garbage collections. Hits and misses are reported as
+  message-cache-hits and message-cache-misses.
 */
 
 
@@ -51,12 +63,15 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
 {
     if ( !Server::useCache() )
         return;
-    if ( !c )
+    if ( !c ) {
         c = new MessageCache;
-    Map<Message> * mbcache = c->d->m.find( mb->id() );
+        ::hits = new GraphableCounter( "message-cache-hits" );
+        ::misses = new GraphableCounter( "message-cache-misses" );
+    }
+    HashMap<Message> * mbcache = c->d->m->find( mb->id() );
     if ( !mbcache ) {
-        mbcache = new Map<Message>;
-        c->d->m.insert( mb->id(), mbcache );
+        mbcache = new HashMap<Message>;
+        c->d->m->insert( mb->id(), mbcache );
     }
     mbcache->insert( uid, m );
 }
@@ -70,16 +85,40 @@ class Message * MessageCache::find( class Mailbox * mailbox, uint uid )
 {
     if ( !c )
         return 0;
-    Map<Message> * mbcache = c->d->m.find( mailbox->id() );
+    Message * m = 0;
+    HashMap<Message> * mbcache = c->d->m->find( mailbox->id() );
     if ( mbcache )
-        return mbcache->find( uid );
-    return 0;
+        m = mbcache->find( uid );
+    if ( !m && c->d->old ) {
+        mbcache = c->d->old->find( mailbox->id() );
+        if ( mbcache )
+            m = mbcache->find( uid );
+        if ( m )
+            insert( mailbox, uid, m );
+    }
+    if ( m )
+        ::hits->tick();
+    else
+        ::misses->tick();
+    return m;
 }
 
 
 void MessageCache::clear()
 {
-    d->m.clear();
+    d->m = new HashMap<HashMap<Message> >;
+    d->old = 0;
+}
+
+
+/*! Discards the messages that haven't been used since the last call,
+    and keeps the rest for one more round.
+*/
+
+void MessageCache::age()
+{
+    d->old = d->m;
+    d->m = new HashMap<HashMap<Message> >;
 }
 
 
@@ -18,6 +18,7 @@ public:
     static class Message * provide( class Mailbox *, uint );
 
     void clear();
+    void age();
 
 private:
     class MessageCacheData * d;
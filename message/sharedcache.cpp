@@ -0,0 +1,162 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sharedcache.h"
+
+#include "configuration.h"
+#include "estring.h"
+#include "graph.h"
+#include "log.h"
+
+// mmap
+#include <sys/mman.h>
+// memcpy
+#include <string.h>
+
+
+// every entry occupies one slot of this size, including the header
+static const uint slotSize = 32768;
+
+
+struct SharedCacheSlot
+{
+    // odd while a process writes the slot, bumped after each write
+    volatile uint sequence;
+    uint kind;
+    uint id;
+    uint length;
+    char data[slotSize - 4 * sizeof( uint )];
+};
+
+
+static SharedCacheSlot * slots;
+static uint numSlots;
+static GraphableCounter * hits;
+static GraphableCounter * misses;
+
+
+/*! \class SharedCache sharedcache.h
+    The SharedCache class keeps serialised message data in memory
+    shared by all the server processes.
+
+    MessageCache belongs to one process, so when server-processes is
+    greater than one, each process fetches and parses the same messages
+    on its own, and a client that reconnects to another process starts
+    cold. SharedCache keeps what the database would send for a message
+    (its raw text and its ENVELOPE/BODY/BODYSTRUCTURE summary), keyed by
+    the message's database ID, in a segment created by setup() before
+    the processes are forked.
+
+    The segment is a simple direct-mapped table of fixed-size slots.
+    An insert() replaces whatever occupied the slot, and data too large
+    for a slot isn't cached. Each slot has a sequence number which a
+    writer makes odd while it writes, so that find() can detect and
+    ignore a slot that changed while it was being read. Since every
+    process is single-threaded, no locks are needed.
+
+    The segment isn't shared between hosts. Hits and misses are
+    reported as shared-cache-hits and shared-cache-misses.
+*/
+
+
+/*! Creates the shared segment, if shared-cache-size is nonzero. This
+    must be called before the server forks its worker processes.
+*/
+
+void SharedCache::setup()
+{
+    uint mb = Configuration::scalar( Configuration::SharedCacheSize );
+    if ( !mb || slots )
+        return;
+
+    uint n = mb * 1024 * 1024 / slotSize;
+    void * p = ::mmap( 0, n * slotSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANON, -1, 0 );
+    if ( p == MAP_FAILED ) {
+        ::log( "Cannot allocate " + fn( mb ) + "MB of shared cache",
+               Log::Error );
+        return;
+    }
+    // anonymous mappings are zeroed, so every slot starts out empty
+    slots = (SharedCacheSlot *)p;
+    numSlots = n;
+}
+
+
+/*! Returns true if setup() has created the shared segment, and false
+    if not.
+*/
+
+bool SharedCache::enabled()
+{
+    return slots != 0;
+}
+
+
+static SharedCacheSlot * slotFor( SharedCache::Kind kind, uint id )
+{
+    return slots + ( ( id * 2654435761u + kind ) % numSlots );
+}
+
+
+/*! Returns the data of \a kind cached for the message with database
+    ID \a id, or an empty string if there is none.
+*/
+
+EString SharedCache::find( Kind kind, uint id )
+{
+    EString r;
+    if ( !slots || !id )
+        return r;
+    if ( !::hits ) {
+        ::hits = new GraphableCounter( "shared-cache-hits" );
+        ::misses = new GraphableCounter( "shared-cache-misses" );
+    }
+
+    SharedCacheSlot * s = slotFor( kind, id );
+    uint sequence = s->sequence;
+    __sync_synchronize();
+    if ( !( sequence & 1 ) && s->kind == (uint)kind && s->id == id &&
+         s->length <= sizeof( s->data ) ) {
+        r.append( s->data, s->length );
+        __sync_synchronize();
+        if ( s->sequence != sequence )
+            r.truncate();
+    }
+
+    if ( r.isEmpty() )
+        ::misses->tick();
+    else
+        ::hits->tick();
+    return r;
+}
+
+
+/*! Stores \a data as the \a kind of data for the message with
+    database ID \a id, replacing whatever was in its slot. Does nothing
+    if \a data is too large or another process is writing the same
+    slot.
+*/
+
+void SharedCache::insert( Kind kind, uint id, const EString & data )
+{
+    if ( !slots || !id || data.isEmpty() )
+        return;
+
+    SharedCacheSlot * s = slotFor( kind, id );
+    if ( data.length() > sizeof( s->data ) )
+        return;
+
+    uint sequence = s->sequence;
+    if ( ( sequence & 1 ) ||
+         !__sync_bool_compare_and_swap( &s->sequence,
+                                        sequence, sequence + 1 ) )
+        return;
+
+    s->kind = kind;
+    s->id = id;
+    s->length = data.length();
+    memcpy( s->data, data.data(), data.length() );
+
+    __sync_synchronize();
+    s->sequence = sequence + 2;
+}
@@ -0,0 +1,25 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SHAREDCACHE_H
+#define SHAREDCACHE_H
+
+#include "global.h"
+
+class EString;
+
+
+class SharedCache
+    : public Garbage
+{
+public:
+    enum Kind { RawText = 1, Summary = 2 };
+
+    static void setup();
+    static bool enabled();
+
+    static EString find( Kind, uint );
+    static void insert( Kind, uint, const EString & );
+};
+
+
+#endif
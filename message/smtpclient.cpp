@@ -14,6 +14,7 @@
 #include "address.h"
 #include "message.h"
 #include "ustring.h"
+#include "allocator.h"
 // time
 #include <time.h>
 
@@ -28,7 +29,9 @@ public:
           wbt( 0 ), wbs( 0 ),
           enhancedstatuscodes( false ),
           unicode( false ),
-          size( false )
+          size( false ), pipelining( false ),
+          pipelined( 0 ), skip( 0 ),
+          closeTimer( 0 )
     {}
 
     enum State { Invalid,
@@ -52,6 +55,9 @@ public:
     bool enhancedstatuscodes;
     bool unicode;
     bool size;
+    bool pipelining;
+    uint pipelined;
+    uint skip;
     Timer * closeTimer;
     class TimerCloser
         : public EventHandler
@@ -72,8 +78,15 @@ public:
 
     Archiveopteryx uses it to send outgoing messages to a smarthost.
 
+    Idle clients are kept in a pool of up to smarthost-connections
+    clients, so that provide() can reuse a connection at once rather
+    than connect anew. If the server supports PIPELINING (RFC 2920),
+    the client sends MAIL FROM and all the RCPT TO commands at once.
 */
 
+
+static List<SmtpClient> * idle = 0;
+
 /*! Constructs an SMTP client which will immediately connect to \a
     address and introduce itself, and then wait politely for something
     to do.
@@ -145,6 +158,8 @@ void SmtpClient::react( Event e )
 
     case Error:
     case Close:
+        if ( ::idle )
+            ::idle->remove( this );
         if ( state() == Connecting ) {
             d->error = "Connection refused by SMTP/LMTP server";
             finish( "4.4.1" );
@@ -192,6 +207,11 @@ void SmtpClient::parse()
                 recordExtension( *s );
             }
         }
+        else if ( (*s)[3] == ' ' && d->skip ) {
+            // a response to a pipelined command sent after one that
+            // failed; we've moved on already.
+            d->skip--;
+        }
         else if ( (*s)[3] == ' ' ) {
             switch ( response/100 ) {
             case 1:
@@ -289,6 +309,20 @@ void SmtpClient::sendCommand()
             send.append( " size=" );
             send.append( fn( d->dotted.length() ) );
         }
+        d->pipelined = 0;
+        if ( d->pipelining ) {
+            // we send all the RCPT TO commands now, and then match
+            // the responses to the recipients in the same order.
+            List<Recipient>::Iterator i( d->dsn->recipients() );
+            while ( i ) {
+                if ( i->action() == Recipient::Unknown ) {
+                    send.append( "\r\nrcpt to:<" +
+                                 i->finalRecipient()->lpdomain() + ">" );
+                    d->pipelined++;
+                }
+                ++i;
+            }
+        }
 
         d->state = SmtpClientData::MailFrom;
         break;
@@ -305,7 +339,11 @@ void SmtpClient::sendCommand()
         while ( d->rcptTo && d->rcptTo->action() != Recipient::Unknown )
             ++d->rcptTo;
         if ( d->rcptTo ) {
-            send = "rcpt to:<" + d->rcptTo->finalRecipient()->lpdomain() + ">";
+            if ( d->pipelined )
+                d->pipelined--;
+            else
+                send = "rcpt to:<" +
+                       d->rcptTo->finalRecipient()->lpdomain() + ">";
         }
         else {
             if ( !d->accepted.isEmpty() ) {
@@ -341,10 +379,19 @@ void SmtpClient::sendCommand()
     case SmtpClientData::Rset:
         finish( "4.5.0" );
         delete d->closeTimer;
-        if ( idleClient() == this )
+        if ( !::idle ) {
+            ::idle = new List<SmtpClient>;
+            Allocator::addEternal( ::idle, "idle smtp clients" );
+        }
+        if ( ::idle->count() <
+             Configuration::scalar( Configuration::SmartHostConnections ) ) {
+            ::idle->remove( this );
+            ::idle->append( this );
             d->closeTimer = new Timer( d->timerCloser, 298 );
-        else
+        }
+        else {
             d->closeTimer = new Timer( d->timerCloser, 15 );
+        }
         return;
 
     case SmtpClientData::Error:
@@ -520,6 +567,8 @@ void SmtpClient::handleFailure( const EString & line )
             d->rcptTo->setAction( Recipient::Delayed, status );
     }
     else {
+        d->skip = d->pipelined;
+        d->pipelined = 0;
         List<Recipient>::Iterator i;
         if ( d->dsn )
             i = d->dsn->recipients();
@@ -590,6 +639,8 @@ void SmtpClient::send( DSN * dsn, EventHandler * user )
     d->sentMail = false;
     delete d->closeTimer;
     d->closeTimer = 0;
+    if ( ::idle )
+        ::idle->remove( this );
     if ( d->state == SmtpClientData::Rset )
         d->state = SmtpClientData::Hello;
     sendCommand();
@@ -640,6 +691,9 @@ void SmtpClient::recordExtension( const EString & line )
     else if ( w == "smtputf8" ) {
         d->unicode = true;
     }
+    else if ( w == "pipelining" ) {
+        d->pipelining = true;
+    }
     else if ( w == "size" ) {
         d->size = true;
         ::observedSize = l.section( " ", 2 ).number( 0 );
@@ -664,6 +718,8 @@ void SmtpClient::logout( uint t )
     Scope x( log() );
     if ( d->log )
         x.setLog( d->log );
+    if ( ::idle )
+        ::idle->remove( this );
     d->state = SmtpClientData::Quit;
     log( "Sending: quit", Log::Debug );
     enqueue( "quit\r\n" );
@@ -720,21 +776,20 @@ DSN * SmtpClient::sending() const
 }
 
 
-/*! This private helper returns a pointer to an idle SMTP client, or a
-    null pointer if none are idle.
+/*! This private helper returns a pointer to an idle SMTP client from
+    the pool, or a null pointer if none are idle. The most recently
+    used client is returned first, so that surplus clients time out.
 */
 
 SmtpClient * SmtpClient::idleClient()
 {
-    List<Connection>::Iterator c( EventLoop::global()->connections() );
-    while ( c ) {
-        if ( c->type() == Connection::SmtpClient ) {
-            Connection * tmp = c;
-            SmtpClient * sc = (SmtpClient*)tmp;
-            if ( sc->d->state == SmtpClientData::Rset )
-                return sc;
-        }
-        ++c;
+    if ( !::idle )
+        return 0;
+    while ( !::idle->isEmpty() ) {
+        SmtpClient * c = ::idle->pop();
+        if ( c->d->state == SmtpClientData::Rset &&
+             c->Connection::state() == Connected )
+            return c;
     }
     return 0;
 }
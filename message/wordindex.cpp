@@ -0,0 +1,71 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "wordindex.h"
+
+#include "configuration.h"
+#include "ustringlist.h"
+#include "ustring.h"
+#include "dict.h"
+
+
+// words shorter or longer than this aren't indexed
+static const uint minimumLength = 2;
+static const uint maximumLength = 64;
+
+
+/*! \class WordIndex wordindex.h
+    The WordIndex class knows how text is split into words for the
+    bodypart_words table.
+
+    If use-word-index is set, the Injector stores the distinct words()
+    of each new text bodypart in bodypart_words, and Selector uses
+    that table to find candidates for BODY and TEXT searches before
+    checking them with ilike. This works without tsearch and with any
+    PostgreSQL configuration.
+
+    A word is a run of letters and digits, titlecased. Words shorter
+    than two or longer than 64 characters aren't stored, so a search
+    for a word like that has to do without the index.
+
+    As with tsearch, a search string matches only whole words. "aox
+    index words" adds the words of bodyparts injected before the
+    index was enabled.
+*/
+
+
+/*! Returns true if use-word-index is set. */
+
+bool WordIndex::enabled()
+{
+    return Configuration::toggle( Configuration::UseWordIndex );
+}
+
+
+/*! Returns the distinct indexable words in \a text, in the order they
+    first occur.
+*/
+
+UStringList * WordIndex::words( const UString & text )
+{
+    UStringList * l = new UStringList;
+    UDict<UString> seen;
+    uint i = 0;
+    while ( i < text.length() ) {
+        while ( i < text.length() &&
+                !UString::isLetter( text[i] ) && !UString::isDigit( text[i] ) )
+            i++;
+        uint s = i;
+        while ( i < text.length() &&
+                ( UString::isLetter( text[i] ) || UString::isDigit( text[i] ) ) )
+            i++;
+        if ( i - s >= minimumLength && i - s <= maximumLength ) {
+            UString * w = new UString( text.mid( s, i - s ).titlecased() );
+            if ( !seen.contains( *w ) ) {
+                seen.insert( *w, w );
+                l->append( w );
+            }
+        }
+    }
+    return l;
+}
+
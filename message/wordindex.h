@@ -0,0 +1,23 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef WORDINDEX_H
+#define WORDINDEX_H
+
+#include "global.h"
+
+
+class UString;
+class UStringList;
+
+
+class WordIndex
+    : public Garbage
+{
+public:
+    static bool enabled();
+
+    static UStringList * words( const UString & );
+};
+
+
+#endif
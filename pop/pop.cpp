@@ -3,7 +3,6 @@
 #include "pop.h"
 
 #include "log.h"
-#include "map.h"
 #include "user.h"
 #include "event.h"
 #include "query.h"
@@ -13,6 +12,7 @@
 #include "buffer.h"
 #include "mailbox.h"
 #include "message.h"
+#include "messagecache.h"
 #include "session.h"
 #include "selector.h"
 #include "eventloop.h"
@@ -29,7 +29,8 @@ public:
     PopData()
         : state( POP::Authorization ), sawUser( false ),
           commands( new List< PopCommand > ), reader( 0 ),
-          reserved( false ), messages( 0 )
+          reserved( false ),
+          maildropSize( 0 ), uids( 0 ), ids( 0 ), sizes( 0 )
     {}
 
     POP::State state;
@@ -40,7 +41,12 @@ public:
     PopCommand * reader;
     bool reserved;
     IntegerSet toBeDeleted;
-    Map<Message> * messages;
+
+    uint maildropSize;
+    uint * uids;
+    uint * ids;
+    uint * sizes;
+
     EString challenge;
 };
 
@@ -487,13 +493,58 @@ void POP::badUser()
 
 /*! Returns a pointer to the Message object with UID \a uid, or 0 if
     there isn't any.
+
+    The maildrop doesn't keep Message objects; this provides one (via
+    MessageCache) that knows its database ID and size, and the caller
+    has to fetch whatever else it needs.
 */
 
 class Message * POP::message( uint uid )
 {
-    if ( !d->messages )
+    int i = maildropIndex( uid );
+    if ( i < 0 )
+        return 0;
+
+    Message * m = MessageCache::provide( session()->mailbox(), uid );
+    if ( !m->databaseId() )
+        m->setDatabaseId( d->ids[i] );
+    if ( !m->rfc822Size() )
+        m->setRfc822Size( d->sizes[i] );
+    return m;
+}
+
+
+/*! Returns the RFC 822 size of the message with UID \a uid, or 0 if
+    there isn't any such message in the maildrop.
+*/
+
+uint POP::messageSize( uint uid ) const
+{
+    int i = maildropIndex( uid );
+    if ( i < 0 )
         return 0;
-    return d->messages->find( uid );
+    return d->sizes[i];
+}
+
+
+/*! This private helper returns the index of \a uid in the maildrop,
+    or -1 if it isn't there.
+*/
+
+int POP::maildropIndex( uint uid ) const
+{
+    uint b = 0;
+    uint e = d->maildropSize;
+    while ( b < e ) {
+        uint m = ( b + e ) / 2;
+        if ( d->uids[m] < uid )
+            b = m + 1;
+        else
+            e = m;
+    }
+    if ( b < d->maildropSize && d->uids[b] == uid )
+        return b;
+    return -1;
 }
 
 
@@ -503,14 +554,18 @@ void POP::sendChallenge( const EString &s )
 }
 
 
-/*! Records the Message objects needed for this Pop session. Each of
-    the Message objects is presumed to know its database ID, and may
-    know more. \a m is a map from UID to Message objects.
+/*! Records the maildrop for this POP session: \a n messages, whose
+    UIDs, database IDs and RFC 822 sizes are in the arrays \a uids,
+    \a ids and \a sizes. \a uids must be sorted. This is all POP keeps
+    about each message; message() provides the rest when needed.
 */
 
-void POP::setMessageMap( Map<Message> * m )
+void POP::setMaildrop( uint n, uint * uids, uint * ids, uint * sizes )
 {
-    d->messages = m;
+    d->maildropSize = n;
+    d->uids = uids;
+    d->ids = ids;
+    d->sizes = sizes;
 }
 
 
@@ -5,7 +5,6 @@
 
 #include "saslconnection.h"
 
-#include "map.h"
 
 class User;
 class EString;
@@ -26,6 +25,7 @@ public:
     virtual void setUser( User *, const EString & );
 
     class Message * message( uint );
+    uint messageSize( uint ) const;
 
     void parse();
     void react( Event );
@@ -40,7 +40,7 @@ public:
     void setReader( class PopCommand * );
 
     void markForDeletion( uint );
-    void setMessageMap( Map<Message> * );
+    void setMaildrop( uint, uint *, uint *, uint * );
 
     void badUser();
 
@@ -50,6 +50,8 @@ public:
 
 private:
     class PopData *d;
+
+    int maildropIndex( uint ) const;
 };
 
 
@@ -3,10 +3,10 @@
 #include "popcommand.h"
 
 #include "md5.h"
-#include "map.h"
 #include "utf.h"
 #include "list.h"
 #include "user.h"
+#include "graph.h"
 #include "plain.h"
 #include "query.h"
 #include "buffer.h"
@@ -15,9 +15,12 @@
 #include "session.h"
 #include "mailbox.h"
 #include "mechanism.h"
+#include "allocator.h"
 #include "estringlist.h"
 #include "permissions.h"
-#include "messagecache.h"
+#include "configuration.h"
+
+#include <sys/time.h> // gettimeofday, struct timeval
 
 
 class PopCommandData
@@ -28,9 +31,11 @@ public:
         : pop( 0 ), args( 0 ), done( false ),
           m( 0 ), r( 0 ),
           user( 0 ), mailbox( 0 ), permissions( 0 ),
-          session( 0 ), sentFetch( false ), started( false ),
-          message( 0 ), n( 0 ), findIds( 0 ), map( 0 )
-    {}
+          session( 0 ), started( false ),
+          message( 0 ), n( 0 ), maildrop( 0 )
+    {
+        (void)::gettimeofday( &received, 0 );
+    }
 
     POP * pop;
     PopCommand::Command cmd;
@@ -45,13 +50,13 @@ public:
     Permissions * permissions;
     Session * session;
     IntegerSet set;
-    bool sentFetch;
     bool started;
     Message * message;
     int n;
 
-    Query * findIds;
-    Map<Message> * map;
+    Query * maildrop;
+
+    struct timeval received;
 
     class PopSession
         : public Session
@@ -95,6 +100,23 @@ PopCommand::PopCommand( POP * pop, Command cmd, EStringList * args )
 
 void PopCommand::finish()
 {
+    static const char * names[] = {
+        "quit", "capa", "noop", "stls", "auth", "user", "pass", "apop",
+        "stat", "list", "retr", "dele", "rset", "top", "uidl",
+        "session"
+    };
+
+    struct timeval end;
+    (void)::gettimeofday( &end, 0 );
+    uint total = ( ( end.tv_sec - d->received.tv_sec ) * 1000000 +
+                   ( end.tv_usec - d->received.tv_usec ) + 499 ) / 1000;
+    GraphableDataSet::named( EString( "pop-" ) + names[d->cmd] + "-ms" )
+        ->addNumber( total );
+    uint slow = Configuration::scalar( Configuration::SlowCommandTime );
+    if ( slow && total >= slow )
+        log( EString( "Slow command: " ) + names[d->cmd] + " took " +
+             fn( total ) + "ms", Log::Significant );
+
     d->done = true;
     d->pop->runCommands();
 }
@@ -446,75 +468,49 @@ bool PopCommand::session()
     if ( !d->session->initialised() )
         return false;
 
-    if ( !d->map ) {
+    // we load the whole maildrop in one query, and keep only the
+    // uid, message id and size of each message.
+
+    if ( !d->maildrop ) {
         d->session->clearUnannounced();
-        IntegerSet s( d->session->messages() );
-        IntegerSet r;
-        d->map = new Map<Message>;
-        while ( !s.isEmpty() ) {
-            uint uid = s.smallest();
-            s.remove( uid );
-            Message * m = MessageCache::provide( d->mailbox, uid );
-            if ( !m->databaseId() )
-                r.add( uid );
-            d->map->insert( uid, m );
-        }
-        if ( !r.isEmpty() ) {
-            d->findIds = new Query( "select message, uid "
-                                    "from mailbox_messages "
-                                    "where mailbox=$1 and uid=any($2)",
-                                    this );
-            d->findIds->bind( 1, d->mailbox->id() );
-            d->findIds->bind( 2, r );
-            d->findIds->execute();
-        }
-    }
-    if ( d->findIds && !d->findIds->done() )
+        d->maildrop = new Query( "select mm.uid, mm.message, m.rfc822size "
+                                 "from mailbox_messages mm "
+                                 "join messages m on (mm.message=m.id) "
+                                 "where mm.mailbox=$1 and mm.uid=any($2) "
+                                 "order by mm.uid", this );
+        d->maildrop->bind( 1, d->mailbox->id() );
+        d->maildrop->bind( 2, d->session->messages() );
+        d->maildrop->execute();
+    }
+    if ( !d->maildrop->done() )
         return false;
-    while ( d->findIds && d->findIds->hasResults() ) {
-        Row * r = d->findIds->nextRow();
-        Message * m = d->map->find( r->getInt( "uid" ) );
-        if ( m )
-            m->setDatabaseId( r->getInt( "message" ) );
+
+    uint n = d->maildrop->rows();
+    uint * uids = 0;
+    uint * ids = 0;
+    uint * sizes = 0;
+    if ( n ) {
+        uids = (uint*)Allocator::alloc( n * sizeof( uint ), 0 );
+        ids = (uint*)Allocator::alloc( n * sizeof( uint ), 0 );
+        sizes = (uint*)Allocator::alloc( n * sizeof( uint ), 0 );
+    }
+    uint i = 0;
+    while ( i < n && d->maildrop->hasResults() ) {
+        Row * r = d->maildrop->nextRow();
+        uids[i] = r->getInt( "uid" );
+        ids[i] = r->getInt( "message" );
+        sizes[i] = r->getInt( "rfc822size" );
+        i++;
     }
 
     d->session->clearUnannounced();
-    d->pop->setMessageMap( d->map );
+    d->pop->setMaildrop( i, uids, ids, sizes );
     d->pop->setState( POP::Transaction );
     d->pop->ok( "Done" );
     return true;
 }
 
 
-/*! Handles the guts of the STAT/LIST data acquisition. */
-
-bool PopCommand::fetch822Size()
-{
-    ::List<Message> * l = new ::List<Message>;
-
-    uint n = d->set.count();
-    while ( n >= 1 ) {
-        uint uid = d->set.value( n );
-        Message * m = d->pop->message( uid );
-        if ( m && !m->hasTrivia() )
-            l->prepend( m );
-        n--;
-    }
-
-    if ( l->isEmpty() )
-        return true;
-
-    if ( !d->sentFetch ) {
-        d->sentFetch = true;
-        Fetcher * mtf = new Fetcher( l, this, d->pop );
-        mtf->fetch( Fetcher::Trivia );
-        mtf->execute();
-    }
-
-    return false;
-}
-
-
 /*! Handles the STAT command. */
 
 bool PopCommand::stat()
@@ -531,15 +527,10 @@ bool PopCommand::stat()
         }
     }
 
-    if ( !fetch822Size() )
-        return false;
-
     uint size = 0;
     uint n = s->count();
     while ( n >= 1 ) {
-        Message * m = d->pop->message( s->uid( n ) );
-        if ( m )
-            size += m->rfc822Size();
+        size += d->pop->messageSize( s->uid( n ) );
         n--;
     }
 
@@ -577,16 +568,12 @@ bool PopCommand::list()
         log( "LIST command (" + d->set.set() + ")" );
     }
 
-    if ( !fetch822Size() )
-        return false;
-
     if ( d->args->count() == 1 ) {
         uint uid = d->set.smallest();
-        Message * m = d->pop->message( uid );
+        uint size = d->pop->messageSize( uid );
 
-        if ( m )
-            d->pop->ok( fn( s->msn( uid ) ) + " " +
-                        fn( m->rfc822Size() ) );
+        if ( size )
+            d->pop->ok( fn( s->msn( uid ) ) + " " + fn( size ) );
         else
             d->pop->err( "No such message" );
     }
@@ -596,10 +583,10 @@ bool PopCommand::list()
         d->pop->ok( "Done" );
         while ( i <= d->set.count() ) {
             uint uid = d->set.value( i );
-            Message * m = d->pop->message( uid );
-            if ( m )
+            uint size = d->pop->messageSize( uid );
+            if ( size )
                 d->pop->enqueue( fn( s->msn( uid ) ) + " " +
-                                 fn( m->rfc822Size() ) + "\r\n" );
+                                 fn( size ) + "\r\n" );
             i++;
         }
         d->pop->enqueue( ".\r\n" );
@@ -608,8 +595,57 @@ bool PopCommand::list()
 }
 
 
+/* Returns the dot-stuffed form of \a text, ending with the
+   terminating dot line, in a single string. If \a top is true, the
+   result contains only the header, the blank line after it and \a n
+   lines of the body, as for TOP. The header and body lines sent are
+   counted in \a lnhead and \a lnbody.
+*/
+
+static EString dotStuffed( const EString & text, bool top, int n,
+                           uint & lnhead, uint & lnbody )
+{
+    EString r;
+    r.reserve( text.length() + text.length() / 32 + 5 );
+
+    bool header = true;
+    uint i = 0;
+    while ( i < text.length() ) {
+        uint e = i;
+        while ( e < text.length() && text[e] != '\n' )
+            e++;
+        uint l = e;
+        if ( l > i && text[l-1] == '\r' )
+            l--;
+
+        if ( header && l == i )
+            header = false;
+
+        if ( !header && top && n-- < 0 )
+            break;
+
+        if ( header )
+            lnhead++;
+        else
+            lnbody++;
+
+        if ( text[i] == '.' )
+            r.append( '.' );
+        r.append( text.data() + i, l - i );
+        r.append( "\r\n" );
+        i = e + 1;
+    }
+    r.append( ".\r\n" );
+    return r;
+}
+
+
 /*! Handles both the RETR (if \a lines is false) and TOP (if \a lines
     is true) commands.
+
+    If the message's raw text is stored, that's all we fetch and send,
+    without building the Message tree. If not, TOP 0 fetches only the
+    header.
 */
 
 bool PopCommand::retr( bool lines )
@@ -650,16 +686,23 @@ bool PopCommand::retr( bool lines )
 
         d->started = true;
         Fetcher * f = new Fetcher( d->message, this );
-        if ( !d->message->hasBodies() )
+        if ( !d->message->hasBodies() && !( lines && d->n == 0 ) )
             f->fetch( Fetcher::Body );
         if ( !d->message->hasHeaders() )
             f->fetch( Fetcher::OtherHeader );
         if ( !d->message->hasAddresses() )
             f->fetch( Fetcher::Addresses );
+        if ( f->fetching( Fetcher::Body ) ||
+             f->fetching( Fetcher::OtherHeader ) ||
+             f->fetching( Fetcher::Addresses ) )
+            f->fetch( Fetcher::Raw );
         f->execute();
     }
 
-    if ( !( d->message->hasBodies() &&
+    bool raw = !d->message->rawText().isEmpty();
+    bool headerOnly = !raw && lines && d->n == 0;
+    if ( !raw &&
+         !( ( headerOnly || d->message->hasBodies() ) &&
             d->message->hasHeaders() &&
             d->message->hasAddresses() ) )
         return false;
@@ -672,43 +715,16 @@ bool PopCommand::retr( bool lines )
         return true;
     }
 
-    Buffer * b = new Buffer;
-    b->append( d->message->rfc822( true ) ); // XXX always downgrades
-
-    int ln = d->n;
-    bool header = true;
-    int lnhead = 0;
-    int lnbody = 0;
-    int msize = b->size();
-
-    EString * t;
-    while ( ( t = b->removeLine() ) != 0 ) {
-        if ( header && t->isEmpty() )
-            header = false;
-
-        if ( !header && lines && ln-- < 0 )
-            break;
-
-        if ( header )
-            lnhead++;
-        else
-            lnbody++;
-
-        if ( t->startsWith( "." ) )
-            d->pop->enqueue( "." );
-        d->pop->enqueue( *t );
-        d->pop->enqueue( "\r\n" );
-    }
-
-    EString st = b->string( b->size() );
-    if ( !st.isEmpty() && !( !header && lines && ln-- < 0 ) ) {
-        if ( st.startsWith( "." ) )
-            d->pop->enqueue( "." );
-        d->pop->enqueue( st );
-        d->pop->enqueue( "\r\n" );
-    }
+    EString text;
+    if ( headerOnly )
+        text = d->message->header()->asText( true ) + "\r\n";
+    else
+        text = d->message->rfc822( true ); // XXX always downgrades
 
-    d->pop->enqueue( ".\r\n" );
+    uint lnhead = 0;
+    uint lnbody = 0;
+    uint msize = text.length();
+    d->pop->enqueue( dotStuffed( text, lines, d->n, lnhead, lnbody ) );
 
     if( !lines )
         log( "Retrieved "
@@ -0,0 +1,581 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "replayer.h"
+
+#include "file.h"
+#include "dict.h"
+#include "list.h"
+#include "scope.h"
+#include "buffer.h"
+#include "vector.h"
+#include "endpoint.h"
+#include "eventloop.h"
+#include "resolver.h"
+#include "allocator.h"
+#include "estringlist.h"
+
+#include <stdio.h> // fprintf, printf
+#include <stdlib.h> // exit, qsort
+#include <sys/time.h> // gettimeofday
+
+
+// the current time in milliseconds
+static int64 now()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+/*! \class ReplaySession replayer.cpp
+
+    The ReplaySession class contains one session transcript written by
+    the recorder: a sequence of steps, each of which is a number of
+    lines sent by the client or received from the server.
+*/
+
+class ReplaySession
+    : public Garbage
+{
+public:
+    ReplaySession( const EString & );
+
+    class Step
+        : public Garbage
+    {
+    public:
+        Step(): send( false ) {}
+        bool send;
+        Vector< EString > lines;
+    };
+
+    EString name;
+    Vector< Step > steps;
+    bool valid;
+};
+
+
+/*! Reads the transcript in the file called \a file. If the file
+    can't be read or parsed, valid is false afterwards.
+*/
+
+ReplaySession::ReplaySession( const EString & file )
+    : name( file ), valid( false )
+{
+    File f( file );
+    if ( !f.valid() )
+        return;
+    EStringList * l = EStringList::split( '\n', f.contents() );
+    EStringList::Iterator i( l );
+    while ( i ) {
+        EString line = *i;
+        ++i;
+        if ( line.startsWith( "#" ) || line.isEmpty() )
+            continue;
+        if ( line == "end" )
+            break;
+        Step * s = new Step;
+        if ( line.startsWith( "send " ) )
+            s->send = true;
+        else if ( !line.startsWith( "receive " ) )
+            return;
+        bool ok = false;
+        uint n = line.section( " ", 2 ).number( &ok );
+        if ( !ok )
+            return;
+        while ( n && i ) {
+            s->lines.append( new EString( *i ) );
+            ++i;
+            n--;
+        }
+        if ( n )
+            return;
+        steps.append( s );
+    }
+    valid = true;
+}
+
+
+/*! \class Latencies replayer.cpp
+
+    The Latencies class keeps the response times of one IMAP command
+    and can compute percentiles of them.
+*/
+
+class Latencies
+    : public Garbage
+{
+public:
+    Latencies(): values( 0 ), n( 0 ), size( 0 ), sorted( false ) {}
+
+    void add( uint );
+    uint percentile( uint );
+    uint count() const { return n; }
+
+private:
+    uint * values;
+    uint n;
+    uint size;
+    bool sorted;
+};
+
+
+/*! Records that one command took \a ms milliseconds. */
+
+void Latencies::add( uint ms )
+{
+    if ( n == size ) {
+        size = size ? size * 2 : 64;
+        uint * v = (uint*)Allocator::alloc( size * sizeof( uint ), 0 );
+        uint i = 0;
+        while ( i < n ) {
+            v[i] = values[i];
+            i++;
+        }
+        values = v;
+    }
+    values[n++] = ms;
+    sorted = false;
+}
+
+
+static int compareUints( const void * a, const void * b )
+{
+    uint x = *(const uint *)a;
+    uint y = *(const uint *)b;
+    if ( x < y )
+        return -1;
+    if ( x > y )
+        return 1;
+    return 0;
+}
+
+
+/*! Returns the response time below which \a p percent of the
+    commands completed.
+*/
+
+uint Latencies::percentile( uint p )
+{
+    if ( !n )
+        return 0;
+    if ( !sorted )
+        qsort( values, n, sizeof( uint ), compareUints );
+    sorted = true;
+    uint i = n * p / 100;
+    if ( i >= n )
+        i = n - 1;
+    return values[i];
+}
+
+
+// the position of the last '{' in s, or -1
+static int lastBrace( const EString & s )
+{
+    int i = s.length() - 1;
+    while ( i >= 0 && s[i] != '{' )
+        i--;
+    return i;
+}
+
+
+class Substitution
+    : public Garbage
+{
+public:
+    EString from;
+    EString to;
+};
+
+
+static Endpoint * server;
+static List< Substitution > * substitutions;
+static Dict< Latencies > * latencies;
+static EStringList * commands;
+static uint running;
+static uint failures;
+static int64 bytes;
+
+
+class ReplayClientData
+    : public Garbage
+{
+public:
+    ReplayClientData()
+        : session( 0 ), number( 0 ), step( 0 ), line( 0 ),
+          pending( 0 ), literal( 0 ), skip( 0 ),
+          greeting( true ), continuing( false ), waitForPlus( false ),
+          plus( false ), done( false )
+    {}
+
+    class Pending
+        : public Garbage
+    {
+    public:
+        EString command;
+        int64 sent;
+    };
+
+    ReplaySession * session;
+    uint number;
+    uint step;
+    uint line;
+    Dict< Pending > tags;
+    uint pending;
+    uint literal;
+    uint skip;
+    bool greeting;
+    bool continuing;
+    bool waitForPlus;
+    bool plus;
+    bool done;
+};
+
+
+/*! \class ReplayClient replayer.h
+
+    The ReplayClient class plays the client side of a session recorded
+    by the recorder against a server, and records how long the server
+    takes to answer each command.
+
+    ReplayClient doesn't compare the server's responses to those in
+    the transcript, since they generally differ when the same session
+    is replayed for different users. It sends the client's lines in
+    order, waits for the tagged response to each command before it
+    moves on, and sends literals and AUTHENTICATE/IDLE continuations
+    only when the server has asked for them with a "+".
+*/
+
+
+/*! Constructs a client which replays \a session against the server,
+    as synthetic client number \a number. The number is used for
+    substitutions (see the replayer man page).
+*/
+
+ReplayClient::ReplayClient( ReplaySession * session, uint number )
+    : Connection(), d( new ReplayClientData )
+{
+    d->session = session;
+    d->number = number;
+    ::running++;
+    connect( *::server );
+    EventLoop::global()->addConnection( this );
+}
+
+
+void ReplayClient::react( Event e )
+{
+    switch( e ) {
+    case Read:
+        parse();
+        sendMore();
+        break;
+    case Connect:
+        break;
+    case Error:
+        ::failures++;
+        finish();
+        break;
+    case Timeout:
+    case Close:
+    case Shutdown:
+        finish();
+        break;
+    }
+}
+
+
+/*! Reads the server's responses, and notes which commands are
+    complete and whether the server has asked for more.
+*/
+
+void ReplayClient::parse()
+{
+    Buffer * r = readBuffer();
+    while ( true ) {
+        if ( d->skip ) {
+            uint n = d->skip;
+            if ( n > r->size() )
+                n = r->size();
+            r->remove( n );
+            ::bytes += n;
+            d->skip -= n;
+            if ( d->skip )
+                return;
+        }
+
+        EString * s = r->removeLine();
+        if ( !s )
+            return;
+        ::bytes += s->length() + 2;
+
+        if ( s->endsWith( "}" ) ) {
+            int b = lastBrace( *s );
+            bool ok = false;
+            if ( b >= 0 )
+                d->skip = s->mid( b + 1, s->length() - b - 2 ).number( &ok );
+            if ( !ok )
+                d->skip = 0;
+        }
+
+        if ( d->greeting ) {
+            d->greeting = false;
+        }
+        else if ( s->startsWith( "+" ) ) {
+            if ( d->waitForPlus )
+                d->waitForPlus = false;
+            else if ( d->pending )
+                d->plus = true;
+        }
+        else if ( !s->startsWith( "*" ) ) {
+            EString tag = s->section( " ", 1 );
+            ReplayClientData::Pending * p = d->tags.find( tag );
+            if ( p ) {
+                d->tags.remove( tag );
+                d->pending--;
+                d->plus = false;
+                d->waitForPlus = false;
+                Latencies * l = ::latencies->find( p->command );
+                if ( !l ) {
+                    l = new Latencies;
+                    ::latencies->insert( p->command, l );
+                    ::commands->append( p->command );
+                }
+                l->add( (uint)( ::now() - p->sent ) );
+            }
+        }
+    }
+}
+
+
+/*! Sends as much of the transcript as the server is ready for. */
+
+void ReplayClient::sendMore()
+{
+    while ( !d->done && !d->greeting && !d->waitForPlus &&
+            ( !d->pending || d->plus || d->continuing ) ) {
+        ReplaySession::Step * s = d->session->steps[d->step];
+        if ( !s ) {
+            if ( !d->pending )
+                finish();
+            return;
+        }
+        if ( !s->send || d->line >= s->lines.count() ) {
+            d->step++;
+            d->line = 0;
+            continue;
+        }
+
+        EString l = *s->lines[d->line];
+        d->line++;
+        List< Substitution >::Iterator i( ::substitutions );
+        while ( i ) {
+            EString to = i->to;
+            to.replace( "%n", fn( d->number ) );
+            l.replace( i->from, to );
+            ++i;
+        }
+        enqueue( l + "\r\n" );
+
+        EString rest = l;
+        if ( d->literal ) {
+            if ( l.length() + 2 <= d->literal ) {
+                d->literal -= l.length() + 2;
+                continue;
+            }
+            rest = l.mid( d->literal );
+            d->literal = 0;
+        }
+        else if ( d->plus ) {
+            // the answer to a continuation request, e.g. DONE
+            d->plus = false;
+        }
+        else if ( !d->continuing ) {
+            ReplayClientData::Pending * p = new ReplayClientData::Pending;
+            p->command = l.section( " ", 2 ).upper();
+            if ( p->command == "UID" )
+                p->command.append( " " + l.section( " ", 3 ).upper() );
+            p->sent = ::now();
+            d->tags.insert( l.section( " ", 1 ), p );
+            d->pending++;
+        }
+
+        d->continuing = false;
+        if ( rest.endsWith( "}" ) ) {
+            int b = lastBrace( rest );
+            EString n = rest.mid( b + 1, rest.length() - b - 2 );
+            bool sync = true;
+            if ( n.endsWith( "+" ) ) {
+                n = n.mid( 0, n.length() - 1 );
+                sync = false;
+            }
+            bool ok = false;
+            if ( b >= 0 )
+                d->literal = n.number( &ok );
+            if ( ok ) {
+                d->continuing = true;
+                if ( sync && d->literal )
+                    d->waitForPlus = true;
+            }
+            else {
+                d->literal = 0;
+            }
+        }
+    }
+}
+
+
+/*! Records that this client is done, closes the connection and stops
+    the event loop when the last client is done.
+*/
+
+void ReplayClient::finish()
+{
+    if ( d->done )
+        return;
+    d->done = true;
+    if ( d->pending )
+        ::failures++;
+    if ( state() == Connected )
+        close();
+    ::running--;
+    if ( !::running )
+        EventLoop::shutdown();
+}
+
+
+static void report( int64 elapsed )
+{
+    if ( elapsed < 1 )
+        elapsed = 1;
+    uint total = 0;
+    EStringList::Iterator i( ::commands->sorted() );
+    printf( "%-20s %8s %8s %8s %8s %8s\n",
+            "Command", "Count", "p50 ms", "p90 ms", "p99 ms", "Max ms" );
+    while ( i ) {
+        Latencies * l = ::latencies->find( *i );
+        printf( "%-20s %8d %8d %8d %8d %8d\n",
+                i->cstr(), l->count(), l->percentile( 50 ),
+                l->percentile( 90 ), l->percentile( 99 ),
+                l->percentile( 100 ) );
+        total += l->count();
+        ++i;
+    }
+    printf( "\n%d commands in %d.%03d seconds: %d commands/s, %s/s "
+            "received\n",
+            total, (int)( elapsed / 1000 ), (int)( elapsed % 1000 ),
+            (int)( (int64)total * 1000 / elapsed ),
+            EString::humanNumber( ::bytes * 1000 / elapsed ).cstr() );
+    if ( ::failures )
+        printf( "%d sessions did not complete\n", ::failures );
+}
+
+
+int main( int argc, char ** argv )
+{
+    Scope global;
+    EventLoop::setup();
+
+    ::substitutions = new List< Substitution >;
+    Allocator::addEternal( ::substitutions, "replay substitutions" );
+    ::latencies = new Dict< Latencies >;
+    Allocator::addEternal( ::latencies, "replay latencies" );
+    ::commands = new EStringList;
+    Allocator::addEternal( ::commands, "replayed commands" );
+
+    EString error;
+    uint clients = 1;
+    int i = 1;
+    while ( error.isEmpty() && i < argc && argv[i][0] == '-' ) {
+        EString a( argv[i] );
+        if ( i + 1 >= argc ) {
+            error = "Missing argument for " + a;
+        }
+        else if ( a == "-n" ) {
+            bool ok = false;
+            clients = EString( argv[i+1] ).number( &ok );
+            if ( !ok || !clients )
+                error = "Could not parse number of clients";
+        }
+        else if ( a == "-s" ) {
+            EString s( argv[i+1] );
+            int eq = s.find( '=' );
+            if ( eq < 1 ) {
+                error = "Substitutions must be from=to: " + s;
+            }
+            else {
+                Substitution * sub = new Substitution;
+                sub->from = s.mid( 0, eq );
+                sub->to = s.mid( eq + 1 );
+                ::substitutions->append( sub );
+            }
+        }
+        else {
+            error = "Unknown option " + a;
+        }
+        i += 2;
+    }
+
+    if ( error.isEmpty() && argc - i < 3 )
+        error = "Wrong number of arguments";
+
+    if ( error.isEmpty() ) {
+        bool ok = false;
+        uint port = EString( argv[i+1] ).number( &ok );
+        EStringList l = Resolver::resolve( argv[i] );
+        if ( !ok )
+            error = "Could not parse server's port number";
+        else if ( l.isEmpty() )
+            error = EString( "Cannot resolve " ) + argv[i] +
+                    ": " + Resolver::errors().join( ", " );
+        else
+            ::server = new Endpoint( *l.first(), port );
+        if ( ::server && !::server->valid() )
+            error = "Invalid server address";
+        else if ( ::server )
+            Allocator::addEternal( ::server, "replay server endpoint" );
+        i += 2;
+    }
+
+    List< ReplaySession > sessions;
+    while ( error.isEmpty() && i < argc ) {
+        ReplaySession * s = new ReplaySession( argv[i] );
+        if ( !s->valid )
+            error = EString( "Could not read transcript " ) + argv[i];
+        sessions.append( s );
+        i++;
+    }
+
+    if ( !error.isEmpty() ) {
+        fprintf( stderr,
+                 "Error: %s\n"
+                 "Usage: replayer [-n clients] [-s from=to]... "
+                 "address port file...\n"
+                 "       -n: The number of concurrent clients (default 1).\n"
+                 "       -s: Replace 'from' by 'to' in what clients send.\n"
+                 "           %%n in 'to' is replaced by the client number.\n"
+                 "       Address: The IP address of the IMAP server.\n"
+                 "       Port: The IMAP server's port.\n"
+                 "       File: Transcripts written by recorder.\n",
+                 error.cstr() );
+        exit( 1 );
+    }
+
+    global.setLog( new Log );
+
+    uint n = 0;
+    List< ReplaySession >::Iterator s( sessions );
+    while ( n < clients ) {
+        if ( !s )
+            s = sessions.first();
+        (void)new ReplayClient( s, n + 1 );
+        ++s;
+        n++;
+    }
+
+    int64 started = ::now();
+    EventLoop::global()->start();
+    report( ::now() - started );
+    return ::failures ? 1 : 0;
+}
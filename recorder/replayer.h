@@ -0,0 +1,26 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef REPLAYER_H
+#define REPLAYER_H
+
+#include "connection.h"
+
+
+class ReplayClient
+    : public Connection
+{
+public:
+    ReplayClient( class ReplaySession *, uint );
+
+    void react( Event );
+
+private:
+    class ReplayClientData * d;
+
+    void parse();
+    void sendMore();
+    void finish();
+};
+
+
+#endif
@@ -5,25 +5,35 @@
 #include "configuration.h"
 #include "eventloop.h"
 #include "mechanism.h"
+#include "allocator.h"
 #include "buffer.h"
+#include "list.h"
 #include "user.h"
 
 
+// the most connections to the LDAP server
+static const uint maxClients = 4;
+// how long an idle connection is kept open, in seconds
+static const uint idleTimeout = 300;
+
+static List<LdapClient> * clients = 0;
+static List<LdapRelay> * queued = 0;
+
+
 class LdapRelayData
     : public Garbage
 {
 public:
     LdapRelayData()
         : mechanism( 0 ),
-          state( LdapRelay::Working ),
-          haveReadType( false ), responseLength( 0 )
+          state( LdapRelay::Working )
         {}
 
     SaslMechanism * mechanism;
+    EString dn;
+    EString password;
 
     LdapRelay::State state;
-    bool haveReadType;
-    uint responseLength;
 };
 
 
@@ -42,46 +52,181 @@ public:
 
     BindSucceeded: We should accept this authentication.
 
-    The implementation is based on RFC 4511.
+    The bind request itself is sent by an LdapClient, which keeps its
+    connection to the server open for later requests.
 */
 
 
 
-/*! Constructs an LdapRelay to verify whatever \a mechanism needs. */
+/*! Constructs an LdapRelay to verify whatever \a mechanism needs, and
+    queues it for the first free LdapClient.
+*/
 
 LdapRelay::LdapRelay( SaslMechanism * mechanism )
-    : Connection( Connection::socket( server().protocol() ),
-                  Connection::LdapRelay ),
-      d ( new LdapRelayData )
+    : d ( new LdapRelayData )
 {
     d->mechanism = mechanism;
-    setTimeoutAfter( 30 );
-    connect( server() );
-    EventLoop::global()->addConnection( this );
+    if ( mechanism->user() )
+        d->dn = mechanism->user()->ldapdn().utf8();
+    d->password = mechanism->secret().utf8();
+
+    if ( !::queued ) {
+        ::queued = new List<LdapRelay>;
+        Allocator::addEternal( ::queued, "queued LDAP binds" );
+    }
+    ::queued->append( this );
+    LdapClient::dispatch();
+}
+
+
+/*! Returns the address of the LDAP server used. */
+
+Endpoint LdapRelay::server()
+{
+    return Endpoint(
+        Configuration::text( Configuration::LdapServerAddress ),
+        Configuration::scalar( Configuration::LdapServerPort ) );
+
 }
 
 
-/*! Reacts to incoming packets from the LDAP server, changes the
-    object's state, and eventually notifies the Mechanism. \a e is as
-    for Connection::react().
+/*! This private helper sets the state, logs \a error and notifies the
+    Mechanism.
 */
 
-void LdapRelay::react( Event e )
+void LdapRelay::fail( const EString & error )
 {
     if ( d->state != Working )
         return;
 
+    d->state = BindFailed;
+    d->mechanism->log( error );
+    d->mechanism->execute();
+}
+
+
+/*! This private helper sets the state, logs and notifies the
+    Mechanism.
+*/
+
+void LdapRelay::succeed()
+{
+    if ( d->state != Working )
+        return;
+
+    d->state = BindSucceeded;
+    d->mechanism->log( "LDAP authentication succeeded" );
+    d->mechanism->execute();
+}
+
+
+/*! Returns the relay object's current state. */
+
+LdapRelay::State LdapRelay::state() const
+{
+    return d->state;
+}
+
+
+class LdapClientData
+    : public Garbage
+{
+public:
+    LdapClientData()
+        : relay( 0 ), messageId( 0 ), connected( false )
+        {}
+
+    ::LdapRelay * relay;
+    uint messageId;
+    bool connected;
+};
+
+
+/*! \class LdapClient ldaprelay.h
+
+    The LdapClient class keeps a connection to the LDAP server, and
+    sends bind requests on behalf of LdapRelay objects.
+
+    RFC 4511 section 4.2.1 forbids sending anything while a bind is
+    outstanding, so each LdapClient sends one bind at a time, each
+    with its own message-id, and takes the next queued LdapRelay as
+    soon as the answer arrives. Up to four clients are used, so a
+    burst of logins costs at most four handshakes with the server.
+
+    Idle connections are closed after five minutes.
+*/
+
+
+/*! Constructs an LdapClient and starts connecting to the LDAP
+    server.
+*/
+
+LdapClient::LdapClient()
+    : Connection( Connection::socket( ::LdapRelay::server().protocol() ),
+                  Connection::LdapRelay ),
+      d( new LdapClientData )
+{
+    setTimeoutAfter( 30 );
+    connect( ::LdapRelay::server() );
+    EventLoop::global()->addConnection( this );
+}
+
+
+/*! Gives each queued LdapRelay to an idle LdapClient, and creates
+    more clients if there are too few.
+*/
+
+void LdapClient::dispatch()
+{
+    if ( !::clients ) {
+        ::clients = new List<LdapClient>;
+        Allocator::addEternal( ::clients, "LDAP clients" );
+    }
+
+    uint connecting = 0;
+    List<LdapClient>::Iterator i( ::clients );
+    while ( i && ::queued && !::queued->isEmpty() ) {
+        LdapClient * c = i;
+        ++i;
+        if ( !c->d->connected )
+            connecting++;
+        else if ( !c->d->relay )
+            c->bind( ::queued->shift() );
+    }
+
+    while ( ::queued && ::queued->count() > connecting &&
+            ::clients->count() < maxClients ) {
+        ::clients->append( new LdapClient );
+        connecting++;
+    }
+}
+
+
+/*! Reacts to incoming packets from the LDAP server, and passes the
+    results on to the LdapRelay being served. \a e is as for
+    Connection::react().
+*/
+
+void LdapClient::react( Event e )
+{
     switch( e ) {
     case Read:
         parse();
         break;
 
     case Connection::Timeout:
-        fail( "LDAP server timeout" );
+        if ( d->relay )
+            fail( "LDAP server timeout" );
+        else if ( !d->connected )
+            fail( "Timeout connecting to LDAP server" );
+        else
+            unbind();
         break;
 
     case Connect:
-        bind();
+        d->connected = true;
+        setTimeoutAfter( idleTimeout );
+        dispatch();
         break;
 
     case Error:
@@ -95,282 +240,277 @@ void LdapRelay::react( Event e )
     case Shutdown:
         break;
     }
+}
 
-    if ( d->state == Working )
-        return;
 
-    setState( Closing );
-    d->mechanism->execute();
+// the byte at position i of s, as an unsigned number
+static uint byteAt( const EString & s, uint i )
+{
+    return (uint)(unsigned char)s[i];
 }
 
 
-/*! Returns the address of the LDAP server used. */
-
-Endpoint LdapRelay::server()
+// the big-endian bytes of n, at least one
+static EString bigEndian( uint n )
 {
-    return Endpoint(
-        Configuration::text( Configuration::LdapServerAddress ),
-        Configuration::scalar( Configuration::LdapServerPort ) );
-
+    uint bytes = 1;
+    while ( bytes < 4 && ( n >> ( 8 * bytes ) ) )
+        bytes++;
+    EString r;
+    while ( bytes ) {
+        bytes--;
+        r.append( (char)( ( n >> ( 8 * bytes ) ) & 0xff ) );
+    }
+    return r;
 }
 
 
-static bool hasTypeAndLength( Buffer * r )
+// the BER encoding of the length l
+static EString berLength( uint l )
 {
-    uint l = (*r)[1];
+    EString r;
+    if ( l < 0x80 ) {
+        r.append( (char)l );
+        return r;
+    }
+    EString b = bigEndian( l );
+    r.append( (char)( 0x80 | b.length() ) );
+    r.append( b );
+    return r;
+}
+
 
-    if ( r->size() >= 2 && ( l < 0x80 || r->size() >= 2+(l&0x7f) ) )
-        return true;
-    return false;
+// the BER element with the given type and contents
+static EString berElement( char type, const EString & contents )
+{
+    EString r;
+    r.append( type );
+    r.append( berLength( contents.length() ) );
+    r.append( contents );
+    return r;
 }
 
 
-static uint removeLength( Buffer * r )
+// the BER encoding of the nonnegative integer n
+static EString berInteger( char type, uint n )
 {
-    uint length = (*r)[0];
-    r->remove( 1 );
+    EString b = bigEndian( n );
+    if ( byteAt( b, 0 ) >= 0x80 )
+        b.prepend( EString( "\000", 1 ) );
+    return berElement( type, b );
+}
 
-    // Handle the indefinite form encoding of length (generated by
-    // e.g. Active Directory, but not permitted by RFC4511, p.42).
-    // <http://www.w3.org/Protocols/HTTP-NG/asn1.html>
 
-    if ( length >= 0x80 ) {
-        uint lengthLength = length & 0x7f;
-        length = 0;
-        uint i = 0;
-        while ( i < lengthLength ) {
-            length *= 256;
-            length += (*r)[i];
-            ++i;
+// reads the element starting at i in s, and steps i past it. returns
+// false if s doesn't contain a complete element there.
+static bool berRead( const EString & s, uint & i,
+                     uint & type, EString & contents )
+{
+    if ( i + 2 > s.length() )
+        return false;
+    type = byteAt( s, i );
+    uint l = byteAt( s, i + 1 );
+    i += 2;
+    if ( l >= 0x80 ) {
+        uint n = l & 0x7f;
+        if ( n > 4 || i + n > s.length() )
+            return false;
+        l = 0;
+        while ( n ) {
+            l = l * 256 + byteAt( s, i );
+            i++;
+            n--;
         }
-        r->remove( lengthLength );
     }
+    if ( i + l > s.length() )
+        return false;
+    contents = s.mid( i, l );
+    i += l;
+    return true;
+}
+
 
-    return length;
+// the value of the BER integer whose contents are s
+static uint berValue( const EString & s )
+{
+    uint n = 0;
+    uint i = 0;
+    while ( i < s.length() ) {
+        n = n * 256 + byteAt( s, i );
+        i++;
+    }
+    return n;
 }
 
 
-/*! Parses the response the server sends, which has to be a bind
-    response.
+/*! Parses the responses the server sends, which have to be bind
+    responses.
 */
 
-void LdapRelay::parse()
+void LdapClient::parse()
 {
     Buffer * r = readBuffer();
 
-    if ( !d->haveReadType ) {
+    while ( r->size() >= 2 ) {
         // LDAPMessage magic bytes (30 xx)
         //     30 -> universal context-specific zero
-        //     xx -> message length
+        //     xx -> message length, perhaps in the long form
+        //           (generated by e.g. Active Directory)
 
-        if ( !hasTypeAndLength( r ) )
+        EString m = r->string( r->size() );
+        uint i = 0;
+        uint type = 0;
+        EString message;
+        if ( !berRead( m, i, type, message ) )
             return;
+        r->remove( i );
 
-        uint byte = (*r)[0];
-        if ( byte != 0x30 ) {
+        if ( type != 0x30 ) {
             fail( "Expected LDAP type byte 0x30, received 0x" +
-                  EString::fromNumber( byte, 16 ).lower() );
+                  EString::fromNumber( type, 16 ).lower() );
             return;
         }
-        r->remove( 1 );
 
-        d->responseLength = removeLength( r );
-        if ( d->responseLength < 8 ) {
-            fail( "Expected LDAP response of at least 8 bytes, received "
-                  "only " + fn( d->responseLength ) + " bytes" );
+        //  message-id (02 nn id)
+        i = 0;
+        EString id;
+        if ( !berRead( message, i, type, id ) || type != 2 ) {
+            fail( "Expected LDAP message-id with type 2, "
+                  "received type " + fn( type ) );
+            return;
+        }
+        if ( !d->relay || berValue( id ) != d->messageId ) {
+            fail( "Unexpected LDAP message-id " + fn( berValue( id ) ) );
             return;
         }
 
-        d->haveReadType = true;
-    }
-
-    if ( r->size() < d->responseLength )
-        return;
-
-    //  message-id (02 01 01)
-    //     02 -> integer
-    //     01 -> length
-    //     01 -> message-id
-    if ( (*r)[0] != 2 || (*r)[1] != 1 || (*r)[2] != 1 ) {
-        fail( "Expected LDAP message-id to have type 2 length 1 ID 1, "
-              "received type " + fn( (*r)[0] ) + " length " + fn( (*r)[1] ) +
-              " ID " + fn( (*r)[2] ) );
-        return;
-    }
-    r->remove( 3 );
-
-    //  bindresponse (61 07)
-    //     61 -> APPLICATION 1, BindResponse
-    //     07 -> length of remaining bytes
-    if ( (*r)[0] != 0x61 ) {
-        fail( "Expected LDAP response type 0x61, received type " +
-              EString::fromNumber( (*r)[0] ) );
-        return;
-    }
-    r->remove( 1 );
+        //  bindresponse (61 nn)
+        //     61 -> APPLICATION 1, BindResponse
+        //     nn -> length of remaining bytes
+        EString response;
+        if ( !berRead( message, i, type, response ) || type != 0x61 ) {
+            fail( "Expected LDAP response type 0x61, received type " +
+                  EString::fromNumber( type ) );
+            return;
+        }
 
-    // The next three bytes should be the LDAP result code.
-    uint bindResponseLength = removeLength( r );
-    if ( bindResponseLength < 3 ) {
-        fail( "Expected bind response with length >= 3, received "
-              "only " + fn( bindResponseLength ) + " bytes" );
-        return;
-    }
+        //   resultcode
+        //     0a -> enum
+        //     01 -> length
+        //     00 -> success
+        i = 0;
+        EString code;
+        if ( !berRead( response, i, type, code ) || type != 10 ) {
+            fail( "Expected LDAP result code to have type 10, "
+                  "received type " + fn( type ) );
+            return;
+        }
 
-    //   resultcode
-    //     0a -> enum
-    //     01 -> length?
-    //     00 -> success
-    if ( (*r)[0] != 10 || (*r)[1] != 1 ) {
-        fail( "Expected LDAP result code to have type 10 length 1, "
-              "received type " + fn( (*r)[0] ) + " length " + fn( (*r)[1] ) );
-        return;
+        //   matchedDN and errorMessage, both octetstrings
+        EString matched;
+        EString error;
+        if ( berRead( response, i, type, matched ) && type == 4 &&
+             berRead( response, i, type, error ) && type == 4 &&
+             !error.isEmpty() )
+            log( "Note: LDAP server returned error message: " + error );
+
+        ::LdapRelay * relay = d->relay;
+        d->relay = 0;
+        setTimeoutAfter( idleTimeout );
+        uint resultCode = berValue( code );
+        if ( resultCode != 0 )
+            relay->fail( "LDAP server refused authentication "
+                         "with result code " + fn( resultCode ) );
+        else
+            relay->succeed();
+        dispatch();
     }
-    uint resultCode = (*r)[2];
-    r->remove( 3 );
-    if ( resultCode != 0 )
-        fail( "LDAP server refused authentication with result code " +
-              fn( resultCode ) );
-    else
-        succeed();
-
-    // I think we don't care about the rest of the data.
-
-    //   matchedDN
-    //     04 -> octetstring
-    //     00 -> length
-    if ( (*r)[1] + 2 >= (int)r->size() )
-        return;
-    r->remove( (*r)[1] + 2 );
-
-    //   errorMessage
-    //     04 -> octetstring
-    //     00 -> length
-
-    if ( (*r)[0] != 4 || (*r)[1] >= r->size() )
-        return;
-    uint l = (*r)[1];
-    r->remove( 2 );
-    EString e( r->string( l ) );
-    if ( !e.isEmpty() )
-        log( "Note: LDAP server returned error message: " + e );
-
-    if ( d->state != BindFailed )
-        unbind();
 }
 
 
-/*! Sends a single bind request. */
+/*! Sends a bind request on behalf of \a relay. */
 
-void LdapRelay::bind()
+void LdapClient::bind( ::LdapRelay * relay )
 {
-    // LDAP message
-    //     30 -> LDAP message
-    //     nn -> number of remaining bytes
-
-    EString m;
-    m.append( 0x30 );
-
-    // Message id
-    //     02 -> integer
-    //     01 -> length
-    //     01 -> message-id
-
-    EString id;
-    id.append( "\002\001\001" );
+    d->relay = relay;
+    d->messageId++;
+    if ( d->messageId > 0x7fffffff )
+        d->messageId = 1;
+    setTimeoutAfter( 30 );
 
     // Bind request
     //     60 -> APPLICATION 0, i.e. bind request
-    //     nn -> number of remaining bytes
-
-    EString h;
-    h.append( 0x60 );
-
-    //   version (03)
-    //    02 -> integer
-    //    01 -> length
-    //    03 -> version
+    //   version
+    //     02 01 03 -> integer, length 1, version 3
+    //   name
+    //     04 nn s* -> octetstring, the DN
+    //   authentication
+    //     80 nn s* -> context-specific zero, i.e. "simple", the
+    //                 password
 
     EString s;
     s.append( "\002\001\003" );
+    s.append( berElement( 0x04, relay->d->dn ) );
+    s.append( berElement( (char)0x80, relay->d->password ) );
 
-    //   name (?)
-    //    04 -> octetstring
-    //    nn -> length
-    //    s* -> DN
-
-    s.append( 0x04 );
-    EString dn;
-    if ( d->mechanism->user() )
-        dn = d->mechanism->user()->ldapdn().utf8();
-    s.append( (char)dn.length() );
-    s.append( dn );
-
-    //   authentication
-    //    80 -> type: context-specific universal zero, and zero is "password"
-    //    nn -> length
-    //    s* -> password
-
-    s.append( 0x80 );
-    EString pw = d->mechanism->secret().utf8();
-    s.append( (char)pw.length() );
-    s.append( pw );
-
-    // Fill in the length fields
-
-    h.append( (char)s.length() );
-    m.append( (char)( id.length() + h.length() + s.length() ) );
+    // LDAP message
+    //     30 -> LDAP message
+    //   message id
+    //     02 nn id -> integer
 
-    enqueue( m );
-    enqueue( id );
-    enqueue( h );
-    enqueue( s );
+    EString m( berInteger( 0x02, d->messageId ) );
+    m.append( berElement( 0x60, s ) );
+    enqueue( berElement( 0x30, m ) );
 }
 
 
-/*! Sends an unbind request. */
+/*! Sends an unbind request and closes the connection. */
 
-void LdapRelay::unbind()
+void LdapClient::unbind()
 {
-    EString m;
-    m.append( 0x30 );
-    m.append( 0x05 );
-    m.append( 0x02 );
-    m.append( 0x01 );
-    m.append( 0x03 );
-    m.append( 0x42 );
-    m.append( "\000", 1 );
-    enqueue( m );
+    d->messageId++;
+    EString m( berInteger( 0x02, d->messageId ) );
+    m.append( "\102\000", 2 );
+    enqueue( berElement( 0x30, m ) );
+    finish();
 }
 
 
-/*! This private helper sets the state and logs \a error. */
+/*! This private helper fails the bind in progress, and logs \a
+    error. If no client has managed to connect, every queued bind
+    fails, since the server is evidently unreachable.
+*/
 
-void LdapRelay::fail( const EString & error )
+void LdapClient::fail( const EString & error )
 {
-    if ( d->state != Working )
-        return;
-
-    d->state = BindFailed;
     log( error );
+    if ( d->relay )
+        d->relay->fail( error );
+    d->relay = 0;
+    bool reachable = d->connected;
+    List<LdapClient>::Iterator i( ::clients );
+    while ( i && !reachable ) {
+        if ( i->d->connected )
+            reachable = true;
+        ++i;
+    }
+    if ( !reachable ) {
+        while ( ::queued && !::queued->isEmpty() )
+            ::queued->shift()->fail( error );
+    }
+    finish();
 }
 
 
-/*! This private helper sets the state and logs. */
-
-void LdapRelay::succeed()
-{
-    if ( d->state != Working )
-        return;
-
-    d->state = BindSucceeded;
-    log( "LDAP authentication succeeded" );
-}
-
-
-/*! Returns the relay object's current state. */
+/*! Closes this connection and forgets it, so that dispatch() can
+    start another if needed.
+*/
 
-LdapRelay::State LdapRelay::state() const
+void LdapClient::finish()
 {
-    return d->state;
+    setState( Closing );
+    if ( ::clients )
+        ::clients->remove( this );
+    if ( d->connected )
+        dispatch();
 }
@@ -10,13 +10,11 @@ class SaslMechanism;
 
 
 class LdapRelay
-    : public Connection
+    : public Garbage
 {
 public:
     LdapRelay( SaslMechanism * );
 
-    void react( Event );
-
     enum State { Working,
                  BindFailed,
                  BindSucceeded };
@@ -25,16 +23,34 @@ public:
 
     static Endpoint server();
 
-    void parse();
-    void bind();
-    void unbind();
-
 private:
     class LdapRelayData * d;
+    friend class LdapClient;
 
     void fail( const EString & );
     void succeed();
 };
 
 
+class LdapClient
+    : public Connection
+{
+public:
+    LdapClient();
+
+    void react( Event );
+
+    static void dispatch();
+
+private:
+    class LdapClientData * d;
+
+    void parse();
+    void bind( ::LdapRelay * );
+    void unbind();
+    void fail( const EString & );
+    void finish();
+};
+
+
 #endif
@@ -8,12 +8,22 @@
 #include "saslconnection.h"
 #include "estringlist.h"
 #include "ldaprelay.h"
+#include "allocator.h"
+#include "database.h"
+#include "entropy.h"
 #include "mailbox.h"
+#include "cache.h"
 #include "scope.h"
 #include "graph.h"
 #include "query.h"
+#include "timer.h"
+#include "dict.h"
 #include "user.h"
 #include "utf.h"
+#include "md5.h"
+
+// time
+#include <time.h>
 
 // Supported authentication mechanisms, for create().
 // (Keep these alphabetical.)
@@ -24,6 +34,72 @@
 #include "sasllogin.h"
 
 
+// how long a successful LDAP bind is remembered, in seconds
+static const uint verifiedTtl = 60;
+// the longest a login is held back while the database is busy
+static const uint maxPacing = 20;
+
+
+class VerifiedCredential
+    : public Garbage
+{
+public:
+    VerifiedCredential(): Garbage(), expires( 0 ) {}
+
+    EString digest;
+    uint expires;
+};
+
+
+class VerifiedCache
+    : public Cache
+{
+public:
+    VerifiedCache(): Cache( 2 ) {}
+
+    Dict<VerifiedCredential> entries;
+
+    void clear() { entries.clear(); }
+};
+
+
+static VerifiedCache * verified = 0;
+static EString * verifiedKey = 0;
+
+
+// the digest remembered for a successful bind as \a dn using \a secret
+static EString credentialDigest( const UString & dn, const UString & secret )
+{
+    if ( !verifiedKey ) {
+        verifiedKey = new EString( Entropy::asString( 16 ) );
+        Allocator::addEternal( verifiedKey, "credential digest key" );
+    }
+    return MD5::HMAC( *verifiedKey, dn.utf8() + "\n" + secret.utf8() );
+}
+
+
+// remembers that \a u could bind using \a secret
+static void rememberBind( User * u, const UString & secret )
+{
+    if ( !verified ) {
+        verified = new VerifiedCache;
+        Allocator::addEternal( verified, "verified credentials" );
+    }
+    VerifiedCredential * v = new VerifiedCredential;
+    v->digest = credentialDigest( u->ldapdn(), secret );
+    v->expires = (uint)::time( 0 ) + verifiedTtl;
+    verified->entries.insert( u->login().utf8(), v );
+}
+
+
+// true if the database has so much queued that a new login should wait
+static bool databaseBusy()
+{
+    return Database::queueLength() >
+        4 * Configuration::scalar( Configuration::DbMaxHandles );
+}
+
+
 class SaslData
     : public Garbage
 {
@@ -32,7 +108,7 @@ public:
         : state( SaslMechanism::IssuingChallenge ),
           command( 0 ), user( 0 ),
           l( 0 ), type( SaslMechanism::Plain ),
-          connection( 0 ), ldapRelay( 0 )
+          connection( 0 ), ldapRelay( 0 ), pacer( 0 ), paced( 0 )
     {}
 
     SaslMechanism::State state;
@@ -46,6 +122,8 @@ public:
     SaslMechanism::Type type;
     SaslConnection * connection;
     LdapRelay * ldapRelay;
+    Timer * pacer;
+    uint paced;
 };
 
 
@@ -282,6 +360,13 @@ void SaslMechanism::readResponse( const EString * r )
     If the login() name does not exist, this function sets the state to
     Failed. Otherwise, it calls verify(), which is expected to validate
     the request and set the state appropriately.
+
+    Users refreshed during the past minute are taken from the cache
+    kept by User::cached(). For other users, if the database already
+    has a long queue, this waits a second at a time (for up to 20
+    seconds) before asking, so that a storm of reconnecting clients is
+    admitted at the rate the database can handle instead of all
+    timing out together.
 */
 
 void SaslMechanism::execute()
@@ -300,7 +385,19 @@ void SaslMechanism::execute()
         return;
 
     if ( state() == Authenticating ) {
-        if ( !d->user  ) {
+        if ( !d->user )
+            d->user = User::cached( d->login );
+
+        if ( !d->user ) {
+            if ( d->pacer && d->pacer->active() )
+                return;
+            if ( d->paced < maxPacing && databaseBusy() ) {
+                if ( !d->paced )
+                    log( "Database busy, delaying login", Log::Debug );
+                d->paced++;
+                d->pacer = new Timer( this, 1 );
+                return;
+            }
             d->user = new User;
             d->user->setLogin( d->login );
             d->user->refresh( this );
@@ -332,6 +429,9 @@ void SaslMechanism::execute()
     }
 
     if ( done() ) {
+        if ( state() == Succeeded && d->user &&
+             !Mailbox::load( d->user->id(), this ) )
+            return;
         d->command->execute();
         d->command = 0;
     }
@@ -379,6 +479,10 @@ void SaslMechanism::tick()
     authentication. It returns true if the stored secret is empty, or
     matches the client-supplied secret, or if the user is trying to
     log in as anonymous and that's permitted.
+
+    For users authenticated via LDAP, a successful bind is remembered
+    for a minute (as a keyed digest, not in plain text), so that a
+    client reconnecting with the same password needn't bind again.
 */
 
 void SaslMechanism::verify()
@@ -392,6 +496,7 @@ void SaslMechanism::verify()
     else if ( d->ldapRelay ) {
         switch ( d->ldapRelay->state() ) {
         case LdapRelay::BindSucceeded:
+            rememberBind( d->user, secret() );
             setState( Succeeded );
             break;
         case LdapRelay::BindFailed:
@@ -402,7 +507,14 @@ void SaslMechanism::verify()
         }
     }
     else if ( d->user && !d->user->ldapdn().isEmpty() ) {
-        d->ldapRelay = new LdapRelay( this );
+        VerifiedCredential * v = 0;
+        if ( verified )
+            v = verified->entries.find( d->user->login().utf8() );
+        if ( v && v->expires > (uint)::time( 0 ) &&
+             v->digest == credentialDigest( d->user->ldapdn(), secret() ) )
+            setState( Succeeded );
+        else
+            d->ldapRelay = new LdapRelay( this );
     }
     else if ( storedSecret().isEmpty() || storedSecret() == secret() ) {
         setState( Succeeded );
@@ -3,15 +3,136 @@
 #include "saslconnection.h"
 
 #include "user.h"
+#include "list.h"
 #include "query.h"
+#include "timer.h"
 #include "estring.h"
 #include "endpoint.h"
-#include "eventloop.h"
+#include "allocator.h"
+#include "estringlist.h"
+#include "configuration.h"
 
 // time
 #include <time.h>
 
 
+// the most connections we record using one query
+static const uint batchSize = 500;
+// and the longest we wait before recording them
+static const uint batchDelay = 15;
+
+
+/*! \nodoc
+
+    The ConnectionLogger collects the records SaslConnection::close()
+    makes, and inserts them into the connections table a batch at a
+    time, at background priority. A mass disconnect thus costs a few
+    queries instead of one per connection.
+*/
+
+class ConnectionLogger
+    : public EventHandler
+{
+public:
+    ConnectionLogger()
+        : EventHandler(), timer( 0 ), rows( 0 )
+    {
+        Allocator::addEternal( this, "connection log buffer" );
+    }
+
+    void add( const EString &, const Endpoint &, const EString &,
+              uint, uint, uint, uint );
+    void execute();
+
+    EStringList logins;
+    EStringList addresses;
+    EStringList ports;
+    EStringList mechanisms;
+    EStringList authFailures;
+    EStringList syntaxErrors;
+    EStringList starts;
+    EStringList ends;
+    EStringList users;
+    Timer * timer;
+    uint rows;
+};
+
+
+static ConnectionLogger * logger = 0;
+
+
+/*! Records a connection from \a client by \a login (whose user ID is
+    \a user) using \a mechanism, which started at \a start and had \a
+    af authentication failures and \a sf syntax errors, and flushes the
+    records if there are enough of them.
+*/
+
+void ConnectionLogger::add( const EString & login, const Endpoint & client,
+                            const EString & mechanism,
+                            uint af, uint sf, uint start, uint user )
+{
+    logins.append( login );
+    addresses.append( client.address() );
+    ports.append( fn( client.port() ) );
+    mechanisms.append( mechanism );
+    authFailures.append( fn( af ) );
+    syntaxErrors.append( fn( sf ) );
+    starts.append( fn( start ) );
+    ends.append( fn( (uint)time( 0 ) ) );
+    users.append( fn( user ) );
+    rows++;
+
+    if ( rows >= batchSize )
+        execute();
+    else if ( !timer )
+        timer = new Timer( this, batchDelay );
+}
+
+
+void ConnectionLogger::execute()
+{
+    timer = 0;
+    if ( !rows )
+        return;
+
+    Query * q = new Query(
+        "insert into connections "
+        "(username,address,port,mechanism,authfailures,"
+        "syntaxerrors,started_at,ended_at,userid) "
+        "select ($1::text[])[i], ($2::text[])[i]::inet, "
+        "($3::text[])[i]::integer, ($4::text[])[i], "
+        "($5::text[])[i]::integer, ($6::text[])[i]::integer, "
+        "($7::text[])[i]::interval + 'epoch'::timestamptz, "
+        "($8::text[])[i]::interval + 'epoch'::timestamptz, "
+        "($9::text[])[i]::integer "
+        "from generate_series(1,$10) i", 0
+    );
+    q->bind( 1, logins );
+    q->bind( 2, addresses );
+    q->bind( 3, ports );
+    q->bind( 4, mechanisms );
+    q->bind( 5, authFailures );
+    q->bind( 6, syntaxErrors );
+    q->bind( 7, starts );
+    q->bind( 8, ends );
+    q->bind( 9, users );
+    q->bind( 10, rows );
+    q->setPriority( Query::Background );
+    q->execute();
+
+    logins.clear();
+    addresses.clear();
+    ports.clear();
+    mechanisms.clear();
+    authFailures.clear();
+    syntaxErrors.clear();
+    starts.clear();
+    ends.clear();
+    users.clear();
+    rows = 0;
+}
+
+
 /*! \class SaslConnection saslconnection.h
     A connection that can engage in a SASL negotiation.
 */
@@ -60,14 +181,19 @@ void SaslConnection::setUser( User * user, const EString & mechanism )
     u = user;
     m = mechanism;
     s = (uint)time(0);
+    if ( user )
+        log()->setUser( user->login().utf8() );
 }
 
 
-/*! This reimplementation logs the connection in the connections table
-    and cancels any other queries still running.
+/*! This reimplementation records the connection as configured by
+    connection-log and connection-log-sample. The connections table is
+    written a batch at a time, so a record may appear there a few
+    seconds late.
 
     If the connection is closed as part of server shutdown, then it's
-    probably too late to execute a new Query. We're tolerant of that.
+    probably too late to execute a new Query, and the last batch of
+    records is lost. We're tolerant of that.
 */
 
 void SaslConnection::close()
@@ -81,26 +207,28 @@ void SaslConnection::close()
 
     logged = true;
 
-    Query * q = new Query(
-        "insert into connections "
-        "(username,address,port,mechanism,authfailures,"
-        "syntaxerrors,started_at,ended_at,userid) "
-        "values ($1,$2,$3,$4,$5,$6,"
-        "$7::interval + 'epoch'::timestamptz,"
-        "$8::interval + 'epoch'::timestamptz,$9)", 0
-    );
-
-    q->bind( 1, u->login() );
-    q->bind( 2, client.address() );
-    q->bind( 3, client.port() );
-    q->bind( 4, m );
-    q->bind( 5, af );
-    q->bind( 6, sf );
-    q->bind( 7, s );
-    q->bind( 8, (uint)time( 0 ) );
-    q->bind( 9, u->id() );
-    q->execute();
+    static uint closed = 0;
+    uint sample = Configuration::scalar( Configuration::ConnectionLogSample );
+    closed++;
+    if ( sample > 1 && closed % sample )
+        return;
 
+    EString where( Configuration::text( Configuration::ConnectionLog ) );
+    where = where.lower();
+    if ( where == "logfile" ) {
+        log( "Connection ended: user " + u->login().utf8() +
+             ", address " + client.string() +
+             ", mechanism " + m +
+             ", duration " + fn( (uint)time( 0 ) - s ) +
+             "s, authentication failures " + fn( af ) +
+             ", syntax errors " + fn( sf ),
+             Log::Significant );
+    }
+    else if ( where == "database" ) {
+        if ( !logger )
+            logger = new ConnectionLogger;
+        logger->add( u->login().utf8(), client, m, af, sf, s, u->id() );
+    }
 }
 
 
@@ -15,6 +15,8 @@
 #include "eventloop.h"
 #include "allocator.h"
 #include "resolver.h"
+#include "session.h"
+#include "mailbox.h"
 #include "user.h"
 
 // errno
@@ -28,6 +30,8 @@
 #include <sys/socket.h>
 // time
 #include <time.h>
+// getenv
+#include <stdlib.h>
 
 
 class ConnectionData
@@ -38,7 +42,8 @@ public:
         : r( 0 ), w( 0 ),
           tls( 0 ), l( 0 ), session( 0 ),
           fd( -1 ), timeout( 0 ),
-          wbt( 0 ), wbs( 0 ),
+          wbt( 0 ), wbs( 0 ), memory( 0 ), throttled( 0 ), process( 0 ),
+          low( 0 ), high( 0 ), full( false ),
           state( Connection::Invalid ),
           type( Connection::Client ),
           pending( false )
@@ -51,6 +56,11 @@ public:
     int fd;
     uint timeout;
     uint wbt, wbs;
+    uint memory;
+    uint throttled;
+    uint process;
+    uint low, high;
+    bool full;
     Connection::State state;
 
     Connection::Type type;
@@ -225,6 +235,7 @@ bool Connection::hasProperty( Property p ) const
         break;
 
     case Connection::LdapRelay:
+    case Connection::DnsClient:
     case SmtpClient:
         break;
 
@@ -361,6 +372,9 @@ EString Connection::description() const
     case Connection::LdapRelay:
         r = "LDAP relay";
         break;
+    case Connection::DnsClient:
+        r = "DNS client";
+        break;
     case Pipe:
         r = "Byte forwarder";
         break;
@@ -548,6 +562,7 @@ void Connection::write()
     if ( !valid() )
         return;
 
+    d->w->flush();
     d->w->write( d->fd );
     uint wbs = d->w->size();
     if ( wbs && !d->wbs ) {
@@ -568,13 +583,128 @@ void Connection::write()
         d->wbt = 0;
         d->wbs = 0;
     }
+
+    if ( d->full && wbs <= d->low ) {
+        d->full = false;
+        writeBufferDrained();
+    }
+}
+
+
+/*! Returns true if the EventLoop should read more input for this
+    Connection, which it should unless the EventLoop has throttled()
+    it. Subclasses may reimplement this to apply other backpressure.
+*/
+
+bool Connection::canRead()
+{
+    return d->throttled == 0 && !writeBufferFull();
+}
+
+
+/*! Instructs this Connection to consider its writeBuffer() full once
+    it holds more than \a high bytes, and to stop being full once
+    write() has brought it down to \a low bytes or less. While the
+    buffer is full, canRead() returns false, and when it stops being
+    full, writeBufferDrained() is called.
+
+    This bounds the memory a client that doesn't read its responses
+    can make the server use, provided that the subclass holds back
+    work while writeBufferFull(). The default, 0 and 0, means that
+    the buffer is never full.
+*/
+
+void Connection::setWriteBufferLimits( uint low, uint high )
+{
+    d->low = low;
+    d->high = high;
+    if ( !high )
+        d->full = false;
+}
+
+
+/*! Returns true if the writeBuffer() has grown past the high limit
+    set by setWriteBufferLimits(), and has not yet been written down
+    to the low limit, and false otherwise.
+*/
+
+bool Connection::writeBufferFull() const
+{
+    if ( !d->full && d->high && d->w && d->w->size() > d->high )
+        d->full = true;
+    return d->full;
+}
+
+
+/*! This virtual function is called by write() when the writeBuffer()
+    is no longer full (see writeBufferFull()). Subclasses may
+    reimplement it to resume work held back while the buffer was
+    full. The default implementation does nothing.
+*/
+
+void Connection::writeBufferDrained()
+{
+}
+
+
+/*! Records that \a bytes of memory could be reached from this
+    Connection (and not from any other) at the last garbage
+    collection. EventLoop::freeMemory() calls this.
+*/
+
+void Connection::setMemoryUsage( uint bytes )
+{
+    d->memory = bytes;
+}
+
+
+/*! Returns the memory usage recorded by setMemoryUsage(), or 0 if
+    there hasn't been a garbage collection since this Connection was
+    added to the EventLoop.
+*/
+
+uint Connection::memoryUsage() const
+{
+    return d->memory;
+}
+
+
+/*! Throttles this Connection if \a t is true, and releases it if \a
+    t is false. While a Connection is throttled, canRead() returns
+    false and Fetcher waits before fetching each new batch for it.
+
+    EventLoop::freeMemory() throttles the Connection using the most
+    memory while the server is over its memory limit, and calls this
+    once more for each collection that doesn't bring the server back
+    under the limit.
+*/
+
+void Connection::setThrottled( bool t )
+{
+    if ( t )
+        d->throttled++;
+    else
+        d->throttled = 0;
 }
 
 
-/*! Returns true if we have any data to send. */
+/*! Returns the number of consecutive garbage collections for which
+    this Connection has been throttled, or 0 if it isn't throttled.
+*/
+
+uint Connection::throttled() const
+{
+    return d->throttled;
+}
+
+
+/*! Returns true if we have any data to send. Flushes the
+    writeBuffer() first, so that compressed output counts.
+*/
 
 bool Connection::canWrite()
 {
+    d->w->flush();
     return d->w->size() > 0;
 }
 
@@ -690,6 +820,10 @@ int Connection::listen( const Endpoint &e, bool silent )
 
     int i = 1;
     ::setsockopt( d->fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof (int) );
+#if defined(SO_REUSEPORT)
+    if ( d->process )
+        ::setsockopt( d->fd, SOL_SOCKET, SO_REUSEPORT, &i, sizeof (int) );
+#endif
 
     if ( e.protocol() == Endpoint::Unix )
         unlink( File::chrooted( e.address() ).cstr() );
@@ -765,8 +899,11 @@ int Connection::connect( const Endpoint &e )
 
 
 /*! Accepts a queued connection from a listening socket, and returns the
-    newly created FD, or -1 on error. Should only be called on Listening
-    connections.
+    newly created FD, or -1 on error (including when no connection is
+    queued). Should only be called on Listening connections.
+
+    Where possible, the new FD is nonblocking and close-on-exec from
+    the start.
 */
 
 int Connection::accept()
@@ -777,11 +914,89 @@ int Connection::accept()
     socklen_t len = 0;
     struct sockaddr_storage l;
 
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    int s = ::accept4( fd(), (sockaddr *)&l, &len,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else
     int s = ::accept( fd(), (sockaddr *)&l, &len );
+#endif
     return s;
 }
 
 
+/*! Records that this Listening connection belongs to server process
+    number \a n, counting from 1. Such a connection is listen()ed to
+    using SO_REUSEPORT, and each server process closes the ones that
+    belong to other processes. The default, 0, means that the
+    connection is shared by all server processes.
+
+    Must be called before listen().
+*/
+
+void Connection::setServerProcess( uint n )
+{
+    d->process = n;
+}
+
+
+/*! Returns the server process this connection belongs to, as set by
+    setServerProcess(), or 0 if it is shared.
+*/
+
+uint Connection::serverProcess() const
+{
+    return d->process;
+}
+
+
+/*! Returns the number of listening sockets passed to this process
+    using systemd's socket activation protocol (i.e. the LISTEN_PID and
+    LISTEN_FDS environment variables), or 0 if there are none. The
+    sockets are fds 3 and up.
+*/
+
+int Connection::inheritedSockets()
+{
+    const char * pid = ::getenv( "LISTEN_PID" );
+    const char * fds = ::getenv( "LISTEN_FDS" );
+    if ( !pid || !fds )
+        return 0;
+    bool ok = false;
+    uint p = EString( pid ).number( &ok );
+    if ( !ok || p != (uint)::getpid() )
+        return 0;
+    uint n = EString( fds ).number( &ok );
+    if ( !ok )
+        return 0;
+    return n;
+}
+
+
+/*! Returns the inherited listening socket (see inheritedSockets())
+    that is bound to \a e, or -1 if there is none. This lets a new
+    server accept connections on the same sockets as the old one,
+    without any gap in which connections are refused.
+*/
+
+int Connection::inheritedSocket( const Endpoint & e )
+{
+    int n = inheritedSockets();
+    int fd = 3;
+    while ( fd < 3 + n ) {
+        struct sockaddr_storage sa;
+        socklen_t l = sizeof( sa );
+        if ( ::getsockname( fd, (sockaddr *)&sa, &l ) >= 0 ) {
+            Endpoint s( (sockaddr *)&sa, l );
+            if ( s.valid() && s.protocol() == e.protocol() &&
+                 s.port() == e.port() && s.address() == e.address() )
+                return fd;
+        }
+        fd++;
+    }
+    return -1;
+}
+
+
 /*! Returns a new TCP socket for the protocol \a p, or -1 on error. */
 
 int Connection::socket( Endpoint::Protocol p )
@@ -1063,7 +1278,11 @@ void Connection::substitute( Connection * other, Event event )
 
 void Connection::setSession( class Session * session )
 {
+    if ( d->session && d->session->mailbox() )
+        d->session->mailbox()->removeSession( d->session );
     d->session = session;
+    if ( session && session->mailbox() )
+        session->mailbox()->addSession( session );
 }
 
 
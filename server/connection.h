@@ -33,7 +33,8 @@ public:
         Listener,
         Pipe,
         ManageSieveServer,
-        LdapRelay
+        LdapRelay,
+        DnsClient
     };
     Connection();
     Connection( int, Type );
@@ -68,8 +69,18 @@ public:
     virtual void close();
     virtual void read();
     virtual void write();
+    virtual bool canRead();
     virtual bool canWrite();
 
+    void setMemoryUsage( uint );
+    uint memoryUsage() const;
+    void setThrottled( bool );
+    uint throttled() const;
+
+    void setWriteBufferLimits( uint, uint );
+    bool writeBufferFull() const;
+    virtual void writeBufferDrained();
+
     void enqueue( const EString & );
 
     enum Event { Error, Connect, Read, Timeout, Close, Shutdown };
@@ -81,10 +92,14 @@ public:
     int connect( const Endpoint & );
     int connect( const EString &, uint );
     int accept();
+    void setServerProcess( uint );
+    uint serverProcess() const;
     static void setAny6ListensTo4( bool );
     static bool any6ListensTo4();
 
     static int socket( Endpoint::Protocol );
+    static int inheritedSockets();
+    static int inheritedSocket( const Endpoint & );
 
     Log * log() const;
     void log( const EString &, Log::Severity = Log::Info );
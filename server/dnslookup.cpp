@@ -0,0 +1,798 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <errno.h>
+
+#include "dnslookup.h"
+
+#include "map.h"
+#include "dict.h"
+#include "log.h"
+#include "scope.h"
+#include "cache.h"
+#include "timer.h"
+#include "buffer.h"
+#include "entropy.h"
+#include "endpoint.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "allocator.h"
+
+// time
+#include <time.h>
+
+
+// we never believe a TTL longer than this, and use this TTL for
+// negative answers that don't say
+static const uint maxTtl = 86400;
+static const uint defaultNegativeTtl = 300;
+
+
+class DnsCacheEntry
+    : public Garbage
+{
+public:
+    DnsCacheEntry(): Garbage(), results( 0 ), expires( 0 ) {}
+
+    EStringList * results;
+    EString error;
+    uint expires;
+};
+
+
+class DnsCache
+    : public Cache
+{
+public:
+    DnsCache(): Cache( 10 ) {}
+
+    Dict<DnsCacheEntry> entries;
+
+    void clear() { entries.clear(); }
+};
+
+
+static DnsCache * cache = 0;
+
+
+static EString cacheKey( const EString & name, DnsLookup::Type type )
+{
+    EString k = fn( (uint)type );
+    k.append( '/' );
+    k.append( name );
+    return k;
+}
+
+
+// returns the byte at i in p as an unsigned number
+static uint octet( const EString & p, uint i )
+{
+    return (uint)(unsigned char)p[i];
+}
+
+
+// reads a possibly compressed domain name starting at i in the
+// packet p, and moves i past it. sets ok to false on parse errors.
+static EString readName( const EString & p, uint & i, bool & ok )
+{
+    EString r;
+    uint j = i;
+    uint jumps = 0;
+    bool jumped = false;
+    while ( ok ) {
+        if ( j >= p.length() ) {
+            ok = false;
+        }
+        else if ( octet( p, j ) == 0 ) {
+            j++;
+            break;
+        }
+        else if ( octet( p, j ) >= 192 ) {
+            if ( ++jumps > 16 || j + 1 >= p.length() ) {
+                ok = false;
+            }
+            else {
+                uint t = ( ( octet( p, j ) & 0x3f ) << 8 ) + octet( p, j+1 );
+                if ( !jumped )
+                    i = j + 2;
+                jumped = true;
+                j = t;
+            }
+        }
+        else if ( octet( p, j ) < 64 ) {
+            uint l = octet( p, j );
+            if ( !r.isEmpty() )
+                r.append( '.' );
+            r.append( p.mid( j+1, l ) );
+            j += l + 1;
+        }
+        else {
+            ok = false;
+        }
+    }
+    if ( !jumped )
+        i = j;
+    return r.lower();
+}
+
+
+class DnsClient
+    : public Connection
+{
+public:
+    DnsClient( int, const Endpoint &, bool );
+
+    void react( Event );
+    void read();
+    void write();
+
+    void query( DnsLookup *, const EString & );
+    void forget( uint );
+
+    static DnsClient * udp();
+    static Endpoint nameserver();
+
+private:
+    void parse();
+    void fail( const EString & );
+
+    Map<DnsLookup> pending;
+    uint lookups;
+    bool tcp;
+};
+
+
+static DnsClient * udpClient = 0;
+
+
+/*! \class DnsClient dnslookup.cpp
+
+    The DnsClient class sends DNS queries to the nameserver on behalf
+    of DnsLookup, and hands each reply to the DnsLookup whose id it
+    carries.
+
+    Normally there is one DnsClient per process, which uses UDP.
+    Replies too large for UDP are fetched again using a short-lived
+    TCP DnsClient. Either way, the read and write buffers hold
+    messages prefixed by their two-byte length, as on TCP.
+*/
+
+/*! Constructs a DnsClient for the socket \a fd, which talks to \a
+    server, using TCP if \a useTcp is true and UDP otherwise.
+*/
+
+DnsClient::DnsClient( int fd, const Endpoint & server, bool useTcp )
+    : Connection( fd, Connection::DnsClient ), lookups( 0 ), tcp( useTcp )
+{
+    connect( server );
+    EventLoop::global()->addConnection( this );
+}
+
+
+void DnsClient::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        parse();
+        break;
+
+    case Timeout:
+        fail( "DNS server timed out" );
+        break;
+
+    case Connect:
+    case Shutdown:
+        break;
+
+    case Error:
+    case Close:
+        fail( "Lost connection to DNS server" );
+        break;
+    }
+}
+
+
+/*! Reads the available datagrams and frames each of them like a TCP
+    DNS message. For TCP, this is just Connection::read().
+*/
+
+void DnsClient::read()
+{
+    if ( tcp ) {
+        Connection::read();
+        return;
+    }
+
+    char buf[65536];
+    int n = ::recv( fd(), buf, 65536, 0 );
+    while ( n >= 0 ) {
+        char l[2];
+        l[0] = ( n >> 8 ) & 0xff;
+        l[1] = n & 0xff;
+        readBuffer()->append( l, 2 );
+        readBuffer()->append( buf, n );
+        n = ::recv( fd(), buf, 65536, 0 );
+    }
+}
+
+
+/*! Sends each complete framed message in the write buffer as one
+    datagram. For TCP, this is just Connection::write().
+*/
+
+void DnsClient::write()
+{
+    if ( tcp ) {
+        Connection::write();
+        return;
+    }
+
+    Buffer * w = writeBuffer();
+    while ( w->size() >= 2 ) {
+        uint l = ( ( (uint)(unsigned char)(*w)[0] ) << 8 ) +
+                 (uint)(unsigned char)(*w)[1];
+        if ( w->size() < l + 2 )
+            return;
+        EString p = w->string( l + 2 ).mid( 2 );
+        if ( ::send( fd(), p.data(), p.length(), 0 ) < 0 &&
+             ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+            return;
+        w->remove( l + 2 );
+    }
+}
+
+
+/*! Sends \a packet, the query for \a lookup, whose id is in the
+    first two bytes of \a packet.
+*/
+
+void DnsClient::query( DnsLookup * lookup, const EString & packet )
+{
+    uint id = ( octet( packet, 0 ) << 8 ) + octet( packet, 1 );
+    pending.insert( id, lookup );
+    lookups++;
+
+    EString l;
+    l.append( (char)( ( packet.length() >> 8 ) & 0xff ) );
+    l.append( (char)( packet.length() & 0xff ) );
+    enqueue( l );
+    enqueue( packet );
+    if ( tcp )
+        setTimeoutAfter( 10 );
+}
+
+
+/*! Forgets the query with \a id, if any, so that a late reply is
+    ignored.
+*/
+
+void DnsClient::forget( uint id )
+{
+    if ( pending.find( id ) ) {
+        pending.remove( id );
+        lookups--;
+    }
+}
+
+
+/*! Hands each complete reply to its DnsLookup. */
+
+void DnsClient::parse()
+{
+    Buffer * r = readBuffer();
+    while ( r->size() >= 2 ) {
+        uint l = ( ( (uint)(unsigned char)(*r)[0] ) << 8 ) +
+                 (uint)(unsigned char)(*r)[1];
+        if ( r->size() < l + 2 )
+            return;
+        EString p = r->string( l + 2 ).mid( 2 );
+        r->remove( l + 2 );
+
+        uint id = ( octet( p, 0 ) << 8 ) + octet( p, 1 );
+        DnsLookup * lookup = 0;
+        if ( p.length() >= 12 )
+            lookup = pending.find( id );
+        if ( lookup ) {
+            forget( id );
+            lookup->parse( p );
+        }
+    }
+
+    if ( tcp && !lookups ) {
+        setState( Closing );
+    }
+}
+
+
+/*! Fails all pending lookups with \a error, and makes sure that this
+    client isn't used again.
+*/
+
+void DnsClient::fail( const EString & error )
+{
+    if ( this == ::udpClient ) {
+        Allocator::removeEternal( ::udpClient );
+        ::udpClient = 0;
+    }
+
+    List<DnsLookup> failing;
+    Map<DnsLookup>::Iterator i( pending );
+    while ( i ) {
+        failing.append( i );
+        ++i;
+    }
+    pending.clear();
+    lookups = 0;
+
+    List<DnsLookup>::Iterator f( failing );
+    while ( f ) {
+        DnsLookup * lookup = f;
+        ++f;
+        lookup->finish( error, 0 );
+    }
+
+    if ( state() != Closing )
+        setState( Closing );
+}
+
+
+/*! Returns the process's UDP DnsClient, creating it if necessary.
+    Returns a null pointer if no socket can be created.
+*/
+
+DnsClient * DnsClient::udp()
+{
+    if ( ::udpClient )
+        return ::udpClient;
+
+    Endpoint ns( nameserver() );
+    int fd = ::socket( ns.protocol() == Endpoint::IPv6 ? AF_INET6 : AF_INET,
+                       SOCK_DGRAM, 0 );
+    if ( fd < 0 )
+        return 0;
+    ::udpClient = new DnsClient( fd, ns, false );
+    Allocator::addEternal( ::udpClient, "DNS client" );
+    return ::udpClient;
+}
+
+
+/*! Returns the address of the first nameserver in the resolver
+    configuration, or 127.0.0.1 if none is configured.
+
+    The configuration is read by res_init(), which Resolver has
+    already called at startup, before the server entered its jail.
+*/
+
+Endpoint DnsClient::nameserver()
+{
+    if ( !( _res.options & RES_INIT ) )
+        res_init();
+    if ( _res.nscount > 0 && _res.nsaddr_list[0].sin_family == AF_INET )
+        return Endpoint( (struct sockaddr *)&_res.nsaddr_list[0],
+                         sizeof( struct sockaddr_in ) );
+    return Endpoint( "127.0.0.1", 53 );
+}
+
+
+class DnsLookupData
+    : public Garbage
+{
+public:
+    DnsLookupData()
+        : type( DnsLookup::A ), owner( 0 ), done( false ),
+          results( new EStringList ),
+          id( 0 ), tries( 0 ), timer( 0 ), client( 0 )
+    {}
+
+    EString name;
+    DnsLookup::Type type;
+    EventHandler * owner;
+    bool done;
+    EString error;
+    EStringList * results;
+    uint id;
+    uint tries;
+    Timer * timer;
+    DnsClient * client;
+};
+
+
+/*! \class DnsLookup dnslookup.h
+
+    The DnsLookup class looks up a DNS name without blocking the
+    event loop, and notifies its owner when the answer arrives.
+
+    Resolver uses res_query(), which blocks and so is only suitable
+    at startup. DnsLookup is for use while the server is running, e.g.
+    to find the MX hosts or SPF records for an address or to resolve
+    a smarthost name.
+
+    Answers, positive and negative, are cached for as long as their
+    TTL says (but at most a day), so repeated lookups for the same
+    name are cheap. A name with no records, or that doesn't exist,
+    gives an empty results() list and no error(); failed() is true
+    only if the lookup couldn't be done, e.g. because the nameserver
+    didn't answer. Such failures are not cached.
+
+    If no answer arrives within two seconds, the query is sent again,
+    up to three times with a doubling timeout.
+*/
+
+
+/*! Starts looking up records of \a type for \a name, and arranges to
+    notify \a owner when the lookup is done.
+
+    If the answer is in the cache, done() is true at once and \a owner
+    is not notified.
+*/
+
+DnsLookup::DnsLookup( const EString & name, Type type, EventHandler * owner )
+    : EventHandler(), d( new DnsLookupData )
+{
+    d->name = name.lower();
+    if ( d->name.endsWith( "." ) )
+        d->name.truncate( d->name.length() - 1 );
+    d->type = type;
+    d->owner = owner;
+    if ( owner )
+        setLog( new Log( owner->log() ) );
+    else
+        setLog( new Log );
+
+    if ( ::cache ) {
+        DnsCacheEntry * e =
+            ::cache->entries.find( cacheKey( d->name, type ) );
+        if ( e && e->expires > (uint)::time( 0 ) ) {
+            d->results = e->results;
+            d->error = e->error;
+            d->done = true;
+            return;
+        }
+    }
+
+    send();
+}
+
+
+/*! Resends the query when the timer expires, or gives up after the
+    third attempt.
+*/
+
+void DnsLookup::execute()
+{
+    if ( d->done )
+        return;
+
+    if ( d->client )
+        d->client->forget( d->id );
+    if ( d->tries >= 3 )
+        finish( "No answer from DNS server", 0 );
+    else
+        send();
+}
+
+
+/*! Sends a query for name() with a new id, using TCP if the last
+    answer was truncated, and starts the timer.
+*/
+
+void DnsLookup::send()
+{
+    EString p;
+
+    // the header: id, rd, and one question
+    d->id = 0;
+    while ( !d->id )
+        d->id = Entropy::asNumber( 2 ) & 0xffff;
+    p.append( (char)( d->id >> 8 ) );
+    p.append( (char)( d->id & 0xff ) );
+    p.append( (char)1 );
+    p.append( (char)0 );
+    p.append( (char)0 );
+    p.append( (char)1 );
+    uint i = 0;
+    while ( i < 6 ) {
+        p.append( (char)0 );
+        i++;
+    }
+
+    // the question
+    EStringList::Iterator l( EStringList::split( '.', d->name ) );
+    while ( l ) {
+        if ( l->isEmpty() || l->length() > 63 ) {
+            finish( "Invalid domain name: " + d->name, 0 );
+            return;
+        }
+        p.append( (char)l->length() );
+        p.append( *l );
+        ++l;
+    }
+    p.append( (char)0 );
+    p.append( (char)( d->type >> 8 ) );
+    p.append( (char)( d->type & 0xff ) );
+    p.append( (char)0 );
+    p.append( (char)C_IN );
+
+    if ( !d->client ) {
+        d->client = DnsClient::udp();
+        if ( !d->client ) {
+            finish( "Could not create DNS socket", 0 );
+            return;
+        }
+    }
+
+    Scope x( log() );
+    log( "Looking up " + d->name + " (type " + fn( (uint)d->type ) + ")",
+         Log::Debug );
+    d->client->query( this, p );
+    d->tries++;
+    delete d->timer;
+    d->timer = new Timer( this, 1 << d->tries );
+}
+
+
+/*! Parses the reply \a p and finishes the lookup, or, if \a p is a
+    truncated UDP reply, asks again using TCP.
+*/
+
+void DnsLookup::parse( const EString & p )
+{
+    Scope x( log() );
+
+    if ( octet( p, 2 ) & 0x02 ) {
+        // TC: the answer didn't fit into a datagram
+        Endpoint ns( DnsClient::nameserver() );
+        d->client = new DnsClient( Connection::socket( ns.protocol() ),
+                                   ns, true );
+        d->tries = 0;
+        log( "Retrying DNS lookup of " + d->name + " using TCP",
+             Log::Debug );
+        send();
+        return;
+    }
+
+    uint rcode = octet( p, 3 ) & 0x0f;
+    if ( rcode != 0 && rcode != 3 ) {
+        // SERVFAIL, REFUSED and so on; not worth caching
+        finish( "DNS server returned error " + fn( rcode ) +
+                " for " + d->name, 0 );
+        return;
+    }
+
+    uint qdcount = ( octet( p, 4 ) << 8 ) + octet( p, 5 );
+    uint ancount = ( octet( p, 6 ) << 8 ) + octet( p, 7 );
+    uint nscount = ( octet( p, 8 ) << 8 ) + octet( p, 9 );
+
+    bool ok = true;
+    uint i = 12;
+    while ( ok && qdcount ) {
+        (void)readName( p, i, ok );
+        i += 4;
+        qdcount--;
+    }
+
+    // the answers. we pick out records of the type we asked for,
+    // whatever their owner, which takes care of CNAME chains.
+
+    uint ttl = maxTtl;
+    Map<EStringList> mx;
+    EStringList * results = new EStringList;
+    while ( ok && ancount && i + 10 <= p.length() ) {
+        (void)readName( p, i, ok );
+        uint type = ( octet( p, i ) << 8 ) + octet( p, i+1 );
+        uint rttl = ( octet( p, i+4 ) << 24 ) + ( octet( p, i+5 ) << 16 ) +
+                    ( octet( p, i+6 ) << 8 ) + octet( p, i+7 );
+        uint rdlength = ( octet( p, i+8 ) << 8 ) + octet( p, i+9 );
+        i += 10;
+        if ( i + rdlength > p.length() )
+            ok = false;
+
+        EString a;
+        if ( !ok ) {
+            // nothing
+        }
+        else if ( type != (uint)d->type ) {
+            // a CNAME, most likely
+        }
+        else if ( type == A && rdlength == 4 ) {
+            uint n = 0;
+            while ( n < rdlength ) {
+                if ( !a.isEmpty() )
+                    a.append( '.' );
+                a.appendNumber( octet( p, i+n ) );
+                n++;
+            }
+        }
+        else if ( type == Aaaa && rdlength == 16 ) {
+            uint n = 0;
+            while ( n < rdlength ) {
+                if ( !a.isEmpty() )
+                    a.append( ':' );
+                a.append( fn( ( octet( p, i+n ) << 8 ) + octet( p, i+n+1 ),
+                              16 ) );
+                n += 2;
+            }
+        }
+        else if ( type == Mx && rdlength > 2 ) {
+            uint preference = ( octet( p, i ) << 8 ) + octet( p, i+1 );
+            uint n = i + 2;
+            EString host = readName( p, n, ok );
+            if ( ok && !host.isEmpty() ) {
+                EStringList * l = mx.find( preference + 1 );
+                if ( !l ) {
+                    l = new EStringList;
+                    mx.insert( preference + 1, l );
+                }
+                l->append( host );
+                if ( rttl < ttl )
+                    ttl = rttl;
+            }
+        }
+
+        if ( !a.isEmpty() ) {
+            Endpoint e( a, 1 );
+            if ( e.valid() ) {
+                results->append( e.address() );
+                if ( rttl < ttl )
+                    ttl = rttl;
+            }
+        }
+        i += rdlength;
+        ancount--;
+    }
+
+    if ( d->type == Mx ) {
+        Map<EStringList>::Iterator m( mx );
+        while ( m ) {
+            results->append( *m );
+            ++m;
+        }
+    }
+
+    // for a negative answer, the SOA in the authority section says
+    // how long to remember it (RFC 2308)
+
+    if ( results->isEmpty() ) {
+        ttl = defaultNegativeTtl;
+        while ( ok && nscount && i + 10 <= p.length() ) {
+            (void)readName( p, i, ok );
+            uint type = ( octet( p, i ) << 8 ) + octet( p, i+1 );
+            uint rttl = ( octet( p, i+4 ) << 24 ) +
+                        ( octet( p, i+5 ) << 16 ) +
+                        ( octet( p, i+6 ) << 8 ) + octet( p, i+7 );
+            uint rdlength = ( octet( p, i+8 ) << 8 ) + octet( p, i+9 );
+            i += 10;
+            if ( type == T_SOA && i + rdlength <= p.length() ) {
+                uint n = i;
+                (void)readName( p, n, ok );
+                (void)readName( p, n, ok );
+                n += 16;
+                uint minimum = ( octet( p, n ) << 24 ) +
+                               ( octet( p, n+1 ) << 16 ) +
+                               ( octet( p, n+2 ) << 8 ) + octet( p, n+3 );
+                if ( ok && n + 4 <= i + rdlength ) {
+                    ttl = rttl;
+                    if ( minimum < ttl )
+                        ttl = minimum;
+                }
+            }
+            i += rdlength;
+            nscount--;
+        }
+    }
+
+    if ( !ok && results->isEmpty() ) {
+        finish( "Parse error in DNS response for " + d->name, 0 );
+        return;
+    }
+
+    d->results = results;
+    finish( "", ttl );
+}
+
+
+/*! Records the result of this lookup, with \a error if it failed,
+    caches it for \a ttl seconds if \a ttl is nonzero, and notifies
+    the owner.
+*/
+
+void DnsLookup::finish( const EString & error, uint ttl )
+{
+    if ( d->done )
+        return;
+
+    d->done = true;
+    d->error = error;
+    delete d->timer;
+    d->timer = 0;
+    if ( !error.isEmpty() )
+        d->results = new EStringList;
+
+    Scope x( log() );
+    if ( !error.isEmpty() )
+        log( error, Log::Error );
+    else
+        log( "Found " + fn( d->results->count() ) + " records for " +
+             d->name, Log::Debug );
+
+    if ( ttl && error.isEmpty() ) {
+        if ( ttl > maxTtl )
+            ttl = maxTtl;
+        if ( !::cache ) {
+            ::cache = new DnsCache;
+            Allocator::addEternal( ::cache, "DNS cache" );
+        }
+        DnsCacheEntry * e = new DnsCacheEntry;
+        e->results = d->results;
+        e->expires = (uint)::time( 0 ) + ttl;
+        ::cache->entries.insert( cacheKey( d->name, d->type ), e );
+    }
+
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
+/*! Returns the name looked up, in lower case and without a trailing
+    dot.
+*/
+
+EString DnsLookup::name() const
+{
+    return d->name;
+}
+
+
+/*! Returns the type of record looked up, as specified to the
+    constructor.
+*/
+
+DnsLookup::Type DnsLookup::type() const
+{
+    return d->type;
+}
+
+
+/*! Returns true if this lookup has finished, successfully or not. */
+
+bool DnsLookup::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if this lookup has finished and could not get an
+    answer from the DNS, and false otherwise. A name that doesn't
+    exist is not a failure.
+*/
+
+bool DnsLookup::failed() const
+{
+    return d->done && !d->error.isEmpty();
+}
+
+
+/*! Returns the error message if failed() is true, and an empty string
+    otherwise.
+*/
+
+EString DnsLookup::error() const
+{
+    return d->error;
+}
+
+
+/*! Returns the records found. For A and AAAA lookups, these are
+    addresses in the form Endpoint::address() uses. For MX lookups,
+    they are host names, most preferred first. The list is empty if
+    the name has no such records or the lookup failed.
+*/
+
+EStringList DnsLookup::results() const
+{
+    return *d->results;
+}
@@ -0,0 +1,38 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef DNSLOOKUP_H
+#define DNSLOOKUP_H
+
+#include "event.h"
+#include "estringlist.h"
+
+
+class DnsLookup
+    : public EventHandler
+{
+public:
+    enum Type { A = 1, Mx = 15, Aaaa = 28 };
+
+    DnsLookup( const EString &, Type, EventHandler * );
+
+    void execute();
+
+    EString name() const;
+    Type type() const;
+
+    bool done() const;
+    bool failed() const;
+    EString error() const;
+    EStringList results() const;
+
+private:
+    class DnsLookupData * d;
+    friend class DnsClient;
+
+    void send();
+    void parse( const EString & );
+    void finish( const EString &, uint );
+};
+
+
+#endif
@@ -0,0 +1,854 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+// select, fd_set
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+// close, getpid
+#include <unistd.h>
+// errno
+#include <errno.h>
+// memset, memcpy (and for FD_* under OpenBSD)
+#include <string.h>
+
+#if defined(__linux__)
+#define EVENTBACKEND_EPOLL
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define EVENTBACKEND_IO_URING
+// io_uring_setup, io_uring_enter
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+// mmap, munmap
+#include <sys/mman.h>
+// POLLIN, POLLOUT
+#include <poll.h>
+#endif
+#endif
+
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || \
+    defined(__DragonFly__) || defined(__APPLE__)
+#define EVENTBACKEND_KQUEUE
+// kqueue, kevent
+#include <sys/event.h>
+#endif
+
+#include "eventbackend.h"
+
+#include "allocator.h"
+#include "estring.h"
+#include "log.h"
+
+
+/*! \class EventBackend eventbackend.h
+
+    The EventBackend class is the part of EventLoop that asks the
+    operating system which file descriptors are ready.
+
+    Each pass through the EventLoop calls prepare(), then watch() once
+    for each Connection, then wait(), and finally takeEvents() for
+    each Connection. Backends that are able to do so (epoll and
+    io_uring on Linux, kqueue on the BSDs) remember what each file
+    descriptor is interested in and tell the kernel only about
+    changes, so that the cost of a pass depends on the number of
+    active connections rather than the total number. The select()
+    backend rebuilds its fd_sets every time, as EventLoop always used
+    to do, and is always available as a fallback.
+
+    The backend is chosen using the event-backend configuration
+    variable; see create().
+*/
+
+
+/*! Constructs an EventBackend. Only subclasses can be created. */
+
+EventBackend::EventBackend()
+    : Garbage()
+{
+}
+
+
+/*! Exists only to avoid compiler warnings. */
+
+EventBackend::~EventBackend()
+{
+}
+
+
+/*! \fn const char * EventBackend::name() const
+
+    Returns the name of this backend, as used in the event-backend
+    configuration variable.
+*/
+
+
+/*! \fn void EventBackend::prepare()
+
+    Called at the start of each pass through the event loop, before
+    watch() is called for any Connection.
+*/
+
+
+/*! \fn void EventBackend::watch( Connection * c, int fd, bool r, bool w )
+
+    Records that \a c, which currently uses \a fd, wants to know
+    whether \a fd is readable (if \a r is true) and/or writable (if \a
+    w is true) during this pass.
+*/
+
+
+/*! \fn void EventBackend::forget( int fd )
+
+    Instructs the backend to stop watching \a fd, e.g. because its
+    Connection has been removed from the event loop.
+*/
+
+
+/*! \fn void EventBackend::wait( uint ms )
+
+    Waits at most \a ms milliseconds for at least one watched file
+    descriptor to become ready.
+*/
+
+
+/*! \fn uint EventBackend::takeEvents( int fd )
+
+    Returns a bitmask of Readiness values describing \a fd after the
+    last wait(), and clears them so that a subsequent call during the
+    same pass returns 0.
+*/
+
+
+class SelectBackend
+    : public EventBackend
+{
+public:
+    SelectBackend(): EventBackend(), maxfd( -1 ) {
+        FD_ZERO( &r );
+        FD_ZERO( &w );
+    }
+
+    const char * name() const { return "select"; }
+
+    void prepare() {
+        FD_ZERO( &r );
+        FD_ZERO( &w );
+        maxfd = -1;
+    }
+
+    void watch( Connection *, int fd, bool rd, bool wr ) {
+        if ( fd < 0 || fd >= FD_SETSIZE )
+            return;
+        if ( !rd && !wr )
+            return;
+        if ( fd > maxfd )
+            maxfd = fd;
+        if ( rd )
+            FD_SET( fd, &r );
+        if ( wr )
+            FD_SET( fd, &w );
+    }
+
+    void forget( int fd ) {
+        if ( fd < 0 || fd >= FD_SETSIZE )
+            return;
+        FD_CLR( fd, &r );
+        FD_CLR( fd, &w );
+    }
+
+    void wait( uint ms ) {
+        struct timeval tv;
+        tv.tv_sec = ms / 1000;
+        tv.tv_usec = ( ms % 1000 ) * 1000;
+        if ( ::select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
+            // r and w are undefined. we clear them, and dispatch()
+            // won't jump to conclusions
+            FD_ZERO( &r );
+            FD_ZERO( &w );
+        }
+    }
+
+    uint takeEvents( int fd ) {
+        if ( fd < 0 || fd >= FD_SETSIZE )
+            return 0;
+        uint e = 0;
+        if ( FD_ISSET( fd, &r ) )
+            e |= Readable;
+        if ( FD_ISSET( fd, &w ) )
+            e |= Writable;
+        FD_CLR( fd, &r );
+        FD_CLR( fd, &w );
+        return e;
+    }
+
+    int maxfd;
+    fd_set r, w;
+};
+
+
+#if defined(EVENTBACKEND_EPOLL) || defined(EVENTBACKEND_KQUEUE) || \
+    defined(EVENTBACKEND_IO_URING)
+
+/*! This helper records, for each file descriptor, which Connection
+    registered it with the kernel and with what interest, so that
+    PollingBackend subclasses need only talk to the kernel about
+    changes.
+
+    The owner is kept so that a file descriptor which is closed and
+    reused for a new Connection between two passes is registered
+    anew.
+*/
+
+class PollingBackend
+    : public EventBackend
+{
+public:
+    PollingBackend()
+        : EventBackend(),
+          slots( 0 ), size( 0 ), pass( 1 ), always( 0 ), pid( 0 ) {}
+
+    struct Slot {
+        Connection * owner;
+        uint registered;
+        uint ready;
+        uint watched;
+        uint readyPass;
+        uint armed;
+        bool pollable;
+    };
+
+    Slot * slot( int fd ) {
+        if ( fd < 0 )
+            return 0;
+        if ( (uint)fd >= size ) {
+            uint n = size ? size : 256;
+            while ( n <= (uint)fd )
+                n *= 2;
+            Slot * s = (Slot*)Allocator::alloc( n * sizeof( Slot ) );
+            memset( s, 0, n * sizeof( Slot ) );
+            if ( slots ) {
+                memcpy( s, slots, size * sizeof( Slot ) );
+                Allocator::dealloc( slots );
+            }
+            slots = s;
+            size = n;
+        }
+        return &slots[fd];
+    }
+
+    void prepare() {
+        pass++;
+        always = 0;
+        if ( pid != ::getpid() ) {
+            // a fork() happened since we last looked at the kernel
+            // (or we've never looked). start from scratch.
+            reopen();
+            pid = ::getpid();
+            uint i = 0;
+            while ( i < size ) {
+                slots[i].owner = 0;
+                slots[i].registered = 0;
+                slots[i].pollable = false;
+                i++;
+            }
+        }
+    }
+
+    void watch( Connection * c, int fd, bool r, bool w ) {
+        Slot * s = slot( fd );
+        if ( !s )
+            return;
+        uint mask = 0;
+        if ( r )
+            mask |= Readable;
+        if ( w )
+            mask |= Writable;
+        s->watched = pass;
+        if ( s->owner != c ) {
+            // a new Connection, or a new fd; whatever the kernel may
+            // know is about someone else.
+            s->pollable = true;
+            s->owner = c;
+            if ( !change( fd, s->registered, mask, true ) )
+                s->pollable = false;
+            s->registered = mask;
+        }
+        else if ( s->registered != mask ) {
+            if ( s->pollable && !change( fd, s->registered, mask, false ) )
+                s->pollable = false;
+            s->registered = mask;
+        }
+        if ( !s->pollable && mask )
+            always++;
+    }
+
+    void forget( int fd ) {
+        Slot * s = slot( fd );
+        if ( !s )
+            return;
+        if ( s->registered && s->pollable )
+            change( fd, s->registered, 0, false );
+        s->owner = 0;
+        s->registered = 0;
+        s->ready = 0;
+    }
+
+    uint takeEvents( int fd ) {
+        if ( fd < 0 || (uint)fd >= size )
+            return 0;
+        Slot * s = &slots[fd];
+        uint e = 0;
+        if ( s->watched != pass )
+            return 0;
+        if ( !s->pollable )
+            e = s->registered;
+        else if ( s->readyPass == pass )
+            e = s->ready;
+        s->ready = 0;
+        s->watched = 0;
+        return e;
+    }
+
+    /*! Records that the kernel says \a fd is ready with \a mask. If
+        \a fd wasn't watched during this pass, the kernel knows about
+        an fd that no Connection uses any more (for example because
+        TlsThread took it over), and we tell the kernel to forget it.
+    */
+    void ready( int fd, uint mask ) {
+        Slot * s = slot( fd );
+        if ( !s )
+            return;
+        if ( s->watched != pass ) {
+            change( fd, s->registered, 0, true );
+            s->owner = 0;
+            s->registered = 0;
+            return;
+        }
+        if ( s->readyPass != pass )
+            s->ready = 0;
+        s->ready |= mask;
+        s->readyPass = pass;
+    }
+
+    /*! Returns the timeout to use when the caller asks for \a ms:
+        If there are any fds the kernel can't poll (regular files,
+        for example), they are always ready and we mustn't sleep.
+    */
+    uint timeout( uint ms ) const {
+        if ( always )
+            return 0;
+        return ms;
+    }
+
+    virtual void reopen() = 0;
+    virtual bool change( int, uint, uint, bool ) = 0;
+
+    Slot * slots;
+    uint size;
+    uint pass;
+    uint always;
+    pid_t pid;
+};
+
+#endif
+
+
+#if defined(EVENTBACKEND_IO_URING)
+
+static int ioUringSetup( uint entries, struct io_uring_params * p )
+{
+    return (int)::syscall( __NR_io_uring_setup, entries, p );
+}
+
+
+static int ioUringEnter( int fd, uint submit, uint wait, uint flags )
+{
+    return (int)::syscall( __NR_io_uring_enter, fd, submit, wait, flags,
+                           0, 0 );
+}
+
+
+/*! This backend uses io_uring. Each watched fd has a one-shot poll
+    request in the kernel; all the requests made or changed during a
+    pass go to the kernel together with the wait, in one
+    io_uring_enter() call, where the epoll backend needs one
+    epoll_ctl() per change.
+
+    A poll request goes away when it completes, so watch() arms it
+    again the next time the fd is watched. Each request is tagged
+    with a sequence number as well as the fd, so that completions for
+    requests that have since been removed are recognised and ignored.
+*/
+
+class IoUringBackend
+    : public PollingBackend
+{
+public:
+    IoUringBackend()
+        : PollingBackend(), ring( -1 ),
+          sqMap( 0 ), sqMapSize( 0 ), cqMap( 0 ), cqMapSize( 0 ),
+          sqes( 0 ), sqesSize( 0 ),
+          sqHead( 0 ), sqTail( 0 ), sqMask( 0 ), sqArray( 0 ),
+          cqHead( 0 ), cqTail( 0 ), cqMask( 0 ), cqes( 0 ),
+          sqEntries( 0 ), tail( 0 ), pending( 0 ), sequence( 0 ) {
+        memset( &ts, 0, sizeof( ts ) );
+    }
+
+    const char * name() const { return "io_uring"; }
+
+    static bool available() {
+        struct io_uring_params p;
+        memset( &p, 0, sizeof( p ) );
+        int fd = ioUringSetup( 2, &p );
+        if ( fd < 0 )
+            return false;
+        ::close( fd );
+        return true;
+    }
+
+    void unmap() {
+        if ( sqes )
+            ::munmap( sqes, sqesSize );
+        if ( cqMap && cqMap != sqMap )
+            ::munmap( cqMap, cqMapSize );
+        if ( sqMap )
+            ::munmap( sqMap, sqMapSize );
+        if ( ring >= 0 )
+            ::close( ring );
+        sqes = 0;
+        cqMap = 0;
+        sqMap = 0;
+        ring = -1;
+    }
+
+    void reopen() {
+        // after fork() the maps are shared with the parent's ring,
+        // so we drop them without touching the ring itself.
+        unmap();
+        uint i = 0;
+        while ( i < size )
+            slots[i++].armed = 0;
+        pending = 0;
+
+        struct io_uring_params p;
+        memset( &p, 0, sizeof( p ) );
+        ring = ioUringSetup( Entries, &p );
+        if ( ring < 0 ) {
+            ::log( "io_uring_setup() failed with errno " + fn( errno ),
+                   Log::Disaster );
+            return;
+        }
+
+        sqMapSize = p.sq_off.array + p.sq_entries * sizeof( uint );
+        cqMapSize = p.cq_off.cqes +
+                    p.cq_entries * sizeof( struct io_uring_cqe );
+        if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+            if ( cqMapSize > sqMapSize )
+                sqMapSize = cqMapSize;
+            cqMapSize = sqMapSize;
+        }
+        sqMap = (char*)::mmap( 0, sqMapSize, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring,
+                               IORING_OFF_SQ_RING );
+        if ( p.features & IORING_FEAT_SINGLE_MMAP )
+            cqMap = sqMap;
+        else
+            cqMap = (char*)::mmap( 0, cqMapSize, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, ring,
+                                   IORING_OFF_CQ_RING );
+        sqesSize = p.sq_entries * sizeof( struct io_uring_sqe );
+        sqes = (struct io_uring_sqe*)
+               ::mmap( 0, sqesSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES );
+        if ( sqMap == MAP_FAILED || cqMap == MAP_FAILED ||
+             sqes == MAP_FAILED ) {
+            ::log( "Could not map io_uring queues, errno " + fn( errno ),
+                   Log::Disaster );
+            if ( sqMap == MAP_FAILED )
+                sqMap = 0;
+            if ( cqMap == MAP_FAILED )
+                cqMap = 0;
+            if ( sqes == MAP_FAILED )
+                sqes = 0;
+            unmap();
+            return;
+        }
+
+        sqHead = (uint*)( sqMap + p.sq_off.head );
+        sqTail = (uint*)( sqMap + p.sq_off.tail );
+        sqMask = *(uint*)( sqMap + p.sq_off.ring_mask );
+        sqArray = (uint*)( sqMap + p.sq_off.array );
+        sqEntries = p.sq_entries;
+        cqHead = (uint*)( cqMap + p.cq_off.head );
+        cqTail = (uint*)( cqMap + p.cq_off.tail );
+        cqMask = *(uint*)( cqMap + p.cq_off.ring_mask );
+        cqes = (struct io_uring_cqe*)( cqMap + p.cq_off.cqes );
+        tail = *sqTail;
+    }
+
+    /*! Returns a cleared submission queue entry, or a null pointer if
+        the queue is full even after handing what's in it to the
+        kernel.
+    */
+    struct io_uring_sqe * entry() {
+        if ( ring < 0 )
+            return 0;
+        if ( tail - __atomic_load_n( sqHead, __ATOMIC_ACQUIRE ) >=
+             sqEntries ) {
+            submit( 0, 0 );
+            if ( tail - __atomic_load_n( sqHead, __ATOMIC_ACQUIRE ) >=
+                 sqEntries )
+                return 0;
+        }
+        uint i = tail & sqMask;
+        sqArray[i] = i;
+        tail++;
+        pending++;
+        struct io_uring_sqe * e = &sqes[i];
+        memset( e, 0, sizeof( *e ) );
+        return e;
+    }
+
+    /*! Publishes the queued entries and calls io_uring_enter(),
+        waiting for \a wait completions if \a flags says so.
+    */
+    void submit( uint wait, uint flags ) {
+        __atomic_store_n( sqTail, tail, __ATOMIC_RELEASE );
+        int r = ioUringEnter( ring, pending, wait, flags );
+        if ( r > 0 )
+            pending -= ( (uint)r < pending ) ? (uint)r : pending;
+    }
+
+    bool arm( int fd, Slot * s, uint mask ) {
+        struct io_uring_sqe * e = entry();
+        if ( !e )
+            return false;
+        uint events = 0;
+        if ( mask & Readable )
+            events |= POLLIN;
+        if ( mask & Writable )
+            events |= POLLOUT;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        // the kernel reads poll32_events word-swapped on big-endian
+        events = ( events << 16 ) | ( events >> 16 );
+#endif
+        if ( !++sequence )
+            ++sequence;
+        e->opcode = IORING_OP_POLL_ADD;
+        e->fd = fd;
+        e->poll32_events = events;
+        e->user_data = ( (__u64)sequence << 32 ) | (uint)fd;
+        s->armed = sequence;
+        return true;
+    }
+
+    void disarm( int fd, Slot * s ) {
+        if ( !s->armed )
+            return;
+        struct io_uring_sqe * e = entry();
+        if ( e ) {
+            // removal and timeout completions have sequence 0, which
+            // no poll request has, so they're ignored when reaped
+            e->opcode = IORING_OP_POLL_REMOVE;
+            e->fd = -1;
+            e->addr = ( (__u64)s->armed << 32 ) | (uint)fd;
+        }
+        s->armed = 0;
+    }
+
+    bool change( int fd, uint, uint to, bool ) {
+        Slot * s = slot( fd );
+        if ( !s )
+            return true;
+        disarm( fd, s );
+        if ( to )
+            return arm( fd, s, to );
+        return true;
+    }
+
+    void watch( Connection * c, int fd, bool r, bool w ) {
+        PollingBackend::watch( c, fd, r, w );
+        Slot * s = slot( fd );
+        if ( s && s->pollable && s->registered && !s->armed &&
+             !arm( fd, s, s->registered ) )
+            s->pollable = false;
+    }
+
+    void wait( uint ms ) {
+        if ( ring < 0 )
+            return;
+        ms = timeout( ms );
+        uint want = 0;
+        if ( ms ) {
+            struct io_uring_sqe * e = entry();
+            if ( e ) {
+                ts.tv_sec = ms / 1000;
+                ts.tv_nsec = ( ms % 1000 ) * 1000000;
+                e->opcode = IORING_OP_TIMEOUT;
+                e->fd = -1;
+                e->addr = (unsigned long)&ts;
+                e->len = 1;
+                // complete as soon as anything else does
+                e->off = 1;
+                want = 1;
+            }
+        }
+        submit( want, want ? IORING_ENTER_GETEVENTS : 0 );
+
+        uint head = *cqHead;
+        uint end = __atomic_load_n( cqTail, __ATOMIC_ACQUIRE );
+        while ( head != end ) {
+            struct io_uring_cqe * c = &cqes[head & cqMask];
+            uint seq = (uint)( c->user_data >> 32 );
+            int fd = (int)( c->user_data & 0xffffffff );
+            Slot * s = seq ? slot( fd ) : 0;
+            if ( s && s->armed == seq ) {
+                s->armed = 0;
+                uint mask = 0;
+                if ( c->res < 0 )
+                    mask = Readable | Writable;
+                if ( c->res & ( POLLIN | POLLHUP | POLLERR ) )
+                    mask |= Readable;
+                if ( c->res & ( POLLOUT | POLLHUP | POLLERR ) )
+                    mask |= Writable;
+                if ( c->res != -ECANCELED )
+                    ready( fd, mask );
+            }
+            head++;
+        }
+        __atomic_store_n( cqHead, head, __ATOMIC_RELEASE );
+    }
+
+    static const uint Entries = 4096;
+
+    int ring;
+    char * sqMap;
+    size_t sqMapSize;
+    char * cqMap;
+    size_t cqMapSize;
+    struct io_uring_sqe * sqes;
+    size_t sqesSize;
+    uint * sqHead;
+    uint * sqTail;
+    uint sqMask;
+    uint * sqArray;
+    uint * cqHead;
+    uint * cqTail;
+    uint cqMask;
+    struct io_uring_cqe * cqes;
+    uint sqEntries;
+    uint tail;
+    uint pending;
+    uint sequence;
+    struct __kernel_timespec ts;
+};
+
+#endif
+
+
+#if defined(EVENTBACKEND_EPOLL)
+
+class EpollBackend
+    : public PollingBackend
+{
+public:
+    EpollBackend()
+        : PollingBackend(), epfd( -1 ), events( 0 ) {
+        events = (struct epoll_event*)
+                 Allocator::alloc( MaxEvents * sizeof( struct epoll_event ),
+                                   0 );
+    }
+
+    const char * name() const { return "epoll"; }
+
+    void reopen() {
+        if ( epfd >= 0 )
+            ::close( epfd );
+        epfd = ::epoll_create( 1024 );
+        if ( epfd < 0 )
+            ::log( "epoll_create() failed with errno " + fn( errno ),
+                   Log::Disaster );
+    }
+
+    bool change( int fd, uint from, uint to, bool unsure ) {
+        if ( !to ) {
+            if ( from || unsure )
+                ::epoll_ctl( epfd, EPOLL_CTL_DEL, fd, 0 );
+            return true;
+        }
+
+        struct epoll_event e;
+        memset( &e, 0, sizeof( e ) );
+        if ( to & Readable )
+            e.events |= EPOLLIN;
+        if ( to & Writable )
+            e.events |= EPOLLOUT;
+        e.data.fd = fd;
+
+        int op = EPOLL_CTL_ADD;
+        if ( from )
+            op = EPOLL_CTL_MOD;
+        int r = ::epoll_ctl( epfd, op, fd, &e );
+        if ( r < 0 && errno == ENOENT && op == EPOLL_CTL_MOD )
+            r = ::epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &e );
+        else if ( r < 0 && errno == EEXIST && op == EPOLL_CTL_ADD )
+            r = ::epoll_ctl( epfd, EPOLL_CTL_MOD, fd, &e );
+        // EPERM means that fd is something epoll can't handle, such
+        // as a regular file. select() would always consider such fds
+        // ready, so we do the same.
+        if ( r < 0 && errno == EPERM )
+            return false;
+        return true;
+    }
+
+    void wait( uint ms ) {
+        int n = ::epoll_wait( epfd, events, MaxEvents, timeout( ms ) );
+        int i = 0;
+        while ( i < n ) {
+            uint mask = 0;
+            if ( events[i].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+                mask |= Readable;
+            if ( events[i].events & ( EPOLLOUT | EPOLLHUP | EPOLLERR ) )
+                mask |= Writable;
+            ready( events[i].data.fd, mask );
+            i++;
+        }
+    }
+
+    static const int MaxEvents = 1024;
+
+    int epfd;
+    struct epoll_event * events;
+};
+
+#endif
+
+
+#if defined(EVENTBACKEND_KQUEUE)
+
+class KqueueBackend
+    : public PollingBackend
+{
+public:
+    KqueueBackend()
+        : PollingBackend(), kq( -1 ), events( 0 ) {
+        events = (struct kevent*)
+                 Allocator::alloc( MaxEvents * sizeof( struct kevent ), 0 );
+    }
+
+    const char * name() const { return "kqueue"; }
+
+    void reopen() {
+        // kqueues aren't inherited by children, so after fork() the
+        // old kq is meaningless and we mustn't close() it.
+        if ( kq >= 0 && pid == ::getpid() )
+            ::close( kq );
+        kq = ::kqueue();
+        if ( kq < 0 )
+            ::log( "kqueue() failed with errno " + fn( errno ),
+                   Log::Disaster );
+    }
+
+    bool filter( int fd, short f, bool on ) {
+        struct kevent k;
+        EV_SET( &k, fd, f, on ? EV_ADD : EV_DELETE, 0, 0, 0 );
+        int r = ::kevent( kq, &k, 1, 0, 0, 0 );
+        if ( r < 0 && on && errno != ENOENT )
+            return false;
+        return true;
+    }
+
+    bool change( int fd, uint from, uint to, bool unsure ) {
+        bool ok = true;
+        if ( ( to & Readable ) && ( unsure || !( from & Readable ) ) )
+            ok = filter( fd, EVFILT_READ, true ) && ok;
+        else if ( !( to & Readable ) && ( unsure || ( from & Readable ) ) )
+            filter( fd, EVFILT_READ, false );
+        if ( ( to & Writable ) && ( unsure || !( from & Writable ) ) )
+            ok = filter( fd, EVFILT_WRITE, true ) && ok;
+        else if ( !( to & Writable ) && ( unsure || ( from & Writable ) ) )
+            filter( fd, EVFILT_WRITE, false );
+        return ok;
+    }
+
+    void wait( uint ms ) {
+        struct timespec ts;
+        ms = timeout( ms );
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = ( ms % 1000 ) * 1000000;
+        int n = ::kevent( kq, 0, 0, events, MaxEvents, &ts );
+        int i = 0;
+        while ( i < n ) {
+            uint mask = 0;
+            if ( events[i].filter == EVFILT_READ ||
+                 ( events[i].flags & ( EV_EOF | EV_ERROR ) ) )
+                mask |= Readable;
+            if ( events[i].filter == EVFILT_WRITE ||
+                 ( events[i].flags & ( EV_EOF | EV_ERROR ) ) )
+                mask |= Writable;
+            ready( (int)events[i].ident, mask );
+            i++;
+        }
+    }
+
+    static const int MaxEvents = 1024;
+
+    int kq;
+    struct kevent * events;
+};
+
+#endif
+
+
+/*! Creates and returns the backend named \a name, which may be
+    "select", "epoll", "io_uring", "kqueue" or "auto". "auto" (and the
+    empty string) picks the best backend supported by the operating
+    system; it does not pick io_uring, which must be asked for.
+
+    If io_uring is asked for but the kernel refuses (too old, or
+    forbidden by a seccomp policy), create() logs an error and uses
+    epoll.
+
+    If \a name is unknown or not supported on this platform, create()
+    logs an error and uses the select() backend.
+*/
+
+EventBackend * EventBackend::create( const EString & name )
+{
+    EString n = name.lower();
+    if ( n.isEmpty() || n == "auto" ) {
+#if defined(EVENTBACKEND_EPOLL)
+        n = "epoll";
+#elif defined(EVENTBACKEND_KQUEUE)
+        n = "kqueue";
+#else
+        n = "select";
+#endif
+    }
+
+#if defined(EVENTBACKEND_IO_URING)
+    if ( n == "io_uring" || n == "io-uring" ) {
+        if ( IoUringBackend::available() )
+            return new IoUringBackend;
+        ::log( "io_uring is not available (errno " + fn( errno ) +
+               "), using epoll", Log::Error );
+        n = "epoll";
+    }
+#endif
+#if defined(EVENTBACKEND_EPOLL)
+    if ( n == "epoll" )
+        return new EpollBackend;
+#endif
+#if defined(EVENTBACKEND_KQUEUE)
+    if ( n == "kqueue" )
+        return new KqueueBackend;
+#endif
+    if ( n != "select" )
+        ::log( "event-backend " + n.quoted() +
+               " is not supported here, using select", Log::Error );
+    return new SelectBackend;
+}
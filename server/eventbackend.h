@@ -0,0 +1,34 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef EVENTBACKEND_H
+#define EVENTBACKEND_H
+
+#include "global.h"
+
+
+class Connection;
+class EString;
+
+
+class EventBackend
+    : public Garbage
+{
+public:
+    EventBackend();
+    virtual ~EventBackend();
+
+    static EventBackend * create( const EString & );
+
+    virtual const char * name() const = 0;
+
+    enum Readiness { Readable = 1, Writable = 2 };
+
+    virtual void prepare() = 0;
+    virtual void watch( Connection *, int, bool, bool ) = 0;
+    virtual void forget( int ) = 0;
+    virtual void wait( uint ) = 0;
+    virtual uint takeEvents( int ) = 0;
+};
+
+
+#endif
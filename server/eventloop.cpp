@@ -3,6 +3,8 @@
 #include "eventloop.h"
 
 #include "connection.h"
+#include "eventbackend.h"
+#include "configuration.h"
 #include "allocator.h"
 #include "buffer.h"
 #include "estring.h"
@@ -10,6 +12,8 @@
 #include "scope.h"
 #include "timer.h"
 #include "graph.h"
+#include "profiler.h"
+#include "tlsthread.h"
 #include "event.h"
 #include "list.h"
 #include "log.h"
@@ -18,19 +22,17 @@
 #include <time.h>
 // errno
 #include <errno.h>
-// struct timeval, fd_set
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/select.h>
+// malloc, free
+#include <stdlib.h>
 // getsockopt, SOL_SOCKET, SO_ERROR
+#include <sys/types.h>
 #include <sys/socket.h>
-// read, select
+// read
 #include <unistd.h>
 // ioctl, FIONREAD
 #include <sys/ioctl.h>
-
-// memset (for FD_* under OpenBSD)
-#include <string.h>
+// gettimeofday
+#include <sys/time.h>
 
 
 static bool freeMemorySoon;
@@ -39,21 +41,48 @@ static bool freeMemorySoon;
 static EventLoop * loop;
 
 
+// the number of one-second slots in the timer wheel
+static const uint wheelSlots = 1024;
+
+
 class LoopData
     : public Garbage
 {
 public:
     LoopData()
-        : log( new Log ), startup( false ),
-          stop( false ), limit( 16 * 1024 * 1024 )
+        : log( new Log ), backend( 0 ), startup( false ),
+          stop( false ), limit( 16 * 1024 * 1024 ), slice( 0 ),
+          lastTimerRun( time( 0 ) ),
+          drainRequest( 0 ), drainStart( 0 ), drainUntil( 0 ),
+          drainTotal( 0 ), drainLast( 0 )
     {}
 
     Log *log;
+    EventBackend * backend;
     bool startup;
     bool stop;
     List< Connection > connections;
-    List< Timer > timers;
     uint limit;
+    uint slice;
+
+    // each Timer is in the slot for its timeout, modulo wheelSlots,
+    // or in the next slot to be run if its timeout has passed.
+    uint lastTimerRun;
+    List< Timer > wheel[wheelSlots];
+
+    // set by drain() (possibly in a signal handler), then acted on
+    // by the loop
+    volatile uint drainRequest;
+    uint drainStart;
+    uint drainUntil;
+    uint drainTotal;
+    uint drainLast;
+
+    List< Timer > * slot( uint t ) {
+        if ( t <= lastTimerRun )
+            t = lastTimerRun + 1;
+        return &wheel[t % wheelSlots];
+    }
 
     class Stopper
         : public EventHandler
@@ -84,6 +113,10 @@ public:
     and periodically informs them about any events (e.g., read/write,
     errors, timeouts) that occur. The loop continues until something
     calls stop().
+
+    The EventLoop uses an EventBackend to find out which Connections
+    are ready. The backend is chosen by the event-backend
+    configuration variable when start() is called.
 */
 
 
@@ -106,6 +139,7 @@ void EventLoop::setup( EventLoop * l )
 EventLoop::EventLoop()
     : d( new LoopData )
 {
+    d->log->setLabel( "event loop" );
 }
 
 
@@ -152,6 +186,11 @@ void EventLoop::removeConnection( Connection * c )
 
     if ( d->connections.remove( c ) == 0 )
         return;
+    if ( d->backend && c->fd() >= 0 )
+        d->backend->forget( c->fd() );
+    // the mailbox's list of sessions mustn't outlive the connection
+    if ( c->session() )
+        c->Connection::setSession( 0 );
     setConnectionCounts();
 
     // if this is a server, with external connections, and we just
@@ -186,9 +225,120 @@ List< Connection > *EventLoop::connections() const
 
 
 static GraphableNumber * sizeinram = 0;
+static GraphableCounter * gcRuns = 0;
+static GraphableNumber * gcPause = 0;
+static GraphableNumber * gcMarkTime = 0;
+static GraphableNumber * gcSweepTime = 0;
+static GraphableNumber * gcFreed = 0;
+static GraphableNumber * gcObjects = 0;
+static GraphableNumber * gcBlocks = 0;
+static GraphableNumber * gcLargestSize = 0;
+static GraphableNumber * gcMapped = 0;
+static GraphableNumber * gcResident = 0;
+static GraphableNumber * throttledConnections = 0;
+static uint gcSeen = 0;
+
+static GraphableDataSet * loopBusy = 0;
+static GraphableDataSet * loopReady = 0;
+static GraphableDataSet * freeMemoryTime = 0;
+static GraphableDataSet * timerLateness = 0;
+
+// dispatch times for the connection groups dispatchGroup() returns
+static const uint dispatchGroups = 6;
+static GraphableDataSet * dispatchTime[dispatchGroups];
+static const char * dispatchNames[dispatchGroups] = {
+    "dispatch-time-imap", "dispatch-time-pop3", "dispatch-time-smtp",
+    "dispatch-time-db", "dispatch-time-internal", "dispatch-time-other"
+};
+
+
+/*  Returns the current time in microseconds. */
+
+static int64 microseconds()
+{
+    struct timeval tv;
+    ::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*  Returns the index into dispatchTime for \a c. */
+
+static uint dispatchGroup( Connection * c )
+{
+    switch( c->type() ) {
+    case Connection::ImapServer:
+        return 0;
+    case Connection::Pop3Server:
+        return 1;
+    case Connection::SmtpServer:
+        return 2;
+    case Connection::DatabaseClient:
+        return 3;
+    default:
+        break;
+    }
+    if ( c->hasProperty( Connection::Internal ) )
+        return 4;
+    return 5;
+}
+
+
+/*  Records that \a n connections are throttled. */
+
+static void setThrottledConnections( uint n )
+{
+    if ( !throttledConnections )
+        throttledConnections =
+            new GraphableNumber( "throttled-connections" );
+    throttledConnections->setValue( n );
+}
+
+
+/*  Records the statistics for the last garbage collection, if there
+    has been one since the last time this was called. Times are in
+    microseconds. gc-mapped and gc-resident show how much of the
+    heap is mapped and how much of that is in RAM, to compare with
+    memory-used, the amount in use.
+*/
+
+static void graphCollections()
+{
+    if ( Allocator::collections() == gcSeen )
+        return;
+    if ( !gcRuns ) {
+        gcRuns = new GraphableCounter( "gc-runs" );
+        gcPause = new GraphableNumber( "gc-pause" );
+        gcMarkTime = new GraphableNumber( "gc-mark-time" );
+        gcSweepTime = new GraphableNumber( "gc-sweep-time" );
+        gcFreed = new GraphableNumber( "gc-freed" );
+        gcObjects = new GraphableNumber( "gc-objects" );
+        gcBlocks = new GraphableNumber( "gc-blocks" );
+        gcLargestSize = new GraphableNumber( "gc-largest-size-class" );
+        gcMapped = new GraphableNumber( "gc-mapped" );
+        gcResident = new GraphableNumber( "gc-resident" );
+    }
+    while ( gcSeen < Allocator::collections() ) {
+        gcRuns->tick();
+        gcSeen++;
+    }
+    gcPause->setValue( Allocator::lastPause() );
+    gcMarkTime->setValue( Allocator::lastMarkTime() );
+    gcSweepTime->setValue( Allocator::lastSweepTime() );
+    gcFreed->setValue( Allocator::lastFreed() );
+    gcObjects->setValue( Allocator::lastObjects() );
+    gcBlocks->setValue( Allocator::lastBlocks() );
+    gcLargestSize->setValue( Allocator::largestSizeClass() );
+    gcMapped->setValue( Allocator::allocatedFromOS() );
+    gcResident->setValue( Allocator::residentFromOS() );
+}
 
 static const uint gcDelay = 30;
 
+// the number of collections a throttled connection may stay the
+// heaviest while the server is over its limit before we close it
+static const uint throttlePatience = 3;
+
 
 /*! Starts the EventLoop and runs it until stop() is called. */
 
@@ -198,7 +348,26 @@ void EventLoop::start()
     time_t gc = time(0);
     bool haveLoggedStartup = false;
 
-    log( "Starting event loop", Log::Debug );
+    if ( !d->backend )
+        d->backend = EventBackend::create(
+            Configuration::text( Configuration::EventBackend ) );
+
+    log( EString( "Starting event loop using " ) + d->backend->name(),
+         Log::Debug );
+
+    reconfigure();
+
+    if ( !loopBusy ) {
+        loopBusy = new GraphableDataSet( "loop-busy-time" );
+        loopReady = new GraphableDataSet( "loop-ready-connections" );
+        freeMemoryTime = new GraphableDataSet( "free-memory-time" );
+        timerLateness = new GraphableDataSet( "timer-lateness" );
+        uint i = 0;
+        while ( i < dispatchGroups ) {
+            dispatchTime[i] = new GraphableDataSet( dispatchNames[i] );
+            i++;
+        }
+    }
 
     while ( !d->stop && !Log::disastersYet() ) {
         if ( !haveLoggedStartup && !inStartup() ) {
@@ -210,12 +379,9 @@ void EventLoop::start()
 
         Connection * c;
 
-        uint timeout = gcDelay;
-        int maxfd = -1;
+        uint timeout = time( 0 ) + gcDelay;
 
-        fd_set r, w;
-        FD_ZERO( &r );
-        FD_ZERO( &w );
+        d->backend->prepare();
 
         // Figure out what events each connection wants.
 
@@ -231,15 +397,13 @@ void EventLoop::start()
             else if ( c->type() == Connection::Listener && inStartup() ) {
                 // we don't accept new connections until we've
                 // completed startup
+                d->backend->watch( c, fd, false, false );
             }
             else {
-                if ( fd > maxfd )
-                    maxfd = fd;
-                FD_SET( fd, &r );
-                if ( c->canWrite() ||
-                     c->state() == Connection::Connecting ||
-                     c->state() == Connection::Closing )
-                    FD_SET( fd, &w );
+                d->backend->watch( c, fd, c->canRead(),
+                                   c->canWrite() ||
+                                   c->state() == Connection::Connecting ||
+                                   c->state() == Connection::Closing );
                 if ( c->timeout() > 0 && c->timeout() < timeout )
                     timeout = c->timeout();
             }
@@ -247,70 +411,101 @@ void EventLoop::start()
 
         // Figure out whether any timers need attention soon
 
-        List< Timer >::Iterator t( d->timers );
-        while ( t ) {
-            if ( t->active() && t->timeout() < timeout )
-                timeout = t->timeout();
-            ++t;
+        uint soon = d->lastTimerRun + 1;
+        uint horizon = time( 0 ) + 60;
+        if ( horizon >= soon + wheelSlots )
+            horizon = soon + wheelSlots - 1;
+        while ( soon < timeout && soon <= horizon ) {
+            List< Timer >::Iterator t( d->wheel[soon % wheelSlots] );
+            while ( t && soon < timeout ) {
+                if ( t->active() && t->timeout() <= soon )
+                    timeout = soon;
+                ++t;
+            }
+            soon++;
         }
 
         // Look for interesting input
 
-        struct timeval tv;
-        tv.tv_sec = timeout - time( 0 );
-        tv.tv_usec = 0;
-
-        if ( tv.tv_sec < 0 )
-            tv.tv_sec = 0;
-        if ( tv.tv_sec > 60 )
-            tv.tv_sec = 60;
-
-        // we never ask the OS to sleep shorter than .2 seconds
-        if ( tv.tv_sec < 1 )
-            tv.tv_usec = 200000;
-
-        if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
-            // r and w are undefined. we clear them, and dispatch()
-            // won't jump to conclusions
-            FD_ZERO( &r );
-            FD_ZERO( &w );
-        }
+        int secs = timeout - time( 0 );
+        if ( secs < 0 )
+            secs = 0;
+        if ( secs > 60 )
+            secs = 60;
+
+        // we never ask the OS to sleep shorter than .2 seconds,
+        // except that we don't sleep at all while there's garbage
+        // left to sweep
+        if ( Allocator::sweeping() )
+            d->backend->wait( 0 );
+        else if ( secs < 1 )
+            d->backend->wait( 200 );
+        else
+            d->backend->wait( secs * 1000 );
         time_t now = time( 0 );
+        int64 woke = microseconds();
 
         // Graph our size before processing events
         if ( !sizeinram )
             sizeinram = new GraphableNumber( "memory-used" );
         sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+        graphCollections();
+        TlsThread::graphHandshakes();
 
         // Any interesting timers?
 
-        if ( !d->timers.isEmpty() ) {
-            uint now = time( 0 );
-            t = d->timers.first();
-            while ( t ) {
-                Timer * tmp = t;
-                ++t;
-                if ( tmp->active() && tmp->timeout() <= now )
-                    tmp->execute();
-            }
-        }
+        runTimers();
+        int64 timersDone = microseconds();
 
-        // Figure out what each connection cares about.
+        if ( d->drainRequest || d->drainUntil )
+            drainSome();
 
+        // Figure out what each connection cares about. Connections
+        // with nothing to do are left alone, so that idle connections
+        // cost next to nothing.
+
+        uint slow = 1000 * Configuration::scalar( Configuration::SlowLoopTime );
+        uint ready = 0;
+        int64 slowest = 0;
+        EString slowestName;
         it = d->connections.first();
         while ( it ) {
             c = it;
             ++it;
             int fd = c->fd();
             if ( fd >= 0 ) {
-                dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
-                FD_CLR( fd, &r );
-                FD_CLR( fd, &w );
+                uint e = d->backend->takeEvents( fd );
+                if ( e ||
+                     c->canWrite() ||
+                     ( c->timeout() && now >= (time_t)c->timeout() ) ||
+                     c->state() == Connection::Connecting ||
+                     c->state() == Connection::Closing ) {
+                    int64 before = microseconds();
+                    uint group = dispatchGroup( c );
+                    dispatch( c,
+                              e & EventBackend::Readable,
+                              e & EventBackend::Writable,
+                              now );
+                    int64 spent = microseconds() - before;
+                    dispatchTime[group]->addNumber( (uint)spent );
+                    ready++;
+                    if ( slow && spent > slowest && spent >= slow / 2 ) {
+                        slowest = spent;
+                        slowestName = c->description();
+                    }
+                }
             }
             else {
                 removeConnection( c );
             }
         }
+        loopReady->addNumber( ready );
+        int64 dispatched = microseconds();
+
+        // The profiler's samples have to be looked at before any
+        // garbage is collected
+
+        Profiler::collect();
 
         // Graph our size after processing all the events too
 
@@ -322,6 +517,8 @@ void EventLoop::start()
         // be freed here.
 
         if ( !d->stop ) {
+            if ( Allocator::sweeping() )
+                Allocator::sweepSome( d->slice * 1000 );
             if ( !::freeMemorySoon ) {
                 uint a = Allocator::inUse() + Allocator::allocated();
                 if ( now < gc ) {
@@ -344,11 +541,37 @@ void EventLoop::start()
                 }
             }
             if ( ::freeMemorySoon ) {
+                int64 before = microseconds();
                 freeMemory();
+                freeMemoryTime->addNumber( (uint)( microseconds() - before ) );
                 gc = time( 0 );
                 ::freeMemorySoon = false;
             }
         }
+
+        int64 busy = microseconds() - woke;
+        loopBusy->addNumber( (uint)busy );
+        if ( slow && busy >= slow ) {
+            EString l( "Event loop busy for " );
+            l.appendNumber( (int64)( busy / 1000 ) );
+            l.append( "ms: " );
+            l.appendNumber( (int64)( ( timersDone - woke ) / 1000 ) );
+            l.append( "ms in timers, " );
+            l.appendNumber( (int64)( ( dispatched - timersDone ) / 1000 ) );
+            l.append( "ms serving " );
+            l.appendNumber( ready );
+            l.append( " connections, " );
+            l.appendNumber( (int64)( ( woke + busy - dispatched ) / 1000 ) );
+            l.append( "ms collecting garbage" );
+            if ( !slowestName.isEmpty() ) {
+                l.append( ". Slowest: " );
+                l.append( slowestName );
+                l.append( " (" );
+                l.appendNumber( (int64)( slowest / 1000 ) );
+                l.append( "ms)" );
+            }
+            log( l, Log::Significant );
+        }
     }
 
     // This is for event loop shutdown. A little brutal. With any
@@ -380,6 +603,19 @@ void EventLoop::start()
 
 /*! Calls Allocator::free() and does any necessary pre- and
     postprocessing.
+
+    If gc-slice-time is nonzero, this only marks the live objects;
+    start() then sweeps the garbage in slices of at most that many
+    milliseconds, one per pass through the loop.
+
+    Records how much memory each Connection uses. If the server still
+    uses more than its memory limit after collecting, the external
+    Connection using the most memory is throttled, so that it stops
+    sending commands and its Fetchers pause between batches. A
+    Connection that stays the heaviest and stays throttled for several
+    collections without the server getting back under the limit is
+    closed. Once the server is under the limit, all Connections are
+    released.
 */
 
 void EventLoop::freeMemory()
@@ -392,31 +628,69 @@ void EventLoop::freeMemory()
             x.append( c );
         ++i;
     }
-    Garbage * biggest = Allocator::free( &x );
-    // x now points to free memory
+    uint * sizes = (uint*)::malloc( ( x.count() + 1 ) * sizeof( uint ) );
+    Allocator::free( &x, d->slice > 0, sizes );
+    // x now points to free memory, but d->connections is in the same
+    // order, so we can use that to map the sizes back
+
+    bool over = Allocator::inUse() > d->limit;
+    Connection * heaviest = 0;
+    uint throttled = 0;
+    uint n = 0;
     i = d->connections.first();
-    Connection * victim = 0;
     while ( i ) {
         Connection * c = i;
-        if ( c == biggest )
-            victim = i;
         ++i;
+        if ( c->hasProperty( Connection::Listens ) )
+            continue;
+        c->setMemoryUsage( sizes[n++] );
+        if ( !over ) {
+            if ( c->throttled() )
+                c->log( "Resuming input after memory overload",
+                        Log::Debug );
+            c->setThrottled( false );
+        }
+        else if ( !c->hasProperty( Connection::Internal ) &&
+                  ( !heaviest ||
+                    c->memoryUsage() > heaviest->memoryUsage() ) ) {
+            heaviest = c;
+        }
+        if ( c->throttled() )
+            throttled++;
     }
+    ::free( sizes );
 
-    if ( victim && Allocator::inUse() > d->limit ) {
-        ::log( "Closing connection due to memory overload: " +
-               victim->description() );
-        victim->react( Connection::Shutdown );
-        victim->close();
+    if ( !heaviest ) {
+        setThrottledConnections( throttled );
+        return;
+    }
+
+    if ( heaviest->throttled() < ::throttlePatience ) {
+        if ( !heaviest->throttled() ) {
+            ::log( "Pausing input due to memory overload (" +
+                   EString::humanNumber( heaviest->memoryUsage() ) +
+                   " bytes): " + heaviest->description() );
+            throttled++;
+        }
+        heaviest->setThrottled( true );
+        setThrottledConnections( throttled );
+        return;
     }
+
+    ::log( "Closing connection due to memory overload (" +
+           EString::humanNumber( heaviest->memoryUsage() ) +
+           " bytes): " + heaviest->description() );
+    heaviest->react( Connection::Shutdown );
+    heaviest->close();
+    setThrottledConnections( throttled - 1 );
 }
 
 
 /*! Dispatches events to the connection \a c, based on its current
-    state, the time \a now and the results from select: \a r is true
-    if the FD may be read, and \a w is true if we know that the FD may
-    be written to. If \a now is past that Connection's timeout, we
-    must send a Timeout event.
+    state, the time \a now and the results from the EventBackend: \a
+    r is true if the FD may be read, and \a w is true if we know that
+    the FD may be written to. If \a now is past that Connection's
+    timeout, we must send a Timeout event.
 */
 
 void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
@@ -564,6 +838,114 @@ void EventLoop::stop( uint s )
 }
 
 
+/*! Rereads the configuration variables this EventLoop caches, i.e.
+    gc-slice-time.
+*/
+
+void EventLoop::reconfigure()
+{
+    d->slice = Configuration::scalar( Configuration::GcSliceTime );
+}
+
+
+/*! Instructs this EventLoop to stop accepting new connections and
+    close its existing client connections gradually over \a s seconds,
+    so that clients which reconnect (presumably to a new server) don't
+    all do so at once. The loop stops when the last client connection
+    is gone.
+
+    This only records the request, so it's safe to call in a signal
+    handler. The loop acts on it at once.
+*/
+
+void EventLoop::drain( uint s )
+{
+    if ( !s )
+        s = 1;
+    d->drainRequest = s;
+}
+
+
+/*! Does the work for drain(): Closes the Listeners when draining
+    starts, and once per second closes enough client connections to
+    keep up with the schedule, those that have been idle longest
+    first.
+*/
+
+void EventLoop::drainSome()
+{
+    uint now = time( 0 );
+    if ( d->drainRequest ) {
+        d->drainStart = now;
+        d->drainUntil = now + d->drainRequest;
+        d->drainRequest = 0;
+        d->drainLast = 0;
+        d->drainTotal = 0;
+        List< Connection >::Iterator i( d->connections );
+        while ( i ) {
+            Connection * c = i;
+            ++i;
+            if ( c->hasProperty( Connection::Listens ) ) {
+                c->react( Connection::Shutdown );
+                c->close();
+            }
+            else if ( !c->hasProperty( Connection::Internal ) ) {
+                d->drainTotal++;
+            }
+        }
+        log( "Draining " + fn( d->drainTotal ) + " connections over " +
+             fn( d->drainUntil - now ) + " seconds", Log::Significant );
+    }
+
+    if ( now == d->drainLast )
+        return;
+    d->drainLast = now;
+
+    List< Connection > clients;
+    List< Connection >::Iterator i( d->connections );
+    while ( i ) {
+        if ( i->valid() && i->state() != Connection::Closing &&
+             !i->hasProperty( Connection::Internal ) &&
+             !i->hasProperty( Connection::Listens ) )
+            clients.append( i );
+        ++i;
+    }
+
+    if ( clients.isEmpty() ) {
+        log( "All connections drained", Log::Significant );
+        d->drainUntil = 0;
+        stop();
+        return;
+    }
+    if ( now >= d->drainUntil ) {
+        d->drainUntil = 0;
+        stop( 1 );
+        return;
+    }
+
+    uint target = (uint)( (int64)d->drainTotal * ( d->drainUntil - now ) /
+                          ( d->drainUntil - d->drainStart ) );
+    while ( clients.count() > target ) {
+        // the connection that has been idle longest has the first
+        // timeout. we leave alone those that are busy writing.
+        Connection * victim = 0;
+        List< Connection >::Iterator c( clients );
+        while ( c ) {
+            if ( !c->writeBuffer()->size() &&
+                 ( !victim || c->timeout() < victim->timeout() ) )
+                victim = c;
+            ++c;
+        }
+        if ( !victim )
+            break;
+        clients.remove( victim );
+        Scope x( victim->log() );
+        victim->react( Connection::Shutdown );
+        victim->setState( Connection::Closing );
+    }
+}
+
+
 /*! Closes all Connections except \a c1 and \a c2. This helps TlsProxy
     do its work.
 */
@@ -582,9 +964,12 @@ void EventLoop::closeAllExcept( Connection * c1, Connection * c2 )
 
 /*! Closes all Connection except Listeners. When we fork, this allows
     us to keep the connections on one side of the fence.
+
+    If \a process is nonzero, Listeners that belong to other server
+    processes (see Connection::setServerProcess()) are closed too.
 */
 
-void EventLoop::closeAllExceptListeners()
+void EventLoop::closeAllExceptListeners( uint process )
 {
     List< Connection >::Iterator it( d->connections );
     while ( it ) {
@@ -592,6 +977,9 @@ void EventLoop::closeAllExceptListeners()
         ++it;
         if ( c->type() != Connection::Listener )
             c->close();
+        else if ( process && c->serverProcess() &&
+                  c->serverProcess() != process )
+            c->close();
     }
 }
 
@@ -666,7 +1054,7 @@ void EventLoop::shutdown()
 
 void EventLoop::addTimer( Timer * t )
 {
-    d->timers.append( t );
+    d->slot( t->timeout() )->append( t );
 }
 
 
@@ -676,9 +1064,50 @@ void EventLoop::addTimer( Timer * t )
 
 void EventLoop::removeTimer( Timer * t )
 {
-    List<Timer>::Iterator i( d->timers.find( t ) );
+    List<Timer> * l = &d->wheel[t->timeout() % wheelSlots];
+    List<Timer>::Iterator i( l->find( t ) );
+    if ( !i ) {
+        l = d->slot( t->timeout() );
+        i = l->find( t );
+    }
     if ( i )
-        d->timers.take( i );
+        l->take( i );
+}
+
+
+/*! Runs the timer wheel's slots for each second since it was last
+    run, executing each Timer that is due. Only the timers in those
+    slots are examined, so the cost doesn't depend on how many timers
+    there are in total.
+*/
+
+void EventLoop::runTimers()
+{
+    uint now = time( 0 );
+    if ( d->lastTimerRun + wheelSlots < now )
+        d->lastTimerRun = now - wheelSlots;
+    while ( d->lastTimerRun < now ) {
+        d->lastTimerRun++;
+        List<Timer> due;
+        List<Timer>::Iterator t( d->wheel[d->lastTimerRun % wheelSlots] );
+        while ( t ) {
+            if ( t->timeout() <= d->lastTimerRun )
+                due.append( t );
+            ++t;
+        }
+        t = due.first();
+        while ( t ) {
+            Timer * tmp = t;
+            ++t;
+            if ( tmp->active() && tmp->timeout() <= now ) {
+                if ( timerLateness )
+                    timerLateness->addNumber(
+                        (uint)( microseconds() / 1000 -
+                                (int64)tmp->timeout() * 1000 ) );
+                tmp->execute();
+            }
+        }
+    }
 }
 
 static GraphableNumber * imapgraph = 0;
@@ -732,6 +1161,7 @@ void EventLoop::setConnectionCounts()
         case Connection::ManageSieveServer:
         case Connection::EGDServer:
         case Connection::LdapRelay:
+        case Connection::DnsClient:
             other++;
             break;
         case Connection::Pop3Server:
@@ -786,6 +1216,9 @@ void EventLoop::shutdownSSL()
 
 /*! Requests the event loop to collect garbage and clear any caches at
     the earliest opportunity. Used for debugging.
+
+    If gc-slice-time is set, the collection is spread over several
+    passes through the loop; see freeMemory().
 */
 
 void EventLoop::freeMemorySoon()
@@ -18,10 +18,12 @@ public:
 
     virtual void start();
     virtual void stop( uint = 0 );
+    void drain( uint );
+    void reconfigure();
     virtual void addConnection( Connection * );
     virtual void removeConnection( Connection * );
     void closeAllExcept( Connection *, Connection * );
-    void closeAllExceptListeners();
+    void closeAllExceptListeners( uint = 0 );
     void flushAll();
 
     void dispatch( Connection *, bool, bool, uint );
@@ -52,6 +54,9 @@ public:
 
 private:
     class LoopData *d;
+
+    void runTimers();
+    void drainSome();
 };
 
 
@@ -0,0 +1,205 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "flagsnapshot.h"
+
+#include "estringlist.h"
+#include "integerset.h"
+#include "flag.h"
+#include "map.h"
+
+
+class FlagSnapshotData
+    : public Garbage
+{
+public:
+    FlagSnapshotData(): from( 0 ), to( 0 ) {}
+
+    struct Message
+        : public Garbage
+    {
+    public:
+        Message()
+            : Garbage(),
+              id( 0 ), modseq( 0 ), seen( false ), deleted( false ) {}
+
+        uint id;
+        int64 modseq;
+        bool seen;
+        bool deleted;
+        IntegerSet flags;
+    };
+
+    int64 from;
+    int64 to;
+    Map<Message> messages;
+};
+
+
+/*! \class FlagSnapshot flagsnapshot.h
+
+    The FlagSnapshot class records the modseq and flags of the
+    messages that changed in a Mailbox between two modseqs.
+
+    SessionInitialiser fetches the changes once for all the Sessions
+    on a Mailbox, and records them in a FlagSnapshot. Then it tells
+    each Session about the changes. The Fetch each IMAP session uses to
+    announce the changes looks here first. So ten clients watching a
+    shared mailbox cost one set of queries per change, not ten.
+
+    A FlagSnapshot isn't changed once Mailbox::setFlagSnapshot() has
+    been called. The next update makes a new snapshot, so anyone still
+    using the old one sees consistent data.
+*/
+
+
+/*! Constructs an empty FlagSnapshot describing the changes with
+    modseqs from \a from up to (but not including) \a to.
+*/
+
+FlagSnapshot::FlagSnapshot( int64 from, int64 to )
+    : Garbage(), d( new FlagSnapshotData )
+{
+    d->from = from;
+    d->to = to;
+}
+
+
+/*! Returns the first modseq covered by this snapshot, as set in the
+    constructor.
+*/
+
+int64 FlagSnapshot::from() const
+{
+    return d->from;
+}
+
+
+/*! Returns the modseq after the last change covered by this snapshot,
+    as set in the constructor.
+*/
+
+int64 FlagSnapshot::to() const
+{
+    return d->to;
+}
+
+
+/*! Records that the message \a uid has the database id \a id, the
+    modseq \a modseq, that it is \a seen and \a deleted or not, and
+    that it has the flags whose bits are set in \a flagbits (see
+    Flag::bit()).
+*/
+
+void FlagSnapshot::add( uint uid, uint id, int64 modseq,
+                        bool seen, bool deleted, int64 flagbits )
+{
+    FlagSnapshotData::Message * m = d->messages.find( uid );
+    if ( !m ) {
+        m = new FlagSnapshotData::Message;
+        d->messages.insert( uid, m );
+    }
+    m->id = id;
+    m->modseq = modseq;
+    m->seen = seen;
+    m->deleted = deleted;
+    uint f = 1;
+    while ( flagbits && f <= 64 ) {
+        int64 b = Flag::bit( f );
+        if ( flagbits & b ) {
+            m->flags.add( f );
+            flagbits &= ~b;
+        }
+        f++;
+    }
+}
+
+
+/*! Records that the message \a uid has the flag with id \a flag. Does
+    nothing unless add() has been called for \a uid.
+*/
+
+void FlagSnapshot::addFlag( uint uid, uint flag )
+{
+    FlagSnapshotData::Message * m = d->messages.find( uid );
+    if ( m )
+        m->flags.add( flag );
+}
+
+
+/*! Returns true if this snapshot knows the current state of \a uid,
+    and false if not.
+*/
+
+bool FlagSnapshot::contains( uint uid ) const
+{
+    return d->messages.find( uid ) != 0;
+}
+
+
+/*! Returns true if this snapshot knows about every message in \a
+    uids, and false if there's at least one it doesn't.
+*/
+
+bool FlagSnapshot::contains( const IntegerSet & uids ) const
+{
+    IntegerSet s( uids );
+    while ( !s.isEmpty() ) {
+        uint uid = s.smallest();
+        s.remove( uid );
+        if ( !d->messages.find( uid ) )
+            return false;
+    }
+    return true;
+}
+
+
+/*! Returns the database id of \a uid, or 0 if it's not in this
+    snapshot.
+*/
+
+uint FlagSnapshot::databaseId( uint uid ) const
+{
+    FlagSnapshotData::Message * m = d->messages.find( uid );
+    if ( !m )
+        return 0;
+    return m->id;
+}
+
+
+/*! Returns the modseq of \a uid, or 0 if it's not in this snapshot. */
+
+int64 FlagSnapshot::modSeq( uint uid ) const
+{
+    FlagSnapshotData::Message * m = d->messages.find( uid );
+    if ( !m )
+        return 0;
+    return m->modseq;
+}
+
+
+/*! Returns the names of the flags set on \a uid, or a null pointer if
+    \a uid isn't in this snapshot or has a flag whose name isn't
+    known yet.
+*/
+
+EStringList * FlagSnapshot::flags( uint uid ) const
+{
+    FlagSnapshotData::Message * m = d->messages.find( uid );
+    if ( !m )
+        return 0;
+    EStringList * r = new EStringList;
+    if ( m->seen )
+        r->append( "\\Seen" );
+    if ( m->deleted )
+        r->append( "\\Deleted" );
+    uint i = 1;
+    uint c = m->flags.count();
+    while ( i <= c ) {
+        EString n = Flag::name( m->flags.value( i ) );
+        if ( n.isEmpty() )
+            return 0;
+        r->append( n );
+        i++;
+    }
+    return r;
+}
@@ -0,0 +1,37 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef FLAGSNAPSHOT_H
+#define FLAGSNAPSHOT_H
+
+#include "global.h"
+
+
+class IntegerSet;
+class EStringList;
+
+
+class FlagSnapshot
+    : public Garbage
+{
+public:
+    FlagSnapshot( int64, int64 );
+
+    int64 from() const;
+    int64 to() const;
+
+    void add( uint, uint, int64, bool, bool, int64 );
+    void addFlag( uint, uint );
+
+    bool contains( uint ) const;
+    bool contains( const IntegerSet & ) const;
+
+    uint databaseId( uint ) const;
+    int64 modSeq( uint ) const;
+    EStringList * flags( uint ) const;
+
+private:
+    class FlagSnapshotData * d;
+};
+
+
+#endif
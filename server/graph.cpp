@@ -5,8 +5,11 @@
 #include "allocator.h"
 #include "eventloop.h"
 #include "list.h"
+#include "dict.h"
+#include "buffer.h"
 
 #include <time.h> // time()
+#include <unistd.h> // getpid()
 
 
 static List<GraphableNumber> * numbers = 0;
@@ -19,7 +22,7 @@ class GraphableNumberData
     : public Garbage
 {
 public:
-    GraphableNumberData(): min( 0 ), max( 0 ) {
+    GraphableNumberData(): counter( false ), min( 0 ), max( 0 ) {
         uint i = 0;
         while ( i < graphableHistorySize )
             values[i++] = 0;
@@ -27,6 +30,7 @@ public:
     }
     EString name;
     // no pointers after this line
+    bool counter;
     uint min;
     uint max;
     uint values[::graphableHistorySize];
@@ -193,6 +197,24 @@ EString GraphableNumber::name() const
 }
 
 
+/*! Returns true if this is a GraphableCounter, whose values only
+    ever increase, and false if not.
+*/
+
+bool GraphableNumber::isCounter() const
+{
+    return d->counter;
+}
+
+
+/*! Records that this is a GraphableCounter. */
+
+void GraphableNumber::setCounter()
+{
+    d->counter = true;
+}
+
+
 /*! \class GraphableCounter graph.h
 
     The GraphableCounter class provides a tick counter; you can tell
@@ -205,6 +227,7 @@ EString GraphableNumber::name() const
 GraphableCounter::GraphableCounter( const EString & name )
     : GraphableNumber( name )
 {
+    setCounter();
     setValue( 0 );
 }
 
@@ -221,7 +244,7 @@ class GraphableDataSetData
     : public Garbage
 {
 public:
-    GraphableDataSetData(): t( 0 ), n( 0 ) {}
+    GraphableDataSetData(): t( 0 ), s( 0 ), n( 0 ) {}
     uint t;
     uint s;
     uint n;
@@ -241,7 +264,7 @@ public:
 /*! Constructs an empty data set named \a name. */
 
 GraphableDataSet::GraphableDataSet( const EString & name )
-    : GraphableNumber( name )
+    : GraphableNumber( name ), d( new GraphableDataSetData )
 {
 }
 
@@ -256,13 +279,36 @@ void GraphableDataSet::addNumber( uint n )
         d->n = 0;
         d->s = 0;
     }
-    n++;
+    d->n++;
     d->s += n;
     if ( d->n )
         setValue( ( d->s + (d->n/2) ) / d->n );
 }
 
 
+static Dict<GraphableDataSet> * dataSets = 0;
+
+
+/*! Returns the GraphableDataSet called \a name, creating it if
+    necessary. This is convenient for families of data sets whose
+    names aren't known in advance, such as one per command name.
+*/
+
+GraphableDataSet * GraphableDataSet::named( const EString & name )
+{
+    if ( !dataSets ) {
+        dataSets = new Dict<GraphableDataSet>;
+        Allocator::addEternal( dataSets, "named data sets" );
+    }
+    GraphableDataSet * s = dataSets->find( name );
+    if ( !s ) {
+        s = new GraphableDataSet( name );
+        dataSets->insert( name, s );
+    }
+    return s;
+}
+
+
 /*! \class GraphDumper graph.h
     This Connection subclass is responsible for transferring statistics
     en masse to any client that asks.
@@ -315,3 +361,176 @@ void GraphDumper::react( Event )
 {
     setState( Closing );
 }
+
+
+/*! \class MetricsDumper graph.h
+    This Connection subclass answers HTTP requests with the current
+    value of every GraphableNumber, in the OpenMetrics text format, so
+    that Prometheus and similar tools can scrape a server.
+
+    Each sample is labelled with the process ID. Counters are exported
+    as counters, other numbers as gauges. Each GraphableDataSet also
+    gets a second gauge with the maximum in the last minute.
+
+    In addition, the memory used by each external Connection at the
+    last garbage collection is exported, with the number of
+    collections for which that connection has been throttled (see
+    EventLoop::freeMemory()).
+
+    Finally, there are three gauges per Allocator size class, labelled
+    with the object size: The number of objects left by the last
+    collection, the number allocated between the last two
+    collections, and the percentage which survived the last
+    collection (see Allocator::classSurvival()).
+*/
+
+/*! Constructs a MetricsDumper for the client connected to \a fd. */
+
+MetricsDumper::MetricsDumper( int fd )
+    : Connection( fd, Connection::GraphDumper )
+{
+    EventLoop::global()->addConnection( this );
+    setTimeoutAfter( 10 );
+}
+
+
+void MetricsDumper::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        // we don't care what's asked for, only that the request is
+        // complete
+        while ( state() == Connected ) {
+            EString * l = readBuffer()->removeLine();
+            if ( !l )
+                break;
+            if ( l->isEmpty() )
+                dump();
+        }
+        break;
+    case Connect:
+        break;
+    case Timeout:
+    case Shutdown:
+    case Close:
+    case Error:
+        setState( Closing );
+        break;
+    }
+}
+
+
+/*! Sends the response and closes the connection. */
+
+void MetricsDumper::dump()
+{
+    EString labels( "{process=\"" );
+    labels.appendNumber( getpid() );
+    labels.append( "\"}" );
+
+    uint since = (uint)time( 0 ) - 60;
+    EString body;
+    body.reserve( 16384 );
+    List<GraphableNumber>::Iterator i( numbers );
+    while ( i ) {
+        EString n( "aox_" );
+        n.append( i->name() );
+        n.replace( "-", "_" );
+        body.append( "# TYPE " );
+        body.append( n );
+        if ( i->isCounter() ) {
+            body.append( " counter\n" );
+            n.append( "_total" );
+        }
+        else {
+            body.append( " gauge\n" );
+        }
+        body.append( n );
+        body.append( labels );
+        body.append( " " );
+        body.appendNumber( i->lastValue() );
+        body.append( "\n" );
+        if ( !i->isCounter() ) {
+            body.append( "# TYPE " );
+            body.append( n );
+            body.append( "_max_1m gauge\n" );
+            body.append( n );
+            body.append( "_max_1m" );
+            body.append( labels );
+            body.append( " " );
+            body.appendNumber( i->maximumSince( since ) );
+            body.append( "\n" );
+        }
+        ++i;
+    }
+
+    EString memory( "# TYPE aox_connection_memory_bytes gauge\n" );
+    EString throttled( "# TYPE aox_connection_throttled gauge\n" );
+    labels.truncate( labels.length() - 1 );
+    List<Connection>::Iterator c( EventLoop::global()->connections() );
+    while ( c ) {
+        if ( !c->hasProperty( Connection::Listens ) &&
+             !c->hasProperty( Connection::Internal ) ) {
+            EString l( labels );
+            l.append( ",fd=\"" );
+            l.appendNumber( c->fd() );
+            l.append( "\",connection=\"" );
+            EString n( c->description() );
+            n.replace( "\\", "\\\\" );
+            n.replace( "\"", "\\\"" );
+            l.append( n );
+            l.append( "\"} " );
+            memory.append( "aox_connection_memory_bytes" );
+            memory.append( l );
+            memory.appendNumber( c->memoryUsage() );
+            memory.append( "\n" );
+            throttled.append( "aox_connection_throttled" );
+            throttled.append( l );
+            throttled.appendNumber( c->throttled() );
+            throttled.append( "\n" );
+        }
+        ++c;
+    }
+    body.append( memory );
+    body.append( throttled );
+
+    EString objects( "# TYPE aox_gc_class_objects gauge\n" );
+    EString allocations( "# TYPE aox_gc_class_allocations gauge\n" );
+    EString survival( "# TYPE aox_gc_class_survival_percent gauge\n" );
+    uint sc = 0;
+    while ( sc < 32 ) {
+        if ( Allocator::classObjects( sc ) ||
+             Allocator::classAllocations( sc ) ) {
+            EString l( labels );
+            l.append( ",size=\"" );
+            l.appendNumber( Allocator::classSize( sc ) );
+            l.append( "\"} " );
+            objects.append( "aox_gc_class_objects" );
+            objects.append( l );
+            objects.appendNumber( Allocator::classObjects( sc ) );
+            objects.append( "\n" );
+            allocations.append( "aox_gc_class_allocations" );
+            allocations.append( l );
+            allocations.appendNumber( Allocator::classAllocations( sc ) );
+            allocations.append( "\n" );
+            survival.append( "aox_gc_class_survival_percent" );
+            survival.append( l );
+            survival.appendNumber( Allocator::classSurvival( sc ) );
+            survival.append( "\n" );
+        }
+        sc++;
+    }
+    body.append( objects );
+    body.append( allocations );
+    body.append( survival );
+    body.append( "# EOF\n" );
+
+    enqueue( "HTTP/1.0 200 OK\r\n"
+             "Content-Type: application/openmetrics-text; "
+             "version=1.0.0; charset=utf-8\r\n"
+             "Content-Length: " + fn( body.length() ) + "\r\n"
+             "Connection: close\r\n"
+             "\r\n" );
+    enqueue( body );
+    setState( Closing );
+}
@@ -20,10 +20,14 @@ public:
     uint lastValue() const;
 
     EString name() const;
+    bool isCounter() const;
     uint oldestTime() const;
     uint youngestTime() const;
     uint value( uint );
 
+protected:
+    void setCounter();
+
 private:
     class GraphableNumberData * d;
     void clearOldHistory( uint );
@@ -48,6 +52,8 @@ public:
 
     void addNumber( uint );
 
+    static GraphableDataSet * named( const EString & );
+
 private:
     class GraphableDataSetData * d;
 };
@@ -63,4 +69,17 @@ public:
 };
 
 
+class MetricsDumper
+    : public Connection
+{
+public:
+    MetricsDumper( int );
+
+    void react( Event );
+
+private:
+    void dump();
+};
+
+
 #endif
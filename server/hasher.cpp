@@ -0,0 +1,275 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "hasher.h"
+
+#include "list.h"
+#include "event.h"
+#include "buffer.h"
+#include "estring.h"
+#include "sha256.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "allocator.h"
+#include "configuration.h"
+
+// socketpair
+#include <sys/socket.h>
+// fcntl
+#include <fcntl.h>
+// write, close
+#include <unistd.h>
+// malloc, free
+#include <stdlib.h>
+
+#include <pthread.h>
+
+
+// anything smaller than this is hashed at once, since handing it to a
+// thread would cost more than it saves
+static const uint minimumSize = 65536;
+
+
+class HasherData
+    : public Garbage
+{
+public:
+    HasherData(): ctx( 0 ), owner( 0 ), done( false ) {}
+
+    SHA256 * ctx;
+    EString data;
+    EventHandler * owner;
+    bool done;
+    EString hash;
+};
+
+
+// One unit of work for the threads, malloc()ed and passed between the
+// threads under ::lock. The Hasher and the memory the job points to
+// are kept alive by ::working until the main thread has seen the job
+// finish.
+
+struct HashJob // NOT a Garbage class
+{
+    Hasher * hasher;
+    SHA256 * ctx;
+    const char * data;
+    uint length;
+    HashJob * next;
+};
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static HashJob * queue = 0;
+static HashJob * queueEnd = 0;
+static HashJob * finished = 0;
+static int wakeFd = -1;
+static uint threads = 0;
+static bool started = false;
+static List<Hasher> * working = 0;
+
+
+/* The body of each hashing thread. It must not allocate GC memory;
+   SHA256::add() doesn't. */
+
+static void * hashJobs( void * )
+{
+    while ( true ) {
+        pthread_mutex_lock( &lock );
+        while ( !queue )
+            pthread_cond_wait( &queued, &lock );
+        HashJob * j = queue;
+        queue = j->next;
+        if ( !queue )
+            queueEnd = 0;
+        pthread_mutex_unlock( &lock );
+
+        j->ctx->add( j->data, j->length );
+
+        pthread_mutex_lock( &lock );
+        j->next = finished;
+        finished = j;
+        pthread_mutex_unlock( &lock );
+
+        char c = 0;
+        (void)::write( wakeFd, &c, 1 );
+    }
+    return 0;
+}
+
+
+/*! \nodoc
+
+    The HashWaker is the main thread's end of the socket the hashing
+    threads use to say that they've finished a job. It finishes each
+    Hasher and notifies its owner.
+*/
+
+class HashWaker
+    : public Connection
+{
+public:
+    HashWaker( int fd )
+        : Connection( fd, Connection::Pipe )
+    {
+        setState( Connected );
+        EventLoop::global()->addConnection( this );
+    }
+
+    void react( Event e ) {
+        if ( e != Read )
+            return;
+
+        readBuffer()->remove( readBuffer()->size() );
+
+        pthread_mutex_lock( &lock );
+        HashJob * j = finished;
+        finished = 0;
+        pthread_mutex_unlock( &lock );
+
+        while ( j ) {
+            HashJob * next = j->next;
+            Hasher * h = j->hasher;
+            ::free( j );
+            ::working->remove( h );
+            h->d->hash = h->d->ctx->hash();
+            h->d->data.truncate();
+            h->d->done = true;
+            if ( h->d->owner )
+                h->d->owner->notify();
+            j = next;
+        }
+    }
+};
+
+
+/* Starts the hashing threads, if injection-threads asks for any. */
+
+static void start()
+{
+    started = true;
+    uint n = Configuration::scalar( Configuration::InjectionThreads );
+    if ( !n || !EventLoop::global() )
+        return;
+
+    int sv[2];
+    if ( ::socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 ) {
+        log( "Cannot create socket for hashing threads", Log::Error );
+        return;
+    }
+    int flags = fcntl( sv[1], F_GETFL, 0 );
+    if ( flags >= 0 )
+        fcntl( sv[1], F_SETFL, flags | O_NDELAY );
+    ::wakeFd = sv[1];
+
+    while ( ::threads < n ) {
+        pthread_t t;
+        if ( pthread_create( &t, 0, hashJobs, 0 ) )
+            break;
+        pthread_detach( t );
+        ::threads++;
+    }
+    if ( ::threads < n )
+        log( "Could only start " + fn( ::threads ) + " of " +
+             fn( n ) + " hashing threads", Log::Error );
+    if ( !::threads ) {
+        ::close( sv[0] );
+        ::close( sv[1] );
+        ::wakeFd = -1;
+        return;
+    }
+
+    ::working = new List<Hasher>;
+    Allocator::addEternal( ::working, "hashes being computed by threads" );
+    (void)new HashWaker( sv[0] );
+}
+
+
+/*! \class Hasher hasher.h
+    Computes a SHA-256 hash, in another thread if that's worthwhile.
+
+    The Injector hashes the content of every bodypart it stores, and
+    hashing a large message on the main thread holds up every other
+    client of the process. If injection-threads is nonzero, a fixed
+    pool of that many threads hashes large inputs, and the Hasher
+    notifies its owner when the hash is done(). Small inputs, and all
+    inputs if there are no threads, are hashed at once.
+
+    Only the hashing is moved off the main thread. Parsing allocates
+    memory, which only the main thread may do.
+*/
+
+
+/*! Starts hashing \a prefix followed by \a data, and notifies \a
+    owner when done() becomes true, unless it already is true when
+    the constructor returns.
+*/
+
+Hasher::Hasher( const EString & prefix, const EString & data,
+                EventHandler * owner )
+    : d( new HasherData )
+{
+    d->ctx = new SHA256;
+    d->ctx->add( prefix );
+
+    if ( data.length() >= minimumSize && threaded() ) {
+        HashJob * j = (HashJob*)::malloc( sizeof( HashJob ) );
+        if ( j ) {
+            d->data = data;
+            d->owner = owner;
+            j->hasher = this;
+            j->ctx = d->ctx;
+            j->data = d->data.data();
+            j->length = d->data.length();
+            j->next = 0;
+            ::working->append( this );
+
+            pthread_mutex_lock( &lock );
+            if ( queueEnd )
+                queueEnd->next = j;
+            else
+                queue = j;
+            queueEnd = j;
+            pthread_cond_signal( &queued );
+            pthread_mutex_unlock( &lock );
+            return;
+        }
+    }
+
+    d->ctx->add( data );
+    d->hash = d->ctx->hash();
+    d->done = true;
+}
+
+
+/*! Returns true if hash() is available, and false if a thread is
+    still working on it.
+*/
+
+bool Hasher::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns the 32-byte SHA-256 hash, or an empty string if done() is
+    still false.
+*/
+
+EString Hasher::hash() const
+{
+    return d->hash;
+}
+
+
+/*! Returns true if hashing threads are running in this process, and
+    false if all hashing happens on the main thread. Starts the
+    threads the first time it's called.
+*/
+
+bool Hasher::threaded()
+{
+    if ( !::started )
+        start();
+    return ::threads > 0;
+}
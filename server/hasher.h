@@ -0,0 +1,30 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef HASHER_H
+#define HASHER_H
+
+#include "global.h"
+
+
+class EString;
+class EventHandler;
+
+
+class Hasher
+    : public Garbage
+{
+public:
+    Hasher( const EString &, const EString &, EventHandler * );
+
+    bool done() const;
+    EString hash() const;
+
+    static bool threaded();
+
+private:
+    class HasherData * d;
+    friend class HashWaker;
+};
+
+
+#endif
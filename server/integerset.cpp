@@ -3,45 +3,57 @@
 #include "integerset.h"
 
 #include "estringlist.h"
+#include "allocator.h"
 #include "map.h"
 
 
 static inline uint bitsSet( uint b )
+{
+    return __builtin_popcount( b );
+}
+
+
+// counts the bits set in the \a n words starting at \a w. the
+// compiler is allowed to use the popcnt instruction for the second
+// version, so it is only used if the CPU has it.
+
+static uint countBitsPortably( const uint * w, uint n )
 {
     uint r = 0;
-    while ( b ) {
-        switch ( b & 15 ) {
-        case 0:
-            r += 0;
-            break;
-        case 1:
-        case 2:
-        case 4:
-        case 8:
-            r += 1;
-            break;
-        case 3:
-        case 5:
-        case 6:
-        case 9:
-        case 10:
-        case 12:
-            r += 2;
-            break;
-        case 7:
-        case 11:
-        case 13:
-        case 14:
-            r += 3;
-            break;
-        case 15:
-            r += 4;
-            break;
-        }
-        b >>= 4;
-    }
+    uint i = 0;
+    while ( i < n )
+        r += __builtin_popcount( w[i++] );
     return r;
-};
+}
+
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+__attribute__((target("popcnt")))
+static uint countBitsNatively( const uint * w, uint n )
+{
+    uint r = 0;
+    uint i = 0;
+    while ( i < n )
+        r += __builtin_popcount( w[i++] );
+    return r;
+}
+#endif
+
+
+static uint chooseBitCounter( const uint *, uint );
+static uint (*countBits)( const uint *, uint ) = chooseBitCounter;
+
+
+static uint chooseBitCounter( const uint * w, uint n )
+{
+    countBits = countBitsPortably;
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "popcnt" ) )
+        countBits = countBitsNatively;
+#endif
+    return countBits( w, n );
+}
 
 
 static const uint BlockSize = 8192;
@@ -53,7 +65,8 @@ class SetData
     : public Garbage
 {
 public:
-    SetData() {}
+    SetData()
+        : blocks( 0 ), before( 0 ), last( 0 ), n( 0 ), stale( true ) {}
 
     class Block
         : public Garbage
@@ -87,16 +100,36 @@ public:
             if ( i >= BlockSize )
                 return;
 
-            if ( !(contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) )
+            // a count of 0 means "unknown", see recount()
+            if ( count &&
+                 !(contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) )
                 count++;
             contents[i/BitsPerUint] |= 1 << ( i % BitsPerUint );
         }
 
         void recount() {
-            count = 0;
-            uint i = 0;
-            while ( i < ArraySize )
-                count += bitsSet( contents[i++] );
+            count = countBits( contents, ArraySize );
+        }
+
+        // sets the bits for \a n1 to \a n2, which must both be in
+        // this block, a word at a time.
+        void fill( uint n1, uint n2 ) {
+            uint i = n1 - start;
+            uint e = n2 - start;
+            while ( i <= e ) {
+                uint w = i / BitsPerUint;
+                uint lo = i % BitsPerUint;
+                uint hi = BitsPerUint - 1;
+                if ( e < ( w + 1 ) * BitsPerUint )
+                    hi = e % BitsPerUint;
+                uint mask = ~0u << lo;
+                if ( hi < BitsPerUint - 1 )
+                    mask &= ~( ~0u << ( hi + 1 ) );
+                if ( count )
+                    count += bitsSet( mask & ~contents[w] );
+                contents[w] |= mask;
+                i = ( w + 1 ) * BitsPerUint;
+            }
         }
 
         void merge( Block * other ) {
@@ -110,6 +143,84 @@ public:
     };
 
     Map<Block> b;
+
+    // the rank index: blocks in ascending order, and how many
+    // numbers precede each. before[n] is the total count.
+    Block ** blocks;
+    uint * before;
+    // the block add() used last, so that adding ascending ranges
+    // needn't look each one up in b.
+    Block * last;
+    uint n;
+    bool stale;
+
+    Block * block( uint start ) {
+        if ( last && last->start == start )
+            return last;
+        last = b.find( start );
+        if ( !last ) {
+            last = new Block( start );
+            b.insert( start, last );
+        }
+        return last;
+    }
+
+    void rank() {
+        if ( !stale )
+            return;
+        n = 0;
+        Map<Block>::Iterator i( b );
+        while ( i ) {
+            n++;
+            ++i;
+        }
+        blocks = 0;
+        if ( n )
+            blocks = (Block**)Allocator::alloc( n * sizeof( Block * ) );
+        before = (uint*)Allocator::alloc( ( n + 1 ) * sizeof( uint ), 0 );
+        uint c = 0;
+        uint k = 0;
+        Map<Block>::Iterator j( b );
+        while ( j ) {
+            blocks[k] = j;
+            before[k] = c;
+            c += j->count;
+            k++;
+            ++j;
+        }
+        before[n] = c;
+        stale = false;
+    }
+
+    // returns the position of the last block whose members all
+    // precede the index'th member, ie. the block containing it.
+    uint blockHolding( uint index ) const {
+        uint l = 0;
+        uint h = n;
+        while ( l + 1 < h ) {
+            uint m = ( l + h ) / 2;
+            if ( before[m] < index )
+                l = m;
+            else
+                h = m;
+        }
+        return l;
+    }
+
+    // returns the position of the block starting at \a start,
+    // which must be present.
+    uint blockAt( uint start ) const {
+        uint l = 0;
+        uint h = n;
+        while ( l + 1 < h ) {
+            uint m = ( l + h ) / 2;
+            if ( blocks[m]->start <= start )
+                l = m;
+            else
+                h = m;
+        }
+        return l;
+    }
 };
 
 
@@ -120,6 +231,18 @@ public:
     members to the set, find its members by value() or index() (sorted
     by size, with 1 first), look for the largest contained number, and
     produce an SQL "where" clause matching its contents.
+
+    The numbers are kept in bitmap blocks of 8192. value() and index()
+    use a rank index (the number of members before each block), which
+    is rebuilt lazily after the set changes, so MSN/UID translation on
+    a large mailbox costs a binary search rather than a walk over
+    every block.
+
+    add() sets whole words at a time and remembers the last block it
+    used, so building a set from thousands of ascending ranges (as
+    Command::set() does for a long UID set) costs little more than
+    the parsing. set() and csl() likewise find members and ranges a
+    word at a time.
 */
 
 
@@ -177,25 +300,22 @@ void IntegerSet::add( uint n1, uint n2 )
         return;
     }
 
-    uint n = n1;
-    uint s = n - (n%BlockSize);
-    SetData::Block * b = d->b.find( s );
-    if ( !b ) {
-        b = new SetData::Block( s );
-        d->b.insert( s, b );
+    d->stale = true;
+    if ( n1 == n2 ) {
+        d->block( n1 - (n1%BlockSize) )->insert( n1 );
+        return;
     }
-    b->insert( n );
-    while ( n < n2 ) {
-        ++n;
-        if ( s != n - (n%BlockSize) ) {
-            s = n - (n%BlockSize);
-            b = d->b.find( s );
-            if ( !b ) {
-                b = new SetData::Block( s );
-                d->b.insert( s, b );
-            }
-        }
-        b->insert( n );
+
+    uint n = n1;
+    while ( true ) {
+        uint s = n - (n%BlockSize);
+        uint e = n2;
+        if ( e - s >= BlockSize )
+            e = s + BlockSize - 1;
+        d->block( s )->fill( n, e );
+        if ( e == n2 )
+            return;
+        n = e + 1;
     }
 }
 
@@ -208,6 +328,7 @@ void IntegerSet::add( const IntegerSet & set )
         *this = set;
         return;
     }
+    d->stale = true;
     Map<SetData::Block>::Iterator i( set.d->b );
     while( i ) {
         SetData::Block * b = d->b.find( i->start );
@@ -256,13 +377,8 @@ uint IntegerSet::largest() const
 uint IntegerSet::count() const
 {
     recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i ) {
-        c += i->count;
-        ++i;
-    }
-    return c;
+    d->rank();
+    return d->before[d->n];
 }
 
 
@@ -286,14 +402,12 @@ uint IntegerSet::value( uint index ) const
     if ( !index )
         return 0;
     recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i && c + i->count < index ) {
-        c += i->count;
-        ++i;
-    }
-    if ( !i )
+    d->rank();
+    if ( index > d->before[d->n] )
         return 0;
+    uint k = d->blockHolding( index );
+    uint c = d->before[k];
+    SetData::Block * i = d->blocks[k];
 
     uint bs = bitsSet( i->contents[0] );
     uint n = 0;
@@ -322,27 +436,16 @@ uint IntegerSet::value( uint index ) const
 
 uint IntegerSet::index( uint value ) const
 {
-    recount();
-    uint i = 0;
-    Map<SetData::Block>::Iterator b( d->b );
-    while ( b && b->start + BlockSize - 1 < value ) {
-        i += b->count;
-        ++b;
-    }
-    if ( !b )
-        return 0;
-
-    if ( b->start > value )
+    if ( !contains( value ) )
         return 0;
+    recount();
+    d->rank();
+    uint k = d->blockAt( value - (value%BlockSize) );
+    uint i = d->before[k];
+    SetData::Block * b = d->blocks[k];
 
     uint vi = (value-b->start)/BitsPerUint;
-    if ( !(b->contents[vi] & 1 << (value%BitsPerUint)) )
-        return 0;
-    uint n = 0;
-    while ( n < vi ) {
-        i += bitsSet( b->contents[n] );
-        n++;
-    }
+    i += countBits( b->contents, vi );
     i += bitsSet ( b->contents[vi] & ~( 0xfffffffe << (value%BitsPerUint) ) );
     return i;
 }
@@ -379,6 +482,8 @@ void IntegerSet::remove( uint value )
         return;
 
     b->contents[i/BitsPerUint] &= ~(1 << ( i % BitsPerUint ) );
+    d->stale = true;
+    d->last = 0;
     if ( b->count ) {
         b->count--;
         if ( !b->count )
@@ -404,6 +509,8 @@ void IntegerSet::remove( uint v1, uint v2 )
 
 void IntegerSet::remove( const IntegerSet & other )
 {
+    d->stale = true;
+    d->last = 0;
     Map<SetData::Block>::Iterator mine( d->b );
     Map<SetData::Block>::Iterator hers( other.d->b );
     while ( mine && hers ) {
@@ -487,6 +594,22 @@ static void addRange( EString & r, uint s, uint e )
 }
 
 
+/*  Returns the length of the longest comma-separated list of the
+    \a n numbers up to \a largest, i.e. an upper bound for the length
+    of set() and the exact length of csl() if they're all large.
+*/
+
+static uint listLength( uint n, uint largest )
+{
+    uint digits = 1;
+    while ( largest >= 10 ) {
+        largest /= 10;
+        digits++;
+    }
+    return n * ( digits + 1 );
+}
+
+
 /*! Returns the contents of this set in IMAP syntax. The shortest
     possible representation is returned, with strictly increasing
     values, without repetitions, with ":" and "," as necessary.
@@ -497,38 +620,41 @@ static void addRange( EString & r, uint s, uint e )
 EString IntegerSet::set() const
 {
     EString r;
-    r.reserve( 2222 );
+    if ( isEmpty() )
+        return r;
+    // ranges usually make set() much shorter than csl(), so we don't
+    // reserve all of that
+    uint l = listLength( count(), largest() );
+    r.reserve( l < 2222 ? l : 2222 );
     uint s = 0;
     uint e = 0;
 
+    // a range usually covers many bits, so this looks for its ends a
+    // word at a time rather than testing every bit.
     Map<SetData::Block>::Iterator it( d->b );
     while ( it ) {
-        uint v = it->start;
         uint n = 0;
         while ( n < ArraySize ) {
-            uint j = 0;
             uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !e ) {
-                            s = v + j;
-                            e = s;
-                        }
-                        else if ( e + 1 < v + j ) {
-                            addRange( r, s, e );
-                            s = v + j;
-                            e = s;
-                        }
-                        else {
-                            e = v + j;
-                        }
-                    }
-                    j++;
+            uint v = it->start + n * BitsPerUint;
+            while ( b ) {
+                uint j = __builtin_ctz( b );
+                uint x = v + j;
+                if ( !e || e + 1 < x ) {
+                    if ( e )
+                        addRange( r, s, e );
+                    s = x;
                 }
+                // the run of ones starting at j
+                uint ones = b >> j;
+                uint l = ~ones ? __builtin_ctz( ~ones ) : BitsPerUint - j;
+                e = x + l - 1;
+                if ( j + l >= BitsPerUint )
+                    b = 0;
+                else
+                    b &= ~0u << ( j + l );
             }
             n++;
-            v += BitsPerUint;
         }
         ++it;
     }
@@ -545,23 +671,21 @@ EString IntegerSet::set() const
 EString IntegerSet::csl() const
 {
     EString r;
-    r.reserve( 2222 );
+    if ( isEmpty() )
+        return r;
+    r.reserve( listLength( count(), largest() ) );
 
     Map<SetData::Block>::Iterator it( d->b );
     while ( it ) {
         uint n = 0;
         while ( n < ArraySize ) {
-            uint j = 0;
             uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !r.isEmpty() )
-                            r.append( ',' );
-                        r.appendNumber( it->start + n * BitsPerUint + j );
-                    }
-                    j++;
-                }
+            while ( b ) {
+                uint j = __builtin_ctz( b );
+                if ( !r.isEmpty() )
+                    r.append( ',' );
+                r.appendNumber( it->start + n * BitsPerUint + j );
+                b &= b - 1;
             }
             n++;
         }
@@ -577,12 +701,15 @@ EString IntegerSet::csl() const
 
 void IntegerSet::recount() const
 {
+    d->last = 0;
     Map<SetData::Block>::Iterator i( d->b );
     while ( i ) {
         SetData::Block * b = i;
         ++i;
-        if ( !b->count )
+        if ( !b->count ) {
             b->recount();
+            d->stale = true;
+        }
         if ( !b->count )
             d->b.remove( b->start );
     }
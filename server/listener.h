@@ -17,15 +17,24 @@ class Listener
     : public Connection
 {
 public:
-    Listener( const Endpoint &e, const EString & s, bool silent = false )
+    Listener( const Endpoint &e, const EString & s, bool silent = false,
+              uint process = 0 )
         : Connection(), svc( s )
     {
         setType( Connection::Listener );
+        setServerProcess( process );
         if ( listen( e, silent ) >= 0 ) {
             EventLoop::global()->addConnection( this );
         }
     }
 
+    Listener( int fd, const EString & s )
+        : Connection( fd, Connection::Listener ), svc( s )
+    {
+        setState( Listening );
+        EventLoop::global()->addConnection( this );
+    }
+
     void read() {}
     void write() {}
     bool canWrite() { return false; }
@@ -47,10 +56,13 @@ public:
         if ( state() == Closing )
             return;
 
+        // accept everything that's queued, so a burst of connections
+        // doesn't cost one wakeup each
         int s = accept();
-        if ( s >= 0 ) {
+        while ( s >= 0 ) {
             Connection * c = new T(s);
             c->setState( Connected );
+            s = accept();
         }
     }
 
@@ -104,7 +116,18 @@ public:
                     bool silent = false;
                     if ( any6 && *it == "0.0.0.0" )
                         silent = true;
-                    Listener<T> * l = new Listener<T>( e, svc, silent );
+                    uint processes = 1;
+                    int inherited = inheritedSocket( e );
+                    if ( Configuration::toggle( Configuration::ReusePort ) &&
+                         e.protocol() != Endpoint::Unix && inherited < 0 )
+                        processes = Configuration::scalar(
+                            Configuration::ServerProcesses );
+                    Listener<T> * l = 0;
+                    if ( inherited >= 0 )
+                        l = new Listener<T>( inherited, svc );
+                    else
+                        l = new Listener<T>( e, svc, silent,
+                                             processes > 1 ? 1 : 0 );
                     if ( l->state() != Listening ) {
                         delete l;
                         l = 0;
@@ -125,6 +148,8 @@ public:
                     }
                     else {
                         ::log( "Started: " + l->description() );
+                        if ( processes > 1 )
+                            createPerProcess( l, e, svc, processes );
                         c++;
                         if ( *it == "::" )
                             any6 = true;
@@ -164,6 +189,32 @@ public:
 
 private:
     EString svc;
+
+    static void createPerProcess( Listener<T> * first, const Endpoint & e,
+                                  const EString & svc, uint processes )
+    {
+        List< Listener<T> > extra;
+        uint n = 2;
+        while ( n <= processes ) {
+            Listener<T> * l = new Listener<T>( e, svc, true, n );
+            if ( l->state() != Listening ) {
+                // no SO_REUSEPORT here, so all processes share one
+                ::log( "Cannot use reuse-port for " + svc + " on " +
+                       e.string() + "; sharing one socket", Log::Error );
+                delete l;
+                typename List< Listener<T> >::Iterator i( extra );
+                while ( i ) {
+                    Listener<T> * x = i;
+                    ++i;
+                    delete x;
+                }
+                first->setServerProcess( 0 );
+                return;
+            }
+            extra.append( l );
+            n++;
+        }
+    }
 };
 
 #endif
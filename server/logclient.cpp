@@ -4,6 +4,7 @@
 
 #include "eventloop.h"
 #include "estring.h"
+#include "buffer.h"
 #include "server.h"
 #include "connection.h"
 #include "configuration.h"
@@ -14,29 +15,49 @@
 #include <stdio.h>
 // gettimeofday
 #include <sys/time.h>
-// localtime
-#include <time.h>
 // openlog, syslog
 #include <syslog.h>
 
 
-/* This static function returns a nicely-formatted timestamp. */
+/* This static function appends one log message framed for the log
+   server to \a w: a four-byte length, the severity, the time in
+   seconds and milliseconds, the transaction \a id prefixed by its
+   length, and finally the message \a m. See
+   LogServer::processFrame().
 
-static EString time()
+   The message is appended straight to the write buffer, since
+   building it in a string first would make garbage for each line
+   logged.
+*/
+
+static void frame( Buffer * w, const EString & id, Log::Severity s,
+                   const EString & m )
 {
     struct timeval tv;
     struct timezone tz;
     if ( ::gettimeofday( &tv, &tz ) < 0 )
-        return "";
-    struct tm * t = localtime( (const time_t *)&tv.tv_sec );
-
-    // yuck.
-    char result[32];
-    sprintf( result, "%04d-%02d-%02d %02d:%02d:%02d.%03d",
-             t->tm_year + 1900, t->tm_mon+1, t->tm_mday,
-             t->tm_hour, t->tm_min, t->tm_sec,
-             (int)tv.tv_usec/1000 );
-    return result;
+        tv.tv_sec = tv.tv_usec = 0;
+    uint sec = (uint)tv.tv_sec;
+    uint ms = (uint)tv.tv_usec / 1000;
+    uint idl = id.length() > 255 ? 255 : id.length();
+    uint l = 1 + 4 + 2 + 1 + idl + m.length();
+
+    char h[12];
+    h[0] = (char)( l >> 24 );
+    h[1] = (char)( l >> 16 );
+    h[2] = (char)( l >> 8 );
+    h[3] = (char)l;
+    h[4] = (char)s;
+    h[5] = (char)( sec >> 24 );
+    h[6] = (char)( sec >> 16 );
+    h[7] = (char)( sec >> 8 );
+    h[8] = (char)sec;
+    h[9] = (char)( ms >> 8 );
+    h[10] = (char)ms;
+    h[11] = (char)idl;
+    w->append( h, sizeof( h ) );
+    w->append( id.data(), idl );
+    w->append( m );
 }
 
 
@@ -47,7 +68,7 @@ class LogClientData
 public:
     LogClientData( int fd, const Endpoint & e, Logger *client )
         : Connection( fd, Connection::LogClient ),
-          logServer( e ), owner( client )
+          logServer( e ), owner( client ), dropped( 0 )
     {
     }
 
@@ -61,6 +82,8 @@ public:
     void reconnect()
     {
         connect( logServer );
+        enqueue( "name " + name + "\r\n" );
+        enqueue( "binary\r\n" );
         EventLoop::global()->addConnection( this );
     }
 
@@ -71,8 +94,9 @@ public:
         case Timeout:
             break;
         case Shutdown:
+            // an empty frame asks logd to close the connection
             if ( state() == Connected )
-                enqueue( "shutdown\r\n" );
+                enqueue( EString( "\0\0\0\0", 4 ) );
             break;
         case Read:
         case Close:
@@ -87,15 +111,24 @@ public:
     Endpoint logServer;
     Logger *owner;
     EString name;
+    uint dropped;
 };
 
 
+// if the log server falls this far behind, we drop all but errors
+static const uint maxBacklog = 4 * 1024 * 1024;
+
+
 /*! \class LogClient logclient.h
     A Logger subclass that talks to our log server. (LogdClient)
 
     This is the Logger that's used throughout most of the system.
     All programs that want to use the regular log server must call
     LogClient::setup() at startup.
+
+    If the log server cannot keep up, LogClient drops messages less
+    severe than Log::Error once a few megabytes are waiting, and
+    reports the number dropped when it's able to send again.
 */
 
 /*! Creates a new LogClient.  This constructor is usable only via
@@ -138,16 +171,21 @@ void LogClient::send( const EString &id, Log::Severity s, const EString & m )
     if ( d->state() == Connection::Invalid )
         d->reconnect();
 
-    EString t( id );
-    t.reserve( m.length() + 35 );
-    t.append( " x/" );
-    t.append( Log::severity( s ) );
-    t.append( " " );
-    t.append( time() );
-    t.append( " " );
-    t.append( m.simplified() );
-    t.append( "\r\n" );
-    d->enqueue( t );
+    // if logd isn't keeping up, drop the unimportant messages rather
+    // than let the write buffer grow, and say so once it catches up.
+    if ( d->writeBuffer()->size() > maxBacklog && s < Log::Error ) {
+        d->dropped++;
+        return;
+    }
+    if ( d->dropped ) {
+        EString r( "Log server too slow: dropped " );
+        r.appendNumber( d->dropped );
+        r.append( " messages" );
+        frame( d->writeBuffer(), id, Log::Error, r );
+        d->dropped = 0;
+    }
+
+    frame( d->writeBuffer(), id, s, m );
 }
 
 
@@ -235,9 +273,21 @@ void LogClient::setup( const EString & n )
         }
         client->d->setBlocking( false );
         client->d->enqueue( "name " + client->name() + "\r\n" );
+        client->d->enqueue( "binary\r\n" );
         EventLoop::global()->addConnection( client->d );
     }
 
+    reconfigure();
+}
+
+
+/*! Sets the log level from the log-level configuration variable.
+    setup() calls this, and so does Server when the configuration is
+    reloaded.
+*/
+
+void LogClient::reconfigure()
+{
     Log::Severity ls;
     EString ll( Configuration::text( Configuration::LogLevel ) );
     if ( ll == Log::severity( Log::Disaster ) )
@@ -4,7 +4,9 @@
 
 #include "log.h"
 #include "map.h"
+#include "hashmap.h"
 #include "dict.h"
+#include "compactdict.h"
 #include "user.h"
 #include "query.h"
 #include "scope.h"
@@ -20,11 +22,18 @@
 #include "integerset.h"
 #include "estringlist.h"
 #include "transaction.h"
+#include "utf.h"
 
 
-static Map<Mailbox> * mailboxes = 0;
-static UDict<Mailbox> * mailboxesByName = 0;
+static HashMap<Mailbox> * mailboxes = 0;
+// keyed by the UTF-8 form of the titlecased name. the tree can have
+// millions of mailboxes and changes seldom, so a CompactDict saves a
+// lot of memory compared to a UDict.
+static CompactDict<Mailbox> * mailboxesByName = 0;
 static bool wiped = false;
+static bool lazy = false;
+// in lazy mode: the users whose mailboxes are in the tree
+static IntegerSet * users = 0;
 
 
 class MailboxData
@@ -35,7 +44,7 @@ public:
         : type( Mailbox::Ordinary ), id( 0 ),
           uidnext( 0 ), uidvalidity( 0 ), owner( 0 ),
           parent( 0 ), children( 0 ),
-          nextModSeq( 1 )
+          nextModSeq( 1 ), flagSnapshot( 0 ), sessions( 0 )
     {}
 
     UString name;
@@ -52,6 +61,8 @@ public:
     List< Mailbox > * children;
 
     int64 nextModSeq;
+    FlagSnapshot * flagSnapshot;
+    List<Session> * sessions;
 };
 
 
@@ -79,43 +90,105 @@ class MailboxReader
 public:
     EventHandler * owner;
     Query * q;
+    Query * deletions;
+    uint user;
+    int64 h;
     bool done;
 
-    MailboxReader( EventHandler * ev, int64 );
+    MailboxReader( EventHandler * ev, int64, uint = 0 );
+    void submit( Transaction * = 0 );
     void execute();
 };
 
 
 static List<MailboxReader> * readers = 0;
 
+// every transaction older than this has been taken into account by a
+// MailboxReader, so the next one only needs rows whose change is at
+// least this.
+static int64 horizon = 0;
 
-MailboxReader::MailboxReader( EventHandler * ev, int64 c )
-    : owner( ev ), q( 0 ), done( false )
+
+/*! Constructs a MailboxReader which reads the mailboxes changed by
+    transactions at or after \a c, and notifies \a ev when it's done.
+    If \a c is 0, it reads the entire table (or in lazy mode, the
+    mailboxes that belong to no user).
+
+    If \a u is nonzero, the MailboxReader reads only the mailboxes
+    owned by user \a u instead. Mailbox::load() uses that.
+*/
+
+MailboxReader::MailboxReader( EventHandler * ev, int64 c, uint u )
+    : owner( ev ), q( 0 ), deletions( 0 ), user( u ), h( 0 ), done( false )
 {
     if ( !::readers ) {
         ::readers = new List<MailboxReader>;
         Allocator::addEternal( ::readers, "active mailbox readers" );
     }
     ::readers->append( this );
-    q = new Query( "select m.id, m.name, m.deleted, m.owner, "
-                   "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag "
-                   //"m.change " // better: m.change
-                   "from mailboxes m ",
-                   //"where change>=$1"
-                   this );
-    c = c; //query->bind( 1, c );
+    EString s( "select m.id, m.name, m.deleted, m.owner, "
+               "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag, "
+               "txid_snapshot_xmin(txid_current_snapshot()) as horizon "
+               "from mailboxes m " );
+    if ( u ) {
+        q = new Query( s + "where m.owner=$1", this );
+        q->bind( 1, u );
+    }
+    else if ( !c && ::lazy ) {
+        q = new Query( s + "where m.owner is null", this );
+    }
+    else {
+        q = new Query( s + "where m.change>=$1", this );
+        q->bind( 1, c );
+    }
+    q->setShareable();
+    if ( c ) {
+        deletions = new Query( "select mailbox from mailbox_deletions "
+                               "where change>=$1", this );
+        deletions->bind( 1, c );
+        deletions->setShareable();
+    }
     if ( !::mailboxes )
         Mailbox::setup();
 }
 
 
+/*! Sends the queries, either within \a t or (if \a t is null, the
+    default) on their own.
+*/
+
+void MailboxReader::submit( Transaction * t )
+{
+    if ( t ) {
+        t->enqueue( q );
+        if ( deletions )
+            t->enqueue( deletions );
+    }
+    else {
+        q->execute();
+        if ( deletions )
+            deletions->execute();
+    }
+}
+
+
 void MailboxReader::execute() {
     while ( q->hasResults() ) {
         Row * r = q->nextRow();
+        h = r->getBigint( "horizon" );
 
         UString n = r->getUString( "name" );
         uint id = r->getInt( "id" );
         Mailbox * m = ::mailboxes->find( id );
+        if ( user && m ) {
+            // the other readers keep this one up to date
+            continue;
+        }
+        if ( ::lazy && !m && !r->isNull( "owner" ) &&
+             !::users->contains( r->getInt( "owner" ) ) ) {
+            // we'll read it if and when its owner needs it
+            continue;
+        }
         if ( !m || m->name() != n ) {
             m = Mailbox::obtain( n );
             if ( n != m->d->name )
@@ -144,9 +217,19 @@ void MailboxReader::execute() {
         m->setFlag( r->getEString( "flag" ) );
     }
 
-    if ( !q->done() || done )
+    if ( !q->done() || ( deletions && !deletions->done() ) || done )
         return;
 
+    while ( deletions && deletions->hasResults() ) {
+        Row * r = deletions->nextRow();
+        uint id = r->getInt( "mailbox" );
+        Mailbox * m = ::mailboxes->find( id );
+        if ( m ) {
+            m->setType( Mailbox::Deleted );
+            ::mailboxes->remove( id );
+        }
+    }
+
     done = true;
     if ( q->transaction() )
         q->transaction()->commit();
@@ -160,6 +243,11 @@ void MailboxReader::execute() {
             log( "Couldn't create mailbox tree: " + q->error(),
                  Log::Disaster );
     }
+    else if ( !q->failed() && !user && h > ::horizon ) {
+        // if no rows were returned, nothing changed, and the old
+        // horizon is as good as any
+        ::horizon = h;
+    }
     if ( owner )
         owner->execute();
 };
@@ -192,8 +280,8 @@ public:
         else {
             // time's out, time to work
             t = 0;
-            m = new MailboxReader( 0, 0 );
-            m->q->execute();
+            m = new MailboxReader( 0, ::horizon );
+            m->submit();
         }
     }
     Timer * t;
@@ -201,6 +289,146 @@ public:
 };
 
 
+// parses a nonnegative decimal number that may not fit in a uint
+static int64 bigNumber( const EString & s, bool * ok )
+{
+    int64 n = 0;
+    uint i = 0;
+    *ok = !s.isEmpty() && s.length() < 19;
+    while ( *ok && i < s.length() ) {
+        if ( s[i] >= '0' && s[i] <= '9' )
+            n = n * 10 + s[i] - '0';
+        else
+            *ok = false;
+        i++;
+    }
+    return n;
+}
+
+
+// the mailbox_update_trigger sends "mailbox_counters" with a payload
+// of 'id uidnext nextmodseq' when only those columns change. this
+// applies such changes directly, so that deliveries don't cost each
+// server a MailboxReader. all the changes that arrive during one
+// event loop iteration are applied together, once per mailbox.
+class MailboxCountersWatcher
+    : public EventHandler
+{
+public:
+    MailboxCountersWatcher(): EventHandler(), s( 0 ), t( 0 ) {
+        s = new DatabaseSignal( "mailbox_counters", this );
+    }
+    void execute() {
+        if ( EventLoop::global()->inShutdown() )
+            return;
+
+        if ( !t ) {
+            t = new Timer( this, 0 );
+            return;
+        }
+        if ( t->active() )
+            return;
+        t = 0;
+
+        Map<Change> changes;
+        List<Change> changed;
+        EStringList::Iterator i( s->payloads() );
+        while ( i ) {
+            EStringList * w = EStringList::split( ' ', *i );
+            ++i;
+            EStringList::Iterator f( w );
+            bool ok = w->count() == 3;
+            uint id = 0;
+            uint uidnext = 0;
+            int64 modseq = 0;
+            if ( ok ) {
+                id = f->number( &ok );
+                ++f;
+            }
+            if ( ok ) {
+                uidnext = f->number( &ok );
+                ++f;
+            }
+            if ( ok )
+                modseq = bigNumber( *f, &ok );
+            Mailbox * m = ok ? ::mailboxes->find( id ) : 0;
+            if ( !m )
+                continue;
+            Change * c = changes.find( id );
+            if ( !c ) {
+                c = new Change( m );
+                changes.insert( id, c );
+                changed.append( c );
+            }
+            if ( uidnext > c->uidnext )
+                c->uidnext = uidnext;
+            if ( modseq > c->modseq )
+                c->modseq = modseq;
+        }
+
+        List<Change>::Iterator c( changed );
+        while ( c ) {
+            Mailbox * m = c->mailbox;
+            // notifications may arrive out of order; never go back
+            if ( c->uidnext < m->uidnext() )
+                c->uidnext = m->uidnext();
+            if ( c->modseq < m->nextModSeq() )
+                c->modseq = m->nextModSeq();
+            m->setUidnextAndNextModSeq( c->uidnext, c->modseq, 0 );
+            ++c;
+        }
+    }
+
+    class Change
+        : public Garbage
+    {
+    public:
+        Change( Mailbox * m ): mailbox( m ), uidnext( 0 ), modseq( 0 ) {}
+        Mailbox * mailbox;
+        uint uidnext;
+        int64 modseq;
+    };
+
+    DatabaseSignal * s;
+    Timer * t;
+};
+
+
+// Mailbox::announceRename() sends "mailboxes_renamed" with a payload
+// of the old name's length, a space and the old and new names. this
+// moves the renamed subtree at once, so that the MailboxReader that
+// follows finds the names already right.
+class MailboxRenameWatcher
+    : public EventHandler
+{
+public:
+    MailboxRenameWatcher(): EventHandler(), s( 0 ) {
+        s = new DatabaseSignal( "mailboxes_renamed", this );
+    }
+    void execute() {
+        if ( EventLoop::global()->inShutdown() )
+            return;
+
+        EStringList::Iterator i( s->payloads() );
+        while ( i ) {
+            EString p = *i;
+            ++i;
+            int space = p.find( ' ' );
+            bool ok = space > 0;
+            uint l = 0;
+            if ( ok )
+                l = p.mid( 0, space ).number( &ok );
+            Utf8Codec c;
+            UString names = c.toUnicode( p.mid( space + 1 ) );
+            if ( ok && c.valid() && l < names.length() )
+                Mailbox::moveTree( names.mid( 0, l ), names.mid( l ) );
+        }
+    }
+
+    DatabaseSignal * s;
+};
+
+
 // this helper class is used to recover when testing tools
 // violate various database invariants.
 class MailboxObliterator
@@ -217,9 +445,12 @@ public:
             ::mailboxes->clear();
             ::mailboxesByName->clear();
             ::wiped = true;
+            ::horizon = 0;
+            if ( ::users )
+                ::users->clear();
             (void)Mailbox::root();
             mr = new MailboxReader( this, 0 );
-            mr->q->execute();
+            mr->submit();
         }
 
         if ( !mr->done )
@@ -235,24 +466,33 @@ public:
     be called by ::main().
 
     The \a owner (if one is specified) is notified of completion.
+
+    If \a lazy is true, only the mailboxes that belong to no user are
+    read now, and each user's mailboxes are read by load() when
+    needed. The default is false, which reads the entire table.
 */
 
-void Mailbox::setup( EventHandler * owner )
+void Mailbox::setup( EventHandler * owner, bool lazy )
 {
     ::wiped = true;
+    ::lazy = lazy;
+    ::users = new IntegerSet;
+    Allocator::addEternal( ::users, "users with mailboxes in the tree" );
 
-    ::mailboxes = new Map<Mailbox>;
+    ::mailboxes = new HashMap<Mailbox>;
     Allocator::addEternal( ::mailboxes, "mailbox tree" );
 
-    ::mailboxesByName = new UDict<Mailbox>;
+    ::mailboxesByName = new CompactDict<Mailbox>;
     Allocator::addEternal( ::mailboxesByName, "mailbox tree" );
 
     (void)root();
 
     Scope x( new Log );
-    (new MailboxReader( owner, 0 ))->q->execute();
+    (new MailboxReader( owner, 0 ))->submit();
 
     (void)new MailboxesWatcher;
+    (void)new MailboxCountersWatcher;
+    (void)new MailboxRenameWatcher;
     if ( !Configuration::toggle( Configuration::Security ) )
         (void)new MailboxObliterator;
 }
@@ -512,7 +752,7 @@ Mailbox * Mailbox::obtain( const UString & name, bool create )
         setup();
 
     UString n = name.titlecased();
-    Mailbox * m = ::mailboxesByName->find( n );
+    Mailbox * m = ::mailboxesByName->find( n.utf8() );
     if ( m || !create )
         return m;
     uint i = 0;
@@ -522,10 +762,11 @@ Mailbox * Mailbox::obtain( const UString & name, bool create )
             uint l = i;
             if ( !l )
                 l = 1;
-            m = ::mailboxesByName->find( n.mid( 0, l ) );
+            EString k = n.mid( 0, l ).utf8();
+            m = ::mailboxesByName->find( k );
             if ( !m ) {
                 m = new Mailbox( name.mid( 0, l ) );
-                ::mailboxesByName->insert( n.mid( 0, l ), m );
+                ::mailboxesByName->insert( k, m );
                 if ( p ) {
                     if ( !p->d->children )
                         p->d->children = new List<Mailbox>;
@@ -562,6 +803,10 @@ void Mailbox::setUidnextAndNextModSeq( uint n, int64 m, Transaction * t )
     d->uidnext = n;
     d->nextModSeq = m;
 
+    // if nobody's looking, there's nothing to update
+    if ( !d->sessions || d->sessions->isEmpty() )
+        return;
+
     (void)new SessionInitialiser( this, t );
 }
 
@@ -582,6 +827,9 @@ void Mailbox::setDeleted( bool del )
     it returns 0 and does nothing. It does not commit the transaction.
 
     If \a owner is non-null, the new mailbox is owned by by \a owner.
+
+    If the mailbox was deleted and the Maintainer hasn't yet emptied
+    it, this moves the remaining messages to deleted_messages first.
 */
 
 Query * Mailbox::create( Transaction * t, User * owner )
@@ -589,8 +837,22 @@ Query * Mailbox::create( Transaction * t, User * owner )
     Query * q;
 
     if ( deleted() ) {
+        q = new Query( "select nextmodseq from mailboxes "
+                       "where id=$1 for update", 0 );
+        q->bind( 1, id() );
+        t->enqueue( q );
+        q = new Query( "insert into deleted_messages "
+                       "(mailbox,uid,message,modseq,deleted_by,reason) "
+                       "select mm.mailbox, mm.uid, mm.message, "
+                       "mb.nextmodseq, null, 'Mailbox deleted' "
+                       "from mailbox_messages mm "
+                       "join mailboxes mb on (mm.mailbox=mb.id) "
+                       "where mm.mailbox=$1", 0 );
+        q->bind( 1, id() );
+        t->enqueue( q );
         q = new Query( "update mailboxes "
-                       "set deleted='f',owner=$2,first_recent=uidnext,flag=$3 "
+                       "set deleted='f',owner=$2,first_recent=uidnext,"
+                       "flag=$3,nextmodseq=nextmodseq+1 "
                        "where id=$1", 0 );
         q->bind( 1, id() );
     }
@@ -649,6 +911,11 @@ Query * Mailbox::create( Transaction * t, User * owner )
 /*! If this Mailbox can be deleted, this function enqueues a Query to do
     so in the Transaction \a t and returns the Query. If not, it returns
     0 and does nothing. It does not commit the transaction.
+
+    The mailbox need not be empty. Its messages stay in
+    mailbox_messages until the Maintainer moves them to
+    deleted_messages, a batch at a time, so deleting even a very large
+    mailbox is quick.
 */
 
 Query * Mailbox::remove( Transaction * t )
@@ -667,6 +934,7 @@ Query * Mailbox::remove( Transaction * t )
     t->enqueue( q );
 
     t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+    t->enqueue( new Query( "notify mailboxes_emptying", 0 ) );
 
     return q;
 }
@@ -679,39 +947,149 @@ Query * Mailbox::remove( Transaction * t )
 void Mailbox::refreshMailboxes( class Transaction * t )
 {
     Scope x( new Log );
-    MailboxReader * mr = new MailboxReader( 0, 0 );
+    MailboxReader * mr = new MailboxReader( 0, ::horizon );
     Transaction * s = t->subTransaction( mr );
-    s->enqueue( mr->q );
+    mr->submit( s );
     s->enqueue( new Query( "notify mailboxes_updated", 0 ) );
     s->execute();
 }
 
 
-/*! Returns a pointer to the sessions on this mailbox. The return
-    value may be a null pointer. In the event of client/network
-    problems it may also include sessions that have recently become
-    invalid.
+/*! Adds a query to \a t to tell all servers, when \a t commits, that
+    the mailbox named \a from and its children have been renamed to
+    \a to. Each server then calls moveTree(). The MailboxReader that
+    runs because the names changed finds them already changed.
 */
 
-List<Session> * Mailbox::sessions() const
+void Mailbox::announceRename( class Transaction * t,
+                              const UString & from, const UString & to )
 {
-    List<Session> * r = 0;
+    EString p = fn( from.length() );
+    p.append( " " );
+    p.append( from.utf8() );
+    p.append( to.utf8() );
+    Query * q = new Query( "select pg_notify('mailboxes_renamed',$1)", 0 );
+    q->bind( 1, p );
+    t->enqueue( q );
+}
 
-    List<Connection> * connections = EventLoop::global()->connections();
-    List<Connection>::Iterator i( connections );
-    while ( i ) {
-        Session * s = i->session();
-        if ( s && s->mailbox() == this ) {
-            if ( !r )
-                r = new List<Session>;
-            r->append( s );
+
+/*! Moves the Mailbox named \a from and its children to \a to in the
+    tree, keeping the objects, so that sessions on them follow. Returns
+    true if that was done, and false if there's nothing to move or if
+    something is in the way at \a to already; in the latter case, the
+    MailboxReader has to sort the tree out.
+
+    This doesn't change the database; it only brings the tree up to
+    date after a rename.
+*/
+
+bool Mailbox::moveTree( const UString & from, const UString & to )
+{
+    Mailbox * m = obtain( from, false );
+    if ( !m || m == root() || obtain( to, false ) )
+        return false;
+
+    int slash = to.length() - 1;
+    while ( slash > 0 && to[slash] != '/' )
+        slash--;
+    if ( slash < 0 )
+        return false;
+    Mailbox * p = root();
+    if ( slash > 0 )
+        p = obtain( to.mid( 0, slash ) );
+    if ( !p )
+        return false;
+
+    if ( m->d->parent && m->d->parent->d->children )
+        m->d->parent->d->children->remove( m );
+    if ( !p->d->children )
+        p->d->children = new List<Mailbox>;
+    p->d->children->append( m );
+    m->d->parent = p;
+
+    uint l = from.length();
+    List<Mailbox> todo;
+    todo.append( m );
+    while ( !todo.isEmpty() ) {
+        Mailbox * n = todo.shift();
+        ::mailboxesByName->remove( n->d->name.titlecased().utf8() );
+        UString name = to;
+        name.append( n->d->name.mid( l ) );
+        n->d->name = name;
+        ::mailboxesByName->insert( name.titlecased().utf8(), n );
+        List<Mailbox>::Iterator c( n->d->children );
+        while ( c ) {
+            todo.append( c );
+            ++c;
         }
-        ++i;
     }
+    return true;
+}
+
+
+/*! Returns a pointer to a new list of the sessions on this mailbox,
+    or a null pointer if there are none. In the event of
+    client/network problems it may also include sessions that have
+    recently become invalid.
+
+    The sessions are those recorded by addSession(), so this costs
+    time in proportion to the number of sessions on this mailbox, not
+    the number of connections.
+*/
+
+List<Session> * Mailbox::sessions() const
+{
+    if ( !d->sessions || d->sessions->isEmpty() )
+        return 0;
+    List<Session> * r = new List<Session>;
+    r->append( *d->sessions );
     return r;
 }
 
 
+/*! Records that \a s is a session on this mailbox. Connection calls
+    this from setSession().
+*/
+
+void Mailbox::addSession( Session * s )
+{
+    if ( !d->sessions )
+        d->sessions = new List<Session>;
+    if ( !d->sessions->find( s ) )
+        d->sessions->append( s );
+}
+
+
+/*! Records that \a s no longer is a session on this mailbox. */
+
+void Mailbox::removeSession( Session * s )
+{
+    if ( d->sessions )
+        d->sessions->remove( s );
+}
+
+
+/*! Returns the most recent FlagSnapshot for this mailbox, or a null
+    pointer if there isn't one.
+*/
+
+FlagSnapshot * Mailbox::flagSnapshot() const
+{
+    return d->flagSnapshot;
+}
+
+
+/*! Records that \a s describes the most recent changes to this
+    mailbox. \a s must not be changed afterwards.
+*/
+
+void Mailbox::setFlagSnapshot( FlagSnapshot * s )
+{
+    d->flagSnapshot = s;
+}
+
+
 /*! Returns the value last specified by nextModSeq(), or 1 initially. */
 
 int64 Mailbox::nextModSeq() const
@@ -803,6 +1181,38 @@ uint Mailbox::match( const UString & pattern, uint p,
 }
 
 
+/*! Makes sure that the mailboxes owned by \a user are in the tree,
+    and returns true if they are. If they aren't, load() starts
+    reading them, notifies \a ev when done and returns false.
+
+    Unless setup() was asked to be lazy, all mailboxes are always in
+    the tree and load() returns true at once.
+*/
+
+bool Mailbox::load( uint user, EventHandler * ev )
+{
+    if ( !::lazy || !user )
+        return true;
+
+    bool reading = false;
+    if ( ::readers ) {
+        List<MailboxReader>::Iterator i( ::readers );
+        while ( i && i->user != user )
+            ++i;
+        if ( i )
+            reading = true;
+    }
+    if ( ::users->contains( user ) && !reading )
+        return true;
+
+    // add the user at once, so the MailboxesWatcher keeps any
+    // mailboxes changed from now on
+    ::users->add( user );
+    (new MailboxReader( ev, 0, user ))->submit();
+    return false;
+}
+
+
 /*! Returns true if the Mailbox subsystem is currently in the process
     of relearning all the Mailbox objects from the database. Never
     returns true during normal operations, but may if if the database
@@ -7,6 +7,7 @@
 #include "ustring.h"
 
 class EventHandler;
+class FlagSnapshot;
 class Transaction;
 class IntegerSet;
 class Message;
@@ -49,7 +50,8 @@ public:
     List< Mailbox > * children() const;
     bool hasChildren() const;
 
-    static void setup( class EventHandler * = 0 );
+    static void setup( class EventHandler * = 0, bool = false );
+    static bool load( uint, class EventHandler * );
     static Mailbox * find( const UString &, bool = false );
     static Mailbox * obtain( const UString &, bool create = true );
     static Mailbox * closestParent( const UString & );
@@ -71,9 +73,17 @@ public:
     Query * create( class Transaction *, class User * );
     Query * remove( class Transaction * );
     static void refreshMailboxes( class Transaction * );
+    static void announceRename( class Transaction *,
+                                const UString &, const UString & );
+    static bool moveTree( const UString &, const UString & );
 
     void abortSessions();
     List<class Session> * sessions() const;
+    void addSession( class Session * );
+    void removeSession( class Session * );
+
+    FlagSnapshot * flagSnapshot() const;
+    void setFlagSnapshot( FlagSnapshot * );
 
     static bool refreshing();
 
@@ -0,0 +1,398 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "messageindex.h"
+
+#include "integerset.h"
+#include "allocator.h"
+#include "mailbox.h"
+#include "session.h"
+#include "query.h"
+#include "scope.h"
+#include "flag.h"
+#include "list.h"
+#include "map.h"
+#include "log.h"
+
+// memmove
+#include <string.h>
+
+
+class MessageIndexData
+    : public Garbage
+{
+public:
+    MessageIndexData()
+        : session( 0 ),
+          n( 0 ), max( 0 ),
+          uids( 0 ), idates( 0 ), sizes( 0 ), modseqs( 0 ), flagbits( 0 ),
+          uidnext( 0 ), nextModSeq( 0 ),
+          messages( 0 ), flags( 0 ),
+          newUidnext( 0 ), newNextModSeq( 0 )
+    {}
+
+    Session * session;
+
+    // one column per attribute, all sorted by uid
+    uint n;
+    uint max;
+    uint * uids;
+    uint * idates;
+    uint * sizes;
+    int64 * modseqs;
+    int64 * flagbits;
+
+    IntegerSet seen;
+    IntegerSet deleted;
+    Map<IntegerSet> other;
+
+    // what the columns cover
+    uint uidnext;
+    int64 nextModSeq;
+
+    // an ongoing refresh
+    Query * messages;
+    Query * flags;
+    uint newUidnext;
+    int64 newNextModSeq;
+    IntegerSet changed;
+    List<EventHandler> waiters;
+};
+
+
+/*! \class MessageIndex messageindex.h
+    The MessageIndex class keeps the flags, internaldate, rfc822size
+    and modseq of every message in a Session, so that Selector::match()
+    and SelectorProgram can answer common searches on large mailboxes
+    without asking the database.
+
+    Each attribute is kept in its own array, sorted by uid, including
+    mailbox_messages.flagbits, and each other flag as an IntegerSet of
+    uids. That costs about 30 bytes per message, which is why the
+    index is only built when a Search finds it useful.
+
+    The index is current() when it covers everything the Session
+    knows about. When the Session learns about new messages or
+    changes, refresh() fetches just the messages whose modseq or uid
+    is new.
+
+    Messages that have been expunged stay in the index. Nothing asks
+    about them, since Search only looks at the Session's messages.
+*/
+
+
+/*! Constructs an empty MessageIndex for \a s. Nothing is fetched
+    until refresh() is called.
+*/
+
+MessageIndex::MessageIndex( Session * s )
+    : d( new MessageIndexData )
+{
+    d->session = s;
+}
+
+
+/*! Returns true if this index describes every message in its Session
+    as the Session currently sees them, and false if it's out of date
+    or being refreshed.
+*/
+
+bool MessageIndex::current() const
+{
+    if ( d->messages )
+        return false;
+    if ( !d->uidnext )
+        return false;
+    return d->uidnext >= d->session->uidnext() &&
+        d->nextModSeq >= d->session->nextModSeq();
+}
+
+
+/*! Makes sure the index is current(). Returns true if it is, and
+    otherwise starts fetching what's missing, notifies \a owner when
+    the index is current, and returns false.
+*/
+
+bool MessageIndex::refresh( EventHandler * owner )
+{
+    if ( current() )
+        return true;
+    if ( owner )
+        d->waiters.append( owner );
+    if ( d->messages )
+        return false;
+
+    Mailbox * m = d->session->mailbox();
+    d->newUidnext = d->session->uidnext();
+    d->newNextModSeq = d->session->nextModSeq();
+    d->changed.clear();
+
+    EString c( " where mm.mailbox=$1 and mm.uid<$2" );
+    if ( d->uidnext )
+        c.append( " and (mm.uid>=$3 or mm.modseq>=$4)" );
+
+    d->messages = new Query( "select mm.uid, mm.modseq, mm.seen, mm.deleted, "
+                             "mm.flagbits, m.idate, m.rfc822size "
+                             "from mailbox_messages mm "
+                             "join messages m on (mm.message=m.id)" + c +
+                             " order by mm.uid", this );
+    d->flags = new Query( "select f.uid, f.flag from flags f "
+                          "join mailbox_messages mm on "
+                          "(f.mailbox=mm.mailbox and f.uid=mm.uid)" + c,
+                          this );
+    Query * q = d->messages;
+    while ( q ) {
+        q->bind( 1, m->id() );
+        q->bind( 2, d->newUidnext );
+        if ( d->uidnext ) {
+            q->bind( 3, d->uidnext );
+            q->bind( 4, d->nextModSeq );
+        }
+        q->execute();
+        if ( q == d->messages )
+            q = d->flags;
+        else
+            q = 0;
+    }
+    return false;
+}
+
+
+void MessageIndex::execute()
+{
+    if ( !d->messages )
+        return;
+
+    while ( d->messages->hasResults() ) {
+        Row * r = d->messages->nextRow();
+        uint uid = r->getInt( "uid" );
+        uint i = insert( uid );
+        d->modseqs[i] = r->getBigint( "modseq" );
+        d->flagbits[i] = r->getBigint( "flagbits" );
+        d->idates[i] = r->getInt( "idate" );
+        d->sizes[i] = r->getInt( "rfc822size" );
+        if ( r->getBoolean( "seen" ) )
+            d->seen.add( uid );
+        else
+            d->seen.remove( uid );
+        if ( r->getBoolean( "deleted" ) )
+            d->deleted.add( uid );
+        else
+            d->deleted.remove( uid );
+        d->changed.add( uid );
+    }
+
+    if ( !d->messages->done() || !d->flags->done() )
+        return;
+
+    if ( d->messages->failed() || d->flags->failed() ) {
+        // leave the index as it was. it's not current, so the next
+        // search will try again, and this one goes to the database.
+        log( "Could not refresh message index", Log::Debug );
+    }
+    else {
+        Map<IntegerSet>::Iterator o( d->other );
+        while ( o ) {
+            o->remove( d->changed );
+            ++o;
+        }
+        while ( d->flags->hasResults() ) {
+            Row * r = d->flags->nextRow();
+            uint flag = r->getInt( "flag" );
+            IntegerSet * s = d->other.find( flag );
+            if ( !s ) {
+                s = new IntegerSet;
+                d->other.insert( flag, s );
+            }
+            s->add( r->getInt( "uid" ) );
+        }
+        d->uidnext = d->newUidnext;
+        d->nextModSeq = d->newNextModSeq;
+        log( "Message index for " + d->session->mailbox()->name().utf8() +
+             " updated " + fn( d->changed.count() ) + " messages",
+             Log::Debug );
+    }
+
+    d->messages = 0;
+    d->flags = 0;
+    d->changed.clear();
+
+    List<EventHandler>::Iterator w( d->waiters );
+    d->waiters.clear();
+    while ( w ) {
+        w->execute();
+        ++w;
+    }
+}
+
+
+/*! Returns true if the index knows about \a uid, and false if not. */
+
+bool MessageIndex::contains( uint uid ) const
+{
+    uint i = position( uid );
+    return i < d->n && d->uids[i] == uid;
+}
+
+
+/*! Returns true if the message with \a uid has the flag whose id is
+    \a flag. Returns false if not, or if the message isn't known.
+*/
+
+bool MessageIndex::hasFlag( uint uid, uint flag ) const
+{
+    if ( Flag::isSeen( flag ) )
+        return d->seen.contains( uid );
+    if ( Flag::isDeleted( flag ) )
+        return d->deleted.contains( uid );
+    int64 b = Flag::bit( flag );
+    if ( b ) {
+        uint i = position( uid );
+        return i < d->n && d->uids[i] == uid && ( d->flagbits[i] & b );
+    }
+    IntegerSet * s = d->other.find( flag );
+    return s && s->contains( uid );
+}
+
+
+/*! Returns the internaldate of \a uid, or 0 if that isn't known. */
+
+uint MessageIndex::internalDate( uint uid ) const
+{
+    uint i = position( uid );
+    if ( i < d->n && d->uids[i] == uid )
+        return d->idates[i];
+    return 0;
+}
+
+
+/*! Returns the rfc822size of \a uid, or 0 if that isn't known. */
+
+uint MessageIndex::rfc822Size( uint uid ) const
+{
+    uint i = position( uid );
+    if ( i < d->n && d->uids[i] == uid )
+        return d->sizes[i];
+    return 0;
+}
+
+
+/*! Returns the modseq of \a uid, or 0 if that isn't known. */
+
+int64 MessageIndex::modSeq( uint uid ) const
+{
+    uint i = position( uid );
+    if ( i < d->n && d->uids[i] == uid )
+        return d->modseqs[i];
+    return 0;
+}
+
+
+/*! Copies the columns for the \a n messages in \a uids, which must
+    be in ascending order, to the arrays given. Any of \a idates, \a
+    sizes, \a modseqs and \a flagbits may be a null pointer if that
+    column isn't needed. \a found[i] is set to true if the index knows
+    about \a uids[i], and to false (with zeroes in the columns) if not.
+
+    This lets SelectorProgram look at a batch of messages with one
+    search instead of one per message and column.
+*/
+
+void MessageIndex::fill( const uint * uids, uint n, bool * found,
+                         uint * idates, uint * sizes,
+                         int64 * modseqs, int64 * flagbits ) const
+{
+    uint p = n ? position( uids[0] ) : 0;
+    uint i = 0;
+    while ( i < n ) {
+        while ( p < d->n && d->uids[p] < uids[i] )
+            p++;
+        bool f = p < d->n && d->uids[p] == uids[i];
+        found[i] = f;
+        if ( idates )
+            idates[i] = f ? d->idates[p] : 0;
+        if ( sizes )
+            sizes[i] = f ? d->sizes[p] : 0;
+        if ( modseqs )
+            modseqs[i] = f ? d->modseqs[p] : 0;
+        if ( flagbits )
+            flagbits[i] = f ? d->flagbits[p] : 0;
+        i++;
+    }
+}
+
+
+/*! Returns the position of \a uid in the columns, or if \a uid isn't
+    there, the position where it would be inserted.
+*/
+
+uint MessageIndex::position( uint uid ) const
+{
+    uint b = 0;
+    uint e = d->n;
+    while ( b < e ) {
+        uint m = ( b + e ) / 2;
+        if ( d->uids[m] < uid )
+            b = m + 1;
+        else
+            e = m;
+    }
+    return b;
+}
+
+
+/*! Makes room for \a uid in the columns if necessary, and returns its
+    position. New messages have larger uids than the old ones, so this
+    usually appends.
+*/
+
+uint MessageIndex::insert( uint uid )
+{
+    uint i = d->n;
+    if ( d->n && d->uids[d->n-1] >= uid ) {
+        i = position( uid );
+        if ( d->uids[i] == uid )
+            return i;
+    }
+
+    if ( d->n == d->max ) {
+        uint max = d->max * 2;
+        if ( max < 1024 )
+            max = 1024;
+        uint * uids = (uint*)Allocator::alloc( max * sizeof( uint ), 0 );
+        uint * idates = (uint*)Allocator::alloc( max * sizeof( uint ), 0 );
+        uint * sizes = (uint*)Allocator::alloc( max * sizeof( uint ), 0 );
+        int64 * modseqs =
+            (int64*)Allocator::alloc( max * sizeof( int64 ), 0 );
+        int64 * flagbits =
+            (int64*)Allocator::alloc( max * sizeof( int64 ), 0 );
+        if ( d->n ) {
+            memmove( uids, d->uids, d->n * sizeof( uint ) );
+            memmove( idates, d->idates, d->n * sizeof( uint ) );
+            memmove( sizes, d->sizes, d->n * sizeof( uint ) );
+            memmove( modseqs, d->modseqs, d->n * sizeof( int64 ) );
+            memmove( flagbits, d->flagbits, d->n * sizeof( int64 ) );
+        }
+        d->uids = uids;
+        d->idates = idates;
+        d->sizes = sizes;
+        d->modseqs = modseqs;
+        d->flagbits = flagbits;
+        d->max = max;
+    }
+
+    if ( i < d->n ) {
+        uint c = d->n - i;
+        memmove( d->uids + i + 1, d->uids + i, c * sizeof( uint ) );
+        memmove( d->idates + i + 1, d->idates + i, c * sizeof( uint ) );
+        memmove( d->sizes + i + 1, d->sizes + i, c * sizeof( uint ) );
+        memmove( d->modseqs + i + 1, d->modseqs + i, c * sizeof( int64 ) );
+        memmove( d->flagbits + i + 1, d->flagbits + i, c * sizeof( int64 ) );
+    }
+    d->uids[i] = uid;
+    d->idates[i] = 0;
+    d->sizes[i] = 0;
+    d->modseqs[i] = 0;
+    d->flagbits[i] = 0;
+    d->n++;
+    return i;
+}
@@ -0,0 +1,40 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef MESSAGEINDEX_H
+#define MESSAGEINDEX_H
+
+#include "event.h"
+
+
+class Session;
+
+
+class MessageIndex
+    : public EventHandler
+{
+public:
+    MessageIndex( Session * );
+
+    bool current() const;
+    bool refresh( EventHandler * );
+
+    bool contains( uint ) const;
+    bool hasFlag( uint, uint ) const;
+    uint internalDate( uint ) const;
+    uint rfc822Size( uint ) const;
+    int64 modSeq( uint ) const;
+
+    void fill( const uint *, uint, bool *,
+               uint *, uint *, int64 *, int64 * ) const;
+
+    void execute();
+
+private:
+    class MessageIndexData * d;
+
+    uint position( uint ) const;
+    uint insert( uint );
+};
+
+
+#endif
@@ -4,9 +4,12 @@
 
 #include "integerset.h"
 #include "estringlist.h"
+#include "dbsignal.h"
 #include "mailbox.h"
+#include "cache.h"
 #include "event.h"
 #include "query.h"
+#include "dict.h"
 #include "user.h"
 
 
@@ -28,12 +31,44 @@ static const char * rightNames[Permissions::NumRights] = {
 };
 
 
+class PermissionsCache
+    : public Cache
+{
+public:
+    PermissionsCache(): Cache( 10 ) {}
+
+    // the rights string found for each login/mailbox-id pair
+    Dict<EString> rights;
+    // the names of the groups each login belongs to
+    Dict<EStringList> groups;
+
+    void clear() { rights.clear(); groups.clear(); }
+};
+
+
+static PermissionsCache * cache = 0;
+
+
+class PermissionsWatcher
+    : public EventHandler
+{
+public:
+    PermissionsWatcher(): EventHandler() {
+        (void)new DatabaseSignal( "permissions_updated", this );
+    }
+    void execute() {
+        ::cache->clear();
+    }
+};
+
+
 class PermissionData
     : public Garbage
 {
 public:
     PermissionData()
-        : ready( false ), mailbox( 0 ), user( 0 ), owner( 0 ), q( 0 )
+        : ready( false ), mailbox( 0 ), user( 0 ), owner( 0 ), q( 0 ),
+          gq( 0 ), groups( 0 )
     {
         uint i = 0;
         while ( i < Permissions::NumRights )
@@ -46,6 +81,9 @@ public:
     EventHandler * owner;
     bool allowed[ Permissions::NumRights ];
     Query * q;
+    Query * gq;
+    EStringList * groups;
+    EString key;
 };
 
 
@@ -153,11 +191,15 @@ bool Permissions::allowed( Right r )
 
 /*! This function processes ACL results from the database and calculates
     the applicable permissions.
+
+    The rights found for each user and mailbox, and the groups each
+    user belongs to, are cached until the permissions, groups or
+    group_members tables change.
 */
 
 void Permissions::execute()
 {
-    if ( !d->q ) {
+    if ( !d->q && !d->gq ) {
         // The owner of a mailbox always has all rights.
         if ( d->user->login() != "anonymous" &&
              d->user->login() != "anyone" &&
@@ -183,16 +225,46 @@ void Permissions::execute()
             d->allowed[Read] = true;
         }
 
-        // For everyone else, we have to check.
-        d->q = new Query( "select * from permissions "
-                          "where mailbox=any($1) and "
-                          "(identifier=$2 or"
-                          " identifier='anyone' or"
-                          " identifier in ("
-                          "select g.name from groups g "
-                          "join group_members gm on (g.id=gm.groupid) "
-                          "join users u on (gm.member=u.id) "
-                          "where u.login=$2))",
+        // For everyone else, we have to check, unless we already did.
+        if ( !::cache ) {
+            ::cache = new PermissionsCache;
+            (void)new PermissionsWatcher;
+        }
+        EString login = d->user->login().utf8();
+        d->key = login + "/" + fn( d->mailbox->id() );
+        EString * known = ::cache->rights.find( d->key );
+        if ( known ) {
+            allow( *known );
+            d->ready = true;
+            d->owner = 0;
+            return;
+        }
+
+        d->groups = ::cache->groups.find( login );
+        if ( !d->groups ) {
+            d->gq = new Query( "select g.name from groups g "
+                               "join group_members gm on (g.id=gm.groupid) "
+                               "join users u on (gm.member=u.id) "
+                               "where u.login=$1", this );
+            d->gq->bind( 1, d->user->login() );
+            d->gq->setShareable();
+            d->gq->execute();
+        }
+    }
+
+    if ( !d->groups ) {
+        if ( !d->gq->done() )
+            return;
+        d->groups = new EStringList;
+        while ( d->gq->hasResults() )
+            d->groups->append( d->gq->nextRow()->getEString( "name" ) );
+        if ( !d->gq->failed() )
+            ::cache->groups.insert( d->user->login().utf8(), d->groups );
+    }
+
+    if ( !d->q ) {
+        d->q = new Query( "select mailbox, rights from permissions "
+                          "where mailbox=any($1) and identifier=any($2)",
                           this );
 
         IntegerSet r;
@@ -202,8 +274,13 @@ void Permissions::execute()
                 r.add( m->id() );
             m = m->parent();
         }
+        EStringList identifiers;
+        identifiers.append( d->user->login().utf8() );
+        identifiers.append( "anyone" );
+        identifiers.append( *d->groups );
         d->q->bind( 1, r );
-        d->q->bind( 2, d->user->login() );
+        d->q->bind( 2, identifiers );
+        d->q->setShareable();
         d->q->execute();
     }
 
@@ -216,7 +293,6 @@ void Permissions::execute()
     while ( d->q->hasResults() ) {
         Row * r = d->q->nextRow();
         Mailbox * m = Mailbox::find( r->getInt( "mailbox" ) );
-        EString id = r->getEString( "identifier" );
         if ( m && ( !candidate ||
                     candidate->name().length() < m->name().length() ) ) {
             candidate = m;
@@ -226,10 +302,12 @@ void Permissions::execute()
             p.append( r->getEString( "rights" ) );
     }
 
-    if ( p.isEmpty() )
-        allow( "l" );
-    else
-        allow( p.join( "" ) ); // ooooh.
+    EString rights = "l";
+    if ( !p.isEmpty() )
+        rights = p.join( "" ); // ooooh.
+    allow( rights );
+    if ( !d->q->failed() )
+        ::cache->rights.insert( d->key, new EString( rights ) );
 
     d->ready = true;
     d->owner->execute();
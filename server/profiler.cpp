@@ -0,0 +1,393 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "profiler.h"
+
+#include "configuration.h"
+#include "allocator.h"
+#include "estring.h"
+#include "server.h"
+#include "event.h"
+#include "scope.h"
+#include "timer.h"
+#include "dict.h"
+#include "list.h"
+#include "log.h"
+
+// backtrace
+#include <execinfo.h>
+// dladdr
+#include <dlfcn.h>
+// abi::__cxa_demangle
+#include <cxxabi.h>
+// pthread_self, pthread_equal
+#include <pthread.h>
+// sigaction
+#include <signal.h>
+// setitimer
+#include <sys/time.h>
+// open
+#include <fcntl.h>
+// write, getpid
+#include <unistd.h>
+// free
+#include <stdlib.h>
+// errno
+#include <errno.h>
+
+
+static const uint ringSize = 1024;
+static const uint maxDepth = 48;
+
+// the signal handler writes samples here, and collect() reads them.
+// none of this is seen by the garbage collector, which is why
+// collect() has to be called before each collection.
+struct Sample {
+    Log * log;
+    bool allocation;
+    int depth;
+    void * frames[maxDepth];
+};
+
+static Sample ring[ringSize];
+static volatile uint produced = 0;
+static volatile uint consumed = 0;
+static volatile uint dropped = 0;
+static pthread_t mainThread;
+static uint rate = 0;
+
+
+class FoldedStack
+    : public Garbage
+{
+public:
+    FoldedStack(): Garbage(), count( 0 ), allocation( false ) {}
+
+    EString stack;
+    uint count;
+    bool allocation;
+};
+
+
+class ProfileWriter
+    : public EventHandler
+{
+public:
+    ProfileWriter(): EventHandler() {
+        Timer * t = new Timer( this, 60 );
+        t->setRepeating( true );
+    }
+
+    void execute() {
+        if ( rate )
+            Profiler::write();
+    }
+};
+
+
+static Dict<FoldedStack> * stacks = 0;
+static List<FoldedStack> * order = 0;
+static Dict<EString> * symbols = 0;
+static ProfileWriter * writer = 0;
+
+
+/*  Records one sample of the main thread's call stack. Samples that
+    arrive while another thread is running are discarded, as are
+    samples for which there is no room.
+*/
+
+static void sample( int )
+{
+    if ( !pthread_equal( pthread_self(), mainThread ) )
+        return;
+    if ( produced - consumed >= ringSize ) {
+        dropped = dropped + 1;
+        return;
+    }
+    int e = errno;
+    Sample * s = &ring[produced % ringSize];
+    s->log = 0;
+    Scope * c = Scope::current();
+    if ( c )
+        s->log = c->log();
+    s->allocation = false;
+    s->depth = ::backtrace( s->frames, maxDepth );
+    produced = produced + 1;
+    errno = e;
+}
+
+
+/*  Records the call stack which just made the Allocator cross another
+    megabyte. This is called from within Allocator::alloc(), so it
+    must not allocate memory either.
+
+    The slot is claimed before it's filled in, so that sample() can
+    interrupt this without both using the same slot.
+*/
+
+static void sampleAllocation()
+{
+    if ( !pthread_equal( pthread_self(), mainThread ) )
+        return;
+    if ( produced - consumed >= ringSize ) {
+        dropped = dropped + 1;
+        return;
+    }
+    Sample * s = &ring[produced % ringSize];
+    produced = produced + 1;
+    s->log = 0;
+    Scope * c = Scope::current();
+    if ( c )
+        s->log = c->log();
+    s->allocation = true;
+    s->depth = ::backtrace( s->frames, maxDepth );
+}
+
+
+/*  Returns a name for the code address \a a: the demangled function
+    name if there is one, otherwise the object file and offset, which
+    addr2line can resolve.
+*/
+
+static EString symbol( void * a )
+{
+    EString k = EString::fromNumber( (int64)(unsigned long)a, 16 );
+    EString * r = symbols->find( k );
+    if ( r )
+        return *r;
+
+    r = new EString( "0x" + k );
+    Dl_info i;
+    if ( ::dladdr( a, &i ) ) {
+        if ( i.dli_sname ) {
+            int status = 0;
+            char * n = abi::__cxa_demangle( i.dli_sname, 0, 0, &status );
+            if ( n && !status )
+                *r = n;
+            else
+                *r = i.dli_sname;
+            ::free( n );
+            int paren = r->find( '(' );
+            if ( paren > 0 )
+                r->truncate( paren );
+        }
+        else if ( i.dli_fname ) {
+            EString f( i.dli_fname );
+            int slash = f.find( '/' );
+            while ( slash >= 0 && f.find( '/', slash + 1 ) >= 0 )
+                slash = f.find( '/', slash + 1 );
+            *r = f.mid( slash + 1 );
+            r->append( "+0x" );
+            r->appendNumber( (int64)( (char*)a - (char*)i.dli_fbase ),
+                             (uint)16 );
+        }
+    }
+    symbols->insert( k, r );
+    return *r;
+}
+
+
+/*! \class Profiler profiler.h
+    The Profiler class samples what a server is doing.
+
+    When profile-rate is nonzero, the kernel sends SIGPROF that many
+    times per second of CPU time used, and the signal handler records
+    the event loop thread's call stack along with the Log of the
+    current Scope. collect() later turns the samples into "folded"
+    stacks, whose first element is the Log::label() (e.g. "IMAP
+    fetch"), and write() writes them to profile-directory, where
+    flame graph tools can read them.
+
+    While sampling, the Profiler also records the call stack each time
+    the Allocator has handed out another megabyte of memory. Those
+    stacks are written to a second file, whose name ends in
+    "-alloc.folded", and show which code allocates the most memory.
+
+    Samples taken while another thread (such as a TlsThread) has the
+    CPU are discarded.
+*/
+
+
+/*! Starts, stops or adjusts sampling according to profile-rate. */
+
+void Profiler::reconfigure()
+{
+    uint r = Configuration::scalar( Configuration::ProfileRate );
+    if ( r > 1000 )
+        r = 1000;
+    if ( r == rate )
+        return;
+
+    if ( !rate ) {
+        mainThread = pthread_self();
+
+        // the first backtrace() may allocate memory, which mustn't
+        // happen in the signal handler
+        void * f[1];
+        (void)::backtrace( f, 1 );
+
+        if ( !symbols ) {
+            symbols = new Dict<EString>;
+            Allocator::addEternal( symbols, "profiler symbols" );
+            stacks = new Dict<FoldedStack>;
+            Allocator::addEternal( stacks, "profiler stacks" );
+            order = new List<FoldedStack>;
+            Allocator::addEternal( order, "profiler stack order" );
+            writer = new ProfileWriter;
+            Allocator::addEternal( writer, "profile writer" );
+        }
+        stacks->clear();
+        order->clear();
+        dropped = 0;
+
+        Allocator::setSampler( sampleAllocation );
+
+        struct sigaction sa;
+        sa.sa_handler = sample;
+        sigemptyset( &sa.sa_mask );
+        sa.sa_flags = SA_RESTART;
+        ::sigaction( SIGPROF, &sa, 0 );
+    }
+
+    struct itimerval t;
+    t.it_interval.tv_sec = 0;
+    t.it_interval.tv_usec = 0;
+    if ( r ) {
+        uint usec = 1000000 / r;
+        t.it_interval.tv_sec = usec / 1000000;
+        t.it_interval.tv_usec = usec % 1000000;
+    }
+    t.it_value = t.it_interval;
+    ::setitimer( ITIMER_PROF, &t, 0 );
+
+    if ( r )
+        log( "Sampling " + fn( r ) + " times per CPU second",
+             Log::Significant );
+    else
+        log( "Stopped sampling", Log::Significant );
+
+    uint old = rate;
+    rate = r;
+    if ( old && !r ) {
+        Allocator::setSampler( 0 );
+        collect();
+        write();
+    }
+}
+
+
+/*! Returns true if the Profiler is sampling, and false if not. */
+
+bool Profiler::active()
+{
+    return rate != 0;
+}
+
+
+/*! Adds the samples taken since the last call to the folded stacks.
+
+    This must be called before each garbage collection, since the
+    samples refer to Log objects the collector doesn't know about.
+*/
+
+void Profiler::collect()
+{
+    if ( produced == consumed || !stacks )
+        return;
+
+    while ( consumed != produced ) {
+        Sample * s = &ring[consumed % ringSize];
+        EString stack;
+        if ( s->log )
+            stack = s->log->label();
+        if ( stack.isEmpty() )
+            stack = "other";
+        stack.replace( ";", "," );
+        // the two innermost frames are sample() and the kernel's
+        // signal trampoline, or just sampleAllocation()
+        int skip = 2;
+        if ( s->allocation )
+            skip = 1;
+        int i = s->depth;
+        while ( i > skip ) {
+            i--;
+            stack.append( ";" );
+            stack.append( symbol( s->frames[i] ) );
+        }
+        EString k( stack );
+        if ( s->allocation )
+            k.append( " alloc" );
+        FoldedStack * f = stacks->find( k );
+        if ( !f ) {
+            f = new FoldedStack;
+            f->stack = stack;
+            f->allocation = s->allocation;
+            stacks->insert( k, f );
+            order->append( f );
+        }
+        f->count++;
+        consumed = consumed + 1;
+    }
+}
+
+
+/*! Writes all the stacks collected since sampling started to files
+    in profile-directory, replacing the files' earlier contents.
+*/
+
+void Profiler::write()
+{
+    if ( !order || order->isEmpty() )
+        return;
+
+    writeFile( false );
+    writeFile( true );
+}
+
+
+/*! Writes the allocation stacks if \a allocations is true, and the
+    CPU stacks if it's false.
+*/
+
+void Profiler::writeFile( bool allocations )
+{
+    EString r;
+    List<FoldedStack>::Iterator i( order );
+    while ( i ) {
+        if ( i->allocation == allocations ) {
+            r.append( i->stack );
+            r.append( " " );
+            r.appendNumber( i->count );
+            r.append( "\n" );
+        }
+        ++i;
+    }
+    if ( r.isEmpty() )
+        return;
+
+    EString n = Configuration::text( Configuration::ProfileDir );
+    n.append( "/" );
+    n.append( Server::name() );
+    n.append( "-" );
+    n.appendNumber( getpid() );
+    if ( allocations )
+        n.append( "-alloc" );
+    n.append( ".folded" );
+
+    int fd = ::open( n.cstr(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0644 );
+    uint done = 0;
+    while ( fd >= 0 && done < r.length() ) {
+        int w = ::write( fd, r.data() + done, r.length() - done );
+        if ( w <= 0 )
+            break;
+        done += w;
+    }
+    if ( fd >= 0 )
+        ::close( fd );
+
+    if ( done < r.length() )
+        log( "Could not write profile to " + n, Log::Error );
+    else if ( dropped && !allocations )
+        log( "Wrote profile to " + n + " (" + fn( dropped ) +
+             " samples were dropped)", Log::Debug );
+}
@@ -0,0 +1,24 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "global.h"
+
+
+class Profiler
+    : public Garbage
+{
+public:
+    static void reconfigure();
+    static void collect();
+    static void write();
+
+    static bool active();
+
+private:
+    static void writeFile( bool );
+};
+
+
+#endif
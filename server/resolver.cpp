@@ -45,6 +45,9 @@ public:
     remains empty, all is well and remains well until the end of the
     process.
 
+    resolve() blocks, so it must not be used once the server is
+    running; DnsLookup is the non-blocking alternative.
+
     We need a class called Revolver.
 */
 
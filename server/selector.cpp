@@ -9,6 +9,7 @@
 #include "date.h"
 #include "cache.h"
 #include "session.h"
+#include "messageindex.h"
 #include "mailbox.h"
 #include "allocator.h"
 #include "estringlist.h"
@@ -18,6 +19,8 @@
 #include "dbsignal.h"
 #include "field.h"
 #include "user.h"
+#include "ustringlist.h"
+#include "wordindex.h"
 
 #include <time.h> // whereAge() calls time()
 
@@ -141,6 +144,7 @@ public:
     EString * mm;
     Session * session;
     User * user;
+    IntegerSet mailboxes;
 
     EStringList extraJoins;
     EStringList leftJoins;
@@ -575,10 +579,15 @@ Query * Selector::query( User * user, Mailbox * mailbox,
     d->estringPlaceholders.clear();
     d->ustringPlaceholders.clear();
     uint mboxId = 0;
+    uint mboxIds = 0;
     if ( mailbox ) {
         mboxId = placeHolder();
         d->query->bind( mboxId, mailbox->id() );
     }
+    else if ( !d->mailboxes.isEmpty() ) {
+        mboxIds = placeHolder();
+        d->query->bind( mboxIds, d->mailboxes );
+    }
     if ( deleted )
         d->mm = new EString( "dm" );
     else
@@ -631,6 +640,10 @@ Query * Selector::query( User * user, Mailbox * mailbox,
         // normal case: search one mailbox
         mboxClause = mm() + ".mailbox=$" + fn( mboxId );
     }
+    else if ( mboxIds ) {
+        // search a set of mailboxes the caller has checked
+        mboxClause = mm() + ".mailbox=any($" + fn( mboxIds ) + ")";
+    }
     else if ( user ) {
         // search all mailboxes accessible to user
         uint owner = placeHolder();
@@ -700,10 +713,32 @@ Query * Selector::query( User * user, Mailbox * mailbox,
     }
 
     d->query->setString( q );
+    d->query->setReadOnly();
+    d->query->setRecurring();
     return d->query;
 }
 
 
+/*! Returns a query representing this Selector across all the
+    mailboxes whose ids are in \a mailboxes, in the context of \a user,
+    notifying \a owner of results. The result columns are those in \a
+    wanted, and the rows are ordered by mailbox and then uid (if those
+    are wanted).
+
+    This does no permission checking; the caller must pass only
+    mailboxes \a user may read.
+*/
+
+Query * Selector::query( User * user, const IntegerSet & mailboxes,
+                         EventHandler * owner, EStringList * wanted )
+{
+    d->mailboxes = mailboxes;
+    Query * q = query( user, 0, 0, owner, true, wanted, false );
+    d->mailboxes.clear();
+    return q;
+}
+
+
 /*! Gives an SQL string representing this condition.
 
     The string may include $n placeholders; where() and its helpers
@@ -766,6 +801,22 @@ EString Selector::where()
     return "";
 }
 
+/*  Returns \a table followed by \a op and the number \a n, e.g.
+    "mm.uid=$4". Most simple conditions look like that, and building
+    them in one string avoids the temporaries of a chain of + and fn().
+*/
+
+static EString comparison( const EString & table, const char * op, uint n )
+{
+    EString r;
+    r.reserve( table.length() + 24 );
+    r.append( table );
+    r.append( op );
+    r.appendNumber( n );
+    return r;
+}
+
+
 /*! This implements the INTERNALDATE part of where().
 */
 
@@ -787,18 +838,22 @@ EString Selector::whereInternalDate()
         root()->d->query->bind( n1, d1.unixTime() );
         uint n2 = placeHolder();
         root()->d->query->bind( n2, d2.unixTime() );
-        return "(" + m() + ".idate>=$" + fn( n1 ) +
-            " and " + m() + ".idate<=$" + fn( n2 ) + ")";
+        EString r( "(" );
+        r.append( comparison( m(), ".idate>=$", n1 ) );
+        r.append( " and " );
+        r.append( comparison( m(), ".idate<=$", n2 ) );
+        r.append( ")" );
+        return r;
     }
     else if ( d->a == SinceDate ) {
         uint n1 = placeHolder();
         root()->d->query->bind( n1, d1.unixTime() );
-        return m() +".idate>=$" + fn( n1 );
+        return comparison( m(), ".idate>=$", n1 );
     }
     else if ( d->a == BeforeDate ) {
         uint n2 = placeHolder();
         root()->d->query->bind( n2, d2.unixTime() );
-        return m() + ".idate<=$" + fn( n2 );
+        return comparison( m(), ".idate<=$", n2 );
     }
 
     setError( "Cannot search for: " + debugString() );
@@ -885,6 +940,18 @@ static EString matchTsvector( const EString & col, uint n )
 }
 
 
+/*  Returns a condition that is true if the value of the header_fields
+    row \a hf matches \a condition, whether it's stored in the row or
+    interned in header_values (see interned-header-fields).
+*/
+
+static EString valueMatches( const EString & hf, const EString & condition )
+{
+    return "(" + hf + ".value " + condition + " or " + hf + ".value_id in "
+        "(select id from header_values where value " + condition + "))";
+}
+
+
 static bool sensibleWords( const UString & s )
 {
     uint l = 0;
@@ -939,7 +1006,8 @@ EString Selector::whereHeaderField()
     }
     else if ( !d->s16.isEmpty() ) {
         uint like = placeHolder( q( d->s16 ) );
-        j.append( " and hf" + jn + ".value ilike " + matchAny( like ) );
+        j.append( " and " +
+                  valueMatches( "hf" + jn, "ilike " + matchAny( like ) ) );
     }
 
     if ( t ) {
@@ -954,7 +1022,53 @@ EString Selector::whereHeaderField()
     j.append( ")" );
     root()->d->leftJoins.append( j );
 
-    return "hf" + jn + ".field is not null";
+    if ( HeaderField::isIndexed( d->s8 ) )
+        return "hf" + jn + ".field is not null";
+    return "(hf" + jn + ".field is not null or " +
+        whereHeaderBlob( d->s8 ) + ")";
+}
+
+
+/*! Returns a condition matching messages whose header_blobs text
+    contains a field named \a field whose value contains
+    stringArgument(). If \a field is empty, any field matches.
+
+    This is used for the fields HeaderField::isIndexed() keeps out of
+    header_fields. It's slow, since each blob must be split into lines,
+    but those fields are rarely searched.
+*/
+
+EString Selector::whereHeaderBlob( const EString & field )
+{
+    // the blob escapes backslash, so the pattern must too
+    UString v;
+    uint i = 0;
+    while ( i < d->s16.length() ) {
+        if ( d->s16[i] == '\\' )
+            v.append( '\\' );
+        v.append( d->s16[i] );
+        i++;
+    }
+
+    EString p( "%\t" );
+    if ( field.isEmpty() ) {
+        p.append( "%\t" );
+    }
+    else {
+        AsciiCodec a;
+        p.append( q( a.toUnicode( field ) ) );
+        p.append( "\t" );
+    }
+    p.append( "%" );
+    p.append( q( v ) );
+    p.append( "%" );
+
+    uint like = placeHolder( p );
+    EString jn = "hb" + fn( ++root()->d->join );
+    return "exists (select 1 from header_blobs " + jn + ", "
+        "regexp_split_to_table(" + jn + ".header, E'\\n') " + jn + "l "
+        "where " + jn + ".message=" + mm() + ".message and " +
+        jn + "l ilike $" + fn( like ) + ")";
 }
 
 
@@ -1026,7 +1140,8 @@ EString Selector::whereHeaders( List<Selector> * sl )
                 }
                 else {
                     uint b = placeHolder( q( si->d->s16 ) );
-                    orl.append( jn + ".value ilike " + matchAny( b ) );
+                    orl.append( valueMatches( jn,
+                                              "ilike " + matchAny( b ) ) );
                 }
             }
             ++si;
@@ -1425,12 +1540,16 @@ EString Selector::whereHeader()
     EString jn = "hf" + fn( ++root()->d->join );
     EString j = " left join header_fields " + jn +
                " on (" + mm() + ".message=" + jn + ".message and " +
-               jn + ".value ilike " + matchAny( like ) + ")";
+               valueMatches( jn, "ilike " + matchAny( like ) ) + ")";
     root()->d->leftJoins.append( j );
     List<Selector> dummy;
     dummy.append( this );
-    return "(" + jn + ".field is not null or " +
-        whereAddressFields( &dummy ) + ")";
+    EString r = "(" + jn + ".field is not null or " +
+                whereAddressFields( &dummy );
+    if ( !HeaderField::isIndexed( "" ) )
+        r.append( " or " + whereHeaderBlob( "" ) );
+    r.append( ")" );
+    return r;
 }
 
 
@@ -1443,6 +1562,9 @@ EString Selector::whereHeader()
     results with a plain 'ilike' in order to avoid overly liberal
     stemming. (Perhaps we actually want liberal stemming. I don't
     know. IMAP says not to do it, but do we listen?)
+
+    If use-word-index is set, the bodypart_words table is used the
+    same way instead of tsearch. See WordIndex.
 */
 
 EString Selector::whereBody()
@@ -1453,7 +1575,23 @@ EString Selector::whereBody()
 
     uint bt = placeHolder( q( d->s16 ) );
 
-    if ( ::tsearchAvailable && sensibleWords( d->s16 ) )
+    UStringList * words = 0;
+    if ( WordIndex::enabled() && sensibleWords( d->s16 ) )
+        words = WordIndex::words( d->s16 );
+
+    if ( words && !words->isEmpty() ) {
+        // the words go in as one array, so the text is the same
+        // however many words there are. words() returns each only once.
+        uint wl = placeHolder();
+        root()->d->query->bind( wl, *words );
+        uint wc = placeHolder();
+        root()->d->query->bind( wc, words->count() );
+        s.append( "(bp.id in (select bodypart from bodypart_words "
+                  "where word=any($" + fn( wl ) + ") group by bodypart "
+                  "having count(distinct word)=$" + fn( wc ) + ") "
+                  "and bp.text ilike " + matchAny( bt ) + ")" );
+    }
+    else if ( ::tsearchAvailable && sensibleWords( d->s16 ) )
         s.append( "(" + matchTsvector( "bp.text", bt ) + " "
                   "and bp.text ilike " + matchAny( bt ) + ")" );
     else
@@ -1472,9 +1610,9 @@ EString Selector::whereRfc822Size()
     uint s = placeHolder();
     root()->d->query->bind( s, d->n );
     if ( d->a == Smaller )
-        return m() + ".rfc822size<$" + fn( s );
+        return comparison( m(), ".rfc822size<$", s );
     else if ( d->a == Larger )
-        return m() + ".rfc822size>$" + fn( s );
+        return comparison( m(), ".rfc822size>$", s );
     setError( "Internal error: " + debugString() );
     return "";
 }
@@ -1500,24 +1638,40 @@ EString Selector::whereFlags()
     else if ( Flag::isDeleted( fid ) )
         return mm() + ".deleted";
 
+    if ( Flag::bit( fid ) ) {
+        uint b = placeHolder();
+        root()->d->query->bind( b, fid - 1 );
+        EString r( "(" );
+        r.append( comparison( mm(), ".flagbits>>$", b ) );
+        r.append( ")&1=1" );
+        return r;
+    }
+
     uint join = ++root()->d->join;
     EString n = fn( join );
 
     EString j;
     if ( fid ) {
         // we know this flag, so look for it reasonably efficiently
+        uint f = placeHolder();
+        root()->d->query->bind( f, fid );
         j = " left join flags f" + n +
             " on (" + mm() + ".mailbox=f" + n + ".mailbox and " +
             mm() + ".uid=f" + n + ".uid and "
-            "f" + n + ".flag=" + fn( fid ) + ")";
+            "f" + n + ".flag=$" + fn( f ) + ")";
     }
     else {
-        // just in case the cache is out of date we look in the db
+        // just in case the cache is out of date we look in the db,
+        // and the flag may be one with a bit in flagbits.
         uint b = placeHolder( d->s8.lower() );
         j = " left join flags f" + n +
             " on (" + mm() + ".mailbox=f" + n + ".mailbox and " +
             mm() + ".uid=f" + n + ".uid and f" + n + ".flag="
             "(select id from flag_names where lower(name)=$" + fn(b) + "))";
+        root()->d->leftJoins.append( j );
+        return "(f" + n + ".flag is not null or "
+            "coalesce((" + mm() + ".flagbits>>((select id from flag_names "
+            "where lower(name)=$" + fn(b) + " and id<=64)-1))&1=1,false))";
     }
     root()->d->leftJoins.append( j );
 
@@ -1541,19 +1695,25 @@ EString Selector::whereSet( const IntegerSet & s )
 
     if ( c > 2 ) {
         root()->d->query->bind( u, s );
-        return mm() + ".uid=any($" + fn( u ) + ")";
+        EString r( comparison( mm(), ".uid=any($", u ) );
+        r.append( ")" );
+        return r;
     }
 
     if ( c == 2 ) {
         uint u2 = placeHolder();
         root()->d->query->bind( u, s.smallest() );
         root()->d->query->bind( u2, s.largest() );
-        return "(" + mm() + ".uid=$" + fn( u ) +
-            " or " + mm() + ".uid=$" + fn( u2 ) + ")";
+        EString r( "(" );
+        r.append( comparison( mm(), ".uid=$", u ) );
+        r.append( " or " );
+        r.append( comparison( mm(), ".uid=$", u2 ) );
+        r.append( ")" );
+        return r;
     }
 
     root()->d->query->bind( u, s.smallest() );
-    return mm() + ".uid=$" + fn( u );
+    return comparison( mm(), ".uid=$", u );
 }
 
 
@@ -1630,9 +1790,9 @@ EString Selector::whereModseq()
     root()->d->query->bind( i, d->n );
 
     if (action() == Larger )
-        return mm() + ".modseq>=$" + fn( i );
+        return comparison( mm(), ".modseq>=$", i );
     else if ( action() == Smaller )
-        return mm() + ".modseq<$" + fn( i );
+        return comparison( mm(), ".modseq<$", i );
 
     log( "Bad selector", Log::Error );
     return "false";
@@ -1658,9 +1818,9 @@ EString Selector::whereAge()
         root()->d->needMessages = true;
         root()->d->query->bind( i, (uint)::time( 0 ) - d->n );
         if ( d->a == Larger )
-            r = m() + ".idate<=$" + fn( i );
+            r = comparison( m(), ".idate<=$", i );
         else
-            r = m() + ".idate>=$" + fn( i );
+            r = comparison( m(), ".idate>=$", i );
     }
     return r;
 }
@@ -1674,7 +1834,7 @@ EString Selector::whereDatabaseId()
     root()->d->query->bind( i, d->n );
 
     if (action() == Equals )
-        return mm() + ".message=$" + fn( i );
+        return comparison( mm(), ".message=$", i );
 
     log( "Bad selector", Log::Error );
     return "false";
@@ -1690,7 +1850,7 @@ EString Selector::whereThreadId()
 
     if (action() == Equals ) {
         root()->d->needMessages = true;
-        return m() + ".thread_root=$" + fn( i );
+        return comparison( m(), ".thread_root=$", i );
     }
 
     log( "Bad selector", Log::Error );
@@ -1751,7 +1911,13 @@ EString Selector::whereNoField()
 
         List<Selector>::Iterator i( d->children );
         while ( i ) {
-            if ( i->d->f == Header ) {
+            if ( i->d->f == Header &&
+                 !HeaderField::isIndexed( i->d->s8 ) &&
+                 !isAddressField( i->d->s8 ) ) {
+                // the OR optimiser doesn't know about header_blobs
+                rest.append( i );
+            }
+            else if ( i->d->f == Header ) {
                 if ( i->d->s8.isEmpty() ) {
                     addressTests.append( i );
                     otherHeaderTests.append( i );
@@ -2033,7 +2199,59 @@ Selector::MatchResult Selector::match( Session * s, uint uid )
                 return Yes;
             return No;
         }
-        return Punt;
+        MessageIndex * mi = s->messageIndex();
+        uint fid = Flag::id( d->s8 );
+        if ( !fid || !mi->current() || !mi->contains( uid ) )
+            return Punt;
+        if ( mi->hasFlag( uid, fid ) )
+            return Yes;
+        return No;
+    }
+    else if ( d->f == InternalDate || d->f == Rfc822Size ||
+              d->f == Modseq ) {
+        MessageIndex * mi = s->messageIndex();
+        if ( !mi->current() || !mi->contains( uid ) )
+            return Punt;
+        bool r = false;
+        if ( d->f == InternalDate ) {
+            uint day = d->s8.mid( 0, 2 ).number( 0 );
+            EString month = d->s8.mid( 3, 3 );
+            uint year = d->s8.mid( 7 ).number( 0 );
+            Date d1;
+            d1.setDate( year, month, day, 0, 0, 0, 0 );
+            Date d2;
+            d2.setDate( year, month, day, 23, 59, 59, 0 );
+            uint idate = mi->internalDate( uid );
+            if ( d->a == OnDate )
+                r = idate >= d1.unixTime() && idate <= d2.unixTime();
+            else if ( d->a == SinceDate )
+                r = idate >= d1.unixTime();
+            else if ( d->a == BeforeDate )
+                r = idate <= d2.unixTime();
+            else
+                return Punt;
+        }
+        else if ( d->f == Rfc822Size ) {
+            uint size = mi->rfc822Size( uid );
+            if ( d->a == Smaller )
+                r = size < d->n;
+            else if ( d->a == Larger )
+                r = size > d->n;
+            else
+                return Punt;
+        }
+        else {
+            int64 modseq = mi->modSeq( uid );
+            if ( d->a == Larger )
+                r = modseq >= (int64)d->n;
+            else if ( d->a == Smaller )
+                r = modseq < (int64)d->n;
+            else
+                return Punt;
+        }
+        if ( r )
+            return Yes;
+        return No;
     }
     else if ( d->a == Not ) {
         MatchResult sub = d->children->first()->match( s, uid );
@@ -2073,6 +2291,44 @@ bool Selector::needSession() const
 }
 
 
+/*! Returns true if match() can evaluate this condition using a
+    MessageIndex (or without one), and false if it needs the database.
+    Header and body searches are never indexable, since they need
+    substring matches.
+*/
+
+bool Selector::indexable() const
+{
+    switch ( d->f ) {
+    case Uid:
+    case Flags:
+    case InternalDate:
+    case Rfc822Size:
+    case Modseq:
+        return true;
+        break;
+    case NoField:
+        if ( d->a == All )
+            return true;
+        if ( d->a == And || d->a == Or || d->a == Not ) {
+            List< Selector >::Iterator i( d->children );
+            while ( i ) {
+                if ( !i->indexable() )
+                    return false;
+                ++i;
+            }
+            return true;
+        }
+        return false;
+        break;
+    default:
+        return false;
+        break;
+    }
+    return false;
+}
+
+
 static uint lmatch( const EString & pattern, uint p,
                     const EString & name, uint n )
 {
@@ -59,6 +59,8 @@ public:
     Query * query( class User *, class Mailbox *,
                    class Session *, class EventHandler *,
                    bool = true, class EStringList * = 0, bool = false );
+    Query * query( class User *, const IntegerSet &,
+                   class EventHandler *, class EStringList * );
 
     void simplify();
 
@@ -66,6 +68,7 @@ public:
 
     EString debugString() const;
     bool needSession() const;
+    bool indexable() const;
     enum MatchResult {
         Yes,
         No,
@@ -100,6 +103,7 @@ private:
     EString whereHeader();
     EString whereHeaders( List<Selector> * );
     EString whereHeaderField();
+    EString whereHeaderBlob( const EString & );
     EString whereAddressField();
     EString whereAddressFields( List<Selector> * );
     EString whereBody();
@@ -0,0 +1,411 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "selectorprogram.h"
+
+#include "messageindex.h"
+#include "integerset.h"
+#include "allocator.h"
+#include "session.h"
+#include "date.h"
+#include "flag.h"
+#include "list.h"
+
+
+// one bit per message in a batch
+typedef unsigned long long Mask;
+
+// the number of messages evaluated together, one per bit of a Mask
+static const uint batchSize = 64;
+
+static const int64 maxInt64 = 0x7fffffffffffffffLL;
+
+
+class SelectorProgramData
+    : public Garbage
+{
+public:
+    SelectorProgramData()
+        : depth( 0 ), maxDepth( 0 ),
+          index( false ), dates( false ), sizes( false ),
+          modseqs( false ), flagbits( false )
+    {}
+
+    enum Op {
+        True, Unknown, Uids, Recent, Flag, FlagBit,
+        DateRange, SizeRange, ModSeqRange,
+        Not, And, Or
+    };
+
+    class Instruction
+        : public Garbage
+    {
+    public:
+        Instruction( Op o )
+            : op( o ), n( 0 ), bit( 0 ), lo( 0 ), hi( maxInt64 ) {}
+        Op op;
+        uint n;
+        int64 bit;
+        int64 lo;
+        int64 hi;
+        IntegerSet uids;
+    };
+
+    List<Instruction> program;
+    uint depth;
+    uint maxDepth;
+
+    // which columns of the MessageIndex the program needs
+    bool index;
+    bool dates;
+    bool sizes;
+    bool modseqs;
+    bool flagbits;
+
+    Instruction * emit( Op o, uint popped = 0 ) {
+        Instruction * i = new Instruction( o );
+        i->n = popped;
+        program.append( i );
+        depth = depth - popped + 1;
+        if ( depth > maxDepth )
+            maxDepth = depth;
+        return i;
+    }
+};
+
+
+/*! \class SelectorProgram selectorprogram.h
+    The SelectorProgram class evaluates a Selector for all the
+    messages in a Session at once, using the MessageIndex.
+
+    Selector::match() walks the selector tree for each message, looks
+    each message up in the MessageIndex once per condition, and
+    converts search dates to unix times again for each message. That's
+    fine for a few hundred messages, but not for a large mailbox.
+
+    A SelectorProgram is compiled once from one or more selectors
+    into a flat postfix program. run() then evaluates it for 64
+    messages at a time: For each batch it copies the columns it needs
+    out of the MessageIndex, each condition yields a bit mask of the
+    messages it matches, and And, Or and Not combine the masks. The
+    column conditions are simple loops over arrays without branches,
+    which the compiler can vectorise.
+
+    Conditions that match() can't answer compile to an unknown result,
+    as do flag, date, size and modseq conditions if the MessageIndex
+    isn't current. Since And, Or and Not use three-valued logic, an
+    unknown result only matters if it affects the outcome. If it does
+    for any message, run() returns Selector::Punt and the database has
+    to do the search.
+*/
+
+
+/*! Constructs an empty SelectorProgram, which matches all messages.
+    add() adds conditions.
+*/
+
+SelectorProgram::SelectorProgram()
+    : d( new SelectorProgramData )
+{
+}
+
+
+/*! Compiles \a s and adds it to this program. If more than one
+    selector is added, run() finds the messages that match all of
+    them.
+*/
+
+void SelectorProgram::add( Selector * s )
+{
+    compile( s );
+}
+
+
+/*! Returns true if the program needs the MessageIndex, and false if
+    it can be evaluated using only the Session.
+*/
+
+bool SelectorProgram::usesIndex() const
+{
+    return d->index;
+}
+
+
+/*! Compiles \a s, appending its instructions to the program. This
+    mirrors Selector::match().
+*/
+
+void SelectorProgram::compile( Selector * s )
+{
+    Selector::Field f = s->field();
+    Selector::Action a = s->action();
+
+    if ( a == Selector::And || a == Selector::Or ) {
+        uint n = 0;
+        List<Selector>::Iterator i( s->children() );
+        while ( i ) {
+            compile( i );
+            n++;
+            ++i;
+        }
+        d->emit( a == Selector::And ? SelectorProgramData::And
+                                    : SelectorProgramData::Or, n );
+    }
+    else if ( a == Selector::Contains && f == Selector::Uid ) {
+        d->emit( SelectorProgramData::Uids )->uids = s->messageSet();
+    }
+    else if ( a == Selector::Contains && f == Selector::Flags ) {
+        EString name = s->stringArgument();
+        uint fid = Flag::id( name );
+        if ( name == "\\recent" ) {
+            d->emit( SelectorProgramData::Recent );
+        }
+        else if ( !fid ) {
+            d->emit( SelectorProgramData::Unknown );
+        }
+        else if ( Flag::bit( fid ) &&
+                  !Flag::isSeen( fid ) && !Flag::isDeleted( fid ) ) {
+            d->emit( SelectorProgramData::FlagBit )->bit = Flag::bit( fid );
+            d->index = true;
+            d->flagbits = true;
+        }
+        else {
+            d->emit( SelectorProgramData::Flag )->n = fid;
+            d->index = true;
+        }
+    }
+    else if ( f == Selector::InternalDate &&
+              ( a == Selector::OnDate || a == Selector::SinceDate ||
+                a == Selector::BeforeDate ) ) {
+        EString s8 = s->stringArgument();
+        uint day = s8.mid( 0, 2 ).number( 0 );
+        EString month = s8.mid( 3, 3 );
+        uint year = s8.mid( 7 ).number( 0 );
+        Date d1;
+        d1.setDate( year, month, day, 0, 0, 0, 0 );
+        Date d2;
+        d2.setDate( year, month, day, 23, 59, 59, 0 );
+        SelectorProgramData::Instruction * i
+            = d->emit( SelectorProgramData::DateRange );
+        if ( a != Selector::BeforeDate )
+            i->lo = d1.unixTime();
+        if ( a != Selector::SinceDate )
+            i->hi = d2.unixTime();
+        d->index = true;
+        d->dates = true;
+    }
+    else if ( ( f == Selector::Rfc822Size || f == Selector::Modseq ) &&
+              ( a == Selector::Smaller || a == Selector::Larger ) ) {
+        int64 n = (uint)s->integerArgument();
+        SelectorProgramData::Instruction * i = 0;
+        if ( f == Selector::Rfc822Size ) {
+            i = d->emit( SelectorProgramData::SizeRange );
+            d->sizes = true;
+        }
+        else {
+            i = d->emit( SelectorProgramData::ModSeqRange );
+            d->modseqs = true;
+        }
+        d->index = true;
+        // size < n, size > n, modseq < n and modseq >= n
+        if ( a == Selector::Smaller )
+            i->hi = n - 1;
+        else if ( f == Selector::Rfc822Size )
+            i->lo = n + 1;
+        else
+            i->lo = n;
+    }
+    else if ( a == Selector::Not ) {
+        compile( s->children()->first() );
+        d->emit( SelectorProgramData::Not, 1 );
+    }
+    else if ( a == Selector::All ) {
+        d->emit( SelectorProgramData::True );
+    }
+    else {
+        d->emit( SelectorProgramData::Unknown );
+    }
+}
+
+
+/*  Combines the \a n results on top of the stack \a yes/\a known,
+    whose top is at \a sp, using And (if \a conjunction is true) or
+    Or. Returns the new stack pointer.
+
+    A message is known to match a conjunction if it's known to match
+    all terms, and known not to if it's known not to match any. Vice
+    versa for a disjunction.
+*/
+
+static uint combine( Mask * yes, Mask * known, uint sp, uint n,
+                     bool conjunction, Mask all )
+{
+    Mask y = conjunction ? all : 0;
+    Mask no = conjunction ? 0 : all;
+    uint i = sp - n;
+    while ( i < sp ) {
+        if ( conjunction ) {
+            y &= yes[i];
+            no |= known[i] & ~yes[i];
+        }
+        else {
+            y |= yes[i];
+            no &= known[i] & ~yes[i];
+        }
+        i++;
+    }
+    sp -= n;
+    yes[sp] = y;
+    known[sp] = y | no;
+    return sp + 1;
+}
+
+
+/*! Evaluates this program for all the messages in \a s, and adds
+    the UIDs of the matching messages to \a matches.
+
+    Returns Selector::Yes if all messages could be evaluated, and
+    Selector::Punt (leaving \a matches in an undefined state) if the
+    result for at least one message depends on something the program
+    can't know.
+*/
+
+Selector::MatchResult SelectorProgram::run( Session * s,
+                                            IntegerSet & matches )
+{
+    MessageIndex * mi = 0;
+    if ( d->index && s->messageIndex()->current() )
+        mi = s->messageIndex();
+
+    uint stack = d->maxDepth + 1;
+    Mask * yes = (Mask*)Allocator::alloc( stack * sizeof( Mask ), 0 );
+    Mask * known = (Mask*)Allocator::alloc( stack * sizeof( Mask ), 0 );
+
+    uint uids[batchSize];
+    bool found[batchSize];
+    uint idates[batchSize];
+    uint sizes[batchSize];
+    int64 modseqs[batchSize];
+    int64 flagbits[batchSize];
+
+    uint max = s->count();
+    uint c = 0;
+    while ( c < max ) {
+        uint n = 0;
+        while ( n < batchSize && c < max )
+            uids[n++] = s->uid( ++c );
+        Mask all = n == batchSize ? ~(Mask)0 : ( (Mask)1 << n ) - 1;
+
+        // the messages whose columns we have
+        Mask indexed = 0;
+        if ( mi ) {
+            mi->fill( uids, n, found,
+                      d->dates ? idates : 0, d->sizes ? sizes : 0,
+                      d->modseqs ? modseqs : 0,
+                      d->flagbits ? flagbits : 0 );
+            uint j = 0;
+            while ( j < n ) {
+                indexed |= (Mask)found[j] << j;
+                j++;
+            }
+        }
+
+        uint sp = 0;
+        List<SelectorProgramData::Instruction>::Iterator i( d->program );
+        while ( i ) {
+            Mask y = 0;
+            Mask k = all;
+            uint j = 0;
+            switch ( i->op ) {
+            case SelectorProgramData::True:
+                y = all;
+                break;
+            case SelectorProgramData::Unknown:
+                k = 0;
+                break;
+            case SelectorProgramData::Uids:
+                while ( j < n ) {
+                    y |= (Mask)i->uids.contains( uids[j] ) << j;
+                    j++;
+                }
+                break;
+            case SelectorProgramData::Recent:
+                while ( j < n ) {
+                    y |= (Mask)s->isRecent( uids[j] ) << j;
+                    j++;
+                }
+                break;
+            case SelectorProgramData::Flag:
+                k = indexed;
+                while ( mi && j < n ) {
+                    y |= (Mask)mi->hasFlag( uids[j], i->n ) << j;
+                    j++;
+                }
+                break;
+            case SelectorProgramData::FlagBit:
+                k = indexed;
+                while ( mi && j < n ) {
+                    y |= (Mask)( ( flagbits[j] & i->bit ) != 0 ) << j;
+                    j++;
+                }
+                break;
+            case SelectorProgramData::DateRange:
+                k = indexed;
+                while ( mi && j < n ) {
+                    y |= (Mask)( idates[j] >= i->lo &&
+                                 idates[j] <= i->hi ) << j;
+                    j++;
+                }
+                break;
+            case SelectorProgramData::SizeRange:
+                k = indexed;
+                while ( mi && j < n ) {
+                    y |= (Mask)( sizes[j] >= i->lo &&
+                                 sizes[j] <= i->hi ) << j;
+                    j++;
+                }
+                break;
+            case SelectorProgramData::ModSeqRange:
+                k = indexed;
+                while ( mi && j < n ) {
+                    y |= (Mask)( modseqs[j] >= i->lo &&
+                                 modseqs[j] <= i->hi ) << j;
+                    j++;
+                }
+                break;
+            case SelectorProgramData::Not:
+                sp--;
+                y = known[sp] & ~yes[sp];
+                k = known[sp];
+                break;
+            case SelectorProgramData::And:
+            case SelectorProgramData::Or:
+                sp = combine( yes, known, sp, i->n,
+                              i->op == SelectorProgramData::And, all );
+                sp--;
+                y = yes[sp];
+                k = known[sp];
+                break;
+            }
+            yes[sp] = y & k;
+            known[sp] = k;
+            sp++;
+            ++i;
+        }
+
+        // several conditions added: all must match
+        if ( sp != 1 )
+            sp = combine( yes, known, sp, sp, true, all );
+
+        if ( known[0] != all )
+            return Selector::Punt;
+
+        Mask y = yes[0];
+        while ( y ) {
+            uint j = __builtin_ctzll( y );
+            matches.add( uids[j] );
+            y &= y - 1;
+        }
+    }
+
+    return Selector::Yes;
+}
@@ -0,0 +1,32 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SELECTORPROGRAM_H
+#define SELECTORPROGRAM_H
+
+#include "selector.h"
+
+
+class IntegerSet;
+class Session;
+
+
+class SelectorProgram
+    : public Garbage
+{
+public:
+    SelectorProgram();
+
+    void add( Selector * );
+
+    bool usesIndex() const;
+
+    Selector::MatchResult run( Session *, IntegerSet & );
+
+private:
+    class SelectorProgramData * d;
+
+    void compile( Selector * );
+};
+
+
+#endif
@@ -38,8 +38,11 @@
 #include "log.h"
 #include "file.h"
 #include "scope.h"
+#include "timer.h"
+#include "event.h"
 #include "estring.h"
 #include "logclient.h"
+#include "profiler.h"
 #include "eventloop.h"
 #include "connection.h"
 #include "configuration.h"
@@ -282,10 +285,13 @@ void Server::nameResolution()
 
 void Server::files()
 {
+    // sockets passed to us by systemd start at fd 3 and are kept
+    // for Listener::create()
+    int inherited = Connection::inheritedSockets();
     int s = getdtablesize();
     while ( s > 0 ) {
         s--;
-        if ( s != 2 && s != 1 )
+        if ( s != 2 && s != 1 && ( s < 3 || s >= 3 + inherited ) )
             close( s );
     }
     s = open( "/dev/null", O_RDWR );
@@ -314,6 +320,61 @@ void Server::logSetup()
 }
 
 
+// set when we've been asked to drain, so that the mother doesn't
+// replace the children that exit
+static volatile sig_atomic_t draining = 0;
+
+// set when we've been asked to reread the configuration file
+static volatile sig_atomic_t reloading = 0;
+
+
+static void reloadConfiguration( int )
+{
+    reloading = 1;
+    Server::killChildren( SIGHUP );
+}
+
+
+/*  The Reloader looks for reloading once per second, and when it's
+    set, rereads the configuration file and tells the classes that
+    cache configuration values.
+*/
+
+class Reloader
+    : public EventHandler
+{
+public:
+    Reloader(): EventHandler() {
+        Timer * t = new Timer( this, 1 );
+        t->setRepeating( true );
+    }
+
+    void execute() {
+        if ( !reloading )
+            return;
+        reloading = 0;
+        Configuration::reload();
+        EventLoop::global()->reconfigure();
+        LogClient::reconfigure();
+        Profiler::reconfigure();
+        if ( Server::name() == "archiveopteryx" )
+            EventLoop::global()->setMemoryUsage(
+                1024 * 1024 *
+                Configuration::scalar( Configuration::MemoryLimit ) );
+    }
+};
+
+
+static void drainLoop( int )
+{
+    draining = 1;
+    Server::killChildren( SIGUSR2 );
+    if ( EventLoop::global() )
+        EventLoop::global()->drain(
+            Configuration::scalar( Configuration::DrainTime ) );
+}
+
+
 static void shutdownLoop( int )
 {
     Server::killChildren( SIGTERM );
@@ -366,8 +427,8 @@ void Server::loop()
     sigemptyset( &sa.sa_mask ); // we block no other signals
     sa.sa_flags = 0; // in particular, we don't want SA_RESETHAND
 
-    // we cannot reread files, so we ignore sighup
-    sa.sa_handler = SIG_IGN;
+    // sighup rereads the configuration file
+    sa.sa_handler = reloadConfiguration;
     ::sigaction( SIGHUP, &sa, 0 );
 
     // sigint and sigterm both should stop the server
@@ -384,6 +445,11 @@ void Server::loop()
     sa.sa_handler = dumpCoreAndGoOn;
     ::sigaction( SIGUSR1, &sa, 0 );
 
+    // and one to stop accepting connections and close the existing
+    // ones slowly, so a new server can take over
+    sa.sa_handler = drainLoop;
+    ::sigaction( SIGUSR2, &sa, 0 );
+
     // a custom signal to die, quickly, for last-resort exit
     sa.sa_handler = ::killChildrenAndExit;
     ::sigaction( SIGALRM, &sa, 0 );
@@ -464,6 +530,10 @@ void Server::secure()
     if ( !security ) {
         if ( getuid() == 0 || geteuid() == 0 )
             log( "Warning: Starting " + d->name + " insecurely as root" );
+        if ( d->configFile.isEmpty() )
+            Configuration::prepareReload( Configuration::configFile() );
+        else
+            Configuration::prepareReload( d->configFile );
         d->secured = false;
         return;
     }
@@ -530,6 +600,8 @@ void Server::secure()
         exit( 1 );
     }
 
+    Configuration::prepareReload( cfn );
+
     EString root;
     switch ( d->chrootMode ) {
     case JailDir:
@@ -638,11 +710,19 @@ void Server::run()
         exit( 1 );
     }
 
+    (void)new Reloader;
+    Profiler::reconfigure();
+
     dup2( 0, 1 );
     if ( d->fork )
         dup2( 0, 2 );
     EventLoop::global()->start();
 
+    if ( Profiler::active() ) {
+        Profiler::collect();
+        Profiler::write();
+    }
+
     if ( Scope::current()->log()->disastersYet() )
         exit( 1 );
     exit( 0 );
@@ -693,6 +773,7 @@ void Server::maintainChildren()
         i++;
     }
     uint failures = 0;
+    uint process = 0;
     while ( children > 1 && d->mainProcess ) {
         // check that all children exist
         List<pid_t>::Iterator c( d->children );
@@ -706,8 +787,10 @@ void Server::maintainChildren()
         }
         // add new children in each empty slot
         c = d->children->first();
+        uint slot = 0;
         while ( c && d->mainProcess ) {
-            if ( !*c ) {
+            slot++;
+            if ( !*c && !draining ) {
                 *c = ::fork();
                 if ( *c < 0 ) {
                     log( "Unable to fork server; pressing on. Error code " +
@@ -720,6 +803,7 @@ void Server::maintainChildren()
                 else {
                     // a child. fork() must return.
                     d->mainProcess = false;
+                    process = slot;
                 }
             }
             ++c;
@@ -730,10 +814,18 @@ void Server::maintainChildren()
             time_t now = time( 0 );
             pid_t child = ::waitpid( -1, &status, 0 );
             if ( child == (pid_t)-1 && errno == ECHILD ) {
+                if ( draining ) {
+                    log( "All server processes have drained; quitting.",
+                         Log::Significant );
+                    exit( 0 );
+                }
                 log( "Qutting due to unexpected lack of child processes.",
                      Log::Error );
                 exit( 0 );
             }
+            if ( child == (pid_t)-1 || draining )
+                // interrupted by a signal, or a drained child exited
+                continue;
             if ( time( 0 ) >= now + 5 ) {
                 // not a failure, or the first in a long while
                 log( "Child process failed; no problem yet",
@@ -760,7 +852,7 @@ void Server::maintainChildren()
     // the mother never gets this far: by this time, we know we should
     // serve users.
     d->children = 0;
-    EventLoop::global()->closeAllExceptListeners();
+    EventLoop::global()->closeAllExceptListeners( process );
     log( "Process " + fn( getpid() ) + " started" );
     if ( Configuration::toggle( Configuration::UseStatistics ) ) {
         uint port = Configuration::scalar( Configuration::StatisticsPort );
@@ -3,6 +3,8 @@
 #include "session.h"
 
 #include "transaction.h"
+#include "messageindex.h"
+#include "flagsnapshot.h"
 #include "integerset.h"
 #include "allocator.h"
 #include "selector.h"
@@ -11,6 +13,7 @@
 #include "event.h"
 #include "query.h"
 #include "scope.h"
+#include "graph.h"
 #include "flag.h"
 #include "map.h"
 #include "log.h"
@@ -24,7 +27,7 @@ public:
         : readOnly( true ),
           mailbox( 0 ),
           uidnext( 1 ), nextModSeq( 1 ),
-          permissions( 0 )
+          permissions( 0 ), index( 0 )
     {}
 
     bool readOnly;
@@ -36,6 +39,7 @@ public:
     int64 nextModSeq;
     Permissions * permissions;
     IntegerSet unannounced;
+    MessageIndex * index;
 };
 
 
@@ -300,10 +304,11 @@ public:
     SessionInitialiserData()
         : mailbox( 0 ),
           t( 0 ), recent( 0 ), messages( 0 ), expunges( 0 ),
+          flags( 0 ), snapshot( 0 ),
           also( 0 ),
           oldUidnext( 0 ), newUidnext( 0 ),
           state( NoTransaction ),
-          changeRecent( false )
+          changeRecent( false ), runs( false )
         {}
 
     Mailbox * mailbox;
@@ -313,6 +318,9 @@ public:
     Query * recent;
     Query * messages;
     Query * expunges;
+    Query * flags;
+
+    FlagSnapshot * snapshot;
 
     Session * also;
 
@@ -326,6 +334,7 @@ public:
     State state;
 
     bool changeRecent;
+    bool runs;
 };
 
 
@@ -389,7 +398,8 @@ void SessionInitialiser::execute()
             recordMailboxChanges();
             recordExpunges();
             if ( d->messages->done() &&
-                 ( !d->expunges || d->expunges->done() ) )
+                 ( !d->expunges || d->expunges->done() ) &&
+                 ( !d->flags || d->flags->done() ) )
                 d->state = SessionInitialiserData::Updated;
             break;
         case SessionInitialiserData::Updated:
@@ -560,10 +570,35 @@ void SessionInitialiser::findMailboxChanges()
     EString msgs = "select mm.uid, mm.modseq from mailbox_messages mm "
                   "where mm.mailbox=$1 and mm.uid<$2";
 
+    // if every session is new, nothing cares about modseqs, and
+    // asking for runs of consecutive UIDs instead of one row per
+    // message makes a big difference for large mailboxes.
+    if ( initialising ) {
+        d->runs = true;
+        List<Session>::Iterator i( d->sessions );
+        while ( i && d->runs ) {
+            if ( i->uidnext() > 1 )
+                d->runs = false;
+            ++i;
+        }
+    }
+    if ( d->runs )
+        msgs = "select min(uid) as first, max(uid) as last from "
+               "(select uid, uid-row_number() over (order by uid) as run "
+               "from mailbox_messages "
+               "where mailbox=$1 and uid<$2) r "
+               "group by run";
+
     // if we know we'll see one new modseq and at least one new
     // message, we could skip the test on mm.modseq.
-    if ( !initialising )
-        msgs.append( " and (mm.uid>=$3 or mm.modseq>=$4)" );
+    if ( !initialising ) {
+        msgs = "select mm.uid, mm.modseq, mm.message, mm.seen, mm.deleted, "
+               "mm.flagbits "
+               "from mailbox_messages mm "
+               "where mm.mailbox=$1 and mm.uid<$2 "
+               "and (mm.uid>=$3 or mm.modseq>=$4)";
+        d->snapshot = new FlagSnapshot( d->oldModSeq, d->newModSeq );
+    }
 
     d->messages = new Query( msgs, this );
     d->messages->bind( 1, d->mailbox->id() );
@@ -577,6 +612,19 @@ void SessionInitialiser::findMailboxChanges()
     if ( initialising )
         return;
 
+    // the flags of the same messages, so that all the sessions can
+    // share one FlagSnapshot instead of each fetching the flags
+    d->flags = new Query( "select f.uid, f.flag from flags f "
+                          "join mailbox_messages mm on "
+                          "(f.mailbox=mm.mailbox and f.uid=mm.uid) "
+                          "where mm.mailbox=$1 and mm.uid<$2 "
+                          "and (mm.uid>=$3 or mm.modseq>=$4)", this );
+    d->flags->bind( 1, d->mailbox->id() );
+    d->flags->bind( 2, d->newUidnext );
+    d->flags->bind( 3, d->oldUidnext );
+    d->flags->bind( 4, d->oldModSeq );
+    submit( d->flags );
+
     d->expunges = new Query( "select uid from deleted_messages "
                              "where mailbox=$1 and modseq>=$2",
                              this );
@@ -587,16 +635,53 @@ void SessionInitialiser::findMailboxChanges()
 
 
 /*! Parses the results of the Query generated by findMailboxChanges()
-    and updates each Session.
+    and updates each Session. When all the changes have arrived, makes
+    them available to all sessions via Mailbox::flagSnapshot().
+
+    When all the sessions are new, the results are runs of UIDs rather
+    than individual messages.
 */
 
 void SessionInitialiser::recordMailboxChanges()
 {
     Row * r = 0;
+    if ( d->runs ) {
+        IntegerSet uids;
+        while ( (r=d->messages->nextRow()) != 0 )
+            uids.add( r->getInt( "first" ), r->getInt( "last" ) );
+        if ( uids.isEmpty() )
+            return;
+        List<Session>::Iterator i( d->sessions );
+        while ( i ) {
+            i->addUnannounced( uids );
+            ++i;
+        }
+        return;
+    }
+
     while ( (r=d->messages->nextRow()) != 0 ) {
         uint uid = r->getInt( "uid" );
-        addToSessions( uid, r->getBigint( "modseq" ) );
+        int64 ms = r->getBigint( "modseq" );
+        addToSessions( uid, ms );
+        if ( d->snapshot )
+            d->snapshot->add( uid, r->getInt( "message" ), ms,
+                              r->getBoolean( "seen" ),
+                              r->getBoolean( "deleted" ),
+                              r->getBigint( "flagbits" ) );
     }
+
+    if ( !d->flags || !d->messages->done() )
+        return;
+
+    while ( (r=d->flags->nextRow()) != 0 )
+        d->snapshot->addFlag( r->getInt( "uid" ), r->getInt( "flag" ) );
+
+    if ( !d->flags->done() )
+        return;
+
+    if ( !d->messages->failed() && !d->flags->failed() )
+        d->mailbox->setFlagSnapshot( d->snapshot );
+    d->flags = 0;
 }
 
 
@@ -624,11 +709,23 @@ void SessionInitialiser::recordExpunges()
 }
 
 
+static GraphableDataSet * fanout = 0;
+
+
 /*! Persuades each Session to emit its responses.
+
+    The number of sessions updated at once is recorded as
+    "session-fanout", so the cost of a change is visible.
 */
 
 void SessionInitialiser::emitUpdates()
 {
+    if ( !d->sessions.isEmpty() ) {
+        if ( !fanout )
+            fanout = new GraphableDataSet( "session-fanout" );
+        fanout->addNumber( d->sessions.count() );
+    }
+
     List<Session>::Iterator s( d->sessions );
     while ( s ) {
         if ( s->nextModSeq() < d->newModSeq )
@@ -699,17 +796,17 @@ const IntegerSet & Session::messages() const
 }
 
 
-/*! Records that the client has been told that \a uid no longer
-    exists.
+/*! Records that the client has been told that the messages in \a
+    uids no longer exist.
 
     This is IMAP stuff infesting Session.
 */
 
-void Session::clearExpunged( uint uid )
+void Session::clearExpunged( const IntegerSet & uids )
 {
-    d->msns.remove( uid );
-    d->expunges.remove( uid );
-    d->unannounced.remove( uid );
+    d->msns.remove( uids );
+    d->expunges.remove( uids );
+    d->unannounced.remove( uids );
 }
 
 
@@ -790,3 +887,16 @@ void Session::clearUnannounced()
 void Session::sendFlagUpdate()
 {
 }
+
+
+/*! Returns the MessageIndex for this Session, creating an empty one
+    if necessary. The index isn't filled in until someone calls
+    MessageIndex::refresh().
+*/
+
+MessageIndex * Session::messageIndex()
+{
+    if ( !d->index )
+        d->index = new MessageIndex( this );
+    return d->index;
+}
@@ -14,6 +14,7 @@ class Connection;
 class Mailbox;
 class Message;
 class Select;
+class MessageIndex;
 class IMAP;
 
 
@@ -57,7 +58,7 @@ public:
     const IntegerSet & messages() const;
 
     void expunge( const IntegerSet & );
-    virtual void clearExpunged( uint );
+    virtual void clearExpunged( const IntegerSet & );
     virtual void earlydeletems( const IntegerSet & );
 
     virtual void emitUpdates( Transaction * );
@@ -69,6 +70,8 @@ public:
 
     virtual void sendFlagUpdate();
 
+    MessageIndex * messageIndex();
+
 private:
     friend class SessionInitialiser;
     class SessionData *d;
@@ -106,15 +106,19 @@ class EventHandler * Timer::owner()
 void Timer::execute()
 {
     if ( d->repeating ) {
+        // the EventLoop files timers by timeout, so it has to forget
+        // this one while we change it
+        EventLoop::global()->removeTimer( this );
         d->timeout += d->interval;
         uint now = time( 0 );
         // if we can't make the required frequency, get as close as we can
         if ( d->timeout <= now )
             d->timeout = now + 1;
+        EventLoop::global()->addTimer( this );
     }
     else {
-        d->timeout = 0;
         EventLoop::global()->removeTimer( this );
+        d->timeout = 0;
     }
 
     notify();
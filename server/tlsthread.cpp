@@ -4,15 +4,34 @@
 
 #include "file.h"
 #include "estring.h"
+#include "list.h"
+#include "graph.h"
 #include "allocator.h"
 #include "configuration.h"
 
 #include <unistd.h>
+// errno
+#include <errno.h>
+// poll
+#include <poll.h>
+// malloc, realloc
+#include <stdlib.h>
+// fcntl
+#include <fcntl.h>
+// memcpy, memcmp, strdup
+#include <string.h>
+// stat
+#include <sys/stat.h>
+// time
+#include <time.h>
 
 #include <pthread.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 
 static const int bs = 32768;
@@ -36,7 +55,11 @@ public:
           encwbo( 0 ), encwbs( 0 ),
           encfd( -1 ),
           networkBio( 0 ), sslBio( 0 ), thread( 0 ),
-          broken( false )
+          broken( false ),
+          crct( false ), crenc( false ), cwct( false ), cwenc( false ),
+          ctgone( false ), encgone( false ), finish( false ),
+          ktls( false ), attached( false ),
+          worker( 0 ), slot( 0 )
         {}
 
     SSL * ssl;
@@ -70,6 +93,60 @@ public:
 
     pthread_t thread;
     bool broken;
+
+    // what poll/select told us, and what we've concluded
+    bool crct;
+    bool crenc;
+    bool cwct;
+    bool cwenc;
+    bool ctgone;
+    bool encgone;
+    bool finish;
+
+    // whether openssl talks to encfd itself (so the kernel can do
+    // the record encryption), and whether it has been told to yet
+    bool ktls;
+    bool attached;
+
+    // the pool thread that serves us, if any, and where
+    class TlsWorker * worker;
+    uint slot;
+};
+
+
+/*! \nodoc
+
+    A TlsWorker is one of a fixed pool of threads, each of which
+    serves many TlsThread objects using poll(). The pool is used when
+    tls-threads is nonzero.
+
+    The worker must not allocate GC memory. Its arrays are malloc()ed,
+    and the TlsThread objects are kept alive by tlsSessions (below)
+    until TlsThread::close() removes them, which it does while holding
+    the worker's lock.
+*/
+
+class TlsWorker // NOT a Garbage class
+{
+public:
+    TlsWorker();
+
+    bool start();
+    void add( TlsThread * );
+    void remove( TlsThread * );
+    void run();
+    void retire( uint );
+    void wakeUp();
+
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int wake[2];
+
+    TlsThread ** sessions;
+    uint * serials;
+    uint size;
+    uint count;
+    uint serial;
 };
 
 
@@ -82,6 +159,160 @@ static void * trampoline( void * t )
 
 static SSL_CTX * ctx = 0;
 
+static TlsWorker ** workers = 0;
+static uint numWorkers = 0;
+static List<TlsThread> * tlsSessions = 0;
+
+
+// the session ticket keys. each is a 16-byte name, a 16-byte HMAC
+// key and a 16-byte AES key, and the first one is used for new
+// tickets. the TLS threads use these, so they're malloc()ed and
+// guarded by ticketLock.
+static const uint ticketKeySize = 48;
+static pthread_mutex_t ticketLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char * ticketKeys = 0;
+static uint numTicketKeys = 0;
+static char * ticketKeyFile = 0;
+static time_t ticketKeysChecked = 0;
+static time_t ticketKeysModified = 0;
+
+
+/*  (Re)reads ticketKeyFile if it has changed since last time. The
+    caller must hold ticketLock. Returns true if we have keys.
+*/
+
+static bool readTicketKeys()
+{
+    struct stat st;
+    if ( ::stat( ticketKeyFile, &st ) < 0 ||
+         st.st_mtime == ticketKeysModified )
+        return numTicketKeys > 0;
+
+    uint n = st.st_size / ticketKeySize;
+    if ( n < 1 || (uint)st.st_size != n * ticketKeySize )
+        return numTicketKeys > 0;
+    unsigned char * k = (unsigned char*)::malloc( st.st_size );
+    int fd = ::open( ticketKeyFile, O_RDONLY );
+    if ( !k || fd < 0 ) {
+        ::free( k );
+        if ( fd >= 0 )
+            ::close( fd );
+        return numTicketKeys > 0;
+    }
+    uint got = 0;
+    int r = 1;
+    while ( got < (uint)st.st_size && r > 0 ) {
+        r = ::read( fd, k + got, st.st_size - got );
+        if ( r > 0 )
+            got += r;
+    }
+    ::close( fd );
+    if ( got != (uint)st.st_size ) {
+        ::free( k );
+        return numTicketKeys > 0;
+    }
+
+    ::free( ticketKeys );
+    ticketKeys = k;
+    numTicketKeys = n;
+    ticketKeysModified = st.st_mtime;
+    return true;
+}
+
+
+/*  Called by OpenSSL to set up the cipher and HMAC contexts \a c and
+    \a h for encrypting (if \a enc is 1) or decrypting a session ticket
+    named \a name with initialization vector \a iv. Returns 1 if all is
+    well, 2 if the ticket is good but should be reissued with the
+    current key, 0 if the ticket's key is unknown and -1 on error.
+*/
+
+static int ticketKeyCallback( SSL *, unsigned char * name,
+                              unsigned char * iv,
+                              EVP_CIPHER_CTX * c, HMAC_CTX * h, int enc )
+{
+    pthread_mutex_lock( &ticketLock );
+    time_t now = ::time( 0 );
+    if ( ticketKeyFile && now >= ticketKeysChecked + 60 ) {
+        ticketKeysChecked = now;
+        readTicketKeys();
+    }
+
+    const EVP_CIPHER * cipher = EVP_aes_128_cbc();
+    int result = -1;
+    if ( enc ) {
+        unsigned char * k = ticketKeys;
+        if ( RAND_bytes( iv, EVP_CIPHER_iv_length( cipher ) ) > 0 &&
+             EVP_EncryptInit_ex( c, cipher, 0, k + 32, iv ) &&
+             HMAC_Init_ex( h, k + 16, 16, EVP_sha256(), 0 ) ) {
+            ::memcpy( name, k, 16 );
+            result = 1;
+        }
+    }
+    else {
+        uint i = 0;
+        while ( i < numTicketKeys &&
+                ::memcmp( name, ticketKeys + i * ticketKeySize, 16 ) )
+            i++;
+        if ( i >= numTicketKeys ) {
+            result = 0;
+        }
+        else {
+            unsigned char * k = ticketKeys + i * ticketKeySize;
+            if ( HMAC_Init_ex( h, k + 16, 16, EVP_sha256(), 0 ) &&
+                 EVP_DecryptInit_ex( c, cipher, 0, k + 32, iv ) )
+                result = i ? 2 : 1;
+        }
+    }
+    pthread_mutex_unlock( &ticketLock );
+    return result;
+}
+
+
+/*  Sets up the session cache and session tickets for ctx. */
+
+static void setupResumption()
+{
+    SSL_CTX_set_session_id_context( ctx, (const unsigned char *)"aox", 3 );
+
+    uint size = Configuration::scalar( Configuration::TlsSessionCacheSize );
+    if ( size ) {
+        SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_SERVER );
+        SSL_CTX_sess_set_cache_size( ctx, size );
+    }
+    else {
+        SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_OFF );
+    }
+    SSL_CTX_set_timeout( ctx,
+                         Configuration::scalar(
+                             Configuration::TlsSessionTimeout ) );
+
+    EString f( Configuration::text( Configuration::TlsTicketKeyFile ) );
+    if ( !f.isEmpty() ) {
+        ticketKeyFile = ::strdup( File::chrooted( f ).cstr() );
+        if ( !readTicketKeys() ) {
+            log( "Cannot read TLS ticket keys from " + f +
+                 " (it must contain one or more 48-byte keys)",
+                 Log::Disaster );
+            return;
+        }
+    }
+    else {
+        // this happens before we fork, so all the server processes
+        // share the key.
+        ticketKeys = (unsigned char*)::malloc( ticketKeySize );
+        if ( !ticketKeys || RAND_bytes( ticketKeys, ticketKeySize ) <= 0 ) {
+            log( "Cannot make up a TLS ticket key", Log::Error );
+            ::free( ticketKeys );
+            ticketKeys = 0;
+            return;
+        }
+        numTicketKeys = 1;
+    }
+    ticketKeysChecked = ::time( 0 );
+    SSL_CTX_set_tlsext_ticket_key_cb( ctx, ticketKeyCallback );
+}
+
 
 /*! Perform any OpenSSL initialisation needed to enable us to create
     TlsThreads later.
@@ -101,6 +332,14 @@ void TlsThread::setup()
         // and not v3 either
         | SSL_OP_NO_SSLv3
         ;
+    if ( Configuration::toggle( Configuration::UseKtls ) ) {
+#if defined(SSL_OP_ENABLE_KTLS)
+        options |= SSL_OP_ENABLE_KTLS;
+#else
+        log( "use-ktls is enabled, but this OpenSSL cannot use kernel TLS",
+             Log::Error );
+#endif
+    }
     SSL_CTX_set_options( ctx, options );
 
     SSL_CTX_set_cipher_list( ctx, "kEDH:HIGH:!aNULL:!MD5" );
@@ -122,11 +361,65 @@ void TlsThread::setup()
 
     // we don't ask for a client cert
     SSL_CTX_set_verify( ctx, SSL_VERIFY_NONE, NULL );
+
+    setupResumption();
+
+    uint n = Configuration::scalar( Configuration::TlsThreads );
+    if ( n && !workers ) {
+        workers = (TlsWorker**)::malloc( n * sizeof( TlsWorker * ) );
+        while ( workers && numWorkers < n ) {
+            TlsWorker * w = new TlsWorker;
+            if ( !w->start() ) {
+                log( "Could only start " + fn( numWorkers ) + " of " +
+                     fn( n ) + " TLS threads", Log::Error );
+                break;
+            }
+            workers[numWorkers++] = w;
+        }
+        tlsSessions = new List<TlsThread>;
+        Allocator::addEternal( tlsSessions, "TLS sessions served by pool" );
+    }
+}
+
+
+static GraphableNumber * fullHandshakes = 0;
+static GraphableNumber * resumedHandshakes = 0;
+
+
+/*! Records how many TLS handshakes have completed so far, and how
+    many of those resumed an earlier session. The TLS threads can't
+    touch the graphs, so EventLoop calls this now and then.
+*/
+
+void TlsThread::graphHandshakes()
+{
+    if ( !ctx )
+        return;
+    if ( !fullHandshakes ) {
+        fullHandshakes = new GraphableNumber( "tls-full-handshakes" );
+        resumedHandshakes = new GraphableNumber( "tls-resumed-handshakes" );
+    }
+    long good = SSL_CTX_sess_accept_good( ctx );
+    long resumed = SSL_CTX_sess_hits( ctx );
+    if ( resumed > good )
+        resumed = good;
+    fullHandshakes->setValue( good - resumed );
+    resumedHandshakes->setValue( resumed );
 }
 
 
 /*! \class TlsThread tlsthread.h
     Creates and manages a thread for TLS processing using openssl
+
+    By default, each TlsThread has its own thread. If tls-threads is
+    set, a fixed pool of that many threads serves all the TlsThread
+    objects, so that the number of TLS connections is bounded by
+    memory rather than by the number of threads the OS permits.
+
+    If use-ktls is enabled and OpenSSL supports it, OpenSSL reads and
+    writes the client's socket directly and asks the kernel to do
+    the record encryption after the handshake, so the thread only
+    copies cleartext between the two sockets.
 */
 
 
@@ -149,15 +442,25 @@ TlsThread::TlsThread( bool asClient )
     else
         SSL_set_accept_state( d->ssl );
 
-    if ( !BIO_new_bio_pair( &d->sslBio, bs, &d->networkBio, bs ) ) {
-        // an error. hm?
-    }
-    ::SSL_set_bio( d->ssl, d->sslBio, d->sslBio );
+#if defined(SSL_OP_ENABLE_KTLS)
+    if ( SSL_get_options( d->ssl ) & SSL_OP_ENABLE_KTLS )
+        d->ktls = true;
+#endif
 
     d->ctrb = (char*)Allocator::alloc( bs, 0 );
     d->ctwb = (char*)Allocator::alloc( bs, 0 );
-    d->encrb = (char*)Allocator::alloc( bs, 0 );
-    d->encwb = (char*)Allocator::alloc( bs, 0 );
+
+    if ( !d->ktls ) {
+        if ( !BIO_new_bio_pair( &d->sslBio, bs, &d->networkBio, bs ) ) {
+            // an error. hm?
+        }
+        ::SSL_set_bio( d->ssl, d->sslBio, d->sslBio );
+        d->encrb = (char*)Allocator::alloc( bs, 0 );
+        d->encwb = (char*)Allocator::alloc( bs, 0 );
+    }
+
+    if ( numWorkers )
+        return;
 
     int r = pthread_create( &d->thread, 0, trampoline, (void*)this );
     if ( r ) {
@@ -182,150 +485,29 @@ TlsThread::~TlsThread()
 
 
 /*! Starts negotiating and does everything after that. This is run in
-    the separate thread.
+    the separate thread, if there is one per TlsThread.
 
 */
 
 void TlsThread::start()
 {
-    bool crct = false;
-    bool crenc = false;
-    bool cwct = false;
-    bool cwenc = false;
-    bool ctgone = false;
-    bool encgone = false;
-    bool finish = false;
-    while ( !finish && !d->broken ) {
-        // are our read buffers empty, and select said we can read? if
-        // so, try to read
-        if ( crct ) {
-            d->ctrbs = ::read( d->ctfd, d->ctrb, bs );
-            if ( d->ctrbs <= 0 ) {
-                ctgone = true;
-                d->ctrbs = 0;
-            }
-        }
-        if ( crenc ) {
-            d->encrbs = ::read( d->encfd, d->encrb, bs );
-            if ( d->encrbs <= 0 ) {
-                encgone = true;
-                d->encrbs = 0;
-            }
-        }
-        if ( ctgone && encgone ) {
-            // if both file descriptors are gone, there's nothing left
-            // to do. but maybe we try anyway.
-            finish = true;
-        }
-        if ( ctgone && d->encwbs == 0 ) {
-            // if the cleartext one is gone and we have nothing to
-            // write to enc, finish
-            finish = true;
-        }
-        if ( encgone && d->ctwbs == 0 ) {
-            // if the encfd is gone and we have nothing to write to ct,
-            // finish
-            finish = true;
-        }
-
-        // is there something in our write buffers, and select() told
-        // us we can write it?
-        if ( cwct ) {
-            int r = ::write( d->ctfd,
-                             d->ctwb + d->ctwbo,
-                             d->ctwbs - d->ctwbo );
-            if ( r <= 0 ) {
-                // select said we could, but we couldn't. parachute time.
-                finish = true;
-            }
-            else {
-                d->ctwbo += r;
-                if ( d->ctwbo == d->ctwbs ) {
-                    d->ctwbs = 0;
-                    d->ctwbo = 0;
-                }
-            }
-        }
-        if ( cwenc ) {
-            int r = ::write( d->encfd,
-                             d->encwb + d->encwbo,
-                             d->encwbs - d->encwbo );
-            if ( r <= 0 ) {
-                finish = true;
-            }
-            else {
-                d->encwbo += r;
-                if ( d->encwbo == d->encwbs ) {
-                    d->encwbs = 0;
-                    d->encwbo = 0;
-                }
-            }
-        }
-
-        // we've served file descriptors. now for glorious openssl.
-        if ( d->encrbs > 0 && d->encrbo < d->encrbs ) {
-            int r = BIO_write( d->networkBio,
-                               d->encrb + d->encrbo,
-                               d->encrbs - d->encrbo );
-            if ( r > 0 )
-                d->encrbo += r;
-            if ( d->encrbo >= d->encrbs ) {
-                d->encrbo = 0;
-                d->encrbs = 0;
-            }
-        }
-        if ( d->ctrbs > 0 && d->ctrbo < d->ctrbs ) {
-            int r = SSL_write( d->ssl,
-                               d->ctrb + d->ctrbo,
-                               d->ctrbs - d->ctrbo );
-            if ( r > 0 )
-                d->ctrbo += r;
-            else if ( r < 0 && !finish )
-                finish = sslErrorSeriousness( r );
-            if ( d->ctrbo >= d->ctrbs ) {
-                d->ctrbo = 0;
-                d->ctrbs = 0;
-            }
-        }
-        if ( d->ctwbs == 0 ) {
-            d->ctwbs = SSL_read( d->ssl, d->ctwb, bs );
-            if ( d->ctwbs < 0 ) {
-                if ( !finish )
-                    finish = sslErrorSeriousness( d->ctwbs );
-                d->ctwbs = 0;
-            }
-        }
-        if ( d->encwbs == 0 ) {
-            d->encwbs = BIO_read( d->networkBio, d->encwb, bs );
-            if ( d->encwbs < 0 )
-                d->encwbs = 0;
-        }
+    while ( !d->finish && !d->broken ) {
+        step();
 
-        if ( !finish && !d->broken ) {
-            bool any = false;
+        if ( !d->finish && !d->broken ) {
+            bool rct, wct, renc, wenc;
+            bool any = wants( rct, wct, renc, wenc );
             fd_set r, w;
             FD_ZERO( &r );
             FD_ZERO( &w );
-            if ( d->ctfd >= 0 ) {
-                if ( d->ctrbs == 0 ) {
-                    FD_SET( d->ctfd, &r );
-                    any = true;
-                }
-                if ( d->ctwbs ) {
-                    any = true;
-                    FD_SET( d->ctfd, &w );
-                }
-            }
-            if ( d->encfd >= 0 ) {
-                if ( d->encrbs == 0  ) {
-                    any = true;
-                    FD_SET( d->encfd, &r );
-                }
-                if ( d->encwbs ) {
-                    any = true;
-                    FD_SET( d->encfd, &w );
-                }
-            }
+            if ( rct )
+                FD_SET( d->ctfd, &r );
+            if ( wct )
+                FD_SET( d->ctfd, &w );
+            if ( renc )
+                FD_SET( d->encfd, &r );
+            if ( wenc )
+                FD_SET( d->encfd, &w );
             int maxfd = -1;
             if ( maxfd < d->ctfd )
                 maxfd = d->ctfd;
@@ -347,22 +529,22 @@ void TlsThread::start()
             else {
                 // we aren't going to read, we can't write. no point
                 // in prolonging the agony.
-                finish = true;
+                d->finish = true;
                 tv.tv_sec = 0;
                 tv.tv_usec = 0;
             }
 
-            int n = finish ? 0 : select( maxfd+1, &r, &w, 0, &tv );
+            int n = d->finish ? 0 : select( maxfd+1, &r, &w, 0, &tv );
             if ( n < 0 && errno != EINTR )
-                finish = true;
+                d->finish = true;
 
             if ( n >= 0 ) {
-                crct = FD_ISSET( d->ctfd, &r );
-                cwct = FD_ISSET( d->ctfd, &w );
-                crenc = FD_ISSET( d->encfd, &r );
-                cwenc = FD_ISSET( d->encfd, &w );
+                d->crct = FD_ISSET( d->ctfd, &r );
+                d->cwct = FD_ISSET( d->ctfd, &w );
+                d->crenc = FD_ISSET( d->encfd, &r );
+                d->cwenc = FD_ISSET( d->encfd, &w );
             } else {
-                crct = cwct = crenc = cwenc = false;
+                d->crct = d->cwct = d->crenc = d->cwenc = false;
             }
 
         }
@@ -376,6 +558,163 @@ void TlsThread::start()
 }
 
 
+/*! Does as much work as possible given what the last select() or
+    poll() said about our fds, and sets d->finish if the session is
+    over. start() and TlsWorker::run() both use this.
+*/
+
+void TlsThread::step()
+{
+    if ( d->ktls ) {
+        // openssl reads and writes encfd itself, so that once the
+        // handshake is done, the kernel can encrypt and decrypt the
+        // records. we only shovel cleartext.
+        if ( d->ctfd < 0 || d->encfd < 0 )
+            return;
+        if ( !d->attached ) {
+            SSL_set_fd( d->ssl, d->encfd );
+            d->attached = true;
+        }
+    }
+
+    // are our read buffers empty, and select said we can read? if
+    // so, try to read
+    if ( d->crct ) {
+        d->ctrbs = ::read( d->ctfd, d->ctrb, bs );
+        if ( d->ctrbs <= 0 ) {
+            d->ctgone = true;
+            d->ctrbs = 0;
+        }
+    }
+    if ( d->crenc && !d->ktls ) {
+        d->encrbs = ::read( d->encfd, d->encrb, bs );
+        if ( d->encrbs <= 0 ) {
+            d->encgone = true;
+            d->encrbs = 0;
+        }
+    }
+    if ( d->ctgone && d->encgone ) {
+        // if both file descriptors are gone, there's nothing left
+        // to do. but maybe we try anyway.
+        d->finish = true;
+    }
+    if ( d->ctgone && d->encwbs == 0 ) {
+        // if the cleartext one is gone and we have nothing to
+        // write to enc, finish
+        d->finish = true;
+    }
+    if ( d->encgone && d->ctwbs == 0 ) {
+        // if the encfd is gone and we have nothing to write to ct,
+        // finish
+        d->finish = true;
+    }
+
+    // is there something in our write buffers, and select() told
+    // us we can write it?
+    if ( d->cwct ) {
+        int r = ::write( d->ctfd,
+                         d->ctwb + d->ctwbo,
+                         d->ctwbs - d->ctwbo );
+        if ( r <= 0 ) {
+            // select said we could, but we couldn't. parachute time.
+            d->finish = true;
+        }
+        else {
+            d->ctwbo += r;
+            if ( d->ctwbo == d->ctwbs ) {
+                d->ctwbs = 0;
+                d->ctwbo = 0;
+            }
+        }
+    }
+    if ( d->cwenc && !d->ktls ) {
+        int r = ::write( d->encfd,
+                         d->encwb + d->encwbo,
+                         d->encwbs - d->encwbo );
+        if ( r <= 0 ) {
+            d->finish = true;
+        }
+        else {
+            d->encwbo += r;
+            if ( d->encwbo == d->encwbs ) {
+                d->encwbs = 0;
+                d->encwbo = 0;
+            }
+        }
+    }
+
+    // we've served file descriptors. now for glorious openssl.
+    if ( d->encrbs > 0 && d->encrbo < d->encrbs ) {
+        int r = BIO_write( d->networkBio,
+                           d->encrb + d->encrbo,
+                           d->encrbs - d->encrbo );
+        if ( r > 0 )
+            d->encrbo += r;
+        if ( d->encrbo >= d->encrbs ) {
+            d->encrbo = 0;
+            d->encrbs = 0;
+        }
+    }
+    if ( d->ctrbs > 0 && d->ctrbo < d->ctrbs ) {
+        int r = SSL_write( d->ssl,
+                           d->ctrb + d->ctrbo,
+                           d->ctrbs - d->ctrbo );
+        if ( r > 0 )
+            d->ctrbo += r;
+        else if ( r < 0 && !d->finish )
+            d->finish = sslErrorSeriousness( r );
+        if ( d->ctrbo >= d->ctrbs ) {
+            d->ctrbo = 0;
+            d->ctrbs = 0;
+        }
+    }
+    if ( d->ctwbs == 0 ) {
+        d->ctwbs = SSL_read( d->ssl, d->ctwb, bs );
+        if ( d->ctwbs < 0 ) {
+            if ( !d->finish )
+                d->finish = sslErrorSeriousness( d->ctwbs );
+            d->ctwbs = 0;
+        }
+    }
+    if ( d->encwbs == 0 && !d->ktls ) {
+        d->encwbs = BIO_read( d->networkBio, d->encwb, bs );
+        if ( d->encwbs < 0 )
+            d->encwbs = 0;
+    }
+}
+
+
+/*! Sets \a rct, \a wct, \a renc and \a wenc to reflect whether we
+    want to read/write the cleartext and encrypted fds, and returns
+    true if we want to do anything at all.
+*/
+
+bool TlsThread::wants( bool & rct, bool & wct, bool & renc, bool & wenc )
+{
+    rct = wct = renc = wenc = false;
+    if ( d->ctfd >= 0 ) {
+        if ( d->ctrbs == 0 )
+            rct = true;
+        if ( d->ctwbs )
+            wct = true;
+    }
+    if ( d->encfd >= 0 && d->ktls ) {
+        // openssl reads when we have room, and writes what we have
+        if ( d->ctwbs == 0 )
+            renc = true;
+        if ( d->ctrbs )
+            wenc = true;
+    }
+    else if ( d->encfd >= 0 ) {
+        if ( d->encrbs == 0  )
+            renc = true;
+        if ( d->encwbs )
+            wenc = true;
+    }
+    return rct || wct || renc || wenc;
+}
+
+
 /*! Returns true if the openssl result status \a r is a serious error,
     and false otherwise.
 */
@@ -414,6 +753,8 @@ bool TlsThread::sslErrorSeriousness( int r ) {
 void TlsThread::setServerFD( int fd )
 {
     d->ctfd = fd;
+    if ( numWorkers && d->encfd >= 0 )
+        addToPool();
 }
 
 
@@ -424,6 +765,8 @@ void TlsThread::setServerFD( int fd )
 void TlsThread::setClientFD( int fd )
 {
     d->encfd = fd;
+    if ( numWorkers && d->ctfd >= 0 )
+        addToPool();
 }
 
 
@@ -443,9 +786,255 @@ bool TlsThread::broken() const
 
 void TlsThread::close()
 {
+    if ( d->worker ) {
+        d->worker->remove( this );
+        tlsSessions->remove( this );
+        return;
+    }
+    if ( numWorkers ) {
+        // never got as far as the pool
+        d->broken = true;
+        return;
+    }
     d->broken = true;
     ::close( d->encfd );
     ::close( d->ctfd );
     pthread_cancel( d->thread );
     pthread_join( d->thread, 0 );
 }
+
+
+/*! Hands this TlsThread to the least busy TlsWorker. */
+
+void TlsThread::addToPool()
+{
+    if ( d->worker || d->broken )
+        return;
+    TlsWorker * w = workers[0];
+    uint i = 1;
+    while ( i < numWorkers ) {
+        if ( workers[i]->count < w->count )
+            w = workers[i];
+        i++;
+    }
+    tlsSessions->append( this );
+    w->add( this );
+}
+
+
+TlsWorker::TlsWorker()
+    : sessions( 0 ), serials( 0 ), size( 0 ), count( 0 ), serial( 0 )
+{
+    pthread_mutex_init( &lock, 0 );
+    wake[0] = -1;
+    wake[1] = -1;
+}
+
+
+static void * workerTrampoline( void * w )
+{
+    ((TlsWorker*)w)->run();
+    return 0;
+}
+
+
+/*! Creates the wakeup pipe and starts the thread. Returns false if
+    that isn't possible.
+*/
+
+bool TlsWorker::start()
+{
+    if ( ::pipe( wake ) < 0 )
+        return false;
+    int flags = fcntl( wake[0], F_GETFL, 0 );
+    if ( flags >= 0 ) {
+        fcntl( wake[0], F_SETFL, flags | O_NDELAY );
+        fcntl( wake[1], F_SETFL, flags | O_NDELAY );
+    }
+    if ( pthread_create( &thread, 0, workerTrampoline, (void*)this ) ) {
+        ::close( wake[0] );
+        ::close( wake[1] );
+        return false;
+    }
+    return true;
+}
+
+
+/*! Tells run() to look at the session list again. */
+
+void TlsWorker::wakeUp()
+{
+    char c = 0;
+    (void)::write( wake[1], &c, 1 );
+}
+
+
+/*! Starts serving \a t. Called by the main thread. */
+
+void TlsWorker::add( TlsThread * t )
+{
+    pthread_mutex_lock( &lock );
+    uint i = 0;
+    while ( i < size && sessions[i] )
+        i++;
+    if ( i == size ) {
+        uint n = size ? size * 2 : 64;
+        sessions = (TlsThread**)::realloc( sessions, n * sizeof( TlsThread* ) );
+        serials = (uint*)::realloc( serials, n * sizeof( uint ) );
+        if ( !sessions || !serials )
+            die( Memory );
+        while ( size < n ) {
+            sessions[size] = 0;
+            serials[size] = 0;
+            size++;
+        }
+    }
+    sessions[i] = t;
+    serials[i] = ++serial;
+    t->d->worker = this;
+    t->d->slot = i;
+    count++;
+    pthread_mutex_unlock( &lock );
+    wakeUp();
+}
+
+
+/*! Stops serving \a t, closes its fds and frees its SSL. When this
+    returns, this thread will not touch \a t again. Called by the main
+    thread.
+*/
+
+void TlsWorker::remove( TlsThread * t )
+{
+    pthread_mutex_lock( &lock );
+    TlsThreadData * d = t->d;
+    d->broken = true;
+    if ( d->slot < size && sessions[d->slot] == t )
+        retire( d->slot );
+    d->worker = 0;
+    pthread_mutex_unlock( &lock );
+    wakeUp();
+}
+
+
+/*! Forgets the session in slot \a i, closing its fds. The caller must
+    hold the lock.
+*/
+
+void TlsWorker::retire( uint i )
+{
+    TlsThreadData * d = sessions[i]->d;
+    if ( d->encfd >= 0 )
+        ::close( d->encfd );
+    if ( d->ctfd >= 0 )
+        ::close( d->ctfd );
+    d->encfd = -1;
+    d->ctfd = -1;
+    if ( d->ssl )
+        SSL_free( d->ssl );
+    d->ssl = 0;
+    sessions[i] = 0;
+    serials[i] = 0;
+    count--;
+}
+
+
+/*! Serves our sessions until the process exits. */
+
+void TlsWorker::run()
+{
+    struct pollfd * fds = 0;
+    uint * slots = 0;
+    uint * known = 0;
+    uint capacity = 0;
+    uint stepped = 0;
+
+    while ( true ) {
+        pthread_mutex_lock( &lock );
+        if ( capacity < 2 * size + 1 ) {
+            capacity = 2 * size + 1;
+            fds = (struct pollfd*)::realloc( fds,
+                                             capacity * sizeof( pollfd ) );
+            slots = (uint*)::realloc( slots, capacity * sizeof( uint ) );
+            known = (uint*)::realloc( known, capacity * sizeof( uint ) );
+            if ( !fds || !slots || !known )
+                die( Memory );
+        }
+        uint n = 0;
+        fds[n].fd = wake[0];
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        n++;
+        uint i = 0;
+        while ( i < size ) {
+            TlsThread * t = sessions[i];
+            if ( t && serials[i] > stepped ) {
+                // new since we last looked: give openssl a chance
+                // to say hello
+                t->step();
+                if ( t->d->finish )
+                    retire( i );
+            }
+            bool rct, wct, renc, wenc;
+            if ( sessions[i] && !t->wants( rct, wct, renc, wenc ) )
+                retire( i );
+            if ( sessions[i] ) {
+                TlsThreadData * d = t->d;
+                fds[n].fd = d->ctfd;
+                fds[n].events = ( rct ? POLLIN : 0 ) | ( wct ? POLLOUT : 0 );
+                fds[n].revents = 0;
+                slots[n] = i;
+                known[n] = serials[i];
+                n++;
+                fds[n].fd = d->encfd;
+                fds[n].events = ( renc ? POLLIN : 0 ) | ( wenc ? POLLOUT : 0 );
+                fds[n].revents = 0;
+                slots[n] = i;
+                known[n] = serials[i];
+                n++;
+            }
+            i++;
+        }
+        stepped = serial;
+        pthread_mutex_unlock( &lock );
+
+        // wait for a few seconds at most, just in case openssl is
+        // acting behind our back.
+        int r = ::poll( fds, n, 4000 );
+        if ( r < 0 && errno != EINTR )
+            r = 0;
+
+        if ( fds[0].revents & POLLIN ) {
+            char b[256];
+            while ( ::read( wake[0], b, 256 ) > 0 )
+                ;
+        }
+
+        pthread_mutex_lock( &lock );
+        i = 1;
+        while ( i < n ) {
+            uint s = slots[i];
+            // skip sessions that were removed (or replaced) while we
+            // weren't holding the lock
+            if ( s < size && sessions[s] && serials[s] == known[i] ) {
+                TlsThread * t = sessions[s];
+                TlsThreadData * d = t->d;
+                short ct = fds[i].revents;
+                short enc = fds[i+1].revents;
+                if ( r == 0 || ct || enc ) {
+                    short bad = POLLHUP | POLLERR | POLLNVAL;
+                    d->crct = ( ct & ( POLLIN | bad ) ) ? true : false;
+                    d->cwct = ( ct & POLLOUT ) ? true : false;
+                    d->crenc = ( enc & ( POLLIN | bad ) ) ? true : false;
+                    d->cwenc = ( enc & POLLOUT ) ? true : false;
+                    t->step();
+                    d->crct = d->cwct = d->crenc = d->cwenc = false;
+                    if ( d->finish )
+                        retire( s );
+                }
+            }
+            i += 2;
+        }
+        pthread_mutex_unlock( &lock );
+    }
+}
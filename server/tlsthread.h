@@ -14,6 +14,7 @@ public:
     ~TlsThread();
 
     static void setup();
+    static void graphHandshakes();
 
     void setServerFD( int );
     void setClientFD( int );
@@ -28,6 +29,11 @@ public:
 
 private:
     class TlsThreadData * d;
+    friend class TlsWorker;
+
+    void step();
+    bool wants( bool &, bool &, bool &, bool & );
+    void addToPool();
 };
 
 #endif
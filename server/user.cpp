@@ -6,9 +6,19 @@
 #include "configuration.h"
 #include "transaction.h"
 #include "address.h"
+#include "allocator.h"
 #include "mailbox.h"
+#include "cache.h"
 #include "query.h"
 #include "codec.h"
+#include "dict.h"
+
+// time
+#include <time.h>
+
+
+// how long a cached User record is used, in seconds
+static const uint userTtl = 60;
 class UserData
     : public Garbage
 {
@@ -46,6 +56,49 @@ public:
 };
 
 
+class UserCacheEntry
+    : public Garbage
+{
+public:
+    UserCacheEntry()
+        : Garbage(), id( 0 ), inboxId( 0 ), home( 0 ), address( 0 ),
+          quota( 0 ), expires( 0 )
+    {}
+
+    UString login;
+    UString secret;
+    UString ldapdn;
+    uint id;
+    uint inboxId;
+    Mailbox * home;
+    Address * address;
+    int64 quota;
+    uint expires;
+};
+
+
+class UserCache
+    : public Cache
+{
+public:
+    UserCache(): Cache( 2 ) {}
+
+    Dict<UserCacheEntry> entries;
+
+    void clear() { entries.clear(); }
+};
+
+
+static UserCache * cache = 0;
+
+
+// the key used for \a login in the cache
+static EString cacheKey( const UString & login )
+{
+    return login.titlecased().utf8();
+}
+
+
 /*! \class User user.h
 
     The User class models a single Archiveopteryx user, which may be
@@ -308,6 +361,7 @@ void User::refresh( EventHandler * user )
         d->q->bind( 2, d->address->domain() );
     }
     if ( d->q ) {
+        d->q->setShareable();
         d->q->execute();
         d->mode = UserData::Refreshing;
     }
@@ -317,6 +371,53 @@ void User::refresh( EventHandler * user )
 }
 
 
+/*! Returns a Refreshed User for \a login if one was refreshed from
+    the database during the past minute, and a null pointer if not.
+
+    This lets SaslMechanism avoid a query per login when many clients
+    reconnect at once. Changes made by other processes may take up to
+    a minute to be noticed; changes made via this process are noticed
+    at once.
+*/
+
+User * User::cached( const UString & login )
+{
+    if ( !::cache )
+        return 0;
+    EString k = cacheKey( login );
+    UserCacheEntry * e = ::cache->entries.find( k );
+    if ( !e )
+        return 0;
+    if ( e->expires <= (uint)::time( 0 ) ) {
+        ::cache->entries.remove( k );
+        return 0;
+    }
+
+    User * u = new User;
+    u->d->login = e->login;
+    u->d->secret = e->secret;
+    u->d->ldapdn = e->ldapdn;
+    u->d->id = e->id;
+    u->d->inboxId = e->inboxId;
+    u->d->home = e->home;
+    u->d->address = e->address;
+    u->d->quota = e->quota;
+    u->d->state = Refreshed;
+    return u;
+}
+
+
+/*! Forgets any cached record for \a login, so that the next cached()
+    call returns a null pointer.
+*/
+
+void User::forget( const UString & login )
+{
+    if ( ::cache )
+        ::cache->entries.remove( cacheKey( login ) );
+}
+
+
 /*! Parses the query results for refresh(). */
 
 void User::refreshHelper()
@@ -355,6 +456,22 @@ void User::refreshHelper()
         d->quota = r->getBigint( "quota" );
         d->state = Refreshed;
         d->q = 0;
+
+        if ( !::cache ) {
+            ::cache = new UserCache;
+            Allocator::addEternal( ::cache, "user cache" );
+        }
+        UserCacheEntry * e = new UserCacheEntry;
+        e->login = d->login;
+        e->secret = d->secret;
+        e->ldapdn = d->ldapdn;
+        e->id = d->id;
+        e->inboxId = d->inboxId;
+        e->home = d->home;
+        e->address = d->address;
+        e->quota = d->quota;
+        e->expires = (uint)::time( 0 ) + userTtl;
+        ::cache->entries.insert( cacheKey( d->login ), e );
     }
     if ( d->user )
         d->user->execute();
@@ -487,6 +604,7 @@ Query * User::remove( Transaction * t )
     Query * q = new Query( "delete from users where login=$1", 0 );
     q->bind( 1, d->login );
     t->enqueue( q );
+    forget( d->login );
     return q;
 }
 
@@ -528,6 +646,7 @@ void User::csHelper()
     if ( !d->q->done() )
         return;
 
+    forget( d->login );
     if ( d->q->failed() )
         d->result->setError( d->q->error() );
     else
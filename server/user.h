@@ -49,6 +49,8 @@ public:
     bool exists();
 
     void refresh( EventHandler * );
+    static User * cached( const UString & );
+    static void forget( const UString & );
     Query * create( EventHandler * );
     Query * remove( class Transaction * );
     Query * changeSecret( EventHandler * );
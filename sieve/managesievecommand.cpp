@@ -356,9 +356,8 @@ bool ManageSieveCommand::putScript()
             no( "Script cannot be empty" );
             return true;
         }
-        SieveScript script;
-        script.parse( d->script.crlf() );
-        EString e = script.parseErrors();
+        SieveScript * script = SieveScript::parsed( d->script );
+        EString e = script->parseErrors();
         if ( !e.isEmpty() ) {
             no( e );
             return true;
@@ -373,7 +372,7 @@ bool ManageSieveCommand::putScript()
         // mailboxes in the user's namespace, create those. if any
         // refer to mailboxes not owned by the user, deny the command.
         List<SieveCommand> stack;
-        stack.append( script.topLevelCommands() );
+        stack.append( script->topLevelCommands() );
         while ( !stack.isEmpty() ) {
             SieveCommand * c = stack.shift();
             if ( c->block() )
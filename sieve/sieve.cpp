@@ -5,6 +5,8 @@
 #include "md5.h"
 #include "utf.h"
 #include "date.h"
+#include "dict.h"
+#include "cache.h"
 #include "html.h"
 #include "user.h"
 #include "codec.h"
@@ -55,7 +57,9 @@ public:
             : d( data ), address( a ), mailbox( m ),
               done( false ), ok( true ),
               implicitKeep( true ), explicitKeep( false ),
-              sq( 0 ), script( new SieveScript ), user( 0 ), handler( 0 )
+              sq( 0 ), script( new SieveScript ), user( 0 ), handler( 0 ),
+              pendingMailbox( 0 ), pendingOwner( 0 ),
+              hasQuota( false ), quota( 0 ), messages( 0 ), size( 0 )
         {
             d->recipients.append( this );
         }
@@ -77,12 +81,31 @@ public:
         User * user;
         EventHandler * handler;
         UStringList flags;
+        // in a lazy mailbox tree: the mailbox we wait for, and its owner
+        uint pendingMailbox;
+        uint pendingOwner;
+        // the mailbox owner's quota and quota_usage
+        bool hasQuota;
+        int64 quota;
+        int64 messages;
+        int64 size;
 
         bool evaluate( SieveCommand * );
         enum Result { True, False, Undecidable };
         Result evaluate( SieveTest * );
+        Result compute( SieveTest * );
     };
 
+    class TestResult
+        : public Garbage
+    {
+    public:
+        TestResult( bool r ): result( r ) {}
+        bool result;
+    };
+    Dict<TestResult> testResults;
+    Dict<UStringList> bodyTexts;
+
     Address * sender;
     List<Recipient> recipients;
     Recipient * currentRecipient;
@@ -128,6 +151,100 @@ SieveData::Recipient * SieveData::recipient( Address * a )
 }
 
 
+/* Returns the parsed form of \a source, \a user's active script, and
+   logs its parse errors, if any. SieveScript::parsed() does the work,
+   so identical scripts are parsed only once.
+*/
+
+static SieveScript * parsedScript( User * user, const EString & source )
+{
+    SieveScript * script = SieveScript::parsed( source );
+
+    EString errors = script->parseErrors();
+    if ( !errors.isEmpty() ) {
+        log( "Note: Sieve script for " + user->login().utf8() +
+             "had parse errors.", Log::Error );
+        EStringList::Iterator i( EStringList::split( '\n', errors ) );
+        while ( i ) {
+            log( "Sieve: " + *i, Log::Error );
+            ++i;
+        }
+    }
+    return script;
+}
+
+
+class AutoresponseCache
+    : public Cache
+{
+public:
+    AutoresponseCache(): Cache( 10 ) {}
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): Garbage(), expires( 0 ) {}
+        uint expires;
+    };
+
+    Dict<Entry> entries;
+
+    void clear() { entries.clear(); }
+};
+
+
+static AutoresponseCache * autoresponseCache = 0;
+
+
+/* Returns the key under which the autoresponse cache knows about \a
+   a, which is the handle together with the sender and recipient.
+*/
+
+static EString autoresponseKey( SieveAction * a )
+{
+    EString k = a->handle().utf8();
+    k.append( '\n' );
+    k.append( a->senderAddress()->lpdomain().lower() );
+    k.append( '\n' );
+    k.append( a->recipientAddress()->lpdomain().lower() );
+    return k;
+}
+
+
+/* Records that an autoresponse like \a a has been sent, and that
+   similar ones should be suppressed until \a expires (a unix time).
+*/
+
+static void rememberAutoresponse( SieveAction * a, uint expires )
+{
+    if ( !::autoresponseCache )
+        ::autoresponseCache = new AutoresponseCache;
+    EString k = autoresponseKey( a );
+    AutoresponseCache::Entry * e = ::autoresponseCache->entries.find( k );
+    if ( !e ) {
+        e = new AutoresponseCache::Entry;
+        ::autoresponseCache->entries.insert( k, e );
+    }
+    if ( expires > e->expires )
+        e->expires = expires;
+}
+
+
+/* Returns true if the cache knows that an autoresponse like \a a has
+   been sent and has not yet expired at \a now.
+*/
+
+static bool autoresponseSent( SieveAction * a, uint now )
+{
+    if ( !::autoresponseCache )
+        return false;
+    AutoresponseCache::Entry * e
+        = ::autoresponseCache->entries.find( autoresponseKey( a ) );
+    return e && e->expires > now;
+}
+
+
 /*! \class Sieve sieve.h
 
     The Sieve class interprets the Sieve language, which processes
@@ -174,8 +291,21 @@ void Sieve::execute()
                 for ( in = i ;
                       (r = i->sq->nextRow()) ;
                       in = new SieveData::Recipient( i->address, 0, d) ) {
-                    if ( !r->isNull( "mailbox" ) )
-                        in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
+                    if ( !r->isNull( "mailbox" ) ) {
+                        uint m = r->getInt( "mailbox" );
+                        in->mailbox = Mailbox::find( m );
+                        if ( !in->mailbox && !r->isNull( "owner" ) &&
+                             !Mailbox::load( r->getInt( "owner" ), this ) ) {
+                            in->pendingMailbox = m;
+                            in->pendingOwner = r->getInt( "owner" );
+                        }
+                    }
+                    if ( !r->isNull( "quota" ) ) {
+                        in->hasQuota = true;
+                        in->quota = r->getBigint( "quota" );
+                        in->messages = r->getBigint( "quotamessages" );
+                        in->size = r->getBigint( "quotasize" );
+                    }
                     if ( !r->isNull( "script" ) ) {
                         in->prefix = r->getUString( "namespace" ) + "/" +
                                     r->getUString( "login" ) + "/";
@@ -186,21 +316,8 @@ void Sieve::execute()
                                                  r->getUString( "name" ),
                                                  r->getEString( "localpart" ),
                                                  r->getEString( "domain" ) ) );
-                        in->script->parse( r->getEString( "script" ).crlf() );
-                        EString errors = in->script->parseErrors();
-                        if ( !errors.isEmpty() ) {
-                            log( "Note: Sieve script for " +
-                                 in->user->login().utf8() +
-                                 "had parse errors.", Log::Error );
-                            EString prefix = "Sieve script for " +
-                                            in->user->login().utf8();
-                            EStringList::Iterator i(
-                                EStringList::split( '\n', errors ) );
-                            while ( i ) {
-                                log( "Sieve: " + *i, Log::Error );
-                                ++i;
-                            }
-                        }
+                        in->script = parsedScript( in->user,
+                                                   r->getEString( "script" ) );
                         List<SieveCommand>::Iterator
                             c(in->script->topLevelCommands());
                         while ( c ) {
@@ -213,6 +330,11 @@ void Sieve::execute()
             }
             if ( i->sq && i->sq->done() )
                 i->sq = 0;
+            if ( i->pendingMailbox &&
+                 Mailbox::load( i->pendingOwner, this ) ) {
+                i->mailbox = Mailbox::find( i->pendingMailbox );
+                i->pendingMailbox = 0;
+            }
             ++i;
         }
         if ( ready() && !wasReady ) {
@@ -235,25 +357,47 @@ void Sieve::execute()
         if ( !d->injector ) {
             d->injector = new Injector( this );
             d->injector->setLog( new Log ); // XXX why here?
+            d->injector->setPriority( Query::Delivery );
         }
 
         if ( !d->autoresponses ) {
             d->vacations = vacations();
+
+            // anything we've sent recently is suppressed without
+            // asking the database.
+            Date now;
+            now.setCurrentTime();
+            List<SieveAction>::Iterator i( d->vacations );
+            while ( i ) {
+                if ( autoresponseSent( i, now.unixTime() ) ) {
+                    log( "Suppressing vacation response to " +
+                         i->recipientAddress()->toString( false ) );
+                    d->vacations->take( i );
+                }
+                else {
+                    ++i;
+                }
+            }
+
             if ( d->vacations->isEmpty() ) {
                 d->state = 2;
             }
             else {
                 d->transaction = new Transaction( this );
+                d->transaction->setPriority( Query::Delivery );
                 d->injector->setTransaction( d->transaction );
 //              d->transaction->enqueue(
 //                  new Query( "lock autoresponses in exclusive mode",
 //                             this ) );
                 d->autoresponses = new Query( "", this );
-                EString s = "select handle from autoresponses "
+                EString s = "select handle, "
+                           "extract(epoch from expires_at)::integer "
+                           "as expires "
+                           "from autoresponses "
                            "where expires_at > current_timestamp "
                            "and ( false ";
                 int n = 1;
-                List<SieveAction>::Iterator i( d->vacations );
+                i = d->vacations->first();
                 while ( i ) {
                     s.append( " or " );
                     s.append( "(handle=$" );
@@ -301,6 +445,7 @@ void Sieve::execute()
                 if ( i ) {
                     log( "Suppressing vacation response to " +
                          i->recipientAddress()->toString( false ) );
+                    rememberAutoresponse( i, r->getInt( "expires" ) );
                     d->vacations->take( i );
                 }
             }
@@ -371,26 +516,45 @@ void Sieve::execute()
 
     // 4: record what autoresponses were sent
     if ( d->state == 4 ) {
+        // one insert covers all the responses sent
+        Query * q = 0;
+        EString s = "insert into autoresponses "
+                    "(sent_from, sent_to, expires_at, handle) values ";
+        uint n = 1;
         List<SieveAction>::Iterator i( d->vacations );
         while ( i ) {
-            Query * q
-                = new Query(
-                    "insert into autoresponses "
-                    "(sent_from, sent_to, expires_at, handle) "
-                    "values ($1, $2, $3, $4)", this );
-            q->bind( 1, d->injector->addressId( i->senderAddress() ) );
-            q->bind( 2, d->injector->addressId( i->recipientAddress() ) );
+            if ( !q )
+                q = new Query( "", this );
+            else
+                s.append( ", " );
+            s.append( "($" );
+            s.appendNumber( n );
+            s.append( ", $" );
+            s.appendNumber( n+1 );
+            s.append( ", $" );
+            s.appendNumber( n+2 );
+            s.append( ", $" );
+            s.appendNumber( n+3 );
+            s.append( ")" );
+            q->bind( n, d->injector->addressId( i->senderAddress() ) );
+            q->bind( n+1, d->injector->addressId( i->recipientAddress() ) );
             Date e;
             e.setCurrentTime();
             if( i->expiry() )
                 e.setUnixTime( e.unixTime() + 86400 * i->expiry() );
             else
                 e.setUnixTime( e.unixTime() + 180 );
-            q->bind( 3, e.isoDateTime() );
-            q->bind( 4, i->handle() );
-            d->transaction->enqueue( q );
+            q->bind( n+2, e.isoDateTime() );
+            q->bind( n+3, i->handle() );
+            if ( !d->injector->failed() )
+                rememberAutoresponse( i, e.unixTime() );
+            n += 4;
             ++i;
         }
+        if ( q ) {
+            q->setString( s );
+            d->transaction->enqueue( q );
+        }
 
         if ( d->transaction )
             d->transaction->commit();
@@ -469,6 +633,9 @@ void Sieve::addRecipient( Address * address, Mailbox * destination,
     script and other needed information so that delivery to \a address
     can be evaluated. Calls \a user when the information is available.
 
+    The same query also retrieves the quota and quota usage of the
+    mailbox's owner, for overQuota().
+
     If \a address is not a registered alias, Sieve will refuse mail to
     it.
 */
@@ -485,7 +652,9 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
 
     r->sq = new Query( "select al.mailbox, s.script, m.owner, "
                        "n.name as namespace, u.id as userid, u.login, "
-                       "a.name, a.localpart::text, a.domain::text "
+                       "a.name, a.localpart::text, a.domain::text, "
+                       "o.quota, qu.messages as quotamessages, "
+                       "qu.rfc822size as quotasize "
                        "from aliases al "
                        "join addresses a on (al.address=a.id) "
                        "join mailboxes m on (al.mailbox=m.id) "
@@ -493,6 +662,8 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
                        " (s.owner=m.owner and s.active='t') "
                        "left join users u on (s.owner=u.id) "
                        "left join namespaces n on (u.parentspace=n.id) "
+                       "left join users o on (m.owner=o.id) "
+                       "left join quota_usage qu on (m.owner=qu.owner) "
                        "where m.deleted='f' and "
                        "a.localpart=$1 and a.domain=$2", this );
     UString localpart( address->localpart() );
@@ -1184,7 +1355,69 @@ static void addAddress( UStringList * l, Address * a,
 }
 
 
+/* Returns a key for the body parts a body test \a t looks at, so
+   that body tests with different keys but the same :text, :raw or
+   :content argument share the extracted text.
+*/
+
+static EString bodyTextsKey( SieveTest * t )
+{
+    EString k = fn( (uint)t->bodyMatchType() );
+    UStringList::Iterator i( t->contentTypes() );
+    while ( i ) {
+        k.append( " " );
+        k.append( i->utf8() );
+        ++i;
+    }
+    return k;
+}
+
+
+/* Returns the text of \a t if its result depends only on the message,
+   so that recipients whose scripts contain the same test can share
+   its result, and an empty string if not.
+*/
+
+static EString sharedTestKey( SieveTest * t )
+{
+    EString i = t->identifier();
+    if ( i != "address" && i != "header" && i != "exists" &&
+         i != "body" && i != "size" && i != "date" )
+        return "";
+    SieveProduction * p = t;
+    while ( p->parent() )
+        p = p->parent();
+    if ( p->name() != "sieve script" || t->end() <= t->start() )
+        return "";
+    return ((SieveScript *)p)->source().mid( t->start(),
+                                             t->end() - t->start() );
+}
+
+
+/*! Evaluates \a t for this recipient. Tests that look only at the
+    message are evaluated once for all recipients of the message and
+    the result is reused, since several users often filter on the
+    same header fields.
+*/
+
 SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
+{
+    EString key = sharedTestKey( t );
+    if ( !key.isEmpty() ) {
+        TestResult * known = d->testResults.find( key );
+        if ( known )
+            return known->result ? True : False;
+    }
+    Result r = compute( t );
+    if ( !key.isEmpty() && r != Undecidable )
+        d->testResults.insert( key, new TestResult( r == True ) );
+    return r;
+}
+
+
+/*! Does the work of evaluate() for \a t. */
+
+SieveData::Recipient::Result SieveData::Recipient::compute( SieveTest * t )
 {
     UStringList * haystack = 0;
     if ( t->identifier() == "address" ) {
@@ -1417,6 +1650,10 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
             AsciiCodec a;
             haystack->append( a.toUnicode( d->message->body( false ) ) );
         }
+        else if ( d->bodyTexts.contains( bodyTextsKey( t ) ) ) {
+            haystack = new UStringList;
+            haystack->append( *d->bodyTexts.find( bodyTextsKey( t ) ) );
+        }
         else {
             haystack = new UStringList;
             List<Bodypart>::Iterator i( d->message->allBodyparts() );
@@ -1489,6 +1726,9 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
                 }
                 ++i;
             }
+            UStringList * texts = new UStringList;
+            texts->append( *haystack );
+            d->bodyTexts.insert( bodyTextsKey( t ), texts );
         }
     }
     else if ( t->identifier() == "ihave" ) {
@@ -1544,21 +1784,31 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         haystack->append( hn );
     }
 
+    // everything except :matches compares collation keys, which are
+    // made once per string rather than once per comparison.
+    EStringList * keys = 0;
+    if ( t->matchType() != SieveTest::Matches )
+        keys = t->collationKeys( c );
+
     UStringList::Iterator h( haystack );
     while ( h ) {
         UString s( *h );
+        EString sk;
+        if ( keys )
+            sk = c->key( s );
 
         UStringList::Iterator k( t->keys() );
+        EStringList::Iterator gk( keys );
         while ( k ) {
             UString g( *k );
 
             switch ( t->matchType() ) {
             case SieveTest::Is:
-                if ( c->equals( s, g ) )
+                if ( sk == *gk )
                     return True;
                 break;
             case SieveTest::Contains:
-                if ( c->contains( s, g ) )
+                if ( c->containsKey( sk, *gk ) )
                     return True;
                 break;
             case SieveTest::Matches:
@@ -1567,7 +1817,7 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
                 break;
             case SieveTest::Count:
             case SieveTest::Value:
-                int n = c->compare( s, g );
+                int n = sk.compare( *gk );
                 switch ( t->matchOperator() ) {
                 case SieveTest::GT:
                     if ( n > 0 )
@@ -1599,6 +1849,8 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
                 break;
             }
             ++k;
+            if ( gk )
+                ++gk;
         }
         ++h;
     }
@@ -1641,6 +1893,52 @@ bool Sieve::local( Address * address ) const
 }
 
 
+/*! Returns true if storing another message of \a size bytes for \a
+    address would exceed the User::quota() of the owner of its
+    mailbox, and false if not, or if that isn't known yet.
+
+    The quota applies both to the number of messages and to their
+    total size in kilobytes, as in GETQUOTA.
+*/
+
+bool Sieve::overQuota( Address * address, uint size ) const
+{
+    if ( !ready() )
+        return false;
+    SieveData::Recipient * i = d->recipient( address );
+    if ( !i || !i->hasQuota )
+        return false;
+    if ( i->messages + 1 > i->quota ||
+         ( i->size + size ) / 1024 > i->quota )
+        return true;
+    return false;
+}
+
+
+/*! Records that \a address won't receive this message after all, so
+    that Sieve neither evaluates its script nor delivers to it.
+    SmtpRcptTo uses this for recipients who are overQuota().
+*/
+
+void Sieve::refuse( Address * address )
+{
+    SieveData::Recipient * r = d->recipient( address );
+    if ( !r )
+        return;
+    List<SieveData::Recipient>::Iterator i( d->recipients );
+    while ( i ) {
+        if ( i->address == r->address ) {
+            i->done = true;
+            i->ok = false;
+            i->implicitKeep = false;
+            i->pending.clear();
+            i->actions.clear();
+        }
+        ++i;
+    }
+}
+
+
 /*! Returns true if delivery to \a address failed or will fail, and
     false if it succeeded or if evaluation is not yet complete.
 */
@@ -1866,7 +2164,7 @@ bool Sieve::rejected() const
 bool Sieve::ready() const
 {
     List<SieveData::Recipient>::Iterator i( d->recipients );
-    while ( i && !i->sq )
+    while ( i && !i->sq && !i->pendingMailbox )
         ++i;
     if ( i )
         return false;
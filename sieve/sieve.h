@@ -36,6 +36,8 @@ public:
     Address * recipient() const;
 
     bool local( Address * ) const;
+    bool overQuota( Address *, uint ) const;
+    void refuse( Address * );
 
     void evaluate();
     bool rejected( Address * ) const;
@@ -1008,7 +1008,7 @@ public:
           comparator( 0 ),
           bodyMatchType( SieveTest::Text ),
           headers( 0 ), envelopeParts( 0 ), keys( 0 ),
-          contentTypes( 0 ),
+          collationKeys( 0 ), contentTypes( 0 ),
           sizeOver( false ), sizeLimit( 0 )
     {}
 
@@ -1025,6 +1025,7 @@ public:
     UStringList * headers;
     UStringList * envelopeParts;
     UStringList * keys;
+    EStringList * collationKeys;
     UStringList * contentTypes;
     UString datePart;
     UString zone;
@@ -1781,6 +1782,29 @@ UStringList * SieveTest::keys() const
 }
 
 
+/*! Returns the Collation::key() of each of keys(), in the same order,
+    made by \a c. The list is made when this function is first called
+    and reused afterwards, so \a c must always be the same collation,
+    and the keys of a script cost nothing after the first message.
+
+    Returns a null pointer if keys() does.
+*/
+
+EStringList * SieveTest::collationKeys( Collation * c ) const
+{
+    if ( d->collationKeys || !d->keys )
+        return d->collationKeys;
+
+    d->collationKeys = new EStringList;
+    UStringList::Iterator k( d->keys );
+    while ( k ) {
+        d->collationKeys->append( c->key( *k ) );
+        ++k;
+    }
+    return d->collationKeys;
+}
+
+
 /*! Returns a list of the envelope parts the test "envelope" should
     look at, or a null pointer if identifier() is not "envelope".
 */
@@ -178,6 +178,7 @@ public:
 
     UStringList * headers() const;
     UStringList * keys() const;
+    class EStringList * collationKeys( class Collation * ) const;
     UStringList * envelopeParts() const;
     UStringList * contentTypes() const;
     UString datePart() const;
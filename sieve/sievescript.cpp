@@ -6,7 +6,9 @@
 #include "sieveparser.h"
 #include "ustringlist.h"
 #include "estringlist.h"
-
+#include "cache.h"
+#include "dict.h"
+#include "md5.h"
 
 
 class SieveScriptData
@@ -210,3 +212,50 @@ List<SieveCommand> * SieveScript::topLevelCommands() const
 {
     return d->script;
 }
+
+
+class SieveScriptCache
+    : public Cache
+{
+public:
+    SieveScriptCache(): Cache( 10 ) {}
+
+    Dict<SieveScript> scripts;
+
+    void clear() { scripts.clear(); }
+};
+
+
+static SieveScriptCache * scriptCache = 0;
+
+
+/*! Returns a parsed SieveScript for \a source, parsing it only if the
+    same text hasn't been parsed recently. The returned script may be
+    shared with other callers and must not be changed; parsing never
+    changes a script afterwards, and evaluation only notes which
+    arguments it has looked at.
+
+    Scripts are cached by the MD5 hash of their text rather than by
+    owner, so when many users have the same script (e.g. made from a
+    template), it's parsed only once, and a script ManageSieve checks
+    on upload is ready when the next message is delivered. An edited
+    script has a different hash and is parsed anew, and the cache is
+    emptied now and then at garbage collection.
+*/
+
+SieveScript * SieveScript::parsed( const EString & source )
+{
+    if ( !::scriptCache )
+        ::scriptCache = new SieveScriptCache;
+
+    EString text = source.crlf();
+    EString key = MD5::hash( text ).hex();
+    SieveScript * script = ::scriptCache->scripts.find( key );
+    if ( script )
+        return script;
+
+    script = new SieveScript;
+    script->parse( text );
+    ::scriptCache->scripts.insert( key, script );
+    return script;
+}
@@ -20,6 +20,8 @@ public:
 
     bool isEmpty() const;
 
+    static SieveScript * parsed( const EString & );
+
     List<SieveCommand> * topLevelCommands() const;
 
 private:
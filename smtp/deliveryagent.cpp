@@ -28,7 +28,7 @@ public:
         : messageId( 0 ), t( 0 ),
           qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), expired( false ),
           dsn( 0 ), injector( 0 ), update( 0 ), client( 0 ),
-          updatedDelivery( false )
+          updatedDelivery( false ), owner( 0 )
     {}
 
     uint messageId;
@@ -44,6 +44,7 @@ public:
     Query * update;
     SmtpClient * client;
     bool updatedDelivery;
+    EventHandler * owner;
 };
 
 
@@ -53,12 +54,14 @@ public:
 */
 
 /*! Creates a new DeliveryAgent object to deliver the message with the
-    given \a id.
+    given \a id. If \a owner is non-null, it is notified once the
+    agent has finished working.
 */
 
-DeliveryAgent::DeliveryAgent( uint id )
+DeliveryAgent::DeliveryAgent( uint id, EventHandler * owner )
     : d( new DeliveryAgentData )
 {
+    d->owner = owner;
     setLog( new Log );
     Scope x( log() );
     log( "Attempting delivery for message " + fn( id ) );
@@ -80,11 +83,14 @@ void DeliveryAgent::execute()
 {
     // Fetch and lock the row in deliveries matching (mailbox,uid).
 
-    if ( !d->messageId )
+    if ( !d->messageId ) {
+        finish();
         return;
+    }
 
     if ( !d->t ) {
         d->t = new Transaction( this );
+        d->t->setPriority( Query::Delivery );
         d->qm = new Query(
             "select id, sender, current_timestamp > expires_at as expired "
             "from deliveries where message=$1 for update",
@@ -212,6 +218,7 @@ void DeliveryAgent::execute()
     }
 
     d->messageId = 0;
+    finish();
 }
 
 
@@ -221,12 +228,31 @@ void DeliveryAgent::execute()
 
 bool DeliveryAgent::working() const
 {
+    if ( d->messageId )
+        return true;
     if ( d->t && !d->t->done() )
         return true;
     return false;
 }
 
 
+/*! Notifies the owner of this DeliveryAgent, if there is one, that
+    the agent has finished. Does nothing while the transaction is still
+    working (e.g. rolling back), since execute() is called again when it
+    finishes.
+*/
+
+void DeliveryAgent::finish()
+{
+    if ( !d->owner || working() )
+        return;
+
+    EventHandler * owner = d->owner;
+    d->owner = 0;
+    owner->notify();
+}
+
+
 /*! Begins to fetch a message with the given \a messageId, and returns a
     pointer to the newly-created Message object, which will be filled in
     by the message fetcher.
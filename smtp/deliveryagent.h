@@ -18,7 +18,7 @@ class DeliveryAgent
     : public EventHandler
 {
 public:
-    DeliveryAgent( uint );
+    DeliveryAgent( uint, EventHandler * = 0 );
 
     uint messageId() const;
 
@@ -35,6 +35,7 @@ private:
     void logDelivery( DSN * );
     Injector * injectBounce( DSN * );
     void updateDelivery();
+    void finish();
 };
 
 
@@ -29,7 +29,7 @@ public:
         inputState( SMTP::Command ),
         dialect( SMTP::Smtp ),
         sieve( 0 ), user( 0 ), permittedAddresses( 0 ),
-        recipients( new List<SmtpRcptTo> ), now( 0 ) {}
+        recipients( new List<SmtpRcptTo> ), expectedSize( 0 ), now( 0 ) {}
 
     bool executing;
     bool executeAgain;
@@ -42,6 +42,7 @@ public:
     List<Address> * permittedAddresses;
     List<SmtpRcptTo> * recipients;
     EString body;
+    uint expectedSize;
     Date * now;
     EString id;
 
@@ -276,6 +277,7 @@ void SMTP::reset()
     d->sieve = 0;
     d->recipients = new List<SmtpRcptTo>;
     d->body.truncate();
+    d->expectedSize = 0;
     d->id.truncate();
     d->now = 0;
 }
@@ -410,6 +412,41 @@ void SMTP::setBody( const EString & b )
 }
 
 
+/*! Appends \a b to the body, changing the stored string in place
+    rather than copying what's there already. The first append
+    reserves expectedSize() bytes, so a large message sent in many
+    BDAT chunks is neither copied once per chunk nor much larger in
+    memory than it is on the wire.
+*/
+
+void SMTP::appendBody( const EString & b )
+{
+    if ( d->body.isEmpty() && d->expectedSize > b.length() )
+        d->body.reserve( d->expectedSize );
+    d->body.append( b );
+}
+
+
+/*! Records that the client announced a message of \a size bytes
+    (using the SIZE parameter to MAIL FROM). reset() clears this.
+*/
+
+void SMTP::setExpectedSize( uint size )
+{
+    d->expectedSize = size;
+}
+
+
+/*! Returns what setExpectedSize() recorded, or 0 if the client didn't
+    say how large its message is.
+*/
+
+uint SMTP::expectedSize() const
+{
+    return d->expectedSize;
+}
+
+
 /*! Returns what setBody() set. Used for SmtpBdat instances to
     coordinate the body.
 */
@@ -49,7 +49,10 @@ public:
     List<class SmtpRcptTo> * rcptTo() const;
 
     void setBody( const EString & );
+    void appendBody( const EString & );
     EString body() const;
+    void setExpectedSize( uint );
+    uint expectedSize() const;
 
     bool isFirstCommand( SmtpCommand * ) const;
 
@@ -8,11 +8,15 @@
 #include "smtpauth.h"
 
 #include "smtpparser.h"
+#include "configuration.h"
 #include "estringlist.h"
 #include "eventloop.h"
+#include "graph.h"
 #include "scope.h"
 #include "smtp.h"
 
+#include <sys/time.h> // gettimeofday, struct timeval
+
 
 class SmtpCommandData
     : public Garbage
@@ -20,13 +24,18 @@ class SmtpCommandData
 public:
     SmtpCommandData()
         : responseCode( 200 ), enhancedCode( 0 ),
-          done( false ), smtp( 0 ) {}
+          done( false ), smtp( 0 ), name( "unknown" )
+    {
+        (void)::gettimeofday( &received, 0 );
+    }
 
     uint responseCode;
     const char * enhancedCode;
     EStringList response;
     bool done;
     SMTP * smtp;
+    EString name;
+    struct timeval received;
 };
 
 
@@ -56,6 +65,20 @@ SmtpCommand::SmtpCommand( class SMTP * s )
 
 void SmtpCommand::finish()
 {
+    if ( !d->done ) {
+        struct timeval end;
+        (void)::gettimeofday( &end, 0 );
+        uint total = ( ( end.tv_sec - d->received.tv_sec ) * 1000000 +
+                       ( end.tv_usec - d->received.tv_usec ) + 499 ) / 1000;
+        EString n( d->name );
+        n.replace( " ", "-" );
+        GraphableDataSet::named( "smtp-" + n + "-ms" )->addNumber( total );
+        uint slow = Configuration::scalar( Configuration::SlowCommandTime );
+        if ( slow && total >= slow )
+            log( "Slow command: " + d->name + " took " + fn( total ) + "ms",
+                 Log::Significant );
+    }
+
     d->done = true;
     d->smtp->execute();
 }
@@ -216,7 +239,10 @@ SmtpCommand * SmtpCommand::create( SMTP * server, const EString & command )
     else {
         r = new SmtpCommand( server );
         r->respond( 500, "Unknown command (" + c.upper() + ")", "5.5.1" );
+        c = "unknown";
     }
+    r->d->name = c;
+    r->log()->setLabel( "SMTP " + c );
 
     Scope x( r->log() );
     r->log( "Command: " + command.simplified(), Log::Debug );
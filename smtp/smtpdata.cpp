@@ -121,6 +121,8 @@ void SmtpData::execute()
         r.append( ")\r\n" );
         server()->enqueue( r );
         server()->setInputState( SMTP::Data );
+        if ( server()->expectedSize() )
+            d->body.reserve( server()->expectedSize() );
         d->state = 1;
     }
 
@@ -469,7 +471,15 @@ Injectee * SmtpData::message( const EString & body )
              server()->sieve()->sender()->toString( false ) +
              "\r\n";
 
-    d->body = rp + received + body;
+    // we build the stored copy in one allocation, and drop the
+    // server's copy of the body as soon as we no longer need it.
+    EString text;
+    text.reserve( rp.length() + received.length() + body.length() );
+    text.append( rp );
+    text.append( received );
+    text.append( body );
+    d->body = text;
+    server()->setBody( "" );
     Injectee * m = new Injectee;
     m->parse( d->body );
     // if the sender is another dickhead specifying <> in From to
@@ -599,9 +609,8 @@ void SmtpBdat::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b = server()->body();
-    b.append( d->chunk );
-    server()->setBody( b );
+    server()->appendBody( d->chunk );
+    d->chunk.truncate();
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -687,9 +696,10 @@ void SmtpBurl::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b( server()->body() );
-    b.append( d->url->text() );
-    server()->setBody( b );
+    // the body now shares or has copied the text, and the URL's copy
+    // would only use memory while the message is injected
+    server()->appendBody( d->url->text() );
+    d->url->setText( "" );
     if ( d->last ) {
         SmtpData::execute();
     }
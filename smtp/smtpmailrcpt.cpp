@@ -140,6 +140,8 @@ void SmtpMailFrom::addParam( const EString & name, const EString & value )
         if ( SmtpClient::observedSize() && n > SmtpClient::observedSize() )
             respond( 501, "Cannot deliver mail larger than " +
                      EString::humanNumber( SmtpClient::observedSize() ) );
+        else if ( ok )
+            server()->setExpectedSize( n );
     }
     else if ( name == "auth" ) {
         // RFC 2554 page 4
@@ -286,7 +288,14 @@ void SmtpRcptTo::execute()
     if ( !server()->sieve()->ready() )
         return;
 
-    if ( server()->sieve()->local( d->address ) ) {
+    if ( server()->sieve()->local( d->address ) &&
+         server()->sieve()->overQuota( d->address,
+                                       server()->expectedSize() ) ) {
+        server()->sieve()->refuse( d->address );
+        respond( 452, d->address->lpdomain().lower() + " is over quota",
+                 "4.2.2" );
+    }
+    else if ( server()->sieve()->local( d->address ) ) {
         server()->sieve()->evaluate();
         if ( !server()->sieve()->rejected( d->address ) )
             respond( 250, "Will send to " + d->address->lpdomain().lower(),
@@ -14,9 +14,13 @@
 #include "smtpclient.h"
 #include "allocator.h"
 #include "scope.h"
+#include "dict.h"
+#include "estringlist.h"
 
-#define SPOOLINTERVAL    900
-#define SSPOOLINTERVAL  "900"  /* Keep this in sync with SPOOLINTERVAL */
+// the retry interval starts at MINRETRY seconds and grows by half the
+// message's age in the queue, up to MAXRETRY seconds.
+#define MINRETRY   "60"
+#define MAXRETRY "3600"
 
 
 static SpoolManager * sm;
@@ -34,6 +38,7 @@ public:
     Query * q;
     Timer * t;
     List<DeliveryAgent> agents;
+    List<uint> queue;
     bool again;
 };
 
@@ -43,6 +48,12 @@ public:
     This class periodically attempts to deliver mail from the
     deliveries table to a smarthost using DeliveryAgent.
 
+    Messages that are due are queued, taking one message for each
+    destination domain in turn, and up to delivery-concurrency agents
+    work on the queue at once. A message that cannot be delivered is
+    retried with exponential backoff: the interval starts at a minute
+    and grows with the message's age in the queue, up to an hour.
+
     Each archiveopteryx process has only one instance of this class,
     which is created by SpoolManager::setup().
 */
@@ -54,13 +65,14 @@ SpoolManager::SpoolManager()
 
     Query * q = new Query( "update deliveries "
                            "set expires_at=current_timestamp+interval '"
-                           SSPOOLINTERVAL " s' "
+                           MAXRETRY " s' "
                            "where expires_at<current_timestamp+interval '"
-                           SSPOOLINTERVAL " s' "
+                           MAXRETRY " s' "
                            "and id in "
                            "(select delivery from delivery_recipients"
                            " where action=$1 or action=$2)",
                            0 );
+    q->setPriority( Query::Background );
     q->bind( 1, Recipient::Unknown );
     q->bind( 2, Recipient::Delayed );
     q->execute();
@@ -69,43 +81,60 @@ SpoolManager::SpoolManager()
 
 void SpoolManager::execute()
 {
-    // Fetch a list of spooled messages, and the next time we can try
-    // to deliver each of them.
+    if ( ::shutdown )
+        return;
 
-    uint delay = UINT_MAX;
+    // Forget the agents that have finished, and start new ones for
+    // the messages that are waiting their turn.
+
+    List<DeliveryAgent>::Iterator a( d->agents );
+    while ( a ) {
+        if ( a->working() )
+            ++a;
+        else
+            d->agents.take( a );
+    }
+    startAgents();
+
+    // Fetch a list of spooled messages, and the next time we can try
+    // to deliver each of them. We do that only when the queue is
+    // empty, and not while waiting for a timer.
 
     if ( !d->q ) {
+        if ( !d->queue.isEmpty() || ( d->t && d->t->active() ) )
+            return;
+
         IntegerSet have;
-        List<DeliveryAgent>::Iterator a( d->agents );
-        while ( a ) {
-            if ( a->working() ) {
-                have.add( a->messageId() );
-                delay = SPOOLINTERVAL;
-                ++a;
-            }
-            else {
-                d->agents.take( a );
-            }
+        List<DeliveryAgent>::Iterator w( d->agents );
+        while ( w ) {
+            have.add( w->messageId() );
+            ++w;
         }
 
         log( "Starting queue run" );
         d->again = false;
         reset();
         EString s( "select d.message, "
+                   "min(lower(a.domain::text)) as domain, "
                    "extract(epoch from"
-                   " min(coalesce(dr.last_attempt+interval '"
-                   SSPOOLINTERVAL " s',"
+                   " min(coalesce(dr.last_attempt+"
+                   "least(greatest((dr.last_attempt-"
+                   "coalesce(d.injected_at,dr.last_attempt))/2,"
+                   " interval '" MINRETRY " s'),"
+                   " interval '" MAXRETRY " s'),"
                    " d.deliver_after,"
                    " current_timestamp)))::bigint"
                    "-extract(epoch from current_timestamp)::bigint as delay "
                    "from deliveries d "
                    "join delivery_recipients dr on (d.id=dr.delivery) "
+                   "join addresses a on (dr.recipient=a.id) "
                    "where (dr.action=$1 or dr.action=$2) " );
         if ( !have.isEmpty() )
             s.append( "and not d.message=any($3) " );
         s.append( "group by d.message "
                   "order by delay" );
         d->q = new Query( s, this );
+        d->q->setPriority( Query::Background );
         d->q->bind( 1, Recipient::Unknown );
         d->q->bind( 2, Recipient::Delayed );
         if ( !have.isEmpty() )
@@ -113,42 +142,92 @@ void SpoolManager::execute()
         d->q->execute();
     }
 
-    if ( d->q && !d->q->done() )
+    if ( !d->q->done() )
         return;
 
     // Is there anything we might do?
 
-    if ( d->q && !d->q->rows() ) {
+    if ( !d->q->rows() ) {
         // No. Just finish.
         reset();
         log( "Ending queue run" );
         return;
     }
 
-    // Yes. What?
+    // Yes. What? We queue the deliverable messages so that each
+    // destination domain gets one message in turn, so a backlog for
+    // one destination doesn't hold up the others.
 
-    if ( d->q ) {
-        while ( d->q->hasResults() ) {
-            Row * r = d->q->nextRow();
-            int64 deliverableAt = r->getBigint( "delay" );
-            if ( deliverableAt <= 0 ) {
-                DeliveryAgent * a
-                    = new DeliveryAgent( r->getInt( "message" ) );
-                (void)new Timer( a, d->agents.count() * 5 );
-                d->agents.append( a );
+    uint delay = UINT_MAX;
+    Dict< List<uint> > due;
+    EStringList domains;
+    while ( d->q->hasResults() ) {
+        Row * r = d->q->nextRow();
+        int64 deliverableAt = r->getBigint( "delay" );
+        if ( deliverableAt <= 0 ) {
+            EString domain = r->getEString( "domain" );
+            List<uint> * l = due.find( domain );
+            if ( !l ) {
+                l = new List<uint>;
+                due.insert( domain, l );
+                domains.append( domain );
             }
-            else if ( delay > deliverableAt )
-                delay = deliverableAt;
+            l->append( new uint( r->getInt( "message" ) ) );
+        }
+        else if ( delay > deliverableAt ) {
+            delay = deliverableAt;
         }
-        if ( delay < UINT_MAX ) {
-            log( "Will process the queue again in " +
-                 fn( delay ) + " seconds" );
-            d->t = new Timer( this, delay );
+    }
+
+    bool any = true;
+    while ( any ) {
+        any = false;
+        EStringList::Iterator i( domains );
+        while ( i ) {
+            List<uint> * l = due.find( *i );
+            if ( !l->isEmpty() ) {
+                d->queue.append( l->shift() );
+                any = true;
+            }
+            ++i;
         }
-        d->q = 0;
     }
 
+    if ( !d->queue.isEmpty() )
+        log( "Queued " + fn( d->queue.count() ) + " messages for delivery" );
+
+    d->q = 0;
     reset();
+
+    if ( delay < UINT_MAX && !d->t ) {
+        log( "Will process the queue again in " +
+             fn( delay ) + " seconds" );
+        d->t = new Timer( this, delay );
+    }
+
+    startAgents();
+}
+
+
+/*! Starts DeliveryAgent objects for the queued messages, until as many
+    agents are working as the delivery-concurrency configuration
+    variable allows.
+*/
+
+void SpoolManager::startAgents()
+{
+    if ( ::shutdown )
+        return;
+
+    uint max = Configuration::scalar( Configuration::DeliveryConcurrency );
+    if ( max < 1 )
+        max = 1;
+
+    while ( d->agents.count() < max && !d->queue.isEmpty() ) {
+        DeliveryAgent * a = new DeliveryAgent( *d->queue.shift(), this );
+        (void)new Timer( a, 0 );
+        d->agents.append( a );
+    }
 }
 
 
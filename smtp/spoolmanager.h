@@ -22,6 +22,7 @@ public:
 private:
     class SpoolManagerData * d;
     void reset();
+    void startAgents();
 };
 
 